@@ -0,0 +1,834 @@
+/*
+ * microbench.c
+ * Micro-benchmarks for protocol framing and codecs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "microbench"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/property_list_service.h>
+#include <libimobiledevice/debugserver.h>
+#include <libimobiledevice/syslog_relay.h>
+#include <plist/plist.h>
+
+#include "idevice.h"
+#include "afc.h"
+#include "common/socket.h"
+#include "common/thread.h"
+
+#define BENCH_AFC_MAX_CHUNK (1024 * 1024)
+#define BENCH_DEBUGSERVER_RESPONSE_SIZE 4096
+
+static uint64_t bench_total_bytes = 64 * 1024 * 1024;
+static uint32_t bench_iterations = 2000;
+
+/*
+ * Mock device.
+ *
+ * The benchmarks run the regular service clients against a peer thread that
+ * emulates the device side of each protocol on a loopback socket. The idevice
+ * handle is a network device pointing at 127.0.0.1, so every client goes
+ * through the same idevice_connect() and service_client_t code path that is
+ * used with a real device, minus usbmuxd and SSL.
+ */
+
+typedef void (*bench_peer_func_t)(int fd, void *data);
+
+struct bench_peer {
+	int listen_fd;
+	uint16_t port;
+	THREAD_T thread;
+	bench_peer_func_t func;
+	void *data;
+};
+
+static uint64_t bench_now(void)
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void bench_sleep_ms(unsigned int ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+static void bench_report(const char *name, uint64_t ops, uint64_t bytes, uint64_t elapsed)
+{
+	double seconds = (elapsed > 0) ? (double)elapsed / 1000000.0 : 0.000001;
+	printf("%-32s %10llu ops %12llu bytes %10.3f ms %10.2f MB/s %10.2f us/op\n",
+		name, (unsigned long long)ops, (unsigned long long)bytes, (double)elapsed / 1000.0,
+		(double)bytes / (1024.0 * 1024.0) / seconds,
+		(ops > 0) ? (double)elapsed / (double)ops : 0.0);
+	fflush(stdout);
+}
+
+static int peer_recv_all(int fd, void *data, uint32_t length)
+{
+	uint32_t done = 0;
+	while (done < length) {
+		int res = socket_receive_timeout(fd, (char*)data + done, length - done, 0, 5000);
+		if (res <= 0) {
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+static int peer_send_all(int fd, const void *data, uint32_t length)
+{
+	uint32_t done = 0;
+	while (done < length) {
+		int res = socket_send(fd, (char*)data + done, length - done);
+		if (res <= 0) {
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+static void* bench_peer_thread(void *arg)
+{
+	struct bench_peer *peer = (struct bench_peer*)arg;
+
+	int fd = socket_accept(peer->listen_fd, peer->port);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Mock device could not accept connection\n");
+		return NULL;
+	}
+	socket_set_nodelay(fd, 1);
+	peer->func(fd, peer->data);
+	socket_close(fd);
+
+	return NULL;
+}
+
+static int bench_peer_start(struct bench_peer *peer, bench_peer_func_t func, void *data)
+{
+	struct sockaddr_in saddr;
+	socklen_t len = sizeof(saddr);
+
+	memset(peer, '\0', sizeof(struct bench_peer));
+	peer->func = func;
+	peer->data = data;
+
+	peer->listen_fd = socket_create(0);
+	if (peer->listen_fd < 0) {
+		return -1;
+	}
+	if (getsockname(peer->listen_fd, (struct sockaddr*)&saddr, &len) < 0) {
+		socket_close(peer->listen_fd);
+		return -1;
+	}
+	peer->port = ntohs(saddr.sin_port);
+
+	if (thread_new(&peer->thread, bench_peer_thread, peer) != 0) {
+		socket_close(peer->listen_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void bench_peer_finish(struct bench_peer *peer)
+{
+	thread_join(peer->thread);
+	thread_free(peer->thread);
+	socket_close(peer->listen_fd);
+}
+
+static idevice_t bench_device_new(void)
+{
+	idevice_t device = (idevice_t)calloc(1, sizeof(struct idevice_private));
+	if (!device) {
+		return NULL;
+	}
+	device->udid = strdup("00000000-benchmark-loopback");
+	device->conn_type = CONNECTION_NETWORK;
+
+	/* BSD style sockaddr_in as reported by usbmuxd: len, family, port, address */
+	unsigned char *addr = (unsigned char*)calloc(1, 16);
+	addr[0] = 16;
+	addr[1] = 0x02;
+	addr[4] = 127;
+	addr[7] = 1;
+	device->conn_data = addr;
+
+	return device;
+}
+
+static void bench_service_init(struct lockdownd_service_descriptor *service, struct bench_peer *peer)
+{
+	service->port = peer->port;
+	service->ssl_enabled = 0;
+	service->identifier = NULL;
+}
+
+/*
+ * AFC
+ */
+
+static void afc_peer(int fd, void *data)
+{
+	AFCPacket header;
+	char *body = NULL;
+	uint32_t body_size = 0;
+	char *reply = (char*)calloc(1, sizeof(AFCPacket) + BENCH_AFC_MAX_CHUNK);
+
+	(void)data;
+
+	while (peer_recv_all(fd, &header, sizeof(AFCPacket)) == 0) {
+		AFCPacket_from_LE(&header);
+		uint32_t length = (uint32_t)(header.entire_length - sizeof(AFCPacket));
+		if (length > body_size) {
+			char *newbody = (char*)realloc(body, length);
+			if (!newbody) {
+				break;
+			}
+			body = newbody;
+			body_size = length;
+		}
+		if (length > 0 && peer_recv_all(fd, body, length) < 0) {
+			break;
+		}
+
+		AFCPacket *out = (AFCPacket*)reply;
+		uint64_t operation = AFC_OP_STATUS;
+		uint64_t reply_length = sizeof(uint64_t);
+		uint64_t value = 0;
+
+		switch (header.operation) {
+		case AFC_OP_FILE_OPEN:
+			operation = AFC_OP_FILE_OPEN_RES;
+			value = 1;
+			break;
+		case AFC_OP_FILE_READ:
+			operation = AFC_OP_DATA;
+			reply_length = (length >= 16) ? le64toh(((uint64_t*)body)[1]) : 0;
+			if (reply_length > BENCH_AFC_MAX_CHUNK) {
+				reply_length = BENCH_AFC_MAX_CHUNK;
+			}
+			break;
+		default:
+			break;
+		}
+
+		memcpy(out->magic, AFC_MAGIC, AFC_MAGIC_LEN);
+		out->entire_length = sizeof(AFCPacket) + reply_length;
+		out->this_length = (operation == AFC_OP_DATA) ? sizeof(AFCPacket) : out->entire_length;
+		out->packet_num = header.packet_num;
+		out->operation = operation;
+		AFCPacket_to_LE(out);
+		if (operation != AFC_OP_DATA) {
+			*(uint64_t*)(reply + sizeof(AFCPacket)) = htole64(value);
+		}
+		if (peer_send_all(fd, reply, sizeof(AFCPacket) + (uint32_t)reply_length) < 0) {
+			break;
+		}
+	}
+
+	free(body);
+	free(reply);
+}
+
+static void bench_afc(idevice_t device, int write)
+{
+	static const uint32_t chunk_sizes[] = { 4096, 65536, 262144, 1048576 };
+	unsigned int i;
+	char *buffer = (char*)calloc(1, BENCH_AFC_MAX_CHUNK);
+
+	for (i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+		struct bench_peer peer;
+		struct lockdownd_service_descriptor service;
+		afc_client_t afc = NULL;
+		uint64_t handle = 0;
+		uint64_t done = 0;
+		uint64_t ops = 0;
+		char name[64];
+
+		if (bench_peer_start(&peer, afc_peer, NULL) < 0) {
+			fprintf(stderr, "ERROR: Could not start mock AFC service\n");
+			break;
+		}
+		bench_service_init(&service, &peer);
+		if (afc_client_new(device, &service, &afc) != AFC_E_SUCCESS
+		    || afc_file_open(afc, "/bench", (write) ? AFC_FOPEN_WRONLY : AFC_FOPEN_RDONLY, &handle) != AFC_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not connect to mock AFC service\n");
+			afc_client_free(afc);
+			bench_peer_finish(&peer);
+			break;
+		}
+
+		uint64_t start = bench_now();
+		while (done < bench_total_bytes) {
+			uint32_t bytes = 0;
+			afc_error_t err = (write)
+				? afc_file_write(afc, handle, buffer, chunk_sizes[i], &bytes)
+				: afc_file_read(afc, handle, buffer, chunk_sizes[i], &bytes);
+			if (err != AFC_E_SUCCESS || bytes == 0) {
+				fprintf(stderr, "ERROR: AFC %s failed: %d\n", (write) ? "write" : "read", err);
+				break;
+			}
+			done += bytes;
+			ops++;
+		}
+		afc_file_close(afc, handle);
+		uint64_t elapsed = bench_now() - start;
+
+		snprintf(name, sizeof(name), "afc_%s_%uk", (write) ? "write" : "read", chunk_sizes[i] / 1024);
+		bench_report(name, ops, done, elapsed);
+
+		afc_client_free(afc);
+		bench_peer_finish(&peer);
+	}
+
+	free(buffer);
+}
+
+/*
+ * Property list framing
+ */
+
+static void plist_peer(int fd, void *data)
+{
+	char *buffer = NULL;
+	uint32_t buffer_size = 0;
+
+	(void)data;
+
+	while (1) {
+		uint32_t length = 0;
+		if (peer_recv_all(fd, &length, sizeof(uint32_t)) < 0) {
+			break;
+		}
+		length = be32toh(length);
+		if (length + sizeof(uint32_t) > buffer_size) {
+			char *newbuffer = (char*)realloc(buffer, length + sizeof(uint32_t));
+			if (!newbuffer) {
+				break;
+			}
+			buffer = newbuffer;
+			buffer_size = length + sizeof(uint32_t);
+		}
+		*(uint32_t*)buffer = htobe32(length);
+		if (peer_recv_all(fd, buffer + sizeof(uint32_t), length) < 0
+		    || peer_send_all(fd, buffer, length + sizeof(uint32_t)) < 0) {
+			break;
+		}
+	}
+
+	free(buffer);
+}
+
+static plist_t bench_plist_payload(uint32_t entries)
+{
+	plist_t dict = plist_new_dict();
+	char key[32];
+	char blob[256];
+	uint32_t i;
+
+	memset(blob, 0xA5, sizeof(blob));
+	plist_dict_set_item(dict, "Command", plist_new_string("Benchmark"));
+	plist_t array = plist_new_array();
+	for (i = 0; i < entries; i++) {
+		plist_t item = plist_new_dict();
+		snprintf(key, sizeof(key), "com.example.item%u", i);
+		plist_dict_set_item(item, "CFBundleIdentifier", plist_new_string(key));
+		plist_dict_set_item(item, "Size", plist_new_uint(i * 4096));
+		plist_dict_set_item(item, "Enabled", plist_new_bool(i & 1));
+		plist_dict_set_item(item, "Data", plist_new_data(blob, sizeof(blob)));
+		plist_array_append_item(array, item);
+	}
+	plist_dict_set_item(dict, "Items", array);
+
+	return dict;
+}
+
+static void bench_plist(idevice_t device, int binary)
+{
+	static const uint32_t payload_entries[] = { 1, 64, 1024 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(payload_entries) / sizeof(payload_entries[0]); i++) {
+		struct bench_peer peer;
+		struct lockdownd_service_descriptor service;
+		property_list_service_client_t client = NULL;
+		plist_t payload = bench_plist_payload(payload_entries[i]);
+		char *bin = NULL;
+		uint32_t size = 0;
+		uint32_t iterations = bench_iterations / payload_entries[i];
+		uint32_t n;
+		char name[64];
+
+		if (iterations < 20) {
+			iterations = 20;
+		}
+		if (binary) {
+			plist_to_bin(payload, &bin, &size);
+		} else {
+			plist_to_xml(payload, &bin, &size);
+		}
+		free(bin);
+
+		if (bench_peer_start(&peer, plist_peer, NULL) < 0) {
+			fprintf(stderr, "ERROR: Could not start mock plist service\n");
+			plist_free(payload);
+			break;
+		}
+		bench_service_init(&service, &peer);
+		if (property_list_service_client_new(device, &service, &client) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not connect to mock plist service\n");
+			plist_free(payload);
+			bench_peer_finish(&peer);
+			break;
+		}
+
+		uint64_t start = bench_now();
+		for (n = 0; n < iterations; n++) {
+			plist_t reply = NULL;
+			property_list_service_error_t err = (binary)
+				? property_list_service_send_binary_plist(client, payload)
+				: property_list_service_send_xml_plist(client, payload);
+			if (err == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+				err = property_list_service_receive_plist_with_timeout(client, &reply, 5000);
+			}
+			if (err != PROPERTY_LIST_SERVICE_E_SUCCESS || !reply) {
+				fprintf(stderr, "ERROR: plist round trip failed: %d\n", err);
+				break;
+			}
+			plist_free(reply);
+		}
+		uint64_t elapsed = bench_now() - start;
+
+		snprintf(name, sizeof(name), "plist_%s_%u", (binary) ? "binary" : "xml", payload_entries[i]);
+		bench_report(name, n, (uint64_t)n * size * 2, elapsed);
+
+		property_list_service_client_free(client);
+		plist_free(payload);
+		bench_peer_finish(&peer);
+	}
+}
+
+/*
+ * debugserver
+ */
+
+static void debugserver_peer(int fd, void *data)
+{
+	const char *response = (const char*)data;
+	uint32_t response_length = strlen(response);
+	char buffer[4096];
+	int in_packet = 0;
+	int trailer = 0;
+
+	while (1) {
+		int res = socket_receive_timeout(fd, buffer, sizeof(buffer), 0, 5000);
+		int i;
+		if (res <= 0) {
+			break;
+		}
+		/* answer every complete "$...#xx" packet, skip acks */
+		for (i = 0; i < res; i++) {
+			if (trailer > 0) {
+				if (--trailer == 0) {
+					if (peer_send_all(fd, response, response_length) < 0) {
+						return;
+					}
+				}
+			} else if (in_packet) {
+				if (buffer[i] == '#') {
+					in_packet = 0;
+					trailer = 2;
+				}
+			} else if (buffer[i] == '$') {
+				in_packet = 1;
+			}
+		}
+	}
+}
+
+static char* bench_debugserver_response(uint32_t length)
+{
+	static const char hexchars[] = "0123456789abcdef";
+	char *response = (char*)malloc(length + 6);
+	uint32_t checksum = 0;
+	uint32_t i;
+
+	response[0] = '+';
+	response[1] = '$';
+	for (i = 0; i < length; i++) {
+		response[2 + i] = hexchars[(i * 7) & 0xf];
+		checksum += (unsigned char)response[2 + i];
+	}
+	response[2 + length] = '#';
+	response[3 + length] = hexchars[(checksum >> 4) & 0xf];
+	response[4 + length] = hexchars[checksum & 0xf];
+	response[5 + length] = '\0';
+
+	return response;
+}
+
+static void bench_debugserver_codec(void)
+{
+	static const uint32_t sizes[] = { 64, 4096, 65536 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		char *buffer = (char*)malloc(sizes[i] + 1);
+		uint32_t j;
+		uint64_t bytes = 0;
+		uint64_t ops = 0;
+		char name[64];
+
+		for (j = 0; j < sizes[i]; j++) {
+			buffer[j] = 'A' + (j % 26);
+		}
+		buffer[sizes[i]] = '\0';
+
+		uint64_t start = bench_now();
+		while (bytes < bench_total_bytes / 4) {
+			char *encoded = NULL;
+			char *decoded = NULL;
+			uint32_t encoded_length = 0;
+			debugserver_encode_string(buffer, &encoded, &encoded_length);
+			debugserver_decode_string(encoded, encoded_length, &decoded);
+			free(encoded);
+			free(decoded);
+			bytes += sizes[i];
+			ops++;
+		}
+		uint64_t elapsed = bench_now() - start;
+
+		snprintf(name, sizeof(name), "debugserver_hex_%u", sizes[i]);
+		bench_report(name, ops, bytes, elapsed);
+
+		free(buffer);
+	}
+}
+
+static void bench_debugserver(idevice_t device)
+{
+	struct bench_peer peer;
+	struct lockdownd_service_descriptor service;
+	debugserver_client_t client = NULL;
+	debugserver_command_t command = NULL;
+	char *response = bench_debugserver_response(BENCH_DEBUGSERVER_RESPONSE_SIZE);
+	char argument[] = "benchmark-argument";
+	char *argv[] = { argument };
+	uint32_t n;
+
+	bench_debugserver_codec();
+
+	if (bench_peer_start(&peer, debugserver_peer, response) < 0) {
+		fprintf(stderr, "ERROR: Could not start mock debugserver service\n");
+		free(response);
+		return;
+	}
+	bench_service_init(&service, &peer);
+	if (debugserver_client_new(device, &service, &client) != DEBUGSERVER_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to mock debugserver service\n");
+		bench_peer_finish(&peer);
+		free(response);
+		return;
+	}
+	debugserver_command_new("QBenchmark:", 1, argv, &command);
+
+	uint64_t start = bench_now();
+	for (n = 0; n < bench_iterations; n++) {
+		char *reply = NULL;
+		size_t reply_size = 0;
+		if (debugserver_client_send_command(client, command, &reply, &reply_size) != DEBUGSERVER_E_SUCCESS || !reply) {
+			fprintf(stderr, "ERROR: debugserver round trip failed\n");
+			break;
+		}
+		free(reply);
+	}
+	uint64_t elapsed = bench_now() - start;
+	bench_report("debugserver_command", n, (uint64_t)n * BENCH_DEBUGSERVER_RESPONSE_SIZE, elapsed);
+
+	debugserver_command_free(command);
+	debugserver_client_free(client);
+	bench_peer_finish(&peer);
+	free(response);
+}
+
+/*
+ * syslog_relay
+ */
+
+struct syslog_bench {
+	uint32_t lines;
+	volatile uint32_t received;
+	uint64_t bytes;
+};
+
+static void syslog_peer(int fd, void *data)
+{
+	struct syslog_bench *bench = (struct syslog_bench*)data;
+	char block[65536];
+	uint32_t block_length = 0;
+	uint32_t block_lines = 0;
+	uint32_t sent = 0;
+	char dummy;
+
+	/* fill a block with NUL terminated lines the way the device sends them */
+	while (1) {
+		char line[256];
+		int len = snprintf(line, sizeof(line), "Oct 14 12:34:56 iPhone backboardd(CoreBrightness)[%u] <Notice>: Benchmark message number %u with some payload\n", 60 + block_lines, block_lines);
+		if (block_length + len + 1 > sizeof(block)) {
+			break;
+		}
+		memcpy(block + block_length, line, len + 1);
+		block_length += len + 1;
+		block_lines++;
+	}
+
+	while (sent < bench->lines) {
+		uint32_t count = block_lines;
+		uint32_t length = block_length;
+		if (bench->lines - sent < count) {
+			/* send only the remaining lines of the block */
+			uint32_t i;
+			count = bench->lines - sent;
+			length = 0;
+			for (i = 0; i < count; i++) {
+				length += strlen(block + length) + 1;
+			}
+		}
+		if (peer_send_all(fd, block, length) < 0) {
+			return;
+		}
+		bench->bytes += length;
+		sent += count;
+	}
+
+	/* keep the connection open until the client goes away */
+	while (socket_receive_timeout(fd, &dummy, 1, 0, 5000) > 0);
+}
+
+static void syslog_line_cb(const syslog_relay_line_t *line, void *user_data)
+{
+	struct syslog_bench *bench = (struct syslog_bench*)user_data;
+	(void)line;
+	bench->received++;
+}
+
+static void bench_syslog(idevice_t device)
+{
+	struct bench_peer peer;
+	struct lockdownd_service_descriptor service;
+	syslog_relay_client_t client = NULL;
+	struct syslog_bench bench;
+	uint64_t deadline;
+
+	memset(&bench, '\0', sizeof(bench));
+	bench.lines = bench_iterations * 100;
+
+	if (bench_peer_start(&peer, syslog_peer, &bench) < 0) {
+		fprintf(stderr, "ERROR: Could not start mock syslog_relay service\n");
+		return;
+	}
+	bench_service_init(&service, &peer);
+	if (syslog_relay_client_new(device, &service, &client) != SYSLOG_RELAY_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to mock syslog_relay service\n");
+		bench_peer_finish(&peer);
+		return;
+	}
+
+	uint64_t start = bench_now();
+	if (syslog_relay_start_capture_lines(client, syslog_line_cb, &bench) != SYSLOG_RELAY_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not start syslog capture\n");
+	} else {
+		deadline = start + 30000000;
+		while (bench.received < bench.lines && bench_now() < deadline) {
+			bench_sleep_ms(1);
+		}
+	}
+	uint64_t elapsed = bench_now() - start;
+	syslog_relay_stop_capture(client);
+	if (bench.received < bench.lines) {
+		fprintf(stderr, "ERROR: syslog capture received %u of %u lines\n", bench.received, bench.lines);
+	}
+	bench_report("syslog_lines", bench.received, bench.bytes, elapsed);
+
+	syslog_relay_client_free(client);
+	bench_peer_finish(&peer);
+}
+
+static void print_usage(int argc, char **argv, int is_error)
+{
+	char *name = strrchr(argv[0], '/');
+	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS] [BENCHMARK ...]\n", (name ? name + 1: argv[0]));
+	fprintf(is_error ? stderr : stdout,
+		"\n"
+		"Run micro-benchmarks of the protocol framing and codecs against a mock\n"
+		"device on a loopback connection. No device is required.\n"
+		"\n"
+		"BENCHMARKS:\n"
+		"  afc           AFC file read and write at various chunk sizes\n"
+		"  plist         property list send and receive, binary and XML\n"
+		"  debugserver   debugserver hex codec, checksum and command round trip\n"
+		"  syslog        syslog_relay line capture path\n"
+		"\n"
+		"All benchmarks are run if none is given.\n"
+		"\n"
+		"OPTIONS:\n"
+		"  -s, --size MB         amount of data to transfer per AFC run (default 64)\n"
+		"  -n, --iterations N    number of round trips per run (default 2000)\n"
+		"  -d, --debug           enable communication debugging\n"
+		"  -h, --help            prints usage information\n"
+		"  -v, --version         prints version information\n"
+		"\n"
+		"Homepage:    <" PACKAGE_URL ">\n"
+		"Bug Reports: <" PACKAGE_BUGREPORT ">\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	int c = 0;
+	int i;
+	int run_afc = 0;
+	int run_plist = 0;
+	int run_debugserver = 0;
+	int run_syslog = 0;
+	const struct option longopts[] = {
+		{ "size", required_argument, NULL, 's' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "debug", no_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "version", no_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "s:n:dhv", longopts, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			bench_total_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			if (bench_total_bytes == 0) {
+				fprintf(stderr, "ERROR: Invalid size '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'n':
+			bench_iterations = (uint32_t)strtoul(optarg, NULL, 10);
+			if (bench_iterations == 0) {
+				fprintf(stderr, "ERROR: Invalid number of iterations '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'h':
+			print_usage(argc, argv, 0);
+			return 0;
+		case 'v':
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		default:
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], "afc")) {
+			run_afc = 1;
+		} else if (!strcmp(argv[i], "plist")) {
+			run_plist = 1;
+		} else if (!strcmp(argv[i], "debugserver")) {
+			run_debugserver = 1;
+		} else if (!strcmp(argv[i], "syslog")) {
+			run_syslog = 1;
+		} else {
+			fprintf(stderr, "ERROR: Unknown benchmark '%s'\n", argv[i]);
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+	if (!run_afc && !run_plist && !run_debugserver && !run_syslog) {
+		run_afc = run_plist = run_debugserver = run_syslog = 1;
+	}
+
+	idevice_t device = bench_device_new();
+	if (!device) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return 1;
+	}
+
+	if (run_afc) {
+		bench_afc(device, 1);
+		bench_afc(device, 0);
+	}
+	if (run_plist) {
+		bench_plist(device, 1);
+		bench_plist(device, 0);
+	}
+	if (run_debugserver) {
+		bench_debugserver(device);
+	}
+	if (run_syslog) {
+		bench_syslog(device);
+	}
+
+	idevice_free(device);
+
+	return 0;
+}
@@ -39,11 +39,11 @@
 #include "asprintf.h"
 #endif
 
-static int debug_level;
+int internal_debug_level = 0;
 
 void internal_set_debug_level(int level)
 {
-	debug_level = level;
+	internal_debug_level = level;
 }
 
 #define MAX_PRINT_LEN 16*1024
@@ -51,27 +51,20 @@ void internal_set_debug_level(int level)
 #ifndef STRIP_DEBUG_CODE
 static void debug_print_line(const char *func, const char *file, int line, const char *buffer)
 {
-	char *str_time = NULL;
-	char *header = NULL;
+	char str_time[16];
 	time_t the_time;
+	struct tm tm_time;
 
 	time(&the_time);
-	str_time = (char*)malloc(255);
-	strftime(str_time, 254, "%H:%M:%S", localtime (&the_time));
-
-	/* generate header text */
-	(void)asprintf(&header, "%s %s:%d %s()", str_time, file, line, func);
-	free (str_time);
-
-	/* trim ending newlines */
-
-	/* print header */
-	fprintf(stderr, "%s: ", header);
-
-	/* print actual debug content */
-	fprintf(stderr, "%s\n", buffer);
+#ifdef WIN32
+	localtime_s(&tm_time, &the_time);
+#else
+	localtime_r(&the_time, &tm_time);
+#endif
+	strftime(str_time, sizeof(str_time), "%H:%M:%S", &tm_time);
 
-	free (header);
+	/* print header and actual debug content in one go */
+	fprintf(stderr, "%s %s:%d %s(): %s\n", str_time, file, line, func, buffer);
 }
 #endif
 
@@ -79,30 +72,45 @@ void debug_info_real(const char *func, const char *file, int line, const char *f
 {
 #ifndef STRIP_DEBUG_CODE
 	va_list args;
-	char *buffer = NULL;
+	char stack_buffer[512];
+	char *buffer = stack_buffer;
+	int len;
 
-	if (!debug_level)
+	if (!internal_debug_level)
 		return;
 
-	/* run the real fprintf */
+	/* format into a stack buffer, only allocate for long messages */
 	va_start(args, format);
-	(void)vasprintf(&buffer, format, args);
+	len = vsnprintf(stack_buffer, sizeof(stack_buffer), format, args);
 	va_end(args);
+	if (len < 0) {
+		return;
+	}
+	if ((size_t)len >= sizeof(stack_buffer)) {
+		buffer = NULL;
+		va_start(args, format);
+		(void)vasprintf(&buffer, format, args);
+		va_end(args);
+		if (!buffer) {
+			return;
+		}
+	}
 
 	debug_print_line(func, file, line, buffer);
 
-	free(buffer);
+	if (buffer != stack_buffer)
+		free(buffer);
 #endif
 }
 
+#ifndef STRIP_DEBUG_CODE
 void debug_buffer(const char *data, const int length)
 {
-#ifndef STRIP_DEBUG_CODE
 	int i;
 	int j;
 	unsigned char c;
 
-	if (debug_level) {
+	if (internal_debug_level) {
 		for (i = 0; i < length; i += 16) {
 			fprintf(stderr, "%04x: ", i);
 			for (j = 0; j < 16; j++) {
@@ -127,20 +135,18 @@ void debug_buffer(const char *data, const int length)
 		}
 		fprintf(stderr, "\n");
 	}
-#endif
 }
 
 void debug_buffer_to_file(const char *file, const char *data, const int length)
 {
-#ifndef STRIP_DEBUG_CODE
-	if (debug_level) {
+	if (internal_debug_level) {
 		FILE *f = fopen(file, "wb");
 		fwrite(data, 1, length, f);
 		fflush(f);
 		fclose(f);
 	}
-#endif
 }
+#endif
 
 void debug_plist_real(const char *func, const char *file, int line, plist_t plist)
 {
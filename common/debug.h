@@ -25,15 +25,23 @@
 
 #include <plist/plist.h>
 
+/* checked inline by the macros below so disabled debug output does not
+ * evaluate the arguments or call into debug.c */
+extern int internal_debug_level;
+
+#define debug_enabled() (internal_debug_level != 0)
+
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L && !defined(STRIP_DEBUG_CODE)
-#define debug_info(...) debug_info_real (__func__, __FILE__, __LINE__, __VA_ARGS__)
-#define debug_plist(a) debug_plist_real (__func__, __FILE__, __LINE__, a)
+#define debug_info(...) do { if (internal_debug_level) debug_info_real (__func__, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define debug_plist(a) do { if (internal_debug_level) debug_plist_real (__func__, __FILE__, __LINE__, a); } while (0)
 #elif defined(__GNUC__) && __GNUC__ >= 3 && !defined(STRIP_DEBUG_CODE)
-#define debug_info(...) debug_info_real (__FUNCTION__, __FILE__, __LINE__, __VA_ARGS__)
-#define debug_plist(a) debug_plist_real (__FUNCTION__, __FILE__, __LINE__, a)
+#define debug_info(...) do { if (internal_debug_level) debug_info_real (__FUNCTION__, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define debug_plist(a) do { if (internal_debug_level) debug_plist_real (__FUNCTION__, __FILE__, __LINE__, a); } while (0)
 #else
 #define debug_info(...)
 #define debug_plist(a)
+#undef debug_enabled
+#define debug_enabled() 0
 #endif
 
 void debug_info_real(const char *func,
@@ -41,8 +49,13 @@ void debug_info_real(const char *func,
 											int	line,
 											const char *format, ...);
 
+#ifndef STRIP_DEBUG_CODE
 void debug_buffer(const char *data, const int length);
 void debug_buffer_to_file(const char *file, const char *data, const int length);
+#else
+#define debug_buffer(data, length) do { } while (0)
+#define debug_buffer_to_file(file, data, length) do { } while (0)
+#endif
 void debug_plist_real(const char *func,
 											const char *file,
 											int	line,
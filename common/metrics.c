@@ -0,0 +1,606 @@
+/*
+ * metrics.c
+ * Library-wide counters for monitoring
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "metrics.h"
+#include "socket.h"
+#include "thread.h"
+
+/* upper bounds of the latency histogram buckets in microseconds */
+static const uint64_t metrics_latency_bounds[METRICS_LATENCY_BUCKETS] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+
+/* indexed by AFC operation code, keep in sync with the enum in src/afc.h */
+static const char *metrics_afc_operation_names[METRICS_AFC_NUM_OPS + 1] = {
+	"invalid", "status", "data", "read_dir", "read_file", "write_file",
+	"write_part", "truncate", "remove_path", "make_dir", "get_file_info",
+	"get_devinfo", "write_file_atom", "file_open", "file_open_res",
+	"file_read", "file_write", "file_seek", "file_tell", "file_tell_res",
+	"file_close", "file_set_size", "get_con_info", "set_con_options",
+	"rename_path", "set_fs_bs", "set_socket_bs", "file_lock", "make_link",
+	"get_file_hash", "set_file_mod_time", "get_file_hash_range",
+	"file_set_immutable_hint", "get_size_of_path_contents",
+	"remove_path_and_contents", "dir_open", "dir_open_result", "dir_read",
+	"dir_close", "file_read_offset", "file_write_offset", "other"
+};
+
+struct metrics_afc internal_metrics_afc;
+
+static struct metrics_device *metrics_devices = NULL;
+static struct metrics_service *metrics_services = NULL;
+static mutex_t metrics_mutex;
+static mutex_t metrics_http_mutex;
+static thread_once_t metrics_once = THREAD_ONCE_INIT;
+
+static void metrics_init(void)
+{
+	mutex_init(&metrics_mutex);
+	mutex_init(&metrics_http_mutex);
+}
+
+struct metrics_device *metrics_device_get(const char *udid)
+{
+	struct metrics_device *entry;
+
+	if (!udid) {
+		return NULL;
+	}
+
+	thread_once(&metrics_once, metrics_init);
+	mutex_lock(&metrics_mutex);
+	for (entry = metrics_devices; entry; entry = entry->next) {
+		if (!strcmp(entry->udid, udid)) {
+			break;
+		}
+	}
+	if (!entry) {
+		entry = (struct metrics_device*)calloc(1, sizeof(struct metrics_device));
+		if (entry) {
+			entry->udid = strdup(udid);
+			if (entry->udid) {
+				entry->next = metrics_devices;
+				metrics_devices = entry;
+			} else {
+				free(entry);
+				entry = NULL;
+			}
+		}
+	}
+	mutex_unlock(&metrics_mutex);
+
+	return entry;
+}
+
+struct metrics_service *metrics_service_get(const char *name)
+{
+	struct metrics_service *entry;
+
+	if (!name) {
+		name = "unknown";
+	}
+
+	thread_once(&metrics_once, metrics_init);
+	mutex_lock(&metrics_mutex);
+	for (entry = metrics_services; entry; entry = entry->next) {
+		if (!strcmp(entry->name, name)) {
+			break;
+		}
+	}
+	if (!entry) {
+		entry = (struct metrics_service*)calloc(1, sizeof(struct metrics_service));
+		if (entry) {
+			entry->name = strdup(name);
+			if (entry->name) {
+				entry->next = metrics_services;
+				metrics_services = entry;
+			} else {
+				free(entry);
+				entry = NULL;
+			}
+		}
+	}
+	mutex_unlock(&metrics_mutex);
+
+	return entry;
+}
+
+void metrics_histogram_observe(struct metrics_histogram *histogram, uint64_t value_us)
+{
+	unsigned int i = 0;
+	while (i < METRICS_LATENCY_BUCKETS && value_us > metrics_latency_bounds[i]) {
+		i++;
+	}
+	metrics_add(&histogram->buckets[i], 1);
+	metrics_add(&histogram->sum_us, value_us);
+}
+
+void metrics_afc_operation(uint64_t operation)
+{
+	if (operation > METRICS_AFC_NUM_OPS) {
+		operation = METRICS_AFC_NUM_OPS;
+	}
+	metrics_add(&internal_metrics_afc.operations[operation], 1);
+}
+
+static void metrics_dict_set_uint(plist_t dict, const char *key, uint64_t value)
+{
+	plist_dict_set_item(dict, key, plist_new_uint(value));
+}
+
+#define metrics_read(ptr) __sync_fetch_and_add(ptr, 0)
+
+plist_t internal_metrics_snapshot(void)
+{
+	struct metrics_device *device;
+	struct metrics_service *service;
+	unsigned int i;
+
+	plist_t metrics = plist_new_dict();
+
+	plist_t bounds = plist_new_array();
+	for (i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+		plist_array_append_item(bounds, plist_new_uint(metrics_latency_bounds[i]));
+	}
+	plist_dict_set_item(metrics, "LatencyBucketBounds", bounds);
+
+	thread_once(&metrics_once, metrics_init);
+	mutex_lock(&metrics_mutex);
+	device = metrics_devices;
+	service = metrics_services;
+	mutex_unlock(&metrics_mutex);
+
+	/* entries are only ever prepended, the rest of the lists is stable */
+	plist_t devices = plist_new_dict();
+	for (; device; device = device->next) {
+		plist_t dict = plist_new_dict();
+		metrics_dict_set_uint(dict, "BytesSent", metrics_read(&device->traffic.bytes_sent));
+		metrics_dict_set_uint(dict, "BytesReceived", metrics_read(&device->traffic.bytes_received));
+		metrics_dict_set_uint(dict, "SendSyscalls", metrics_read(&device->traffic.send_syscalls));
+		metrics_dict_set_uint(dict, "RecvSyscalls", metrics_read(&device->traffic.recv_syscalls));
+		metrics_dict_set_uint(dict, "TLSRecordsSent", metrics_read(&device->traffic.tls_records_sent));
+		metrics_dict_set_uint(dict, "TLSRecordsReceived", metrics_read(&device->traffic.tls_records_received));
+		metrics_dict_set_uint(dict, "SendBlockedMicroseconds", metrics_read(&device->traffic.send_blocked_us));
+		metrics_dict_set_uint(dict, "RecvBlockedMicroseconds", metrics_read(&device->traffic.recv_blocked_us));
+		metrics_dict_set_uint(dict, "CryptoBytesSaved", metrics_read(&device->traffic.crypto_bytes_saved));
+		metrics_dict_set_uint(dict, "Connections", metrics_read(&device->connections));
+		metrics_dict_set_uint(dict, "Handshakes", metrics_read(&device->handshakes));
+		metrics_dict_set_uint(dict, "HandshakesFailed", metrics_read(&device->handshakes_failed));
+		metrics_dict_set_uint(dict, "HandshakesResumed", metrics_read(&device->handshakes_resumed));
+		plist_t buckets = plist_new_array();
+		for (i = 0; i <= METRICS_LATENCY_BUCKETS; i++) {
+			plist_array_append_item(buckets, plist_new_uint(metrics_read(&device->handshake_latency.buckets[i])));
+		}
+		plist_dict_set_item(dict, "HandshakeLatencyBuckets", buckets);
+		metrics_dict_set_uint(dict, "HandshakeLatencyMicroseconds", metrics_read(&device->handshake_latency.sum_us));
+		plist_dict_set_item(devices, device->udid, dict);
+	}
+	plist_dict_set_item(metrics, "Devices", devices);
+
+	plist_t services = plist_new_dict();
+	for (; service; service = service->next) {
+		plist_t dict = plist_new_dict();
+		metrics_dict_set_uint(dict, "MessagesSent", metrics_read(&service->messages_sent));
+		metrics_dict_set_uint(dict, "MessagesReceived", metrics_read(&service->messages_received));
+		metrics_dict_set_uint(dict, "BytesSent", metrics_read(&service->bytes_sent));
+		metrics_dict_set_uint(dict, "BytesReceived", metrics_read(&service->bytes_received));
+		metrics_dict_set_uint(dict, "Errors", metrics_read(&service->errors));
+		plist_dict_set_item(services, service->name, dict);
+	}
+	plist_dict_set_item(metrics, "Services", services);
+
+	plist_t afc = plist_new_dict();
+	plist_t operations = plist_new_dict();
+	for (i = 0; i <= METRICS_AFC_NUM_OPS; i++) {
+		uint64_t count = metrics_read(&internal_metrics_afc.operations[i]);
+		if (count > 0) {
+			metrics_dict_set_uint(operations, metrics_afc_operation_names[i], count);
+		}
+	}
+	plist_dict_set_item(afc, "Operations", operations);
+	metrics_dict_set_uint(afc, "Errors", metrics_read(&internal_metrics_afc.errors));
+	metrics_dict_set_uint(afc, "PoolAcquired", metrics_read(&internal_metrics_afc.pool_acquired));
+	metrics_dict_set_uint(afc, "PoolWaiting", metrics_read(&internal_metrics_afc.pool_waiting));
+	plist_dict_set_item(metrics, "AFC", afc);
+
+	unsigned int queued = 0, threads = 0, idle = 0;
+	threadpool_get_stats(threadpool_get_shared(), &queued, &threads, &idle);
+	plist_t pool = plist_new_dict();
+	metrics_dict_set_uint(pool, "QueueDepth", queued);
+	metrics_dict_set_uint(pool, "Threads", threads);
+	metrics_dict_set_uint(pool, "IdleThreads", idle);
+	plist_dict_set_item(metrics, "ThreadPool", pool);
+
+	return metrics;
+}
+
+struct metrics_text {
+	char *data;
+	uint32_t length;
+	uint32_t capacity;
+	int failed;
+};
+
+static void metrics_printf(struct metrics_text *text, const char *format, ...)
+{
+	va_list args;
+	int len;
+
+	if (text->failed) {
+		return;
+	}
+	while (1) {
+		va_start(args, format);
+		len = vsnprintf(text->data + text->length, text->capacity - text->length, format, args);
+		va_end(args);
+		if (len < 0) {
+			text->failed = 1;
+			return;
+		}
+		if ((uint32_t)len < text->capacity - text->length) {
+			text->length += len;
+			return;
+		}
+		uint32_t capacity = text->capacity * 2;
+		while (capacity - text->length <= (uint32_t)len) {
+			capacity *= 2;
+		}
+		char *data = (char*)realloc(text->data, capacity);
+		if (!data) {
+			text->failed = 1;
+			return;
+		}
+		text->data = data;
+		text->capacity = capacity;
+	}
+}
+
+/* prints a label value with OpenMetrics escaping */
+static void metrics_print_label(struct metrics_text *text, const char *value)
+{
+	const char *p;
+	for (p = value; *p; p++) {
+		switch (*p) {
+		case '\\':
+			metrics_printf(text, "\\\\");
+			break;
+		case '"':
+			metrics_printf(text, "\\\"");
+			break;
+		case '\n':
+			metrics_printf(text, "\\n");
+			break;
+		default:
+			metrics_printf(text, "%c", *p);
+			break;
+		}
+	}
+}
+
+static uint64_t metrics_dict_get_uint(plist_t dict, const char *key)
+{
+	uint64_t value = 0;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &value);
+	}
+	return value;
+}
+
+static void metrics_print_family(struct metrics_text *text, const char *name, const char *type, const char *help)
+{
+	metrics_printf(text, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+/* prints one sample per entry of a dict of dicts, labelled with the key */
+static void metrics_print_dict_samples(struct metrics_text *text, plist_t entries, const char *name, const char *suffix, const char *label, const char *key, const char *extra_labels, uint64_t divisor)
+{
+	plist_dict_iter iter = NULL;
+	char *entry_key = NULL;
+	plist_t entry = NULL;
+
+	plist_dict_new_iter(entries, &iter);
+	if (!iter) {
+		return;
+	}
+	do {
+		entry_key = NULL;
+		entry = NULL;
+		plist_dict_next_item(entries, iter, &entry_key, &entry);
+		if (entry_key && entry) {
+			uint64_t value = metrics_dict_get_uint(entry, key);
+			metrics_printf(text, "%s%s{%s=\"", name, suffix, label);
+			metrics_print_label(text, entry_key);
+			metrics_printf(text, "\"%s} ", (extra_labels) ? extra_labels : "");
+			if (divisor > 1) {
+				metrics_printf(text, "%" PRIu64 ".%06" PRIu64 "\n", value / divisor, value % divisor);
+			} else {
+				metrics_printf(text, "%" PRIu64 "\n", value);
+			}
+		}
+		free(entry_key);
+	} while (entry);
+	free(iter);
+}
+
+static void metrics_print_histograms(struct metrics_text *text, plist_t devices, plist_t bounds, const char *name)
+{
+	plist_dict_iter iter = NULL;
+	char *udid = NULL;
+	plist_t device = NULL;
+	uint32_t i;
+
+	plist_dict_new_iter(devices, &iter);
+	if (!iter) {
+		return;
+	}
+	do {
+		udid = NULL;
+		device = NULL;
+		plist_dict_next_item(devices, iter, &udid, &device);
+		if (udid && device) {
+			plist_t buckets = plist_dict_get_item(device, "HandshakeLatencyBuckets");
+			uint32_t count = (buckets) ? plist_array_get_size(buckets) : 0;
+			uint64_t total = 0;
+			for (i = 0; i < count; i++) {
+				uint64_t value = 0;
+				plist_get_uint_val(plist_array_get_item(buckets, i), &value);
+				total += value;
+				metrics_printf(text, "%s_bucket{udid=\"", name);
+				metrics_print_label(text, udid);
+				if (i < plist_array_get_size(bounds)) {
+					uint64_t bound = 0;
+					plist_get_uint_val(plist_array_get_item(bounds, i), &bound);
+					metrics_printf(text, "\",le=\"%" PRIu64 ".%06" PRIu64 "\"} %" PRIu64 "\n", bound / 1000000, bound % 1000000, total);
+				} else {
+					metrics_printf(text, "\",le=\"+Inf\"} %" PRIu64 "\n", total);
+				}
+			}
+			uint64_t sum = metrics_dict_get_uint(device, "HandshakeLatencyMicroseconds");
+			metrics_printf(text, "%s_sum{udid=\"", name);
+			metrics_print_label(text, udid);
+			metrics_printf(text, "\"} %" PRIu64 ".%06" PRIu64 "\n", sum / 1000000, sum % 1000000);
+			metrics_printf(text, "%s_count{udid=\"", name);
+			metrics_print_label(text, udid);
+			metrics_printf(text, "\"} %" PRIu64 "\n", total);
+		}
+		free(udid);
+	} while (device);
+	free(iter);
+}
+
+int internal_metrics_format(char **output, uint32_t *length)
+{
+	struct metrics_text text;
+	uint32_t i;
+
+	if (!output) {
+		return -1;
+	}
+
+	text.capacity = 16384;
+	text.length = 0;
+	text.failed = 0;
+	text.data = (char*)malloc(text.capacity);
+	if (!text.data) {
+		return -1;
+	}
+
+	plist_t metrics = internal_metrics_snapshot();
+	plist_t devices = plist_dict_get_item(metrics, "Devices");
+	plist_t services = plist_dict_get_item(metrics, "Services");
+	plist_t afc = plist_dict_get_item(metrics, "AFC");
+	plist_t pool = plist_dict_get_item(metrics, "ThreadPool");
+
+	static const struct {
+		const char *name;
+		const char *key;
+		const char *help;
+		uint64_t divisor;
+	} device_counters[] = {
+		{ "idevice_connection_sent_bytes", "BytesSent", "Payload bytes sent to the device", 1 },
+		{ "idevice_connection_received_bytes", "BytesReceived", "Payload bytes received from the device", 1 },
+		{ "idevice_connection_send_syscalls", "SendSyscalls", "Send operations performed on device sockets", 1 },
+		{ "idevice_connection_recv_syscalls", "RecvSyscalls", "Receive operations performed on device sockets", 1 },
+		{ "idevice_connection_tls_records_sent", "TLSRecordsSent", "TLS records sent to the device", 1 },
+		{ "idevice_connection_tls_records_received", "TLSRecordsReceived", "TLS record reads that returned data", 1 },
+		{ "idevice_connection_send_blocked_seconds", "SendBlockedMicroseconds", "Time spent in send functions", 1000000 },
+		{ "idevice_connection_recv_blocked_seconds", "RecvBlockedMicroseconds", "Time spent in receive functions", 1000000 },
+		{ "idevice_connection_crypto_saved_bytes", "CryptoBytesSaved", "Payload bytes exchanged in plaintext after dropping SSL following the handshake", 1 },
+		{ "idevice_connections", "Connections", "Connections made to the device", 1 },
+		{ "idevice_ssl_handshakes", "Handshakes", "SSL handshakes attempted", 1 },
+		{ "idevice_ssl_handshakes_failed", "HandshakesFailed", "SSL handshakes that failed", 1 },
+		{ "idevice_ssl_handshakes_resumed", "HandshakesResumed", "SSL handshakes that resumed a cached session", 1 },
+	};
+	for (i = 0; i < sizeof(device_counters) / sizeof(device_counters[0]); i++) {
+		metrics_print_family(&text, device_counters[i].name, "counter", device_counters[i].help);
+		metrics_print_dict_samples(&text, devices, device_counters[i].name, "_total", "udid", device_counters[i].key, NULL, device_counters[i].divisor);
+	}
+
+	metrics_print_family(&text, "idevice_ssl_handshake_duration_seconds", "histogram", "Duration of SSL handshakes");
+	metrics_print_histograms(&text, devices, plist_dict_get_item(metrics, "LatencyBucketBounds"), "idevice_ssl_handshake_duration_seconds");
+
+	metrics_print_family(&text, "idevice_service_messages", "counter", "Plist messages exchanged with a service");
+	metrics_print_dict_samples(&text, services, "idevice_service_messages", "_total", "service", "MessagesSent", ",direction=\"sent\"", 1);
+	metrics_print_dict_samples(&text, services, "idevice_service_messages", "_total", "service", "MessagesReceived", ",direction=\"received\"", 1);
+	metrics_print_family(&text, "idevice_service_message_bytes", "counter", "Size of plist messages exchanged with a service");
+	metrics_print_dict_samples(&text, services, "idevice_service_message_bytes", "_total", "service", "BytesSent", ",direction=\"sent\"", 1);
+	metrics_print_dict_samples(&text, services, "idevice_service_message_bytes", "_total", "service", "BytesReceived", ",direction=\"received\"", 1);
+	metrics_print_family(&text, "idevice_service_errors", "counter", "Failed plist message transfers");
+	metrics_print_dict_samples(&text, services, "idevice_service_errors", "_total", "service", "Errors", NULL, 1);
+
+	metrics_print_family(&text, "idevice_afc_operations", "counter", "AFC requests sent by operation");
+	plist_t operations = plist_dict_get_item(afc, "Operations");
+	for (i = 0; i <= METRICS_AFC_NUM_OPS; i++) {
+		uint64_t count = metrics_dict_get_uint(operations, metrics_afc_operation_names[i]);
+		if (count > 0) {
+			metrics_printf(&text, "idevice_afc_operations_total{operation=\"%s\"} %" PRIu64 "\n", metrics_afc_operation_names[i], count);
+		}
+	}
+	metrics_print_family(&text, "idevice_afc_errors", "counter", "AFC requests that returned an error status");
+	metrics_printf(&text, "idevice_afc_errors_total %" PRIu64 "\n", metrics_dict_get_uint(afc, "Errors"));
+	metrics_print_family(&text, "idevice_afc_pool_acquired", "counter", "Clients handed out by AFC connection pools");
+	metrics_printf(&text, "idevice_afc_pool_acquired_total %" PRIu64 "\n", metrics_dict_get_uint(afc, "PoolAcquired"));
+	metrics_print_family(&text, "idevice_afc_pool_waiting", "gauge", "Threads waiting for a client of an AFC connection pool");
+	metrics_printf(&text, "idevice_afc_pool_waiting %" PRIu64 "\n", metrics_dict_get_uint(afc, "PoolWaiting"));
+
+	metrics_print_family(&text, "idevice_threadpool_queue_depth", "gauge", "Work items queued on the shared thread pool");
+	metrics_printf(&text, "idevice_threadpool_queue_depth %" PRIu64 "\n", metrics_dict_get_uint(pool, "QueueDepth"));
+	metrics_print_family(&text, "idevice_threadpool_threads", "gauge", "Worker threads of the shared thread pool");
+	metrics_printf(&text, "idevice_threadpool_threads %" PRIu64 "\n", metrics_dict_get_uint(pool, "Threads"));
+	metrics_print_family(&text, "idevice_threadpool_idle_threads", "gauge", "Idle worker threads of the shared thread pool");
+	metrics_printf(&text, "idevice_threadpool_idle_threads %" PRIu64 "\n", metrics_dict_get_uint(pool, "IdleThreads"));
+
+	metrics_printf(&text, "# EOF\n");
+	plist_free(metrics);
+
+	if (text.failed) {
+		free(text.data);
+		return -1;
+	}
+	*output = text.data;
+	if (length) {
+		*length = text.length;
+	}
+	return 0;
+}
+
+/* embedded HTTP endpoint */
+
+#define METRICS_HTTP_POLL_INTERVAL 500
+#define METRICS_HTTP_REQUEST_TIMEOUT 2000
+
+static THREAD_T metrics_http_thread = THREAD_T_NULL;
+static int metrics_http_fd = -1;
+static volatile int metrics_http_shutdown = 0;
+
+static int metrics_http_send_all(int fd, const char *data, uint32_t length)
+{
+	while (length > 0) {
+		int res = socket_send(fd, (void*)data, length);
+		if (res <= 0) {
+			return -1;
+		}
+		data += res;
+		length -= res;
+	}
+	return 0;
+}
+
+static void metrics_http_handle(int fd)
+{
+	char request[1024];
+	char header[256];
+	uint32_t received = 0;
+	char *body = NULL;
+	uint32_t length = 0;
+	const char *status = "404 Not Found";
+	const char *content_type = "text/plain; charset=utf-8";
+
+	/* only the request line is of interest */
+	while (received < sizeof(request) - 1) {
+		int res = socket_receive_timeout(fd, request + received, sizeof(request) - 1 - received, 0, METRICS_HTTP_REQUEST_TIMEOUT);
+		if (res <= 0) {
+			break;
+		}
+		received += res;
+		request[received] = '\0';
+		if (strstr(request, "\r\n")) {
+			break;
+		}
+	}
+	request[received] = '\0';
+
+	if (!strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET /metrics?", 13) || !strncmp(request, "GET / ", 6)) {
+		if (internal_metrics_format(&body, &length) == 0) {
+			status = "200 OK";
+			content_type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+		} else {
+			status = "500 Internal Server Error";
+		}
+	}
+
+	snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", status, content_type, length);
+	if (metrics_http_send_all(fd, header, strlen(header)) == 0 && body) {
+		metrics_http_send_all(fd, body, length);
+	}
+	free(body);
+}
+
+static void* metrics_http_thread_func(void* data)
+{
+	int listen_fd = (int)(long)data;
+
+	while (!metrics_http_shutdown) {
+		if (socket_check_fd(listen_fd, FDM_READ, METRICS_HTTP_POLL_INTERVAL) <= 0) {
+			continue;
+		}
+		int fd = socket_accept(listen_fd, 0);
+		if (fd < 0) {
+			continue;
+		}
+		metrics_http_handle(fd);
+		socket_close(fd);
+	}
+
+	return NULL;
+}
+
+int internal_metrics_serve(uint16_t port)
+{
+	thread_once(&metrics_once, metrics_init);
+	mutex_lock(&metrics_http_mutex);
+	if (metrics_http_thread != THREAD_T_NULL) {
+		metrics_http_shutdown = 1;
+		thread_join(metrics_http_thread);
+		thread_free(metrics_http_thread);
+		metrics_http_thread = THREAD_T_NULL;
+		socket_close(metrics_http_fd);
+		metrics_http_fd = -1;
+	}
+	if (port == 0) {
+		mutex_unlock(&metrics_http_mutex);
+		return 0;
+	}
+
+	int fd = socket_create(port);
+	if (fd < 0) {
+		mutex_unlock(&metrics_http_mutex);
+		return -1;
+	}
+	metrics_http_shutdown = 0;
+	if (thread_new(&metrics_http_thread, metrics_http_thread_func, (void*)(long)fd) != 0) {
+		metrics_http_thread = THREAD_T_NULL;
+		socket_close(fd);
+		mutex_unlock(&metrics_http_mutex);
+		return -1;
+	}
+	metrics_http_fd = fd;
+	mutex_unlock(&metrics_http_mutex);
+
+	return 0;
+}
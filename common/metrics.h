@@ -0,0 +1,85 @@
+/*
+ * metrics.h
+ * Library-wide counters for monitoring
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+#include <plist/plist.h>
+#include "libimobiledevice/libimobiledevice.h"
+
+/* number of finite latency histogram buckets, see metrics_latency_bounds
+ * in metrics.c; one more bucket counts everything above the last bound */
+#define METRICS_LATENCY_BUCKETS 10
+
+/* AFC operation codes that are counted individually, higher ones are
+ * counted in the last slot */
+#define METRICS_AFC_NUM_OPS 0x29
+
+struct metrics_histogram {
+	uint64_t buckets[METRICS_LATENCY_BUCKETS + 1];
+	uint64_t sum_us;
+};
+
+/* Entries are created on first use and never freed, so pointers to them
+ * can be kept without holding a reference. All counters are updated with
+ * atomic operations. */
+struct metrics_device {
+	struct metrics_device *next;
+	char *udid;
+	idevice_connection_stats_t traffic;
+	uint64_t connections;
+	uint64_t handshakes;
+	uint64_t handshakes_failed;
+	uint64_t handshakes_resumed;
+	struct metrics_histogram handshake_latency;
+};
+
+struct metrics_service {
+	struct metrics_service *next;
+	char *name;
+	uint64_t messages_sent;
+	uint64_t messages_received;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t errors;
+};
+
+struct metrics_afc {
+	uint64_t operations[METRICS_AFC_NUM_OPS + 1];
+	uint64_t errors;
+	uint64_t pool_acquired;
+	uint64_t pool_waiting;
+};
+
+extern struct metrics_afc internal_metrics_afc;
+
+#define metrics_add(ptr, value) __sync_fetch_and_add(ptr, (uint64_t)(value))
+#define metrics_sub(ptr, value) __sync_fetch_and_sub(ptr, (uint64_t)(value))
+
+struct metrics_device *metrics_device_get(const char *udid);
+struct metrics_service *metrics_service_get(const char *name);
+void metrics_histogram_observe(struct metrics_histogram *histogram, uint64_t value_us);
+void metrics_afc_operation(uint64_t operation);
+
+plist_t internal_metrics_snapshot(void);
+int internal_metrics_format(char **text, uint32_t *length);
+int internal_metrics_serve(uint16_t port);
+
+#endif
@@ -22,6 +22,14 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#define _GNU_SOURCE 1
+#ifdef WIN32
+/* WSAPoll() requires Windows Vista or later */
+#if !defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#endif
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -33,11 +41,15 @@
 #ifdef WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
 #include <windows.h>
 #include <iphlpapi.h>
 static int wsa_init = 0;
+#define poll(fds, nfds, timeout) WSAPoll(fds, nfds, timeout)
 #else
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -49,11 +61,21 @@ static int wsa_init = 0;
 #include <ifaddrs.h>
 #endif
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#endif
 #include "socket.h"
 
 #define RECV_TIMEOUT 20000
 #define CONNECT_TIMEOUT 5000
 
+/* Delay before the next candidate address is tried while a connection
+ * attempt is still in progress (see RFC 8305) */
+#define SOCKET_CONNECT_ATTEMPT_DELAY 250
+#define SOCKET_CONNECT_MAX_CANDIDATES 16
+
 #ifndef EAFNOSUPPORT
 #define EAFNOSUPPORT 102
 #endif
@@ -71,6 +93,131 @@ void socket_set_verbose(int level)
 	verbose = level;
 }
 
+static uint64_t _socket_time_ms(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount();
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+#ifdef WIN32
+/* WSAPoll() rejects POLLPRI, out-of-band data is reported as POLLRDBAND */
+#define SOCKET_POLLPRI POLLRDBAND
+#else
+#define SOCKET_POLLPRI POLLPRI
+#endif
+
+static short _socket_poll_events(unsigned int events)
+{
+	short pev = 0;
+	if (events & SOCKET_POLL_READ)
+		pev |= POLLIN;
+	if (events & SOCKET_POLL_WRITE)
+		pev |= POLLOUT;
+	if (events & SOCKET_POLL_PRI)
+		pev |= SOCKET_POLLPRI;
+	return pev;
+}
+
+static unsigned int _socket_poll_revents(short pev)
+{
+	unsigned int events = 0;
+	if (pev & POLLIN)
+		events |= SOCKET_POLL_READ;
+	if (pev & POLLOUT)
+		events |= SOCKET_POLL_WRITE;
+	if (pev & SOCKET_POLLPRI)
+		events |= SOCKET_POLL_PRI;
+	if (pev & (POLLERR | POLLHUP | POLLNVAL))
+		events |= SOCKET_POLL_ERROR;
+	return events;
+}
+
+static int _socket_poll_errno(void)
+{
+#ifdef WIN32
+	int err = WSAGetLastError();
+	if (err == WSAEINTR)
+		return EINTR;
+	if (err == WSAENOTSOCK)
+		return EBADF;
+	return (err == WSAENOBUFS) ? ENOMEM : EINVAL;
+#else
+	return errno;
+#endif
+}
+
+/* calls poll() and restarts it with the remaining time when interrupted */
+static int _socket_poll_restart(struct pollfd *pfds, unsigned int nfds, int timeout)
+{
+	uint64_t deadline = (timeout > 0) ? _socket_time_ms() + timeout : 0;
+	while (1) {
+		int res = poll(pfds, nfds, timeout);
+		if (res >= 0) {
+			return res;
+		}
+		int err = _socket_poll_errno();
+		if (err != EINTR && err != EAGAIN) {
+			return -err;
+		}
+		if (timeout > 0) {
+			uint64_t now = _socket_time_ms();
+			if (now >= deadline) {
+				return 0;
+			}
+			timeout = (int)(deadline - now);
+		}
+	}
+}
+
+int socket_poll(struct socket_pollfd *fds, int nfds, int timeout)
+{
+	struct pollfd stack_pfds[8];
+	struct pollfd *pfds = stack_pfds;
+	int i;
+
+	if (!fds || nfds <= 0) {
+		return -EINVAL;
+	}
+	if (nfds > (int)(sizeof(stack_pfds) / sizeof(stack_pfds[0]))) {
+		pfds = (struct pollfd*)malloc(sizeof(struct pollfd) * nfds);
+		if (!pfds) {
+			return -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < nfds; i++) {
+		pfds[i].fd = fds[i].fd;
+		pfds[i].events = _socket_poll_events(fds[i].events);
+		pfds[i].revents = 0;
+	}
+
+	int res = _socket_poll_restart(pfds, nfds, (timeout < 0) ? -1 : timeout);
+
+	for (i = 0; i < nfds; i++) {
+		fds[i].revents = (res > 0) ? _socket_poll_revents(pfds[i].revents) : 0;
+	}
+
+	if (pfds != stack_pfds) {
+		free(pfds);
+	}
+
+	return res;
+}
+
+/* waits up to timeout ms until the connection on fd completes */
+static int _socket_connect_wait(int fd, unsigned int timeout)
+{
+	struct socket_pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = SOCKET_POLL_WRITE;
+	return (socket_poll(&pfd, 1, timeout) == 1);
+}
+
 const char *socket_addr_to_string(struct sockaddr *addr, char *addr_out, size_t addr_out_size)
 {
 #ifdef WIN32
@@ -230,14 +377,7 @@ int socket_connect_unix(const char *filename)
 			break;
 		}
 		if (errno == EINPROGRESS) {
-			fd_set fds;
-			FD_ZERO(&fds);
-			FD_SET(sfd, &fds);
-
-			struct timeval timeout;
-			timeout.tv_sec = CONNECT_TIMEOUT / 1000;
-			timeout.tv_usec = (CONNECT_TIMEOUT - (timeout.tv_sec * 1000)) * 1000;
-			if (select(sfd + 1, NULL, &fds, NULL, &timeout) == 1) {
+			if (_socket_connect_wait(sfd, CONNECT_TIMEOUT)) {
 				int so_error;
 				socklen_t len = sizeof(so_error);
 				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
@@ -541,6 +681,116 @@ static int32_t _sockaddr_in6_scope_id(struct sockaddr_in6* addr)
 	return res;
 }
 #endif
+
+/**
+ * Collects the scope ids of all usable interfaces that could route the
+ * given address. The most likely candidate as determined by
+ * _sockaddr_in6_scope_id() comes first.
+ *
+ * @return The number of scope ids stored in ids
+ */
+static int _sockaddr_in6_scope_ids(struct sockaddr_in6* addr, uint32_t *ids, int max)
+{
+	int count = 0;
+	int i;
+	int32_t best;
+
+	if (max <= 0) {
+		return 0;
+	}
+
+	best = _sockaddr_in6_scope_id(addr);
+	if (best < 0) {
+		return 0;
+	}
+	ids[count++] = (uint32_t)best;
+
+	if (_in6_addr_scope(&addr->sin6_addr) != 2) {
+		/* only link-local addresses can be reached via multiple interfaces */
+		return count;
+	}
+
+#ifdef WIN32
+	ULONG outBufLen = 15000;
+	int tries = 0;
+	DWORD dwRetVal = 0;
+	PIP_ADAPTER_ADDRESSES pAddresses = NULL;
+
+	do {
+		pAddresses = (IP_ADAPTER_ADDRESSES *) malloc(outBufLen);
+		if (pAddresses == NULL) {
+			return count;
+		}
+		dwRetVal = GetAdaptersAddresses(AF_INET6, GAA_FLAG_INCLUDE_PREFIX, NULL, pAddresses, &outBufLen);
+		if (dwRetVal == ERROR_BUFFER_OVERFLOW) {
+			free(pAddresses);
+			pAddresses = NULL;
+		} else {
+			break;
+		}
+		tries++;
+	} while ((dwRetVal == ERROR_BUFFER_OVERFLOW) && (tries < 3));
+
+	if (dwRetVal != NO_ERROR) {
+		free(pAddresses);
+		return count;
+	}
+
+	for (PIP_ADAPTER_ADDRESSES cur = pAddresses; cur != NULL && count < max; cur = cur->Next) {
+		if (cur->OperStatus != IfOperStatusUp || cur->IfType == IF_TYPE_SOFTWARE_LOOPBACK) {
+			continue;
+		}
+		for (PIP_ADAPTER_UNICAST_ADDRESS unicast = cur->FirstUnicastAddress; unicast != NULL && count < max; unicast = unicast->Next) {
+			if (unicast->Address.lpSockaddr->sa_family != AF_INET6) {
+				continue;
+			}
+			struct sockaddr_in6 *addr_in = (struct sockaddr_in6 *)unicast->Address.lpSockaddr;
+			if (_in6_addr_scope(&addr_in->sin6_addr) != 2) {
+				continue;
+			}
+			for (i = 0; i < count; i++) {
+				if (ids[i] == addr_in->sin6_scope_id)
+					break;
+			}
+			if (i == count) {
+				ids[count++] = addr_in->sin6_scope_id;
+			}
+		}
+	}
+
+	free(pAddresses);
+#else
+	struct ifaddrs *ifaddr, *ifa;
+
+	if (getifaddrs(&ifaddr) == -1) {
+		return count;
+	}
+
+	for (ifa = ifaddr; ifa != NULL && count < max; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET6) {
+			continue;
+		}
+		if ((ifa->ifa_flags & IFF_UP) == 0 || (ifa->ifa_flags & IFF_RUNNING) == 0 || (ifa->ifa_flags & IFF_LOOPBACK) != 0) {
+			continue;
+		}
+		struct sockaddr_in6* addr_in = (struct sockaddr_in6*)ifa->ifa_addr;
+		if (_in6_addr_scope(&addr_in->sin6_addr) != 2) {
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			if (ids[i] == addr_in->sin6_scope_id)
+				break;
+		}
+		if (i == count) {
+			ids[count++] = addr_in->sin6_scope_id;
+		}
+	}
+
+	freeifaddrs(ifaddr);
+#endif
+
+	return count;
+}
 #endif
 
 int socket_connect_addr(struct sockaddr* addr, uint16_t port)
@@ -626,14 +876,7 @@ int socket_connect_addr(struct sockaddr* addr, uint16_t port)
 		if (errno == EINPROGRESS)
 #endif
 		{
-			fd_set fds;
-			FD_ZERO(&fds);
-			FD_SET(sfd, &fds);
-
-			struct timeval timeout;
-			timeout.tv_sec = CONNECT_TIMEOUT / 1000;
-			timeout.tv_usec = (CONNECT_TIMEOUT - (timeout.tv_sec * 1000)) * 1000;
-			if (select(sfd + 1, NULL, &fds, NULL, &timeout) == 1) {
+			if (_socket_connect_wait(sfd, CONNECT_TIMEOUT)) {
 				int so_error;
 				socklen_t len = sizeof(so_error);
 				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
@@ -672,6 +915,254 @@ int socket_connect_addr(struct sockaddr* addr, uint16_t port)
 	return sfd;
 }
 
+struct connect_candidate {
+	struct sockaddr_storage addr;
+	int addrlen;
+	int fd;
+};
+
+/**
+ * Starts a non-blocking connection attempt to the given candidate.
+ *
+ * @return 1 if the connection was established immediately, 0 if it is in
+ *    progress, or -1 if the attempt failed.
+ */
+static int _connect_candidate_start(struct connect_candidate *cand)
+{
+	int yes = 1;
+#ifdef WIN32
+	u_long l_yes = 1;
+#endif
+
+	cand->fd = socket(cand->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (cand->fd == -1) {
+		return -1;
+	}
+
+#ifdef SO_NOSIGPIPE
+	setsockopt(cand->fd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int));
+#endif
+	setsockopt(cand->fd, SOL_SOCKET, SO_REUSEADDR, (void*)&yes, sizeof(int));
+
+#ifdef WIN32
+	ioctlsocket(cand->fd, FIONBIO, &l_yes);
+#else
+	int flags = fcntl(cand->fd, F_GETFL, 0);
+	fcntl(cand->fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+
+	if (connect(cand->fd, (struct sockaddr*)&cand->addr, cand->addrlen) != -1) {
+		return 1;
+	}
+#ifdef WIN32
+	if (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+	if (errno == EINPROGRESS)
+#endif
+	{
+		return 0;
+	}
+
+	socket_close(cand->fd);
+	cand->fd = -1;
+	return -1;
+}
+
+int socket_connect_addrs(struct sockaddr **addrs, int num_addrs, uint16_t port)
+{
+	struct connect_candidate cands[SOCKET_CONNECT_MAX_CANDIDATES];
+	int num_cands = 0;
+	int next = 0;
+	int sfd = -1;
+	int yes = 1;
+	int bufsize = 0x20000;
+	int i, j;
+#ifdef WIN32
+	WSADATA wsa_data;
+	if (!wsa_init) {
+		if (WSAStartup(MAKEWORD(2,2), &wsa_data) != ERROR_SUCCESS) {
+			fprintf(stderr, "WSAStartup failed!\n");
+			ExitProcess(-1);
+		}
+		wsa_init = 1;
+	}
+#endif
+
+	if (!addrs || num_addrs <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* build the list of candidates */
+	for (i = 0; i < num_addrs && num_cands < SOCKET_CONNECT_MAX_CANDIDATES; i++) {
+		struct sockaddr *addr = addrs[i];
+		if (!addr) {
+			continue;
+		}
+		if (addr->sa_family == AF_INET) {
+			struct connect_candidate *cand = &cands[num_cands++];
+			memcpy(&cand->addr, addr, sizeof(struct sockaddr_in));
+			((struct sockaddr_in*)&cand->addr)->sin_port = htons(port);
+			cand->addrlen = sizeof(struct sockaddr_in);
+			cand->fd = -1;
+		}
+#ifdef AF_INET6
+		else if (addr->sa_family == AF_INET6) {
+			uint32_t scope_ids[SOCKET_CONNECT_MAX_CANDIDATES];
+			int num_ids = _sockaddr_in6_scope_ids((struct sockaddr_in6*)addr, scope_ids, SOCKET_CONNECT_MAX_CANDIDATES - num_cands);
+			if (num_ids == 0) {
+				/* let the system decide */
+				scope_ids[0] = ((struct sockaddr_in6*)addr)->sin6_scope_id;
+				num_ids = 1;
+			}
+			for (j = 0; j < num_ids; j++) {
+				struct connect_candidate *cand = &cands[num_cands++];
+				memcpy(&cand->addr, addr, sizeof(struct sockaddr_in6));
+				((struct sockaddr_in6*)&cand->addr)->sin6_port = htons(port);
+				((struct sockaddr_in6*)&cand->addr)->sin6_scope_id = scope_ids[j];
+				cand->addrlen = sizeof(struct sockaddr_in6);
+				cand->fd = -1;
+			}
+		}
+#endif
+		else {
+			fprintf(stderr, "ERROR: Unsupported address family");
+		}
+	}
+
+	if (num_cands == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint64_t start = _socket_time_ms();
+	uint64_t last_attempt = 0;
+	int winner = -1;
+	int so_error = ETIMEDOUT;
+
+	while (winner < 0) {
+		uint64_t now = _socket_time_ms();
+		if (now - start >= CONNECT_TIMEOUT) {
+			so_error = ETIMEDOUT;
+			break;
+		}
+
+		int pending = 0;
+		for (i = 0; i < next; i++) {
+			if (cands[i].fd >= 0)
+				pending++;
+		}
+
+		/* start the next attempt if there is none in flight or the
+		 * previous one didn't complete within the attempt delay */
+		if (next < num_cands && (pending == 0 || now - last_attempt >= SOCKET_CONNECT_ATTEMPT_DELAY)) {
+			int res = _connect_candidate_start(&cands[next]);
+			last_attempt = now;
+			next++;
+			if (res == 1) {
+				winner = next-1;
+				break;
+			}
+			if (res == 0) {
+				pending++;
+			} else {
+				so_error = errno;
+			}
+			if (pending == 0) {
+				continue;
+			}
+		}
+
+		if (pending == 0) {
+			/* all candidates failed */
+			break;
+		}
+
+		uint64_t wait = CONNECT_TIMEOUT - (now - start);
+		if (next < num_cands && wait > SOCKET_CONNECT_ATTEMPT_DELAY - (now - last_attempt)) {
+			wait = SOCKET_CONNECT_ATTEMPT_DELAY - (now - last_attempt);
+		}
+
+		struct socket_pollfd pfds[SOCKET_CONNECT_MAX_CANDIDATES];
+		int pidx[SOCKET_CONNECT_MAX_CANDIDATES];
+		int npfds = 0;
+		for (i = 0; i < next; i++) {
+			if (cands[i].fd >= 0) {
+				pfds[npfds].fd = cands[i].fd;
+				pfds[npfds].events = SOCKET_POLL_WRITE;
+				pidx[npfds] = i;
+				npfds++;
+			}
+		}
+
+		int sret = socket_poll(pfds, npfds, (int)wait);
+		if (sret < 0) {
+			so_error = -sret;
+			break;
+		}
+		if (sret == 0) {
+			continue;
+		}
+
+		for (j = 0; j < npfds; j++) {
+			i = pidx[j];
+			if (!pfds[j].revents)
+				continue;
+			int err = 0;
+			socklen_t len = sizeof(err);
+			getsockopt(cands[i].fd, SOL_SOCKET, SO_ERROR, (void*)&err, &len);
+			if (err == 0 && !(pfds[j].revents & SOCKET_POLL_ERROR)) {
+				winner = i;
+				break;
+			}
+			so_error = (err) ? err : ECONNREFUSED;
+			socket_close(cands[i].fd);
+			cands[i].fd = -1;
+		}
+	}
+
+	/* close the losing attempts */
+	for (i = 0; i < next; i++) {
+		if (i != winner && cands[i].fd >= 0) {
+			socket_close(cands[i].fd);
+			cands[i].fd = -1;
+		}
+	}
+
+	if (winner < 0) {
+		if (verbose >= 2) {
+			char addrtxt[48];
+			socket_addr_to_string(addrs[0], addrtxt, sizeof(addrtxt));
+			fprintf(stderr, "%s: Could not connect to %s port %d (%d candidates)\n", __func__, addrtxt, port, num_cands);
+		}
+		errno = so_error;
+		return -1;
+	}
+
+	sfd = cands[winner].fd;
+	errno = 0;
+
+	if (verbose >= 3) {
+		char addrtxt[48];
+		socket_addr_to_string((struct sockaddr*)&cands[winner].addr, addrtxt, sizeof(addrtxt));
+		fprintf(stderr, "%s: connected to %s port %d (candidate %d of %d)\n", __func__, addrtxt, port, winner+1, num_cands);
+	}
+
+	if (setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(int)) == -1) {
+		perror("Could not set TCP_NODELAY on socket");
+	}
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, (void*)&bufsize, sizeof(int)) == -1) {
+		perror("Could not set send buffer for socket");
+	}
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (void*)&bufsize, sizeof(int)) == -1) {
+		perror("Could not set receive buffer for socket");
+	}
+
+	return sfd;
+}
+
 int socket_connect(const char *addr, uint16_t port)
 {
 	int sfd = -1;
@@ -750,14 +1241,7 @@ int socket_connect(const char *addr, uint16_t port)
 		if (errno == EINPROGRESS)
 #endif
 		{
-			fd_set fds;
-			FD_ZERO(&fds);
-			FD_SET(sfd, &fds);
-
-			struct timeval timeout;
-			timeout.tv_sec = CONNECT_TIMEOUT / 1000;
-			timeout.tv_usec = (CONNECT_TIMEOUT - (timeout.tv_sec * 1000)) * 1000;
-			if (select(sfd + 1, NULL, &fds, NULL, &timeout) == 1) {
+			if (_socket_connect_wait(sfd, CONNECT_TIMEOUT)) {
 				int so_error;
 				socklen_t len = sizeof(so_error);
 				getsockopt(sfd, SOL_SOCKET, SO_ERROR, (void*)&so_error, &len);
@@ -794,11 +1278,8 @@ int socket_connect(const char *addr, uint16_t port)
 
 int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 {
-	fd_set fds;
+	struct socket_pollfd pfd;
 	int sret;
-	int eagain;
-	struct timeval to;
-	struct timeval *pto;
 
 	if (fd < 0) {
 		if (verbose >= 2)
@@ -806,60 +1287,33 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 		return -1;
 	}
 
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
-
-	sret = -1;
-
-	do {
-		if (timeout > 0) {
-			to.tv_sec = (time_t) (timeout / 1000);
-			to.tv_usec = (time_t) ((timeout - (to.tv_sec * 1000)) * 1000);
-			pto = &to;
-		} else {
-			pto = NULL;
-		}
-		eagain = 0;
-		switch (fdm) {
-		case FDM_READ:
-			sret = select(fd + 1, &fds, NULL, NULL, pto);
-			break;
-		case FDM_WRITE:
-			sret = select(fd + 1, NULL, &fds, NULL, pto);
-			break;
-		case FDM_EXCEPT:
-			sret = select(fd + 1, NULL, NULL, &fds, pto);
-			break;
-		default:
-			return -1;
-		}
-
-		if (sret < 0) {
-			switch (errno) {
-			case EINTR:
-				// interrupt signal in select
-				if (verbose >= 2)
-					fprintf(stderr, "%s: EINTR\n", __func__);
-				eagain = 1;
-				break;
-			case EAGAIN:
-				if (verbose >= 2)
-					fprintf(stderr, "%s: EAGAIN\n", __func__);
-				eagain = 1;
-				break;
-			default:
-				if (verbose >= 2)
-					fprintf(stderr, "%s: select failed: %s\n", __func__,
-							strerror(errno));
-				return -1;
-			}
-		} else if (sret == 0) {
-			if (verbose >= 2)
-				fprintf(stderr, "%s: timeout\n", __func__);
-			return -ETIMEDOUT;
-		}
-	} while (eagain);
+	pfd.fd = fd;
+	switch (fdm) {
+	case FDM_READ:
+		pfd.events = SOCKET_POLL_READ;
+		break;
+	case FDM_WRITE:
+		pfd.events = SOCKET_POLL_WRITE;
+		break;
+	case FDM_EXCEPT:
+		pfd.events = SOCKET_POLL_PRI;
+		break;
+	default:
+		return -1;
+	}
 
+	/* a timeout of 0 means to wait forever */
+	sret = socket_poll(&pfd, 1, (timeout > 0) ? (int)timeout : -1);
+	if (sret < 0) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: poll failed: %s\n", __func__, strerror(-sret));
+		return -1;
+	}
+	if (sret == 0) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: timeout\n", __func__);
+		return -ETIMEDOUT;
+	}
 	return sret;
 }
 
@@ -932,6 +1386,170 @@ int socket_receive_timeout(int fd, void *data, size_t length, int flags,
 	return result;
 }
 
+int socket_receive_nonblocking(int fd, void *data, size_t length)
+{
+	struct socket_pollfd pfd;
+	int sret;
+	int result;
+
+	if (fd < 0) {
+		return -EINVAL;
+	}
+
+	pfd.fd = fd;
+	pfd.events = SOCKET_POLL_READ;
+	sret = socket_poll(&pfd, 1, 0);
+	if (sret < 0) {
+		return sret;
+	}
+	if (sret == 0) {
+		return -EAGAIN;
+	}
+
+	result = recv(fd, data, length, 0);
+	if (result == 0) {
+		return -ECONNRESET;
+	}
+	if (result < 0) {
+		return -errno;
+	}
+	return result;
+}
+
+int socket_set_nonblocking(int fd, int nonblocking)
+{
+#ifdef WIN32
+	u_long mode = (nonblocking) ? 1 : 0;
+	if (ioctlsocket(fd, FIONBIO, &mode) != 0) {
+		return -1;
+	}
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
+	}
+	if (nonblocking) {
+		flags |= O_NONBLOCK;
+	} else {
+		flags &= ~O_NONBLOCK;
+	}
+	if (fcntl(fd, F_SETFL, flags) < 0) {
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+int socket_set_nodelay(int fd, int nodelay)
+{
+	int value = (nodelay) ? 1 : 0;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&value, sizeof(int)) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+int socket_set_keepalive(int fd, int enable, int idle, int interval, int count)
+{
+	int value = (enable) ? 1 : 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void*)&value, sizeof(int)) == -1) {
+		return -1;
+	}
+	if (!enable) {
+		return 0;
+	}
+#ifdef WIN32
+#ifdef SIO_KEEPALIVE_VALS
+	if (idle > 0 || interval > 0) {
+		struct tcp_keepalive ka;
+		DWORD bytes = 0;
+		ka.onoff = 1;
+		ka.keepalivetime = (ULONG)((idle > 0) ? idle : 7200) * 1000;
+		ka.keepaliveinterval = (ULONG)((interval > 0) ? interval : 1) * 1000;
+		if (WSAIoctl(fd, SIO_KEEPALIVE_VALS, &ka, sizeof(ka), NULL, 0, &bytes, NULL, NULL) != 0) {
+			return -1;
+		}
+	}
+#endif
+#else
+	if (idle > 0) {
+#if defined(TCP_KEEPIDLE)
+		if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (void*)&idle, sizeof(int)) == -1) {
+			return -1;
+		}
+#elif defined(TCP_KEEPALIVE)
+		if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, (void*)&idle, sizeof(int)) == -1) {
+			return -1;
+		}
+#endif
+	}
+#ifdef TCP_KEEPINTVL
+	if (interval > 0) {
+		if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (void*)&interval, sizeof(int)) == -1) {
+			return -1;
+		}
+	}
+#endif
+#ifdef TCP_KEEPCNT
+	if (count > 0) {
+		if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (void*)&count, sizeof(int)) == -1) {
+			return -1;
+		}
+	}
+#endif
+#endif
+	return 0;
+}
+
+int socket_set_buffer_sizes(int fd, int send_size, int recv_size)
+{
+	int res = 0;
+	if (send_size > 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void*)&send_size, sizeof(int)) == -1) {
+			res = -1;
+		}
+	}
+	if (recv_size > 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&recv_size, sizeof(int)) == -1) {
+			res = -1;
+		}
+	}
+	return res;
+}
+
+#ifdef HAVE_SPLICE
+int socket_splice(int fd_in, int fd_out, int pipefd[2], size_t length)
+{
+	ssize_t in;
+	ssize_t left;
+
+	do {
+		in = splice(fd_in, NULL, pipefd[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} while (in < 0 && errno == EINTR);
+	if (in < 0) {
+		return -errno;
+	}
+
+	left = in;
+	while (left > 0) {
+		ssize_t out = splice(pipefd[0], NULL, fd_out, NULL, left, SPLICE_F_MOVE);
+		if (out < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				socket_check_fd(fd_out, FDM_WRITE, 1000);
+				continue;
+			}
+			return -errno;
+		}
+		left -= out;
+	}
+
+	return (int)in;
+}
+#endif
+
 int socket_send(int fd, void *data, size_t length)
 {
 	int flags = 0;
@@ -940,3 +1558,375 @@ int socket_send(int fd, void *data, size_t length)
 #endif
 	return send(fd, data, length, flags);
 }
+
+int socket_sendv(int fd, const struct socket_iovec *iov, int iovcnt)
+{
+	int i;
+	if (!iov || iovcnt <= 0 || iovcnt > SOCKET_IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+#ifdef WIN32
+	WSABUF bufs[SOCKET_IOV_MAX];
+	DWORD sent = 0;
+	for (i = 0; i < iovcnt; i++) {
+		bufs[i].buf = (char*)iov[i].data;
+		bufs[i].len = (ULONG)iov[i].length;
+	}
+	if (WSASend(fd, bufs, (DWORD)iovcnt, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+		return -1;
+	}
+	return (int)sent;
+#else
+	struct iovec vec[SOCKET_IOV_MAX];
+	struct msghdr msg;
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].iov_base = (void*)iov[i].data;
+		vec[i].iov_len = iov[i].length;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = vec;
+	msg.msg_iovlen = iovcnt;
+	return sendmsg(fd, &msg, flags);
+#endif
+}
+
+/* registered fd, entries are kept dense and indexed by fd via fd_index */
+struct socket_poller_entry {
+	int fd;
+	unsigned int events;
+	void *user_data;
+};
+
+struct socket_poller {
+#ifdef HAVE_SYS_EPOLL_H
+	int epfd;
+	struct epoll_event *kevents;
+#elif defined(HAVE_SYS_EVENT_H)
+	int kq;
+	struct kevent *kevents;
+#else
+	struct pollfd *pfds;
+#endif
+	int kevents_size;
+	struct socket_poller_entry *entries;
+	int num_entries;
+	int capacity;
+	int *fd_index;
+	int fd_index_size;
+};
+
+static struct socket_poller_entry *_socket_poller_lookup(socket_poller_t poller, int fd)
+{
+	if (fd < 0 || fd >= poller->fd_index_size || poller->fd_index[fd] == 0) {
+		return NULL;
+	}
+	return &poller->entries[poller->fd_index[fd] - 1];
+}
+
+#ifdef HAVE_SYS_EVENT_H
+#ifndef HAVE_SYS_EPOLL_H
+static int _socket_poller_kqueue_update(socket_poller_t poller, int fd, unsigned int old_events, unsigned int new_events)
+{
+	struct kevent changes[2];
+	int n = 0;
+	if ((old_events ^ new_events) & SOCKET_POLL_READ) {
+		EV_SET(&changes[n], fd, EVFILT_READ, (new_events & SOCKET_POLL_READ) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+		n++;
+	}
+	if ((old_events ^ new_events) & SOCKET_POLL_WRITE) {
+		EV_SET(&changes[n], fd, EVFILT_WRITE, (new_events & SOCKET_POLL_WRITE) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+		n++;
+	}
+	if (n > 0 && kevent(poller->kq, changes, n, NULL, 0, NULL) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+#endif
+#endif
+
+socket_poller_t socket_poller_new(void)
+{
+	socket_poller_t poller = (socket_poller_t)calloc(1, sizeof(struct socket_poller));
+	if (!poller) {
+		return NULL;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (poller->epfd < 0) {
+		free(poller);
+		return NULL;
+	}
+#elif defined(HAVE_SYS_EVENT_H)
+	poller->kq = kqueue();
+	if (poller->kq < 0) {
+		free(poller);
+		return NULL;
+	}
+#endif
+	return poller;
+}
+
+void socket_poller_free(socket_poller_t poller)
+{
+	if (!poller) {
+		return;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	close(poller->epfd);
+#elif defined(HAVE_SYS_EVENT_H)
+	close(poller->kq);
+	free(poller->kevents);
+#else
+	free(poller->pfds);
+#endif
+	free(poller->entries);
+	free(poller->fd_index);
+	free(poller);
+}
+
+int socket_poller_add(socket_poller_t poller, int fd, unsigned int events, void *user_data)
+{
+	if (!poller || fd < 0) {
+		return -EINVAL;
+	}
+	if (_socket_poller_lookup(poller, fd)) {
+		return -EEXIST;
+	}
+
+	if (fd >= poller->fd_index_size) {
+		int newsize = (poller->fd_index_size) ? poller->fd_index_size : 64;
+		while (newsize <= fd) {
+			newsize *= 2;
+		}
+		int *fd_index = (int*)realloc(poller->fd_index, sizeof(int) * newsize);
+		if (!fd_index) {
+			return -ENOMEM;
+		}
+		memset(fd_index + poller->fd_index_size, '\0', sizeof(int) * (newsize - poller->fd_index_size));
+		poller->fd_index = fd_index;
+		poller->fd_index_size = newsize;
+	}
+	if (poller->num_entries == poller->capacity) {
+		int newcap = (poller->capacity) ? poller->capacity * 2 : 16;
+		struct socket_poller_entry *entries = (struct socket_poller_entry*)realloc(poller->entries, sizeof(struct socket_poller_entry) * newcap);
+		if (!entries) {
+			return -ENOMEM;
+		}
+		poller->entries = entries;
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(HAVE_SYS_EVENT_H)
+		struct pollfd *pfds = (struct pollfd*)realloc(poller->pfds, sizeof(struct pollfd) * newcap);
+		if (!pfds) {
+			return -ENOMEM;
+		}
+		poller->pfds = pfds;
+#endif
+		poller->capacity = newcap;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = ((events & SOCKET_POLL_READ) ? EPOLLIN : 0) | ((events & SOCKET_POLL_WRITE) ? EPOLLOUT : 0) | ((events & SOCKET_POLL_PRI) ? EPOLLPRI : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		return -errno;
+	}
+#elif defined(HAVE_SYS_EVENT_H)
+	int res = _socket_poller_kqueue_update(poller, fd, 0, events);
+	if (res < 0) {
+		return res;
+	}
+#else
+	poller->pfds[poller->num_entries].fd = fd;
+	poller->pfds[poller->num_entries].events = _socket_poll_events(events);
+	poller->pfds[poller->num_entries].revents = 0;
+#endif
+
+	struct socket_poller_entry *entry = &poller->entries[poller->num_entries];
+	entry->fd = fd;
+	entry->events = events;
+	entry->user_data = user_data;
+	poller->num_entries++;
+	poller->fd_index[fd] = poller->num_entries;
+
+	return 0;
+}
+
+int socket_poller_modify(socket_poller_t poller, int fd, unsigned int events, void *user_data)
+{
+	if (!poller) {
+		return -EINVAL;
+	}
+	struct socket_poller_entry *entry = _socket_poller_lookup(poller, fd);
+	if (!entry) {
+		return -ENOENT;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = ((events & SOCKET_POLL_READ) ? EPOLLIN : 0) | ((events & SOCKET_POLL_WRITE) ? EPOLLOUT : 0) | ((events & SOCKET_POLL_PRI) ? EPOLLPRI : 0);
+	ev.data.fd = fd;
+	if (epoll_ctl(poller->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+		return -errno;
+	}
+#elif defined(HAVE_SYS_EVENT_H)
+	int res = _socket_poller_kqueue_update(poller, fd, entry->events, events);
+	if (res < 0) {
+		return res;
+	}
+#else
+	poller->pfds[entry - poller->entries].events = _socket_poll_events(events);
+#endif
+
+	entry->events = events;
+	entry->user_data = user_data;
+
+	return 0;
+}
+
+int socket_poller_remove(socket_poller_t poller, int fd)
+{
+	if (!poller) {
+		return -EINVAL;
+	}
+	struct socket_poller_entry *entry = _socket_poller_lookup(poller, fd);
+	if (!entry) {
+		return -ENOENT;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, NULL);
+#elif defined(HAVE_SYS_EVENT_H)
+	_socket_poller_kqueue_update(poller, fd, entry->events, 0);
+#endif
+
+	/* move the last entry into the freed slot */
+	int idx = (int)(entry - poller->entries);
+	int last = poller->num_entries - 1;
+	if (idx != last) {
+		poller->entries[idx] = poller->entries[last];
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(HAVE_SYS_EVENT_H)
+		poller->pfds[idx] = poller->pfds[last];
+#endif
+		poller->fd_index[poller->entries[idx].fd] = idx + 1;
+	}
+	poller->fd_index[fd] = 0;
+	poller->num_entries--;
+
+	return 0;
+}
+
+int socket_poller_wait(socket_poller_t poller, struct socket_poller_event *events, int max_events, int timeout)
+{
+	int count = 0;
+	int i;
+
+	if (!poller || !events || max_events <= 0) {
+		return -EINVAL;
+	}
+
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+	if (poller->kevents_size < max_events) {
+		void *kevents = realloc(poller->kevents, sizeof(*poller->kevents) * max_events);
+		if (!kevents) {
+			return -ENOMEM;
+		}
+		poller->kevents = kevents;
+		poller->kevents_size = max_events;
+	}
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+	int n;
+	do {
+		n = epoll_wait(poller->epfd, poller->kevents, max_events, (timeout < 0) ? -1 : timeout);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return -errno;
+	}
+	for (i = 0; i < n; i++) {
+		struct socket_poller_entry *entry = _socket_poller_lookup(poller, poller->kevents[i].data.fd);
+		if (!entry) {
+			continue;
+		}
+		uint32_t ev = poller->kevents[i].events;
+		events[count].fd = entry->fd;
+		events[count].user_data = entry->user_data;
+		events[count].events = ((ev & EPOLLIN) ? SOCKET_POLL_READ : 0) | ((ev & EPOLLOUT) ? SOCKET_POLL_WRITE : 0) | ((ev & EPOLLPRI) ? SOCKET_POLL_PRI : 0) | ((ev & (EPOLLERR | EPOLLHUP)) ? SOCKET_POLL_ERROR : 0);
+		count++;
+	}
+#elif defined(HAVE_SYS_EVENT_H)
+	struct timespec ts;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+	}
+	int n;
+	do {
+		n = kevent(poller->kq, NULL, 0, poller->kevents, max_events, (timeout < 0) ? NULL : &ts);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		return -errno;
+	}
+	for (i = 0; i < n; i++) {
+		int fd = (int)poller->kevents[i].ident;
+		struct socket_poller_entry *entry = _socket_poller_lookup(poller, fd);
+		if (!entry) {
+			continue;
+		}
+		unsigned int ev = (poller->kevents[i].filter == EVFILT_READ) ? SOCKET_POLL_READ : SOCKET_POLL_WRITE;
+		if (poller->kevents[i].flags & (EV_EOF | EV_ERROR)) {
+			ev |= SOCKET_POLL_ERROR;
+		}
+		/* read and write readiness arrive as separate kevents */
+		int j;
+		for (j = 0; j < count; j++) {
+			if (events[j].fd == fd) {
+				events[j].events |= ev;
+				break;
+			}
+		}
+		if (j == count) {
+			events[count].fd = fd;
+			events[count].user_data = entry->user_data;
+			events[count].events = ev;
+			count++;
+		}
+	}
+#else
+	if (poller->num_entries == 0) {
+		if (timeout < 0) {
+			return -EINVAL;
+		}
+#ifdef WIN32
+		Sleep(timeout);
+#else
+		usleep(timeout * 1000);
+#endif
+		return 0;
+	}
+	int n = _socket_poll_restart(poller->pfds, poller->num_entries, (timeout < 0) ? -1 : timeout);
+	if (n < 0) {
+		return n;
+	}
+	for (i = 0; i < poller->num_entries && count < max_events && n > 0; i++) {
+		if (poller->pfds[i].revents == 0) {
+			continue;
+		}
+		events[count].fd = poller->entries[i].fd;
+		events[count].user_data = poller->entries[i].user_data;
+		events[count].events = _socket_poll_revents(poller->pfds[i].revents);
+		count++;
+		n--;
+	}
+#endif
+
+	return count;
+}
@@ -47,6 +47,7 @@ int socket_connect_unix(const char *filename);
 #endif
 int socket_create(uint16_t port);
 int socket_connect_addr(struct sockaddr *addr, uint16_t port);
+int socket_connect_addrs(struct sockaddr **addrs, int num_addrs, uint16_t port);
 int socket_connect(const char *addr, uint16_t port);
 int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout);
 int socket_accept(int fd, uint16_t port);
@@ -58,9 +59,64 @@ int socket_receive(int fd, void *data, size_t size);
 int socket_peek(int fd, void *data, size_t size);
 int socket_receive_timeout(int fd, void *data, size_t size, int flags,
 					 unsigned int timeout);
+int socket_receive_nonblocking(int fd, void *data, size_t size);
+
+int socket_set_nonblocking(int fd, int nonblocking);
+int socket_set_nodelay(int fd, int nodelay);
+int socket_set_keepalive(int fd, int enable, int idle, int interval, int count);
+int socket_set_buffer_sizes(int fd, int send_size, int recv_size);
 
 int socket_send(int fd, void *data, size_t size);
 
+#ifdef HAVE_SPLICE
+int socket_splice(int fd_in, int fd_out, int pipefd[2], size_t length);
+#endif
+
+/* Maximum number of buffers accepted by socket_sendv() */
+#define SOCKET_IOV_MAX 16
+
+struct socket_iovec {
+	const void *data;
+	size_t length;
+};
+
+int socket_sendv(int fd, const struct socket_iovec *iov, int iovcnt);
+
+/* events for socket_poll() and the socket_poller_* functions */
+#define SOCKET_POLL_READ  0x1
+#define SOCKET_POLL_WRITE 0x2
+#define SOCKET_POLL_PRI   0x4
+#define SOCKET_POLL_ERROR 0x8 /* reported only: error or hangup */
+
+struct socket_pollfd {
+	int fd;
+	unsigned int events;
+	unsigned int revents;
+};
+
+/* Waits up to timeout ms (-1 = forever) for the given fds using poll(),
+ * so it works for any fd value. Returns the number of ready fds, 0 on
+ * timeout or a negative errno value. */
+int socket_poll(struct socket_pollfd *fds, int nfds, int timeout);
+
+/* Multi-fd wait backed by epoll, kqueue or poll depending on the system.
+ * fds stay registered across waits; a poller must only be used by one
+ * thread at a time. */
+typedef struct socket_poller *socket_poller_t;
+
+struct socket_poller_event {
+	int fd;
+	unsigned int events;
+	void *user_data;
+};
+
+socket_poller_t socket_poller_new(void);
+void socket_poller_free(socket_poller_t poller);
+int socket_poller_add(socket_poller_t poller, int fd, unsigned int events, void *user_data);
+int socket_poller_modify(socket_poller_t poller, int fd, unsigned int events, void *user_data);
+int socket_poller_remove(socket_poller_t poller, int fd);
+int socket_poller_wait(socket_poller_t poller, struct socket_poller_event *events, int max_events, int timeout);
+
 void socket_set_verbose(int level);
 
 const char *socket_addr_to_string(struct sockaddr *addr, char *addr_out, size_t addr_out_size);
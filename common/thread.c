@@ -22,8 +22,21 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <stdlib.h>
+#include <stdint.h>
 #include "thread.h"
 
+#ifndef WIN32
+#include <sys/time.h>
+#include <errno.h>
+#endif
+
+/* time after which surplus idle pool workers exit */
+#define THREADPOOL_IDLE_TIMEOUT 30000
+/* limits of the pool returned by threadpool_get_shared() */
+#define THREADPOOL_SHARED_MAX_THREADS 64
+#define THREADPOOL_SHARED_QUEUE_SIZE 1024
+
 int thread_new(THREAD_T *thread, thread_func_t thread_func, void* data)
 {
 #ifdef WIN32
@@ -74,6 +87,15 @@ int thread_alive(THREAD_T thread)
 #endif
 }
 
+int thread_is_self(THREAD_T thread)
+{
+#ifdef WIN32
+	return GetThreadId(thread) == GetCurrentThreadId();
+#else
+	return pthread_equal(thread, pthread_self());
+#endif
+}
+
 int thread_cancel(THREAD_T thread)
 {
 #ifdef WIN32
@@ -114,6 +136,15 @@ void mutex_lock(mutex_t* mutex)
 #endif
 }
 
+int mutex_trylock(mutex_t* mutex)
+{
+#ifdef WIN32
+	return (TryEnterCriticalSection(mutex)) ? 0 : -1;
+#else
+	return pthread_mutex_trylock(mutex);
+#endif
+}
+
 void mutex_unlock(mutex_t* mutex)
 {
 #ifdef WIN32
@@ -123,6 +154,60 @@ void mutex_unlock(mutex_t* mutex)
 #endif
 }
 
+void rwlock_init(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	InitializeSRWLock(rwlock);
+#else
+	pthread_rwlock_init(rwlock, NULL);
+#endif
+}
+
+void rwlock_destroy(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	/* SRW locks need no cleanup */
+#else
+	pthread_rwlock_destroy(rwlock);
+#endif
+}
+
+void rwlock_rdlock(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	AcquireSRWLockShared(rwlock);
+#else
+	pthread_rwlock_rdlock(rwlock);
+#endif
+}
+
+void rwlock_rdunlock(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	ReleaseSRWLockShared(rwlock);
+#else
+	pthread_rwlock_unlock(rwlock);
+#endif
+}
+
+void rwlock_wrlock(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	AcquireSRWLockExclusive(rwlock);
+#else
+	pthread_rwlock_wrlock(rwlock);
+#endif
+}
+
+void rwlock_wrunlock(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	ReleaseSRWLockExclusive(rwlock);
+#else
+	pthread_rwlock_unlock(rwlock);
+#endif
+}
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 {
 #ifdef WIN32
@@ -138,3 +223,522 @@ void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 	pthread_once(once_control, init_routine);
 #endif
 }
+
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	cond->sem = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifdef WIN32
+	CloseHandle(cond->sem);
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
+
+int cond_signal(cond_t* cond)
+{
+#ifdef WIN32
+	return SetEvent(cond->sem) ? 0 : -1;
+#else
+	return pthread_cond_signal(cond);
+#endif
+}
+
+int cond_wait(cond_t* cond, mutex_t* mutex)
+{
+#ifdef WIN32
+	mutex_unlock(mutex);
+	DWORD res = WaitForSingleObject(cond->sem, INFINITE);
+	mutex_lock(mutex);
+	return (res == WAIT_OBJECT_0) ? 0 : -1;
+#else
+	return pthread_cond_wait(cond, mutex);
+#endif
+}
+
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms)
+{
+#ifdef WIN32
+	mutex_unlock(mutex);
+	DWORD res = WaitForSingleObject(cond->sem, timeout_ms);
+	mutex_lock(mutex);
+	return (res == WAIT_OBJECT_0) ? 0 : -1;
+#else
+	struct timespec ts;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	ts.tv_sec = now.tv_sec + timeout_ms / 1000;
+	ts.tv_nsec = now.tv_usec * 1000 + 1000000 * (timeout_ms % 1000);
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+
+	return pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
+
+static uint64_t thread_time_ms(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount64();
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+#endif
+}
+
+struct workqueue_cell {
+	volatile size_t seq;
+	thread_work_func_t func;
+	void* data;
+};
+
+/* bounded MPMC queue as described by Dmitry Vyukov: each cell carries a
+ * sequence number telling producers and consumers whose turn it is */
+struct workqueue {
+	struct workqueue_cell* cells;
+	size_t mask;
+	volatile size_t enqueue_pos;
+	char pad[64];
+	volatile size_t dequeue_pos;
+};
+
+workqueue_t workqueue_new(unsigned int capacity)
+{
+	size_t size = 2;
+	size_t i;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	workqueue_t queue = (workqueue_t)calloc(1, sizeof(struct workqueue));
+	if (!queue) {
+		return NULL;
+	}
+	queue->cells = (struct workqueue_cell*)calloc(size, sizeof(struct workqueue_cell));
+	if (!queue->cells) {
+		free(queue);
+		return NULL;
+	}
+	for (i = 0; i < size; i++) {
+		queue->cells[i].seq = i;
+	}
+	queue->mask = size - 1;
+	return queue;
+}
+
+void workqueue_free(workqueue_t queue)
+{
+	if (!queue) {
+		return;
+	}
+	free(queue->cells);
+	free(queue);
+}
+
+int workqueue_push(workqueue_t queue, thread_work_func_t func, void* data)
+{
+	struct workqueue_cell* cell;
+	size_t pos = queue->enqueue_pos;
+	while (1) {
+		cell = &queue->cells[pos & queue->mask];
+		size_t seq = cell->seq;
+		__sync_synchronize();
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&queue->enqueue_pos, pos, pos + 1)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* full */
+			return -1;
+		}
+		pos = queue->enqueue_pos;
+	}
+	cell->func = func;
+	cell->data = data;
+	__sync_synchronize();
+	cell->seq = pos + 1;
+	return 0;
+}
+
+int workqueue_pop(workqueue_t queue, thread_work_func_t* func, void** data)
+{
+	struct workqueue_cell* cell;
+	size_t pos = queue->dequeue_pos;
+	while (1) {
+		cell = &queue->cells[pos & queue->mask];
+		size_t seq = cell->seq;
+		__sync_synchronize();
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&queue->dequeue_pos, pos, pos + 1)) {
+				break;
+			}
+		} else if (dif < 0) {
+			/* empty */
+			return -1;
+		}
+		pos = queue->dequeue_pos;
+	}
+	*func = cell->func;
+	*data = cell->data;
+	__sync_synchronize();
+	cell->seq = pos + queue->mask + 1;
+	return 0;
+}
+
+unsigned int workqueue_length(workqueue_t queue)
+{
+	size_t dequeue = atomic_read(&queue->dequeue_pos);
+	size_t enqueue = atomic_read(&queue->enqueue_pos);
+	/* both positions move independently, clamp transient underflows */
+	return (enqueue > dequeue) ? (unsigned int)(enqueue - dequeue) : 0;
+}
+
+struct threadpool_timer {
+	threadpool_t pool;
+	uint64_t deadline;
+	unsigned int interval;
+	thread_work_func_t func;
+	void* data;
+	int running;
+	int scheduled;
+	struct threadpool_timer* next;
+};
+
+struct threadpool {
+	workqueue_t queue;
+	mutex_t mutex;
+	cond_t work_cond;
+	cond_t exit_cond;
+	unsigned int min_threads;
+	unsigned int max_threads;
+	volatile unsigned int num_threads;
+	volatile unsigned int idle_threads;
+	int shutdown;
+	/* timers sorted by deadline, served by timer_thread */
+	mutex_t timer_mutex;
+	cond_t timer_cond;
+	cond_t timer_done_cond;
+	struct threadpool_timer* timers;
+	THREAD_T timer_thread;
+	int timer_shutdown;
+};
+
+static void* threadpool_worker(void* arg)
+{
+	threadpool_t pool = (threadpool_t)arg;
+	thread_work_func_t func = NULL;
+	void* data = NULL;
+
+	while (1) {
+		/* lock-free fast path while there is work */
+		if (workqueue_pop(pool->queue, &func, &data) == 0) {
+			func(data);
+			continue;
+		}
+
+		mutex_lock(&pool->mutex);
+		/* announce being idle before checking the queue again, so a
+		 * concurrent threadpool_submit() either sees us or we see its item */
+		atomic_add_fetch(&pool->idle_threads, 1);
+		if (workqueue_pop(pool->queue, &func, &data) == 0) {
+			atomic_sub_fetch(&pool->idle_threads, 1);
+			mutex_unlock(&pool->mutex);
+			func(data);
+			continue;
+		}
+		if (pool->shutdown) {
+			atomic_sub_fetch(&pool->idle_threads, 1);
+			break;
+		}
+		int res = cond_wait_timeout(&pool->work_cond, &pool->mutex, THREADPOOL_IDLE_TIMEOUT);
+		atomic_sub_fetch(&pool->idle_threads, 1);
+		if (res != 0 && !pool->shutdown && pool->num_threads > pool->min_threads) {
+			if (workqueue_pop(pool->queue, &func, &data) == 0) {
+				mutex_unlock(&pool->mutex);
+				func(data);
+				continue;
+			}
+			break;
+		}
+		mutex_unlock(&pool->mutex);
+	}
+
+	/* still holding pool->mutex */
+	pool->num_threads--;
+	if (pool->shutdown) {
+		/* pass the wakeup on to the next idle worker */
+		cond_signal(&pool->work_cond);
+		cond_signal(&pool->exit_cond);
+	}
+	mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+threadpool_t threadpool_new(unsigned int min_threads, unsigned int max_threads, unsigned int queue_size)
+{
+	if (max_threads == 0 || min_threads > max_threads) {
+		return NULL;
+	}
+	threadpool_t pool = (threadpool_t)calloc(1, sizeof(struct threadpool));
+	if (!pool) {
+		return NULL;
+	}
+	pool->queue = workqueue_new(queue_size);
+	if (!pool->queue) {
+		free(pool);
+		return NULL;
+	}
+	mutex_init(&pool->mutex);
+	cond_init(&pool->work_cond);
+	cond_init(&pool->exit_cond);
+	mutex_init(&pool->timer_mutex);
+	cond_init(&pool->timer_cond);
+	cond_init(&pool->timer_done_cond);
+	pool->min_threads = min_threads;
+	pool->max_threads = max_threads;
+	pool->timer_thread = THREAD_T_NULL;
+	return pool;
+}
+
+void threadpool_free(threadpool_t pool)
+{
+	if (!pool) {
+		return;
+	}
+
+	mutex_lock(&pool->timer_mutex);
+	pool->timer_shutdown = 1;
+	cond_signal(&pool->timer_cond);
+	mutex_unlock(&pool->timer_mutex);
+	if (pool->timer_thread) {
+		thread_join(pool->timer_thread);
+		thread_free(pool->timer_thread);
+	}
+
+	/* workers run the queued items before they exit */
+	mutex_lock(&pool->mutex);
+	pool->shutdown = 1;
+	cond_signal(&pool->work_cond);
+	while (pool->num_threads > 0) {
+		cond_wait(&pool->exit_cond, &pool->mutex);
+	}
+	mutex_unlock(&pool->mutex);
+
+	cond_destroy(&pool->timer_done_cond);
+	cond_destroy(&pool->timer_cond);
+	mutex_destroy(&pool->timer_mutex);
+	cond_destroy(&pool->exit_cond);
+	cond_destroy(&pool->work_cond);
+	mutex_destroy(&pool->mutex);
+	workqueue_free(pool->queue);
+	free(pool);
+}
+
+int threadpool_submit(threadpool_t pool, thread_work_func_t func, void* data)
+{
+	if (!pool || !func || pool->shutdown) {
+		return -1;
+	}
+	if (workqueue_push(pool->queue, func, data) != 0) {
+		return -1;
+	}
+
+	mutex_lock(&pool->mutex);
+	if (pool->idle_threads > 0) {
+		cond_signal(&pool->work_cond);
+	} else if (pool->num_threads < pool->max_threads) {
+		THREAD_T thread;
+		if (thread_new(&thread, threadpool_worker, pool) == 0) {
+			thread_detach(thread);
+			pool->num_threads++;
+		} else if (pool->num_threads == 0) {
+			/* nobody would ever pick up the item, run the queue here */
+			mutex_unlock(&pool->mutex);
+			while (workqueue_pop(pool->queue, &func, &data) == 0) {
+				func(data);
+			}
+			return 0;
+		}
+	}
+	mutex_unlock(&pool->mutex);
+
+	return 0;
+}
+
+void threadpool_get_stats(threadpool_t pool, unsigned int* queued, unsigned int* threads, unsigned int* idle)
+{
+	if (queued) {
+		*queued = (pool) ? workqueue_length(pool->queue) : 0;
+	}
+	if (threads) {
+		*threads = (pool) ? atomic_read(&pool->num_threads) : 0;
+	}
+	if (idle) {
+		*idle = (pool) ? atomic_read(&pool->idle_threads) : 0;
+	}
+}
+
+static threadpool_t shared_pool = NULL;
+static thread_once_t shared_pool_once = THREAD_ONCE_INIT;
+
+static void threadpool_shared_init(void)
+{
+	shared_pool = threadpool_new(0, THREADPOOL_SHARED_MAX_THREADS, THREADPOOL_SHARED_QUEUE_SIZE);
+}
+
+threadpool_t threadpool_get_shared(void)
+{
+	thread_once(&shared_pool_once, threadpool_shared_init);
+	return shared_pool;
+}
+
+/* must be called with pool->timer_mutex held */
+static void threadpool_timer_insert(threadpool_t pool, threadpool_timer_t timer)
+{
+	struct threadpool_timer** p = &pool->timers;
+	while (*p && (*p)->deadline <= timer->deadline) {
+		p = &(*p)->next;
+	}
+	timer->next = *p;
+	*p = timer;
+	timer->scheduled = 1;
+}
+
+/* must be called with pool->timer_mutex held */
+static void threadpool_timer_unlink(threadpool_t pool, threadpool_timer_t timer)
+{
+	struct threadpool_timer** p = &pool->timers;
+	while (*p && *p != timer) {
+		p = &(*p)->next;
+	}
+	if (*p) {
+		*p = timer->next;
+	}
+	timer->next = NULL;
+	timer->scheduled = 0;
+}
+
+static void threadpool_timer_run(void* data)
+{
+	threadpool_timer_t timer = (threadpool_timer_t)data;
+	threadpool_t pool = timer->pool;
+
+	timer->func(timer->data);
+
+	mutex_lock(&pool->timer_mutex);
+	timer->running--;
+	cond_signal(&pool->timer_done_cond);
+	mutex_unlock(&pool->timer_mutex);
+}
+
+static void* threadpool_timer_thread(void* arg)
+{
+	threadpool_t pool = (threadpool_t)arg;
+
+	mutex_lock(&pool->timer_mutex);
+	while (!pool->timer_shutdown) {
+		threadpool_timer_t timer = pool->timers;
+		if (!timer) {
+			cond_wait(&pool->timer_cond, &pool->timer_mutex);
+			continue;
+		}
+		uint64_t now = thread_time_ms();
+		if (timer->deadline > now) {
+			cond_wait_timeout(&pool->timer_cond, &pool->timer_mutex, (unsigned int)(timer->deadline - now));
+			continue;
+		}
+
+		threadpool_timer_unlink(pool, timer);
+		if (timer->running) {
+			/* previous run still in progress, skip this one */
+		} else {
+			timer->running++;
+			if (threadpool_submit(pool, threadpool_timer_run, timer) != 0) {
+				timer->running--;
+				if (!timer->interval) {
+					/* queue full, retry shortly */
+					timer->deadline = now + 10;
+					threadpool_timer_insert(pool, timer);
+				}
+			}
+		}
+		if (timer->interval) {
+			timer->deadline += timer->interval;
+			if (timer->deadline <= now) {
+				timer->deadline = now + timer->interval;
+			}
+			threadpool_timer_insert(pool, timer);
+		}
+	}
+	mutex_unlock(&pool->timer_mutex);
+
+	return NULL;
+}
+
+threadpool_timer_t threadpool_timer_add(threadpool_t pool, unsigned int delay_ms, unsigned int interval_ms, thread_work_func_t func, void* data)
+{
+	if (!pool || !func) {
+		return NULL;
+	}
+	threadpool_timer_t timer = (threadpool_timer_t)calloc(1, sizeof(struct threadpool_timer));
+	if (!timer) {
+		return NULL;
+	}
+	timer->pool = pool;
+	timer->deadline = thread_time_ms() + delay_ms;
+	timer->interval = interval_ms;
+	timer->func = func;
+	timer->data = data;
+
+	mutex_lock(&pool->timer_mutex);
+	if (pool->timer_shutdown) {
+		mutex_unlock(&pool->timer_mutex);
+		free(timer);
+		return NULL;
+	}
+	if (!pool->timer_thread) {
+		if (thread_new(&pool->timer_thread, threadpool_timer_thread, pool) != 0) {
+			pool->timer_thread = THREAD_T_NULL;
+			mutex_unlock(&pool->timer_mutex);
+			free(timer);
+			return NULL;
+		}
+	}
+	threadpool_timer_insert(pool, timer);
+	cond_signal(&pool->timer_cond);
+	mutex_unlock(&pool->timer_mutex);
+
+	return timer;
+}
+
+void threadpool_timer_cancel(threadpool_timer_t timer)
+{
+	if (!timer) {
+		return;
+	}
+	threadpool_t pool = timer->pool;
+
+	mutex_lock(&pool->timer_mutex);
+	if (timer->scheduled) {
+		threadpool_timer_unlink(pool, timer);
+	}
+	timer->interval = 0;
+	/* wait for a run in progress; several cancels may share the cond */
+	while (timer->running) {
+		cond_wait_timeout(&pool->timer_done_cond, &pool->timer_mutex, 10);
+	}
+	mutex_unlock(&pool->timer_mutex);
+
+	free(timer);
+}
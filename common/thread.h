@@ -28,6 +28,10 @@
 #include <windows.h>
 typedef HANDLE THREAD_T;
 typedef CRITICAL_SECTION mutex_t;
+typedef SRWLOCK rwlock_t;
+typedef struct {
+	HANDLE sem;
+} cond_t;
 typedef volatile struct {
 	LONG lock;
 	int state;
@@ -35,15 +39,21 @@ typedef volatile struct {
 #define THREAD_ONCE_INIT {0, 0}
 #define THREAD_ID GetCurrentThreadId()
 #define THREAD_T_NULL (THREAD_T)NULL
+typedef DWORD thread_id_t;
+#define thread_id_equal(a, b) ((a) == (b))
 #else
 #include <pthread.h>
 #include <signal.h>
 typedef pthread_t THREAD_T;
 typedef pthread_mutex_t mutex_t;
+typedef pthread_rwlock_t rwlock_t;
+typedef pthread_cond_t cond_t;
 typedef pthread_once_t thread_once_t;
 #define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define THREAD_ID pthread_self()
 #define THREAD_T_NULL (THREAD_T)NULL
+typedef pthread_t thread_id_t;
+#define thread_id_equal(a, b) pthread_equal(a, b)
 #endif
 
 typedef void* (*thread_func_t)(void* data);
@@ -53,6 +63,7 @@ void thread_detach(THREAD_T thread);
 void thread_free(THREAD_T thread);
 int thread_join(THREAD_T thread);
 int thread_alive(THREAD_T thread);
+int thread_is_self(THREAD_T thread);
 
 int thread_cancel(THREAD_T thread);
 
@@ -69,8 +80,63 @@ int thread_cancel(THREAD_T thread);
 void mutex_init(mutex_t* mutex);
 void mutex_destroy(mutex_t* mutex);
 void mutex_lock(mutex_t* mutex);
+/* returns 0 if the mutex was acquired, non-zero if it is held elsewhere */
+int mutex_trylock(mutex_t* mutex);
 void mutex_unlock(mutex_t* mutex);
 
+/* reader-writer lock, read locks are shared and not recursive */
+void rwlock_init(rwlock_t* rwlock);
+void rwlock_destroy(rwlock_t* rwlock);
+void rwlock_rdlock(rwlock_t* rwlock);
+void rwlock_rdunlock(rwlock_t* rwlock);
+void rwlock_wrlock(rwlock_t* rwlock);
+void rwlock_wrunlock(rwlock_t* rwlock);
+
+/* atomic operations with full memory barriers on integer and pointer sized
+ * variables */
+#define atomic_add_fetch(ptr, val) __sync_add_and_fetch(ptr, val)
+#define atomic_sub_fetch(ptr, val) __sync_sub_and_fetch(ptr, val)
+#define atomic_read(ptr) __sync_add_and_fetch(ptr, 0)
+#define atomic_write(ptr, val) do { __sync_synchronize(); *(ptr) = (val); __sync_synchronize(); } while (0)
+#define atomic_cmpxchg(ptr, oldval, newval) __sync_bool_compare_and_swap(ptr, oldval, newval)
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void));
 
+void cond_init(cond_t* cond);
+void cond_destroy(cond_t* cond);
+int cond_signal(cond_t* cond);
+int cond_wait(cond_t* cond, mutex_t* mutex);
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms);
+
+/* Bounded lock-free multi-producer/multi-consumer queue of work items */
+typedef void (*thread_work_func_t)(void* data);
+typedef struct workqueue* workqueue_t;
+
+workqueue_t workqueue_new(unsigned int capacity);
+void workqueue_free(workqueue_t queue);
+int workqueue_push(workqueue_t queue, thread_work_func_t func, void* data);
+int workqueue_pop(workqueue_t queue, thread_work_func_t* func, void** data);
+unsigned int workqueue_length(workqueue_t queue);
+
+/* Pool of worker threads running work items from a workqueue. Workers are
+ * started on demand up to max_threads and exit again after having been idle
+ * for a while, keeping at least min_threads around. */
+typedef struct threadpool* threadpool_t;
+typedef struct threadpool_timer* threadpool_timer_t;
+
+threadpool_t threadpool_new(unsigned int min_threads, unsigned int max_threads, unsigned int queue_size);
+void threadpool_free(threadpool_t pool);
+int threadpool_submit(threadpool_t pool, thread_work_func_t func, void* data);
+threadpool_t threadpool_get_shared(void);
+/* Snapshot of a pool's queue depth and worker counts; any pointer may be
+ * NULL. The values are racy by nature and meant for monitoring only. */
+void threadpool_get_stats(threadpool_t pool, unsigned int* queued, unsigned int* threads, unsigned int* idle);
+
+/* Runs func on the pool after delay_ms and then every interval_ms if
+ * interval_ms is not 0. A timer stays valid until threadpool_timer_cancel(),
+ * which must be called once for every timer, also for fired one-shot
+ * timers, but not from the timer callback itself. */
+threadpool_timer_t threadpool_timer_add(threadpool_t pool, unsigned int delay_ms, unsigned int interval_ms, thread_work_func_t func, void* data);
+void threadpool_timer_cancel(threadpool_timer_t timer);
+
 #endif
@@ -0,0 +1,196 @@
+/*
+ * trace.c
+ * Binary ring buffer event tracer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+#include "trace.h"
+
+#define TRACE_MAX_EVENTS (1 << 20)
+
+int internal_trace_enabled = 0;
+
+/* The buffer is allocated once on first enable and never freed, so
+ * writers racing with idevice_trace_enable() never see a dangling pointer.
+ * Each slot's seq is written last; readers drop slots whose seq changed
+ * while they were copied. */
+static idevice_trace_event_t *trace_buffer = NULL;
+static uint32_t trace_mask = 0;
+static uint64_t trace_head = 0;
+
+static const char *trace_event_names[TRACE_NUM_EVENTS] = {
+	"none",
+	"connection_send",
+	"connection_receive",
+	"ssl_read",
+	"ssl_write",
+	"plist_send",
+	"plist_receive",
+	"afc_lock",
+	"afc_unlock",
+	"afc_packet_send",
+	"afc_packet_receive"
+};
+
+static uint64_t trace_timestamp(void)
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+void trace_event_real(uint32_t event, uint64_t a, uint64_t b, uint64_t c)
+{
+	idevice_trace_event_t *buffer = trace_buffer;
+	if (!buffer) {
+		return;
+	}
+
+	uint64_t index = __sync_fetch_and_add(&trace_head, 1);
+	idevice_trace_event_t *slot = &buffer[index & trace_mask];
+
+	slot->seq = 0;
+	__sync_synchronize();
+	slot->timestamp = trace_timestamp();
+	slot->event = event;
+	slot->args[0] = a;
+	slot->args[1] = b;
+	slot->args[2] = c;
+	__sync_synchronize();
+	slot->seq = (uint32_t)(index + 1);
+}
+
+void internal_trace_enable(uint32_t num_events)
+{
+	if (num_events == 0) {
+		internal_trace_enabled = 0;
+		return;
+	}
+
+	if (!trace_buffer) {
+		uint32_t size = 64;
+		if (num_events > TRACE_MAX_EVENTS) {
+			num_events = TRACE_MAX_EVENTS;
+		}
+		while (size < num_events) {
+			size <<= 1;
+		}
+		idevice_trace_event_t *buffer = (idevice_trace_event_t*)calloc(size, sizeof(idevice_trace_event_t));
+		if (!buffer) {
+			return;
+		}
+		trace_mask = size - 1;
+		__sync_synchronize();
+		if (!__sync_bool_compare_and_swap(&trace_buffer, NULL, buffer)) {
+			free(buffer);
+		}
+	}
+
+	__sync_synchronize();
+	internal_trace_enabled = 1;
+}
+
+uint32_t internal_trace_snapshot(idevice_trace_event_t *events, uint32_t max_events)
+{
+	idevice_trace_event_t *buffer = trace_buffer;
+	if (!buffer || !events || max_events == 0) {
+		return 0;
+	}
+
+	uint64_t head = __sync_add_and_fetch(&trace_head, 0);
+	uint64_t size = (uint64_t)trace_mask + 1;
+	uint64_t first = (head > size) ? head - size : 0;
+	if (head - first > max_events) {
+		first = head - max_events;
+	}
+
+	uint32_t count = 0;
+	uint64_t i;
+	for (i = first; i < head; i++) {
+		idevice_trace_event_t *slot = &buffer[i & trace_mask];
+		uint32_t seq = slot->seq;
+		__sync_synchronize();
+		events[count] = *slot;
+		__sync_synchronize();
+		if (seq != (uint32_t)(i + 1) || slot->seq != seq) {
+			/* not yet written or overwritten while copying */
+			continue;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+const char *internal_trace_event_name(uint32_t event)
+{
+	if (event >= TRACE_NUM_EVENTS) {
+		return "unknown";
+	}
+	return trace_event_names[event];
+}
+
+int internal_trace_dump(FILE *stream)
+{
+	uint32_t max_events = trace_mask + 1;
+	if (!trace_buffer || !stream) {
+		return -1;
+	}
+
+	idevice_trace_event_t *events = (idevice_trace_event_t*)malloc(sizeof(idevice_trace_event_t) * max_events);
+	if (!events) {
+		return -1;
+	}
+
+	uint32_t count = internal_trace_snapshot(events, max_events);
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		fprintf(stream, "%" PRIu64 ".%06" PRIu64 " #%u %s %" PRId64 " %" PRId64 " %" PRId64 "\n",
+			events[i].timestamp / 1000000, events[i].timestamp % 1000000, events[i].seq,
+			internal_trace_event_name(events[i].event),
+			(int64_t)events[i].args[0], (int64_t)events[i].args[1], (int64_t)events[i].args[2]);
+	}
+	free(events);
+
+	return (int)count;
+}
@@ -0,0 +1,59 @@
+/*
+ * trace.h
+ * Binary ring buffer event tracer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "libimobiledevice/libimobiledevice.h"
+
+/* event ids, keep in sync with trace_event_names in trace.c */
+enum trace_event_id {
+	TRACE_NONE = 0,
+	TRACE_CONNECTION_SEND,    /* bytes requested, bytes sent, result */
+	TRACE_CONNECTION_RECEIVE, /* bytes requested, bytes received, result */
+	TRACE_SSL_READ,           /* bytes requested, bytes read, result */
+	TRACE_SSL_WRITE,          /* bytes requested, bytes written, result */
+	TRACE_PLIST_SEND,         /* total length, number of plists, result */
+	TRACE_PLIST_RECEIVE,      /* payload length, result */
+	TRACE_AFC_LOCK,           /* client address */
+	TRACE_AFC_UNLOCK,         /* client address */
+	TRACE_AFC_PACKET_SEND,    /* operation, packet number, total length */
+	TRACE_AFC_PACKET_RECEIVE, /* operation, packet number, total length */
+	TRACE_NUM_EVENTS
+};
+
+/* checked inline by trace_event() so disabled tracing costs one load */
+extern int internal_trace_enabled;
+
+#ifndef STRIP_TRACE_CODE
+#define trace_event(id, a, b, c) do { if (internal_trace_enabled) trace_event_real(id, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c)); } while (0)
+#else
+#define trace_event(id, a, b, c)
+#endif
+
+void trace_event_real(uint32_t event, uint64_t a, uint64_t b, uint64_t c);
+
+void internal_trace_enable(uint32_t num_events);
+uint32_t internal_trace_snapshot(idevice_trace_event_t *events, uint32_t max_events);
+const char *internal_trace_event_name(uint32_t event);
+int internal_trace_dump(FILE *stream);
+
+#endif
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
@@ -67,6 +68,7 @@
 #include "userpref.h"
 #include "debug.h"
 #include "utils.h"
+#include "thread.h"
 
 #ifndef HAVE_OPENSSL
 const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
@@ -186,11 +188,85 @@ const char *userpref_get_config_dir()
  *   SystemBUID upon successful return.
  * @return 0 if the SystemBUID has been successfully retrieved or < 0 otherwise.
  */
+/* Seconds a cached pair record or system BUID is used before it is read
+ * again from usbmuxd, to pick up changes made by other processes */
+#define USERPREF_CACHE_TTL 30
+
+struct pair_record_cache_entry {
+	char *udid;
+	plist_t record;
+	time_t timestamp;
+	struct pair_record_cache_entry *next;
+};
+
+static struct pair_record_cache_entry *pair_record_cache = NULL;
+static char *system_buid_cache = NULL;
+static time_t system_buid_timestamp = 0;
+static mutex_t userpref_cache_mutex;
+static thread_once_t userpref_cache_once = THREAD_ONCE_INIT;
+
+static void userpref_cache_init(void)
+{
+	mutex_init(&userpref_cache_mutex);
+}
+
+/**
+ * Drops the cached pair record of a device so that it is read from
+ * usbmuxd again on next access. This should be called whenever a pair
+ * record might have changed outside of this process, e.g. on a device
+ * paired event.
+ *
+ * @param udid The udid of the device, or NULL to drop all cached pair
+ *     records and the cached system BUID.
+ */
+void userpref_invalidate_pair_record(const char *udid)
+{
+	struct pair_record_cache_entry **link;
+
+	thread_once(&userpref_cache_once, userpref_cache_init);
+
+	mutex_lock(&userpref_cache_mutex);
+	link = &pair_record_cache;
+	while (*link) {
+		struct pair_record_cache_entry *entry = *link;
+		if (!udid || !strcmp(entry->udid, udid)) {
+			*link = entry->next;
+			free(entry->udid);
+			plist_free(entry->record);
+			free(entry);
+		} else {
+			link = &entry->next;
+		}
+	}
+	if (!udid) {
+		free(system_buid_cache);
+		system_buid_cache = NULL;
+	}
+	mutex_unlock(&userpref_cache_mutex);
+}
+
 int userpref_read_system_buid(char **system_buid)
 {
-	int res = usbmuxd_read_buid(system_buid);
+	int res;
+
+	thread_once(&userpref_cache_once, userpref_cache_init);
+
+	mutex_lock(&userpref_cache_mutex);
+	if (system_buid_cache && (time(NULL) - system_buid_timestamp) < USERPREF_CACHE_TTL) {
+		*system_buid = strdup(system_buid_cache);
+		mutex_unlock(&userpref_cache_mutex);
+		return 0;
+	}
+	mutex_unlock(&userpref_cache_mutex);
+
+	res = usbmuxd_read_buid(system_buid);
 	if (res == 0) {
 		debug_info("using %s as %s", *system_buid, USERPREF_SYSTEM_BUID_KEY);
+		mutex_lock(&userpref_cache_mutex);
+		free(system_buid_cache);
+		system_buid_cache = strdup(*system_buid);
+		system_buid_timestamp = time(NULL);
+		mutex_unlock(&userpref_cache_mutex);
 	} else {
 		debug_info("could not read system buid, error %d", res);
 	}
@@ -291,6 +367,8 @@ userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id,
 
 	free(record_data);
 
+	userpref_invalidate_pair_record(udid);
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -307,6 +385,22 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
 {
 	char* record_data = NULL;
 	uint32_t record_size = 0;
+	struct pair_record_cache_entry *entry;
+
+	thread_once(&userpref_cache_once, userpref_cache_init);
+
+	mutex_lock(&userpref_cache_mutex);
+	for (entry = pair_record_cache; udid && entry; entry = entry->next) {
+		if (!strcmp(entry->udid, udid)) {
+			if ((time(NULL) - entry->timestamp) < USERPREF_CACHE_TTL) {
+				*pair_record = plist_copy(entry->record);
+				mutex_unlock(&userpref_cache_mutex);
+				return USERPREF_E_SUCCESS;
+			}
+			break;
+		}
+	}
+	mutex_unlock(&userpref_cache_mutex);
 
 	int res = usbmuxd_read_pair_record(udid, &record_data, &record_size);
 
@@ -326,6 +420,28 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
 
 	free(record_data);
 
+	if (res == 0 && *pair_record && udid) {
+		mutex_lock(&userpref_cache_mutex);
+		for (entry = pair_record_cache; entry; entry = entry->next) {
+			if (!strcmp(entry->udid, udid))
+				break;
+		}
+		if (!entry) {
+			entry = (struct pair_record_cache_entry*)calloc(1, sizeof(struct pair_record_cache_entry));
+			if (entry) {
+				entry->udid = strdup(udid);
+				entry->next = pair_record_cache;
+				pair_record_cache = entry;
+			}
+		}
+		if (entry) {
+			plist_free(entry->record);
+			entry->record = plist_copy(*pair_record);
+			entry->timestamp = time(NULL);
+		}
+		mutex_unlock(&userpref_cache_mutex);
+	}
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -340,6 +456,8 @@ userpref_error_t userpref_delete_pair_record(const char *udid)
 {
 	int res = usbmuxd_delete_pair_record(udid);
 
+	userpref_invalidate_pair_record(udid);
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -366,28 +484,231 @@ static int X509_add_ext_helper(X509 *cert, int nid, char *value)
 }
 #endif
 
+struct pair_host_credentials {
+	key_data_t root_key_pem;
+	key_data_t root_cert_pem;
+	key_data_t host_key_pem;
+	key_data_t host_cert_pem;
+};
+
+/* Upper limits for userpref_key_pool_configure() */
+#define USERPREF_KEY_POOL_MAX_SIZE 256
+#define USERPREF_KEY_POOL_MAX_WORKERS 16
+
+static struct pair_host_credentials *key_pool = NULL;
+static unsigned int key_pool_size = 0;
+static unsigned int key_pool_count = 0;
+static unsigned int key_pool_num_workers = 0;
+static THREAD_T key_pool_workers[USERPREF_KEY_POOL_MAX_WORKERS];
+static int key_pool_stop = 0;
+static mutex_t key_pool_mutex;
+static cond_t key_pool_cond;
+static thread_once_t key_pool_once = THREAD_ONCE_INIT;
+
+static void key_pool_init(void)
+{
+	mutex_init(&key_pool_mutex);
+	cond_init(&key_pool_cond);
+}
+
+static userpref_error_t pair_host_credentials_generate(struct pair_host_credentials *creds);
+static void pair_host_credentials_free(struct pair_host_credentials *creds);
+
 /**
- * Private function to generate required private keys and certificates.
- *
- * @param pair_record a #PLIST_DICT that will be filled with the keys
- *   and certificates
- * @param public_key the public key to use (device public key)
+ * Worker thread that keeps the key pool filled.
+ */
+static void* key_pool_worker(void *data)
+{
+	mutex_lock(&key_pool_mutex);
+	while (!key_pool_stop) {
+		if (key_pool_count >= key_pool_size) {
+			cond_wait_timeout(&key_pool_cond, &key_pool_mutex, 1000);
+			continue;
+		}
+		mutex_unlock(&key_pool_mutex);
+
+		struct pair_host_credentials creds;
+		userpref_error_t res = pair_host_credentials_generate(&creds);
+
+		mutex_lock(&key_pool_mutex);
+		if (res != USERPREF_E_SUCCESS) {
+			debug_info("ERROR: Failed to pre-generate host credentials");
+			cond_wait_timeout(&key_pool_cond, &key_pool_mutex, 1000);
+			continue;
+		}
+		if (key_pool_stop || key_pool_count >= key_pool_size) {
+			pair_host_credentials_free(&creds);
+			continue;
+		}
+		key_pool[key_pool_count++] = creds;
+		/* wake up userpref_key_pool_wait() */
+		cond_signal(&key_pool_cond);
+	}
+	mutex_unlock(&key_pool_mutex);
+
+	return NULL;
+}
+
+/**
+ * Takes pre-generated host credentials from the key pool.
  *
- * @return 1 if keys were successfully generated, 0 otherwise
+ * @return 1 if creds has been filled from the pool, 0 if the pool is empty.
  */
-userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key)
+static int pair_key_pool_take(struct pair_host_credentials *creds)
 {
-	userpref_error_t ret = USERPREF_E_SSL_ERROR;
+	int res = 0;
 
-	key_data_t dev_cert_pem = { NULL, 0 };
-	key_data_t root_key_pem = { NULL, 0 };
-	key_data_t root_cert_pem = { NULL, 0 };
-	key_data_t host_key_pem = { NULL, 0 };
-	key_data_t host_cert_pem = { NULL, 0 };
+	thread_once(&key_pool_once, key_pool_init);
 
-	if (!pair_record || !public_key.data)
+	mutex_lock(&key_pool_mutex);
+	if (key_pool_count > 0) {
+		*creds = key_pool[--key_pool_count];
+		debug_info("using pre-generated host credentials, %d left", key_pool_count);
+		cond_signal(&key_pool_cond);
+		res = 1;
+	}
+	mutex_unlock(&key_pool_mutex);
+
+	return res;
+}
+
+/**
+ * Configures the pool of pre-generated root and host keys used for pairing.
+ * Worker threads generate keys in the background until the pool holds
+ * size entries, so a pair operation only needs to sign the device
+ * certificate.
+ *
+ * @param size The number of key sets to keep ready, or 0 to disable the
+ *     pool and free all pre-generated keys.
+ * @param workers The number of worker threads refilling the pool.
+ *
+ * @return USERPREF_E_SUCCESS on success, USERPREF_E_INVALID_ARG if size or
+ *     workers is out of range.
+ */
+userpref_error_t userpref_key_pool_configure(unsigned int size, unsigned int workers)
+{
+	unsigned int i;
+
+	if (size > USERPREF_KEY_POOL_MAX_SIZE || workers > USERPREF_KEY_POOL_MAX_WORKERS || (size > 0 && workers == 0))
 		return USERPREF_E_INVALID_ARG;
 
+	thread_once(&key_pool_once, key_pool_init);
+
+	/* stop current workers */
+	mutex_lock(&key_pool_mutex);
+	key_pool_stop = 1;
+	for (i = 0; i < key_pool_num_workers; i++) {
+		cond_signal(&key_pool_cond);
+	}
+	mutex_unlock(&key_pool_mutex);
+	for (i = 0; i < key_pool_num_workers; i++) {
+		thread_join(key_pool_workers[i]);
+		thread_free(key_pool_workers[i]);
+	}
+	key_pool_num_workers = 0;
+
+	mutex_lock(&key_pool_mutex);
+	key_pool_stop = 0;
+	/* drop surplus entries */
+	while (key_pool_count > size) {
+		pair_host_credentials_free(&key_pool[--key_pool_count]);
+	}
+	if (size != key_pool_size) {
+		struct pair_host_credentials *pool = NULL;
+		if (size > 0) {
+			pool = (struct pair_host_credentials*)realloc(key_pool, size * sizeof(struct pair_host_credentials));
+			if (!pool) {
+				mutex_unlock(&key_pool_mutex);
+				return USERPREF_E_UNKNOWN_ERROR;
+			}
+		} else {
+			free(key_pool);
+		}
+		key_pool = pool;
+		key_pool_size = size;
+	}
+	for (i = 0; i < workers && size > 0; i++) {
+		if (thread_new(&key_pool_workers[key_pool_num_workers], key_pool_worker, NULL) == 0) {
+			key_pool_num_workers++;
+		}
+	}
+	mutex_unlock(&key_pool_mutex);
+
+	return USERPREF_E_SUCCESS;
+}
+
+/**
+ * Waits until the key pool is completely filled.
+ *
+ * @param timeout Maximum time to wait in milliseconds, or 0 to wait forever.
+ *
+ * @return USERPREF_E_SUCCESS when the pool is full, USERPREF_E_INVALID_CONF if
+ *     no pool is configured, or USERPREF_E_UNKNOWN_ERROR on timeout.
+ */
+userpref_error_t userpref_key_pool_wait(unsigned int timeout)
+{
+	userpref_error_t res = USERPREF_E_SUCCESS;
+	unsigned int waited = 0;
+
+	thread_once(&key_pool_once, key_pool_init);
+
+	mutex_lock(&key_pool_mutex);
+	if (key_pool_size == 0 || key_pool_num_workers == 0) {
+		res = USERPREF_E_INVALID_CONF;
+	}
+	while (res == USERPREF_E_SUCCESS && key_pool_count < key_pool_size) {
+		if (timeout > 0 && waited >= timeout) {
+			res = USERPREF_E_UNKNOWN_ERROR;
+			break;
+		}
+		cond_wait_timeout(&key_pool_cond, &key_pool_mutex, 100);
+		waited += 100;
+	}
+	mutex_unlock(&key_pool_mutex);
+
+	return res;
+}
+
+/**
+ * Returns the configured size of the key pool, 0 if it is disabled.
+ */
+unsigned int userpref_key_pool_get_size(void)
+{
+	unsigned int size;
+
+	thread_once(&key_pool_once, key_pool_init);
+
+	mutex_lock(&key_pool_mutex);
+	size = (key_pool_num_workers > 0) ? key_pool_size : 0;
+	mutex_unlock(&key_pool_mutex);
+
+	return size;
+}
+
+/**
+ * Frees the PEM data of a set of host credentials.
+ */
+static void pair_host_credentials_free(struct pair_host_credentials *creds)
+{
+	free(creds->root_key_pem.data);
+	free(creds->root_cert_pem.data);
+	free(creds->host_key_pem.data);
+	free(creds->host_cert_pem.data);
+	memset(creds, '\0', sizeof(struct pair_host_credentials));
+}
+
+/**
+ * Generates a root key and certificate and a host key and certificate
+ * signed by the root key. This is the expensive part of pairing.
+ *
+ * @param creds The credentials to fill with the PEM encoded data
+ *
+ * @return USERPREF_E_SUCCESS on success, USERPREF_E_SSL_ERROR otherwise.
+ */
+static userpref_error_t pair_host_credentials_generate(struct pair_host_credentials *creds)
+{
+	memset(creds, '\0', sizeof(struct pair_host_credentials));
+
 	debug_info("Generating keys and certificates...");
 
 #ifdef HAVE_OPENSSL
@@ -477,46 +798,158 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 
 		membp = BIO_new(BIO_s_mem());
 		if (PEM_write_bio_X509(membp, root_cert) > 0) {
-			root_cert_pem.size = BIO_get_mem_data(membp, &bdata);
-			root_cert_pem.data = (unsigned char*)malloc(root_cert_pem.size);
-			if (root_cert_pem.data) {
-				memcpy(root_cert_pem.data, bdata, root_cert_pem.size);
+			creds->root_cert_pem.size = BIO_get_mem_data(membp, &bdata);
+			creds->root_cert_pem.data = (unsigned char*)malloc(creds->root_cert_pem.size);
+			if (creds->root_cert_pem.data) {
+				memcpy(creds->root_cert_pem.data, bdata, creds->root_cert_pem.size);
 			}
 			BIO_free(membp);
 			membp = NULL;
 		}
 		membp = BIO_new(BIO_s_mem());
 		if (PEM_write_bio_PrivateKey(membp, root_pkey, NULL, NULL, 0, 0, NULL) > 0) {
-			root_key_pem.size = BIO_get_mem_data(membp, &bdata);
-			root_key_pem.data = (unsigned char*)malloc(root_key_pem.size);
-			if (root_key_pem.data) {
-				memcpy(root_key_pem.data, bdata, root_key_pem.size);
+			creds->root_key_pem.size = BIO_get_mem_data(membp, &bdata);
+			creds->root_key_pem.data = (unsigned char*)malloc(creds->root_key_pem.size);
+			if (creds->root_key_pem.data) {
+				memcpy(creds->root_key_pem.data, bdata, creds->root_key_pem.size);
 			}
 			BIO_free(membp);
 			membp = NULL;
 		}
 		membp = BIO_new(BIO_s_mem());
 		if (PEM_write_bio_X509(membp, host_cert) > 0) {
-			host_cert_pem.size = BIO_get_mem_data(membp, &bdata);
-			host_cert_pem.data = (unsigned char*)malloc(host_cert_pem.size);
-			if (host_cert_pem.data) {
-				memcpy(host_cert_pem.data, bdata, host_cert_pem.size);
+			creds->host_cert_pem.size = BIO_get_mem_data(membp, &bdata);
+			creds->host_cert_pem.data = (unsigned char*)malloc(creds->host_cert_pem.size);
+			if (creds->host_cert_pem.data) {
+				memcpy(creds->host_cert_pem.data, bdata, creds->host_cert_pem.size);
 			}
 			BIO_free(membp);
 			membp = NULL;
 		}
 		membp = BIO_new(BIO_s_mem());
 		if (PEM_write_bio_PrivateKey(membp, host_pkey, NULL, NULL, 0, 0, NULL) > 0) {
-			host_key_pem.size = BIO_get_mem_data(membp, &bdata);
-			host_key_pem.data = (unsigned char*)malloc(host_key_pem.size);
-			if (host_key_pem.data) {
-				memcpy(host_key_pem.data, bdata, host_key_pem.size);
+			creds->host_key_pem.size = BIO_get_mem_data(membp, &bdata);
+			creds->host_key_pem.data = (unsigned char*)malloc(creds->host_key_pem.size);
+			if (creds->host_key_pem.data) {
+				memcpy(creds->host_key_pem.data, bdata, creds->host_key_pem.size);
 			}
 			BIO_free(membp);
 			membp = NULL;
 		}
 	}
 
+	X509V3_EXT_cleanup();
+
+	EVP_PKEY_free(root_pkey);
+	EVP_PKEY_free(host_pkey);
+
+	X509_free(host_cert);
+	X509_free(root_cert);
+#else
+	gnutls_x509_privkey_t root_privkey;
+	gnutls_x509_crt_t root_cert;
+	gnutls_x509_privkey_t host_privkey;
+	gnutls_x509_crt_t host_cert;
+
+	/* use less secure random to speed up key generation */
+	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM);
+
+	gnutls_x509_privkey_init(&root_privkey);
+	gnutls_x509_privkey_init(&host_privkey);
+
+	gnutls_x509_crt_init(&root_cert);
+	gnutls_x509_crt_init(&host_cert);
+
+	/* generate root key */
+	gnutls_x509_privkey_generate(root_privkey, GNUTLS_PK_RSA, 2048, 0);
+	gnutls_x509_privkey_generate(host_privkey, GNUTLS_PK_RSA, 2048, 0);
+
+	/* generate certificates */
+	gnutls_x509_crt_set_key(root_cert, root_privkey);
+	gnutls_x509_crt_set_serial(root_cert, "\x01", 1);
+	gnutls_x509_crt_set_version(root_cert, 3);
+	gnutls_x509_crt_set_ca_status(root_cert, 1);
+	gnutls_x509_crt_set_activation_time(root_cert, time(NULL));
+	gnutls_x509_crt_set_expiration_time(root_cert, time(NULL) + (60 * 60 * 24 * 365 * 10));
+	gnutls_x509_crt_sign2(root_cert, root_cert, root_privkey, GNUTLS_DIG_SHA1, 0);
+
+	gnutls_x509_crt_set_key(host_cert, host_privkey);
+	gnutls_x509_crt_set_serial(host_cert, "\x01", 1);
+	gnutls_x509_crt_set_version(host_cert, 3);
+	gnutls_x509_crt_set_ca_status(host_cert, 0);
+	gnutls_x509_crt_set_key_usage(host_cert, GNUTLS_KEY_KEY_ENCIPHERMENT | GNUTLS_KEY_DIGITAL_SIGNATURE);
+	gnutls_x509_crt_set_activation_time(host_cert, time(NULL));
+	gnutls_x509_crt_set_expiration_time(host_cert, time(NULL) + (60 * 60 * 24 * 365 * 10));
+	gnutls_x509_crt_sign2(host_cert, root_cert, root_privkey, GNUTLS_DIG_SHA1, 0);
+
+	/* export to PEM format */
+	size_t root_key_export_size = 0;
+	size_t host_key_export_size = 0;
+
+	gnutls_x509_privkey_export(root_privkey, GNUTLS_X509_FMT_PEM, NULL, &root_key_export_size);
+	gnutls_x509_privkey_export(host_privkey, GNUTLS_X509_FMT_PEM, NULL, &host_key_export_size);
+
+	creds->root_key_pem.data = gnutls_malloc(root_key_export_size);
+	creds->host_key_pem.data = gnutls_malloc(host_key_export_size);
+
+	gnutls_x509_privkey_export(root_privkey, GNUTLS_X509_FMT_PEM, creds->root_key_pem.data, &root_key_export_size);
+	creds->root_key_pem.size = root_key_export_size;
+	gnutls_x509_privkey_export(host_privkey, GNUTLS_X509_FMT_PEM, creds->host_key_pem.data, &host_key_export_size);
+	creds->host_key_pem.size = host_key_export_size;
+
+	size_t root_cert_export_size = 0;
+	size_t host_cert_export_size = 0;
+
+	gnutls_x509_crt_export(root_cert, GNUTLS_X509_FMT_PEM, NULL, &root_cert_export_size);
+	gnutls_x509_crt_export(host_cert, GNUTLS_X509_FMT_PEM, NULL, &host_cert_export_size);
+
+	creds->root_cert_pem.data = gnutls_malloc(root_cert_export_size);
+	creds->host_cert_pem.data = gnutls_malloc(host_cert_export_size);
+
+	gnutls_x509_crt_export(root_cert, GNUTLS_X509_FMT_PEM, creds->root_cert_pem.data, &root_cert_export_size);
+	creds->root_cert_pem.size = root_cert_export_size;
+	gnutls_x509_crt_export(host_cert, GNUTLS_X509_FMT_PEM, creds->host_cert_pem.data, &host_cert_export_size);
+	creds->host_cert_pem.size = host_cert_export_size;
+
+	gnutls_x509_crt_deinit(root_cert);
+	gnutls_x509_crt_deinit(host_cert);
+	gnutls_x509_privkey_deinit(root_privkey);
+	gnutls_x509_privkey_deinit(host_privkey);
+#endif
+
+	if (creds->root_cert_pem.data && 0 != creds->root_cert_pem.size
+	    && creds->root_key_pem.data && 0 != creds->root_key_pem.size
+	    && creds->host_cert_pem.data && 0 != creds->host_cert_pem.size
+	    && creds->host_key_pem.data && 0 != creds->host_key_pem.size) {
+		return USERPREF_E_SUCCESS;
+	}
+
+	pair_host_credentials_free(creds);
+	return USERPREF_E_SSL_ERROR;
+}
+
+/**
+ * Creates the device certificate for the given device public key, signed
+ * with the root key of the given host credentials.
+ *
+ * @param creds The host credentials to sign with
+ * @param public_key The PEM encoded device public key
+ * @param dev_cert_pem Will be filled with the PEM encoded device certificate
+ */
+static void pair_record_sign_device_certificate(const struct pair_host_credentials *creds, key_data_t public_key, key_data_t *dev_cert_pem)
+{
+#ifdef HAVE_OPENSSL
+	EVP_PKEY *root_pkey = NULL;
+	{
+		BIO *membp = BIO_new_mem_buf(creds->root_key_pem.data, creds->root_key_pem.size);
+		root_pkey = PEM_read_bio_PrivateKey(membp, NULL, NULL, NULL);
+		BIO_free(membp);
+	}
+	if (!root_pkey) {
+		debug_info("ERROR: Could not read root private key");
+		return;
+	}
+
 	RSA *pubkey = NULL;
 	{
 		BIO *membp = BIO_new_mem_buf(public_key.data, public_key.size);
@@ -558,10 +991,10 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 			BIO* membp = BIO_new(BIO_s_mem());
 			if (PEM_write_bio_X509(membp, dev_cert) > 0) {
 				char *bdata = NULL;
-				dev_cert_pem.size = BIO_get_mem_data(membp, &bdata);
-				dev_cert_pem.data = (unsigned char*)malloc(dev_cert_pem.size);
-				if (dev_cert_pem.data) {
-					memcpy(dev_cert_pem.data, bdata, dev_cert_pem.size);
+				dev_cert_pem->size = BIO_get_mem_data(membp, &bdata);
+				dev_cert_pem->data = (unsigned char*)malloc(dev_cert_pem->size);
+				if (dev_cert_pem->data) {
+					memcpy(dev_cert_pem->data, bdata, dev_cert_pem->size);
 				}
 				BIO_free(membp);
 				membp = NULL;
@@ -575,75 +1008,20 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 	X509_free(dev_cert);
 
 	EVP_PKEY_free(root_pkey);
-	EVP_PKEY_free(host_pkey);
-
-	X509_free(host_cert);
-	X509_free(root_cert);
 #else
 	gnutls_x509_privkey_t root_privkey;
 	gnutls_x509_crt_t root_cert;
-	gnutls_x509_privkey_t host_privkey;
-	gnutls_x509_crt_t host_cert;
-
-	/* use less secure random to speed up key generation */
-	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM);
 
 	gnutls_x509_privkey_init(&root_privkey);
-	gnutls_x509_privkey_init(&host_privkey);
-
 	gnutls_x509_crt_init(&root_cert);
-	gnutls_x509_crt_init(&host_cert);
-
-	/* generate root key */
-	gnutls_x509_privkey_generate(root_privkey, GNUTLS_PK_RSA, 2048, 0);
-	gnutls_x509_privkey_generate(host_privkey, GNUTLS_PK_RSA, 2048, 0);
-
-	/* generate certificates */
-	gnutls_x509_crt_set_key(root_cert, root_privkey);
-	gnutls_x509_crt_set_serial(root_cert, "\x01", 1);
-	gnutls_x509_crt_set_version(root_cert, 3);
-	gnutls_x509_crt_set_ca_status(root_cert, 1);
-	gnutls_x509_crt_set_activation_time(root_cert, time(NULL));
-	gnutls_x509_crt_set_expiration_time(root_cert, time(NULL) + (60 * 60 * 24 * 365 * 10));
-	gnutls_x509_crt_sign2(root_cert, root_cert, root_privkey, GNUTLS_DIG_SHA1, 0);
-
-	gnutls_x509_crt_set_key(host_cert, host_privkey);
-	gnutls_x509_crt_set_serial(host_cert, "\x01", 1);
-	gnutls_x509_crt_set_version(host_cert, 3);
-	gnutls_x509_crt_set_ca_status(host_cert, 0);
-	gnutls_x509_crt_set_key_usage(host_cert, GNUTLS_KEY_KEY_ENCIPHERMENT | GNUTLS_KEY_DIGITAL_SIGNATURE);
-	gnutls_x509_crt_set_activation_time(host_cert, time(NULL));
-	gnutls_x509_crt_set_expiration_time(host_cert, time(NULL) + (60 * 60 * 24 * 365 * 10));
-	gnutls_x509_crt_sign2(host_cert, root_cert, root_privkey, GNUTLS_DIG_SHA1, 0);
-
-	/* export to PEM format */
-	size_t root_key_export_size = 0;
-	size_t host_key_export_size = 0;
-
-	gnutls_x509_privkey_export(root_privkey, GNUTLS_X509_FMT_PEM, NULL, &root_key_export_size);
-	gnutls_x509_privkey_export(host_privkey, GNUTLS_X509_FMT_PEM, NULL, &host_key_export_size);
-
-	root_key_pem.data = gnutls_malloc(root_key_export_size);
-	host_key_pem.data = gnutls_malloc(host_key_export_size);
 
-	gnutls_x509_privkey_export(root_privkey, GNUTLS_X509_FMT_PEM, root_key_pem.data, &root_key_export_size);
-	root_key_pem.size = root_key_export_size;
-	gnutls_x509_privkey_export(host_privkey, GNUTLS_X509_FMT_PEM, host_key_pem.data, &host_key_export_size);
-	host_key_pem.size = host_key_export_size;
-
-	size_t root_cert_export_size = 0;
-	size_t host_cert_export_size = 0;
-
-	gnutls_x509_crt_export(root_cert, GNUTLS_X509_FMT_PEM, NULL, &root_cert_export_size);
-	gnutls_x509_crt_export(host_cert, GNUTLS_X509_FMT_PEM, NULL, &host_cert_export_size);
-
-	root_cert_pem.data = gnutls_malloc(root_cert_export_size);
-	host_cert_pem.data = gnutls_malloc(host_cert_export_size);
-
-	gnutls_x509_crt_export(root_cert, GNUTLS_X509_FMT_PEM, root_cert_pem.data, &root_cert_export_size);
-	root_cert_pem.size = root_cert_export_size;
-	gnutls_x509_crt_export(host_cert, GNUTLS_X509_FMT_PEM, host_cert_pem.data, &host_cert_export_size);
-	host_cert_pem.size = host_cert_export_size;
+	if (gnutls_x509_privkey_import(root_privkey, &creds->root_key_pem, GNUTLS_X509_FMT_PEM) != GNUTLS_E_SUCCESS
+	    || gnutls_x509_crt_import(root_cert, &creds->root_cert_pem, GNUTLS_X509_FMT_PEM) != GNUTLS_E_SUCCESS) {
+		debug_info("ERROR: Could not import root key and certificate");
+		gnutls_x509_crt_deinit(root_cert);
+		gnutls_x509_privkey_deinit(root_privkey);
+		return;
+	}
 
 	gnutls_datum_t modulus = { NULL, 0 };
 	gnutls_datum_t exponent = { NULL, 0 };
@@ -727,9 +1105,9 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 				/* if everything went well, export in PEM format */
 				size_t export_size = 0;
 				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, NULL, &export_size);
-				dev_cert_pem.data = gnutls_malloc(export_size);
-				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, dev_cert_pem.data, &export_size);
-				dev_cert_pem.size = export_size;
+				dev_cert_pem->data = gnutls_malloc(export_size);
+				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, dev_cert_pem->data, &export_size);
+				dev_cert_pem->size = export_size;
 			} else {
 				debug_info("ERROR: Signing device certificate with root private key failed: %s", gnutls_strerror(gnutls_error));
 			}
@@ -741,15 +1119,47 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 	}
 
 	gnutls_x509_crt_deinit(root_cert);
-	gnutls_x509_crt_deinit(host_cert);
 	gnutls_x509_privkey_deinit(root_privkey);
-	gnutls_x509_privkey_deinit(host_privkey);
 
 	gnutls_free(modulus.data);
 	gnutls_free(exponent.data);
 
 	gnutls_free(der_pub_key.data);
 #endif
+}
+
+/**
+ * Private function to generate required private keys and certificates.
+ * Uses pre-generated host credentials from the key pool if available.
+ *
+ * @param pair_record a #PLIST_DICT that will be filled with the keys
+ *   and certificates
+ * @param public_key the public key to use (device public key)
+ *
+ * @return 1 if keys were successfully generated, 0 otherwise
+ */
+userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key)
+{
+	userpref_error_t ret = USERPREF_E_SSL_ERROR;
+	struct pair_host_credentials creds;
+
+	key_data_t dev_cert_pem = { NULL, 0 };
+
+	if (!pair_record || !public_key.data)
+		return USERPREF_E_INVALID_ARG;
+
+	if (!pair_key_pool_take(&creds)) {
+		if (pair_host_credentials_generate(&creds) != USERPREF_E_SUCCESS) {
+			return USERPREF_E_SSL_ERROR;
+		}
+	}
+
+	pair_record_sign_device_certificate(&creds, public_key, &dev_cert_pem);
+
+	key_data_t root_key_pem = creds.root_key_pem;
+	key_data_t root_cert_pem = creds.root_cert_pem;
+	key_data_t host_key_pem = creds.host_key_pem;
+	key_data_t host_cert_pem = creds.host_cert_pem;
 
 	/* make sure that we have all we need */
 	if (root_cert_pem.data && 0 != root_cert_pem.size
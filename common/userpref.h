@@ -66,8 +66,12 @@ int userpref_read_system_buid(char **system_buid);
 userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_record);
 userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id, plist_t pair_record);
 userpref_error_t userpref_delete_pair_record(const char *udid);
+void userpref_invalidate_pair_record(const char *udid);
 
 userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key);
+userpref_error_t userpref_key_pool_configure(unsigned int size, unsigned int workers);
+userpref_error_t userpref_key_pool_wait(unsigned int timeout);
+unsigned int userpref_key_pool_get_size(void);
 #ifdef HAVE_OPENSSL
 userpref_error_t pair_record_import_key_with_name(plist_t pair_record, const char* name, key_data_t* key);
 userpref_error_t pair_record_import_crt_with_name(plist_t pair_record, const char* name, key_data_t* cert);
@@ -33,6 +33,12 @@
 #include <sys/time.h>
 #include <inttypes.h>
 #include <ctype.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 #include "utils.h"
 
@@ -278,6 +284,92 @@ void buffer_read_from_filename(const char *filename, char **buffer, uint64_t *le
 	*length = size;
 }
 
+int buffer_map_from_filename(const char *filename, struct mapped_buffer *map, int sequential)
+{
+	memset(map, '\0', sizeof(struct mapped_buffer));
+
+	if (!filename)
+		return -1;
+
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | ((sequential) ? FILE_FLAG_SEQUENTIAL_SCAN : 0), NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return -1;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping) {
+		void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		/* the view keeps the mapping alive */
+		CloseHandle(mapping);
+		if (data) {
+			map->data = (char*)data;
+			map->length = (uint64_t)size.QuadPart;
+			map->mapped = 1;
+			return 0;
+		}
+	}
+#else
+	struct stat fst;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &fst) != 0 || fst.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	if (S_ISREG(fst.st_mode) && (uint64_t)fst.st_size <= SIZE_MAX) {
+		void *data = mmap(NULL, (size_t)fst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			close(fd);
+#ifdef MADV_SEQUENTIAL
+			if (sequential) {
+				madvise(data, (size_t)fst.st_size, MADV_SEQUENTIAL);
+			}
+#endif
+			map->data = (char*)data;
+			map->length = (uint64_t)fst.st_size;
+			map->mapped = 1;
+			return 0;
+		}
+	}
+	close(fd);
+#endif
+
+	/* the file cannot be mapped, read it instead */
+	buffer_read_from_filename(filename, &map->data, &map->length);
+	if (map->length == 0) {
+		free(map->data);
+		map->data = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void buffer_unmap(struct mapped_buffer *map)
+{
+	if (!map->data)
+		return;
+
+	if (map->mapped) {
+#ifdef WIN32
+		UnmapViewOfFile(map->data);
+#else
+		munmap(map->data, (size_t)map->length);
+#endif
+	} else {
+		free(map->data);
+	}
+	memset(map, '\0', sizeof(struct mapped_buffer));
+}
+
 void buffer_write_to_filename(const char *filename, const char *buffer, uint64_t length)
 {
 	FILE *f;
@@ -291,25 +383,24 @@ void buffer_write_to_filename(const char *filename, const char *buffer, uint64_t
 
 int plist_read_from_filename(plist_t *plist, const char *filename)
 {
-	char *buffer = NULL;
-	uint64_t length;
+	struct mapped_buffer map;
 
 	if (!filename)
 		return 0;
 
-	buffer_read_from_filename(filename, &buffer, &length);
-
-	if (!buffer) {
+	/* parse straight from the mapped file instead of a heap copy */
+	if (buffer_map_from_filename(filename, &map, 1) < 0) {
 		return 0;
 	}
 
-	if ((length > 8) && (memcmp(buffer, "bplist00", 8) == 0)) {
-		plist_from_bin(buffer, length, plist);
-	} else {
-		plist_from_xml(buffer, length, plist);
+	if (map.length > UINT32_MAX) {
+		buffer_unmap(&map);
+		return 0;
 	}
 
-	free(buffer);
+	plist_from_memory(map.data, (uint32_t)map.length, plist);
+
+	buffer_unmap(&map);
 
 	return 1;
 }
@@ -336,195 +427,488 @@ int plist_write_to_filename(plist_t plist, const char *filename, enum plist_form
 	return 1;
 }
 
-static const char base64_str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-static const char base64_pad = '=';
+#define PLIST_WRITER_BUFFER_SIZE 8192
+
+/* buffered output to a stream, or to a growing memory buffer if stream is NULL */
+struct plist_writer {
+	FILE *stream;
+	char *buf;
+	size_t len;
+	size_t capacity;
+};
 
-static char *base64encode(const unsigned char *buf, size_t size)
+struct plist_writer_frame {
+	plist_t node;
+	plist_dict_iter iter;
+	uint32_t index;
+	uint32_t count;
+};
+
+static void plist_writer_flush(struct plist_writer *w)
 {
-	if (!buf || !(size > 0)) return NULL;
-	int outlen = (size / 3) * 4;
-	char *outbuf = (char*)malloc(outlen+5); // 4 spare bytes + 1 for '\0'
-	size_t n = 0;
-	size_t m = 0;
-	unsigned char input[3];
-	unsigned int output[4];
-	while (n < size) {
-		input[0] = buf[n];
-		input[1] = (n+1 < size) ? buf[n+1] : 0;
-		input[2] = (n+2 < size) ? buf[n+2] : 0;
-		output[0] = input[0] >> 2;
-		output[1] = ((input[0] & 3) << 4) + (input[1] >> 4);
-		output[2] = ((input[1] & 15) << 2) + (input[2] >> 6);
-		output[3] = input[2] & 63;
-		outbuf[m++] = base64_str[(int)output[0]];
-		outbuf[m++] = base64_str[(int)output[1]];
-		outbuf[m++] = (n+1 < size) ? base64_str[(int)output[2]] : base64_pad;
-		outbuf[m++] = (n+2 < size) ? base64_str[(int)output[3]] : base64_pad;
-		n+=3;
-	}
-	outbuf[m] = 0; // 0-termination!
-	return outbuf;
+	if (w->stream && w->len > 0) {
+		fwrite(w->buf, 1, w->len, w->stream);
+		w->len = 0;
+	}
 }
 
-static void plist_node_print_to_stream(plist_t node, int* indent_level, FILE* stream);
+static char *plist_writer_reserve(struct plist_writer *w, size_t length)
+{
+	if (w->len + length <= w->capacity) {
+		return w->buf + w->len;
+	}
+	if (w->stream) {
+		plist_writer_flush(w);
+		if (length <= w->capacity) {
+			return w->buf;
+		}
+	}
+	size_t capacity = (w->capacity) ? w->capacity : PLIST_WRITER_BUFFER_SIZE;
+	while (capacity < w->len + length) {
+		capacity *= 2;
+	}
+	char *buf = (char*)realloc(w->buf, capacity);
+	if (!buf) {
+		return NULL;
+	}
+	w->buf = buf;
+	w->capacity = capacity;
+
+	return w->buf + w->len;
+}
 
-static void plist_array_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+static void plist_writer_write(struct plist_writer *w, const char *data, size_t length)
 {
-	/* iterate over items */
-	int i, count;
-	plist_t subnode = NULL;
+	/* large blocks bypass the buffer */
+	if (w->stream && length >= PLIST_WRITER_BUFFER_SIZE) {
+		plist_writer_flush(w);
+		fwrite(data, 1, length, w->stream);
+		return;
+	}
+	char *p = plist_writer_reserve(w, length);
+	if (p) {
+		memcpy(p, data, length);
+		w->len += length;
+	}
+}
 
-	count = plist_array_get_size(node);
+static void plist_writer_puts(struct plist_writer *w, const char *str)
+{
+	plist_writer_write(w, str, strlen(str));
+}
 
-	for (i = 0; i < count; i++) {
-		subnode = plist_array_get_item(node, i);
-		fprintf(stream, "%*s", *indent_level, "");
-		fprintf(stream, "%d: ", i);
-		plist_node_print_to_stream(subnode, indent_level, stream);
+static void plist_writer_putc(struct plist_writer *w, char c)
+{
+	char *p = plist_writer_reserve(w, 1);
+	if (p) {
+		*p = c;
+		w->len++;
 	}
 }
 
-static void plist_dict_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+static void plist_writer_indent(struct plist_writer *w, uint32_t count)
 {
-	/* iterate over key/value pairs */
-	plist_dict_iter it = NULL;
-
-	char* key = NULL;
-	plist_t subnode = NULL;
-	plist_dict_new_iter(node, &it);
-	plist_dict_next_item(node, it, &key, &subnode);
-	while (subnode)
-	{
-		fprintf(stream, "%*s", *indent_level, "");
-		fprintf(stream, "%s", key);
-		if (plist_get_node_type(subnode) == PLIST_ARRAY)
-			fprintf(stream, "[%d]: ", plist_array_get_size(subnode));
-		else
-			fprintf(stream, ": ");
-		free(key);
-		key = NULL;
-		plist_node_print_to_stream(subnode, indent_level, stream);
-		plist_dict_next_item(node, it, &key, &subnode);
+	char *p = plist_writer_reserve(w, count);
+	if (p) {
+		memset(p, ' ', count);
+		w->len += count;
 	}
-	free(it);
 }
 
-static void plist_node_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+static void plist_writer_uint(struct plist_writer *w, uint64_t value)
 {
-	char *s = NULL;
-	char *data = NULL;
-	double d;
-	uint8_t b;
-	uint64_t u = 0;
-	struct timeval tv = { 0, 0 };
+	char tmp[24];
+	int i = sizeof(tmp);
+	do {
+		tmp[--i] = '0' + (value % 10);
+		value /= 10;
+	} while (value > 0);
+	plist_writer_write(w, tmp + i, sizeof(tmp) - i);
+}
+
+static const char base64_str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char base64_pad = '=';
 
-	plist_type t;
+/* encodes data in chunks straight into the output buffer */
+static void plist_writer_base64(struct plist_writer *w, const unsigned char *data, uint64_t size)
+{
+	uint64_t n = 0;
 
-	if (!node)
-		return;
+	while (n < size) {
+		uint64_t chunk = size - n;
+		if (chunk > (PLIST_WRITER_BUFFER_SIZE / 4) * 3) {
+			chunk = (PLIST_WRITER_BUFFER_SIZE / 4) * 3;
+		}
+		char *out = plist_writer_reserve(w, ((chunk + 2) / 3) * 4);
+		if (!out) {
+			return;
+		}
+		uint64_t end = n + chunk;
+		size_t m = 0;
+		while (n + 3 <= end) {
+			uint32_t v = ((uint32_t)data[n] << 16) | ((uint32_t)data[n+1] << 8) | data[n+2];
+			out[m++] = base64_str[(v >> 18) & 63];
+			out[m++] = base64_str[(v >> 12) & 63];
+			out[m++] = base64_str[(v >> 6) & 63];
+			out[m++] = base64_str[v & 63];
+			n += 3;
+		}
+		if (n < end) {
+			uint32_t v = (uint32_t)data[n] << 16;
+			if (n + 1 < end) v |= (uint32_t)data[n+1] << 8;
+			out[m++] = base64_str[(v >> 18) & 63];
+			out[m++] = base64_str[(v >> 12) & 63];
+			out[m++] = (n + 1 < end) ? base64_str[(v >> 6) & 63] : base64_pad;
+			out[m++] = base64_pad;
+			n = end;
+		}
+		w->len += m;
+	}
+}
+
+static void plist_writer_json_string(struct plist_writer *w, const char *str)
+{
+	plist_writer_putc(w, '"');
+	while (str && *str) {
+		const char *start = str;
+		while (*str && (unsigned char)*str >= 0x20 && *str != '"' && *str != '\\') {
+			str++;
+		}
+		if (str > start) {
+			plist_writer_write(w, start, str - start);
+			continue;
+		}
+		char esc[8];
+		switch (*str) {
+		case '"': plist_writer_puts(w, "\\\""); break;
+		case '\\': plist_writer_puts(w, "\\\\"); break;
+		case '\n': plist_writer_puts(w, "\\n"); break;
+		case '\r': plist_writer_puts(w, "\\r"); break;
+		case '\t': plist_writer_puts(w, "\\t"); break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*str);
+			plist_writer_puts(w, esc);
+			break;
+		}
+		str++;
+	}
+	plist_writer_putc(w, '"');
+}
+
+static void plist_writer_date(struct plist_writer *w, plist_t node, int utc)
+{
+	int32_t sec = 0;
+	int32_t usec = 0;
+	char tmp[32];
+	struct tm tm_buf;
+	struct tm *btime;
+
+	plist_get_date_val(node, &sec, &usec);
+	time_t ti = (time_t)sec + MAC_EPOCH;
+#ifdef WIN32
+	btime = (utc) ? gmtime(&ti) : localtime(&ti);
+	(void)tm_buf;
+#else
+	btime = (utc) ? gmtime_r(&ti, &tm_buf) : localtime_r(&ti, &tm_buf);
+#endif
+	if (btime && strftime(tmp, sizeof(tmp), "%Y-%m-%dT%H:%M:%SZ", btime) > 0) {
+		if (utc) {
+			plist_writer_json_string(w, tmp);
+		} else {
+			plist_writer_puts(w, tmp);
+		}
+	} else if (utc) {
+		plist_writer_puts(w, "null");
+	}
+}
 
-	t = plist_get_node_type(node);
+/* prints a leaf node as in the key/value text output */
+static void plist_writer_text_value(struct plist_writer *w, plist_t node)
+{
+	char tmp[64];
+	uint64_t u = 0;
+	uint8_t b = 0;
+	double d = 0;
+	const char *s;
 
-	switch (t) {
+	switch (plist_get_node_type(node)) {
 	case PLIST_BOOLEAN:
 		plist_get_bool_val(node, &b);
-		fprintf(stream, "%s\n", (b ? "true" : "false"));
+		plist_writer_puts(w, (b) ? "true\n" : "false\n");
 		break;
-
 	case PLIST_UINT:
 		plist_get_uint_val(node, &u);
-		fprintf(stream, "%"PRIu64"\n", u);
+		plist_writer_uint(w, u);
+		plist_writer_putc(w, '\n');
 		break;
-
 	case PLIST_REAL:
 		plist_get_real_val(node, &d);
-		fprintf(stream, "%f\n", d);
+		snprintf(tmp, sizeof(tmp), "%f\n", d);
+		plist_writer_puts(w, tmp);
 		break;
-
 	case PLIST_STRING:
-		plist_get_string_val(node, &s);
-		fprintf(stream, "%s\n", s);
-		free(s);
+		s = plist_get_string_ptr(node, NULL);
+		plist_writer_puts(w, (s) ? s : "(null)");
+		plist_writer_putc(w, '\n');
 		break;
-
-	case PLIST_KEY:
-		plist_get_key_val(node, &s);
-		fprintf(stream, "%s: ", s);
-		free(s);
+	case PLIST_KEY: {
+		char *key = NULL;
+		plist_get_key_val(node, &key);
+		plist_writer_puts(w, (key) ? key : "(null)");
+		plist_writer_puts(w, ": ");
+		free(key);
 		break;
-
+	}
 	case PLIST_DATA:
-		plist_get_data_val(node, &data, &u);
-		if (u > 0) {
-			s = base64encode((unsigned char*)data, u);
-			free(data);
-			if (s) {
-				fprintf(stream, "%s\n", s);
-				free(s);
-			} else {
-				fprintf(stream, "\n");
-			}
-		} else {
-			fprintf(stream, "\n");
+		s = plist_get_data_ptr(node, &u);
+		if (s && u > 0) {
+			plist_writer_base64(w, (const unsigned char*)s, u);
 		}
+		plist_writer_putc(w, '\n');
+		break;
+	case PLIST_DATE:
+		plist_writer_date(w, node, 0);
+		plist_writer_putc(w, '\n');
 		break;
+	default:
+		break;
+	}
+}
+
+/* prints a leaf node as JSON; data becomes base64, dates ISO 8601 in UTC */
+static void plist_writer_json_value(struct plist_writer *w, plist_t node)
+{
+	char tmp[64];
+	uint64_t u = 0;
+	uint8_t b = 0;
+	double d = 0;
+	const char *s;
 
+	switch (plist_get_node_type(node)) {
+	case PLIST_BOOLEAN:
+		plist_get_bool_val(node, &b);
+		plist_writer_puts(w, (b) ? "true" : "false");
+		break;
+	case PLIST_UINT:
+		plist_get_uint_val(node, &u);
+		plist_writer_uint(w, u);
+		break;
+	case PLIST_UID:
+		plist_get_uid_val(node, &u);
+		plist_writer_uint(w, u);
+		break;
+	case PLIST_REAL:
+		plist_get_real_val(node, &d);
+		if (d != d || d - d != 0) {
+			/* NaN and infinity have no JSON representation */
+			plist_writer_puts(w, "null");
+		} else {
+			snprintf(tmp, sizeof(tmp), "%.17g", d);
+			plist_writer_puts(w, tmp);
+		}
+		break;
+	case PLIST_STRING:
+		plist_writer_json_string(w, plist_get_string_ptr(node, NULL));
+		break;
+	case PLIST_KEY: {
+		char *key = NULL;
+		plist_get_key_val(node, &key);
+		plist_writer_json_string(w, key);
+		free(key);
+		break;
+	}
+	case PLIST_DATA:
+		s = plist_get_data_ptr(node, &u);
+		plist_writer_putc(w, '"');
+		if (s && u > 0) {
+			plist_writer_base64(w, (const unsigned char*)s, u);
+		}
+		plist_writer_putc(w, '"');
+		break;
 	case PLIST_DATE:
-		plist_get_date_val(node, (int32_t*)&tv.tv_sec, (int32_t*)&tv.tv_usec);
-		{
-			time_t ti = (time_t)tv.tv_sec + MAC_EPOCH;
-			struct tm *btime = localtime(&ti);
-			if (btime) {
-				s = (char*)malloc(24);
- 				memset(s, 0, 24);
-				if (strftime(s, 24, "%Y-%m-%dT%H:%M:%SZ", btime) <= 0) {
-					free (s);
-					s = NULL;
+		plist_writer_date(w, node, 1);
+		break;
+	default:
+		plist_writer_puts(w, "null");
+		break;
+	}
+}
+
+static int plist_writer_is_container(plist_t node)
+{
+	plist_type t = plist_get_node_type(node);
+	return (t == PLIST_DICT || t == PLIST_ARRAY);
+}
+
+/*
+ * Walks the tree depth first with an explicit stack so that deeply nested
+ * input like IORegistry dumps cannot exhaust the C stack.
+ */
+static void plist_writer_print(struct plist_writer *w, plist_t plist, enum plist_print_format_t format)
+{
+	struct plist_writer_frame *stack = NULL;
+	uint32_t depth = 0;
+	uint32_t stack_size = 0;
+	int json = (format == PLIST_PRINT_JSON);
+
+	if (!plist_writer_is_container(plist)) {
+		if (json) {
+			plist_writer_json_value(w, plist);
+			plist_writer_putc(w, '\n');
+		} else {
+			plist_writer_text_value(w, plist);
+		}
+		return;
+	}
+
+	plist_t node = plist;
+	while (1) {
+		if (node) {
+			/* enter a container */
+			if (depth == stack_size) {
+				uint32_t size = (stack_size) ? stack_size * 2 : 16;
+				struct plist_writer_frame *newstack = (struct plist_writer_frame*)realloc(stack, size * sizeof(struct plist_writer_frame));
+				if (!newstack) {
+					break;
 				}
+				stack = newstack;
+				stack_size = size;
+			}
+			struct plist_writer_frame *frame = &stack[depth++];
+			frame->node = node;
+			frame->iter = NULL;
+			frame->index = 0;
+			if (plist_get_node_type(node) == PLIST_DICT) {
+				frame->count = 0;
+				plist_dict_new_iter(node, &frame->iter);
+			} else {
+				frame->count = plist_array_get_size(node);
+			}
+			if (json) {
+				plist_writer_putc(w, (frame->iter) ? '{' : '[');
+			}
+			node = NULL;
+		}
+		if (depth == 0) {
+			break;
+		}
+
+		struct plist_writer_frame *frame = &stack[depth - 1];
+		plist_t child = NULL;
+		char *key = NULL;
+		if (frame->iter) {
+			plist_dict_next_item(frame->node, frame->iter, &key, &child);
+		} else if (frame->index < frame->count) {
+			child = plist_array_get_item(frame->node, frame->index);
+		}
+		if (!child) {
+			/* leave the container */
+			free(key);
+			if (json) {
+				plist_writer_putc(w, (frame->iter) ? '}' : ']');
 			}
+			free(frame->iter);
+			depth--;
+			continue;
 		}
-		if (s) {
-			fprintf(stream, "%s\n", s);
-			free(s);
+
+		if (json) {
+			if (frame->index > 0) {
+				plist_writer_putc(w, ',');
+			}
+			if (key) {
+				plist_writer_json_string(w, key);
+				plist_writer_putc(w, ':');
+			}
 		} else {
-			fprintf(stream, "\n");
+			plist_writer_indent(w, depth - 1);
+			if (key) {
+				plist_writer_puts(w, key);
+				if (plist_get_node_type(child) == PLIST_ARRAY) {
+					plist_writer_putc(w, '[');
+					plist_writer_uint(w, plist_array_get_size(child));
+					plist_writer_puts(w, "]: ");
+				} else {
+					plist_writer_puts(w, ": ");
+				}
+			} else {
+				plist_writer_uint(w, frame->index);
+				plist_writer_puts(w, ": ");
+			}
 		}
-		break;
+		frame->index++;
+		free(key);
 
-	case PLIST_ARRAY:
-		fprintf(stream, "\n");
-		(*indent_level)++;
-		plist_array_print_to_stream(node, indent_level, stream);
-		(*indent_level)--;
-		break;
+		if (plist_writer_is_container(child)) {
+			if (!json) {
+				plist_writer_putc(w, '\n');
+			}
+			node = child;
+		} else if (json) {
+			plist_writer_json_value(w, child);
+		} else {
+			plist_writer_text_value(w, child);
+		}
+	}
 
-	case PLIST_DICT:
-		fprintf(stream, "\n");
-		(*indent_level)++;
-		plist_dict_print_to_stream(node, indent_level, stream);
-		(*indent_level)--;
-		break;
+	/* release iterators left behind if the stack could not grow */
+	while (depth > 0) {
+		free(stack[--depth].iter);
+	}
+	free(stack);
 
-	default:
-		break;
+	if (json) {
+		plist_writer_putc(w, '\n');
 	}
 }
 
-void plist_print_to_stream(plist_t plist, FILE* stream)
+void plist_print_to_stream_with_format(plist_t plist, FILE* stream, enum plist_print_format_t format)
 {
-	int indent = 0;
+	struct plist_writer w;
 
 	if (!plist || !stream)
 		return;
 
-	switch (plist_get_node_type(plist)) {
-	case PLIST_DICT:
-		plist_dict_print_to_stream(plist, &indent, stream);
-		break;
-	case PLIST_ARRAY:
-		plist_array_print_to_stream(plist, &indent, stream);
-		break;
-	default:
-		plist_node_print_to_stream(plist, &indent, stream);
+	w.stream = stream;
+	w.len = 0;
+	w.capacity = PLIST_WRITER_BUFFER_SIZE;
+	w.buf = (char*)malloc(w.capacity);
+	if (!w.buf)
+		return;
+
+	plist_writer_print(&w, plist, format);
+	plist_writer_flush(&w);
+	free(w.buf);
+}
+
+void plist_print_to_stream(plist_t plist, FILE* stream)
+{
+	plist_print_to_stream_with_format(plist, stream, PLIST_PRINT_TEXT);
+}
+
+char *plist_to_json_string(plist_t plist)
+{
+	struct plist_writer w;
+
+	if (!plist)
+		return NULL;
+
+	w.stream = NULL;
+	w.len = 0;
+	w.capacity = 0;
+	w.buf = NULL;
+
+	plist_writer_print(&w, plist, PLIST_PRINT_JSON);
+	if (w.len > 0 && w.buf[w.len - 1] == '\n') {
+		/* no trailing newline, the caller embeds the string */
+		w.len--;
 	}
+	char *p = plist_writer_reserve(&w, 1);
+	if (!p) {
+		free(w.buf);
+		return NULL;
+	}
+	*p = '\0';
+
+	return w.buf;
 }
@@ -49,6 +49,28 @@ char *string_toupper(char *str);
 char *generate_uuid(void);
 
 void buffer_read_from_filename(const char *filename, char **buffer, uint64_t *length);
+
+/**
+ * Read-only contents of a file, memory mapped where possible.
+ */
+struct mapped_buffer {
+	char *data;
+	uint64_t length;
+	int mapped;
+};
+
+/**
+ * Maps the contents of a file read-only into memory. Falls back to reading
+ * the file into a heap buffer if it cannot be mapped.
+ *
+ * @param filename The file to map.
+ * @param map Receives the contents, release it with buffer_unmap().
+ * @param sequential Non-zero to hint that the data is read front to back.
+ *
+ * @return 0 on success, -1 if the file is missing, empty or unreadable.
+ */
+int buffer_map_from_filename(const char *filename, struct mapped_buffer *map, int sequential);
+void buffer_unmap(struct mapped_buffer *map);
 void buffer_write_to_filename(const char *filename, const char *buffer, uint64_t length);
 
 enum plist_format_t {
@@ -59,6 +81,13 @@ enum plist_format_t {
 int plist_read_from_filename(plist_t *plist, const char *filename);
 int plist_write_to_filename(plist_t plist, const char *filename, enum plist_format_t format);
 
+enum plist_print_format_t {
+	PLIST_PRINT_TEXT,
+	PLIST_PRINT_JSON
+};
+
 void plist_print_to_stream(plist_t plist, FILE* stream);
+void plist_print_to_stream_with_format(plist_t plist, FILE* stream, enum plist_print_format_t format);
+char *plist_to_json_string(plist_t plist);
 
 #endif
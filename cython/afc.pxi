@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/afc.h":
+cdef extern from "libimobiledevice/afc.h" nogil:
     cdef struct afc_client_private:
         pass
     ctypedef afc_client_private *afc_client_t
@@ -31,6 +31,7 @@ cdef extern from "libimobiledevice/afc.h":
         AFC_E_NO_MEM = 31
         AFC_E_NOT_ENOUGH_DATA = 32
         AFC_E_DIR_NOT_EMPTY = 33
+        AFC_E_HASH_MISMATCH = 34
     ctypedef enum afc_file_mode_t:
         AFC_FOPEN_RDONLY   = 0x00000001
         AFC_FOPEN_RW       = 0x00000002
@@ -62,11 +63,34 @@ cdef extern from "libimobiledevice/afc.h":
     afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
     afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t operation)
     afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
+    afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t chunk_size, uint32_t depth, uint32_t *bytes_read)
     afc_error_t afc_file_write(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_written)
     afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence)
     afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *position)
     afc_error_t afc_file_truncate(afc_client_t client, uint64_t handle, uint64_t newsize)
 
+from cpython.buffer cimport PyObject_GetBuffer, PyBuffer_Release, PyBUF_SIMPLE, PyBUF_WRITABLE
+from libc.stdio cimport FILE, fopen, fwrite, fclose
+
+# size of the transfer buffer used by AfcFile.copy_to_path()
+cdef enum:
+    AFC_COPY_BUFFER_SIZE = 1048576
+
+cdef afc_error_t afc_file_copy_to_stream(afc_client_t client, uint64_t handle, FILE *stream, char *buf, uint32_t depth, uint64_t *total) nogil:
+    cdef:
+        uint32_t bytes_read
+        afc_error_t err
+    while True:
+        bytes_read = 0
+        err = afc_file_read_pipelined(client, handle, buf, AFC_COPY_BUFFER_SIZE, 0, depth, &bytes_read)
+        if err != AFC_E_SUCCESS:
+            return err
+        if bytes_read > 0 and fwrite(buf, 1, bytes_read, stream) != bytes_read:
+            return AFC_E_IO_ERROR
+        total[0] += bytes_read
+        if bytes_read < AFC_COPY_BUFFER_SIZE:
+            return AFC_E_SUCCESS
+
 LOCK_SH = AFC_LOCK_SH
 LOCK_EX = AFC_LOCK_EX
 LOCK_UN = AFC_LOCK_UN
@@ -101,7 +125,8 @@ cdef class AfcError(BaseError):
             AFC_E_MUX_ERROR: "MUX error",
             AFC_E_NO_MEM: "No memory",
             AFC_E_NOT_ENOUGH_DATA: "Not enough data",
-            AFC_E_DIR_NOT_EMPTY: "Directory not empty"
+            AFC_E_DIR_NOT_EMPTY: "Directory not empty",
+            AFC_E_HASH_MISMATCH: "Hash mismatch"
         }
         BaseError.__init__(self, *args, **kwargs)
 
@@ -123,29 +148,58 @@ cdef class AfcFile(Base):
         self.close()
 
     cpdef close(self):
-        self.handle_error(afc_file_close(self._client._c_client, self._c_handle))
+        cdef:
+            afc_client_t c_client = self._client._c_client
+            afc_error_t err
+        with nogil:
+            err = afc_file_close(c_client, self._c_handle)
+        self.handle_error(err)
 
     cpdef lock(self, int operation):
-        self.handle_error(afc_file_lock(self._client._c_client, self._c_handle, <afc_lock_op_t>operation))
+        cdef:
+            afc_client_t c_client = self._client._c_client
+            afc_error_t err
+        with nogil:
+            err = afc_file_lock(c_client, self._c_handle, <afc_lock_op_t>operation)
+        self.handle_error(err)
 
     cpdef seek(self, int64_t offset, int whence):
-        self.handle_error(afc_file_seek(self._client._c_client, self._c_handle, offset, whence))
+        cdef:
+            afc_client_t c_client = self._client._c_client
+            afc_error_t err
+        with nogil:
+            err = afc_file_seek(c_client, self._c_handle, offset, whence)
+        self.handle_error(err)
 
     cpdef uint64_t tell(self):
-        cdef uint64_t position
-        self.handle_error(afc_file_tell(self._client._c_client, self._c_handle, &position))
+        cdef:
+            afc_client_t c_client = self._client._c_client
+            uint64_t position
+            afc_error_t err
+        with nogil:
+            err = afc_file_tell(c_client, self._c_handle, &position)
+        self.handle_error(err)
         return position
 
     cpdef truncate(self, uint64_t newsize):
-        self.handle_error(afc_file_truncate(self._client._c_client, self._c_handle, newsize))
+        cdef:
+            afc_client_t c_client = self._client._c_client
+            afc_error_t err
+        with nogil:
+            err = afc_file_truncate(c_client, self._c_handle, newsize)
+        self.handle_error(err)
 
     cpdef bytes read(self, uint32_t size):
         cdef:
+            afc_client_t c_client = self._client._c_client
             uint32_t bytes_read
             char* c_data = <char *>malloc(size)
+            afc_error_t err
             bytes result
         try:
-            self.handle_error(afc_file_read(self._client._c_client, self._c_handle, c_data, size, &bytes_read))
+            with nogil:
+                err = afc_file_read(c_client, self._c_handle, c_data, size, &bytes_read)
+            self.handle_error(err)
             result = c_data[:bytes_read]
             return result
         except BaseError, e:
@@ -153,23 +207,79 @@ cdef class AfcFile(Base):
         finally:
             free(c_data)
 
-    cpdef uint32_t write(self, bytes data):
+    cpdef uint32_t readinto(self, object buffer):
         cdef:
-            uint32_t bytes_written
-            char* c_data = data
+            afc_client_t c_client = self._client._c_client
+            Py_buffer view
+            uint32_t bytes_read = 0
+            afc_error_t err
+        PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE | PyBUF_WRITABLE)
         try:
-            self.handle_error(afc_file_write(self._client._c_client, self._c_handle, c_data, len(data), &bytes_written))
-        except BaseError, e:
-            raise
+            if view.len > 0xFFFFFFFF:
+                raise ValueError("buffer is too large for a single read")
+            with nogil:
+                err = afc_file_read(c_client, self._c_handle, <char *>view.buf, <uint32_t>view.len, &bytes_read)
+            self.handle_error(err)
+        finally:
+            PyBuffer_Release(&view)
+
+        return bytes_read
+
+    cpdef uint32_t write(self, object data):
+        cdef:
+            afc_client_t c_client = self._client._c_client
+            Py_buffer view
+            uint32_t bytes_written = 0
+            afc_error_t err
+        PyObject_GetBuffer(data, &view, PyBUF_SIMPLE)
+        try:
+            if view.len > 0xFFFFFFFF:
+                raise ValueError("buffer is too large for a single write")
+            with nogil:
+                err = afc_file_write(c_client, self._c_handle, <char *>view.buf, <uint32_t>view.len, &bytes_written)
+            self.handle_error(err)
+        finally:
+            PyBuffer_Release(&view)
 
         return bytes_written
 
+    cpdef uint64_t copy_to_path(self, bytes path, uint32_t depth=8):
+        # copies from the current position to the end of the file
+        cdef:
+            afc_client_t c_client = self._client._c_client
+            char* c_path = path
+            char* buf = <char *>malloc(AFC_COPY_BUFFER_SIZE)
+            FILE* stream = NULL
+            uint64_t total = 0
+            afc_error_t err = AFC_E_IO_ERROR
+        if buf == NULL:
+            raise MemoryError()
+        try:
+            with nogil:
+                stream = fopen(c_path, "wb")
+                if stream != NULL:
+                    err = afc_file_copy_to_stream(c_client, self._c_handle, stream, buf, depth, &total)
+                    if fclose(stream) != 0 and err == AFC_E_SUCCESS:
+                        err = AFC_E_IO_ERROR
+            self.handle_error(err)
+        finally:
+            free(buf)
+
+        return total
+
+    def read_async(self, uint32_t size, loop=None):
+        return self._client._run_serialized(loop, self.read, size)
+
+    def write_async(self, object data, loop=None):
+        return self._client._run_serialized(loop, self.write, data)
+
     cdef inline BaseError _error(self, int16_t ret):
         return AfcError(ret)
 
 cdef class AfcClient(BaseService):
     __service_name__ = "com.apple.afc"
     cdef afc_client_t _c_client
+    cdef object _executor
 
     def __cinit__(self, iDevice device = None, LockdownServiceDescriptor descriptor = None, *args, **kwargs):
         if (device is not None and descriptor is not None):
@@ -177,6 +287,8 @@ cdef class AfcClient(BaseService):
     
     def __dealloc__(self):
         cdef afc_error_t err
+        if self._executor is not None:
+            self._executor.shutdown(wait=False)
         if self._c_client is not NULL:
             err = afc_client_free(self._c_client)
             self.handle_error(err)
@@ -184,6 +296,14 @@ cdef class AfcClient(BaseService):
     cdef BaseError _error(self, int16_t ret):
         return AfcError(ret)
 
+    def _run_serialized(self, loop, func, *args):
+        # AFC has no non-blocking API; requests on one client must not
+        # interleave, so each client gets a single worker thread
+        if self._executor is None:
+            from concurrent.futures import ThreadPoolExecutor
+            self._executor = ThreadPoolExecutor(max_workers=1)
+        return _aio_get_loop(loop).run_in_executor(self._executor, func, *args)
+
     cpdef list get_device_info(self):
         cdef:
             afc_error_t err
@@ -191,7 +311,8 @@ cdef class AfcClient(BaseService):
             bytes info
             int i = 0
             list result = []
-        err = afc_get_device_info(self._c_client, &infos)
+        with nogil:
+            err = afc_get_device_info(self._c_client, &infos)
         try:
             self.handle_error(err)
         except BaseError, e:
@@ -211,10 +332,12 @@ cdef class AfcClient(BaseService):
         cdef:
             afc_error_t err
             char** dir_list = NULL
+            char* c_directory = directory
             bytes f
             int i = 0
             list result = []
-        err = afc_read_directory(self._c_client, directory, &dir_list)
+        with nogil:
+            err = afc_read_directory(self._c_client, c_directory, &dir_list)
         try:
             self.handle_error(err)
         except BaseError, e:
@@ -234,6 +357,8 @@ cdef class AfcClient(BaseService):
         cdef:
             afc_file_mode_t c_mode
             uint64_t handle
+            char* c_filename = NULL
+            afc_error_t err
             AfcFile f
         if mode == <bytes>'r':
             c_mode = AFC_FOPEN_RDONLY
@@ -250,7 +375,10 @@ cdef class AfcClient(BaseService):
         else:
             raise ValueError("mode string must be 'r', 'r+', 'w', 'w+', 'a', or 'a+'")
 
-        self.handle_error(afc_file_open(self._c_client, filename, c_mode, &handle))
+        c_filename = filename
+        with nogil:
+            err = afc_file_open(self._c_client, c_filename, c_mode, &handle)
+        self.handle_error(err)
         f = AfcFile.__new__(AfcFile)
         f._c_handle = handle
         f._client = self
@@ -262,10 +390,14 @@ cdef class AfcClient(BaseService):
         cdef:
             list result = []
             char** c_result = NULL
+            char* c_path = path
             int i = 0
             bytes info
+            afc_error_t err
         try:
-            self.handle_error(afc_get_file_info(self._c_client, path, &c_result))
+            with nogil:
+                err = afc_get_file_info(self._c_client, c_path, &c_result)
+            self.handle_error(err)
         except BaseError, e:
             raise
         finally:
@@ -280,25 +412,60 @@ cdef class AfcClient(BaseService):
         return result
 
     cpdef remove_path(self, bytes path):
-        self.handle_error(afc_remove_path(self._c_client, path))
+        cdef:
+            char* c_path = path
+            afc_error_t err
+        with nogil:
+            err = afc_remove_path(self._c_client, c_path)
+        self.handle_error(err)
 
     cpdef rename_path(self, bytes f, bytes t):
-        self.handle_error(afc_rename_path(self._c_client, f, t))
+        cdef:
+            char* c_from = f
+            char* c_to = t
+            afc_error_t err
+        with nogil:
+            err = afc_rename_path(self._c_client, c_from, c_to)
+        self.handle_error(err)
 
     cpdef make_directory(self, bytes d):
-        self.handle_error(afc_make_directory(self._c_client, d))
+        cdef:
+            char* c_dir = d
+            afc_error_t err
+        with nogil:
+            err = afc_make_directory(self._c_client, c_dir)
+        self.handle_error(err)
 
     cpdef truncate(self, bytes path, uint64_t newsize):
-        self.handle_error(afc_truncate(self._c_client, path, newsize))
+        cdef:
+            char* c_path = path
+            afc_error_t err
+        with nogil:
+            err = afc_truncate(self._c_client, c_path, newsize)
+        self.handle_error(err)
+
+    cdef _make_link(self, afc_link_type_t linktype, bytes source, bytes link_name):
+        cdef:
+            char* c_source = source
+            char* c_link_name = link_name
+            afc_error_t err
+        with nogil:
+            err = afc_make_link(self._c_client, linktype, c_source, c_link_name)
+        self.handle_error(err)
 
     cpdef link(self, bytes source, bytes link_name):
-        self.handle_error(afc_make_link(self._c_client, AFC_HARDLINK, source, link_name))
+        self._make_link(AFC_HARDLINK, source, link_name)
 
     cpdef symlink(self, bytes source, bytes link_name):
-        self.handle_error(afc_make_link(self._c_client, AFC_SYMLINK, source, link_name))
+        self._make_link(AFC_SYMLINK, source, link_name)
 
     cpdef set_file_time(self, bytes path, uint64_t mtime):
-        self.handle_error(afc_set_file_time(self._c_client, path, mtime))
+        cdef:
+            char* c_path = path
+            afc_error_t err
+        with nogil:
+            err = afc_set_file_time(self._c_client, c_path, mtime)
+        self.handle_error(err)
 
 cdef class Afc2Client(AfcClient):
     __service_name__ = "com.apple.afc2"
@@ -307,6 +474,8 @@ cdef class Afc2Client(AfcClient):
         cdef:
             afc_file_mode_t c_mode
             uint64_t handle
+            char* c_filename = NULL
+            afc_error_t err
             AfcFile f
         if mode == <bytes>'r':
             c_mode = AFC_FOPEN_RDONLY
@@ -323,7 +492,10 @@ cdef class Afc2Client(AfcClient):
         else:
             raise ValueError("mode string must be 'r', 'r+', 'w', 'w+', 'a', or 'a+'")
 
-        self.handle_error(afc_file_open(self._c_client, filename, c_mode, &handle))
+        c_filename = filename
+        with nogil:
+            err = afc_file_open(self._c_client, c_filename, c_mode, &handle)
+        self.handle_error(err)
         f = AfcFile.__new__(AfcFile)
         f._c_handle = handle
         f._client = <AfcClient>self
@@ -0,0 +1,97 @@
+# asyncio integration
+#
+# Raw connections are registered with the event loop by their file
+# descriptor and drained with idevice_connection_try_receive(). Streams that
+# the C library delivers through callbacks (syslog lines, notifications) are
+# handed to the loop with call_soon_threadsafe() and consumed with
+# "async for". Everything here is plain Python so it builds with Cython
+# versions that predate "async def".
+
+from collections import deque
+
+_aio_end_of_stream = object()
+
+def _aio_get_loop(loop):
+    if loop is None:
+        import asyncio
+        loop = asyncio.get_event_loop()
+    return loop
+
+class AsyncStream(object):
+    def __init__(self, loop=None, close_cb=None):
+        self._loop = _aio_get_loop(loop)
+        self._items = deque()
+        self._waiter = None
+        self._close_cb = close_cb
+
+    def _resolve(self, fut, item):
+        if item is _aio_end_of_stream:
+            fut.set_exception(StopAsyncIteration())
+        elif isinstance(item, BaseException):
+            fut.set_exception(item)
+        else:
+            fut.set_result(item)
+
+    def _push(self, item):
+        waiter = self._waiter
+        self._waiter = None
+        if waiter is not None and not waiter.done():
+            self._resolve(waiter, item)
+            if item is not _aio_end_of_stream:
+                return
+        # the end marker stays queued so later iterations stop as well
+        self._items.append(item)
+
+    def push_threadsafe(self, item):
+        self._loop.call_soon_threadsafe(self._push, item)
+
+    def finish_threadsafe(self, error=None):
+        self.push_threadsafe(_aio_end_of_stream if error is None else error)
+
+    def __aiter__(self):
+        return self
+
+    def __anext__(self):
+        fut = self._loop.create_future()
+        if self._items:
+            item = self._items[0]
+            if item is not _aio_end_of_stream:
+                self._items.popleft()
+            self._resolve(fut, item)
+        else:
+            self._waiter = fut
+        return fut
+
+    def close(self):
+        cb = self._close_cb
+        self._close_cb = None
+        if cb is not None:
+            cb()
+        self._push(_aio_end_of_stream)
+
+def _aio_connection_receive(iDeviceConnection conn, uint32_t max_len, loop):
+    loop = _aio_get_loop(loop)
+    fut = loop.create_future()
+
+    # data may already be buffered, e.g. decrypted SSL records
+    data = conn.try_receive(max_len)
+    if data is not None:
+        fut.set_result(data)
+        return fut
+
+    fd = conn.fileno()
+
+    def on_readable():
+        if fut.done():
+            return
+        try:
+            result = conn.try_receive(max_len)
+        except BaseException as e:
+            fut.set_exception(e)
+            return
+        if result is not None:
+            fut.set_result(result)
+
+    loop.add_reader(fd, on_readable)
+    fut.add_done_callback(lambda f: loop.remove_reader(fd))
+    return fut
@@ -31,6 +31,7 @@ cdef extern from "libimobiledevice/diagnostics_relay.h":
     diagnostics_relay_error_t diagnostics_relay_query_mobilegestalt(diagnostics_relay_client_t client, plist.plist_t keys, plist.plist_t* result)
     diagnostics_relay_error_t diagnostics_relay_query_ioregistry_entry(diagnostics_relay_client_t client, char* name, char* class_name, plist.plist_t* result)
     diagnostics_relay_error_t diagnostics_relay_query_ioregistry_plane(diagnostics_relay_client_t client, char* plane, plist.plist_t* result)
+    diagnostics_relay_error_t diagnostics_relay_query_multiple(diagnostics_relay_client_t client, plist.plist_t requests, plist.plist_t* results)
 
 cdef class DiagnosticsRelayError(BaseError):
     def __init__(self, *args, **kwargs):
@@ -126,3 +127,16 @@ cdef class DiagnosticsRelayClient(PropertyListService):
             if c_node != NULL:
                 plist.plist_free(c_node)
             raise
+
+    cpdef plist.Node query_multiple(self, plist.Node requests):
+        cdef:
+            plist.plist_t c_node = NULL
+            diagnostics_relay_error_t err
+        err = diagnostics_relay_query_multiple(self._c_client, requests._c_node, &c_node)
+        try:
+            self.handle_error(err)
+            return plist.plist_t_to_node(c_node)
+        except BaseError, e:
+            if c_node != NULL:
+                plist.plist_free(c_node)
+            raise
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/heartbeat.h":
+cdef extern from "libimobiledevice/heartbeat.h" nogil:
     cdef struct heartbeat_client_private:
         pass
     ctypedef heartbeat_client_private *heartbeat_client_t
@@ -48,13 +48,22 @@ cdef class HeartbeatClient(PropertyListService):
             self.handle_error(err)
 
     cdef inline int16_t _send(self, plist.plist_t node):
-        return heartbeat_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = heartbeat_send(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive(self, plist.plist_t* node):
-        return heartbeat_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = heartbeat_receive(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive_with_timeout(self, plist.plist_t* node, int timeout_ms):
-        return heartbeat_receive_with_timeout(self._c_client, node, timeout_ms)
+        cdef int16_t err
+        with nogil:
+            err = heartbeat_receive_with_timeout(self._c_client, node, timeout_ms)
+        return err
 
     cdef inline BaseError _error(self, int16_t ret):
         return HeartbeatError(ret)
@@ -9,6 +9,7 @@ cdef extern from "libimobiledevice/house_arrest.h":
         HOUSE_ARREST_E_PLIST_ERROR = -2
         HOUSE_ARREST_E_CONN_FAILED = -3
         HOUSE_ARREST_E_INVALID_MODE = -4
+        HOUSE_ARREST_E_COMMAND_FAILED = -5
         HOUSE_ARREST_E_UNKNOWN_ERROR = -256
 
     house_arrest_error_t house_arrest_client_new(idevice_t device, lockdownd_service_descriptor_t descriptor, house_arrest_client_t * client)
@@ -28,6 +29,7 @@ cdef class HouseArrestError(BaseError):
             HOUSE_ARREST_E_PLIST_ERROR: "Property list error",
             HOUSE_ARREST_E_CONN_FAILED: "Connection failed",
             HOUSE_ARREST_E_INVALID_MODE: "Invalid mode",
+            HOUSE_ARREST_E_COMMAND_FAILED: "Command failed",
             HOUSE_ARREST_E_UNKNOWN_ERROR: "Unknown error"
         }
         BaseError.__init__(self, *args, **kwargs)
@@ -44,6 +44,9 @@ cdef class iDeviceConnection(Base):
 
     cpdef bytes receive_timeout(self, uint32_t max_len, unsigned int timeout)
     cpdef bytes receive(self, max_len)
+    cpdef object try_receive(self, uint32_t max_len)
+    cpdef uint32_t pending_bytes(self)
+    cpdef int fileno(self) except -1
     cpdef disconnect(self)
 
 cdef class iDevice(Base):
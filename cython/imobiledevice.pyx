@@ -31,7 +31,7 @@ cdef class Base:
 
     cdef BaseError _error(self, int16_t ret): pass
 
-cdef extern from "libimobiledevice/libimobiledevice.h":
+cdef extern from "libimobiledevice/libimobiledevice.h" nogil:
     ctypedef enum idevice_error_t:
         IDEVICE_E_SUCCESS = 0
         IDEVICE_E_INVALID_ARG = -1
@@ -40,6 +40,7 @@ cdef extern from "libimobiledevice/libimobiledevice.h":
         IDEVICE_E_NOT_ENOUGH_DATA = -4
         IDEVICE_E_SSL_ERROR = -6
         IDEVICE_E_TIMEOUT = -7
+        IDEVICE_E_WOULD_BLOCK = -8
     cdef enum idevice_options:
         IDEVICE_LOOKUP_USBMUX = 1 << 1
         IDEVICE_LOOKUP_NETWORK = 1 << 2
@@ -60,6 +61,9 @@ cdef extern from "libimobiledevice/libimobiledevice.h":
     idevice_error_t idevice_connection_send(idevice_connection_t connection, char *data, uint32_t len, uint32_t *sent_bytes)
     idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
     idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+    idevice_error_t idevice_connection_try_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+    idevice_error_t idevice_connection_get_pending_bytes(idevice_connection_t connection, uint32_t *pending)
+    idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd)
 
 cdef class iDeviceError(BaseError):
     def __init__(self, *args, **kwargs):
@@ -70,7 +74,8 @@ cdef class iDeviceError(BaseError):
             IDEVICE_E_NO_DEVICE: 'No device',
             IDEVICE_E_NOT_ENOUGH_DATA: 'Not enough data',
             IDEVICE_E_SSL_ERROR: 'SSL Error',
-            IDEVICE_E_TIMEOUT: 'Connection timeout'
+            IDEVICE_E_TIMEOUT: 'Connection timeout',
+            IDEVICE_E_WOULD_BLOCK: 'Operation would block'
         }
         BaseError.__init__(self, *args, **kwargs)
 
@@ -137,10 +142,13 @@ cdef class iDeviceConnection(Base):
         cdef:
             uint32_t bytes_received
             char* c_data = <char *>malloc(max_len)
+            idevice_error_t err
             bytes result
 
         try:
-            self.handle_error(idevice_connection_receive_timeout(self._c_connection, c_data, max_len, &bytes_received, timeout))
+            with nogil:
+                err = idevice_connection_receive_timeout(self._c_connection, c_data, max_len, &bytes_received, timeout)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -151,11 +159,15 @@ cdef class iDeviceConnection(Base):
     cpdef bytes receive(self, max_len):
         cdef:
             uint32_t bytes_received
-            char* c_data = <char *>malloc(max_len)
+            uint32_t c_max_len = max_len
+            char* c_data = <char *>malloc(c_max_len)
+            idevice_error_t err
             bytes result
 
         try:
-            self.handle_error(idevice_connection_receive(self._c_connection, c_data, max_len, &bytes_received))
+            with nogil:
+                err = idevice_connection_receive(self._c_connection, c_data, c_max_len, &bytes_received)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -163,9 +175,40 @@ cdef class iDeviceConnection(Base):
         finally:
             free(c_data)
 
+    cpdef object try_receive(self, uint32_t max_len):
+        cdef:
+            uint32_t bytes_received = 0
+            char* c_data = <char *>malloc(max_len)
+            idevice_error_t err
+            bytes result
+
+        try:
+            err = idevice_connection_try_receive(self._c_connection, c_data, max_len, &bytes_received)
+            if err == IDEVICE_E_WOULD_BLOCK:
+                return None
+            self.handle_error(err)
+            result = c_data[:bytes_received]
+            return result
+        finally:
+            free(c_data)
+
+    cpdef uint32_t pending_bytes(self):
+        cdef uint32_t pending = 0
+        self.handle_error(idevice_connection_get_pending_bytes(self._c_connection, &pending))
+        return pending
+
+    cpdef int fileno(self) except -1:
+        cdef int fd = -1
+        self.handle_error(idevice_connection_get_fd(self._c_connection, &fd))
+        return fd
+
+    def receive_async(self, uint32_t max_len, loop=None):
+        return _aio_connection_receive(self, max_len, loop)
+
     cpdef disconnect(self):
         cdef idevice_error_t err
-        err = idevice_disconnect(self._c_connection)
+        with nogil:
+            err = idevice_disconnect(self._c_connection)
         self.handle_error(err)
 
     cdef BaseError _error(self, int16_t ret):
@@ -175,12 +218,16 @@ from libc.stdlib cimport *
 
 cdef class iDevice(Base):
     def __cinit__(self, object udid=None, *args, **kwargs):
-        cdef char* c_udid = NULL
+        cdef:
+            char* c_udid = NULL
+            idevice_error_t err
         if isinstance(udid, basestring):
             c_udid = <bytes>udid
         elif udid is not None:
             raise TypeError("iDevice's constructor takes a string or None as the udid argument")
-        self.handle_error(idevice_new(&self._c_dev, c_udid))
+        with nogil:
+            err = idevice_new(&self._c_dev, c_udid)
+        self.handle_error(err)
 
     def __dealloc__(self):
         if self._c_dev is not NULL:
@@ -194,7 +241,8 @@ cdef class iDevice(Base):
             idevice_error_t err
             idevice_connection_t c_conn = NULL
             iDeviceConnection conn
-        err = idevice_connect(self._c_dev, port, &c_conn)
+        with nogil:
+            err = idevice_connect(self._c_dev, port, &c_conn)
         try:
             self.handle_error(err)
 
@@ -274,6 +322,7 @@ cdef class PropertyListService(BaseService):
 cdef class DeviceLinkService(PropertyListService):
     pass
 
+include "aio.pxi"
 include "lockdown.pxi"
 include "mobilesync.pxi"
 include "notification_proxy.pxi"
@@ -292,3 +341,4 @@ include "misagent.pxi"
 include "house_arrest.pxi"
 include "restore.pxi"
 include "debugserver.pxi"
+include "syslog_relay.pxi"
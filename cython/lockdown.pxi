@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/lockdown.h":
+cdef extern from "libimobiledevice/lockdown.h" nogil:
     ctypedef enum lockdownd_error_t:
         LOCKDOWN_E_SUCCESS
         LOCKDOWN_E_INVALID_ARG
@@ -154,12 +154,16 @@ cdef class LockdownClient(PropertyListService):
         cdef:
             lockdownd_error_t err
             char* c_label = NULL
+            idevice_t c_dev = device._c_dev
+            lockdownd_client_t c_client = NULL
         if label:
             c_label = label
-        if handshake:
-            err = lockdownd_client_new_with_handshake(device._c_dev, &self._c_client, c_label)
-        else:
-            err = lockdownd_client_new(device._c_dev, &self._c_client, c_label)
+        with nogil:
+            if handshake:
+                err = lockdownd_client_new_with_handshake(c_dev, &c_client, c_label)
+            else:
+                err = lockdownd_client_new(c_dev, &c_client, c_label)
+        self._c_client = c_client
         self.handle_error(err)
 
         self.device = device
@@ -175,7 +179,8 @@ cdef class LockdownClient(PropertyListService):
             lockdownd_error_t err
             char* c_type = NULL
             bytes result
-        err = lockdownd_query_type(self._c_client, &c_type)
+        with nogil:
+            err = lockdownd_query_type(self._c_client, &c_type)
         try:
             self.handle_error(err)
             result = c_type
@@ -198,7 +203,8 @@ cdef class LockdownClient(PropertyListService):
         if key is not None:
             c_key = key
 
-        err = lockdownd_get_value(self._c_client, c_domain, c_key, &c_node)
+        with nogil:
+            err = lockdownd_get_value(self._c_client, c_domain, c_key, &c_node)
 
         try:
             self.handle_error(err)
@@ -210,9 +216,15 @@ cdef class LockdownClient(PropertyListService):
             raise
 
     cpdef set_value(self, bytes domain, bytes key, object value):
-        cdef plist.plist_t c_node = plist.native_to_plist_t(value)
+        cdef:
+            plist.plist_t c_node = plist.native_to_plist_t(value)
+            char* c_domain = domain
+            char* c_key = key
+            lockdownd_error_t err
         try:
-            self.handle_error(lockdownd_set_value(self._c_client, domain, key, c_node))
+            with nogil:
+                err = lockdownd_set_value(self._c_client, c_domain, c_key, c_node)
+            self.handle_error(err)
         except BaseError, e:
             raise
         finally:
@@ -220,12 +232,19 @@ cdef class LockdownClient(PropertyListService):
                 plist.plist_free(c_node)
 
     cpdef remove_value(self, bytes domain, bytes key):
-        self.handle_error(lockdownd_remove_value(self._c_client, domain, key))
+        cdef:
+            char* c_domain = domain
+            char* c_key = key
+            lockdownd_error_t err
+        with nogil:
+            err = lockdownd_remove_value(self._c_client, c_domain, c_key)
+        self.handle_error(err)
 
     cpdef object start_service(self, object service):
         cdef:
             char* c_service_name = NULL
             lockdownd_service_descriptor_t c_descriptor = NULL
+            lockdownd_error_t err
             LockdownServiceDescriptor result
 
         if issubclass(service, BaseService) and \
@@ -238,7 +257,9 @@ cdef class LockdownClient(PropertyListService):
             raise TypeError("LockdownClient.start_service() takes a BaseService or string as its first argument")
 
         try:
-            self.handle_error(lockdownd_start_service(self._c_client, c_service_name, &c_descriptor))
+            with nogil:
+                err = lockdownd_start_service(self._c_client, c_service_name, &c_descriptor)
+            self.handle_error(err)
 
             result = LockdownServiceDescriptor.__new__(LockdownServiceDescriptor)
             result._c_service_descriptor = c_descriptor
@@ -262,10 +283,12 @@ cdef class LockdownClient(PropertyListService):
     cpdef tuple start_session(self, bytes host_id):
         cdef:
             lockdownd_error_t err
+            char* c_host_id = host_id
             char* c_session_id = NULL
             bint ssl_enabled
             bytes session_id
-        err = lockdownd_start_session(self._c_client, host_id, &c_session_id, <int *>&ssl_enabled)
+        with nogil:
+            err = lockdownd_start_session(self._c_client, c_host_id, &c_session_id, <int *>&ssl_enabled)
         try:
             self.handle_error(err)
 
@@ -278,37 +301,68 @@ cdef class LockdownClient(PropertyListService):
                 free(c_session_id)
 
     cpdef stop_session(self, bytes session_id):
-        self.handle_error(lockdownd_stop_session(self._c_client, session_id))
+        cdef:
+            char* c_session_id = session_id
+            lockdownd_error_t err
+        with nogil:
+            err = lockdownd_stop_session(self._c_client, c_session_id)
+        self.handle_error(err)
 
     cpdef pair(self, object pair_record=None):
-        cdef lockdownd_pair_record_t c_pair_record = NULL
+        cdef:
+            lockdownd_pair_record_t c_pair_record = NULL
+            lockdownd_error_t err
         if pair_record is not None:
             c_pair_record = (<LockdownPairRecord>pair_record)._c_record
-        self.handle_error(lockdownd_pair(self._c_client, c_pair_record))
+        with nogil:
+            err = lockdownd_pair(self._c_client, c_pair_record)
+        self.handle_error(err)
 
     cpdef validate_pair(self, object pair_record=None):
-        cdef lockdownd_pair_record_t c_pair_record = NULL
+        cdef:
+            lockdownd_pair_record_t c_pair_record = NULL
+            lockdownd_error_t err
         if pair_record is not None:
             c_pair_record = (<LockdownPairRecord>pair_record)._c_record
-        self.handle_error(lockdownd_validate_pair(self._c_client, c_pair_record))
+        with nogil:
+            err = lockdownd_validate_pair(self._c_client, c_pair_record)
+        self.handle_error(err)
 
     cpdef unpair(self, object pair_record=None):
-        cdef lockdownd_pair_record_t c_pair_record = NULL
+        cdef:
+            lockdownd_pair_record_t c_pair_record = NULL
+            lockdownd_error_t err
         if pair_record is not None:
             c_pair_record = (<LockdownPairRecord>pair_record)._c_record
-        self.handle_error(lockdownd_unpair(self._c_client, c_pair_record))
+        with nogil:
+            err = lockdownd_unpair(self._c_client, c_pair_record)
+        self.handle_error(err)
 
     cpdef activate(self, plist.Node activation_record):
-        self.handle_error(lockdownd_activate(self._c_client, activation_record._c_node))
+        cdef:
+            plist.plist_t c_record = activation_record._c_node
+            lockdownd_error_t err
+        with nogil:
+            err = lockdownd_activate(self._c_client, c_record)
+        self.handle_error(err)
 
     cpdef deactivate(self):
-        self.handle_error(lockdownd_deactivate(self._c_client))
+        cdef lockdownd_error_t err
+        with nogil:
+            err = lockdownd_deactivate(self._c_client)
+        self.handle_error(err)
 
     cpdef enter_recovery(self):
-        self.handle_error(lockdownd_enter_recovery(self._c_client))
+        cdef lockdownd_error_t err
+        with nogil:
+            err = lockdownd_enter_recovery(self._c_client)
+        self.handle_error(err)
 
     cpdef goodbye(self):
-        self.handle_error(lockdownd_goodbye(self._c_client))
+        cdef lockdownd_error_t err
+        with nogil:
+            err = lockdownd_goodbye(self._c_client)
+        self.handle_error(err)
 
     cpdef list get_sync_data_classes(self):
         cdef:
@@ -316,9 +370,12 @@ cdef class LockdownClient(PropertyListService):
             int count = 0
             list result = []
             bytes data_class
+            lockdownd_error_t err
 
         try:
-            self.handle_error(lockdownd_get_sync_data_classes(self._c_client, &classes, &count))
+            with nogil:
+                err = lockdownd_get_sync_data_classes(self._c_client, &classes, &count)
+            self.handle_error(err)
 
             for i from 0 <= i < count:
                 data_class = classes[i]
@@ -332,10 +389,16 @@ cdef class LockdownClient(PropertyListService):
                 lockdownd_data_classes_free(classes)
 
     cdef inline int16_t _send(self, plist.plist_t node):
-        return lockdownd_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = lockdownd_send(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive(self, plist.plist_t* node):
-        return lockdownd_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = lockdownd_receive(self._c_client, node)
+        return err
 
     cdef inline BaseError _error(self, int16_t ret):
         return LockdownError(ret)
@@ -17,6 +17,7 @@ cdef extern from "libimobiledevice/misagent.h":
     misagent_error_t misagent_install(misagent_client_t client, plist.plist_t profile)
     misagent_error_t misagent_copy(misagent_client_t client, plist.plist_t* profiles)
     misagent_error_t misagent_remove(misagent_client_t client, char* profileID)
+    misagent_error_t misagent_install_multiple(misagent_client_t client, plist.plist_t profiles, int* status_codes)
     int misagent_get_status_code(misagent_client_t client)
 
 cdef class MisagentError(BaseError):
@@ -52,6 +53,11 @@ cdef class MisagentClient(PropertyListService):
         err = misagent_install(self._c_client, profile._c_node)
         self.handle_error(err)
 
+    cpdef install_multiple(self, plist.Array profiles):
+        cdef misagent_error_t err
+        err = misagent_install_multiple(self._c_client, profiles._c_node, NULL)
+        self.handle_error(err)
+
     cpdef plist.Node copy(self):
         cdef:
             plist.plist_t c_node = NULL
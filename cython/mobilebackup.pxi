@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/mobilebackup.h":
+cdef extern from "libimobiledevice/mobilebackup.h" nogil:
     cdef struct mobilebackup_client_private:
         pass
     ctypedef mobilebackup_client_private *mobilebackup_client_t
@@ -63,10 +63,16 @@ cdef class MobileBackupClient(PropertyListService):
         return MobileBackupError(ret)
 
     cdef inline int16_t _send(self, plist.plist_t node):
-        return mobilebackup_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = mobilebackup_send(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive(self, plist.plist_t* node):
-        return mobilebackup_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = mobilebackup_receive(self._c_client, node)
+        return err
 
     cdef request_backup(self, plist.Node backup_manifest, bytes base_path, bytes proto_version):
         self.handle_error(mobilebackup_request_backup(self._c_client, backup_manifest._c_node, base_path, proto_version))
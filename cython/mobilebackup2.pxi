@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/mobilebackup2.h":
+cdef extern from "libimobiledevice/mobilebackup2.h" nogil:
     cdef struct mobilebackup2_client_private:
         pass
     ctypedef mobilebackup2_client_private *mobilebackup2_client_t
@@ -59,14 +59,21 @@ cdef class MobileBackup2Client(PropertyListService):
         return MobileBackup2Error(ret)
 
     cdef send_message(self, bytes message, plist.Node options):
-        self.handle_error(mobilebackup2_send_message(self._c_client, message, options._c_node))
+        cdef:
+            char* c_message = message
+            plist.plist_t c_options = options._c_node
+            mobilebackup2_error_t err
+        with nogil:
+            err = mobilebackup2_send_message(self._c_client, c_message, c_options)
+        self.handle_error(err)
 
     cdef tuple receive_message(self):
         cdef:
             char* dlmessage = NULL
             plist.plist_t c_node = NULL
             mobilebackup2_error_t err
-        err = mobilebackup2_receive_message(self._c_client, &c_node, &dlmessage)
+        with nogil:
+            err = mobilebackup2_receive_message(self._c_client, &c_node, &dlmessage)
         try:
             self.handle_error(err)
             return (plist.plist_t_to_node(c_node), <bytes>dlmessage)
@@ -80,8 +87,11 @@ cdef class MobileBackup2Client(PropertyListService):
     cdef int send_raw(self, bytes data, int length):
         cdef:
             uint32_t bytes = 0
+            char* c_data = data
+            uint32_t c_length = length
             mobilebackup2_error_t err
-        err = mobilebackup2_send_raw(self._c_client, data, length, &bytes)
+        with nogil:
+            err = mobilebackup2_send_raw(self._c_client, c_data, c_length, &bytes)
         try:
             self.handle_error(err)
             return <bint>bytes
@@ -91,8 +101,11 @@ cdef class MobileBackup2Client(PropertyListService):
     cdef int receive_raw(self, bytes data, int length):
         cdef:
             uint32_t bytes = 0
+            char* c_data = data
+            uint32_t c_length = length
             mobilebackup2_error_t err
-        err = mobilebackup2_receive_raw(self._c_client, data, length, &bytes)
+        with nogil:
+            err = mobilebackup2_receive_raw(self._c_client, c_data, c_length, &bytes)
         try:
             self.handle_error(err)
             return <bint>bytes
@@ -103,8 +116,10 @@ cdef class MobileBackup2Client(PropertyListService):
         cdef:
             double[::1] temp = None
             double remote_version = 0.0
+            char count = len(local_versions)
             mobilebackup2_error_t err
-        err = mobilebackup2_version_exchange(self._c_client, &local_versions[0], len(local_versions), &remote_version)
+        with nogil:
+            err = mobilebackup2_version_exchange(self._c_client, &local_versions[0], count, &remote_version)
         try:
             self.handle_error(err)
             return <float>remote_version
@@ -112,7 +127,21 @@ cdef class MobileBackup2Client(PropertyListService):
             raise
 
     cdef send_request(self, bytes request, bytes target_identifier, bytes source_identifier, plist.Node options):
-        self.handle_error(mobilebackup2_send_request(self._c_client, request, target_identifier, source_identifier, options._c_node))
+        cdef:
+            char* c_request = request
+            char* c_target_identifier = target_identifier
+            char* c_source_identifier = source_identifier
+            plist.plist_t c_options = options._c_node
+            mobilebackup2_error_t err
+        with nogil:
+            err = mobilebackup2_send_request(self._c_client, c_request, c_target_identifier, c_source_identifier, c_options)
+        self.handle_error(err)
 
     cdef send_status_response(self, int status_code, bytes status1, plist.Node status2):
-        self.handle_error(mobilebackup2_send_status_response(self._c_client, status_code, status1, status2._c_node))
+        cdef:
+            char* c_status1 = status1
+            plist.plist_t c_status2 = status2._c_node
+            mobilebackup2_error_t err
+        with nogil:
+            err = mobilebackup2_send_status_response(self._c_client, status_code, c_status1, c_status2)
+        self.handle_error(err)
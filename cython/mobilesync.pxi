@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/mobilesync.h":
+cdef extern from "libimobiledevice/mobilesync.h" nogil:
     cdef struct mobilesync_client_private:
         pass
     ctypedef mobilesync_client_private *mobilesync_client_t
@@ -155,10 +155,16 @@ cdef class MobileSyncClient(DeviceLinkService):
             raise
     
     cdef int16_t _send(self, plist.plist_t node):
-        return mobilesync_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = mobilesync_send(self._c_client, node)
+        return err
 
     cdef int16_t _receive(self, plist.plist_t* node):
-        return mobilesync_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = mobilesync_receive(self._c_client, node)
+        return err
 
     cdef inline BaseError _error(self, int16_t ret):
         return MobileSyncError(ret)
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/notification_proxy.h":
+cdef extern from "libimobiledevice/notification_proxy.h" nogil:
     cdef struct np_client_private:
         pass
     ctypedef np_client_private *np_client_t
@@ -70,7 +70,7 @@ NP_ITDBPREP_DID_END = C_NP_ITDBPREP_DID_END
 NP_LANGUAGE_CHANGED = C_NP_LANGUAGE_CHANGED
 NP_ADDRESS_BOOK_PREF_CHANGED = C_NP_ADDRESS_BOOK_PREF_CHANGED
 
-cdef void np_notify_cb(const_char_ptr notification, void *py_callback):
+cdef void np_notify_cb(const_char_ptr notification, void *py_callback) with gil:
     (<object>py_callback)(notification)
 
 cdef class NotificationProxyError(BaseError):
@@ -87,6 +87,7 @@ cdef class NotificationProxyError(BaseError):
 cdef class NotificationProxyClient(PropertyListService):
     __service_name__ = "com.apple.mobile.notification_proxy"
     cdef np_client_t _c_client
+    cdef object _notify_callback
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
         self.handle_error(np_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
@@ -94,14 +95,31 @@ cdef class NotificationProxyClient(PropertyListService):
     def __dealloc__(self):
         cdef np_error_t err
         if self._c_client is not NULL:
-            err = np_client_free(self._c_client)
+            # joins the notifier thread, which might be waiting for the GIL
+            with nogil:
+                err = np_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return NotificationProxyError(ret)
 
     cpdef set_notify_callback(self, object callback):
-        self.handle_error(np_set_notify_callback(self._c_client, np_notify_cb, <void*>callback))
+        cdef np_error_t err
+        cdef np_notify_cb_t c_callback = NULL
+        cdef void *c_userdata = NULL
+        if callback is not None:
+            c_callback = np_notify_cb
+            c_userdata = <void*>callback
+        # replacing a callback joins the previous notifier thread
+        with nogil:
+            err = np_set_notify_callback(self._c_client, c_callback, c_userdata)
+        self._notify_callback = callback
+        self.handle_error(err)
+
+    def notifications(self, loop=None):
+        stream = AsyncStream(loop, lambda: self.set_notify_callback(None))
+        self.set_notify_callback(stream.push_threadsafe)
+        return stream
 
     cpdef observe_notification(self, bytes notification):
         self.handle_error(np_observe_notification(self._c_client, notification))
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/restore.h":
+cdef extern from "libimobiledevice/restore.h" nogil:
     cdef struct restored_client_private:
         pass
     ctypedef restored_client_private *restored_client_t
@@ -64,10 +64,16 @@ cdef class RestoreClient(PropertyListService):
         return RestoreError(ret)
 
     cdef inline int16_t _send(self, plist.plist_t node):
-        return restored_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = restored_send(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive(self, plist.plist_t* node):
-        return restored_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = restored_receive(self._c_client, node)
+        return err
 
     cpdef tuple query_type(self):
         cdef:
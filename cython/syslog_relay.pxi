@@ -0,0 +1,82 @@
+cdef extern from "libimobiledevice/syslog_relay.h" nogil:
+    cdef struct syslog_relay_client_private:
+        pass
+    ctypedef syslog_relay_client_private *syslog_relay_client_t
+
+    ctypedef enum syslog_relay_error_t:
+        SYSLOG_RELAY_E_SUCCESS = 0
+        SYSLOG_RELAY_E_INVALID_ARG = -1
+        SYSLOG_RELAY_E_MUX_ERROR = -2
+        SYSLOG_RELAY_E_SSL_ERROR = -3
+        SYSLOG_RELAY_E_NOT_ENOUGH_DATA = -4
+        SYSLOG_RELAY_E_TIMEOUT = -5
+        SYSLOG_RELAY_E_UNKNOWN_ERROR = -256
+
+    ctypedef struct syslog_relay_line_t:
+        char *line
+        uint32_t line_length
+    ctypedef syslog_relay_line_t* const_syslog_relay_line_t "const syslog_relay_line_t*"
+    ctypedef void (*syslog_relay_line_cb_t) (const_syslog_relay_line_t line, void *user_data)
+
+    syslog_relay_error_t syslog_relay_client_new(idevice_t device, lockdownd_service_descriptor_t descriptor, syslog_relay_client_t * client)
+    syslog_relay_error_t syslog_relay_client_free(syslog_relay_client_t client)
+
+    syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_line_cb_t callback, void* user_data)
+    syslog_relay_error_t syslog_relay_set_dispatch_buffer(syslog_relay_client_t client, uint32_t capacity)
+    syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client)
+
+cdef void syslog_relay_line_cb(const_syslog_relay_line_t line, void *py_callback) with gil:
+    cdef bytes data = line.line[:line.line_length]
+    (<object>py_callback)(data)
+
+cdef class SyslogRelayError(BaseError):
+    def __init__(self, *args, **kwargs):
+        self._lookup_table = {
+            SYSLOG_RELAY_E_SUCCESS: "Success",
+            SYSLOG_RELAY_E_INVALID_ARG: "Invalid argument",
+            SYSLOG_RELAY_E_MUX_ERROR: "MUX error",
+            SYSLOG_RELAY_E_SSL_ERROR: "SSL Error",
+            SYSLOG_RELAY_E_NOT_ENOUGH_DATA: "Not enough data",
+            SYSLOG_RELAY_E_TIMEOUT: "Connection timeout",
+            SYSLOG_RELAY_E_UNKNOWN_ERROR: "Unknown error"
+        }
+        BaseError.__init__(self, *args, **kwargs)
+
+cdef class SyslogRelayClient(BaseService):
+    __service_name__ = "com.apple.syslog_relay"
+    cdef syslog_relay_client_t _c_client
+    cdef object _callback
+
+    def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
+        self.handle_error(syslog_relay_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+
+    def __dealloc__(self):
+        cdef syslog_relay_error_t err
+        if self._c_client is not NULL:
+            # joins the capture thread, which might be waiting for the GIL
+            with nogil:
+                err = syslog_relay_client_free(self._c_client)
+            self.handle_error(err)
+
+    cdef inline BaseError _error(self, int16_t ret):
+        return SyslogRelayError(ret)
+
+    cpdef set_dispatch_buffer(self, uint32_t capacity):
+        self.handle_error(syslog_relay_set_dispatch_buffer(self._c_client, capacity))
+
+    cpdef start_capture(self, object callback):
+        # the callback is invoked with each line as bytes from the capture thread
+        self.handle_error(syslog_relay_start_capture_lines(self._c_client, syslog_relay_line_cb, <void*>callback))
+        self._callback = callback
+
+    cpdef stop_capture(self):
+        cdef syslog_relay_error_t err
+        with nogil:
+            err = syslog_relay_stop_capture(self._c_client)
+        self._callback = None
+        self.handle_error(err)
+
+    def lines(self, loop=None):
+        stream = AsyncStream(loop, self.stop_capture)
+        self.start_capture(stream.push_threadsafe)
+        return stream
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/webinspector.h":
+cdef extern from "libimobiledevice/webinspector.h" nogil:
     cdef struct webinspector_client_private:
         pass
     ctypedef webinspector_client_private *webinspector_client_t
@@ -48,13 +48,22 @@ cdef class WebinspectorClient(PropertyListService):
             self.handle_error(err)
 
     cdef inline int16_t _send(self, plist.plist_t node):
-        return webinspector_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = webinspector_send(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive(self, plist.plist_t* node):
-        return webinspector_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = webinspector_receive(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive_with_timeout(self, plist.plist_t* node, int timeout_ms):
-        return webinspector_receive_with_timeout(self._c_client, node, timeout_ms)
+        cdef int16_t err
+        with nogil:
+            err = webinspector_receive_with_timeout(self._c_client, node, timeout_ms)
+        return err
 
     cdef inline BaseError _error(self, int16_t ret):
         return WebinspectorError(ret)
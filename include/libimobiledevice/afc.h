@@ -63,6 +63,7 @@ typedef enum {
 	AFC_E_NO_MEM                = 31,
 	AFC_E_NOT_ENOUGH_DATA       = 32,
 	AFC_E_DIR_NOT_EMPTY         = 33,
+	AFC_E_HASH_MISMATCH         = 34,
 	AFC_E_FORCE_SIGNED_TYPE     = -1
 } afc_error_t;
 
@@ -76,6 +77,12 @@ typedef enum {
 	AFC_FOPEN_RDAPPEND = 0x00000006  /**< a+  O_RDWR   | O_APPEND | O_CREAT */
 } afc_file_mode_t;
 
+/** Flags for afc_download_file */
+typedef enum {
+	AFC_TRANSFER_RESUME = 1 << 0, /**< continue a partially downloaded local file */
+	AFC_TRANSFER_VERIFY = 1 << 1  /**< verify the result against the device side hash */
+} afc_transfer_flags_t;
+
 /** Type of link for afc_make_link() calls */
 typedef enum {
 	AFC_HARDLINK = 1,
@@ -92,6 +99,60 @@ typedef enum {
 typedef struct afc_client_private afc_client_private;
 typedef afc_client_private *afc_client_t; /**< The client handle. */
 
+/** File types as reported in the st_ifmt file info key */
+typedef enum {
+	AFC_FILE_TYPE_UNKNOWN = 0,
+	AFC_FILE_TYPE_REGULAR,
+	AFC_FILE_TYPE_DIRECTORY,
+	AFC_FILE_TYPE_SYMLINK,
+	AFC_FILE_TYPE_CHAR_DEVICE,
+	AFC_FILE_TYPE_BLOCK_DEVICE,
+	AFC_FILE_TYPE_FIFO,
+	AFC_FILE_TYPE_SOCKET
+} afc_file_type_t;
+
+/** Directory entry as returned by afc_read_directory_with_info() */
+typedef struct {
+	char *name;            /**< name of the entry, relative to the directory */
+	uint64_t size;         /**< st_size */
+	uint64_t mtime;        /**< st_mtime in nanoseconds since epoch */
+	afc_file_type_t type;  /**< st_ifmt */
+} afc_dir_entry_t;
+
+/** File information as returned by afc_get_file_info_typed() */
+typedef struct {
+	uint64_t size;         /**< st_size */
+	uint64_t blocks;       /**< st_blocks */
+	uint32_t nlink;        /**< st_nlink */
+	uint64_t mtime;        /**< st_mtime in nanoseconds since epoch */
+	uint64_t birthtime;    /**< st_birthtime in nanoseconds since epoch */
+	afc_file_type_t type;  /**< st_ifmt */
+	char *link_target;     /**< LinkTarget for symlinks, NULL otherwise */
+} afc_file_info_t;
+
+/** Device information as returned by afc_get_device_info_typed() */
+typedef struct {
+	char *model;           /**< Model, or NULL if not reported */
+	uint64_t total_bytes;  /**< FSTotalBytes */
+	uint64_t free_bytes;   /**< FSFreeBytes */
+	uint64_t block_size;   /**< FSBlockSize */
+} afc_device_info_t;
+
+/** Buffer usage of a client as returned by afc_get_buffer_stats() */
+typedef struct {
+	uint32_t send_buffer_size;  /**< current size of the send buffer */
+	uint32_t recv_buffer_size;  /**< current size of the receive buffer */
+	uint32_t send_high_water;   /**< largest send buffer size so far */
+	uint32_t recv_high_water;   /**< largest receive buffer size so far */
+	uint64_t allocations;       /**< number of buffer (re)allocations */
+} afc_buffer_stats_t;
+
+typedef struct afc_pool_private afc_pool_private;
+typedef afc_pool_private *afc_pool_t; /**< The connection pool handle. */
+
+/** Reports the progress of afc_copy_tree() and afc_put_tree() transfers */
+typedef void (*afc_progress_cb_t)(const char *path, uint64_t bytes_done, uint64_t bytes_total, void *user_data);
+
 /* Interface */
 
 /**
@@ -129,6 +190,60 @@ afc_error_t afc_client_start_service(idevice_t device, afc_client_t* client, con
  */
 afc_error_t afc_client_free(afc_client_t client);
 
+/**
+ * Creates a pool of AFC connections to the given device. All connections are
+ * started up front; a connection that fails to start, or one that broke
+ * while in use, is re-established lazily when it is acquired next.
+ *
+ * @param device The device to connect to.
+ * @param service_name The AFC based service to start, or NULL for
+ *        AFC_SERVICE_NAME.
+ * @param size The number of connections to keep.
+ * @param label The label to use for communication. Usually the program name.
+ *        Pass NULL to disable sending the label in requests to lockdownd.
+ * @param pool Pointer that will point to a newly allocated afc_pool_t upon
+ *        successful return. Must be freed using afc_pool_free() after use.
+ *
+ * @return AFC_E_SUCCESS on success, or an AFC_E_* error code if not even a
+ *         single connection could be established.
+ */
+afc_error_t afc_pool_new(idevice_t device, const char *service_name, uint32_t size, const char *label, afc_pool_t *pool);
+
+/**
+ * Frees an AFC connection pool and closes all of its connections.
+ * No connection may be in use when calling this function.
+ *
+ * @param pool The pool to free.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_pool_free(afc_pool_t pool);
+
+/**
+ * Takes a connection from the pool for exclusive use by the calling thread,
+ * blocking until one becomes available.
+ *
+ * @param pool The pool to take the connection from.
+ * @param client Pointer that will be set to the acquired client. Hand it
+ *        back with afc_pool_release().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value if a connection
+ *         had to be re-established and that failed.
+ */
+afc_error_t afc_pool_acquire(afc_pool_t pool, afc_client_t *client);
+
+/**
+ * Returns a connection to the pool. Connections that failed at the transport
+ * level are closed and re-established on a later afc_pool_acquire().
+ *
+ * @param pool The pool the connection was acquired from.
+ * @param client The client to return.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_INVALID_ARG if the client does
+ *         not belong to the pool.
+ */
+afc_error_t afc_pool_release(afc_pool_t pool, afc_client_t client);
+
 /**
  * Get device information for a connected client. The device information
  * returned is the device model as well as the free space, the total capacity
@@ -143,6 +258,27 @@ afc_error_t afc_client_free(afc_client_t client);
  */
 afc_error_t afc_get_device_info(afc_client_t client, char ***device_information);
 
+/**
+ * Get device information for a connected client, parsed into a structure.
+ *
+ * @param client The client to get device info for.
+ * @param device_info Pointer that will be set to the device information, or
+ *        NULL if there was an error. The structure and the strings it refers
+ *        to are a single allocation, free with afc_device_info_free().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_device_info_typed(afc_client_t client, afc_device_info_t **device_info);
+
+/**
+ * Frees device information as returned by afc_get_device_info_typed().
+ *
+ * @param device_info The device information to free.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_device_info_free(afc_device_info_t *device_info);
+
 /**
  * Gets a directory listing of the directory requested.
  *
@@ -156,6 +292,35 @@ afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
  */
 afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information);
 
+/**
+ * Gets a directory listing of the directory requested together with the
+ * size, modification time and type of each entry. The file information
+ * requests are pipelined, so the whole listing costs roughly one round trip
+ * per 64 entries instead of one per entry.
+ *
+ * @param client The client to get a directory listing from.
+ * @param path The directory for listing. (must be a fully-qualified path)
+ * @param entries Pointer that will be set to an array of directory entries,
+ *        excluding "." and "..", or NULL if there was an error. The array is
+ *        a single allocation, free with afc_dir_entries_free().
+ * @param count Pointer that will be set to the number of entries.
+ *
+ * @note Entries that vanish while the listing is collected are reported
+ *       with type AFC_FILE_TYPE_UNKNOWN.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_read_directory_with_info(afc_client_t client, const char *path, afc_dir_entry_t **entries, uint32_t *count);
+
+/**
+ * Frees a directory listing as returned by afc_read_directory_with_info().
+ *
+ * @param entries The array of directory entries.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_dir_entries_free(afc_dir_entry_t *entries);
+
 /**
  * Gets information about a specific file.
  *
@@ -169,6 +334,28 @@ afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***di
  */
 afc_error_t afc_get_file_info(afc_client_t client, const char *path, char ***file_information);
 
+/**
+ * Gets information about a specific file, parsed into a structure.
+ *
+ * @param client The client to use to get the information of the file.
+ * @param path The fully-qualified path to the file.
+ * @param file_info Pointer that will be set to the file information, or NULL
+ *        if there was an error. The structure and the strings it refers to
+ *        are a single allocation, free with afc_file_info_free().
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_file_info_typed(afc_client_t client, const char *path, afc_file_info_t **file_info);
+
+/**
+ * Frees file information as returned by afc_get_file_info_typed().
+ *
+ * @param file_info The file information to free.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_file_info_free(afc_file_info_t *file_info);
+
 /**
  * Opens a file on the device.
  *
@@ -186,6 +373,9 @@ afc_error_t afc_file_open(afc_client_t client, const char *filename, afc_file_mo
  *
  * @param client The client to close the file with.
  * @param handle File handle of a previously opened file.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value. In windowed
+ *         write mode this also reports a deferred write error.
  */
 afc_error_t afc_file_close(afc_client_t client, uint64_t handle);
 
@@ -216,6 +406,27 @@ afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t op
  */
 afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read);
 
+/**
+ * Reads the given number of bytes from the given file while keeping multiple
+ * read requests in flight, hiding the round trip latency of the connection.
+ * The data is delivered in order. A short read stops issuing new requests;
+ * replies to requests that are already in flight are drained before the
+ * function returns.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param data The pointer to the memory region to store the read data
+ * @param length The number of bytes to read
+ * @param chunk_size The number of bytes requested per read packet, or 0 to
+ *        use a default size.
+ * @param depth The maximum number of outstanding read requests. Values
+ *        larger than 64 are capped.
+ * @param bytes_read The number of bytes actually read.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t chunk_size, uint32_t depth, uint32_t *bytes_read);
+
 /**
  * Writes a given number of bytes to a file.
  *
@@ -229,6 +440,69 @@ afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint
  */
 afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written);
 
+/**
+ * Sets the maximum chunk size used by pipelined transfers on the given
+ * client. Packet buffers of the client that grow beyond this size for a
+ * single operation are released again afterwards, so memory use per client
+ * stays bounded.
+ *
+ * @param client The client to configure.
+ * @param size The maximum chunk size in bytes, or 0 for the default limits.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_set_max_chunk_size(afc_client_t client, uint32_t size);
+
+/**
+ * Retrieves the current packet buffer sizes of the given client together
+ * with their high-water marks.
+ *
+ * @param client The client to query.
+ * @param stats Pointer to a structure that will be filled.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_buffer_stats(afc_client_t client, afc_buffer_stats_t *stats);
+
+/**
+ * Enables or disables windowed write mode for the given client.
+ * In windowed mode afc_file_write() returns as soon as the data has been
+ * sent and only waits for a status reply once the given number of writes
+ * is outstanding. The first error reported by the device is returned by a
+ * later afc_file_write() or afc_file_close() call on the same client.
+ * All outstanding status replies are collected before any other operation
+ * on the client proceeds.
+ *
+ * @param client The client to configure.
+ * @param window The maximum number of writes that can be outstanding, at most
+ *        64. Pass 0 or 1 to wait for every write (the default behavior).
+ *
+ * @return AFC_E_SUCCESS on success, or the error of a previously deferred
+ *         write status that was collected while switching the mode.
+ */
+afc_error_t afc_set_write_window(afc_client_t client, uint32_t window);
+
+/**
+ * Enables or disables the metadata cache of the given client. While
+ * enabled, the replies of afc_get_file_info(), afc_get_file_info_typed(),
+ * afc_read_directory() and afc_read_directory_with_info() are kept for ttl
+ * milliseconds and repeated calls for the same path are answered without a
+ * device round trip. Changes made through this client with afc_file_open()
+ * for writing, afc_file_truncate(), afc_file_close(), afc_remove_path(),
+ * afc_remove_path_and_contents(), afc_rename_path(), afc_make_directory(),
+ * afc_make_link(), afc_truncate() and afc_set_file_time() drop the entries
+ * of the affected path, of everything below it and the listing of its
+ * parent directory. Changes made by other clients or on the device itself
+ * only become visible once the entries expire.
+ *
+ * @param client The client to configure.
+ * @param ttl Time in milliseconds entries stay valid, or 0 to disable the
+ *        cache (the default). Any change empties the cache.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_set_metadata_cache(afc_client_t client, uint32_t ttl);
+
 /**
  * Seeks to a given position of a pre-opened file on the device.
  *
@@ -344,6 +618,85 @@ afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mt
  */
 afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
 
+/**
+ * Deletes a list of files or empty directories, keeping several requests in
+ * flight instead of waiting for each reply.
+ *
+ * @param client The client to use.
+ * @param paths Array of paths to delete. (must be fully-qualified paths)
+ * @param count The number of paths.
+ * @param results Array of count elements that will be set to the result of
+ *        each path, or NULL.
+ *
+ * @note If the connection fails the remaining paths are not processed and
+ *       their results are set to the error of the connection.
+ *
+ * @return AFC_E_SUCCESS if all paths were deleted, otherwise the error of
+ *         the first path that failed.
+ */
+afc_error_t afc_remove_paths(afc_client_t client, const char **paths, uint32_t count, afc_error_t *results);
+
+/**
+ * Deletes a list of files or directories including possible contents,
+ * keeping several requests in flight.
+ *
+ * @param client The client to use.
+ * @param paths Array of paths to delete. (must be fully-qualified paths)
+ * @param count The number of paths.
+ * @param results Array of count elements that will be set to the result of
+ *        each path, or NULL.
+ * @note Only available in iOS 6 and later.
+ *
+ * @return Like afc_remove_paths().
+ */
+afc_error_t afc_remove_paths_and_contents(afc_client_t client, const char **paths, uint32_t count, afc_error_t *results);
+
+/**
+ * Renames a list of files or directories, keeping several requests in
+ * flight. The renames are sent in order.
+ *
+ * @param client The client to use.
+ * @param from Array of paths to rename. (must be fully-qualified paths)
+ * @param to Array of new names, one for each element of from.
+ * @param count The number of paths.
+ * @param results Array of count elements that will be set to the result of
+ *        each rename, or NULL.
+ *
+ * @return Like afc_remove_paths().
+ */
+afc_error_t afc_rename_paths(afc_client_t client, const char **from, const char **to, uint32_t count, afc_error_t *results);
+
+/**
+ * Creates a list of directories, keeping several requests in flight. The
+ * directories are created in order, so parents must come before their
+ * children.
+ *
+ * @param client The client to use.
+ * @param paths Array of directories to create. (must be fully-qualified paths)
+ * @param count The number of paths.
+ * @param results Array of count elements that will be set to the result of
+ *        each directory, or NULL.
+ *
+ * @return Like afc_remove_paths().
+ */
+afc_error_t afc_make_directories(afc_client_t client, const char **paths, uint32_t count, afc_error_t *results);
+
+/**
+ * Sets the modification time of a list of files, keeping several requests
+ * in flight.
+ *
+ * @param client The client to use.
+ * @param paths Array of paths of the files. (must be fully-qualified paths)
+ * @param mtimes Array of modification times in nanoseconds since epoch, one
+ *        for each path.
+ * @param count The number of paths.
+ * @param results Array of count elements that will be set to the result of
+ *        each path, or NULL.
+ *
+ * @return Like afc_remove_paths().
+ */
+afc_error_t afc_set_file_times(afc_client_t client, const char **paths, const uint64_t *mtimes, uint32_t count, afc_error_t *results);
+
 /* Helper functions */
 
 /**
@@ -359,6 +712,82 @@ afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
  */
 afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char **value);
 
+/**
+ * Copies a file or directory tree from the device to the host.
+ * Directories are walked with the first client, the files are then
+ * transferred in parallel using one worker thread per client, with large
+ * pipelined reads.
+ *
+ * @param clients Array of connected AFC clients for the same service on the
+ *        same device. Each client is used by exactly one worker.
+ * @param num_clients Number of clients in the array.
+ * @param device_path The file or directory on the device to copy.
+ * @param local_path The destination path on the host. Missing directories
+ *        are created.
+ * @param progress_cb Callback to report progress, or NULL. Calls are
+ *        serialized but may come from any worker thread.
+ * @param user_data Pointer passed to the progress callback.
+ *
+ * @return AFC_E_SUCCESS on success or the first AFC_E_* error value that
+ *         occurred. AFC_E_IO_ERROR indicates a local filesystem error.
+ */
+afc_error_t afc_copy_tree(afc_client_t *clients, uint32_t num_clients, const char *device_path, const char *local_path, afc_progress_cb_t progress_cb, void *user_data);
+
+/**
+ * Copies a file or directory tree from the host to the device.
+ * Directories are created with the first client, the files are then
+ * transferred in parallel using one worker thread per client, with windowed
+ * writes.
+ *
+ * @param clients Array of connected AFC clients for the same service on the
+ *        same device. Each client is used by exactly one worker.
+ * @param num_clients Number of clients in the array.
+ * @param local_path The file or directory on the host to copy.
+ * @param device_path The destination path on the device.
+ * @param progress_cb Callback to report progress, or NULL. Calls are
+ *        serialized but may come from any worker thread.
+ * @param user_data Pointer passed to the progress callback.
+ *
+ * @return AFC_E_SUCCESS on success or the first AFC_E_* error value that
+ *         occurred. AFC_E_IO_ERROR indicates a local filesystem error.
+ */
+afc_error_t afc_put_tree(afc_client_t *clients, uint32_t num_clients, const char *local_path, const char *device_path, afc_progress_cb_t progress_cb, void *user_data);
+
+/**
+ * Retrieves the hash of a file's contents as computed by the device.
+ *
+ * @param client The client to use.
+ * @param path The fully-qualified path of the file.
+ * @param hash Pointer that will be set to a newly allocated buffer holding the
+ *        raw hash (SHA1 on known devices). Free with free().
+ * @param hash_len Pointer that will be set to the length of the hash.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_get_file_hash(afc_client_t client, const char *path, char **hash, uint32_t *hash_len);
+
+/**
+ * Downloads a single file from the device, optionally resuming an existing
+ * partial local copy and verifying the result.
+ * When resuming, the transfer continues at the size of the local file using
+ * afc_file_seek(). With AFC_TRANSFER_VERIFY a SHA1 is computed while the data
+ * arrives (reading the already present part of a resumed file once) and
+ * compared with afc_get_file_hash(), so the file is never re-read after the
+ * download.
+ *
+ * @param client The client to use.
+ * @param device_path The fully-qualified path of the file on the device.
+ * @param local_path The destination path on the host.
+ * @param flags A combination of afc_transfer_flags_t values.
+ * @param progress_cb Callback to report progress, or NULL.
+ * @param user_data Pointer passed to the progress callback.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_HASH_MISMATCH if verification
+ *         failed, or another AFC_E_* error value. AFC_E_IO_ERROR indicates a
+ *         local filesystem error.
+ */
+afc_error_t afc_download_file(afc_client_t client, const char *device_path, const char *local_path, uint32_t flags, afc_progress_cb_t progress_cb, void *user_data);
+
 /**
  * Frees up a char dictionary as returned by some AFC functions.
  *
@@ -51,8 +51,14 @@ typedef enum {
 typedef struct companion_proxy_client_private companion_proxy_client_private;
 typedef companion_proxy_client_private *companion_proxy_client_t; /**< The client handle. */
 
+typedef struct companion_proxy_forwarder_private companion_proxy_forwarder_private;
+typedef companion_proxy_forwarder_private *companion_proxy_forwarder_t; /**< The forwarder handle. */
+
 typedef void (*companion_proxy_device_event_cb_t) (plist_t event, void* userdata);
 
+/** Number of idle connections a forwarder keeps per forwarded service */
+#define COMPANION_PROXY_FORWARDER_MAX_IDLE 8
+
 /**
  * Connects to the companion_proxy service on the specified device.
  *
@@ -201,6 +207,97 @@ companion_proxy_error_t companion_proxy_start_forwarding_service_port(companion_
  */
 companion_proxy_error_t companion_proxy_stop_forwarding_service_port(companion_proxy_client_t client, uint16_t remote_port);
 
+/**
+ * Creates a forwarder that manages forwarded companion service ports.
+ * Each service port is forwarded once and stays forwarded until the
+ * forwarder is freed. Connections to it are pooled for reuse by later
+ * consumers, and the device registry is cached.
+ *
+ * @param device The device the companion devices are paired with.
+ * @param label The label to use for communication with lockdownd.
+ * @param forwarder Pointer that will point to a newly allocated
+ *     companion_proxy_forwarder_t upon successful return. Must be freed
+ *     using companion_proxy_forwarder_free() after use.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_forwarder_new(idevice_t device, const char* label, companion_proxy_forwarder_t* forwarder);
+
+/**
+ * Retrieves the list of paired devices, using the result of an earlier
+ * call unless a refresh is requested.
+ *
+ * @param forwarder The companion_proxy forwarder
+ * @param refresh Set to non-zero to query the device again.
+ * @param paired_devices Pointer that will receive a PLIST_ARRAY with paired
+ *     device UDIDs. Free with plist_free() after use.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  COMPANION_PROXY_E_NO_DEVICES if no devices are paired,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_forwarder_get_device_registry(companion_proxy_forwarder_t forwarder, int refresh, plist_t* paired_devices);
+
+/**
+ * Starts forwarding several companion service ports at once. All
+ * companion_proxy connections are set up in one lockdown session and the
+ * forwarding requests are sent before any reply is awaited. Ports that are
+ * already forwarded are skipped.
+ *
+ * @param forwarder The companion_proxy forwarder
+ * @param remote_ports Array of count remote ports on the companion devices
+ * @param service_names Array of count service names, or NULL
+ * @param count Number of ports
+ * @param options PLIST_DICT with additional options as accepted by
+ *    companion_proxy_start_forwarding_service_port(), or NULL.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS if all ports are forwarded, or the
+ *  COMPANION_PROXY_E_* error code of a failed port otherwise.
+ */
+companion_proxy_error_t companion_proxy_forwarder_add_services(companion_proxy_forwarder_t forwarder, const uint16_t* remote_ports, const char** service_names, unsigned int count, plist_t options);
+
+/**
+ * Gets a connection to a forwarded companion service, forwarding the port
+ * first if needed. An idle pooled connection is handed out if available.
+ *
+ * @param forwarder The companion_proxy forwarder
+ * @param remote_port The remote port on the companion device
+ * @param service_name The service name to forward the port with, or NULL
+ * @param options PLIST_DICT with forwarding options, or NULL
+ * @param connection Pointer that will receive the connection. Hand it back
+ *     with companion_proxy_forwarder_release().
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_forwarder_connect(companion_proxy_forwarder_t forwarder, uint16_t remote_port, const char* service_name, plist_t options, idevice_connection_t* connection);
+
+/**
+ * Hands a connection back to the forwarder.
+ *
+ * @param forwarder The companion_proxy forwarder
+ * @param remote_port The remote port the connection was obtained for
+ * @param connection The connection
+ * @param reusable Non-zero if the connection is in a state where the next
+ *     consumer can use it, 0 to close it.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  COMPANION_PROXY_E_INVALID_ARG when forwarder or connection is NULL.
+ */
+companion_proxy_error_t companion_proxy_forwarder_release(companion_proxy_forwarder_t forwarder, uint16_t remote_port, idevice_connection_t connection, int reusable);
+
+/**
+ * Closes all pooled connections, stops forwarding all service ports and
+ * frees the forwarder.
+ *
+ * @param forwarder The companion_proxy forwarder
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_forwarder_free(companion_proxy_forwarder_t forwarder);
+
 #ifdef __cplusplus
 }
 #endif
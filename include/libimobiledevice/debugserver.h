@@ -138,6 +138,34 @@ debugserver_error_t debugserver_client_receive_with_timeout(debugserver_client_t
  */
 debugserver_error_t debugserver_client_receive(debugserver_client_t client, char *data, uint32_t size, uint32_t *received);
 
+/**
+ * Relays the raw debugserver connection to the given local socket in both
+ * directions until either side closes the connection.
+ * See idevice_connection_relay() for details.
+ *
+ * @param client The debugserver client
+ * @param fd The local socket to relay the connection to
+ *
+ * @return DEBUGSERVER_E_SUCCESS when one of the sides closed the connection,
+ *  DEBUGSERVER_E_INVALID_ARG when client is NULL or fd is invalid,
+ *  or an DEBUGSERVER_E_* error code otherwise.
+ */
+debugserver_error_t debugserver_client_relay(debugserver_client_t client, int fd);
+
+/**
+ * Gets the underlying connection of the given debugserver client, e.g. to
+ * relay the raw stream from an event loop with idevice_connection_get_fd()
+ * and idevice_connection_try_receive().
+ *
+ * @param client The debugserver client
+ * @param connection Pointer that receives the connection. The connection
+ *  is owned by the client and must not be disconnected.
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client or connection is NULL
+ */
+debugserver_error_t debugserver_client_get_connection(debugserver_client_t client, idevice_connection_t *connection);
+
 /**
  * Sends a command to the debugserver service.
  *
@@ -151,6 +179,28 @@ debugserver_error_t debugserver_client_receive(debugserver_client_t client, char
  */
 debugserver_error_t debugserver_client_send_command(debugserver_client_t client, debugserver_command_t command, char** response, size_t* response_size);
 
+/**
+ * Sends multiple independent commands back to back and receives their
+ * responses afterwards, which saves a round trip per command compared to
+ * debugserver_client_send_command().
+ *
+ * @note Only batch commands that do not depend on the result of a previous
+ *  command in the same batch, the server executes all of them.
+ *
+ * @param client The debugserver client
+ * @param commands Array of commands to send
+ * @param count Number of commands in the array
+ * @param responses Array of count entries receiving the response of each
+ *  command, entries of commands without a response are set to NULL.
+ *  The responses have to be freed by the caller. Can be NULL to ignore.
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client or commands is NULL or count is 0,
+ *  DEBUGSERVER_E_TIMEOUT when a response did not arrive in time,
+ *  or another error code on communication failure
+ */
+debugserver_error_t debugserver_client_send_commands(debugserver_client_t client, debugserver_command_t* commands, int count, char** responses);
+
 /**
  * Receives and parses response of debugserver service.
  *
@@ -202,6 +252,28 @@ debugserver_error_t debugserver_client_set_argv(debugserver_client_t client, int
  */
 debugserver_error_t debugserver_client_set_environment_hex_encoded(debugserver_client_t client, const char* env, char** response);
 
+/**
+ * Reads a block of memory of the debugged process.
+ *
+ * The maximum packet size is queried from the server once and binary
+ * memory reads ('x' packets) are used if supported, otherwise hex encoded
+ * reads ('m' packets). Large blocks are split into multiple requests that
+ * are sent ahead of their responses.
+ *
+ * @param client The debugserver client
+ * @param address Address of the memory to read
+ * @param length Number of bytes to read
+ * @param buffer Buffer of at least length bytes receiving the memory contents
+ * @param bytes_read Pointer to receive the number of bytes read, these are
+ *  valid even if an error is returned. Can be NULL to ignore.
+ *
+ * @return DEBUGSERVER_E_SUCCESS if all bytes were read,
+ *  DEBUGSERVER_E_INVALID_ARG when client or buffer is NULL,
+ *  DEBUGSERVER_E_RESPONSE_ERROR when the memory could not be read
+ *  completely, or another error code on communication failure
+ */
+debugserver_error_t debugserver_client_read_memory(debugserver_client_t client, uint64_t address, uint32_t length, char* buffer, uint32_t* bytes_read);
+
 /**
  * Creates and initializes a new command object.
  *
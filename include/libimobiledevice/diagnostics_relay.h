@@ -180,6 +180,32 @@ diagnostics_relay_error_t diagnostics_relay_query_ioregistry_entry(diagnostics_r
 
 diagnostics_relay_error_t diagnostics_relay_query_ioregistry_plane(diagnostics_relay_client_t client, const char* plane, plist_t* result);
 
+/**
+ * Sends several query requests over the connection and collects all replies.
+ * Requests are sent ahead of the replies so the round trip latency is paid
+ * once per window of requests instead of once per request.
+ *
+ * Each request is a PLIST_DICT as it would be sent by the individual query
+ * functions, e.g. { Request = "IORegistry"; EntryName = "AppleARMPMUCharger" }
+ * or { Request = "MobileGestalt"; MobileGestaltKeys = ( ... ) }. Requests that
+ * end the session or change the device state (Goodbye, Sleep, Restart,
+ * Shutdown) are not accepted.
+ *
+ * @param client The diagnostics_relay client
+ * @param requests A PLIST_ARRAY of request dictionaries
+ * @param results Pointer to store a PLIST_ARRAY with one reply dictionary
+ *        per request, in request order. A reply contains a "Status" string
+ *        and, if the request succeeded, the "Diagnostics" node. Free with
+ *        plist_free() after use.
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS if all replies were received,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when client, requests or results is
+ *  invalid, or DIAGNOSTICS_RELAY_E_PLIST_ERROR or
+ *  DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR if the communication failed. The
+ *  outcome of the individual requests is reported through their "Status".
+ */
+diagnostics_relay_error_t diagnostics_relay_query_multiple(diagnostics_relay_client_t client, plist_t requests, plist_t* results);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,12 +43,37 @@ typedef enum {
 	FILE_RELAY_E_INVALID_SOURCE    = -4,
 	FILE_RELAY_E_STAGING_EMPTY     = -5,
 	FILE_RELAY_E_PERMISSION_DENIED = -6,
+	FILE_RELAY_E_ARCHIVE_ERROR     = -7,
+	FILE_RELAY_E_ABORTED           = -8,
 	FILE_RELAY_E_UNKNOWN_ERROR     = -256
 } file_relay_error_t;
 
 typedef struct file_relay_client_private file_relay_client_private;
 typedef file_relay_client_private *file_relay_client_t; /**< The client handle. */
 
+/** An entry of the archive passed to the extraction callbacks */
+typedef struct {
+	const char *name; /**< path of the entry inside the archive */
+	uint32_t mode;    /**< file type and permission bits */
+	uint64_t mtime;   /**< modification time in seconds since the epoch */
+	uint64_t size;    /**< size of the entry data */
+	uint64_t offset;  /**< number of data bytes passed for this entry before the current chunk */
+} file_relay_entry_t;
+
+/**
+ * Filter callback for file_relay_extract_archive().
+ * Return non-zero to extract the entry, or 0 to skip it.
+ */
+typedef int (*file_relay_entry_filter_cb_t)(const file_relay_entry_t *entry, void *user_data);
+
+/**
+ * Data callback for file_relay_extract_archive(). It is called with the data
+ * of an entry in chunks as they are decompressed, followed by a call with
+ * data set to NULL and length 0 once the entry is complete. Return 0 to
+ * continue or non-zero to abort the extraction.
+ */
+typedef int (*file_relay_entry_cb_t)(const file_relay_entry_t *entry, const char *data, uint32_t length, void *user_data);
+
 /**
  * Connects to the file_relay service on the specified device.
  *
@@ -107,7 +132,8 @@ file_relay_error_t file_relay_client_free(file_relay_client_t client);
  *     - tmp
  *     - SystemConfiguration
  * @param connection The connection that has to be used for receiving the
- *     data using idevice_connection_receive(). The connection will be closed
+ *     data using idevice_connection_receive() or to be forwarded to a local
+ *     socket using idevice_connection_relay(). The connection will be closed
  *     automatically by the device, but use file_relay_client_free() to clean
  *     up properly.
  * @param timeout Maximum time in milliseconds to wait for data.
@@ -141,7 +167,8 @@ file_relay_error_t file_relay_request_sources(file_relay_client_t client, const
  *     - tmp
  *     - SystemConfiguration
  * @param connection The connection that has to be used for receiving the
- *     data using idevice_connection_receive(). The connection will be closed
+ *     data using idevice_connection_receive() or to be forwarded to a local
+ *     socket using idevice_connection_relay(). The connection will be closed
  *     automatically by the device, but use file_relay_client_free() to clean
  *     up properly.
  *
@@ -158,6 +185,33 @@ file_relay_error_t file_relay_request_sources(file_relay_client_t client, const
  */
 file_relay_error_t file_relay_request_sources_timeout(file_relay_client_t client, const char **sources, idevice_connection_t *connection, unsigned int timeout);
 
+/**
+ * Receives the archive sent over a connection returned by
+ * file_relay_request_sources() and unpacks it while it arrives.
+ *
+ * The gzip compressed CPIO archive is decompressed and walked incrementally,
+ * so the entries can be written to their destination without staging the
+ * whole archive first. Uncompressed archives are supported as well.
+ *
+ * @param connection The connection returned by file_relay_request_sources().
+ * @param filter Callback deciding which entries to extract, or NULL to
+ *     extract all entries.
+ * @param entry_cb Callback receiving the data of the extracted entries.
+ * @param user_data User data passed to the callbacks.
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @note Compressed archives can only be extracted if libimobiledevice was
+ *     built with zlib support.
+ *
+ * @return FILE_RELAY_E_SUCCESS if the complete archive was extracted,
+ *     FILE_RELAY_E_INVALID_ARG when one or more parameters are invalid,
+ *     FILE_RELAY_E_MUX_ERROR if a communication error occurs,
+ *     FILE_RELAY_E_ARCHIVE_ERROR if the archive is malformed or
+ *     compressed without zlib support, or FILE_RELAY_E_ABORTED if the
+ *     entry callback aborted the extraction.
+ */
+file_relay_error_t file_relay_extract_archive(idevice_connection_t connection, file_relay_entry_filter_cb_t filter, file_relay_entry_cb_t entry_cb, void *user_data, unsigned int timeout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -47,6 +47,20 @@ typedef enum {
 typedef struct heartbeat_client_private heartbeat_client_private;
 typedef heartbeat_client_private *heartbeat_client_t; /**< The client handle. */
 
+typedef struct heartbeat_scheduler_private heartbeat_scheduler_private;
+typedef heartbeat_scheduler_private *heartbeat_scheduler_t; /**< The keepalive scheduler handle. */
+
+/** Link health of a device serviced by a keepalive scheduler */
+struct heartbeat_health {
+	uint32_t interval_ms; /**< Heartbeat interval announced by the device */
+	uint32_t last_delay_ms; /**< How late the last heartbeat arrived */
+	uint32_t average_delay_ms; /**< Moving average of the heartbeat delay */
+	uint32_t max_delay_ms; /**< Largest heartbeat delay seen */
+	uint64_t beats; /**< Number of heartbeats answered */
+	uint64_t missed; /**< Number of heartbeats that did not arrive in time */
+	int connected; /**< 0 once the connection failed or the device went away */
+};
+
 /**
  * Connects to the heartbeat service on the specified device.
  *
@@ -129,6 +143,66 @@ heartbeat_error_t heartbeat_receive(heartbeat_client_t client, plist_t * plist);
  */
 heartbeat_error_t heartbeat_receive_with_timeout(heartbeat_client_t client, plist_t * plist, uint32_t timeout_ms);
 
+/**
+ * Creates a keepalive scheduler which answers the heartbeat requests of any
+ * number of devices from a single thread. Devices are dropped automatically
+ * once their removal is reported by usbmuxd.
+ *
+ * @param scheduler Pointer that will point to the new scheduler. Must be
+ *     freed with heartbeat_scheduler_free() after use.
+ *
+ * @return HEARTBEAT_E_SUCCESS on success, HEARTBEAT_E_INVALID_ARG when
+ *     scheduler is NULL, or HEARTBEAT_E_UNKNOWN_ERROR otherwise.
+ */
+heartbeat_error_t heartbeat_scheduler_new(heartbeat_scheduler_t *scheduler);
+
+/**
+ * Hands a heartbeat client over to the scheduler, which answers the
+ * heartbeat requests on it from now on and frees it when the device is
+ * removed.
+ *
+ * @param scheduler The keepalive scheduler
+ * @param client The heartbeat client, owned by the scheduler from now on
+ * @param udid The UDID of the device the client is connected to
+ *
+ * @return HEARTBEAT_E_SUCCESS on success, HEARTBEAT_E_INVALID_ARG when an
+ *     argument is NULL or a client for udid is already scheduled.
+ */
+heartbeat_error_t heartbeat_scheduler_add(heartbeat_scheduler_t scheduler, heartbeat_client_t client, const char *udid);
+
+/**
+ * Stops servicing a device and frees its heartbeat client.
+ *
+ * @param scheduler The keepalive scheduler
+ * @param udid The UDID of the device
+ *
+ * @return HEARTBEAT_E_SUCCESS on success, HEARTBEAT_E_INVALID_ARG when the
+ *     device is not scheduled.
+ */
+heartbeat_error_t heartbeat_scheduler_remove(heartbeat_scheduler_t scheduler, const char *udid);
+
+/**
+ * Gets the link health of a device serviced by the scheduler.
+ *
+ * @param scheduler The keepalive scheduler
+ * @param udid The UDID of the device
+ * @param health Pointer to a struct heartbeat_health to fill
+ *
+ * @return HEARTBEAT_E_SUCCESS on success, HEARTBEAT_E_INVALID_ARG when the
+ *     device is not scheduled.
+ */
+heartbeat_error_t heartbeat_scheduler_get_health(heartbeat_scheduler_t scheduler, const char *udid, struct heartbeat_health *health);
+
+/**
+ * Stops the scheduler thread and frees all remaining heartbeat clients.
+ *
+ * @param scheduler The keepalive scheduler
+ *
+ * @return HEARTBEAT_E_SUCCESS on success, HEARTBEAT_E_INVALID_ARG when
+ *     scheduler is NULL.
+ */
+heartbeat_error_t heartbeat_scheduler_free(heartbeat_scheduler_t scheduler);
+
 #ifdef __cplusplus
 }
 #endif
@@ -41,6 +41,7 @@ typedef enum {
 	HOUSE_ARREST_E_PLIST_ERROR   = -2,
 	HOUSE_ARREST_E_CONN_FAILED   = -3,
 	HOUSE_ARREST_E_INVALID_MODE  = -4,
+	HOUSE_ARREST_E_COMMAND_FAILED = -5,
 	HOUSE_ARREST_E_UNKNOWN_ERROR = -256
 } house_arrest_error_t;
 
@@ -172,6 +173,36 @@ house_arrest_error_t house_arrest_get_result(house_arrest_client_t client, plist
  */
 afc_error_t afc_client_new_from_house_arrest_client(house_arrest_client_t client, afc_client_t *afc_client);
 
+/**
+ * Opens the containers of many applications at once and returns an AFC
+ * client for each of them.
+ *
+ * The house_arrest services are started with a single pipelined lockdownd
+ * request and the connections, including their SSL handshakes and the vend
+ * commands, are set up by several threads in parallel.
+ *
+ * @param device The device to connect to.
+ * @param command The vend command to send for every application, either
+ *     "VendContainer" or "VendDocuments".
+ * @param appids Array of bundle identifiers of the applications.
+ * @param count Number of bundle identifiers.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ * @param afc_clients Array of count AFC clients that will be set to a client
+ *     for the container of each application, or NULL if the container could
+ *     not be opened. Every non-NULL entry owns its connection and has to be
+ *     freed with afc_client_free(), also when an error is returned.
+ * @param errors Optional array of count error codes that will receive the
+ *     result for each application. Pass NULL if not needed.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS if all containers were opened,
+ *     HOUSE_ARREST_E_INVALID_ARG if a parameter is invalid, or the error
+ *     code of the first application that failed otherwise.
+ *     HOUSE_ARREST_E_COMMAND_FAILED denotes that the device rejected the
+ *     vend command, for example because the application is not installed.
+ */
+house_arrest_error_t house_arrest_vend_containers(idevice_t device, const char *command, const char **appids, unsigned int count, const char *label, afc_client_t *afc_clients, house_arrest_error_t *errors);
+
 #ifdef __cplusplus
 }
 #endif
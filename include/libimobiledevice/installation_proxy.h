@@ -113,6 +113,12 @@ typedef instproxy_client_private *instproxy_client_t; /**< The client handle. */
 /** Reports the status response of the given command */
 typedef void (*instproxy_status_cb_t) (plist_t command, plist_t status, void *user_data);
 
+/** Reports a page of applications found by instproxy_browse_pages().
+ *  current_list is the PLIST_ARRAY of the received page; it is only valid
+ *  during the callback and must not be freed. Return non-zero to skip the
+ *  remaining pages. */
+typedef int (*instproxy_browse_page_cb_t) (plist_t current_list, uint64_t current_index, uint64_t total, void *user_data);
+
 /* Interface */
 
 /**
@@ -191,6 +197,32 @@ instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_opt
  */
 instproxy_error_t instproxy_browse_with_callback(instproxy_client_t client, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
+/**
+ * List installed applications page by page, handing each page to a callback
+ * as soon as it is received. Unlike instproxy_browse() no result array is
+ * built, so memory use stays bounded by the size of a single page.
+ *
+ * If client_options does not contain "ReturnAttributes", only the attributes
+ * CFBundleIdentifier, CFBundleShortVersionString, CFBundleVersion,
+ * CFBundleDisplayName and ApplicationType are requested.
+ *
+ * @param client The connected installation_proxy client
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        Valid client options include:
+ *          "ApplicationType" -> "System"
+ *          "ApplicationType" -> "User"
+ *          "ApplicationType" -> "Internal"
+ *          "ApplicationType" -> "Any"
+ *          "ReturnAttributes" -> PLIST_ARRAY of attribute names
+ * @param page_cb Callback function called for each page of application
+ *        information. Passing a callback is required.
+ * @param user_data Callback data passed to page_cb.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *         an error occurred.
+ */
+instproxy_error_t instproxy_browse_pages(instproxy_client_t client, plist_t client_options, instproxy_browse_page_cb_t page_cb, void *user_data);
+
 /**
  * Lookup information about specific applications from the device.
  *
@@ -227,9 +259,10 @@ instproxy_error_t instproxy_lookup(instproxy_client_t client, const char** appid
  *         an error occurred.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occurring during the command has to be
- *       handled inside the specified callback function.
+ *       INSTPROXY_E_SUCCESS immediately once the command has been queued;
+ *       queued commands are run one after another in the order they were
+ *       issued. Any error occurring during the command has to be handled
+ *       inside the specified callback function.
  */
 instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -255,9 +288,10 @@ instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_p
  *         an error occurred.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occurring during the command has to be
- *       handled inside the specified callback function.
+ *       INSTPROXY_E_SUCCESS immediately once the command has been queued;
+ *       queued commands are run one after another in the order they were
+ *       issued. Any error occurring during the command has to be handled
+ *       inside the specified callback function.
  */
 instproxy_error_t instproxy_upgrade(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -276,9 +310,10 @@ instproxy_error_t instproxy_upgrade(instproxy_client_t client, const char *pkg_p
  *     an error occurred.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occurring during the command has to be
- *       handled inside the specified callback function.
+ *       INSTPROXY_E_SUCCESS immediately once the command has been queued;
+ *       queued commands are run one after another in the order they were
+ *       issued. Any error occurring during the command has to be handled
+ *       inside the specified callback function.
  */
 instproxy_error_t instproxy_uninstall(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -318,9 +353,10 @@ instproxy_error_t instproxy_lookup_archives(instproxy_client_t client, plist_t c
  *     an error occurred.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occurring during the command has to be
- *       handled inside the specified callback function.
+ *       INSTPROXY_E_SUCCESS immediately once the command has been queued;
+ *       queued commands are run one after another in the order they were
+ *       issued. Any error occurring during the command has to be handled
+ *       inside the specified callback function.
  */
 instproxy_error_t instproxy_archive(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -342,9 +378,10 @@ instproxy_error_t instproxy_archive(instproxy_client_t client, const char *appid
  *     an error occurred.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occurring during the command has to be
- *       handled inside the specified callback function.
+ *       INSTPROXY_E_SUCCESS immediately once the command has been queued;
+ *       queued commands are run one after another in the order they were
+ *       issued. Any error occurring during the command has to be handled
+ *       inside the specified callback function.
  */
 instproxy_error_t instproxy_restore(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -365,9 +402,10 @@ instproxy_error_t instproxy_restore(instproxy_client_t client, const char *appid
  *         an error occurred.
  *
  * @note If a callback function is given (async mode), this function returns
- *       INSTPROXY_E_SUCCESS immediately if the status updater thread has been
- *       created successfully; any error occurring during the command has to be
- *       handled inside the specified callback function.
+ *       INSTPROXY_E_SUCCESS immediately once the command has been queued;
+ *       queued commands are run one after another in the order they were
+ *       issued. Any error occurring during the command has to be handled
+ *       inside the specified callback function.
  */
 instproxy_error_t instproxy_remove_archive(instproxy_client_t client, const char *appid, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
@@ -497,6 +535,39 @@ void instproxy_client_options_free(plist_t client_options);
  */
 instproxy_error_t instproxy_client_get_path_for_bundle_identifier(instproxy_client_t client, const char* bundle_id, char** path);
 
+/**
+ * Enables caching of instproxy_lookup() results for the given bundle
+ * identifiers in the client, which also speeds up
+ * instproxy_client_get_path_for_bundle_identifier(). Results are cached
+ * separately per set of client options.
+ *
+ * The cache is cleared whenever the device posts the
+ * com.apple.mobile.application_installed or _uninstalled notification, and
+ * when a command that changes applications (install, upgrade, uninstall,
+ * archive, restore) is sent through this client. A shared
+ * notification_proxy connection is used for that, see
+ * np_client_start_service_shared(). If the notification connection fails,
+ * caching is turned off again.
+ *
+ * @param client The connected installation proxy client.
+ * @param device The device the client is connected to.
+ *
+ * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_INVALID_ARG if
+ *         a parameter is invalid, or INSTPROXY_E_CONN_FAILED if notifications
+ *         could not be set up.
+ */
+instproxy_error_t instproxy_client_enable_cache(instproxy_client_t client, idevice_t device);
+
+/**
+ * Drops all cached lookup results of the client.
+ *
+ * @param client The installation proxy client.
+ *
+ * @return INSTPROXY_E_SUCCESS on success, or INSTPROXY_E_INVALID_ARG if
+ *         client is NULL.
+ */
+instproxy_error_t instproxy_client_clear_cache(instproxy_client_t client);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,7 +43,8 @@ typedef enum {
 	IDEVICE_E_NO_DEVICE       = -3,
 	IDEVICE_E_NOT_ENOUGH_DATA = -4,
 	IDEVICE_E_SSL_ERROR       = -6,
-	IDEVICE_E_TIMEOUT         = -7
+	IDEVICE_E_TIMEOUT         = -7,
+	IDEVICE_E_WOULD_BLOCK     = -8
 } idevice_error_t;
 
 typedef struct idevice_private idevice_private;
@@ -65,6 +66,37 @@ enum idevice_connection_type {
 	CONNECTION_NETWORK
 };
 
+/** TCP tuning options applied to connections to network devices */
+typedef struct {
+	int nodelay; /**< Set TCP_NODELAY to disable Nagle's algorithm (default: 1) */
+	int keepalive; /**< Enable TCP keepalive probes (default: 0) */
+	int keepalive_idle; /**< Idle time in seconds before the first keepalive probe is sent, or 0 for the system default */
+	int keepalive_interval; /**< Interval in seconds between keepalive probes, or 0 for the system default */
+	int keepalive_count; /**< Number of unanswered probes after which the connection is dropped, or 0 for the system default */
+	int send_buffer_size; /**< Socket send buffer size in bytes, or 0 for the default */
+	int recv_buffer_size; /**< Socket receive buffer size in bytes, or 0 for the default */
+} idevice_network_options_t;
+
+/** Traffic counters of a connection, see idevice_connection_get_stats() */
+typedef struct {
+	uint64_t bytes_sent; /**< Payload bytes sent */
+	uint64_t bytes_received; /**< Payload bytes received */
+	uint64_t send_syscalls; /**< Number of send/poll operations performed on the socket (approximate for SSL) */
+	uint64_t recv_syscalls; /**< Number of receive/poll operations performed on the socket (approximate for SSL) */
+	uint64_t tls_records_sent; /**< Number of TLS records sent (estimated from the record size) */
+	uint64_t tls_records_received; /**< Number of TLS record reads that returned data */
+	uint64_t send_blocked_us; /**< Time in microseconds spent in send functions */
+	uint64_t recv_blocked_us; /**< Time in microseconds spent in receive functions, including waiting for data */
+	uint64_t crypto_bytes_saved; /**< Payload bytes sent and received in plaintext after SSL was dropped following the handshake; for devices only counted once the connection is closed */
+} idevice_connection_stats_t;
+
+/** Priority classes of connections to the same device, see idevice_connection_set_qos() */
+typedef enum {
+	IDEVICE_PRIORITY_INTERACTIVE = 0, /**< Latency sensitive traffic, e.g. debugserver or syslog_relay */
+	IDEVICE_PRIORITY_NORMAL = 1, /**< Default class of connections */
+	IDEVICE_PRIORITY_BULK = 2 /**< Transfers like backups and file copies, sent in slices that yield to the other classes */
+} idevice_connection_priority_t;
+
 struct idevice_info {
 	char *udid;
 	enum idevice_connection_type conn_type;
@@ -92,6 +124,17 @@ typedef struct {
 /** Callback to notifiy if a device was added or removed. */
 typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_data);
 
+/** Handle of an event subscription created with idevice_events_subscribe() */
+typedef struct idevice_subscription_context* idevice_subscription_context_t;
+
+/** An event recorded by the binary tracer, see idevice_trace_enable() */
+typedef struct {
+	uint64_t timestamp; /**< Monotonic time of the event in microseconds */
+	uint32_t seq;       /**< Sequence number, starting at 1 */
+	uint32_t event;     /**< Event id, see idevice_trace_event_name() */
+	uint64_t args[3];   /**< Event specific arguments */
+} idevice_trace_event_t;
+
 /* functions */
 
 /**
@@ -101,9 +144,196 @@ typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_dat
  */
 void idevice_set_debug_level(int level);
 
+/**
+ * Enable or disable the binary event tracer. While enabled, hot paths like
+ * connection and SSL I/O, plist messages and AFC packets record a
+ * timestamp, an event id and a few integers into a lock-free ring buffer,
+ * which is cheap enough to be left enabled in production. The buffer is
+ * allocated on the first call enabling the tracer and is kept for the
+ * lifetime of the process, so recorded events remain available for
+ * idevice_trace_snapshot() after the tracer has been disabled again.
+ *
+ * @param num_events Capacity of the ring buffer, rounded up to a power of
+ *     two. Only the first enabling call sets the capacity. Pass 0 to
+ *     disable the tracer.
+ */
+void idevice_trace_enable(uint32_t num_events);
+
+/**
+ * Copy the events currently held in the trace ring buffer, oldest first.
+ * Events that are overwritten while being copied are skipped.
+ *
+ * @param events Array receiving the events.
+ * @param max_events Number of entries in events. If the buffer holds more
+ *     events, only the most recent max_events ones are copied.
+ *
+ * @return The number of events copied.
+ */
+uint32_t idevice_trace_snapshot(idevice_trace_event_t *events, uint32_t max_events);
+
+/**
+ * Get the name of a trace event id.
+ *
+ * @param event The event id of an idevice_trace_event_t.
+ *
+ * @return A static string with the name, or "unknown".
+ */
+const char *idevice_trace_event_name(uint32_t event);
+
+/**
+ * Write the events currently held in the trace ring buffer to a file, one
+ * line per event with timestamp, sequence number, event name and
+ * arguments.
+ *
+ * @param filename Path of the file to write, or NULL for stderr.
+ *
+ * @return The number of events written, or -1 if tracing was never
+ *     enabled or the file could not be written.
+ */
+int idevice_trace_dump(const char *filename);
+
+/**
+ * Get a snapshot of the library-wide metrics. Counters are kept per device
+ * UDID (traffic, connections, SSL handshakes and their latency), per
+ * service (plist messages and bytes), for AFC (requests by operation and
+ * connection pool usage) and for the shared thread pool. Per device and
+ * per service counters accumulate over the lifetime of the process, also
+ * across device handles and connections that have been freed.
+ *
+ * @param metrics Pointer to a plist_t that will be set to a PLIST_DICT
+ *     with the keys "Devices", "Services", "AFC", "ThreadPool" and
+ *     "LatencyBucketBounds". Must be freed with plist_free().
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_metrics_get(plist_t *metrics);
+
+/**
+ * Format the library-wide metrics in the OpenMetrics text exposition
+ * format, as understood by Prometheus and compatible scrapers.
+ *
+ * @param text Pointer that will be set to a newly allocated, null
+ *     terminated string. Must be freed with free().
+ * @param length Pointer that will be set to the length of text, can be
+ *     NULL.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_metrics_format_openmetrics(char **text, uint32_t *length);
+
+/**
+ * Serve the library-wide metrics over HTTP from a background thread.
+ * GET requests for /metrics return the output of
+ * idevice_metrics_format_openmetrics(). The endpoint only listens on the
+ * loopback interface; calling this function again replaces a running
+ * endpoint.
+ *
+ * @param port The TCP port to listen on, or 0 to stop serving.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_UNKNOWN_ERROR if the port
+ *     could not be bound.
+ */
+idevice_error_t idevice_metrics_serve(uint16_t port);
+
+/**
+ * Set the connection broker used by devices created afterwards with
+ * idevice_new() or idevice_new_with_options(). For those devices,
+ * lockdownd_client_new_with_handshake() and the *_client_start_service()
+ * functions obtain warm lockdown sessions and service connections from the
+ * broker instead of performing the handshakes themselves, and connect
+ * directly if the broker cannot be reached. The default is taken from the
+ * LIBIMOBILEDEVICE_BROKER environment variable.
+ *
+ * @note Brokers are only supported on systems with Unix domain sockets.
+ *
+ * @param path Path of the broker's Unix socket, or NULL to connect
+ *     directly.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_UNKNOWN_ERROR if brokers are
+ *     not supported on this platform.
+ */
+idevice_error_t idevice_set_broker(const char *path);
+
+/**
+ * Run a connection broker from a background thread. The broker keeps a
+ * warm lockdown session for every attached device and hands ready channels
+ * to clients connecting to its Unix socket, see idevice_set_broker(). The
+ * socket is only accessible by the current user; calling this function
+ * again replaces a running broker.
+ *
+ * @param path Path of the Unix socket to listen on, or NULL to stop the
+ *     broker.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_UNKNOWN_ERROR if the socket
+ *     could not be created or brokers are not supported on this platform.
+ */
+idevice_error_t idevice_broker_serve(const char *path);
+
+/**
+ * Record the payload of all connections made from now on to a capture
+ * file, with a timestamp per send and receive. Data is recorded as the
+ * connection functions exchange it, i.e. after SSL was terminated, so
+ * captures contain everything the device sent in plaintext, including
+ * pairing and session data. Data moved with idevice_connection_relay() is
+ * not recorded. The default is taken from the LIBIMOBILEDEVICE_CAPTURE
+ * environment variable; starting a new capture closes the previous file.
+ *
+ * @param filename The capture file to create
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_UNKNOWN_ERROR if the file
+ *     could not be created.
+ */
+idevice_error_t idevice_capture_start(const char *filename);
+
+/**
+ * Stop recording connections and close the capture file.
+ *
+ * @return IDEVICE_E_SUCCESS
+ */
+idevice_error_t idevice_capture_stop(void);
+
+/** Speed at which recorded sessions are served, see idevice_replay_start() */
+typedef enum {
+	IDEVICE_REPLAY_RECORDED_SPEED = 0, /**< Deliver received data at the time it was recorded */
+	IDEVICE_REPLAY_MAX_SPEED = 1 /**< Deliver received data as soon as the client sent everything preceding it */
+} idevice_replay_speed_t;
+
+/**
+ * Serve devices from a capture file written by idevice_capture_start()
+ * instead of real devices. idevice_new() and idevice_new_with_options()
+ * then return the recorded device with the given udid, or the first one,
+ * and each idevice_connect() plays the next unused connection recorded to
+ * the same port: data the client sends is consumed without being compared,
+ * and the recorded responses are returned in order. SSL is skipped on
+ * these connections and pairing is not attempted, so unmodified service
+ * clients run against the recording as long as they make the same
+ * requests. The default is taken from the LIBIMOBILEDEVICE_REPLAY
+ * environment variable, with LIBIMOBILEDEVICE_REPLAY_SPEED=max selecting
+ * maximum speed.
+ *
+ * @note Replay is only supported on systems with Unix domain sockets.
+ *
+ * @param filename The capture file to replay
+ * @param speed Whether to keep the recorded timing
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_UNKNOWN_ERROR if the file
+ *     could not be read or replay is not supported on this platform.
+ */
+idevice_error_t idevice_replay_start(const char *filename, idevice_replay_speed_t speed);
+
+/**
+ * Stop serving devices from a capture file. Devices created before keep
+ * using it.
+ *
+ * @return IDEVICE_E_SUCCESS
+ */
+idevice_error_t idevice_replay_stop(void);
+
 /**
  * Register a callback function that will be called when device add/remove
- * events occur.
+ * events occur. Registering another callback with this function replaces
+ * the previous one; use idevice_events_subscribe() for multiple
+ * subscribers.
  *
  * @param callback Callback function to call.
  * @param user_data Application-specific data passed as parameter
@@ -121,6 +351,35 @@ idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_
  */
 idevice_error_t idevice_event_unsubscribe(void);
 
+/**
+ * Subscribe a callback function that will be called when device add/remove
+ * events occur. Any number of subscriptions can be active at the same time.
+ * Each subscriber's callback is invoked from a dedicated dispatch thread, so
+ * a slow callback does not delay event delivery to other subscribers.
+ * Devices that are already attached are reported with IDEVICE_DEVICE_ADD
+ * events right after subscribing.
+ *
+ * @param context Pointer that will be set to the handle of the new
+ *   subscription, to be passed to idevice_events_unsubscribe().
+ * @param callback Callback function to call.
+ * @param user_data Application-specific data passed as parameter
+ *   to the registered callback function.
+ *
+ * @return IDEVICE_E_SUCCESS on success or an error value when an error occurred.
+ */
+idevice_error_t idevice_events_subscribe(idevice_subscription_context_t *context, idevice_event_cb_t callback, void *user_data);
+
+/**
+ * Release a subscription created with idevice_events_subscribe(). Once this
+ * function returns the callback will not be invoked anymore, unless it is
+ * called from within the callback itself.
+ *
+ * @param context The subscription handle to release.
+ *
+ * @return IDEVICE_E_SUCCESS on success or an error value when an error occurred.
+ */
+idevice_error_t idevice_events_unsubscribe(idevice_subscription_context_t context);
+
 /* discovery (synchronous) */
 
 /**
@@ -241,6 +500,32 @@ idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connect
  */
 idevice_error_t idevice_disconnect(idevice_connection_t connection);
 
+/**
+ * Set the TCP options used for connections to network devices.
+ * The options are applied by idevice_connect() to every new connection
+ * with a device of type CONNECTION_NETWORK; they are ignored for
+ * connections via usbmuxd.
+ *
+ * @param device The device to set the options for, or NULL to set the
+ *    process-wide defaults used by devices without own options.
+ * @param options The options to use, or NULL to revert to the defaults
+ *    (the process-wide ones when device is non-NULL).
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_set_network_options(idevice_t device, const idevice_network_options_t *options);
+
+/**
+ * Get the TCP options that will be used for new connections to the given
+ * network device.
+ *
+ * @param device The device to query, or NULL for the process-wide defaults.
+ * @param options Pointer to a structure that will be filled with the options.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_get_network_options(idevice_t device, idevice_network_options_t *options);
+
 /* communication */
 
 /**
@@ -288,6 +573,39 @@ idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connecti
  */
 idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes);
 
+/**
+ * Receive data from a device via the given connection without blocking.
+ * This function returns immediately with the data that is available right
+ * now, which might be less than len bytes. It is meant to be used from an
+ * event loop together with idevice_connection_get_fd() and
+ * idevice_connection_get_pending_bytes().
+ *
+ * @param connection The connection to receive data from.
+ * @param data Buffer that will be filled with the received data.
+ *   This buffer has to be large enough to hold len bytes.
+ * @param len Buffer size or maximum number of bytes to receive.
+ * @param recv_bytes Number of bytes actually received.
+ *
+ * @return IDEVICE_E_SUCCESS if at least one byte was received,
+ *    IDEVICE_E_WOULD_BLOCK if no data is available at the moment,
+ *    or another error code otherwise.
+ */
+idevice_error_t idevice_connection_try_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes);
+
+/**
+ * Get the number of bytes that can be read from the given connection
+ * without the underlying file descriptor becoming readable.
+ * For SSL connections this is data that has already been received and
+ * decrypted; an event loop must not wait for the fd to become readable
+ * while this is non-zero. For plain connections this is always 0.
+ *
+ * @param connection The connection to query
+ * @param pending Pointer to an uint32_t that receives the number of bytes
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_get_pending_bytes(idevice_connection_t connection, uint32_t *pending);
+
 /**
  * Enables SSL for the given connection.
  *
@@ -324,6 +642,23 @@ idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection);
 idevice_error_t idevice_connection_disable_bypass_ssl(idevice_connection_t connection, uint8_t sslBypass);
 
 
+/**
+ * Relay data between the given connection and a local socket in both
+ * directions until either side closes the connection.
+ * For plain connections splice() is used where available to move the data
+ * without copying it through userspace; SSL connections and other systems
+ * use a single poll() loop. This can be used to forward raw service
+ * streams, e.g. debugserver or file_relay connections, to local clients.
+ * Neither the connection nor fd are closed by this function.
+ *
+ * @param connection The connection to relay
+ * @param fd The local socket to relay the connection to
+ *
+ * @return IDEVICE_E_SUCCESS when one of the sides closed the connection,
+ *    otherwise an error code.
+ */
+idevice_error_t idevice_connection_relay(idevice_connection_t connection, int fd);
+
 /**
  * Get the underlying file descriptor for a connection
  *
@@ -334,6 +669,45 @@ idevice_error_t idevice_connection_disable_bypass_ssl(idevice_connection_t conne
  */
 idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd);
 
+/**
+ * Get the traffic counters of the given connection.
+ *
+ * @param connection The connection to query
+ * @param stats Pointer to a structure that will be filled with the counters
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_get_stats(idevice_connection_t connection, idevice_connection_stats_t *stats);
+
+/**
+ * Set the priority class and rate limit of the given connection.
+ *
+ * Sends of a connection wait while sends of a higher class are in progress
+ * on other connections made with the same device handle, for at most a few
+ * milliseconds each time. Bulk connections send large buffers in slices so
+ * that the other classes get through while a transfer is running. Service
+ * clients get a class matching their service by default.
+ *
+ * @param connection The connection to configure
+ * @param priority The priority class, IDEVICE_PRIORITY_NORMAL by default
+ * @param rate_limit Maximum average rate in bytes per second the connection
+ *   sends and receives with, or 0 for no limit
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_set_qos(idevice_connection_t connection, idevice_connection_priority_t priority, uint32_t rate_limit);
+
+/**
+ * Get the traffic counters aggregated over all connections that have been
+ * made with the given device handle, including closed ones.
+ *
+ * @param device The device handle to query
+ * @param stats Pointer to a structure that will be filled with the counters
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_get_stats(idevice_t device, idevice_connection_stats_t *stats);
+
 /* misc */
 
 /**
@@ -0,0 +1,120 @@
+/**
+ * @file libimobiledevice/location_simulation.h
+ * @brief Simulate the location of the device.
+ * \internal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ILOCATION_SIMULATION_H
+#define ILOCATION_SIMULATION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+#define LOCATION_SIMULATION_SERVICE_NAME "com.apple.dt.simulatelocation"
+
+/** Error Codes */
+typedef enum {
+	LOCATION_SIMULATION_E_SUCCESS       =  0,
+	LOCATION_SIMULATION_E_INVALID_ARG   = -1,
+	LOCATION_SIMULATION_E_MUX_ERROR     = -2,
+	LOCATION_SIMULATION_E_SSL_ERROR     = -3,
+	LOCATION_SIMULATION_E_UNKNOWN_ERROR = -256
+} location_simulation_error_t;
+
+typedef struct location_simulation_client_private location_simulation_client_private;
+typedef location_simulation_client_private *location_simulation_client_t; /**< The client handle. */
+
+/**
+ * Connects to the location simulation service on the specified device.
+ * The service is only available with a mounted developer disk image.
+ *
+ * @param device The device to connect to.
+ * @param service The service descriptor returned by lockdownd_start_service.
+ * @param client Pointer that will point to a newly allocated
+ *     location_simulation_client_t upon successful return. Must be freed
+ *     using location_simulation_client_free() after use.
+ *
+ * @return LOCATION_SIMULATION_E_SUCCESS on success,
+ *     LOCATION_SIMULATION_E_INVALID_ARG when a parameter is invalid, or an
+ *     LOCATION_SIMULATION_E_* error code otherwise.
+ */
+location_simulation_error_t location_simulation_client_new(idevice_t device, lockdownd_service_descriptor_t service, location_simulation_client_t *client);
+
+/**
+ * Starts a new location simulation service on the specified device and
+ * connects to it.
+ *
+ * @param device The device to connect to.
+ * @param client Pointer that will point to a newly allocated
+ *     location_simulation_client_t upon successful return. Must be freed
+ *     using location_simulation_client_free() after use.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ *
+ * @return LOCATION_SIMULATION_E_SUCCESS on success, or an
+ *     LOCATION_SIMULATION_E_* error code otherwise.
+ */
+location_simulation_error_t location_simulation_client_start_service(idevice_t device, location_simulation_client_t *client, const char *label);
+
+/**
+ * Disconnects a location simulation client from the device and frees up
+ * the client data. The simulated location stays in effect until
+ * location_simulation_stop() is called.
+ *
+ * @param client The location simulation client to disconnect and free.
+ *
+ * @return LOCATION_SIMULATION_E_SUCCESS on success,
+ *     LOCATION_SIMULATION_E_INVALID_ARG when client is NULL, or an
+ *     LOCATION_SIMULATION_E_* error code otherwise.
+ */
+location_simulation_error_t location_simulation_client_free(location_simulation_client_t client);
+
+/**
+ * Sets the simulated location. It can be called any number of times on
+ * the same connection, e.g. to move the device along a route.
+ *
+ * @param client The location simulation client
+ * @param latitude The latitude in degrees, -90 to 90
+ * @param longitude The longitude in degrees, -180 to 180
+ *
+ * @return LOCATION_SIMULATION_E_SUCCESS on success,
+ *     LOCATION_SIMULATION_E_INVALID_ARG when client is NULL or a coordinate
+ *     is out of range, or an LOCATION_SIMULATION_E_* error code otherwise.
+ */
+location_simulation_error_t location_simulation_set(location_simulation_client_t client, double latitude, double longitude);
+
+/**
+ * Stops the location simulation, so the device reports its real location
+ * again.
+ *
+ * @param client The location simulation client
+ *
+ * @return LOCATION_SIMULATION_E_SUCCESS on success,
+ *     LOCATION_SIMULATION_E_INVALID_ARG when client is NULL, or an
+ *     LOCATION_SIMULATION_E_* error code otherwise.
+ */
+location_simulation_error_t location_simulation_stop(location_simulation_client_t client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -138,9 +138,26 @@ lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t *cli
  */
 lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdownd_client_t *client, const char *label);
 
+/**
+ * Enables caching of authenticated lockdownd sessions.
+ * With caching enabled, lockdownd_client_free() keeps clients created by
+ * lockdownd_client_new_with_handshake() open instead of closing their
+ * session, and a later lockdownd_client_new_with_handshake() call for
+ * the same device reuses such a client without repeating the handshake.
+ * Each cached session is used by one client at a time. Sessions idle for
+ * longer than the timeout are closed. Cached sessions of a device are
+ * closed when the device is freed. Caching is disabled by default.
+ *
+ * @param timeout Idle time in seconds after which a cached session is
+ *     closed, or 0 to disable caching and close all cached sessions.
+ */
+void lockdownd_set_session_cache_timeout(unsigned int timeout);
+
 /**
  * Closes the lockdownd client session if one is running and frees up the
- * lockdownd_client struct.
+ * lockdownd_client struct. If session caching is enabled, clients created
+ * by lockdownd_client_new_with_handshake() are kept for reuse instead.
+ * @see lockdownd_set_session_cache_timeout
  *
  * @param client The lockdown client
  *
@@ -172,6 +189,49 @@ lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type);
  */
 lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value);
 
+/**
+ * Retrieves multiple values of a domain at once.
+ * The requests are pipelined, so fetching many keys takes about one
+ * round trip instead of one per key.
+ *
+ * @param client An initialized lockdownd client.
+ * @param domain The domain to query on or NULL for global domain
+ * @param keys NULL-terminated array of key names to request
+ * @param out Pointer that will be set to a newly allocated PLIST_DICT
+ *     mapping each key to its value. Keys the device did not return a
+ *     value for are omitted. Free with plist_free() after use.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when client,
+ *     keys or out is NULL, or an LOCKDOWN_E_* error code when the
+ *     communication with the device failed.
+ */
+lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char *domain, const char **keys, plist_t *out);
+
+/**
+ * Enables caching of the values of a domain read with lockdownd_get_value()
+ * and lockdownd_get_values(). Cached values are kept per device across
+ * clients and served without a request to the device until the TTL has
+ * passed. Values of the global domain that cannot change while the device
+ * is attached, like UniqueDeviceID, ProductType, ProductVersion or
+ * WiFiAddress, are kept until the device is detached, or for at least an
+ * hour. Values read without a session are cached separately from those read
+ * within one, as lockdownd returns more values once a session is started.
+ * lockdownd_set_value() and lockdownd_remove_value() drop the values they
+ * change; use np_subscribe_lockdown_value_cache() to drop values like
+ * DeviceName when they are changed on the device. Caching is disabled for
+ * all domains by default.
+ *
+ * @note Devices are only noticed to be detached while idevice events are
+ *     subscribed to, see idevice_events_subscribe(). Otherwise values that
+ *     cannot change expire after an hour or the TTL, whichever is longer.
+ *
+ * @param domain The domain, or NULL for the global domain
+ * @param ttl Time in seconds values of the domain are served from the
+ *     cache, or 0 to disable caching for the domain. Values cached before
+ *     are dropped.
+ */
+void lockdownd_set_value_cache_ttl(const char *domain, unsigned int ttl);
+
 /**
  * Sets a preferences value using a plist and optional by domain and/or key name.
  *
@@ -228,6 +288,24 @@ lockdownd_error_t lockdownd_start_service(lockdownd_client_t client, const char
  */
 lockdownd_error_t lockdownd_start_service_with_escrow_bag(lockdownd_client_t client, const char *identifier, lockdownd_service_descriptor_t *service);
 
+/**
+ * Requests to start multiple services at once. The StartService requests
+ * are pipelined, so starting several services needs about one round trip.
+ *
+ * @param client The lockdownd client
+ * @param identifiers Array of identifiers of the services to start
+ * @param count Number of identifiers
+ * @param services Array of count service descriptors that will be set to
+ *  the descriptor of each started service, or NULL for services that could
+ *  not be started. Every non-NULL entry has to be freed with
+ *  lockdownd_service_descriptor_free(), also when an error is returned.
+ *
+ * @return LOCKDOWN_E_SUCCESS if all services were started,
+ *  LOCKDOWN_E_INVALID_ARG if a parameter is NULL, or the error code of the
+ *  first service that failed to start otherwise.
+ */
+lockdownd_error_t lockdownd_start_services(lockdownd_client_t client, const char **identifiers, unsigned int count, lockdownd_service_descriptor_t *services);
+
 /**
  * Opens a session with lockdownd and switches to SSL mode if device wants it.
  *
@@ -350,6 +428,34 @@ lockdownd_error_t lockdownd_validate_pair(lockdownd_client_t client, lockdownd_p
  */
 lockdownd_error_t lockdownd_unpair(lockdownd_client_t client, lockdownd_pair_record_t pair_record);
 
+/**
+ * Configures a pool of pre-generated host keys for pairing.
+ * Generating the RSA keys is the most expensive part of pairing a device.
+ * With a pool configured, background threads generate root and host key
+ * pairs in advance so lockdownd_pair() only has to sign the device
+ * certificate. Each pool entry is used for one pair operation only.
+ * The pool is disabled by default.
+ *
+ * @param size Number of key sets to keep ready (at most 256), or 0 to
+ *    disable the pool and free all pre-generated keys.
+ * @param workers Number of background threads refilling the pool (at most 16).
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when size or
+ *  workers is out of range
+ */
+lockdownd_error_t lockdownd_set_pair_key_pool(unsigned int size, unsigned int workers);
+
+/**
+ * Waits until the pool of pre-generated host keys is full.
+ * @see lockdownd_set_pair_key_pool
+ *
+ * @param timeout Maximum time to wait in milliseconds, or 0 to wait forever.
+ *
+ * @return LOCKDOWN_E_SUCCESS when the pool is full, LOCKDOWN_E_INVALID_CONF
+ *  if no pool is configured, LOCKDOWN_E_RECEIVE_TIMEOUT on timeout
+ */
+lockdownd_error_t lockdownd_wait_pair_key_pool(unsigned int timeout);
+
 /**
  * Activates the device. Only works within an open session.
  * The ActivationRecord plist dictionary must be obtained using the
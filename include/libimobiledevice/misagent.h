@@ -46,6 +46,25 @@ typedef enum {
 typedef struct misagent_client_private misagent_client_private;
 typedef misagent_client_private *misagent_client_t; /**< The client handle. */
 
+/** Summary of a provisioning profile, see misagent_profile_get_info() */
+typedef struct {
+	char uuid[64]; /**< The profile UUID, empty if not found */
+	char name[256]; /**< The profile name, truncated if longer, empty if not found */
+	int64_t expiration_date; /**< Expiration date as UNIX timestamp, 0 if not found */
+} misagent_profile_info_t;
+
+/**
+ * Callback for misagent_profiles_foreach().
+ *
+ * @param data The raw profile data. Only valid during the callback.
+ * @param size The size of the profile data.
+ * @param info Summary of the profile.
+ * @param user_data The user data passed to misagent_profiles_foreach().
+ *
+ * @return 0 to continue with the next profile, non-zero to stop.
+ */
+typedef int (*misagent_profile_cb_t)(const char* data, uint64_t size, const misagent_profile_info_t* info, void* user_data);
+
 /* Interface */
 
 /**
@@ -138,6 +157,38 @@ misagent_error_t misagent_copy(misagent_client_t client, plist_t* profiles);
  */
 misagent_error_t misagent_copy_all(misagent_client_t client, plist_t* profiles);
 
+/**
+ * Retrieves the installed provisioning profiles and passes them to a
+ * callback one at a time. The profile data is handed out directly from the
+ * received message without copying, and only the UUID, name and expiration
+ * date are extracted from it instead of parsing the whole embedded plist.
+ *
+ * @param client The connected misagent to use.
+ * @param copy_all Non-zero to use the CopyAll request (iOS 9.3 and later),
+ *     0 to use the Copy request of older iOS versions.
+ * @param callback The callback to call for each profile.
+ * @param user_data User data passed to the callback.
+ *
+ * @return MISAGENT_E_SUCCESS on success, MISAGENT_E_INVALID_ARG when
+ *     client or callback is invalid, or an MISAGENT_E_* error code otherwise.
+ */
+misagent_error_t misagent_profiles_foreach(misagent_client_t client, int copy_all, misagent_profile_cb_t callback, void* user_data);
+
+/**
+ * Extracts UUID, name and expiration date from a provisioning profile by
+ * scanning the XML plist embedded in the CMS envelope, without decoding
+ * the envelope or parsing the plist.
+ *
+ * @param data The raw profile data.
+ * @param size The size of the profile data.
+ * @param info Pointer to a misagent_profile_info_t to fill.
+ *
+ * @return MISAGENT_E_SUCCESS if at least the UUID was found,
+ *     MISAGENT_E_INVALID_ARG when data or info is NULL, or
+ *     MISAGENT_E_PLIST_ERROR otherwise.
+ */
+misagent_error_t misagent_profile_get_info(const char* data, uint64_t size, misagent_profile_info_t* info);
+
 /**
  * Removes a given provisioning profile.
  *
@@ -151,6 +202,41 @@ misagent_error_t misagent_copy_all(misagent_client_t client, plist_t* profiles);
  */
 misagent_error_t misagent_remove(misagent_client_t client, const char* profileID);
 
+/**
+ * Installs several provisioning profiles over the connection. All requests
+ * are pipelined, keeping a few of them in flight at a time.
+ *
+ * @param client The connected misagent to use.
+ * @param profiles A PLIST_ARRAY of PLIST_DATA nodes with the profiles.
+ * @param status_codes Optional array with one entry per profile that will
+ *     receive the status code of the respective install request, or -1 if
+ *     the request was not answered. Pass NULL if not needed.
+ *
+ * @return MISAGENT_E_SUCCESS if all profiles were installed,
+ *     MISAGENT_E_INVALID_ARG when an argument is invalid,
+ *     MISAGENT_E_REQUEST_FAILED if any of the requests failed, or an
+ *     MISAGENT_E_* error code if the communication failed.
+ */
+misagent_error_t misagent_install_multiple(misagent_client_t client, plist_t profiles, int* status_codes);
+
+/**
+ * Removes several provisioning profiles over the connection. All requests
+ * are pipelined, keeping a few of them in flight at a time.
+ *
+ * @param client The connected misagent to use.
+ * @param profile_ids Array of count profile UUIDs.
+ * @param count The number of profile UUIDs.
+ * @param status_codes Optional array with one entry per profile that will
+ *     receive the status code of the respective remove request, or -1 if
+ *     the request was not answered. Pass NULL if not needed.
+ *
+ * @return MISAGENT_E_SUCCESS if all profiles were removed,
+ *     MISAGENT_E_INVALID_ARG when an argument is invalid,
+ *     MISAGENT_E_REQUEST_FAILED if any of the requests failed, or an
+ *     MISAGENT_E_* error code if the communication failed.
+ */
+misagent_error_t misagent_remove_multiple(misagent_client_t client, const char** profile_ids, uint32_t count, int* status_codes);
+
 /**
  * Retrieves the status code from the last operation.
  *
@@ -44,6 +44,13 @@ typedef enum {
 	MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR  = -256
 } mobile_image_mounter_error_t;
 
+/** Mount state of an image as reported by mobile_image_mounter_get_mount_state() */
+typedef enum {
+	MOBILE_IMAGE_MOUNTER_STATE_NOT_MOUNTED   = 0, /**< no image of the given type is mounted */
+	MOBILE_IMAGE_MOUNTER_STATE_MOUNTED       = 1, /**< the image with the given signature is mounted */
+	MOBILE_IMAGE_MOUNTER_STATE_MOUNTED_OTHER = 2  /**< an image with a different signature is mounted */
+} mobile_image_mounter_mount_state_t;
+
 typedef struct mobile_image_mounter_client_private mobile_image_mounter_client_private;
 typedef mobile_image_mounter_client_private *mobile_image_mounter_client_t; /**< The client handle. */
 
@@ -109,6 +116,29 @@ mobile_image_mounter_error_t mobile_image_mounter_free(mobile_image_mounter_clie
  */
 mobile_image_mounter_error_t mobile_image_mounter_lookup_image(mobile_image_mounter_client_t client, const char *image_type, plist_t *result);
 
+/**
+ * Tells if the image with the given signature is already mounted, so that
+ * uploading and mounting it again can be skipped.
+ *
+ * The image signatures from the lookup result are compared with the given
+ * signature. Older devices that only report whether an image is present
+ * are considered to have the image with the given signature mounted.
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param image_type The type of the image to look up
+ * @param signature Buffer with the signature of the local image
+ * @param signature_size Size of the signature buffer
+ * @param state Pointer that will be set to the mount state of the image.
+ *
+ * @note Clients for different devices do not share any state, so the mount
+ *    state of many devices can be checked concurrently from separate threads.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on success,
+ *    MOBILE_IMAGE_MOUNTER_E_INVALID_ARG if one or more parameters are
+ *    invalid, or another error code otherwise.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_get_mount_state(mobile_image_mounter_client_t client, const char *image_type, const char *signature, uint16_t signature_size, mobile_image_mounter_mount_state_t *state);
+
 /**
  * Uploads an image with an optional signature to the device.
  *
@@ -128,6 +158,27 @@ mobile_image_mounter_error_t mobile_image_mounter_lookup_image(mobile_image_moun
  */
 mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata);
 
+/**
+ * Uploads an image from a memory buffer to the device.
+ *
+ * Unlike mobile_image_mounter_upload_image() the data is sent in large
+ * slices directly from the given buffer, which makes this function a good
+ * fit for memory-mapped image files.
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param image_type Type of image that is being uploaded.
+ * @param image_data Pointer to the image data.
+ * @param image_size Total size of the image.
+ * @param signature Buffer with a signature of the image being uploaded. If
+ *    NULL, no signature will be used.
+ * @param signature_size Total size of the image signature buffer. If 0, no
+ *    signature will be used.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on succes, or a
+ *    MOBILE_IMAGE_MOUNTER_E_* error code otherwise.
+ */
+mobile_image_mounter_error_t mobile_image_mounter_upload_image_buffer(mobile_image_mounter_client_t client, const char *image_type, const char *image_data, size_t image_size, const char *signature, uint16_t signature_size);
+
 /**
  * Mounts an image on the device.
  *
@@ -106,6 +106,25 @@ mobilebackup_error_t mobilebackup_client_free(mobilebackup_client_t client);
  */
 mobilebackup_error_t mobilebackup_receive(mobilebackup_client_t client, plist_t *plist);
 
+/**
+ * Polls the device for mobilebackup data and gives direct access to the file
+ * data block of a received DLSendFile message, without copying it.
+ *
+ * @param client The mobilebackup client
+ * @param plist A pointer to the location where the received message will be
+ *    stored. It has to be freed with plist_free() once the data block is
+ *    not needed anymore.
+ * @param data Set to the file data block inside of plist, or NULL if the
+ *    message is not a DLSendFile message. The block is only valid until plist
+ *    is freed.
+ * @param length Set to the size of the file data block in bytes.
+ *
+ * @return MOBILEBACKUP_E_SUCCESS on success, MOBILEBACKUP_E_INVALID_ARG if
+ *    one of the parameters is invalid, or an MOBILEBACKUP_E_* error code
+ *    if receiving failed.
+ */
+mobilebackup_error_t mobilebackup_receive_file_data(mobilebackup_client_t client, plist_t *plist, const char **data, uint64_t *length);
+
 /**
  * Sends mobilebackup data to the device
  *
@@ -164,6 +164,34 @@ mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_client_t client, cons
  */
 mobilebackup2_error_t mobilebackup2_receive_raw(mobilebackup2_client_t client, char *data, uint32_t length, uint32_t *bytes);
 
+/**
+ * Sets the size of the buffer used to coalesce data sent with
+ * mobilebackup2_send_raw(). With a buffer, small writes like the length
+ * and code headers of a file block are sent together with the block data.
+ * Buffered data is sent when the buffer is full, when
+ * mobilebackup2_flush_raw() is called, and automatically before any
+ * message is sent or data is received.
+ *
+ * @param client The MobileBackup client to use.
+ * @param size Size of the buffer in bytes, or 0 to disable buffering (default).
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS on success,
+ *     MOBILEBACKUP2_E_INVALID_ARG if client is invalid,
+ *     or MOBILEBACKUP2_E_MUX_ERROR if pending data could not be sent.
+ */
+mobilebackup2_error_t mobilebackup2_set_raw_buffer_size(mobilebackup2_client_t client, uint32_t size);
+
+/**
+ * Sends any data buffered by mobilebackup2_send_raw() to the device.
+ *
+ * @param client The MobileBackup client to use.
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS on success,
+ *     MOBILEBACKUP2_E_INVALID_ARG if client is invalid,
+ *     or MOBILEBACKUP2_E_MUX_ERROR if sending the data failed.
+ */
+mobilebackup2_error_t mobilebackup2_flush_raw(mobilebackup2_client_t client);
+
 /**
  * Performs the mobilebackup2 protocol version exchange.
  *
@@ -68,6 +68,13 @@ typedef struct {
 } mobilesync_anchors;
 typedef mobilesync_anchors *mobilesync_anchors_t; /**< Anchors used by the device and computer. */
 
+/**
+ * Callback receiving the record batches of mobilesync_sync_from_device().
+ * The entities and actions are owned by the caller and only valid during
+ * the callback. Return 0 to continue or non-zero to cancel the session.
+ */
+typedef int (*mobilesync_records_cb_t)(plist_t entities, plist_t actions, uint8_t is_last_record, mobilesync_sync_type_t sync_type, void *user_data);
+
 /* Interface */
 
 /**
@@ -283,6 +290,33 @@ mobilesync_error_t mobilesync_ready_to_send_changes_from_computer(mobilesync_cli
  */
 mobilesync_error_t mobilesync_send_changes(mobilesync_client_t client, plist_t entities, uint8_t is_last_record, plist_t actions);
 
+/**
+ * Sends a large set of changed entities of the currently set data class to
+ * the device. The entities are split into batches and several batches are
+ * kept outstanding instead of waiting for the remapping response of each
+ * batch before sending the next one.
+ *
+ * @param client The mobilesync client
+ * @param entities All changed entity records as a PLIST_DICT
+ * @param actions Additional actions for the device created with
+ *    mobilesync_actions_new() that are sent with every batch, or NULL if no
+ *    actions should be passed
+ * @param batch_size Number of entities per batch, or 0 for the default of 500
+ * @param window Number of batches that may be outstanding, or 0 for the
+ *    default of 4
+ * @param mapping Pointer that will be set to a PLIST_DICT holding the merged
+ *    identifier remappings of all batches, or NULL if the device did not
+ *    remap any identifiers. Pass NULL to ignore the remappings.
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_WRONG_DIRECTION if the current sync direction does
+ * not permit this call
+ * @retval MOBILESYNC_E_CANCELLED if the device explicitly cancelled the
+ * session
+ */
+mobilesync_error_t mobilesync_send_changes_windowed(mobilesync_client_t client, plist_t entities, plist_t actions, uint32_t batch_size, uint32_t window, plist_t *mapping);
+
 /**
  * Receives any remapped identifiers reported after the device merged submitted changes.
  *
@@ -320,6 +354,61 @@ mobilesync_anchors_t mobilesync_anchors_new(const char *device_anchor, const cha
  */
 void mobilesync_anchors_free(mobilesync_anchors_t anchors);
 
+/**
+ * Loads the anchors of a data class from an anchor store file.
+ *
+ * @param path Path of the anchor store, a property list that keeps the
+ *  anchors of each data class.
+ * @param data_class The data class to load the anchors for
+ *
+ * @return A new #mobilesync_anchors_t struct that must be freed using
+ *  mobilesync_anchors_free(), or NULL if no anchors are stored.
+ */
+mobilesync_anchors_t mobilesync_anchors_load(const char *path, const char *data_class);
+
+/**
+ * Stores the anchors of a data class in an anchor store file, keeping the
+ * anchors of the other data classes.
+ *
+ * @param path Path of the anchor store
+ * @param data_class The data class to store the anchors for
+ * @param anchors The anchors to store, or NULL to remove the stored anchors
+ *  of the data class.
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_UNKNOWN_ERROR if the file could not be written
+ */
+mobilesync_error_t mobilesync_anchors_save(const char *path, const char *data_class, mobilesync_anchors_t anchors);
+
+/**
+ * Runs a complete incremental sync session that receives the records of a
+ * data class from the device.
+ *
+ * The anchors of the last successful session are taken from the anchor
+ * store, so the device can choose a fast sync which only transfers the
+ * changes; a slow sync is only done when the device requests it. Each
+ * batch is acknowledged before it is passed to the callback, letting the
+ * device prepare the next batch in the meantime. The anchors are updated
+ * in the store once the session finished successfully.
+ *
+ * @param client The mobilesync client
+ * @param data_class The data class identifier to sync
+ * @param computer_data_class_version The version of the data class storage on the computer
+ * @param anchor_store Path of the anchor store, see mobilesync_anchors_load()
+ * @param records_cb Callback receiving the record batches
+ * @param user_data User data passed to the callback
+ * @param sync_type Pointer that will receive the sync type chosen by the
+ *  device, or NULL.
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_SYNC_REFUSED if the device refused to sync
+ * @retval MOBILESYNC_E_CANCELLED if the device or the callback cancelled
+ *  the session
+ */
+mobilesync_error_t mobilesync_sync_from_device(mobilesync_client_t client, const char *data_class, uint64_t computer_data_class_version, const char *anchor_store, mobilesync_records_cb_t records_cb, void *user_data, mobilesync_sync_type_t *sync_type);
+
 
 /**
  * Create a new actions plist to use in mobilesync_send_changes().
@@ -30,6 +30,7 @@ extern "C" {
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/service.h>
 
 #define NP_SERVICE_NAME "com.apple.mobile.notification_proxy"
 
@@ -89,6 +90,8 @@ typedef np_client_private *np_client_t; /**< The client handle. */
 /** Reports which notification was received. */
 typedef void (*np_notify_cb_t) (const char *notification, void *user_data);
 
+typedef struct np_subscription *np_subscription_t; /**< Handle for a notification subscription, see np_subscribe() */
+
 /* Interface */
 
 /**
@@ -120,12 +123,34 @@ np_error_t np_client_new(idevice_t device, lockdownd_service_descriptor_t servic
  */
 np_error_t np_client_start_service(idevice_t device, np_client_t* client, const char* label);
 
+/**
+ * Returns a notification_proxy client for the specified device that is
+ * shared with every other caller of this function for the same device.
+ * The first call starts the service, later calls only take a reference on
+ * the existing connection. Use np_subscribe() to receive notifications on
+ * a shared client.
+ *
+ * @param device The device to connect to.
+ * @param client Pointer that will point to the shared np_client_t upon
+ *     successful return. Must be released using np_client_free() after use;
+ *     the connection is closed when the last reference is released.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ *
+ * @return NP_E_SUCCESS on success, or an NP_E_* error
+ *     code otherwise.
+ */
+np_error_t np_client_start_service_shared(idevice_t device, np_client_t* client, const char* label);
+
 /**
  * Disconnects a notification_proxy client from the device and frees up the
  * notification_proxy client data.
  *
  * @param client The notification_proxy client to disconnect and free.
  *
+ * @note For a client obtained with np_client_start_service_shared() this
+ *    only releases one reference.
+ *
  * @return NP_E_SUCCESS on success, or NP_E_INVALID_ARG when client is NULL.
  */
 np_error_t np_client_free(np_client_t client);
@@ -189,6 +214,74 @@ np_error_t np_observe_notifications(np_client_t client, const char **notificatio
  */
 np_error_t np_set_notify_callback(np_client_t client, np_notify_cb_t notify_cb, void *userdata);
 
+/**
+ * Registers an additional consumer for notifications on the given client.
+ * Any number of subscriptions can exist next to the callback set with
+ * np_set_notify_callback(); all of them are served by the same notifier
+ * thread. Notifications that are not yet observed are requested from the
+ * device. In case of an error condition the callback is called with an
+ * empty notification "".
+ *
+ * @param client The NP client
+ * @param notifications NULL terminated array of notification names this
+ *        subscription is interested in, or NULL to receive every
+ *        notification observed on the client.
+ * @param notify_cb Callback function to invoke for matching notifications.
+ * @param user_data Pointer that will be passed to the callback function.
+ * @param subscription Pointer that will be set to the new subscription on
+ *        success. Pass it to np_unsubscribe() to remove it again.
+ *
+ * @note Callbacks must not call np_subscribe() or np_unsubscribe().
+ *
+ * @return NP_E_SUCCESS on success, NP_E_INVALID_ARG when client, notify_cb
+ *         or subscription is NULL, or an NP_E_* error code otherwise.
+ */
+np_error_t np_subscribe(np_client_t client, const char **notifications, np_notify_cb_t notify_cb, void *user_data, np_subscription_t *subscription);
+
+/**
+ * Removes a subscription registered with np_subscribe() and frees it.
+ * The notifications stay observed on the device.
+ *
+ * @param client The NP client
+ * @param subscription The subscription to remove
+ *
+ * @return NP_E_SUCCESS on success, or NP_E_INVALID_ARG when client or
+ *         subscription is NULL or the subscription is unknown.
+ */
+np_error_t np_unsubscribe(np_client_t client, np_subscription_t subscription);
+
+/**
+ * Keeps the lockdown value cache of the client's device up to date: values
+ * the device reports as changed, e.g. DeviceName on
+ * NP_DEVICE_NAME_CHANGED, are dropped from the cache so the next
+ * lockdownd_get_value() fetches them again.
+ * @see lockdownd_set_value_cache_ttl
+ *
+ * @param client The NP client
+ * @param subscription Pointer that will be set to the new subscription on
+ *        success. Pass it to np_unsubscribe() to remove it again.
+ *
+ * @return NP_E_SUCCESS on success, NP_E_INVALID_ARG when client or
+ *         subscription is NULL, or an NP_E_* error code otherwise.
+ */
+np_error_t np_subscribe_lockdown_value_cache(np_client_t client, np_subscription_t *subscription);
+
+/**
+ * Makes the notifier thread re-establish the service connection when it is
+ * lost, e.g. after a USB hub reset or a Wi-Fi outage, and observe all
+ * previously observed notifications again. Callbacks are only called with
+ * the empty notification "" once the reconnect has been given up or if the
+ * proxy shut down. Notifications posted by the device while disconnected
+ * are lost. It is disabled by default.
+ *
+ * @param client The NP client
+ * @param policy The backoff to apply between attempts, or NULL to stop
+ *        the notifier thread when the connection is lost.
+ *
+ * @return NP_E_SUCCESS on success, or NP_E_INVALID_ARG when client is NULL.
+ */
+np_error_t np_set_reconnect(np_client_t client, const service_reconnect_policy_t *policy);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,197 @@
+/**
+ * @file libimobiledevice/os_trace_relay.h
+ * @brief Capture the unified log stream from a device.
+ * \internal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IOS_TRACE_RELAY_H
+#define IOS_TRACE_RELAY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+#define OS_TRACE_RELAY_SERVICE_NAME "com.apple.os_trace_relay"
+
+/** Error Codes */
+typedef enum {
+	OS_TRACE_RELAY_E_SUCCESS         =  0,
+	OS_TRACE_RELAY_E_INVALID_ARG     = -1,
+	OS_TRACE_RELAY_E_MUX_ERROR       = -2,
+	OS_TRACE_RELAY_E_SSL_ERROR       = -3,
+	OS_TRACE_RELAY_E_PLIST_ERROR     = -4,
+	OS_TRACE_RELAY_E_NOT_ENOUGH_DATA = -5,
+	OS_TRACE_RELAY_E_TIMEOUT         = -6,
+	OS_TRACE_RELAY_E_REQUEST_FAILED  = -7,
+	OS_TRACE_RELAY_E_MALFORMED_ENTRY = -8,
+	OS_TRACE_RELAY_E_UNKNOWN_ERROR   = -256
+} os_trace_relay_error_t;
+
+/** Log levels of a log entry */
+typedef enum {
+	OS_TRACE_RELAY_LEVEL_NOTICE      = 0x00,
+	OS_TRACE_RELAY_LEVEL_INFO        = 0x01,
+	OS_TRACE_RELAY_LEVEL_DEBUG       = 0x02,
+	OS_TRACE_RELAY_LEVEL_USER_ACTION = 0x03,
+	OS_TRACE_RELAY_LEVEL_ERROR       = 0x10,
+	OS_TRACE_RELAY_LEVEL_FAULT       = 0x11
+} os_trace_relay_level_t;
+
+/**
+ * A log entry of the activity stream.
+ * All strings point into the receive buffer of the client and are only
+ * valid until the next entry is received. The strings are NUL-terminated,
+ * the lengths do not include the terminator. Strings that are not present
+ * in the entry are empty.
+ */
+typedef struct {
+	uint32_t pid;               /**< id of the logging process */
+	uint64_t timestamp;         /**< seconds since the epoch */
+	uint32_t timestamp_usec;    /**< microseconds part of the timestamp */
+	os_trace_relay_level_t level;
+	const char *filename;       /**< path of the logging executable */
+	uint32_t filename_length;
+	const char *image_name;     /**< path of the image that logged the message */
+	uint32_t image_name_length;
+	const char *message;
+	uint32_t message_length;
+	const char *subsystem;
+	uint32_t subsystem_length;
+	const char *category;
+	uint32_t category_length;
+} os_trace_relay_entry_t;
+
+typedef struct os_trace_relay_client_private os_trace_relay_client_private;
+typedef os_trace_relay_client_private *os_trace_relay_client_t; /**< The client handle. */
+
+/** Receives each log entry from the device. */
+typedef void (*os_trace_relay_entry_cb_t)(const os_trace_relay_entry_t *entry, void *user_data);
+
+/* Interface */
+
+/**
+ * Connects to the os_trace_relay service on the specified device.
+ *
+ * @param device The device to connect to.
+ * @param service The service descriptor returned by lockdownd_start_service.
+ * @param client Pointer that will point to a newly allocated
+ *     os_trace_relay_client_t upon successful return. Must be freed using
+ *     os_trace_relay_client_free() after use.
+ *
+ * @return OS_TRACE_RELAY_E_SUCCESS on success, OS_TRACE_RELAY_E_INVALID_ARG
+ *     when client is NULL, or an OS_TRACE_RELAY_E_* error code otherwise.
+ */
+os_trace_relay_error_t os_trace_relay_client_new(idevice_t device, lockdownd_service_descriptor_t service, os_trace_relay_client_t * client);
+
+/**
+ * Starts a new os_trace_relay service on the specified device and connects
+ * to it.
+ *
+ * @param device The device to connect to.
+ * @param client Pointer that will point to a newly allocated
+ *     os_trace_relay_client_t upon successful return. Must be freed using
+ *     os_trace_relay_client_free() after use.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ *
+ * @return OS_TRACE_RELAY_E_SUCCESS on success, or an OS_TRACE_RELAY_E_*
+ *     error code otherwise.
+ */
+os_trace_relay_error_t os_trace_relay_client_start_service(idevice_t device, os_trace_relay_client_t * client, const char* label);
+
+/**
+ * Disconnects an os_trace_relay client from the device and frees up the
+ * os_trace_relay client data.
+ *
+ * @param client The os_trace_relay client to disconnect and free.
+ *
+ * @return OS_TRACE_RELAY_E_SUCCESS on success, OS_TRACE_RELAY_E_INVALID_ARG
+ *     when client is NULL, or an OS_TRACE_RELAY_E_* error code otherwise.
+ */
+os_trace_relay_error_t os_trace_relay_client_free(os_trace_relay_client_t client);
+
+/**
+ * Requests the device to start streaming log entries.
+ * After a successful call, use os_trace_relay_next_entry() to iterate the
+ * entries or os_trace_relay_start_capture() to receive them via callback.
+ *
+ * @param client The os_trace_relay client to use
+ * @param pid Only stream entries of the process with this pid, or -1 for
+ *     all processes.
+ *
+ * @return OS_TRACE_RELAY_E_SUCCESS on success,
+ *      OS_TRACE_RELAY_E_INVALID_ARG when client is NULL,
+ *      OS_TRACE_RELAY_E_REQUEST_FAILED if the device rejected the request,
+ *      or an OS_TRACE_RELAY_E_* error code otherwise.
+ */
+os_trace_relay_error_t os_trace_relay_start_activity(os_trace_relay_client_t client, int pid);
+
+/**
+ * Receives the next log entry of the activity stream.
+ * Entries are parsed in place in the receive buffer of the client; data is
+ * read from the device in large chunks, so most calls do not need to wait
+ * for the device at all.
+ *
+ * @param client The os_trace_relay client to use
+ * @param entry Pointer to a structure that will be filled with the
+ *     entry. The strings it points to are valid until the next call.
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return OS_TRACE_RELAY_E_SUCCESS on success,
+ *      OS_TRACE_RELAY_E_INVALID_ARG when client or entry is NULL,
+ *      OS_TRACE_RELAY_E_TIMEOUT if no complete entry was received in time,
+ *      OS_TRACE_RELAY_E_MALFORMED_ENTRY if the stream contains invalid data,
+ *      or an OS_TRACE_RELAY_E_* error code otherwise.
+ */
+os_trace_relay_error_t os_trace_relay_next_entry(os_trace_relay_client_t client, os_trace_relay_entry_t *entry, unsigned int timeout);
+
+/**
+ * Starts the activity stream and receives its entries using a callback.
+ *
+ * Use os_trace_relay_stop_capture() to stop receiving log entries.
+ *
+ * @param client The os_trace_relay client to use
+ * @param pid Only stream entries of the process with this pid, or -1 for
+ *     all processes.
+ * @param callback Callback to receive each log entry.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return OS_TRACE_RELAY_E_SUCCESS on success,
+ *      OS_TRACE_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or OS_TRACE_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a capture has already been started.
+ */
+os_trace_relay_error_t os_trace_relay_start_capture(os_trace_relay_client_t client, int pid, os_trace_relay_entry_cb_t callback, void* user_data);
+
+/**
+ * Stops receiving log entries.
+ *
+ * @param client The os_trace_relay client to use
+ *
+ * @return OS_TRACE_RELAY_E_SUCCESS on success,
+ *      OS_TRACE_RELAY_E_INVALID_ARG when client is NULL.
+ */
+os_trace_relay_error_t os_trace_relay_stop_capture(os_trace_relay_client_t client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
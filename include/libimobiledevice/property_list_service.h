@@ -39,12 +39,33 @@ typedef enum {
 	PROPERTY_LIST_SERVICE_E_SSL_ERROR       = -4,
 	PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT = -5,
 	PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA = -6,
+	PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE = -7,
 	PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR   = -256
 } property_list_service_error_t;
 
+/** Wire formats for plists sent with property_list_service_send_plist() */
+typedef enum {
+	PROPERTY_LIST_SERVICE_FORMAT_AUTO   = 0, /**< binary for services known to accept it, XML otherwise */
+	PROPERTY_LIST_SERVICE_FORMAT_XML    = 1, /**< always send XML plists */
+	PROPERTY_LIST_SERVICE_FORMAT_BINARY = 2  /**< always send binary plists */
+} property_list_service_format_t;
+
 typedef struct property_list_service_client_private property_list_service_private;
 typedef property_list_service_private* property_list_service_client_t; /**< The client handle. */
 
+/**
+ * Callback receiving the payload of a framed message in chunks.
+ *
+ * @param data The next chunk of the payload
+ * @param length Size of the chunk in bytes
+ * @param total Total size of the payload in bytes
+ * @param user_data The user data pointer passed to
+ *     property_list_service_receive_stream()
+ *
+ * @return 0 to continue receiving, or any other value to abort.
+ */
+typedef int (*property_list_service_stream_cb_t)(const char *data, uint32_t length, uint32_t total, void *user_data);
+
 /* Interface */
 
 /**
@@ -72,6 +93,76 @@ property_list_service_error_t property_list_service_client_new(idevice_t device,
  */
 property_list_service_error_t property_list_service_client_free(property_list_service_client_t client);
 
+/**
+ * Enables or disables replacing invalid control characters in received
+ * XML plists with spaces. This works around devices running iOS 4.3 and
+ * later sending such characters and is enabled by default; it can be
+ * disabled for services known to send clean XML.
+ *
+ * @param client The property list service client
+ * @param enabled 1 to sanitize received XML plists, 0 to parse them as is.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL.
+ */
+property_list_service_error_t property_list_service_client_set_xml_sanitize(property_list_service_client_t client, int enabled);
+
+/**
+ * Sets the maximum size of a message the client will accept from the
+ * device. Larger messages are read and discarded so the connection stays
+ * in sync, and PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE is returned to
+ * the caller.
+ *
+ * @param client The property list service client
+ * @param max_size Maximum message size in bytes, or 0 for no limit (default)
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL.
+ */
+property_list_service_error_t property_list_service_client_set_max_message_size(property_list_service_client_t client, uint32_t max_size);
+
+/**
+ * Sets the library-wide wire format used by property_list_service_send_plist()
+ * for clients that do not have a format set explicitly.
+ *
+ * @param format The wire format; PROPERTY_LIST_SERVICE_FORMAT_AUTO (default)
+ *     sends binary plists to services known to accept them and XML plists
+ *     to all others.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when format is invalid.
+ */
+property_list_service_error_t property_list_service_set_default_format(property_list_service_format_t format);
+
+/**
+ * Sets the wire format used by property_list_service_send_plist() for the
+ * given client, overriding the library-wide default.
+ *
+ * @param client The property list service client
+ * @param format The wire format, or PROPERTY_LIST_SERVICE_FORMAT_AUTO to
+ *     use the library-wide default.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL or format is
+ *     invalid.
+ */
+property_list_service_error_t property_list_service_client_set_format(property_list_service_client_t client, property_list_service_format_t format);
+
+/**
+ * Sends a plist using the wire format configured for the client.
+ *
+ * @see property_list_service_client_set_format
+ *
+ * @param client The property list service client to use for sending.
+ * @param plist plist to send
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or plist is NULL,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when dict is not a valid plist,
+ *      or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified error occurs.
+ */
+property_list_service_error_t property_list_service_send_plist(property_list_service_client_t client, plist_t plist);
+
 /**
  * Sends an XML plist.
  *
@@ -98,6 +189,24 @@ property_list_service_error_t property_list_service_send_xml_plist(property_list
  */
 property_list_service_error_t property_list_service_send_binary_plist(property_list_service_client_t client, plist_t plist);
 
+/**
+ * Sends a number of plists with as few writes as possible.
+ * Each plist is framed individually, so the receiver sees the same
+ * messages as if they were sent one by one.
+ *
+ * @param client The property list service client to use for sending.
+ * @param plists array of plists to send
+ * @param count number of plists in the array
+ * @param binary 1 to send binary plists, 0 to send xml plists
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or plists is NULL
+ *      or count is 0, PROPERTY_LIST_SERVICE_E_PLIST_ERROR when one of the
+ *      plists is not a valid plist, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
+ *      when an unspecified error occurs.
+ */
+property_list_service_error_t property_list_service_send_plist_batch(property_list_service_client_t client, const plist_t *plists, uint32_t count, int binary);
+
 /**
  * Receives a plist using the given property list service client with specified
  * timeout.
@@ -140,6 +249,26 @@ property_list_service_error_t property_list_service_receive_plist_with_timeout(p
  */
 property_list_service_error_t property_list_service_receive_plist(property_list_service_client_t client, plist_t *plist);
 
+/**
+ * Receives the raw payload of the next framed message and passes it to
+ * the given callback in chunks instead of parsing it as a plist.
+ * This allows handling very large messages without holding the complete
+ * payload in memory. The maximum message size set with
+ * property_list_service_client_set_max_message_size() does not apply.
+ *
+ * @param client The property list service client to use for receiving
+ * @param callback Callback that receives the payload chunks
+ * @param user_data User data passed to the callback
+ * @param timeout Maximum time in milliseconds to wait for the message.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or callback is NULL,
+ *      PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
+ *      PROPERTY_LIST_SERVICE_E_MUX_ERROR when a communication error occurs,
+ *      or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when the callback aborted.
+ */
+property_list_service_error_t property_list_service_receive_stream(property_list_service_client_t client, property_list_service_stream_cb_t callback, void *user_data, unsigned int timeout);
+
 /**
  * Enable SSL for the given property list service client.
  *
@@ -0,0 +1,168 @@
+/**
+ * @file libimobiledevice/provisioning.h
+ * @brief Pair and activate a batch of devices in overlapping stages.
+ * \internal
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IPROVISIONING_H
+#define IPROVISIONING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+
+/** Error Codes */
+typedef enum {
+	PROVISIONING_E_SUCCESS            =  0,
+	PROVISIONING_E_INVALID_ARG        = -1,
+	PROVISIONING_E_CONNECTION_FAILED  = -2,
+	PROVISIONING_E_PAIRING_FAILED     = -3,
+	PROVISIONING_E_ACTIVATION_FAILED  = -4,
+	PROVISIONING_E_REQUEST_FAILED     = -5,
+	PROVISIONING_E_UNKNOWN_ERROR      = -256
+} provisioning_error_t;
+
+/** The stages a device passes through, in this order */
+typedef enum {
+	PROVISIONING_STAGE_PAIR,            /**< Connect to lockdownd and pair (device I/O and key generation) */
+	PROVISIONING_STAGE_ACTIVATION_INFO, /**< Query the activation state and create the activation info (device I/O) */
+	PROVISIONING_STAGE_REQUEST,         /**< Obtain the activation record with the request callback (network) */
+	PROVISIONING_STAGE_ACTIVATE,        /**< Send the activation record to the device (device I/O) */
+	PROVISIONING_STAGE_COUNT
+} provisioning_stage_t;
+
+typedef struct provisioning_batch_private provisioning_batch_private;
+typedef provisioning_batch_private *provisioning_batch_t; /**< The batch handle. */
+
+/** Reported whenever a device has completed or failed a stage */
+typedef struct {
+	const char *udid;           /**< UDID of the device */
+	provisioning_stage_t stage; /**< The stage that ended */
+	provisioning_error_t error; /**< PROVISIONING_E_SUCCESS if the stage succeeded */
+	int code;                   /**< The lockdownd_error_t or mobileactivation_error_t of a failed stage, or the return value of the request callback */
+	int skipped;                /**< 1 if the stage was skipped because the device is already activated */
+	uint64_t wait_us;           /**< Time the device waited for a worker of this stage */
+	uint64_t latency_us;        /**< Time the stage took once a worker picked it up */
+} provisioning_event_t;
+
+/**
+ * Obtains the activation record for the given activation info, usually with
+ * an HTTP request to the activation server. Called from the network workers,
+ * so requests for different devices run in parallel.
+ *
+ * @param udid UDID of the device
+ * @param activation_info The activation info created by the device
+ * @param activation_record Set this to the activation record, which is
+ *        freed by the library
+ * @param user_data The user data passed to provisioning_batch_new()
+ *
+ * @return 0 on success, any other value makes the device fail the stage
+ *  with PROVISIONING_E_REQUEST_FAILED
+ */
+typedef int (*provisioning_request_cb_t)(const char *udid, plist_t activation_info, plist_t *activation_record, void *user_data);
+
+/**
+ * Receives the progress of the batch. Calls are serialized, so the callback
+ * does not need to lock, but they happen on worker threads.
+ *
+ * @param event The event
+ * @param user_data The user data passed to provisioning_batch_new()
+ */
+typedef void (*provisioning_event_cb_t)(const provisioning_event_t *event, void *user_data);
+
+/** Worker counts of a batch. A value of 0 selects the default. */
+typedef struct {
+	unsigned int device_workers;  /**< Threads for the stages talking to devices (default 8) */
+	unsigned int network_workers; /**< Threads calling the request callback (default 8) */
+	unsigned int key_workers;     /**< Threads pre-generating pair keys while provisioning (default 2) */
+} provisioning_config_t;
+
+/**
+ * Creates a new batch.
+ *
+ * @param config The worker counts to use, or NULL for the defaults
+ * @param request_cb The callback obtaining activation records
+ * @param event_cb The callback receiving the progress, or NULL
+ * @param user_data User data passed to the callbacks
+ * @param batch Pointer that will be set to the new batch
+ *
+ * @return PROVISIONING_E_SUCCESS on success, PROVISIONING_E_INVALID_ARG when
+ *  request_cb or batch is NULL
+ */
+provisioning_error_t provisioning_batch_new(const provisioning_config_t *config, provisioning_request_cb_t request_cb, provisioning_event_cb_t event_cb, void *user_data, provisioning_batch_t *batch);
+
+/**
+ * Frees a batch.
+ *
+ * @param batch The batch to free. It must not be running.
+ *
+ * @return PROVISIONING_E_SUCCESS on success, PROVISIONING_E_INVALID_ARG when
+ *  batch is NULL
+ */
+provisioning_error_t provisioning_batch_free(provisioning_batch_t batch);
+
+/**
+ * Adds a device to the batch.
+ *
+ * @param batch The batch
+ * @param udid UDID of the device
+ * @param options How to look up the device, see idevice_new_with_options()
+ *
+ * @return PROVISIONING_E_SUCCESS on success, PROVISIONING_E_INVALID_ARG when
+ *  a parameter is NULL or the batch is running
+ */
+provisioning_error_t provisioning_batch_add(provisioning_batch_t batch, const char *udid, enum idevice_options options);
+
+/**
+ * Pairs and activates all added devices and returns when every device has
+ * either finished or failed. Each stage has its own workers, so while one
+ * device waits for its activation record, others are paired or activated.
+ * The pool of pre-generated pair keys is enabled while the batch is running,
+ * unless one has already been configured with lockdownd_set_pair_key_pool().
+ * Devices that are already activated only get paired.
+ *
+ * @param batch The batch
+ *
+ * @return PROVISIONING_E_SUCCESS if all devices have been provisioned,
+ *  PROVISIONING_E_INVALID_ARG when batch is NULL, or the error of the first
+ *  device that failed
+ */
+provisioning_error_t provisioning_batch_run(provisioning_batch_t batch);
+
+/**
+ * Returns the result and the timing of a device after provisioning_batch_run().
+ *
+ * @param batch The batch
+ * @param udid UDID of the device
+ * @param stage Set to the stage the device failed in or
+ *        PROVISIONING_STAGE_COUNT if it succeeded. Pass NULL to ignore.
+ * @param latency_us Array of PROVISIONING_STAGE_COUNT values that will be
+ *        set to the time spent in each stage including the wait for a
+ *        worker. Pass NULL to ignore.
+ *
+ * @return The result of the device, or PROVISIONING_E_INVALID_ARG if the
+ *  device is not part of the batch
+ */
+provisioning_error_t provisioning_batch_get_result(provisioning_batch_t batch, const char *udid, provisioning_stage_t *stage, uint64_t *latency_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -45,6 +45,41 @@ typedef enum {
 typedef struct restored_client_private restored_client_private;
 typedef restored_client_private *restored_client_t; /**< The client handle. */
 
+typedef struct restored_options_template_private restored_options_template_private;
+typedef restored_options_template_private *restored_options_template_t; /**< Restore options shared by several restores. */
+
+typedef struct restored_multi_private restored_multi_private;
+typedef restored_multi_private *restored_multi_t; /**< Drives the restores of several devices. */
+
+/** Events delivered by restored_multi_run() */
+typedef enum {
+	RESTORED_EVENT_PROGRESS, /**< A ProgressMsg was received */
+	RESTORED_EVENT_MESSAGE,  /**< Any other message, e.g. a DataRequestMsg the caller has to answer */
+	RESTORED_EVENT_FINISHED  /**< The restore of the device ended */
+} restored_event_type_t;
+
+/** Describes an event of a restore driven by restored_multi_run() */
+typedef struct {
+	restored_event_type_t type; /**< The kind of event */
+	plist_t message;            /**< The received message, NULL if the restore failed without one. Owned by the library. */
+	uint64_t operation;         /**< RESTORED_EVENT_PROGRESS: the operation code */
+	int64_t progress;           /**< RESTORED_EVENT_PROGRESS: the progress in percent, or -1 if not reported */
+	int64_t status;             /**< RESTORED_EVENT_FINISHED: the Status of the StatusMsg, or -1 on failure */
+	restored_error_t error;     /**< RESTORED_EVENT_FINISHED: RESTORE_E_SUCCESS if a StatusMsg was received */
+} restored_event_t;
+
+/**
+ * Called from restored_multi_run() for each event of a device.
+ *
+ * @param client The restored client of the device
+ * @param event The event
+ * @param user_data The user data passed to restored_multi_add()
+ *
+ * @return 0 to continue, or non-zero to abort the restore of this device.
+ *  The return value is ignored for RESTORED_EVENT_FINISHED.
+ */
+typedef int (*restored_event_cb_t)(restored_client_t client, const restored_event_t *event, void *user_data);
+
 /* Interface */
 
 /**
@@ -151,6 +186,115 @@ restored_error_t restored_goodbye(restored_client_t client);
  */
 restored_error_t restored_start_restore(restored_client_t client, plist_t options, uint64_t version);
 
+/**
+ * Queries several values with one round trip. All QueryValue requests are
+ * sent together and the answers are read afterwards, which saves the
+ * latency of one request per key.
+ *
+ * @param client An initialized restored client.
+ * @param keys The key names to request
+ * @param count The number of keys
+ * @param values Array of count plist nodes that will be set to the value of
+ *        each key, or NULL for keys that can't be found. Free the nodes with
+ *        plist_free() when no longer needed.
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when a
+ *  parameter is NULL, or an error code if the communication failed
+ */
+restored_error_t restored_query_values(restored_client_t client, const char **keys, uint32_t count, plist_t *values);
+
+/**
+ * Creates a template for the options of restored_start_restore() that can
+ * be used for any number of devices at the same time. The StartRestore
+ * request is serialized once for each label, protocol version and format
+ * and reused afterwards, instead of copying and serializing the options
+ * for every device.
+ *
+ * @param options PLIST_DICT with options for the restore process. It is
+ *        copied, so it can be freed afterwards.
+ * @param tmpl Pointer that will be set to the new template
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG if a parameter
+ *  is NULL or options is not a PLIST_DICT
+ */
+restored_error_t restored_options_template_new(plist_t options, restored_options_template_t *tmpl);
+
+/**
+ * Frees a template created with restored_options_template_new(). It must
+ * not be used by any client or restored_multi_t anymore.
+ *
+ * @param tmpl The template to free
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when tmpl is NULL
+ */
+restored_error_t restored_options_template_free(restored_options_template_t tmpl);
+
+/**
+ * Requests to start a restore with the options of a template.
+ *
+ * @param client The restored client
+ * @param tmpl The options template
+ * @param version the restore protocol version, see restored_query_type()
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG if a parameter
+ *  is NULL, or an error code if the request could not be sent
+ */
+restored_error_t restored_start_restore_with_template(restored_client_t client, restored_options_template_t tmpl, uint64_t version);
+
+/**
+ * Creates a driver that restores several devices from one thread. The
+ * connections of all added clients are waited on together and every
+ * message is dispatched to the event callback of its device.
+ *
+ * @param multi Pointer that will be set to the new driver
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when multi
+ *  is NULL
+ */
+restored_error_t restored_multi_new(restored_multi_t *multi);
+
+/**
+ * Frees a driver. The added clients are not freed.
+ *
+ * @param multi The driver to free
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when multi
+ *  is NULL
+ */
+restored_error_t restored_multi_free(restored_multi_t multi);
+
+/**
+ * Adds a device to the driver. Its restore is started with the first call
+ * to restored_multi_run().
+ *
+ * @param multi The driver
+ * @param client The restored client of the device. It must only be used
+ *        from the event callback while restored_multi_run() is running.
+ * @param tmpl The options to use, or NULL to start the restore without options
+ * @param version the restore protocol version, see restored_query_type()
+ * @param callback The callback for the events of this device
+ * @param user_data User data passed to the callback
+ *
+ * @return RESTORE_E_SUCCESS on success, RESTORE_E_INVALID_ARG when a
+ *  parameter is NULL or the client was already added
+ */
+restored_error_t restored_multi_add(restored_multi_t multi, restored_client_t client, restored_options_template_t tmpl, uint64_t version, restored_event_cb_t callback, void *user_data);
+
+/**
+ * Starts the restore of all added devices and dispatches their messages
+ * until every restore has finished. Each device gets a
+ * RESTORED_EVENT_FINISHED event exactly once.
+ *
+ * @param multi The driver
+ * @param timeout Maximum time in milliseconds without a message from a
+ *        device before its restore is considered failed, or 0 to wait forever
+ *
+ * @return RESTORE_E_SUCCESS when all restores have finished,
+ *  RESTORE_E_INVALID_ARG when multi is NULL, or RESTORE_E_UNKNOWN_ERROR if
+ *  the connections could not be waited on
+ */
+restored_error_t restored_multi_run(restored_multi_t multi, unsigned int timeout);
+
 /**
  * Requests device to reboot.
  *
@@ -125,6 +125,26 @@ sbservices_error_t sbservices_get_icon_state(sbservices_client_t client, plist_t
  */
 sbservices_error_t sbservices_set_icon_state(sbservices_client_t client, plist_t newstate);
 
+/**
+ * Sets the icon state of the connected device unless it equals the last
+ * known state. The last known state is the one most recently retrieved with
+ * sbservices_get_icon_state() or sent with sbservices_set_icon_state() on
+ * this client. Without a last known state the new state is always sent.
+ *
+ * @note The service only accepts complete icon states, so if anything
+ *     changed the whole state is uploaded.
+ *
+ * @param client The connected sbservices client to use.
+ * @param newstate A plist containing the new iconstate.
+ * @param changes Pointer that will be set to the number of changed values
+ *     compared to the last known state (0 if the upload was skipped). Pass
+ *     NULL if not needed.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client or newstate is NULL, or an SBSERVICES_E_* error code otherwise.
+ */
+sbservices_error_t sbservices_set_icon_state_changed(sbservices_client_t client, plist_t newstate, uint32_t *changes);
+
 /**
  * Get the icon of the specified app as PNG data.
  *
@@ -142,6 +162,47 @@ sbservices_error_t sbservices_set_icon_state(sbservices_client_t client, plist_t
  */
 sbservices_error_t sbservices_get_icon_pngdata(sbservices_client_t client, const char *bundleId, char **pngdata, uint64_t *pngsize);
 
+/**
+ * Get the icons of several apps as PNG data. The requests are sent ahead of
+ * the replies so that the round trip latency is not paid once per icon.
+ *
+ * @param client The connected sbservices client to use.
+ * @param bundle_ids Array of count bundle identifiers.
+ * @param count The number of bundle identifiers.
+ * @param pngdata Array of count pointers that will point to newly allocated
+ *     buffers with the PNG data of the respective app, or NULL if the device
+ *     did not return an icon for it. It is up to the caller to free them.
+ * @param pngsizes Array of count sizes of the buffers in pngdata.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     any of the arguments is invalid, or an SBSERVICES_E_* error code
+ *     otherwise. On error no buffers are returned.
+ */
+sbservices_error_t sbservices_get_icon_pngdata_multiple(sbservices_client_t client, const char **bundle_ids, uint32_t count, char **pngdata, uint64_t *pngsizes);
+
+/**
+ * Get the icons of the given apps through a host side cache directory.
+ * Icons are cached per bundle identifier together with the app version.
+ * An icon is fetched from the device again once the version reported in
+ * the app metadata changes. Cached icons of apps that are not part of the
+ * list are removed.
+ *
+ * @param client The connected sbservices client to use.
+ * @param cache_dir Existing directory to keep the cached icons in.
+ * @param apps A PLIST_ARRAY of app dictionaries as returned by
+ *     instproxy_browse(), containing at least the "CFBundleIdentifier" and
+ *     preferably the "CFBundleVersion" and "CFBundleShortVersionString" of
+ *     each app.
+ * @param icons Pointer that will be set to a PLIST_DICT mapping the bundle
+ *     identifiers to PLIST_DATA nodes with the PNG data. Apps without an
+ *     icon are omitted. Free with plist_free() after use.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     any of the arguments is invalid, or an SBSERVICES_E_* error code
+ *     otherwise.
+ */
+sbservices_error_t sbservices_get_icon_pngdata_cached(sbservices_client_t client, const char *cache_dir, plist_t apps, plist_t *icons);
+
 /**
  * Gets the interface orientation of the device.
  *
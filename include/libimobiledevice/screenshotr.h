@@ -49,6 +49,14 @@ typedef enum {
 typedef struct screenshotr_client_private screenshotr_client_private;
 typedef screenshotr_client_private *screenshotr_client_t; /**< The client handle. */
 
+/** A frame captured by screenshotr_stream_next_frame() */
+typedef struct {
+	const char *data; /**< Image data, owned by the client and valid until the next stream call */
+	uint64_t size; /**< Size of the image data in bytes */
+	uint64_t sequence; /**< Number of the frame since the stream was started */
+	uint64_t latency_us; /**< Time between sending the request and receiving the frame */
+} screenshotr_frame_t;
+
 
 /**
  * Connects to the screenshotr service on the specified device.
@@ -110,6 +118,50 @@ screenshotr_error_t screenshotr_client_free(screenshotr_client_t client);
  */
 screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize);
 
+/**
+ * Get a screen shot from the connected device and write the image data
+ * directly to the given file descriptor, without copying it out of the
+ * received message.
+ * @param client The connection screenshotr service client.
+ * @param fd File descriptor to write the image data to.
+ * @param imgsize Pointer to a uint64_t that will be set to the number of
+ *     bytes written. Can be NULL.
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     one or more parameters are invalid, or another error code if an
+ *     error occurred.
+ */
+screenshotr_error_t screenshotr_take_screenshot_to_fd(screenshotr_client_t client, int fd, uint64_t *imgsize);
+
+/**
+ * Captures the next frame of a continuous screenshot stream on the given
+ * client. The first call starts the stream.
+ * The image data is not copied; it stays valid until the next call to
+ * screenshotr_stream_next_frame(), screenshotr_stream_stop(), or
+ * screenshotr_client_free().
+ *
+ * @param client The connection screenshotr service client.
+ * @param frame Pointer to a frame structure that will be filled.
+ * @param prefetch If non-zero, the request for the following frame is sent
+ *     before the reply for this frame is received, so that the device
+ *     captures it while this frame is being transferred. Pass 0 when the
+ *     frames are paced, otherwise the next frame is older than the interval.
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     one or more parameters are invalid, or another error code if an
+ *     error occurred.
+ */
+screenshotr_error_t screenshotr_stream_next_frame(screenshotr_client_t client, screenshotr_frame_t *frame, int prefetch);
+
+/**
+ * Stops a screenshot stream, collecting the reply of a prefetched request
+ * and releasing the last frame.
+ * screenshotr_take_screenshot() can be used again afterwards.
+ *
+ * @param client The connection screenshotr service client.
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     client is invalid, or another error code if an error occurred.
+ */
+screenshotr_error_t screenshotr_stream_stop(screenshotr_client_t client);
+
 #ifdef __cplusplus
 }
 #endif
@@ -39,6 +39,7 @@ typedef enum {
 	SERVICE_E_START_SERVICE_ERROR = -5,
 	SERVICE_E_NOT_ENOUGH_DATA     = -6,
 	SERVICE_E_TIMEOUT             = -7,
+	SERVICE_E_WOULD_BLOCK         = -8,
 	SERVICE_E_UNKNOWN_ERROR       = -256
 } service_error_t;
 
@@ -47,6 +48,30 @@ typedef service_client_private* service_client_t; /**< The client handle. */
 
 #define SERVICE_CONSTRUCTOR(x) (int32_t (*)(idevice_t, lockdownd_service_descriptor_t, void**))(x)
 
+/**
+ * Whether a service continues in plaintext after the SSL handshake, see
+ * service_set_plaintext_policy().
+ */
+typedef enum {
+	SERVICE_PLAINTEXT_NEVER = 0, /**< Keep SSL for the whole connection (default) */
+	SERVICE_PLAINTEXT_USB = 1, /**< Drop SSL after the handshake on USB connections if the device side accepts it */
+	SERVICE_PLAINTEXT_REQUIRED = 2 /**< The device side always continues in plaintext, like debugserver before iOS 14 */
+} service_plaintext_policy_t;
+
+/**
+ * Reconnect policy of long-running streaming clients like syslog_relay or
+ * notification_proxy, see syslog_relay_set_reconnect() and
+ * np_set_reconnect(). Failed attempts are retried with an exponentially
+ * growing, jittered delay. Clients of the same device share the delay and
+ * make their attempts one at a time, so a device that is gone is probed
+ * once per delay instead of once per client.
+ */
+typedef struct {
+	uint32_t initial_delay; /**< Delay in milliseconds after the first failed attempt, 0 for the default of 250 */
+	uint32_t max_delay;     /**< Upper bound of the delay in milliseconds, 0 for the default of 30000 */
+	uint32_t max_attempts;  /**< Number of failed attempts after which to give up, 0 to retry until stopped */
+} service_reconnect_policy_t;
+
 /* Interface */
 
 /**
@@ -80,6 +105,31 @@ service_error_t service_client_new(idevice_t device, lockdownd_service_descripto
  */
 service_error_t service_client_factory_start_service(idevice_t device, const char* service_name, void **client, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), int32_t *error_code);
 
+/** Constructor used by service_client_factory_start_services() */
+typedef int32_t (*service_client_constructor_t)(idevice_t, lockdownd_service_descriptor_t, void**);
+
+/**
+ * Starts multiple services on the specified device with one lockdown
+ * session and connects to them in parallel.
+ *
+ * @param device The device to connect to.
+ * @param service_names Array of names of the services to start.
+ * @param count Number of services.
+ * @param clients Array of count pointers that will point to the newly
+ *     allocated clients, or NULL for services that could not be started.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ * @param constructor_funcs Array of count constructors used to create the
+ *     clients, e.g. afc_client_new. A NULL array or NULL entry creates a
+ *     plain service_client_t.
+ * @param error_codes Array of count error codes returned by the
+ *     constructors. Can be NULL.
+ *
+ * @return SERVICE_E_SUCCESS if all services were started, or
+ *     SERVICE_E_START_SERVICE_ERROR if at least one service failed.
+ */
+service_error_t service_client_factory_start_services(idevice_t device, const char **service_names, unsigned int count, void **clients, const char* label, const service_client_constructor_t *constructor_funcs, int32_t *error_codes);
+
 /**
  * Frees a service instance.
  *
@@ -142,6 +192,37 @@ service_error_t service_receive_with_timeout(service_client_t client, char *data
  */
 service_error_t service_receive(service_client_t client, char *data, uint32_t size, uint32_t *received);
 
+/**
+ * Receives data using the given service client without blocking.
+ * Returns immediately with the data that is available right now.
+ *
+ * @param client The service client to use for receiving
+ * @param data Buffer that will be filled with the data received
+ * @param size Maximum number of bytes to receive
+ * @param received Number of bytes received (can be NULL to ignore)
+ *
+ * @return SERVICE_E_SUCCESS if at least one byte was received,
+ *      SERVICE_E_WOULD_BLOCK if no data is available at the moment,
+ *      SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, SERVICE_E_SSL_ERROR when reading from the SSL session
+ *      failed, or SERVICE_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs.
+ */
+service_error_t service_try_receive(service_client_t client, char *data, uint32_t size, uint32_t *received);
+
+/**
+ * Gets the underlying connection of the given service client, e.g. to
+ * integrate it into an event loop with idevice_connection_get_fd().
+ *
+ * @param client The service client
+ * @param connection Pointer that receives the connection. The connection
+ *     is owned by the service client and must not be disconnected.
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *     SERVICE_E_INVALID_ARG if client or client->connection is NULL.
+ */
+service_error_t service_get_connection(service_client_t client, idevice_connection_t *connection);
+
 
 /**
  * Enable SSL for the given service client.
@@ -179,6 +260,41 @@ service_error_t service_disable_ssl(service_client_t client);
  */
 service_error_t service_disable_bypass_ssl(service_client_t client, uint8_t sslBypass);
 
+/**
+ * Set whether connections to the given service drop SSL after the
+ * handshake. TLS then only authenticates the host and the payload is sent
+ * unencrypted, which saves the cost of encryption on bulk transfers over
+ * trusted USB links. This is applied by service_client_new() and thus by
+ * all service clients.
+ *
+ * Only com.apple.debugserver is known to require this
+ * (SERVICE_PLAINTEXT_REQUIRED); all other services default to
+ * SERVICE_PLAINTEXT_NEVER. With SERVICE_PLAINTEXT_USB the first data
+ * received on a connection decides whether the device side accepted
+ * plaintext. If it answers with a TLS record or closes the connection
+ * instead, that receive fails with an SSL error and further connections to
+ * the service through the same device handle keep SSL.
+ * idevice_connection_get_stats() reports the payload exchanged without
+ * encryption in crypto_bytes_saved.
+ *
+ * @param service_name The service identifier, e.g. "com.apple.afc"
+ * @param policy The policy for the service
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *     SERVICE_E_INVALID_ARG if service_name is NULL or policy is invalid.
+ */
+service_error_t service_set_plaintext_policy(const char *service_name, service_plaintext_policy_t policy);
+
+/**
+ * Get whether connections to the given service drop SSL after the
+ * handshake, see service_set_plaintext_policy().
+ *
+ * @param service_name The service identifier
+ *
+ * @return The policy for the service
+ */
+service_plaintext_policy_t service_get_plaintext_policy(const char *service_name);
+
 #ifdef __cplusplus
 }
 #endif
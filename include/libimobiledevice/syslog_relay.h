@@ -30,6 +30,7 @@ extern "C" {
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/service.h>
 
 #define SYSLOG_RELAY_SERVICE_NAME "com.apple.syslog_relay"
 
@@ -50,6 +51,54 @@ typedef syslog_relay_client_private *syslog_relay_client_t; /**< The client hand
 /** Receives each character received from the device. */
 typedef void (*syslog_relay_receive_cb_t)(char c, void *user_data);
 
+/** Receives a block of syslog data from the device. */
+typedef void (*syslog_relay_receive_buffer_cb_t)(const char *data, uint32_t length, void *user_data);
+
+/** Modes for syslog_relay_start_capture_buffered() */
+typedef enum {
+	SYSLOG_RELAY_CAPTURE_RAW   = 0, /**< pass received blocks unmodified */
+	SYSLOG_RELAY_CAPTURE_BLOCK = 1, /**< pass received blocks with NUL bytes removed */
+	SYSLOG_RELAY_CAPTURE_LINES = 2  /**< pass each NUL-delimited message separately, without the NUL */
+} syslog_relay_capture_mode_t;
+
+/** Log levels of a syslog line */
+typedef enum {
+	SYSLOG_RELAY_LEVEL_NONE    = 0,
+	SYSLOG_RELAY_LEVEL_NOTICE  = 1,
+	SYSLOG_RELAY_LEVEL_ERROR   = 2,
+	SYSLOG_RELAY_LEVEL_WARNING = 3,
+	SYSLOG_RELAY_LEVEL_DEBUG   = 4
+} syslog_relay_log_level_t;
+
+/**
+ * A syslog line split into its fields.
+ * All pointers point into the line and are not NUL-terminated, except line
+ * itself. Fields that could not be parsed are NULL with a length of 0.
+ * line and message always point to valid data and include the trailing
+ * newline if the device sent one.
+ */
+typedef struct {
+	const char *line;          /**< the complete line */
+	uint32_t line_length;
+	const char *timestamp;     /**< e.g. "Jan  1 12:34:56" */
+	uint32_t timestamp_length;
+	const char *host;          /**< the device name */
+	uint32_t host_length;
+	const char *process;       /**< the process name */
+	uint32_t process_length;
+	const char *sender;        /**< the sender image in parentheses after the process name, if any */
+	uint32_t sender_length;
+	int pid;                   /**< the process id, or -1 */
+	syslog_relay_log_level_t level;
+	const char *level_tag;     /**< e.g. "<Notice>:" */
+	uint32_t level_tag_length;
+	const char *message;       /**< the message text following the header */
+	uint32_t message_length;
+} syslog_relay_line_t;
+
+/** Receives each parsed syslog line from the device. */
+typedef void (*syslog_relay_line_cb_t)(const syslog_relay_line_t *line, void *user_data);
+
 /* Interface */
 
 /**
@@ -130,6 +179,100 @@ syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, sy
  */
 syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data);
 
+/**
+ * Starts capturing the syslog of the device using a callback that receives
+ * whole blocks of data instead of single characters.
+ * Data is read from the device in large chunks, so this is considerably
+ * more efficient than syslog_relay_start_capture() at high log rates.
+ * In SYSLOG_RELAY_CAPTURE_LINES mode incomplete messages are held back
+ * until their terminating NUL byte has been received; messages exceeding
+ * the internal buffer size are delivered in parts.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param mode How received data is processed before invoking the callback.
+ * @param callback Callback to receive the syslog data. The data is only
+ *      valid for the duration of the callback.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+syslog_relay_error_t syslog_relay_start_capture_buffered(syslog_relay_client_t client, syslog_relay_capture_mode_t mode, syslog_relay_receive_buffer_cb_t callback, void* user_data);
+
+/**
+ * Starts capturing the syslog of the device using a callback that receives
+ * each line already split into timestamp, host, process, pid, log level
+ * and message.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param callback Callback to receive each parsed line. The line data is
+ *      only valid for the duration of the callback.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_line_cb_t callback, void* user_data);
+
+/**
+ * Decouples receiving the syslog from invoking the capture callback.
+ * With a dispatch buffer configured, the receiving thread only copies data
+ * into a bounded ring buffer and a separate thread invokes the callback,
+ * so a slow callback does not stall reading from the device. If the
+ * buffer is full, newly received data is dropped and counted, see
+ * syslog_relay_get_dropped(). The setting applies to captures started
+ * afterwards. It is disabled by default.
+ *
+ * @param client The syslog_relay client to use
+ * @param capacity Size of the buffer in bytes, rounded up to a power of two
+ *      of at least 16 KiB, or 0 to invoke the callback from the receiving
+ *      thread directly.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when client is NULL or capacity exceeds
+ *      1 GiB.
+ */
+syslog_relay_error_t syslog_relay_set_dispatch_buffer(syslog_relay_client_t client, uint32_t capacity);
+
+/**
+ * Retrieves the amount of syslog data dropped because the dispatch buffer
+ * was full.
+ * @see syslog_relay_set_dispatch_buffer
+ *
+ * @param client The syslog_relay client to use
+ * @param bytes Pointer that receives the number of dropped bytes (can be NULL)
+ * @param chunks Pointer that receives the number of dropped receive chunks
+ *      (can be NULL)
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when client is NULL.
+ */
+syslog_relay_error_t syslog_relay_get_dropped(syslog_relay_client_t client, uint64_t *bytes, uint64_t *chunks);
+
+/**
+ * Makes the capture thread re-establish the service connection when it is
+ * lost, e.g. after a USB hub reset or a Wi-Fi outage, instead of ending the
+ * capture. The capture continues with the data the device sends after the
+ * reconnect. The setting applies to captures started afterwards. It is
+ * disabled by default.
+ *
+ * @param client The syslog_relay client to use
+ * @param policy The backoff to apply between attempts, or NULL to end the
+ *      capture when the connection is lost.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when client is NULL.
+ */
+syslog_relay_error_t syslog_relay_set_reconnect(syslog_relay_client_t client, const service_reconnect_policy_t *policy);
+
 /**
  * Stops capturing the syslog of the device.
  *
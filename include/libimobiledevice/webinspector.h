@@ -48,6 +48,22 @@ typedef enum {
 typedef struct webinspector_client_private webinspector_client_private;
 typedef webinspector_client_private *webinspector_client_t; /**< The client handle. */
 
+/**
+ * Callback for messages received with webinspector_receive_dispatch().
+ *
+ * @param selector The "__selector" of the message.
+ * @param argument The "__argument" dictionary of the message or NULL. It is
+ *     only valid during the callback.
+ * @param user_data The user data passed to webinspector_receive_dispatch().
+ */
+typedef void (*webinspector_message_cb_t)(const char *selector, plist_t argument, void *user_data);
+
+/** Maps a message selector to the callback handling it. */
+typedef struct {
+	const char *selector;
+	webinspector_message_cb_t callback;
+} webinspector_handler_t;
+
 
 /**
  * Connects to the webinspector service on the specified device.
@@ -129,6 +145,26 @@ webinspector_error_t webinspector_receive(webinspector_client_t client, plist_t
  */
 webinspector_error_t webinspector_receive_with_timeout(webinspector_client_t client, plist_t * plist, uint32_t timeout_ms);
 
+/**
+ * Receives one message and passes its argument to the handler registered
+ * for its selector. The message is neither copied nor converted, handlers
+ * get the argument node of the received message directly.
+ *
+ * @param client The webinspector client to use for receiving
+ * @param handlers Array of count selector handlers
+ * @param count The number of handlers
+ * @param fallback Callback for messages without a matching handler, or NULL
+ *      to ignore them
+ * @param user_data User data passed to the callbacks
+ * @param timeout_ms Maximum time in milliseconds to wait for data.
+ *
+ * @return WEBINSPECTOR_E_SUCCESS when a message was received,
+ *      WEBINSPECTOR_E_INVALID_ARG when client or handlers is invalid,
+ *      WEBINSPECTOR_E_PLIST_ERROR when the message has no selector, or an
+ *      error code as returned by webinspector_receive_with_timeout().
+ */
+webinspector_error_t webinspector_receive_dispatch(webinspector_client_t client, const webinspector_handler_t *handlers, uint32_t count, webinspector_message_cb_t fallback, void *user_data, uint32_t timeout_ms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,12 +28,108 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include <gcrypt.h>
+#endif
 
 #include "afc.h"
 #include "idevice.h"
 #include "common/debug.h"
+#include "common/trace.h"
+#include "common/metrics.h"
+#include "common/socket.h"
+#include "common/utils.h"
 #include "endianness.h"
 
+/**
+ * Rounds a buffer size up to its size class, i.e. the next power of two
+ * but at least AFC_BUFFER_MIN_SIZE.
+ */
+static uint32_t afc_buffer_size_class(uint32_t size)
+{
+	uint32_t result = AFC_BUFFER_MIN_SIZE;
+	while (result < size && result < 0x80000000) {
+		result <<= 1;
+	}
+	return (result < size) ? size : result;
+}
+
+/**
+ * Makes sure the send buffer can hold data_len bytes of packet data.
+ */
+static int _afc_check_packet_buffer(afc_client_t client, uint32_t data_len)
+{
+	if (data_len > client->packet_extra) {
+		uint32_t newsize = afc_buffer_size_class(data_len);
+		AFCPacket* newpkt = (AFCPacket*)realloc(client->afc_packet, sizeof(AFCPacket) + newsize);
+		if (!newpkt) {
+			return -1;
+		}
+		client->afc_packet = newpkt;
+		client->packet_extra = newsize;
+		client->buffer_allocations++;
+		if (newsize > client->send_high_water) {
+			client->send_high_water = newsize;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Makes sure the receive buffer can hold a reply of the given length.
+ */
+static int _afc_check_recv_buffer(afc_client_t client, uint32_t length)
+{
+	if (!client->recv_buf || length > client->recv_buf_size) {
+		uint32_t newsize = afc_buffer_size_class(length);
+		/* the old contents are not needed, avoid the copy of realloc */
+		free(client->recv_buf);
+		client->recv_buf = (char*)malloc(newsize);
+		if (!client->recv_buf) {
+			client->recv_buf_size = 0;
+			return -1;
+		}
+		client->recv_buf_size = newsize;
+		client->buffer_allocations++;
+		if (newsize > client->recv_high_water) {
+			client->recv_high_water = newsize;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Releases buffer memory exceeding the retain limit of the client, so that
+ * a single large reply does not keep the memory allocated.
+ */
+static void afc_trim_buffers(afc_client_t client)
+{
+	uint32_t limit = (client->max_chunk_size) ? afc_buffer_size_class(client->max_chunk_size) : AFC_BUFFER_RETAIN_SIZE;
+	if (client->recv_buf_size > limit) {
+		free(client->recv_buf);
+		client->recv_buf = NULL;
+		client->recv_buf_size = 0;
+	}
+	if (client->packet_extra > limit && client->packet_extra > AFC_BUFFER_MIN_SIZE) {
+		AFCPacket* newpkt = (AFCPacket*)realloc(client->afc_packet, sizeof(AFCPacket) + AFC_BUFFER_MIN_SIZE);
+		if (newpkt) {
+			client->afc_packet = newpkt;
+			client->packet_extra = AFC_BUFFER_MIN_SIZE;
+		}
+	}
+}
+
 /**
  * Locks an AFC client, done for thread safety stuff
  *
@@ -41,8 +137,8 @@
  */
 static void afc_lock(afc_client_t client)
 {
-	debug_info("Locked");
 	mutex_lock(&client->mutex);
+	trace_event(TRACE_AFC_LOCK, (uintptr_t)client, 0, 0);
 }
 
 /**
@@ -52,10 +148,277 @@ static void afc_lock(afc_client_t client)
  */
 static void afc_unlock(afc_client_t client)
 {
-	debug_info("Unlocked");
+	trace_event(TRACE_AFC_UNLOCK, (uintptr_t)client, 0, 0);
+	afc_trim_buffers(client);
 	mutex_unlock(&client->mutex);
 }
 
+static uint64_t afc_cache_time_ms(void)
+{
+#ifdef WIN32
+	return GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+/**
+ * Returns the path in the form used as cache key: absolute, without
+ * repeated or trailing slashes and without "." components.
+ */
+static char *afc_cache_normalize_path(const char *path)
+{
+	size_t len = strlen(path);
+	char *out = (char*)malloc(len + 2);
+	size_t o = 0;
+	const char *p = path;
+
+	if (!out)
+		return NULL;
+
+	while (*p) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+		const char *end = strchr(p, '/');
+		size_t clen = (end) ? (size_t)(end - p) : strlen(p);
+		if (!(clen == 1 && p[0] == '.')) {
+			out[o++] = '/';
+			memcpy(out + o, p, clen);
+			o += clen;
+		}
+		p += clen;
+	}
+	if (o == 0)
+		out[o++] = '/';
+	out[o] = '\0';
+
+	return out;
+}
+
+static uint32_t afc_cache_hash(enum afc_cache_kind kind, const char *path)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u ^ (uint32_t)kind;
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void afc_cache_entry_free(struct afc_cache_entry *entry)
+{
+	free(entry->path);
+	free(entry->data);
+	free(entry);
+}
+
+static void afc_cache_flush(afc_client_t client)
+{
+	uint32_t i;
+
+	if (!client->cache)
+		return;
+	for (i = 0; i < AFC_CACHE_BUCKETS; i++) {
+		while (client->cache[i]) {
+			struct afc_cache_entry *next = client->cache[i]->next;
+			afc_cache_entry_free(client->cache[i]);
+			client->cache[i] = next;
+		}
+	}
+	client->cache_count = 0;
+}
+
+/**
+ * Looks up a cached reply. The returned data stays valid until the cache
+ * of the client is modified.
+ *
+ * @return 1 if a valid entry was found, 0 otherwise
+ */
+static int afc_cache_lookup(afc_client_t client, enum afc_cache_kind kind, const char *path, char **data, uint32_t *length)
+{
+	if (!client->cache_ttl)
+		return 0;
+
+	char *key = afc_cache_normalize_path(path);
+	if (!key)
+		return 0;
+
+	uint32_t hash = afc_cache_hash(kind, key);
+	struct afc_cache_entry **link = &client->cache[hash % AFC_CACHE_BUCKETS];
+	int found = 0;
+	while (*link) {
+		struct afc_cache_entry *entry = *link;
+		if (entry->hash == hash && entry->kind == kind && !strcmp(entry->path, key)) {
+			if (entry->expires > afc_cache_time_ms()) {
+				*data = entry->data;
+				*length = entry->length;
+				found = 1;
+			} else {
+				*link = entry->next;
+				afc_cache_entry_free(entry);
+				client->cache_count--;
+			}
+			break;
+		}
+		link = &entry->next;
+	}
+	free(key);
+
+	return found;
+}
+
+/**
+ * Stores a copy of a successful reply, replacing an older entry.
+ */
+static void afc_cache_store(afc_client_t client, enum afc_cache_kind kind, const char *path, const char *data, uint32_t length)
+{
+	if (!client->cache_ttl || !data)
+		return;
+
+	struct afc_cache_entry *entry = (struct afc_cache_entry*)malloc(sizeof(struct afc_cache_entry));
+	if (!entry)
+		return;
+	entry->path = afc_cache_normalize_path(path);
+	entry->data = (char*)malloc(length);
+	if (!entry->path || !entry->data) {
+		free(entry->path);
+		free(entry->data);
+		free(entry);
+		return;
+	}
+	memcpy(entry->data, data, length);
+	entry->length = length;
+	entry->kind = kind;
+	entry->hash = afc_cache_hash(kind, entry->path);
+	entry->expires = afc_cache_time_ms() + client->cache_ttl;
+
+	struct afc_cache_entry **link = &client->cache[entry->hash % AFC_CACHE_BUCKETS];
+	while (*link) {
+		struct afc_cache_entry *old = *link;
+		if (old->hash == entry->hash && old->kind == kind && !strcmp(old->path, entry->path)) {
+			*link = old->next;
+			afc_cache_entry_free(old);
+			client->cache_count--;
+			break;
+		}
+		link = &old->next;
+	}
+
+	if (client->cache_count >= AFC_CACHE_MAX_ENTRIES) {
+		afc_cache_flush(client);
+	}
+	link = &client->cache[entry->hash % AFC_CACHE_BUCKETS];
+	entry->next = *link;
+	*link = entry;
+	client->cache_count++;
+}
+
+/**
+ * Drops everything cached about a path that was modified: its own info and
+ * listing, everything below it and the listing of its parent directory.
+ */
+static void afc_cache_invalidate(afc_client_t client, const char *path)
+{
+	uint32_t i;
+
+	if (!client->cache_ttl || !path)
+		return;
+
+	char *key = afc_cache_normalize_path(path);
+	if (!key || !strcmp(key, "/")) {
+		free(key);
+		afc_cache_flush(client);
+		return;
+	}
+	size_t key_len = strlen(key);
+	size_t parent_len = strrchr(key, '/') - key;
+	if (parent_len == 0)
+		parent_len = 1;
+
+	for (i = 0; i < AFC_CACHE_BUCKETS; i++) {
+		struct afc_cache_entry **link = &client->cache[i];
+		while (*link) {
+			struct afc_cache_entry *entry = *link;
+			int drop = (!strncmp(entry->path, key, key_len) && (entry->path[key_len] == '\0' || entry->path[key_len] == '/'));
+			if (!drop && entry->kind == AFC_CACHE_DIRECTORY && strlen(entry->path) == parent_len && !strncmp(entry->path, key, parent_len)) {
+				drop = 1;
+			}
+			if (drop) {
+				*link = entry->next;
+				afc_cache_entry_free(entry);
+				client->cache_count--;
+			} else {
+				link = &entry->next;
+			}
+		}
+	}
+	free(key);
+}
+
+/**
+ * Remembers the path of a file opened for writing, so its entries can be
+ * invalidated again when the file is changed through the handle.
+ */
+static void afc_cache_track_handle(afc_client_t client, uint64_t handle, const char *path)
+{
+	if (!client->cache_ttl)
+		return;
+
+	struct afc_cache_handle *h = (struct afc_cache_handle*)malloc(sizeof(struct afc_cache_handle));
+	if (!h)
+		return;
+	h->path = strdup(path);
+	if (!h->path) {
+		free(h);
+		return;
+	}
+	h->handle = handle;
+	h->next = client->cache_handles;
+	client->cache_handles = h;
+}
+
+/**
+ * Invalidates the entries of the file behind a tracked handle, and stops
+ * tracking it if the handle is being closed.
+ */
+static void afc_cache_touch_handle(afc_client_t client, uint64_t handle, int closing)
+{
+	struct afc_cache_handle **link = &client->cache_handles;
+
+	while (*link) {
+		struct afc_cache_handle *h = *link;
+		if (h->handle == handle) {
+			afc_cache_invalidate(client, h->path);
+			if (closing) {
+				*link = h->next;
+				free(h->path);
+				free(h);
+			}
+			return;
+		}
+		link = &h->next;
+	}
+}
+
+static void afc_cache_handles_free(afc_client_t client)
+{
+	while (client->cache_handles) {
+		struct afc_cache_handle *next = client->cache_handles->next;
+		free(client->cache_handles->path);
+		free(client->cache_handles);
+		client->cache_handles = next;
+	}
+}
+
 /**
  * Makes a connection to the AFC service on the device using the given
  * connection.
@@ -78,7 +441,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_with_service_client(service_clie
 	client_loc->free_parent = 0;
 
 	/* allocate a packet */
-	client_loc->packet_extra = 1024;
+	client_loc->packet_extra = AFC_BUFFER_MIN_SIZE;
 	client_loc->afc_packet = (AFCPacket *) malloc(sizeof(AFCPacket) + client_loc->packet_extra);
 	if (!client_loc->afc_packet) {
 		free(client_loc);
@@ -88,6 +451,21 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_with_service_client(service_clie
 	client_loc->afc_packet->entire_length = 0;
 	client_loc->afc_packet->this_length = 0;
 	memcpy(client_loc->afc_packet->magic, AFC_MAGIC, AFC_MAGIC_LEN);
+	client_loc->write_window = 0;
+	client_loc->write_pending_head = 0;
+	client_loc->write_pending_count = 0;
+	client_loc->write_error = AFC_E_SUCCESS;
+	client_loc->broken = 0;
+	client_loc->recv_buf = NULL;
+	client_loc->recv_buf_size = 0;
+	client_loc->max_chunk_size = 0;
+	client_loc->send_high_water = client_loc->packet_extra;
+	client_loc->recv_high_water = 0;
+	client_loc->buffer_allocations = 1;
+	client_loc->cache_ttl = 0;
+	client_loc->cache = NULL;
+	client_loc->cache_count = 0;
+	client_loc->cache_handles = NULL;
 	mutex_init(&client_loc->mutex);
 
 	*client = client_loc;
@@ -130,6 +508,10 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
 		client->parent = NULL;
 	}
 	free(client->afc_packet);
+	free(client->recv_buf);
+	afc_cache_flush(client);
+	free(client->cache);
+	afc_cache_handles_free(client);
 	mutex_destroy(&client->mutex);
 	free(client);
 	return AFC_E_SUCCESS;
@@ -165,115 +547,138 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 	client->afc_packet->entire_length = sizeof(AFCPacket) + data_length + payload_length;
 	client->afc_packet->this_length = sizeof(AFCPacket) + data_length;
 
-	debug_info("packet length = %i", client->afc_packet->this_length);
+	trace_event(TRACE_AFC_PACKET_SEND, operation, client->afc_packet->packet_num, client->afc_packet->entire_length);
+	metrics_afc_operation(operation);
 
-	/* send AFC packet header and data */
-	AFCPacket_to_LE(client->afc_packet);
-	debug_buffer((char*)client->afc_packet, sizeof(AFCPacket) + data_length);
-	sent = 0;
-	service_send(client->parent, (void*)client->afc_packet, sizeof(AFCPacket) + data_length, &sent);
-	AFCPacket_from_LE(client->afc_packet);
-	*bytes_sent += sent;
-	if (sent < sizeof(AFCPacket) + data_length) {
-		return AFC_E_SUCCESS;
+	/* send AFC packet header and data together with the payload */
+	struct socket_iovec iov[2];
+	int iovcnt = 1;
+	iov[0].data = client->afc_packet;
+	iov[0].length = sizeof(AFCPacket) + data_length;
+	if (payload_length > 0) {
+		iov[1].data = payload;
+		iov[1].length = payload_length;
+		iovcnt++;
 	}
 
-	sent = 0;
-	if (payload_length > 0) {
+	AFCPacket_to_LE(client->afc_packet);
+	if (debug_enabled()) {
+		debug_info("packet length = %i", client->afc_packet->this_length);
+		debug_buffer((char*)client->afc_packet, sizeof(AFCPacket) + data_length);
 		if (payload_length > 256) {
 			debug_info("packet payload follows (256/%u)", payload_length);
 			debug_buffer(payload, 256);
-		} else {
+		} else if (payload_length > 0) {
 			debug_info("packet payload follows");
 			debug_buffer(payload, payload_length);
 		}
-		service_send(client->parent, payload, payload_length, &sent);
 	}
-	*bytes_sent += sent;
-	if (sent < payload_length) {
-		return AFC_E_SUCCESS;
+	if (service_sendv(client->parent, iov, iovcnt, &sent) != SERVICE_E_SUCCESS) {
+		client->broken = 1;
 	}
+	AFCPacket_from_LE(client->afc_packet);
+	*bytes_sent = sent;
 
 	return AFC_E_SUCCESS;
 }
 
 /**
- * Receives data through an AFC client and sets a variable to the received data.
+ * Receives and validates the header of the reply to a specific AFC packet.
  *
  * @param client The client to receive data on.
- * @param bytes The char* to point to the newly-received data.
- * @param bytes_recv How much data was received.
+ * @param packet_num The packet number of the request the reply belongs to.
+ * @param header Pointer to an AFCPacket that will be filled with the header
+ *     in host byte order.
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+static afc_error_t afc_receive_header(afc_client_t client, uint64_t packet_num, AFCPacket *header)
 {
-	AFCPacket header;
-	uint32_t entire_len = 0;
-	uint32_t this_len = 0;
-	uint32_t current_count = 0;
-	uint64_t param1 = -1;
-	char* dump_here = NULL;
-
-	if (bytes_recv) {
-		*bytes_recv = 0;
-	}
-	if (bytes) {
-		*bytes = NULL;
-	}
+	uint32_t bytes_recv = 0;
 
 	/* first, read the AFC header */
-	service_receive(client->parent, (char*)&header, sizeof(AFCPacket), bytes_recv);
-	AFCPacket_from_LE(&header);
-	if (*bytes_recv == 0) {
+	service_receive(client->parent, (char*)header, sizeof(AFCPacket), &bytes_recv);
+	AFCPacket_from_LE(header);
+	if (bytes_recv == 0) {
 		debug_info("Just didn't get enough.");
+		client->broken = 1;
 		return AFC_E_MUX_ERROR;
-	} else if (*bytes_recv < sizeof(AFCPacket)) {
+	} else if (bytes_recv < sizeof(AFCPacket)) {
 		debug_info("Did not even get the AFCPacket header");
+		client->broken = 1;
 		return AFC_E_MUX_ERROR;
 	}
 
 	/* check if it's a valid AFC header */
-	if (strncmp(header.magic, AFC_MAGIC, AFC_MAGIC_LEN)) {
+	if (strncmp(header->magic, AFC_MAGIC, AFC_MAGIC_LEN)) {
 		debug_info("Invalid AFC packet received (magic != " AFC_MAGIC ")!");
 	}
 
 	/* check if it has the correct packet number */
-	if (header.packet_num != client->afc_packet->packet_num) {
+	if (header->packet_num != packet_num) {
 		/* otherwise print a warning but do not abort */
-		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, client->afc_packet->packet_num);
+		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header->packet_num, packet_num);
 		return AFC_E_OP_HEADER_INVALID;
 	}
 
-	/* then, read the attached packet */
-	if (header.this_length < sizeof(AFCPacket)) {
+	if (header->this_length < sizeof(AFCPacket) || header->entire_length < header->this_length) {
 		debug_info("Invalid AFCPacket header received!");
 		return AFC_E_OP_HEADER_INVALID;
-	} else if ((header.this_length == header.entire_length)
-			&& header.entire_length == sizeof(AFCPacket)) {
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Receives the remaining part of an AFC packet after its header has been
+ * received with afc_receive_header() and sets a variable to the received data.
+ *
+ * @param client The client to receive data on.
+ * @param header The header of the packet in host byte order.
+ * @param bytes The char* to point to the newly-received data. The data lives
+ *     in the client's receive buffer and stays valid until the next receive
+ *     on the client; it must not be freed.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_body(afc_client_t client, AFCPacket *header, char **bytes, uint32_t *bytes_recv)
+{
+	uint32_t entire_len = 0;
+	uint32_t this_len = 0;
+	uint32_t current_count = 0;
+	uint64_t param1 = -1;
+	char* dump_here = NULL;
+
+	/* then, read the attached packet */
+	if ((header->this_length == header->entire_length)
+			&& header->entire_length == sizeof(AFCPacket)) {
 		debug_info("Empty AFCPacket received!");
 		*bytes_recv = 0;
-		if (header.operation == AFC_OP_DATA) {
+		if (header->operation == AFC_OP_DATA) {
 			return AFC_E_SUCCESS;
 		} else {
 			return AFC_E_IO_ERROR;
 		}
 	}
 
-	debug_info("received AFC packet, full len=%lld, this len=%lld, operation=0x%llx", header.entire_length, header.this_length, header.operation);
+	debug_info("received AFC packet, full len=%lld, this len=%lld, operation=0x%llx", header->entire_length, header->this_length, header->operation);
+	trace_event(TRACE_AFC_PACKET_RECEIVE, header->operation, header->packet_num, header->entire_length);
 
-	entire_len = (uint32_t)header.entire_length - sizeof(AFCPacket);
-	this_len = (uint32_t)header.this_length - sizeof(AFCPacket);
+	entire_len = (uint32_t)header->entire_length - sizeof(AFCPacket);
+	this_len = (uint32_t)header->this_length - sizeof(AFCPacket);
 
-	dump_here = (char*)malloc(entire_len);
+	if (_afc_check_recv_buffer(client, entire_len) < 0) {
+		debug_info("Failed to allocate receive buffer");
+		return AFC_E_NO_MEM;
+	}
+	dump_here = client->recv_buf;
 	if (this_len > 0) {
 		service_receive(client->parent, dump_here, this_len, bytes_recv);
 		if (*bytes_recv <= 0) {
-			free(dump_here);
 			debug_info("Did not get packet contents!");
 			return AFC_E_NOT_ENOUGH_DATA;
 		} else if (*bytes_recv < this_len) {
-			free(dump_here);
 			debug_info("Could not receive this_len=%d bytes", this_len);
 			return AFC_E_NOT_ENOUGH_DATA;
 		}
@@ -299,43 +704,43 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 		param1 = le64toh(*(uint64_t*)(dump_here));
 	}
 
-	debug_info("packet data size = %i", current_count);
-	if (current_count > 256) {
-		debug_info("packet data follows (256/%u)", current_count);
-		debug_buffer(dump_here, 256);
-	} else {
-		debug_info("packet data follows");
-		debug_buffer(dump_here, current_count);
+	if (debug_enabled()) {
+		debug_info("packet data size = %i", current_count);
+		if (current_count > 256) {
+			debug_info("packet data follows (256/%u)", current_count);
+			debug_buffer(dump_here, 256);
+		} else {
+			debug_info("packet data follows");
+			debug_buffer(dump_here, current_count);
+		}
 	}
 
 	/* check operation types */
-	if (header.operation == AFC_OP_STATUS) {
+	if (header->operation == AFC_OP_STATUS) {
 		/* status response */
 		debug_info("got a status response, code=%lld", param1);
 
 		if (param1 != AFC_E_SUCCESS) {
 			/* error status */
-			/* free buffer */
-			free(dump_here);
+			metrics_add(&internal_metrics_afc.errors, 1);
 			return (afc_error_t)param1;
 		}
-	} else if (header.operation == AFC_OP_DATA) {
+	} else if (header->operation == AFC_OP_DATA) {
 		/* data response */
 		debug_info("got a data response");
-	} else if (header.operation == AFC_OP_FILE_OPEN_RES) {
+	} else if (header->operation == AFC_OP_FILE_OPEN_RES) {
 		/* file handle response */
 		debug_info("got a file handle response, handle=%lld", param1);
-	} else if (header.operation == AFC_OP_FILE_TELL_RES) {
+	} else if (header->operation == AFC_OP_FILE_TELL_RES) {
 		/* tell response */
 		debug_info("got a tell response, position=%lld", param1);
 	} else {
 		/* unknown operation code received */
-		free(dump_here);
 		*bytes_recv = 0;
 
-		debug_info("WARNING: Unknown operation code received 0x%llx param1=%lld", header.operation, param1);
+		debug_info("WARNING: Unknown operation code received 0x%llx param1=%lld", header->operation, param1);
 #ifndef WIN32
-		fprintf(stderr, "%s: WARNING: Unknown operation code received 0x%llx param1=%lld", __func__, (long long)header.operation, (long long)param1);
+		fprintf(stderr, "%s: WARNING: Unknown operation code received 0x%llx param1=%lld", __func__, (long long)header->operation, (long long)param1);
 #endif
 
 		return AFC_E_OP_NOT_SUPPORTED;
@@ -343,8 +748,6 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 
 	if (bytes) {
 		*bytes = dump_here;
-	} else {
-		free(dump_here);
 	}
 
 	*bytes_recv = current_count;
@@ -352,81 +755,259 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 }
 
 /**
- * Returns counts of null characters within a string.
+ * Collects the status reply of the oldest write that was dispatched in
+ * windowed write mode. The first error is kept in client->write_error to be
+ * reported by a later afc_file_write() or afc_file_close() call.
+ *
+ * @param client The client to collect the status reply on.
  */
-static uint32_t count_nullspaces(char *string, uint32_t number)
+static void afc_collect_pending_write(afc_client_t client)
 {
-	uint32_t i = 0, nulls = 0;
+	AFCPacket header;
+	uint32_t bytes = 0;
+	uint64_t packet_num = client->write_pending[client->write_pending_head];
+	afc_error_t res;
 
-	for (i = 0; i < number; i++) {
-		if (string[i] == '\0')
-			nulls++;
+	client->write_pending_head = (client->write_pending_head + 1) % AFC_PIPELINE_MAX_DEPTH;
+	client->write_pending_count--;
+
+	res = afc_receive_header(client, packet_num, &header);
+	if (res == AFC_E_SUCCESS) {
+		res = afc_receive_body(client, &header, NULL, &bytes);
+	}
+	if (res != AFC_E_SUCCESS) {
+		debug_info("deferred write status for packet %lld: %d", (long long)packet_num, res);
+		if (client->write_error == AFC_E_SUCCESS) {
+			client->write_error = res;
+		}
+		if (res == AFC_E_MUX_ERROR || res == AFC_E_NOT_ENOUGH_DATA || res == AFC_E_OP_HEADER_INVALID) {
+			/* the reply stream is out of sync, forget about the rest */
+			client->write_pending_count = 0;
+		}
 	}
+}
 
-	return nulls;
+/**
+ * Collects all outstanding write status replies. Needs to be called before
+ * the reply to any later packet can be received.
+ *
+ * @param client The client to collect the status replies on.
+ */
+static void afc_drain_pending_writes(afc_client_t client)
+{
+	while (client->write_pending_count > 0) {
+		afc_collect_pending_write(client);
+	}
 }
 
 /**
- * Splits a string of tokens by null characters and returns each token in a
- * char array/list.
+ * Receives the reply to a specific AFC packet through an AFC client and sets
+ * a variable to the received data.
  *
- * @param tokens The characters to split into a list.
- * @param length The length of the tokens string.
+ * @param client The client to receive data on.
+ * @param packet_num The packet number of the request the reply belongs to.
+ * @param bytes The char* to point to the newly-received data, see
+ *     afc_receive_body() for its lifetime.
+ * @param bytes_recv How much data was received.
  *
- * @return A char ** list with each token found in the string. The caller is
- *  responsible for freeing the memory.
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static char **make_strings_list(char *tokens, uint32_t length)
+static afc_error_t afc_receive_packet(afc_client_t client, uint64_t packet_num, char **bytes, uint32_t *bytes_recv)
 {
-	uint32_t nulls = 0, i = 0, j = 0;
-	char **list = NULL;
-
-	if (!tokens || !length)
-		return NULL;
+	AFCPacket header;
+	afc_error_t ret;
 
-	nulls = count_nullspaces(tokens, length);
-	list = (char **) malloc(sizeof(char *) * (nulls + 1));
-	for (i = 0; i < nulls; i++) {
-		list[i] = strdup(tokens + j);
-		j += strlen(list[i]) + 1;
+	if (bytes_recv) {
+		*bytes_recv = 0;
+	}
+	if (bytes) {
+		*bytes = NULL;
 	}
-	list[i] = NULL;
 
-	return list;
-}
+	afc_drain_pending_writes(client);
 
-static int _afc_check_packet_buffer(afc_client_t client, uint32_t data_len)
-{
-	if (data_len > client->packet_extra) {
-		client->packet_extra = (data_len & ~8) + 8;
-		AFCPacket* newpkt = (AFCPacket*)realloc(client->afc_packet, sizeof(AFCPacket) + client->packet_extra);
-		if (!newpkt) {
-			return -1;
-		}
-		client->afc_packet = newpkt;
+	ret = afc_receive_header(client, packet_num, &header);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
 	}
-	return 0;
-}
 
-#define AFC_PACKET_DATA_PTR ((char*)client->afc_packet + sizeof(AFCPacket))
+	return afc_receive_body(client, &header, bytes, bytes_recv);
+}
 
-LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information)
+/**
+ * Receives the reply to a specific AFC packet directly into a caller-provided
+ * buffer. AFC_OP_DATA replies are read straight into the buffer without any
+ * intermediate allocation or copy; any other reply is handled like in
+ * afc_receive_packet() and its contents are discarded, reporting 0 bytes.
+ *
+ * @param client The client to receive data on.
+ * @param packet_num The packet number of the request the reply belongs to.
+ * @param data The buffer to receive the reply data into.
+ * @param length The size of the buffer. Data exceeding the buffer is
+ *     received and dropped to keep the connection in sync.
+ * @param bytes_recv How much data was stored in the buffer.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_packet_into(afc_client_t client, uint64_t packet_num, char *data, uint32_t length, uint32_t *bytes_recv)
 {
+	AFCPacket header;
+	afc_error_t ret;
+	uint32_t entire_len = 0;
+	uint32_t current_count = 0;
+	uint32_t recv_len = 0;
 	uint32_t bytes = 0;
-	char *data = NULL, **list_loc = NULL;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
-	if (!client || !path || !directory_information || (directory_information && *directory_information))
-		return AFC_E_INVALID_ARG;
+	*bytes_recv = 0;
 
-	afc_lock(client);
+	afc_drain_pending_writes(client);
 
-	uint32_t data_len = (uint32_t)strlen(path)+1;
-	if (_afc_check_packet_buffer(client, data_len) < 0) {
-		afc_unlock(client);
-		debug_info("Failed to realloc packet buffer");
-		return AFC_E_NO_MEM;
-	}
+	ret = afc_receive_header(client, packet_num, &header);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	}
+
+	if (header.operation != AFC_OP_DATA) {
+		/* nothing is stored in the buffer, so nothing may be reported;
+		 * a successful STATUS reply is an empty read */
+		ret = afc_receive_body(client, &header, NULL, bytes_recv);
+		*bytes_recv = 0;
+		return ret;
+	}
+
+	entire_len = (uint32_t)header.entire_length - sizeof(AFCPacket);
+	recv_len = (entire_len > length) ? length : entire_len;
+
+	debug_info("received AFC data packet, full len=%lld, this len=%lld", header.entire_length, header.this_length);
+	trace_event(TRACE_AFC_PACKET_RECEIVE, header.operation, header.packet_num, header.entire_length);
+
+	while (current_count < recv_len) {
+		bytes = 0;
+		service_receive(client->parent, data + current_count, recv_len - current_count, &bytes);
+		if (bytes == 0) {
+			debug_info("Error receiving data (got %u of %u bytes)", current_count, recv_len);
+			*bytes_recv = current_count;
+			return AFC_E_NOT_ENOUGH_DATA;
+		}
+		current_count += bytes;
+	}
+
+	if (entire_len > recv_len) {
+		char discard[256];
+		uint32_t remaining = entire_len - recv_len;
+		debug_info("WARNING: dropping %u bytes exceeding the receive buffer", remaining);
+		while (remaining > 0) {
+			bytes = 0;
+			service_receive(client->parent, discard, (remaining > sizeof(discard)) ? sizeof(discard) : remaining, &bytes);
+			if (bytes == 0) {
+				*bytes_recv = current_count;
+				return AFC_E_NOT_ENOUGH_DATA;
+			}
+			remaining -= bytes;
+		}
+	}
+
+	*bytes_recv = current_count;
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Receives data through an AFC client and sets a variable to the received data.
+ * The reply is expected to belong to the last dispatched packet.
+ *
+ * @param client The client to receive data on.
+ * @param bytes The char* to point to the newly-received data, see
+ *     afc_receive_body() for its lifetime.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+{
+	return afc_receive_packet(client, client->afc_packet->packet_num, bytes, bytes_recv);
+}
+
+/**
+ * Returns counts of null characters within a string.
+ */
+static uint32_t count_nullspaces(char *string, uint32_t number)
+{
+	uint32_t i = 0, nulls = 0;
+
+	for (i = 0; i < number; i++) {
+		if (string[i] == '\0')
+			nulls++;
+	}
+
+	return nulls;
+}
+
+/**
+ * Splits a string of tokens by null characters and returns each token in a
+ * char array/list.
+ *
+ * @param tokens The characters to split into a list.
+ * @param length The length of the tokens string.
+ *
+ * @return A char ** list with each token found in the string. The caller is
+ *  responsible for freeing the memory.
+ */
+static char **make_strings_list(char *tokens, uint32_t length)
+{
+	uint32_t nulls = 0, i = 0, j = 0;
+	char **list = NULL;
+
+	if (!tokens || !length)
+		return NULL;
+
+	nulls = count_nullspaces(tokens, length);
+	list = (char **) malloc(sizeof(char *) * (nulls + 1));
+	for (i = 0; i < nulls; i++) {
+		list[i] = strdup(tokens + j);
+		j += strlen(list[i]) + 1;
+	}
+	list[i] = NULL;
+
+	return list;
+}
+
+
+#define AFC_PACKET_DATA_PTR ((char*)client->afc_packet + sizeof(AFCPacket))
+
+/**
+ * Checks whether an error returned while receiving a reply leaves the
+ * connection in an undefined state, i.e. the reply stream can not be
+ * continued.
+ */
+static int afc_error_is_fatal(afc_error_t err)
+{
+	return (err == AFC_E_MUX_ERROR || err == AFC_E_NOT_ENOUGH_DATA || err == AFC_E_OP_HEADER_INVALID);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information)
+{
+	uint32_t bytes = 0;
+	char *data = NULL, **list_loc = NULL;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !directory_information || (directory_information && *directory_information))
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	if (afc_cache_lookup(client, AFC_CACHE_DIRECTORY, path, &data, &bytes)) {
+		list_loc = make_strings_list(data, bytes);
+		afc_unlock(client);
+		*directory_information = list_loc;
+		return AFC_E_SUCCESS;
+	}
+
+	uint32_t data_len = (uint32_t)strlen(path)+1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
 
 	/* Send the command */
 	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
@@ -438,15 +1019,12 @@ LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const c
 	/* Receive the data */
 	ret = afc_receive_data(client, &data, &bytes);
 	if (ret != AFC_E_SUCCESS) {
-		if (data)
-			free(data);
 		afc_unlock(client);
 		return ret;
 	}
+	afc_cache_store(client, AFC_CACHE_DIRECTORY, path, data, bytes);
 	/* Parse the data */
 	list_loc = make_strings_list(data, bytes);
-	if (data)
-		free(data);
 
 	afc_unlock(client);
 	*directory_information = list_loc;
@@ -454,6 +1032,224 @@ LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const c
 	return ret;
 }
 
+/**
+ * Converts the st_ifmt value of a file info reply to an afc_file_type_t.
+ */
+static afc_file_type_t afc_file_type_from_string(const char *ifmt)
+{
+	if (!strcmp(ifmt, "S_IFREG"))
+		return AFC_FILE_TYPE_REGULAR;
+	if (!strcmp(ifmt, "S_IFDIR"))
+		return AFC_FILE_TYPE_DIRECTORY;
+	if (!strcmp(ifmt, "S_IFLNK"))
+		return AFC_FILE_TYPE_SYMLINK;
+	if (!strcmp(ifmt, "S_IFCHR"))
+		return AFC_FILE_TYPE_CHAR_DEVICE;
+	if (!strcmp(ifmt, "S_IFBLK"))
+		return AFC_FILE_TYPE_BLOCK_DEVICE;
+	if (!strcmp(ifmt, "S_IFIFO"))
+		return AFC_FILE_TYPE_FIFO;
+	if (!strcmp(ifmt, "S_IFSOCK"))
+		return AFC_FILE_TYPE_SOCKET;
+	return AFC_FILE_TYPE_UNKNOWN;
+}
+
+/**
+ * Iterates over the null-separated key/value pairs of an info reply in place.
+ *
+ * @param data The reply data.
+ * @param length The length of the reply data.
+ * @param pos Position to continue from, start with 0.
+ * @param key Set to the next key.
+ * @param val Set to the value of the next key.
+ *
+ * @return 1 if a pair was found, 0 at the end of the data.
+ */
+static int afc_info_next_pair(const char *data, uint32_t length, uint32_t *pos, const char **key, const char **val)
+{
+	if (*pos >= length)
+		return 0;
+	uint32_t key_len = (uint32_t)strnlen(data + *pos, length - *pos);
+	uint32_t val_pos = *pos + key_len + 1;
+	if (val_pos >= length)
+		return 0;
+	uint32_t val_len = (uint32_t)strnlen(data + val_pos, length - val_pos);
+	if (val_pos + val_len >= length)
+		return 0;
+	*key = data + *pos;
+	*val = data + val_pos;
+	*pos = val_pos + val_len + 1;
+	return 1;
+}
+
+/**
+ * Parses a file info reply in place into a directory entry.
+ */
+static void afc_parse_dir_entry_info(const char *data, uint32_t length, afc_dir_entry_t *entry)
+{
+	uint32_t pos = 0;
+	const char *key = NULL;
+	const char *val = NULL;
+	while (afc_info_next_pair(data, length, &pos, &key, &val)) {
+		if (!strcmp(key, "st_size")) {
+			entry->size = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_mtime")) {
+			entry->mtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_ifmt")) {
+			entry->type = afc_file_type_from_string(val);
+		}
+	}
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_read_directory_with_info(afc_client_t client, const char *path, afc_dir_entry_t **entries, uint32_t *count)
+{
+	char **list = NULL;
+	uint32_t i = 0;
+	uint32_t num = 0;
+	size_t names_size = 0;
+	afc_error_t ret;
+
+	if (!client || !path || !entries || !count)
+		return AFC_E_INVALID_ARG;
+
+	*entries = NULL;
+	*count = 0;
+
+	ret = afc_read_directory(client, path, &list);
+	if (ret != AFC_E_SUCCESS)
+		return ret;
+
+	for (i = 0; list && list[i]; i++) {
+		if (!strcmp(list[i], ".") || !strcmp(list[i], ".."))
+			continue;
+		num++;
+		names_size += strlen(list[i]) + 1;
+	}
+
+	/* entries and names are kept in a single allocation */
+	afc_dir_entry_t *entries_loc = (afc_dir_entry_t*)malloc(sizeof(afc_dir_entry_t) * num + names_size + 1);
+	if (!entries_loc) {
+		afc_dictionary_free(list);
+		return AFC_E_NO_MEM;
+	}
+	char *names = (char*)(entries_loc + num);
+	uint32_t n = 0;
+	for (i = 0; list && list[i]; i++) {
+		if (!strcmp(list[i], ".") || !strcmp(list[i], ".."))
+			continue;
+		size_t len = strlen(list[i]) + 1;
+		memcpy(names, list[i], len);
+		entries_loc[n].name = names;
+		entries_loc[n].size = 0;
+		entries_loc[n].mtime = 0;
+		entries_loc[n].type = AFC_FILE_TYPE_UNKNOWN;
+		names += len;
+		n++;
+	}
+	afc_dictionary_free(list);
+
+	size_t path_len = strlen(path);
+	int need_slash = (path_len == 0 || path[path_len-1] != '/');
+	uint64_t packet_nums[AFC_PIPELINE_MAX_DEPTH];
+	uint32_t sent = 0, received = 0;
+	uint32_t *pending = NULL;
+	uint32_t num_pending = num;
+
+	afc_lock(client);
+
+	if (client->cache_ttl && num > 0) {
+		/* only ask for the entries that are not cached */
+		pending = (uint32_t*)malloc(sizeof(uint32_t) * num);
+		if (!pending) {
+			afc_unlock(client);
+			free(entries_loc);
+			return AFC_E_NO_MEM;
+		}
+		num_pending = 0;
+		for (i = 0; i < num; i++) {
+			char *data = NULL;
+			uint32_t bytes = 0;
+			char *entry_path = string_concat(path, (need_slash) ? "/" : "", entries_loc[i].name, NULL);
+			if (entry_path && afc_cache_lookup(client, AFC_CACHE_FILE_INFO, entry_path, &data, &bytes)) {
+				afc_parse_dir_entry_info(data, bytes, &entries_loc[i]);
+			} else {
+				pending[num_pending++] = i;
+			}
+			free(entry_path);
+		}
+	}
+
+	/* pipeline the GetFileInfo requests for all entries */
+	while (received < sent || sent < num_pending) {
+		while (ret == AFC_E_SUCCESS && sent < num_pending && sent - received < AFC_PIPELINE_MAX_DEPTH) {
+			uint32_t bytes = 0;
+			const char *name = entries_loc[(pending) ? pending[sent] : sent].name;
+			size_t name_len = strlen(name);
+			uint32_t data_len = (uint32_t)(path_len + need_slash + name_len + 1);
+			if (_afc_check_packet_buffer(client, data_len) < 0) {
+				ret = AFC_E_NO_MEM;
+				break;
+			}
+			memcpy(AFC_PACKET_DATA_PTR, path, path_len);
+			if (need_slash)
+				AFC_PACKET_DATA_PTR[path_len] = '/';
+			memcpy(AFC_PACKET_DATA_PTR + path_len + need_slash, name, name_len + 1);
+			if (afc_dispatch_packet(client, AFC_OP_GET_FILE_INFO, data_len, NULL, 0, &bytes) != AFC_E_SUCCESS || bytes == 0) {
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			packet_nums[sent % AFC_PIPELINE_MAX_DEPTH] = client->afc_packet->packet_num;
+			sent++;
+		}
+		if (received == sent)
+			break;
+
+		char *data = NULL;
+		uint32_t bytes = 0;
+		afc_dir_entry_t *entry = &entries_loc[(pending) ? pending[received] : received];
+		afc_error_t res = afc_receive_packet(client, packet_nums[received % AFC_PIPELINE_MAX_DEPTH], &data, &bytes);
+		if (res == AFC_E_SUCCESS && data) {
+			afc_parse_dir_entry_info(data, bytes, entry);
+			if (client->cache_ttl) {
+				char *entry_path = string_concat(path, (need_slash) ? "/" : "", entry->name, NULL);
+				if (entry_path) {
+					afc_cache_store(client, AFC_CACHE_FILE_INFO, entry_path, data, bytes);
+					free(entry_path);
+				}
+			}
+		} else if (res != AFC_E_SUCCESS) {
+			/* the entry might have vanished in the meantime */
+			debug_info("could not get info for %s: %d", entry->name, res);
+		}
+		received++;
+		if (afc_error_is_fatal(res)) {
+			ret = res;
+			break;
+		}
+	}
+	free(pending);
+
+	afc_unlock(client);
+
+	if (ret != AFC_E_SUCCESS) {
+		free(entries_loc);
+		return ret;
+	}
+
+	*entries = entries_loc;
+	*count = num;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_dir_entries_free(afc_dir_entry_t *entries)
+{
+	if (!entries)
+		return AFC_E_INVALID_ARG;
+	free(entries);
+	return AFC_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
 {
 	uint32_t bytes = 0;
@@ -474,15 +1270,11 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char *
 	/* Receive the data */
 	ret = afc_receive_data(client, &data, &bytes);
 	if (ret != AFC_E_SUCCESS) {
-		if (data)
-			free(data);
 		afc_unlock(client);
 		return ret;
 	}
 	/* Parse the data */
 	list = make_strings_list(data, bytes);
-	if (data)
-		free(data);
 
 	afc_unlock(client);
 
@@ -491,6 +1283,80 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char *
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info_typed(afc_client_t client, afc_device_info_t **device_info)
+{
+	uint32_t bytes = 0;
+	uint32_t pos = 0;
+	const char *key = NULL;
+	const char *val = NULL;
+	const char *model = NULL;
+	char *data = NULL;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !device_info)
+		return AFC_E_INVALID_ARG;
+
+	*device_info = NULL;
+
+	afc_lock(client);
+
+	/* Send the command */
+	ret = afc_dispatch_packet(client, AFC_OP_GET_DEVINFO, 0, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive the data */
+	ret = afc_receive_data(client, &data, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return ret;
+	}
+
+	while (afc_info_next_pair(data, bytes, &pos, &key, &val)) {
+		if (!strcmp(key, "Model")) {
+			model = val;
+			break;
+		}
+	}
+
+	size_t model_len = (model) ? strlen(model) + 1 : 0;
+	afc_device_info_t *info = (afc_device_info_t*)calloc(1, sizeof(afc_device_info_t) + model_len);
+	if (!info) {
+		afc_unlock(client);
+		return AFC_E_NO_MEM;
+	}
+	if (model) {
+		info->model = (char*)(info + 1);
+		memcpy(info->model, model, model_len);
+	}
+
+	pos = 0;
+	while (afc_info_next_pair(data, bytes, &pos, &key, &val)) {
+		if (!strcmp(key, "FSTotalBytes")) {
+			info->total_bytes = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "FSFreeBytes")) {
+			info->free_bytes = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "FSBlockSize")) {
+			info->block_size = strtoull(val, NULL, 10);
+		}
+	}
+
+	afc_unlock(client);
+
+	*device_info = info;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_device_info_free(afc_device_info_t *device_info)
+{
+	if (!device_info)
+		return AFC_E_INVALID_ARG;
+	free(device_info);
+	return AFC_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char **value)
 {
 	afc_error_t ret = AFC_E_INTERNAL_ERROR;
@@ -544,6 +1410,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_remove_path(afc_client_t client, const char
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
 
 	/* special case; unknown error actually means directory not empty */
 	if (ret == AFC_E_UNKNOWN_ERROR)
@@ -584,6 +1451,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_rename_path(afc_client_t client, const char
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, from);
+	afc_cache_invalidate(client, to);
 
 	afc_unlock(client);
 
@@ -616,6 +1485,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_make_directory(afc_client_t client, const c
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
 
 	afc_unlock(client);
 
@@ -633,6 +1503,12 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 
 	afc_lock(client);
 
+	if (afc_cache_lookup(client, AFC_CACHE_FILE_INFO, path, &received, &bytes)) {
+		*file_information = make_strings_list(received, bytes);
+		afc_unlock(client);
+		return AFC_E_SUCCESS;
+	}
+
 	uint32_t data_len = (uint32_t)strlen(path)+1;
 	if (_afc_check_packet_buffer(client, data_len) < 0) {
 		afc_unlock(client);
@@ -653,8 +1529,10 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 	/* Receive data */
 	ret = afc_receive_data(client, &received, &bytes);
 	if (received) {
+		if (ret == AFC_E_SUCCESS) {
+			afc_cache_store(client, AFC_CACHE_FILE_INFO, path, received, bytes);
+		}
 		*file_information = make_strings_list(received, bytes);
-		free(received);
 	}
 
 	afc_unlock(client);
@@ -662,28 +1540,121 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *filename, afc_file_mode_t file_mode, uint64_t *handle)
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info_typed(afc_client_t client, const char *path, afc_file_info_t **file_info)
 {
-	if (!client || !client->parent || !client->afc_packet)
-		return AFC_E_INVALID_ARG;
-
-	//uint64_t file_mode_loc = htole64(file_mode);
+	char *received = NULL;
 	uint32_t bytes = 0;
+	uint32_t pos = 0;
+	const char *key = NULL;
+	const char *val = NULL;
+	const char *link_target = NULL;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
-	/* set handle to 0 so in case an error occurs, the handle is invalid */
-	*handle = 0;
+	if (!client || !path || !file_info)
+		return AFC_E_INVALID_ARG;
+
+	*file_info = NULL;
 
 	afc_lock(client);
 
-	uint32_t data_len = (uint32_t)(strlen(filename)+1 + 8);
-	if (_afc_check_packet_buffer(client, data_len) < 0) {
+	if (!afc_cache_lookup(client, AFC_CACHE_FILE_INFO, path, &received, &bytes)) {
+		uint32_t data_len = (uint32_t)strlen(path)+1;
+		if (_afc_check_packet_buffer(client, data_len) < 0) {
+			afc_unlock(client);
+			debug_info("Failed to realloc packet buffer");
+			return AFC_E_NO_MEM;
+		}
+
+		/* Send command */
+		memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+		ret = afc_dispatch_packet(client, AFC_OP_GET_FILE_INFO, data_len, NULL, 0, &bytes);
+		if (ret != AFC_E_SUCCESS) {
+			afc_unlock(client);
+			return AFC_E_NOT_ENOUGH_DATA;
+		}
+
+		/* Receive data */
+		ret = afc_receive_data(client, &received, &bytes);
+		if (ret != AFC_E_SUCCESS) {
+			afc_unlock(client);
+			return ret;
+		}
+		afc_cache_store(client, AFC_CACHE_FILE_INFO, path, received, bytes);
+	}
+
+	/* find the link target first, it is stored behind the struct */
+	while (afc_info_next_pair(received, bytes, &pos, &key, &val)) {
+		if (!strcmp(key, "LinkTarget")) {
+			link_target = val;
+			break;
+		}
+	}
+
+	size_t link_len = (link_target) ? strlen(link_target) + 1 : 0;
+	afc_file_info_t *info = (afc_file_info_t*)calloc(1, sizeof(afc_file_info_t) + link_len);
+	if (!info) {
 		afc_unlock(client);
-		debug_info("Failed to realloc packet buffer");
 		return AFC_E_NO_MEM;
 	}
+	if (link_target) {
+		info->link_target = (char*)(info + 1);
+		memcpy(info->link_target, link_target, link_len);
+	}
 
-	/* Send command */
+	pos = 0;
+	while (afc_info_next_pair(received, bytes, &pos, &key, &val)) {
+		if (!strcmp(key, "st_size")) {
+			info->size = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_blocks")) {
+			info->blocks = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_nlink")) {
+			info->nlink = (uint32_t)strtoul(val, NULL, 10);
+		} else if (!strcmp(key, "st_mtime")) {
+			info->mtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_birthtime")) {
+			info->birthtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_ifmt")) {
+			info->type = afc_file_type_from_string(val);
+		}
+	}
+
+	afc_unlock(client);
+
+	*file_info = info;
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_info_free(afc_file_info_t *file_info)
+{
+	if (!file_info)
+		return AFC_E_INVALID_ARG;
+	free(file_info);
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *filename, afc_file_mode_t file_mode, uint64_t *handle)
+{
+	if (!client || !client->parent || !client->afc_packet)
+		return AFC_E_INVALID_ARG;
+
+	//uint64_t file_mode_loc = htole64(file_mode);
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	/* set handle to 0 so in case an error occurs, the handle is invalid */
+	*handle = 0;
+
+	afc_lock(client);
+
+	uint32_t data_len = (uint32_t)(strlen(filename)+1 + 8);
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
+	/* Send command */
 	//memcpy(AFC_PACKET_DATA_PTR, &file_mode_loc, 8);
 	*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(file_mode);
 	memcpy(AFC_PACKET_DATA_PTR + 8, filename, data_len-8);
@@ -697,15 +1668,15 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *
 	char* data = NULL;
 	ret = afc_receive_data(client, &data, &bytes);
 	if ((ret == AFC_E_SUCCESS) && (bytes > 0) && data) {
-		afc_unlock(client);
-
 		/* Get the file handle */
 		memcpy(handle, data, sizeof(uint64_t));
-		free(data);
+		if (file_mode != AFC_FOPEN_RDONLY) {
+			afc_cache_invalidate(client, filename);
+			afc_cache_track_handle(client, *handle, filename);
+		}
+		afc_unlock(client);
 		return ret;
 	}
-	/* in case memory was allocated but no data received or an error occurred */
-	free(data);
 
 	debug_info("Didn't get any further data");
 
@@ -716,8 +1687,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *
 
 LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
 {
-	char *input = NULL;
-	uint32_t current_count = 0, bytes_loc = 0;
+	uint32_t bytes_loc = 0;
 	struct readinfo {
 		uint64_t handle;
 		uint64_t size;
@@ -741,30 +1711,109 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
-	/* Receive the data */
-	ret = afc_receive_data(client, &input, &bytes_loc);
-	debug_info("afc_receive_data returned error: %d", ret);
+	/* Receive the data straight into the caller's buffer */
+	ret = afc_receive_packet_into(client, client->afc_packet->packet_num, data, length, &bytes_loc);
+	debug_info("afc_receive_packet_into returned error: %d", ret);
 	debug_info("bytes returned: %i", bytes_loc);
+	afc_unlock(client);
 	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
 		return ret;
-	} else if (bytes_loc == 0) {
-		if (input)
-			free(input);
-		afc_unlock(client);
-		*bytes_read = current_count;
-		/* FIXME: check that's actually a success */
-		return ret;
-	} else {
-		if (input) {
-			debug_info("%d", bytes_loc);
-			memcpy(data + current_count, input, (bytes_loc > length) ? length : bytes_loc);
-			free(input);
-			input = NULL;
-			current_count += (bytes_loc > length) ? length : bytes_loc;
+	}
+	*bytes_read = bytes_loc;
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t chunk_size, uint32_t depth, uint32_t *bytes_read)
+{
+	struct readinfo {
+		uint64_t handle;
+		uint64_t size;
+	};
+	struct {
+		uint64_t packet_num;
+		uint32_t size;
+	} pending[AFC_PIPELINE_MAX_DEPTH];
+	uint32_t head = 0, tail = 0, inflight = 0;
+	uint32_t requested = 0, current_count = 0;
+	int eof = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || handle == 0 || !data || !bytes_read)
+		return AFC_E_INVALID_ARG;
+
+	if (chunk_size == 0)
+		chunk_size = AFC_PIPELINE_CHUNK_SIZE;
+	if (client->max_chunk_size && chunk_size > client->max_chunk_size)
+		chunk_size = client->max_chunk_size;
+	if (depth == 0)
+		depth = 1;
+	else if (depth > AFC_PIPELINE_MAX_DEPTH)
+		depth = AFC_PIPELINE_MAX_DEPTH;
+
+	debug_info("called for length %u (chunk size %u, depth %u)", length, chunk_size, depth);
+
+	*bytes_read = 0;
+
+	afc_lock(client);
+
+	while (1) {
+		/* keep the pipeline filled */
+		while (ret == AFC_E_SUCCESS && !eof && inflight < depth && requested < length) {
+			uint32_t bytes_loc = 0;
+			uint32_t size = (length - requested > chunk_size) ? chunk_size : length - requested;
+			struct readinfo* readinfo = (struct readinfo*)(AFC_PACKET_DATA_PTR);
+			readinfo->handle = handle;
+			readinfo->size = htole64(size);
+			if (afc_dispatch_packet(client, AFC_OP_FILE_READ, sizeof(struct readinfo), NULL, 0, &bytes_loc) != AFC_E_SUCCESS || bytes_loc == 0) {
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			pending[tail].packet_num = client->afc_packet->packet_num;
+			pending[tail].size = size;
+			tail = (tail + 1) % AFC_PIPELINE_MAX_DEPTH;
+			inflight++;
+			requested += size;
+		}
+
+		if (inflight == 0)
+			break;
+
+		/* collect the oldest outstanding reply, directly into place;
+		 * once an error or short read occurred the remaining replies
+		 * are only drained */
+		uint32_t bytes_loc = 0;
+		uint32_t size = pending[head].size;
+		char discard[256];
+		afc_error_t res;
+		if (ret == AFC_E_SUCCESS && !eof) {
+			res = afc_receive_packet_into(client, pending[head].packet_num, data + current_count, size, &bytes_loc);
+		} else {
+			res = afc_receive_packet_into(client, pending[head].packet_num, discard, sizeof(discard), &bytes_loc);
+			bytes_loc = 0;
+		}
+		head = (head + 1) % AFC_PIPELINE_MAX_DEPTH;
+		inflight--;
+
+		if (res != AFC_E_SUCCESS) {
+			if (ret == AFC_E_SUCCESS)
+				ret = res;
+			if (afc_error_is_fatal(res)) {
+				/* the reply stream is out of sync, stop draining */
+				break;
+			}
+			continue;
+		}
+
+		current_count += bytes_loc;
+
+		if (bytes_loc < size) {
+			/* short read, end of file reached */
+			eof = 1;
 		}
 	}
+
 	afc_unlock(client);
+
 	*bytes_read = current_count;
 	return ret;
 }
@@ -795,6 +1844,22 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t ha
 		return AFC_E_SUCCESS;
 	}
 
+	if (client->write_window > 1) {
+		/* windowed mode: queue the status reply and only wait for the
+		 * oldest one once the window is full */
+		uint32_t tail = (client->write_pending_head + client->write_pending_count) % AFC_PIPELINE_MAX_DEPTH;
+		client->write_pending[tail] = client->afc_packet->packet_num;
+		client->write_pending_count++;
+		while (client->write_pending_count >= client->write_window) {
+			afc_collect_pending_write(client);
+		}
+		ret = client->write_error;
+		client->write_error = AFC_E_SUCCESS;
+		afc_unlock(client);
+		*bytes_written = current_count;
+		return ret;
+	}
+
 	ret = afc_receive_data(client, NULL, &bytes_loc);
 	afc_unlock(client);
 	if (ret != AFC_E_SUCCESS) {
@@ -804,6 +1869,78 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t ha
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API afc_error_t afc_set_max_chunk_size(afc_client_t client, uint32_t size)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	client->max_chunk_size = size;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_buffer_stats(afc_client_t client, afc_buffer_stats_t *stats)
+{
+	if (!client || !stats)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	stats->send_buffer_size = client->packet_extra;
+	stats->recv_buffer_size = client->recv_buf_size;
+	stats->send_high_water = client->send_high_water;
+	stats->recv_high_water = client->recv_high_water;
+	stats->allocations = client->buffer_allocations;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_set_write_window(afc_client_t client, uint32_t window)
+{
+	afc_error_t ret;
+
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	if (window > AFC_PIPELINE_MAX_DEPTH)
+		window = AFC_PIPELINE_MAX_DEPTH;
+
+	afc_lock(client);
+	afc_drain_pending_writes(client);
+	client->write_window = window;
+	ret = client->write_error;
+	client->write_error = AFC_E_SUCCESS;
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_set_metadata_cache(afc_client_t client, uint32_t ttl)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	if (ttl && !client->cache) {
+		client->cache = (struct afc_cache_entry**)calloc(AFC_CACHE_BUCKETS, sizeof(struct afc_cache_entry*));
+		if (!client->cache) {
+			afc_unlock(client);
+			return AFC_E_NO_MEM;
+		}
+	}
+	/* entries were stored with the previous TTL */
+	afc_cache_flush(client);
+	if (!ttl) {
+		afc_cache_handles_free(client);
+	}
+	client->cache_ttl = ttl;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
 {
 	uint32_t bytes = 0;
@@ -816,6 +1953,10 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t ha
 
 	afc_lock(client);
 
+	/* nothing is cached while the lock is held, so this also covers the
+	 * data flushed by the close */
+	afc_cache_touch_handle(client, handle, 1);
+
 	debug_info("File handle %i", handle);
 
 	/* Send command */
@@ -830,6 +1971,12 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t ha
 	/* Receive the response */
 	ret = afc_receive_data(client, NULL, &bytes);
 
+	/* report a deferred write error that was not yet picked up */
+	if (ret == AFC_E_SUCCESS) {
+		ret = client->write_error;
+	}
+	client->write_error = AFC_E_SUCCESS;
+
 	afc_unlock(client);
 
 	return ret;
@@ -931,7 +2078,6 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_tell(afc_client_t client, uint64_t han
 		memcpy(position, buffer, sizeof(uint64_t));
 		*position = le64toh(*position);
 	}
-	free(buffer);
 
 	afc_unlock(client);
 
@@ -952,6 +2098,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_truncate(afc_client_t client, uint64_t
 
 	afc_lock(client);
 
+	afc_cache_touch_handle(client, handle, 0);
+
 	/* Send command */
 	struct truncinfo* truncinfo = (struct truncinfo*)(AFC_PACKET_DATA_PTR);
 	truncinfo->handle = handle;
@@ -997,6 +2145,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_truncate(afc_client_t client, const char *p
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
 
 	afc_unlock(client);
 
@@ -1039,6 +2188,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_make_link(afc_client_t client, afc_link_typ
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, linkname);
 
 	afc_unlock(client);
 
@@ -1072,6 +2222,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_set_file_time(afc_client_t client, const ch
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
 
 	afc_unlock(client);
 
@@ -1104,12 +2255,384 @@ LIBIMOBILEDEVICE_API afc_error_t afc_remove_path_and_contents(afc_client_t clien
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+/**
+ * Builds the request for item i of a batch in the packet buffer.
+ *
+ * @return The length of the request data, or 0 if the buffer could not be
+ *     allocated.
+ */
+static uint32_t afc_batch_build(afc_client_t client, uint64_t operation, const char **paths, const char **targets, const uint64_t *mtimes, uint32_t i)
+{
+	size_t path_len = strlen(paths[i]) + 1;
+	size_t target_len = (operation == AFC_OP_RENAME_PATH) ? strlen(targets[i]) + 1 : 0;
+	uint32_t offset = (operation == AFC_OP_SET_FILE_MOD_TIME) ? 8 : 0;
+	uint32_t data_len = offset + (uint32_t)(path_len + target_len);
+
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		return 0;
+	}
+	if (offset) {
+		*(uint64_t*)(AFC_PACKET_DATA_PTR) = htole64(mtimes[i]);
+	}
+	memcpy(AFC_PACKET_DATA_PTR + offset, paths[i], path_len);
+	if (target_len) {
+		memcpy(AFC_PACKET_DATA_PTR + offset + path_len, targets[i], target_len);
+	}
+
+	return data_len;
+}
+
+/**
+ * Runs the same path operation for count items, keeping up to
+ * AFC_PIPELINE_MAX_DEPTH requests in flight. Replies are matched to the
+ * items by their packet number.
+ */
+static afc_error_t afc_batch_run(afc_client_t client, uint64_t operation, const char **paths, const char **targets, const uint64_t *mtimes, uint32_t count, afc_error_t *results)
+{
+	uint64_t packet_nums[AFC_PIPELINE_MAX_DEPTH];
+	uint32_t sent = 0, received = 0;
+	afc_error_t fatal = AFC_E_SUCCESS;
+	afc_error_t first_error = AFC_E_SUCCESS;
+	uint32_t i;
+
+	if (!client || !client->afc_packet || !client->parent || !paths)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; i < count; i++) {
+		if (!paths[i] || (operation == AFC_OP_RENAME_PATH && !targets[i]))
+			return AFC_E_INVALID_ARG;
+	}
+
+	afc_lock(client);
+
+	while (received < sent || sent < count) {
+		while (fatal == AFC_E_SUCCESS && sent < count && sent - received < AFC_PIPELINE_MAX_DEPTH) {
+			uint32_t bytes = 0;
+			uint32_t data_len = afc_batch_build(client, operation, paths, targets, mtimes, sent);
+			if (data_len == 0) {
+				/* nothing sent for this item, see below */
+				packet_nums[sent % AFC_PIPELINE_MAX_DEPTH] = 0;
+				sent++;
+				continue;
+			}
+			if (afc_dispatch_packet(client, operation, data_len, NULL, 0, &bytes) != AFC_E_SUCCESS || bytes == 0) {
+				fatal = AFC_E_NOT_ENOUGH_DATA;
+				break;
+			}
+			packet_nums[sent % AFC_PIPELINE_MAX_DEPTH] = client->afc_packet->packet_num;
+			sent++;
+		}
+		if (received == sent)
+			break;
+
+		afc_error_t res = AFC_E_NO_MEM;
+		uint64_t packet_num = packet_nums[received % AFC_PIPELINE_MAX_DEPTH];
+		if (packet_num) {
+			uint32_t bytes = 0;
+			res = afc_receive_packet(client, packet_num, NULL, &bytes);
+			/* unknown error actually means directory not empty, like in
+			 * afc_remove_path() */
+			if (operation == AFC_OP_REMOVE_PATH && res == AFC_E_UNKNOWN_ERROR)
+				res = AFC_E_DIR_NOT_EMPTY;
+			afc_cache_invalidate(client, paths[received]);
+			if (operation == AFC_OP_RENAME_PATH)
+				afc_cache_invalidate(client, targets[received]);
+		}
+		if (results)
+			results[received] = res;
+		if (res != AFC_E_SUCCESS && first_error == AFC_E_SUCCESS)
+			first_error = res;
+		received++;
+		if (afc_error_is_fatal(res)) {
+			fatal = res;
+			break;
+		}
+	}
+
+	/* the connection is unusable, the remaining items get its error */
+	if (fatal != AFC_E_SUCCESS) {
+		if (first_error == AFC_E_SUCCESS)
+			first_error = fatal;
+		for (i = received; results && i < count; i++) {
+			results[i] = fatal;
+		}
+	}
+
+	afc_unlock(client);
+
+	return first_error;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_remove_paths(afc_client_t client, const char **paths, uint32_t count, afc_error_t *results)
+{
+	return afc_batch_run(client, AFC_OP_REMOVE_PATH, paths, NULL, NULL, count, results);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_remove_paths_and_contents(afc_client_t client, const char **paths, uint32_t count, afc_error_t *results)
+{
+	return afc_batch_run(client, AFC_OP_REMOVE_PATH_AND_CONTENTS, paths, NULL, NULL, count, results);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_rename_paths(afc_client_t client, const char **from, const char **to, uint32_t count, afc_error_t *results)
+{
+	if (!to)
+		return AFC_E_INVALID_ARG;
+	return afc_batch_run(client, AFC_OP_RENAME_PATH, from, to, NULL, count, results);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_make_directories(afc_client_t client, const char **paths, uint32_t count, afc_error_t *results)
+{
+	return afc_batch_run(client, AFC_OP_MAKE_DIR, paths, NULL, NULL, count, results);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_set_file_times(afc_client_t client, const char **paths, const uint64_t *mtimes, uint32_t count, afc_error_t *results)
+{
+	if (!mtimes)
+		return AFC_E_INVALID_ARG;
+	return afc_batch_run(client, AFC_OP_SET_FILE_MOD_TIME, paths, NULL, mtimes, count, results);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_hash(afc_client_t client, const char *path, char **hash, uint32_t *hash_len)
+{
+	char *data = NULL;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !hash || !hash_len || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	*hash = NULL;
+	*hash_len = 0;
+
+	afc_lock(client);
+
+	uint32_t data_len = strlen(path) + 1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
+	/* Send command */
+	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+	ret = afc_dispatch_packet(client, AFC_OP_GET_FILE_HASH, data_len, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive response */
+	ret = afc_receive_data(client, &data, &bytes);
+	if (ret == AFC_E_SUCCESS && data && bytes > 0) {
+		*hash = (char*)malloc(bytes);
+		if (*hash) {
+			memcpy(*hash, data, bytes);
+			*hash_len = bytes;
+		} else {
+			ret = AFC_E_NO_MEM;
+		}
+	}
 
 	afc_unlock(client);
 
 	return ret;
 }
 
+/* Streaming SHA1 used to verify downloads against the device-side hash */
+
+#define AFC_SHA1_LEN 20
+
+struct afc_sha1_ctx {
+#ifdef HAVE_OPENSSL
+	SHA_CTX sha1;
+#else
+	gcry_md_hd_t hd;
+#endif
+};
+
+static int afc_sha1_init(struct afc_sha1_ctx *ctx)
+{
+#ifdef HAVE_OPENSSL
+	return SHA1_Init(&ctx->sha1) ? 0 : -1;
+#else
+	ctx->hd = NULL;
+	gcry_md_open(&ctx->hd, GCRY_MD_SHA1, 0);
+	return (ctx->hd) ? 0 : -1;
+#endif
+}
+
+static void afc_sha1_update(struct afc_sha1_ctx *ctx, const char *data, size_t len)
+{
+#ifdef HAVE_OPENSSL
+	SHA1_Update(&ctx->sha1, data, len);
+#else
+	gcry_md_write(ctx->hd, data, len);
+#endif
+}
+
+static void afc_sha1_final(struct afc_sha1_ctx *ctx, unsigned char *hash_out)
+{
+#ifdef HAVE_OPENSSL
+	SHA1_Final(hash_out, &ctx->sha1);
+#else
+	unsigned char *newhash = gcry_md_read(ctx->hd, GCRY_MD_SHA1);
+	memcpy(hash_out, newhash, AFC_SHA1_LEN);
+	gcry_md_close(ctx->hd);
+	ctx->hd = NULL;
+#endif
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_download_file(afc_client_t client, const char *device_path, const char *local_path, uint32_t flags, afc_progress_cb_t progress_cb, void *user_data)
+{
+	afc_file_info_t *info = NULL;
+	struct afc_sha1_ctx sha1;
+	struct stat st;
+	uint64_t offset = 0;
+	uint64_t remote_size = 0;
+	uint64_t handle = 0;
+	char *buf = NULL;
+	FILE *f = NULL;
+	int verify = (flags & AFC_TRANSFER_VERIFY) ? 1 : 0;
+	afc_error_t err;
+
+	if (!client || !device_path || !local_path)
+		return AFC_E_INVALID_ARG;
+
+	err = afc_get_file_info_typed(client, device_path, &info);
+	if (err != AFC_E_SUCCESS)
+		return err;
+	if (info->type != AFC_FILE_TYPE_REGULAR) {
+		afc_file_info_free(info);
+		return AFC_E_OBJECT_IS_DIR;
+	}
+	remote_size = info->size;
+	afc_file_info_free(info);
+
+	if ((flags & AFC_TRANSFER_RESUME) && stat(local_path, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size <= remote_size) {
+		/* continue behind the data that is already there */
+		offset = st.st_size;
+	}
+
+	buf = (char*)malloc(AFC_TREE_BUFFER_SIZE);
+	if (!buf)
+		return AFC_E_NO_MEM;
+
+	if (verify && afc_sha1_init(&sha1) < 0) {
+		free(buf);
+		return AFC_E_INTERNAL_ERROR;
+	}
+
+	if (offset > 0) {
+		f = fopen(local_path, "r+b");
+		if (f && verify) {
+			/* the partial data has to be part of the hash */
+			uint64_t hashed = 0;
+			while (hashed < offset) {
+				size_t want = (offset - hashed > AFC_TREE_BUFFER_SIZE) ? AFC_TREE_BUFFER_SIZE : (size_t)(offset - hashed);
+				size_t got = fread(buf, 1, want, f);
+				if (got == 0)
+					break;
+				afc_sha1_update(&sha1, buf, got);
+				hashed += got;
+			}
+			if (hashed < offset) {
+				fclose(f);
+				f = NULL;
+			}
+		}
+		if (f && fseeko(f, (off_t)offset, SEEK_SET) != 0) {
+			fclose(f);
+			f = NULL;
+		}
+		if (!f) {
+			debug_info("could not resume %s, starting over", local_path);
+			offset = 0;
+			if (verify) {
+				afc_sha1_final(&sha1, (unsigned char*)buf);
+				afc_sha1_init(&sha1);
+			}
+		} else {
+			debug_info("resuming %s at offset %llu", local_path, (unsigned long long)offset);
+		}
+	}
+	if (!f) {
+		f = fopen(local_path, "wb");
+	}
+	if (!f) {
+		debug_info("could not open %s for writing", local_path);
+		err = AFC_E_IO_ERROR;
+		goto leave;
+	}
+
+	err = afc_file_open(client, device_path, AFC_FOPEN_RDONLY, &handle);
+	if (err != AFC_E_SUCCESS)
+		goto leave;
+
+	if (offset > 0) {
+		err = afc_file_seek(client, handle, (int64_t)offset, SEEK_SET);
+		if (err != AFC_E_SUCCESS)
+			goto leave;
+	}
+
+	if (progress_cb) {
+		progress_cb(device_path, offset, remote_size, user_data);
+	}
+
+	while (offset < remote_size) {
+		uint32_t bytes = 0;
+		err = afc_file_read_pipelined(client, handle, buf, AFC_TREE_BUFFER_SIZE, AFC_TREE_CHUNK_SIZE, AFC_TREE_DEPTH, &bytes);
+		if (err != AFC_E_SUCCESS)
+			break;
+		if (bytes == 0)
+			break;
+		if (fwrite(buf, 1, bytes, f) != bytes) {
+			err = AFC_E_IO_ERROR;
+			break;
+		}
+		if (verify) {
+			afc_sha1_update(&sha1, buf, bytes);
+		}
+		offset += bytes;
+		if (progress_cb) {
+			progress_cb(device_path, offset, remote_size, user_data);
+		}
+	}
+
+	if (err == AFC_E_SUCCESS && offset < remote_size) {
+		err = AFC_E_NOT_ENOUGH_DATA;
+	}
+
+leave:
+	if (handle) {
+		afc_file_close(client, handle);
+	}
+	if (f && fclose(f) != 0 && err == AFC_E_SUCCESS) {
+		err = AFC_E_IO_ERROR;
+	}
+	if (verify) {
+		unsigned char local_hash[AFC_SHA1_LEN];
+		afc_sha1_final(&sha1, local_hash);
+		if (err == AFC_E_SUCCESS) {
+			char *remote_hash = NULL;
+			uint32_t remote_hash_len = 0;
+			err = afc_get_file_hash(client, device_path, &remote_hash, &remote_hash_len);
+			if (err == AFC_E_SUCCESS && (remote_hash_len != AFC_SHA1_LEN || memcmp(remote_hash, local_hash, AFC_SHA1_LEN) != 0)) {
+				debug_info("hash mismatch for %s", device_path);
+				err = AFC_E_HASH_MISMATCH;
+			}
+			free(remote_hash);
+		}
+	}
+	free(buf);
+
+	return err;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_dictionary_free(char **dictionary)
 {
 	int i = 0;
@@ -1124,3 +2647,587 @@ LIBIMOBILEDEVICE_API afc_error_t afc_dictionary_free(char **dictionary)
 
 	return AFC_E_SUCCESS;
 }
+
+static afc_error_t afc_pool_connect(afc_pool_t pool, afc_client_t *client)
+{
+	afc_error_t err = AFC_E_UNKNOWN_ERROR;
+	*client = NULL;
+	service_client_factory_start_service(pool->device, pool->service_name, (void**)client, pool->label, SERVICE_CONSTRUCTOR(afc_client_new), &err);
+	if (err != AFC_E_SUCCESS && *client) {
+		afc_client_free(*client);
+		*client = NULL;
+	}
+	return err;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_new(idevice_t device, const char *service_name, uint32_t size, const char *label, afc_pool_t *pool)
+{
+	uint32_t i;
+	afc_error_t err;
+
+	if (!device || size == 0 || !pool)
+		return AFC_E_INVALID_ARG;
+
+	afc_pool_t pool_loc = (afc_pool_t)calloc(1, sizeof(struct afc_pool_private));
+	if (!pool_loc)
+		return AFC_E_NO_MEM;
+
+	pool_loc->device = device;
+	pool_loc->service_name = strdup((service_name) ? service_name : AFC_SERVICE_NAME);
+	pool_loc->label = (label) ? strdup(label) : NULL;
+	pool_loc->size = size;
+	pool_loc->clients = (afc_client_t*)calloc(size, sizeof(afc_client_t));
+	pool_loc->in_use = (int*)calloc(size, sizeof(int));
+	if (!pool_loc->clients || !pool_loc->in_use) {
+		free(pool_loc->clients);
+		free(pool_loc->in_use);
+		free(pool_loc->service_name);
+		free(pool_loc->label);
+		free(pool_loc);
+		return AFC_E_NO_MEM;
+	}
+	mutex_init(&pool_loc->mutex);
+	cond_init(&pool_loc->cond);
+
+	/* the first connection has to succeed, the others are retried lazily */
+	err = afc_pool_connect(pool_loc, &pool_loc->clients[0]);
+	if (err != AFC_E_SUCCESS) {
+		afc_pool_free(pool_loc);
+		return err;
+	}
+	for (i = 1; i < size; i++) {
+		if (afc_pool_connect(pool_loc, &pool_loc->clients[i]) != AFC_E_SUCCESS) {
+			debug_info("could not establish connection %u of %u, will retry on demand", i+1, size);
+		}
+	}
+
+	*pool = pool_loc;
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_free(afc_pool_t pool)
+{
+	uint32_t i;
+
+	if (!pool)
+		return AFC_E_INVALID_ARG;
+
+	for (i = 0; i < pool->size; i++) {
+		if (pool->clients[i]) {
+			afc_client_free(pool->clients[i]);
+		}
+	}
+	free(pool->clients);
+	free(pool->in_use);
+	free(pool->service_name);
+	free(pool->label);
+	cond_destroy(&pool->cond);
+	mutex_destroy(&pool->mutex);
+	free(pool);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_acquire(afc_pool_t pool, afc_client_t *client)
+{
+	uint32_t i;
+	int slot;
+
+	if (!pool || !client)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&pool->mutex);
+	while (1) {
+		slot = -1;
+		for (i = 0; i < pool->size; i++) {
+			if (!pool->in_use[i]) {
+				slot = (int)i;
+				if (pool->clients[i]) {
+					/* prefer an established connection */
+					break;
+				}
+			}
+		}
+		if (slot >= 0) {
+			break;
+		}
+		metrics_add(&internal_metrics_afc.pool_waiting, 1);
+		cond_wait(&pool->cond, &pool->mutex);
+		metrics_sub(&internal_metrics_afc.pool_waiting, 1);
+	}
+	pool->in_use[slot] = 1;
+	mutex_unlock(&pool->mutex);
+
+	if (!pool->clients[slot]) {
+		/* (re-)establish the connection outside of the lock */
+		afc_error_t err = afc_pool_connect(pool, &pool->clients[slot]);
+		if (err != AFC_E_SUCCESS) {
+			mutex_lock(&pool->mutex);
+			pool->in_use[slot] = 0;
+			cond_signal(&pool->cond);
+			mutex_unlock(&pool->mutex);
+			*client = NULL;
+			return err;
+		}
+	}
+
+	metrics_add(&internal_metrics_afc.pool_acquired, 1);
+	*client = pool->clients[slot];
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_pool_release(afc_pool_t pool, afc_client_t client)
+{
+	uint32_t i;
+	afc_error_t err = AFC_E_INVALID_ARG;
+
+	if (!pool || !client)
+		return AFC_E_INVALID_ARG;
+
+	mutex_lock(&pool->mutex);
+	for (i = 0; i < pool->size; i++) {
+		if (pool->clients[i] == client && pool->in_use[i]) {
+			if (client->broken) {
+				debug_info("dropping broken connection %u", i+1);
+				afc_client_free(client);
+				pool->clients[i] = NULL;
+			}
+			pool->in_use[i] = 0;
+			cond_signal(&pool->cond);
+			err = AFC_E_SUCCESS;
+			break;
+		}
+	}
+	mutex_unlock(&pool->mutex);
+
+	return err;
+}
+
+/* Tree transfer engine used by afc_copy_tree() and afc_put_tree() */
+
+#define AFC_TREE_MAX_CLIENTS 32
+
+struct afc_tree_job {
+	char *device_path;
+	char *local_path;
+	uint64_t size;
+};
+
+struct afc_tree_ctx {
+	struct afc_tree_job *jobs;
+	uint32_t num_jobs;
+	uint32_t capacity;
+	uint32_t next_job;
+	uint64_t bytes_total;
+	uint64_t bytes_done;
+	afc_error_t error;
+	int upload;
+	afc_progress_cb_t progress_cb;
+	void *user_data;
+	mutex_t mutex;
+};
+
+struct afc_tree_worker {
+	struct afc_tree_ctx *ctx;
+	afc_client_t client;
+	THREAD_T thread;
+};
+
+static int afc_tree_mkdir(const char *path)
+{
+#ifdef WIN32
+	return mkdir(path);
+#else
+	return mkdir(path, 0755);
+#endif
+}
+
+static int afc_tree_add_job(struct afc_tree_ctx *ctx, const char *device_path, const char *local_path, uint64_t size)
+{
+	if (ctx->num_jobs >= ctx->capacity) {
+		uint32_t newcap = (ctx->capacity) ? ctx->capacity * 2 : 64;
+		struct afc_tree_job *newjobs = (struct afc_tree_job*)realloc(ctx->jobs, sizeof(struct afc_tree_job) * newcap);
+		if (!newjobs) {
+			return -1;
+		}
+		ctx->jobs = newjobs;
+		ctx->capacity = newcap;
+	}
+	ctx->jobs[ctx->num_jobs].device_path = strdup(device_path);
+	ctx->jobs[ctx->num_jobs].local_path = strdup(local_path);
+	ctx->jobs[ctx->num_jobs].size = size;
+	ctx->num_jobs++;
+	ctx->bytes_total += size;
+	return 0;
+}
+
+static void afc_tree_ctx_free(struct afc_tree_ctx *ctx)
+{
+	uint32_t i;
+	for (i = 0; i < ctx->num_jobs; i++) {
+		free(ctx->jobs[i].device_path);
+		free(ctx->jobs[i].local_path);
+	}
+	free(ctx->jobs);
+	mutex_destroy(&ctx->mutex);
+}
+
+static void afc_tree_set_error(struct afc_tree_ctx *ctx, afc_error_t err)
+{
+	mutex_lock(&ctx->mutex);
+	if (ctx->error == AFC_E_SUCCESS) {
+		ctx->error = err;
+	}
+	mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * Accounts transferred bytes and reports progress. The progress callback is
+ * invoked with the context mutex held so calls are serialized.
+ *
+ * @return 1 if the transfer should continue, 0 if another worker failed.
+ */
+static int afc_tree_progress(struct afc_tree_ctx *ctx, const char *path, uint32_t bytes)
+{
+	int keep_going;
+	mutex_lock(&ctx->mutex);
+	ctx->bytes_done += bytes;
+	if (ctx->progress_cb) {
+		ctx->progress_cb(path, ctx->bytes_done, ctx->bytes_total, ctx->user_data);
+	}
+	keep_going = (ctx->error == AFC_E_SUCCESS);
+	mutex_unlock(&ctx->mutex);
+	return keep_going;
+}
+
+/**
+ * Returns the type and size of a path on the device.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_tree_stat(afc_client_t client, const char *path, int *is_dir, int *is_reg, uint64_t *size)
+{
+	afc_file_info_t *info = NULL;
+	afc_error_t err = afc_get_file_info_typed(client, path, &info);
+	if (err != AFC_E_SUCCESS) {
+		return err;
+	}
+	*is_dir = (info->type == AFC_FILE_TYPE_DIRECTORY);
+	*is_reg = (info->type == AFC_FILE_TYPE_REGULAR);
+	*size = info->size;
+	afc_file_info_free(info);
+	return AFC_E_SUCCESS;
+}
+
+static afc_error_t afc_tree_walk_device(afc_client_t client, struct afc_tree_ctx *ctx, const char *device_path, const char *local_path)
+{
+	char **list = NULL;
+	afc_error_t err;
+	int i;
+
+	if (afc_tree_mkdir(local_path) != 0 && errno != EEXIST) {
+		debug_info("could not create local directory %s", local_path);
+		return AFC_E_IO_ERROR;
+	}
+
+	err = afc_read_directory(client, device_path, &list);
+	if (err != AFC_E_SUCCESS) {
+		return err;
+	}
+
+	for (i = 0; list && list[i] && err == AFC_E_SUCCESS; i++) {
+		int is_dir = 0;
+		int is_reg = 0;
+		uint64_t size = 0;
+		if (!strcmp(list[i], ".") || !strcmp(list[i], "..")) {
+			continue;
+		}
+		char *dpath = string_build_path(device_path, list[i], NULL);
+		char *lpath = string_build_path(local_path, list[i], NULL);
+		if (afc_tree_stat(client, dpath, &is_dir, &is_reg, &size) == AFC_E_SUCCESS) {
+			if (is_dir) {
+				err = afc_tree_walk_device(client, ctx, dpath, lpath);
+			} else if (is_reg) {
+				if (afc_tree_add_job(ctx, dpath, lpath, size) < 0) {
+					err = AFC_E_NO_MEM;
+				}
+			} else {
+				debug_info("skipping %s (not a regular file or directory)", dpath);
+			}
+		}
+		free(dpath);
+		free(lpath);
+	}
+	afc_dictionary_free(list);
+
+	return err;
+}
+
+static afc_error_t afc_tree_walk_local(afc_client_t client, struct afc_tree_ctx *ctx, const char *local_path, const char *device_path)
+{
+	afc_error_t err = afc_make_directory(client, device_path);
+	if (err != AFC_E_SUCCESS && err != AFC_E_OBJECT_EXISTS) {
+		return err;
+	}
+	err = AFC_E_SUCCESS;
+
+	DIR *dir = opendir(local_path);
+	if (!dir) {
+		debug_info("could not open local directory %s", local_path);
+		return AFC_E_IO_ERROR;
+	}
+
+	struct dirent *ep;
+	while (err == AFC_E_SUCCESS && (ep = readdir(dir))) {
+		struct stat st;
+		if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, "..")) {
+			continue;
+		}
+		char *lpath = string_build_path(local_path, ep->d_name, NULL);
+		char *dpath = string_build_path(device_path, ep->d_name, NULL);
+		if (stat(lpath, &st) == 0) {
+			if (S_ISDIR(st.st_mode)) {
+				err = afc_tree_walk_local(client, ctx, lpath, dpath);
+			} else if (S_ISREG(st.st_mode)) {
+				if (afc_tree_add_job(ctx, dpath, lpath, st.st_size) < 0) {
+					err = AFC_E_NO_MEM;
+				}
+			}
+		}
+		free(lpath);
+		free(dpath);
+	}
+	closedir(dir);
+
+	return err;
+}
+
+static afc_error_t afc_tree_download_file(afc_client_t client, struct afc_tree_ctx *ctx, struct afc_tree_job *job, char *buf)
+{
+	uint64_t handle = 0;
+	afc_error_t err = afc_file_open(client, job->device_path, AFC_FOPEN_RDONLY, &handle);
+	if (err != AFC_E_SUCCESS) {
+		return err;
+	}
+
+	FILE *f = fopen(job->local_path, "wb");
+	if (!f) {
+		debug_info("could not open %s for writing", job->local_path);
+		afc_file_close(client, handle);
+		return AFC_E_IO_ERROR;
+	}
+
+	while (1) {
+		uint32_t bytes = 0;
+		err = afc_file_read_pipelined(client, handle, buf, AFC_TREE_BUFFER_SIZE, AFC_TREE_CHUNK_SIZE, AFC_TREE_DEPTH, &bytes);
+		if (err != AFC_E_SUCCESS) {
+			break;
+		}
+		if (bytes > 0 && fwrite(buf, 1, bytes, f) != bytes) {
+			err = AFC_E_IO_ERROR;
+			break;
+		}
+		if (!afc_tree_progress(ctx, job->device_path, bytes) || bytes < AFC_TREE_BUFFER_SIZE) {
+			break;
+		}
+	}
+
+	fclose(f);
+	afc_file_close(client, handle);
+
+	return err;
+}
+
+static afc_error_t afc_tree_upload_file(afc_client_t client, struct afc_tree_ctx *ctx, struct afc_tree_job *job, char *buf)
+{
+	uint64_t handle = 0;
+	afc_error_t err;
+
+	FILE *f = fopen(job->local_path, "rb");
+	if (!f) {
+		debug_info("could not open %s for reading", job->local_path);
+		return AFC_E_IO_ERROR;
+	}
+
+	err = afc_file_open(client, job->device_path, AFC_FOPEN_WRONLY, &handle);
+	if (err != AFC_E_SUCCESS) {
+		fclose(f);
+		return err;
+	}
+
+	uint32_t window = client->write_window;
+	afc_set_write_window(client, AFC_TREE_DEPTH);
+	while (1) {
+		uint32_t written = 0;
+		size_t bytes = fread(buf, 1, AFC_TREE_CHUNK_SIZE, f);
+		if (bytes == 0) {
+			if (ferror(f)) {
+				err = AFC_E_IO_ERROR;
+			}
+			break;
+		}
+		err = afc_file_write(client, handle, buf, (uint32_t)bytes, &written);
+		if (err != AFC_E_SUCCESS) {
+			break;
+		}
+		if (written < bytes) {
+			err = AFC_E_WRITE_ERROR;
+			break;
+		}
+		if (!afc_tree_progress(ctx, job->device_path, written)) {
+			break;
+		}
+	}
+	fclose(f);
+
+	afc_error_t close_err = afc_file_close(client, handle);
+	if (err == AFC_E_SUCCESS) {
+		err = close_err;
+	}
+	afc_set_write_window(client, window);
+
+	return err;
+}
+
+static void* afc_tree_worker_run(void *arg)
+{
+	struct afc_tree_worker *worker = (struct afc_tree_worker*)arg;
+	struct afc_tree_ctx *ctx = worker->ctx;
+	char *buf = (char*)malloc(AFC_TREE_BUFFER_SIZE);
+
+	if (!buf) {
+		afc_tree_set_error(ctx, AFC_E_NO_MEM);
+		return NULL;
+	}
+
+	while (1) {
+		struct afc_tree_job *job = NULL;
+		afc_error_t err;
+
+		mutex_lock(&ctx->mutex);
+		if (ctx->error == AFC_E_SUCCESS && ctx->next_job < ctx->num_jobs) {
+			job = &ctx->jobs[ctx->next_job++];
+		}
+		mutex_unlock(&ctx->mutex);
+		if (!job) {
+			break;
+		}
+
+		if (ctx->upload) {
+			err = afc_tree_upload_file(worker->client, ctx, job, buf);
+		} else {
+			err = afc_tree_download_file(worker->client, ctx, job, buf);
+		}
+		if (err != AFC_E_SUCCESS) {
+			debug_info("transfer of %s failed: %d", job->device_path, err);
+			afc_tree_set_error(ctx, err);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Runs the queued jobs of a tree transfer using one worker per client.
+ */
+static afc_error_t afc_tree_run(struct afc_tree_ctx *ctx, afc_client_t *clients, uint32_t num_clients)
+{
+	struct afc_tree_worker workers[AFC_TREE_MAX_CLIENTS];
+	uint32_t i;
+	uint32_t started = 0;
+
+	if (num_clients > AFC_TREE_MAX_CLIENTS)
+		num_clients = AFC_TREE_MAX_CLIENTS;
+	if (num_clients > ctx->num_jobs)
+		num_clients = (ctx->num_jobs > 0) ? ctx->num_jobs : 1;
+
+	if (num_clients == 1) {
+		workers[0].ctx = ctx;
+		workers[0].client = clients[0];
+		afc_tree_worker_run(&workers[0]);
+		return ctx->error;
+	}
+
+	for (i = 0; i < num_clients; i++) {
+		workers[i].ctx = ctx;
+		workers[i].client = clients[i];
+		if (thread_new(&workers[i].thread, afc_tree_worker_run, &workers[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+	if (started == 0) {
+		/* no threads available, do the work ourselves */
+		afc_tree_worker_run(&workers[0]);
+	}
+	for (i = 0; i < started; i++) {
+		thread_join(workers[i].thread);
+		thread_free(workers[i].thread);
+	}
+
+	return ctx->error;
+}
+
+static afc_error_t afc_tree_transfer(afc_client_t *clients, uint32_t num_clients, const char *src, const char *dst, int upload, afc_progress_cb_t progress_cb, void *user_data)
+{
+	struct afc_tree_ctx ctx;
+	afc_error_t err = AFC_E_SUCCESS;
+	uint32_t i;
+
+	if (!clients || num_clients == 0 || !src || !dst)
+		return AFC_E_INVALID_ARG;
+	for (i = 0; i < num_clients; i++) {
+		if (!clients[i])
+			return AFC_E_INVALID_ARG;
+	}
+
+	memset(&ctx, '\0', sizeof(ctx));
+	ctx.upload = upload;
+	ctx.progress_cb = progress_cb;
+	ctx.user_data = user_data;
+	ctx.error = AFC_E_SUCCESS;
+	mutex_init(&ctx.mutex);
+
+	if (upload) {
+		struct stat st;
+		if (stat(src, &st) != 0) {
+			err = AFC_E_OBJECT_NOT_FOUND;
+		} else if (S_ISDIR(st.st_mode)) {
+			err = afc_tree_walk_local(clients[0], &ctx, src, dst);
+		} else if (afc_tree_add_job(&ctx, dst, src, st.st_size) < 0) {
+			err = AFC_E_NO_MEM;
+		}
+	} else {
+		int is_dir = 0;
+		int is_reg = 0;
+		uint64_t size = 0;
+		err = afc_tree_stat(clients[0], src, &is_dir, &is_reg, &size);
+		if (err == AFC_E_SUCCESS) {
+			if (is_dir) {
+				err = afc_tree_walk_device(clients[0], &ctx, src, dst);
+			} else if (afc_tree_add_job(&ctx, src, dst, size) < 0) {
+				err = AFC_E_NO_MEM;
+			}
+		}
+	}
+
+	if (err == AFC_E_SUCCESS) {
+		debug_info("transferring %u files (%llu bytes) using %u connections", ctx.num_jobs, (unsigned long long)ctx.bytes_total, num_clients);
+		err = afc_tree_run(&ctx, clients, num_clients);
+	}
+
+	afc_tree_ctx_free(&ctx);
+
+	return err;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_copy_tree(afc_client_t *clients, uint32_t num_clients, const char *device_path, const char *local_path, afc_progress_cb_t progress_cb, void *user_data)
+{
+	return afc_tree_transfer(clients, num_clients, device_path, local_path, 0, progress_cb, user_data);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_put_tree(afc_client_t *clients, uint32_t num_clients, const char *local_path, const char *device_path, afc_progress_cb_t progress_cb, void *user_data)
+{
+	return afc_tree_transfer(clients, num_clients, local_path, device_path, 1, progress_cb, user_data);
+}
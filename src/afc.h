@@ -50,12 +50,82 @@ typedef struct {
 	(x)->packet_num    = le64toh((x)->packet_num); \
 	(x)->operation     = le64toh((x)->operation);
 
+/* Upper bound of outstanding requests in pipelined transfers */
+#define AFC_PIPELINE_MAX_DEPTH 64
+/* Default request size used by pipelined transfers */
+#define AFC_PIPELINE_CHUNK_SIZE 0x10000
+/* Chunk size, pipeline depth and buffer size of the bulk file transfer
+ * helpers */
+#define AFC_TREE_CHUNK_SIZE 0x40000
+#define AFC_TREE_DEPTH 8
+#define AFC_TREE_BUFFER_SIZE (AFC_TREE_CHUNK_SIZE * AFC_TREE_DEPTH)
+/* Smallest packet buffer size class */
+#define AFC_BUFFER_MIN_SIZE 0x1000
+/* Buffers larger than this are released after each operation unless a
+ * maximum chunk size has been set */
+#define AFC_BUFFER_RETAIN_SIZE 0x100000
+
+/* Buckets of the metadata cache, see afc_set_metadata_cache() */
+#define AFC_CACHE_BUCKETS 256
+/* The metadata cache is emptied once it holds this many entries */
+#define AFC_CACHE_MAX_ENTRIES 4096
+
+enum afc_cache_kind {
+	AFC_CACHE_FILE_INFO,
+	AFC_CACHE_DIRECTORY
+};
+
+/* A cached GetFileInfo or ReadDir reply, keyed by the normalized path */
+struct afc_cache_entry {
+	enum afc_cache_kind kind;
+	uint32_t hash;
+	char *path;
+	char *data;
+	uint32_t length;
+	uint64_t expires;
+	struct afc_cache_entry *next;
+};
+
+/* A file opened for writing while the metadata cache is enabled */
+struct afc_cache_handle {
+	uint64_t handle;
+	char *path;
+	struct afc_cache_handle *next;
+};
+
 struct afc_client_private {
 	service_client_t parent;
 	AFCPacket *afc_packet;
 	uint32_t packet_extra;
 	mutex_t mutex;
 	int free_parent;
+	uint32_t write_window;
+	uint64_t write_pending[AFC_PIPELINE_MAX_DEPTH];
+	uint32_t write_pending_head;
+	uint32_t write_pending_count;
+	afc_error_t write_error;
+	int broken;
+	char *recv_buf;
+	uint32_t recv_buf_size;
+	uint32_t max_chunk_size;
+	uint32_t send_high_water;
+	uint32_t recv_high_water;
+	uint64_t buffer_allocations;
+	uint32_t cache_ttl;
+	struct afc_cache_entry **cache;
+	uint32_t cache_count;
+	struct afc_cache_handle *cache_handles;
+};
+
+struct afc_pool_private {
+	idevice_t device;
+	char *service_name;
+	char *label;
+	uint32_t size;
+	afc_client_t *clients;
+	int *in_use;
+	mutex_t mutex;
+	cond_t cond;
 };
 
 /* AFC Operations */
@@ -0,0 +1,905 @@
+/*
+ * broker.c
+ * Cross-process connection broker holding warm lockdown sessions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#endif
+
+#include <plist/plist.h>
+
+#include "broker.h"
+#include "lockdown.h"
+#include "property_list_service.h"
+#include "service.h"
+#include "common/debug.h"
+#include "common/socket.h"
+#include "common/thread.h"
+#include "endianness.h"
+
+/* Label used for the sessions the broker keeps */
+#define BROKER_LABEL "idevicebroker"
+
+/* Time a client waits for the broker's reply; covers a full handshake */
+#define BROKER_REPLY_TIMEOUT 30000
+
+/* Time the broker waits for the request of a connected client */
+#define BROKER_REQUEST_TIMEOUT 5000
+
+#define BROKER_POLL_INTERVAL 500
+#define BROKER_MAX_MESSAGE_SIZE (64*1024)
+
+static char *broker_path = NULL;
+static mutex_t broker_mutex;
+static mutex_t broker_serve_mutex;
+static thread_once_t broker_once = THREAD_ONCE_INIT;
+
+static void broker_init(void)
+{
+	const char *env = getenv(BROKER_ENV);
+
+	mutex_init(&broker_mutex);
+	mutex_init(&broker_serve_mutex);
+	if (env && *env) {
+		broker_path = strdup(env);
+	}
+}
+
+#ifndef WIN32
+
+#ifdef MSG_NOSIGNAL
+#define BROKER_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define BROKER_SEND_FLAGS 0
+#endif
+
+/**
+ * Sends a length prefixed binary plist, optionally along with a file
+ * descriptor passed as SCM_RIGHTS.
+ */
+static int broker_send_message(int fd, plist_t message, int pass_fd)
+{
+	char *data = NULL;
+	uint32_t length = 0;
+	char *buffer;
+	uint32_t total;
+	uint32_t sent = 0;
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	int res;
+
+	plist_to_bin(message, &data, &length);
+	if (!data) {
+		return -1;
+	}
+	total = sizeof(uint32_t) + length;
+	buffer = (char*)malloc(total);
+	if (!buffer) {
+		free(data);
+		return -1;
+	}
+	*(uint32_t*)buffer = htobe32(length);
+	memcpy(buffer + sizeof(uint32_t), data, length);
+	free(data);
+
+	iov.iov_base = buffer;
+	iov.iov_len = total;
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (pass_fd >= 0) {
+		struct cmsghdr *cmsg;
+		memset(control, '\0', sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+
+	do {
+		res = sendmsg(fd, &msg, BROKER_SEND_FLAGS);
+	} while (res < 0 && errno == EINTR);
+	if (res > 0) {
+		/* the descriptor went out with the first byte */
+		sent = (uint32_t)res;
+		while (sent < total) {
+			res = socket_send(fd, buffer + sent, total - sent);
+			if (res <= 0) {
+				break;
+			}
+			sent += res;
+		}
+	}
+	free(buffer);
+
+	return (sent == total) ? 0 : -1;
+}
+
+/**
+ * Receives a message sent with broker_send_message(). A passed descriptor
+ * is stored in received_fd, or closed if received_fd is NULL.
+ */
+static int broker_receive_message(int fd, plist_t *message, int *received_fd, unsigned int timeout)
+{
+	uint32_t nlen = 0;
+	uint32_t got = 0;
+	uint32_t length;
+	char *data;
+	int passed_fd = -1;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	int res;
+
+	*message = NULL;
+	if (received_fd) {
+		*received_fd = -1;
+	}
+
+	if (socket_check_fd(fd, FDM_READ, timeout) <= 0) {
+		return -1;
+	}
+
+	iov.iov_base = &nlen;
+	iov.iov_len = sizeof(nlen);
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	do {
+		res = recvmsg(fd, &msg, 0);
+	} while (res < 0 && errno == EINTR);
+	if (res <= 0) {
+		return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && passed_fd < 0) {
+			memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	got = (uint32_t)res;
+	while (got < sizeof(nlen)) {
+		res = socket_receive_timeout(fd, (char*)&nlen + got, sizeof(nlen) - got, 0, timeout);
+		if (res <= 0) {
+			goto fail;
+		}
+		got += res;
+	}
+
+	length = be32toh(nlen);
+	if (length == 0 || length > BROKER_MAX_MESSAGE_SIZE) {
+		goto fail;
+	}
+	data = (char*)malloc(length);
+	if (!data) {
+		goto fail;
+	}
+	got = 0;
+	while (got < length) {
+		res = socket_receive_timeout(fd, data + got, length - got, 0, timeout);
+		if (res <= 0) {
+			free(data);
+			goto fail;
+		}
+		got += res;
+	}
+	plist_from_bin(data, length, message);
+	free(data);
+	if (!*message || plist_get_node_type(*message) != PLIST_DICT) {
+		plist_free(*message);
+		*message = NULL;
+		goto fail;
+	}
+
+	if (received_fd) {
+		*received_fd = passed_fd;
+	} else if (passed_fd >= 0) {
+		close(passed_fd);
+	}
+	return 0;
+
+fail:
+	if (passed_fd >= 0) {
+		close(passed_fd);
+	}
+	return -1;
+}
+
+static char *broker_dict_get_string(plist_t dict, const char *key)
+{
+	char *value = NULL;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &value);
+	}
+	return value;
+}
+
+static uint64_t broker_dict_get_uint(plist_t dict, const char *key)
+{
+	uint64_t value = 0;
+	plist_t node = plist_dict_get_item(dict, key);
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &value);
+	}
+	return value;
+}
+
+/* client side */
+
+/**
+ * Sends a request about the device to its broker and receives the reply
+ * along with the channel it hands over.
+ */
+static int broker_request(idevice_t device, plist_t request, plist_t *reply, int *fd)
+{
+	int res;
+	int sfd = socket_connect_unix(device->broker);
+	if (sfd < 0) {
+		debug_info("could not connect to broker at %s", device->broker);
+		return -1;
+	}
+
+	plist_dict_set_item(request, "UDID", plist_new_string(device->udid));
+	plist_dict_set_item(request, "ConnectionType", plist_new_uint(device->conn_type));
+	res = broker_send_message(sfd, request, -1);
+	if (res == 0) {
+		res = broker_receive_message(sfd, reply, fd, BROKER_REPLY_TIMEOUT);
+	}
+	socket_close(sfd);
+	if (res < 0) {
+		debug_info("no reply from broker at %s", device->broker);
+		return -1;
+	}
+
+	char *result = broker_dict_get_string(*reply, "Result");
+	if (!result || strcmp(result, "Success") != 0 || *fd < 0) {
+		debug_info("broker request failed with error %d", (int)broker_dict_get_uint(*reply, "Error"));
+		if (*fd >= 0) {
+			close(*fd);
+			*fd = -1;
+		}
+		plist_free(*reply);
+		*reply = NULL;
+		res = -1;
+	}
+	free(result);
+
+	return res;
+}
+
+int broker_lockdown_take(idevice_t device, int *fd, char **session_id, int *version)
+{
+	plist_t request;
+	plist_t reply = NULL;
+
+	if (!device || !device->broker) {
+		return -1;
+	}
+
+	request = plist_new_dict();
+	plist_dict_set_item(request, "Request", plist_new_string("Lockdown"));
+	int res = broker_request(device, request, &reply, fd);
+	plist_free(request);
+	if (res < 0) {
+		return -1;
+	}
+
+	*session_id = broker_dict_get_string(reply, "SessionID");
+	*version = (int)broker_dict_get_uint(reply, "DeviceVersion");
+	plist_free(reply);
+
+	return 0;
+}
+
+int broker_start_service(idevice_t device, const char *service_name, uint16_t *port, int *fd)
+{
+	plist_t request;
+	plist_t reply = NULL;
+
+	if (!device || !device->broker || !service_name) {
+		return -1;
+	}
+
+	request = plist_new_dict();
+	plist_dict_set_item(request, "Request", plist_new_string("StartService"));
+	plist_dict_set_item(request, "Service", plist_new_string(service_name));
+	int res = broker_request(device, request, &reply, fd);
+	plist_free(request);
+	if (res < 0) {
+		return -1;
+	}
+
+	*port = (uint16_t)broker_dict_get_uint(reply, "Port");
+	plist_free(reply);
+	if (*port == 0) {
+		close(*fd);
+		*fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* broker side */
+
+struct broker_device {
+	char *udid;
+	enum idevice_connection_type conn_type;
+	idevice_t device;
+	lockdownd_client_t spare;   /* warm session handed to the next client */
+	lockdownd_client_t control; /* session the broker starts services with */
+	int warming;
+	int refs;
+	mutex_t mutex;
+	struct broker_device *next;
+};
+
+static struct broker_device *broker_devices = NULL;
+static mutex_t broker_devices_mutex;
+static thread_once_t broker_devices_once = THREAD_ONCE_INIT;
+
+static THREAD_T broker_thread = THREAD_T_NULL;
+static int broker_listen_fd = -1;
+static char *broker_listen_path = NULL;
+static volatile int broker_shutdown = 0;
+static idevice_subscription_context_t broker_events = NULL;
+
+static void broker_devices_init(void)
+{
+	mutex_init(&broker_devices_mutex);
+}
+
+static lockdownd_error_t broker_session_new(struct broker_device *bdev, lockdownd_client_t *client)
+{
+	lockdownd_error_t err = lockdownd_client_new_with_handshake(bdev->device, client, BROKER_LABEL);
+	if (err == LOCKDOWN_E_SUCCESS) {
+		/* keep it out of the in-process session cache */
+		(*client)->cacheable = 0;
+	}
+	return err;
+}
+
+static void broker_session_free(lockdownd_client_t client)
+{
+	if (client) {
+		client->cacheable = 0;
+		lockdownd_client_free(client);
+	}
+}
+
+static void broker_device_free(struct broker_device *bdev)
+{
+	broker_session_free(bdev->spare);
+	broker_session_free(bdev->control);
+	idevice_free(bdev->device);
+	mutex_destroy(&bdev->mutex);
+	free(bdev->udid);
+	free(bdev);
+}
+
+static void broker_device_put(struct broker_device *bdev)
+{
+	mutex_lock(&broker_devices_mutex);
+	int refs = --bdev->refs;
+	mutex_unlock(&broker_devices_mutex);
+	if (refs == 0) {
+		broker_device_free(bdev);
+	}
+}
+
+/**
+ * Returns the entry of the device with an additional reference, creating
+ * it if needed.
+ */
+static struct broker_device *broker_device_get(const char *udid, enum idevice_connection_type conn_type)
+{
+	struct broker_device *bdev;
+	idevice_t device = NULL;
+
+	mutex_lock(&broker_devices_mutex);
+	for (bdev = broker_devices; bdev; bdev = bdev->next) {
+		if (bdev->conn_type == conn_type && !strcmp(bdev->udid, udid)) {
+			bdev->refs++;
+			mutex_unlock(&broker_devices_mutex);
+			return bdev;
+		}
+	}
+
+	if (idevice_new_with_options(&device, udid, (conn_type == CONNECTION_NETWORK) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		mutex_unlock(&broker_devices_mutex);
+		return NULL;
+	}
+	/* the broker's own sessions must not be brokered */
+	free(device->broker);
+	device->broker = NULL;
+
+	bdev = (struct broker_device*)calloc(1, sizeof(struct broker_device));
+	if (!bdev) {
+		mutex_unlock(&broker_devices_mutex);
+		idevice_free(device);
+		return NULL;
+	}
+	bdev->udid = strdup(udid);
+	bdev->conn_type = conn_type;
+	bdev->device = device;
+	bdev->refs = 2;
+	mutex_init(&bdev->mutex);
+	bdev->next = broker_devices;
+	broker_devices = bdev;
+	mutex_unlock(&broker_devices_mutex);
+
+	return bdev;
+}
+
+static void broker_device_remove(const char *udid, enum idevice_connection_type conn_type)
+{
+	struct broker_device **link;
+	struct broker_device *removed = NULL;
+
+	mutex_lock(&broker_devices_mutex);
+	for (link = &broker_devices; *link; link = &(*link)->next) {
+		if ((*link)->conn_type == conn_type && !strcmp((*link)->udid, udid)) {
+			removed = *link;
+			*link = removed->next;
+			break;
+		}
+	}
+	mutex_unlock(&broker_devices_mutex);
+
+	if (removed) {
+		broker_device_put(removed);
+	}
+}
+
+static void* broker_warm_thread(void *data)
+{
+	struct broker_device *bdev = (struct broker_device*)data;
+	lockdownd_client_t client = NULL;
+
+	broker_session_new(bdev, &client);
+
+	mutex_lock(&bdev->mutex);
+	bdev->warming = 0;
+	if (!bdev->spare) {
+		bdev->spare = client;
+		client = NULL;
+	}
+	mutex_unlock(&bdev->mutex);
+
+	broker_session_free(client);
+	broker_device_put(bdev);
+
+	return NULL;
+}
+
+/**
+ * Creates the spare session of the device in the background unless there
+ * is one already.
+ */
+static void broker_device_warm(struct broker_device *bdev)
+{
+	THREAD_T thread;
+
+	mutex_lock(&bdev->mutex);
+	if (bdev->spare || bdev->warming) {
+		mutex_unlock(&bdev->mutex);
+		return;
+	}
+	bdev->warming = 1;
+	mutex_unlock(&bdev->mutex);
+
+	mutex_lock(&broker_devices_mutex);
+	bdev->refs++;
+	mutex_unlock(&broker_devices_mutex);
+
+	if (thread_new(&thread, broker_warm_thread, bdev) != 0) {
+		mutex_lock(&bdev->mutex);
+		bdev->warming = 0;
+		mutex_unlock(&bdev->mutex);
+		broker_device_put(bdev);
+		return;
+	}
+	thread_detach(thread);
+}
+
+static lockdownd_error_t broker_device_take_session(struct broker_device *bdev, lockdownd_client_t *client)
+{
+	lockdownd_error_t err = LOCKDOWN_E_SUCCESS;
+
+	mutex_lock(&bdev->mutex);
+	*client = bdev->spare;
+	bdev->spare = NULL;
+	mutex_unlock(&bdev->mutex);
+
+	/* the spare may have been idle for a long time */
+	if (*client && lockdownd_query_type(*client, NULL) != LOCKDOWN_E_SUCCESS) {
+		debug_info("spare session of %s is no longer valid", bdev->udid);
+		broker_session_free(*client);
+		*client = NULL;
+	}
+	if (!*client) {
+		err = broker_session_new(bdev, client);
+	}
+	broker_device_warm(bdev);
+
+	return err;
+}
+
+static void broker_send_error(int fd, int error)
+{
+	plist_t reply = plist_new_dict();
+	plist_dict_set_item(reply, "Result", plist_new_string("Failure"));
+	plist_dict_set_item(reply, "Error", plist_new_uint((uint64_t)(int64_t)error));
+	broker_send_message(fd, reply, -1);
+	plist_free(reply);
+}
+
+/**
+ * Hands over a plaintext channel to the given connection and relays it
+ * until either side closes.
+ */
+static void broker_relay(int fd, plist_t reply, idevice_connection_t connection)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		debug_info("socketpair failed: %s", strerror(errno));
+		broker_send_error(fd, LOCKDOWN_E_UNKNOWN_ERROR);
+		return;
+	}
+	int res = broker_send_message(fd, reply, sv[1]);
+	close(sv[1]);
+	if (res == 0) {
+		idevice_connection_relay(connection, sv[0]);
+	}
+	close(sv[0]);
+}
+
+static void broker_handle_lockdown(int fd, struct broker_device *bdev)
+{
+	lockdownd_client_t client = NULL;
+	lockdownd_error_t err = broker_device_take_session(bdev, &client);
+	if (err != LOCKDOWN_E_SUCCESS) {
+		broker_send_error(fd, err);
+		return;
+	}
+
+	plist_t reply = plist_new_dict();
+	plist_dict_set_item(reply, "Result", plist_new_string("Success"));
+	if (client->session_id) {
+		plist_dict_set_item(reply, "SessionID", plist_new_string(client->session_id));
+	}
+	plist_dict_set_item(reply, "DeviceVersion", plist_new_uint(bdev->device->version));
+
+	/* SSL state cannot be handed to another process, so the session is
+	 * relayed in plaintext for as long as the client keeps it open */
+	broker_relay(fd, reply, client->parent->parent->connection);
+	plist_free(reply);
+
+	/* the client may have left a request unanswered, so the session is
+	 * not reused */
+	broker_session_free(client);
+}
+
+static int broker_is_connection_error(lockdownd_error_t err)
+{
+	switch (err) {
+	case LOCKDOWN_E_MUX_ERROR:
+	case LOCKDOWN_E_SSL_ERROR:
+	case LOCKDOWN_E_RECEIVE_TIMEOUT:
+	case LOCKDOWN_E_PLIST_ERROR:
+	case LOCKDOWN_E_NO_RUNNING_SESSION:
+	case LOCKDOWN_E_SESSION_INACTIVE:
+	case LOCKDOWN_E_INVALID_SESSION_ID:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void broker_handle_start_service(int fd, struct broker_device *bdev, const char *service_name)
+{
+	lockdownd_service_descriptor_t service = NULL;
+	lockdownd_error_t err = LOCKDOWN_E_UNKNOWN_ERROR;
+	idevice_connection_t connection = NULL;
+	int attempt;
+
+	mutex_lock(&bdev->mutex);
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (!bdev->control) {
+			err = broker_session_new(bdev, &bdev->control);
+			if (err != LOCKDOWN_E_SUCCESS) {
+				bdev->control = NULL;
+				break;
+			}
+		}
+		err = lockdownd_start_service(bdev->control, service_name, &service);
+		if (!broker_is_connection_error(err)) {
+			break;
+		}
+		/* the session went away, e.g. because the device was asleep */
+		broker_session_free(bdev->control);
+		bdev->control = NULL;
+	}
+	mutex_unlock(&bdev->mutex);
+
+	if (err != LOCKDOWN_E_SUCCESS || !service || service->port == 0) {
+		broker_send_error(fd, (err != LOCKDOWN_E_SUCCESS) ? err : LOCKDOWN_E_UNKNOWN_ERROR);
+		lockdownd_service_descriptor_free(service);
+		return;
+	}
+
+	if (idevice_connect(bdev->device, service->port, &connection) != IDEVICE_E_SUCCESS) {
+		broker_send_error(fd, LOCKDOWN_E_MUX_ERROR);
+		lockdownd_service_descriptor_free(service);
+		return;
+	}
+	if (service->ssl_enabled) {
+		if (idevice_connection_enable_ssl(connection) != IDEVICE_E_SUCCESS) {
+			broker_send_error(fd, LOCKDOWN_E_SSL_ERROR);
+			idevice_disconnect(connection);
+			lockdownd_service_descriptor_free(service);
+			return;
+		}
+		service_apply_plaintext_policy(connection, service_name);
+	}
+
+	plist_t reply = plist_new_dict();
+	plist_dict_set_item(reply, "Result", plist_new_string("Success"));
+	plist_dict_set_item(reply, "Port", plist_new_uint(service->port));
+	if (connection->ssl_data) {
+		broker_relay(fd, reply, connection);
+	} else {
+		/* no SSL, so the connection itself can be passed on */
+		broker_send_message(fd, reply, (int)(long)connection->data);
+	}
+	plist_free(reply);
+	idevice_disconnect(connection);
+	lockdownd_service_descriptor_free(service);
+}
+
+static void* broker_client_thread(void *data)
+{
+	int fd = (int)(long)data;
+	plist_t request = NULL;
+
+	if (broker_receive_message(fd, &request, NULL, BROKER_REQUEST_TIMEOUT) == 0) {
+		char *type = broker_dict_get_string(request, "Request");
+		char *udid = broker_dict_get_string(request, "UDID");
+		char *service = broker_dict_get_string(request, "Service");
+		enum idevice_connection_type conn_type = (enum idevice_connection_type)broker_dict_get_uint(request, "ConnectionType");
+		struct broker_device *bdev = NULL;
+
+		if (type && udid) {
+			bdev = broker_device_get(udid, (conn_type == CONNECTION_NETWORK) ? CONNECTION_NETWORK : CONNECTION_USBMUXD);
+		}
+		if (!bdev) {
+			broker_send_error(fd, (type && udid) ? LOCKDOWN_E_MUX_ERROR : LOCKDOWN_E_INVALID_ARG);
+		} else if (!strcmp(type, "Lockdown")) {
+			broker_handle_lockdown(fd, bdev);
+		} else if (!strcmp(type, "StartService") && service) {
+			broker_handle_start_service(fd, bdev, service);
+		} else {
+			broker_send_error(fd, LOCKDOWN_E_INVALID_ARG);
+		}
+		if (bdev) {
+			broker_device_put(bdev);
+		}
+		free(type);
+		free(udid);
+		free(service);
+		plist_free(request);
+	}
+	socket_close(fd);
+
+	return NULL;
+}
+
+static void broker_event_cb(const idevice_event_t *event, void *user_data)
+{
+	struct broker_device *bdev;
+
+	switch (event->event) {
+	case IDEVICE_DEVICE_ADD:
+	case IDEVICE_DEVICE_PAIRED:
+		/* have a session ready before the first client asks */
+		bdev = broker_device_get(event->udid, event->conn_type);
+		if (bdev) {
+			broker_device_warm(bdev);
+			broker_device_put(bdev);
+		}
+		break;
+	case IDEVICE_DEVICE_REMOVE:
+		broker_device_remove(event->udid, event->conn_type);
+		break;
+	default:
+		break;
+	}
+}
+
+static void* broker_thread_func(void *data)
+{
+	int listen_fd = (int)(long)data;
+
+	while (!broker_shutdown) {
+		if (socket_check_fd(listen_fd, FDM_READ, BROKER_POLL_INTERVAL) <= 0) {
+			continue;
+		}
+		int fd = socket_accept(listen_fd, 0);
+		if (fd < 0) {
+			continue;
+		}
+		/* relayed channels stay open as long as the client uses them */
+		THREAD_T thread;
+		if (thread_new(&thread, broker_client_thread, (void*)(long)fd) != 0) {
+			socket_close(fd);
+			continue;
+		}
+		thread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static void broker_stop(void)
+{
+	struct broker_device *devices;
+
+	if (broker_thread == THREAD_T_NULL) {
+		return;
+	}
+	if (broker_events) {
+		idevice_events_unsubscribe(broker_events);
+		broker_events = NULL;
+	}
+	broker_shutdown = 1;
+	thread_join(broker_thread);
+	thread_free(broker_thread);
+	broker_thread = THREAD_T_NULL;
+	socket_close(broker_listen_fd);
+	broker_listen_fd = -1;
+	unlink(broker_listen_path);
+	free(broker_listen_path);
+	broker_listen_path = NULL;
+
+	/* channels that are still relayed hold their own references */
+	mutex_lock(&broker_devices_mutex);
+	devices = broker_devices;
+	broker_devices = NULL;
+	mutex_unlock(&broker_devices_mutex);
+	while (devices) {
+		struct broker_device *next = devices->next;
+		broker_device_put(devices);
+		devices = next;
+	}
+}
+
+static int broker_serve(const char *path)
+{
+	thread_once(&broker_devices_once, broker_devices_init);
+	broker_stop();
+	if (!path) {
+		return 0;
+	}
+
+	/* whoever can connect gets sessions with this host's pairing, so the
+	 * socket must never be accessible to others, not even until chmod() */
+	mode_t old_mask = umask(S_IRWXG | S_IRWXO);
+	int fd = socket_create_unix(path);
+	umask(old_mask);
+	if (fd < 0) {
+		return -1;
+	}
+	if (chmod(path, S_IRUSR | S_IWUSR) < 0) {
+		debug_info("could not restrict permissions of %s: %s", path, strerror(errno));
+		socket_close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	broker_shutdown = 0;
+	if (thread_new(&broker_thread, broker_thread_func, (void*)(long)fd) != 0) {
+		broker_thread = THREAD_T_NULL;
+		socket_close(fd);
+		unlink(path);
+		return -1;
+	}
+	broker_listen_fd = fd;
+	broker_listen_path = strdup(path);
+	if (idevice_events_subscribe(&broker_events, broker_event_cb, NULL) != IDEVICE_E_SUCCESS) {
+		debug_info("could not subscribe to device events, sessions are created on demand");
+		broker_events = NULL;
+	}
+
+	return 0;
+}
+
+#else
+
+int broker_lockdown_take(idevice_t device, int *fd, char **session_id, int *version)
+{
+	return -1;
+}
+
+int broker_start_service(idevice_t device, const char *service_name, uint16_t *port, int *fd)
+{
+	return -1;
+}
+
+#endif
+
+char *broker_get_path(void)
+{
+	char *path = NULL;
+
+	thread_once(&broker_once, broker_init);
+#ifndef WIN32
+	mutex_lock(&broker_mutex);
+	if (broker_path) {
+		path = strdup(broker_path);
+	}
+	mutex_unlock(&broker_mutex);
+#endif
+
+	return path;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_broker(const char *path)
+{
+#ifdef WIN32
+	return (path) ? IDEVICE_E_UNKNOWN_ERROR : IDEVICE_E_SUCCESS;
+#else
+	thread_once(&broker_once, broker_init);
+	mutex_lock(&broker_mutex);
+	free(broker_path);
+	broker_path = (path && *path) ? strdup(path) : NULL;
+	mutex_unlock(&broker_mutex);
+
+	return IDEVICE_E_SUCCESS;
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_broker_serve(const char *path)
+{
+#ifdef WIN32
+	return (path) ? IDEVICE_E_UNKNOWN_ERROR : IDEVICE_E_SUCCESS;
+#else
+	thread_once(&broker_once, broker_init);
+	mutex_lock(&broker_serve_mutex);
+	int res = broker_serve(path);
+	mutex_unlock(&broker_serve_mutex);
+
+	return (res == 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
+#endif
+}
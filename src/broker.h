@@ -0,0 +1,46 @@
+/*
+ * broker.h
+ * Cross-process connection broker -- header file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __BROKER_H
+#define __BROKER_H
+
+#include <stdint.h>
+
+#include "idevice.h"
+
+/* Environment variable holding the default broker socket path */
+#define BROKER_ENV "LIBIMOBILEDEVICE_BROKER"
+
+/* Returns a copy of the broker socket path new devices use, or NULL */
+char *broker_get_path(void);
+
+/* Obtains a warm lockdown session of the device from its broker. fd is a
+ * plaintext channel to lockdownd inside the session, session_id its id and
+ * version the device version as in struct idevice_private.
+ * Returns 0 on success or -1 if the broker could not be reached or failed,
+ * in which case callers connect directly. */
+int broker_lockdown_take(idevice_t device, int *fd, char **session_id, int *version);
+
+/* Starts a service through the broker. fd is a plaintext channel to the
+ * service, which was started on the given port. SSL, if the service
+ * requires it, is terminated by the broker.
+ * Returns like broker_lockdown_take(). */
+int broker_start_service(idevice_t device, const char *service_name, uint16_t *port, int *fd);
+
+#endif
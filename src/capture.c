@@ -0,0 +1,564 @@
+/*
+ * capture.c
+ * Recording of device connections to capture files and replay of them
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#include "capture.h"
+#include "common/debug.h"
+#include "common/socket.h"
+#include "common/thread.h"
+#include "endianness.h"
+
+/* A capture file starts with this magic, followed by frames consisting of
+ * a header and length bytes of payload:
+ *   uint8  type
+ *   uint8  reserved[3]
+ *   uint32 connection id
+ *   uint64 time in microseconds since the capture was started
+ *   uint32 length
+ * All integers are big endian. The payload is what the connection
+ * functions exchanged, i.e. after SSL was terminated. */
+#define CAPTURE_MAGIC "LIMDCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_FRAME_HEADER_SIZE 20
+
+#ifdef MSG_NOSIGNAL
+#define REPLAY_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define REPLAY_SEND_FLAGS 0
+#endif
+
+int capture_enabled = 0;
+static FILE *capture_file = NULL;
+static uint64_t capture_start = 0;
+static uint32_t capture_next_id = 0;
+static mutex_t capture_mutex;
+
+struct replay_frame {
+	enum capture_frame_type type;
+	uint64_t time;
+	const char *data;
+	uint32_t length;
+};
+
+struct replay_connection {
+	uint32_t id;
+	uint16_t port;
+	char *udid;
+	uint64_t time;
+	int used;
+	struct replay_frame *frames;
+	uint32_t num_frames;
+	uint32_t capacity;
+};
+
+struct replay_session {
+	char *buffer;
+	struct replay_connection *connections;
+	uint32_t num_connections;
+	idevice_replay_speed_t speed;
+	int refcount;
+};
+
+/* Argument of a thread serving one recorded connection */
+struct replay_feeder {
+	struct replay_session *session;
+	struct replay_connection *connection;
+	int fd;
+};
+
+static struct replay_session *replay_session = NULL;
+static mutex_t replay_mutex;
+static thread_once_t capture_once = THREAD_ONCE_INIT;
+
+static uint64_t capture_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int capture_open(const char *filename)
+{
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		debug_info("ERROR: Could not open capture file %s: %s", filename, strerror(errno));
+		return -1;
+	}
+	if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, f) != CAPTURE_MAGIC_SIZE) {
+		fclose(f);
+		return -1;
+	}
+
+	mutex_lock(&capture_mutex);
+	if (capture_file) {
+		fclose(capture_file);
+	}
+	capture_file = f;
+	capture_start = capture_time_us();
+	capture_enabled = 1;
+	mutex_unlock(&capture_mutex);
+
+	return 0;
+}
+
+static struct replay_session *replay_load(const char *filename, idevice_replay_speed_t speed);
+
+static void capture_init(void)
+{
+	const char *env;
+
+	mutex_init(&capture_mutex);
+	mutex_init(&replay_mutex);
+
+	env = getenv(CAPTURE_ENV);
+	if (env && *env) {
+		capture_open(env);
+	}
+	env = getenv(REPLAY_ENV);
+	if (env && *env) {
+		const char *speed = getenv(REPLAY_SPEED_ENV);
+		replay_session = replay_load(env, (speed && !strcmp(speed, "max")) ? IDEVICE_REPLAY_MAX_SPEED : IDEVICE_REPLAY_RECORDED_SPEED);
+	}
+}
+
+void capture_setup(void)
+{
+	thread_once(&capture_once, capture_init);
+}
+
+/* Writes a frame header; the caller holds capture_mutex and writes the
+ * payload right after */
+static void capture_write_header(enum capture_frame_type type, uint32_t id, uint32_t length)
+{
+	unsigned char header[CAPTURE_FRAME_HEADER_SIZE];
+	uint32_t v32;
+	uint64_t v64;
+
+	memset(header, '\0', sizeof(header));
+	header[0] = (unsigned char)type;
+	v32 = htobe32(id);
+	memcpy(header + 4, &v32, sizeof(v32));
+	v64 = htobe64(capture_time_us() - capture_start);
+	memcpy(header + 8, &v64, sizeof(v64));
+	v32 = htobe32(length);
+	memcpy(header + 16, &v32, sizeof(v32));
+	fwrite(header, 1, sizeof(header), capture_file);
+}
+
+uint32_t capture_connect(idevice_t device, uint16_t port)
+{
+	uint32_t id = 0;
+	uint16_t be_port = htobe16(port);
+	size_t udid_len = (device->udid) ? strlen(device->udid) : 0;
+
+	mutex_lock(&capture_mutex);
+	if (capture_file) {
+		id = ++capture_next_id;
+		capture_write_header(CAPTURE_FRAME_CONNECT, id, (uint32_t)(sizeof(be_port) + udid_len));
+		fwrite(&be_port, 1, sizeof(be_port), capture_file);
+		if (udid_len > 0) {
+			fwrite(device->udid, 1, udid_len, capture_file);
+		}
+	}
+	mutex_unlock(&capture_mutex);
+
+	return id;
+}
+
+void capture_frame(uint32_t id, enum capture_frame_type type, const char *data, uint32_t length)
+{
+	mutex_lock(&capture_mutex);
+	/* connections outlive the capture they were recorded in */
+	if (capture_file) {
+		capture_write_header(type, id, length);
+		if (length > 0) {
+			fwrite(data, 1, length, capture_file);
+		}
+	}
+	mutex_unlock(&capture_mutex);
+}
+
+void capture_framev(uint32_t id, enum capture_frame_type type, const struct socket_iovec *iov, int iovcnt, uint32_t length)
+{
+	int i;
+	uint32_t left = length;
+
+	mutex_lock(&capture_mutex);
+	if (capture_file) {
+		capture_write_header(type, id, length);
+		for (i = 0; i < iovcnt && left > 0; i++) {
+			uint32_t n = (iov[i].length > left) ? left : (uint32_t)iov[i].length;
+			fwrite(iov[i].data, 1, n, capture_file);
+			left -= n;
+		}
+	}
+	mutex_unlock(&capture_mutex);
+}
+
+static void replay_session_free(struct replay_session *session)
+{
+	uint32_t i;
+
+	for (i = 0; i < session->num_connections; i++) {
+		free(session->connections[i].udid);
+		free(session->connections[i].frames);
+	}
+	free(session->connections);
+	free(session->buffer);
+	free(session);
+}
+
+static struct replay_connection *replay_find_connection(struct replay_session *session, uint32_t id)
+{
+	uint32_t i;
+
+	/* frames usually belong to one of the most recent connections */
+	for (i = session->num_connections; i > 0; i--) {
+		if (session->connections[i-1].id == id) {
+			return &session->connections[i-1];
+		}
+	}
+	return NULL;
+}
+
+static struct replay_session *replay_load(const char *filename, idevice_replay_speed_t speed)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		debug_info("ERROR: Could not open capture file %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (size < CAPTURE_MAGIC_SIZE) {
+		fclose(f);
+		return NULL;
+	}
+	char *buffer = (char*)malloc(size);
+	if (!buffer || fread(buffer, 1, size, f) != (size_t)size || memcmp(buffer, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+		debug_info("ERROR: %s is not a capture file", filename);
+		free(buffer);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+
+	struct replay_session *session = (struct replay_session*)calloc(1, sizeof(struct replay_session));
+	session->buffer = buffer;
+	session->speed = speed;
+	session->refcount = 1;
+
+	uint32_t capacity = 0;
+	long pos = CAPTURE_MAGIC_SIZE;
+	while (pos + CAPTURE_FRAME_HEADER_SIZE <= size) {
+		const unsigned char *header = (const unsigned char*)buffer + pos;
+		uint32_t id;
+		uint64_t time;
+		uint32_t length;
+		memcpy(&id, header + 4, sizeof(id));
+		memcpy(&time, header + 8, sizeof(time));
+		memcpy(&length, header + 16, sizeof(length));
+		id = be32toh(id);
+		time = be64toh(time);
+		length = be32toh(length);
+		pos += CAPTURE_FRAME_HEADER_SIZE;
+		if ((long)length > size - pos) {
+			debug_info("WARNING: capture file %s is truncated", filename);
+			break;
+		}
+
+		const char *data = buffer + pos;
+		pos += length;
+		if (header[0] == CAPTURE_FRAME_CONNECT) {
+			uint16_t port;
+			if (length < sizeof(port)) {
+				continue;
+			}
+			if (session->num_connections == capacity) {
+				capacity = (capacity) ? capacity * 2 : 16;
+				session->connections = (struct replay_connection*)realloc(session->connections, capacity * sizeof(struct replay_connection));
+			}
+			struct replay_connection *connection = &session->connections[session->num_connections++];
+			memset(connection, '\0', sizeof(struct replay_connection));
+			memcpy(&port, data, sizeof(port));
+			connection->id = id;
+			connection->port = be16toh(port);
+			connection->udid = (char*)malloc(length - sizeof(port) + 1);
+			memcpy(connection->udid, data + sizeof(port), length - sizeof(port));
+			connection->udid[length - sizeof(port)] = '\0';
+			connection->time = time;
+		} else if (header[0] == CAPTURE_FRAME_SEND || header[0] == CAPTURE_FRAME_RECEIVE) {
+			/* frames of connections made before the capture started are skipped */
+			struct replay_connection *connection = replay_find_connection(session, id);
+			if (!connection || length == 0) {
+				continue;
+			}
+			if (connection->num_frames == connection->capacity) {
+				connection->capacity = (connection->capacity) ? connection->capacity * 2 : 64;
+				connection->frames = (struct replay_frame*)realloc(connection->frames, connection->capacity * sizeof(struct replay_frame));
+			}
+			struct replay_frame *frame = &connection->frames[connection->num_frames++];
+			frame->type = (enum capture_frame_type)header[0];
+			frame->time = time;
+			frame->data = data;
+			frame->length = length;
+		}
+	}
+
+	debug_info("loaded %u recorded connections from %s", session->num_connections, filename);
+	return session;
+}
+
+struct replay_session *replay_get_session(void)
+{
+	struct replay_session *session;
+
+	capture_setup();
+	mutex_lock(&replay_mutex);
+	session = replay_session;
+	if (session) {
+		session->refcount++;
+	}
+	mutex_unlock(&replay_mutex);
+
+	return session;
+}
+
+void replay_release_session(struct replay_session *session)
+{
+	int refcount;
+
+	if (!session) {
+		return;
+	}
+	mutex_lock(&replay_mutex);
+	refcount = --session->refcount;
+	mutex_unlock(&replay_mutex);
+	if (refcount == 0) {
+		replay_session_free(session);
+	}
+}
+
+const char *replay_find_device(struct replay_session *session, const char *udid)
+{
+	uint32_t i;
+
+	for (i = 0; i < session->num_connections; i++) {
+		if (!udid || !strcmp(session->connections[i].udid, udid)) {
+			return session->connections[i].udid;
+		}
+	}
+	return NULL;
+}
+
+#ifndef WIN32
+static void replay_sleep_us(uint64_t us)
+{
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/**
+ * Plays the device side of a recorded connection: payload the host sent is
+ * read and discarded, payload it received is written once the host sent
+ * everything that preceded it, at the recorded time if requested.
+ */
+static void *replay_feeder_thread(void *arg)
+{
+	struct replay_feeder *feeder = (struct replay_feeder*)arg;
+	struct replay_connection *connection = feeder->connection;
+	uint64_t start = capture_time_us();
+	char discard[16384];
+	uint32_t i;
+
+	for (i = 0; i < connection->num_frames; i++) {
+		struct replay_frame *frame = &connection->frames[i];
+		uint32_t done = 0;
+		if (frame->type == CAPTURE_FRAME_RECEIVE) {
+			if (feeder->session->speed == IDEVICE_REPLAY_RECORDED_SPEED) {
+				uint64_t due = start + (frame->time - connection->time);
+				uint64_t now = capture_time_us();
+				if (due > now) {
+					replay_sleep_us(due - now);
+				}
+			}
+			while (done < frame->length) {
+				ssize_t n = send(feeder->fd, frame->data + done, frame->length - done, REPLAY_SEND_FLAGS);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					break;
+				}
+				done += n;
+			}
+		} else {
+			while (done < frame->length) {
+				uint32_t len = frame->length - done;
+				ssize_t n = recv(feeder->fd, discard, (len > sizeof(discard)) ? sizeof(discard) : len, 0);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					break;
+				}
+				done += n;
+			}
+		}
+		if (done < frame->length) {
+			debug_info("host closed replayed connection %u to port %d early", connection->id, connection->port);
+			break;
+		}
+	}
+
+	/* the recorded session is over, the device side goes away */
+	socket_close(feeder->fd);
+	replay_release_session(feeder->session);
+	free(feeder);
+
+	return NULL;
+}
+#endif
+
+int replay_connect(struct replay_session *session, const char *udid, uint16_t port)
+{
+#ifdef WIN32
+	return -1;
+#else
+	struct replay_connection *connection = NULL;
+	uint32_t i;
+	int fds[2];
+	THREAD_T thread;
+
+	mutex_lock(&replay_mutex);
+	for (i = 0; i < session->num_connections; i++) {
+		if (!session->connections[i].used && session->connections[i].port == port && !strcmp(session->connections[i].udid, udid)) {
+			connection = &session->connections[i];
+			connection->used = 1;
+			break;
+		}
+	}
+	if (connection) {
+		session->refcount++;
+	}
+	mutex_unlock(&replay_mutex);
+
+	if (!connection) {
+		debug_info("no recorded connection to port %d left", port);
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		debug_info("ERROR: socketpair failed: %s", strerror(errno));
+		replay_release_session(session);
+		return -1;
+	}
+
+	struct replay_feeder *feeder = (struct replay_feeder*)malloc(sizeof(struct replay_feeder));
+	feeder->session = session;
+	feeder->connection = connection;
+	feeder->fd = fds[1];
+	if (thread_new(&thread, replay_feeder_thread, feeder) != 0) {
+		socket_close(fds[0]);
+		socket_close(fds[1]);
+		free(feeder);
+		replay_release_session(session);
+		return -1;
+	}
+	thread_detach(thread);
+
+	return fds[0];
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_capture_start(const char *filename)
+{
+	if (!filename) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	capture_setup();
+	return (capture_open(filename) == 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_capture_stop(void)
+{
+	capture_setup();
+	mutex_lock(&capture_mutex);
+	capture_enabled = 0;
+	if (capture_file) {
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+	mutex_unlock(&capture_mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_replay_start(const char *filename, idevice_replay_speed_t speed)
+{
+#ifdef WIN32
+	return IDEVICE_E_UNKNOWN_ERROR;
+#else
+	if (!filename || speed < IDEVICE_REPLAY_RECORDED_SPEED || speed > IDEVICE_REPLAY_MAX_SPEED) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	capture_setup();
+	struct replay_session *session = replay_load(filename, speed);
+	if (!session) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	mutex_lock(&replay_mutex);
+	struct replay_session *previous = replay_session;
+	replay_session = session;
+	mutex_unlock(&replay_mutex);
+	replay_release_session(previous);
+
+	return IDEVICE_E_SUCCESS;
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_replay_stop(void)
+{
+	capture_setup();
+	mutex_lock(&replay_mutex);
+	struct replay_session *previous = replay_session;
+	replay_session = NULL;
+	mutex_unlock(&replay_mutex);
+	replay_release_session(previous);
+
+	return IDEVICE_E_SUCCESS;
+}
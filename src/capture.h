@@ -0,0 +1,67 @@
+/*
+ * capture.h
+ * Recording and replay of device connections -- header file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdint.h>
+
+#include "idevice.h"
+
+/* Environment variables selecting a capture or replay file at startup */
+#define CAPTURE_ENV "LIBIMOBILEDEVICE_CAPTURE"
+#define REPLAY_ENV "LIBIMOBILEDEVICE_REPLAY"
+/* "max" serves replayed sessions at maximum speed */
+#define REPLAY_SPEED_ENV "LIBIMOBILEDEVICE_REPLAY_SPEED"
+
+/* frame types of capture files */
+enum capture_frame_type {
+	CAPTURE_FRAME_CONNECT = 1, /* port (16 bit) followed by the udid */
+	CAPTURE_FRAME_SEND,        /* payload sent to the device */
+	CAPTURE_FRAME_RECEIVE,     /* payload received from the device */
+	CAPTURE_FRAME_CLOSE        /* connection closed by the host */
+};
+
+/* checked inline so connections are not slowed down while not capturing */
+extern int capture_enabled;
+
+/* Applies the environment variables; called when devices are created */
+void capture_setup(void);
+
+/* Records a new connection to port and returns its id, or 0 */
+uint32_t capture_connect(idevice_t device, uint16_t port);
+void capture_frame(uint32_t id, enum capture_frame_type type, const char *data, uint32_t length);
+void capture_framev(uint32_t id, enum capture_frame_type type, const struct socket_iovec *iov, int iovcnt, uint32_t length);
+
+struct replay_session;
+
+/* Returns the active replay session with a reference held for the caller,
+ * or NULL if devices are not replayed */
+struct replay_session *replay_get_session(void);
+void replay_release_session(struct replay_session *session);
+
+/* Returns the recorded udid matching udid, or the first recorded one if
+ * udid is NULL; NULL if the capture has no connections to the device */
+const char *replay_find_device(struct replay_session *session, const char *udid);
+
+/* Serves the next unused recorded connection of the device to port over a
+ * socket. Returns the host side of the socket, or -1. */
+int replay_connect(struct replay_session *session, const char *udid, uint16_t port);
+
+#endif
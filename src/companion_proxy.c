@@ -311,12 +311,8 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_get_value_from_regi
 	return res;
 }
 
-LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_start_forwarding_service_port(companion_proxy_client_t client, uint16_t remote_port, const char* service_name, uint16_t* forward_port, plist_t options)
+static plist_t companion_proxy_forwarding_request(uint16_t remote_port, const char* service_name, plist_t options)
 {
-	if (!client) {
-		return COMPANION_PROXY_E_INVALID_ARG;
-	}
-
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "Command", plist_new_string("StartForwardingServicePort"));
 	plist_dict_set_item(dict, "GizmoRemotePortNumber", plist_new_uint(remote_port));
@@ -328,15 +324,13 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_start_forwarding_se
 	if (options) {
 		plist_dict_merge(dict, options);
 	}
+	return dict;
+}
 
-	companion_proxy_error_t res = companion_proxy_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-	if (res != COMPANION_PROXY_E_SUCCESS) {
-		return res;
-	}
-
-	res = companion_proxy_receive(client, &dict);
+static companion_proxy_error_t companion_proxy_forwarding_reply(companion_proxy_client_t client, uint16_t* forward_port)
+{
+	plist_t dict = NULL;
+	companion_proxy_error_t res = companion_proxy_receive(client, &dict);
 	if (res != COMPANION_PROXY_E_SUCCESS) {
 		return res;
 	}
@@ -354,6 +348,22 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_start_forwarding_se
 	return res;
 }
 
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_start_forwarding_service_port(companion_proxy_client_t client, uint16_t remote_port, const char* service_name, uint16_t* forward_port, plist_t options)
+{
+	if (!client) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	plist_t dict = companion_proxy_forwarding_request(remote_port, service_name, options);
+	companion_proxy_error_t res = companion_proxy_send(client, dict);
+	plist_free(dict);
+	if (res != COMPANION_PROXY_E_SUCCESS) {
+		return res;
+	}
+
+	return companion_proxy_forwarding_reply(client, forward_port);
+}
+
 LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_stop_forwarding_service_port(companion_proxy_client_t client, uint16_t remote_port)
 {
 	if (!client) {
@@ -379,3 +389,298 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_stop_forwarding_ser
 
 	return res;
 }
+
+struct companion_proxy_forward_entry {
+	uint16_t remote_port;
+	uint16_t forward_port;
+	idevice_connection_t idle[COMPANION_PROXY_FORWARDER_MAX_IDLE];
+	unsigned int num_idle;
+};
+
+struct companion_proxy_forwarder_private {
+	idevice_t device;
+	char *label;
+	mutex_t mutex;
+	plist_t registry;
+	struct companion_proxy_forward_entry *entries;
+	unsigned int num_entries;
+};
+
+/**
+ * Opens count companion_proxy connections with a single lockdown session.
+ * The service replies to only one command per connection, so every command
+ * needs a connection of its own.
+ */
+static companion_proxy_error_t companion_proxy_forwarder_open_clients(companion_proxy_forwarder_t forwarder, unsigned int count, companion_proxy_client_t *clients)
+{
+	lockdownd_client_t lockdown = NULL;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		clients[i] = NULL;
+	}
+	if (lockdownd_client_new_with_handshake(forwarder->device, &lockdown, forwarder->label) != LOCKDOWN_E_SUCCESS) {
+		return COMPANION_PROXY_E_MUX_ERROR;
+	}
+
+	const char **identifiers = (const char**)malloc(sizeof(char*) * count);
+	lockdownd_service_descriptor_t *services = (lockdownd_service_descriptor_t*)calloc(count, sizeof(lockdownd_service_descriptor_t));
+	for (i = 0; i < count; i++) {
+		identifiers[i] = COMPANION_PROXY_SERVICE_NAME;
+	}
+	lockdownd_start_services(lockdown, identifiers, count, services);
+	lockdownd_client_free(lockdown);
+	free(identifiers);
+
+	companion_proxy_error_t res = COMPANION_PROXY_E_SUCCESS;
+	for (i = 0; i < count; i++) {
+		if (!services[i] || companion_proxy_client_new(forwarder->device, services[i], &clients[i]) != COMPANION_PROXY_E_SUCCESS) {
+			res = COMPANION_PROXY_E_MUX_ERROR;
+		}
+		lockdownd_service_descriptor_free(services[i]);
+	}
+	free(services);
+
+	if (res != COMPANION_PROXY_E_SUCCESS) {
+		for (i = 0; i < count; i++) {
+			if (clients[i]) {
+				companion_proxy_client_free(clients[i]);
+				clients[i] = NULL;
+			}
+		}
+	}
+	return res;
+}
+
+static struct companion_proxy_forward_entry* companion_proxy_forwarder_find(companion_proxy_forwarder_t forwarder, uint16_t remote_port)
+{
+	unsigned int i;
+	for (i = 0; i < forwarder->num_entries; i++) {
+		if (forwarder->entries[i].remote_port == remote_port) {
+			return &forwarder->entries[i];
+		}
+	}
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_forwarder_new(idevice_t device, const char* label, companion_proxy_forwarder_t* forwarder)
+{
+	if (!device || !forwarder) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	companion_proxy_forwarder_t fwd = (companion_proxy_forwarder_t)calloc(1, sizeof(struct companion_proxy_forwarder_private));
+	if (!fwd) {
+		return COMPANION_PROXY_E_UNKNOWN_ERROR;
+	}
+	fwd->device = device;
+	fwd->label = (label) ? strdup(label) : NULL;
+	mutex_init(&fwd->mutex);
+
+	*forwarder = fwd;
+	return COMPANION_PROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_forwarder_get_device_registry(companion_proxy_forwarder_t forwarder, int refresh, plist_t* paired_devices)
+{
+	if (!forwarder || !paired_devices) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	companion_proxy_error_t res = COMPANION_PROXY_E_SUCCESS;
+
+	mutex_lock(&forwarder->mutex);
+	if (refresh && forwarder->registry) {
+		plist_free(forwarder->registry);
+		forwarder->registry = NULL;
+	}
+	if (!forwarder->registry) {
+		companion_proxy_client_t client = NULL;
+		res = companion_proxy_forwarder_open_clients(forwarder, 1, &client);
+		if (res == COMPANION_PROXY_E_SUCCESS) {
+			res = companion_proxy_get_device_registry(client, &forwarder->registry);
+			companion_proxy_client_free(client);
+		}
+	}
+	if (res == COMPANION_PROXY_E_SUCCESS) {
+		*paired_devices = plist_copy(forwarder->registry);
+	}
+	mutex_unlock(&forwarder->mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_forwarder_add_services(companion_proxy_forwarder_t forwarder, const uint16_t* remote_ports, const char** service_names, unsigned int count, plist_t options)
+{
+	if (!forwarder || !remote_ports || count == 0) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	unsigned int *pending = (unsigned int*)malloc(sizeof(unsigned int) * count);
+	unsigned int num_pending = 0;
+	unsigned int i;
+
+	mutex_lock(&forwarder->mutex);
+
+	for (i = 0; i < count; i++) {
+		unsigned int j;
+		int duplicate = 0;
+		for (j = 0; j < num_pending; j++) {
+			if (remote_ports[pending[j]] == remote_ports[i]) {
+				duplicate = 1;
+				break;
+			}
+		}
+		if (!duplicate && !companion_proxy_forwarder_find(forwarder, remote_ports[i])) {
+			pending[num_pending++] = i;
+		}
+	}
+	if (num_pending == 0) {
+		mutex_unlock(&forwarder->mutex);
+		free(pending);
+		return COMPANION_PROXY_E_SUCCESS;
+	}
+
+	companion_proxy_client_t *clients = (companion_proxy_client_t*)malloc(sizeof(companion_proxy_client_t) * num_pending);
+	companion_proxy_error_t res = companion_proxy_forwarder_open_clients(forwarder, num_pending, clients);
+	if (res == COMPANION_PROXY_E_SUCCESS) {
+		/* send all requests first, the device handles them concurrently */
+		for (i = 0; i < num_pending; i++) {
+			unsigned int idx = pending[i];
+			plist_t dict = companion_proxy_forwarding_request(remote_ports[idx], (service_names) ? service_names[idx] : NULL, options);
+			if (companion_proxy_send(clients[i], dict) != COMPANION_PROXY_E_SUCCESS) {
+				companion_proxy_client_free(clients[i]);
+				clients[i] = NULL;
+			}
+			plist_free(dict);
+		}
+
+		struct companion_proxy_forward_entry *entries = (struct companion_proxy_forward_entry*)realloc(forwarder->entries, sizeof(struct companion_proxy_forward_entry) * (forwarder->num_entries + num_pending));
+		if (entries) {
+			forwarder->entries = entries;
+		}
+		for (i = 0; i < num_pending; i++) {
+			uint16_t forward_port = 0;
+			if (!clients[i]) {
+				res = COMPANION_PROXY_E_MUX_ERROR;
+				continue;
+			}
+			companion_proxy_error_t err = companion_proxy_forwarding_reply(clients[i], &forward_port);
+			companion_proxy_client_free(clients[i]);
+			if (err != COMPANION_PROXY_E_SUCCESS || !entries) {
+				debug_info("could not forward remote port %d, error %d", remote_ports[pending[i]], err);
+				res = (err != COMPANION_PROXY_E_SUCCESS) ? err : COMPANION_PROXY_E_UNKNOWN_ERROR;
+				continue;
+			}
+			struct companion_proxy_forward_entry *entry = &forwarder->entries[forwarder->num_entries++];
+			memset(entry, '\0', sizeof(struct companion_proxy_forward_entry));
+			entry->remote_port = remote_ports[pending[i]];
+			entry->forward_port = forward_port;
+		}
+	}
+	free(clients);
+
+	mutex_unlock(&forwarder->mutex);
+	free(pending);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_forwarder_connect(companion_proxy_forwarder_t forwarder, uint16_t remote_port, const char* service_name, plist_t options, idevice_connection_t* connection)
+{
+	if (!forwarder || !connection) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	companion_proxy_error_t res = companion_proxy_forwarder_add_services(forwarder, &remote_port, &service_name, 1, options);
+	if (res != COMPANION_PROXY_E_SUCCESS) {
+		return res;
+	}
+
+	uint16_t forward_port = 0;
+	mutex_lock(&forwarder->mutex);
+	struct companion_proxy_forward_entry *entry = companion_proxy_forwarder_find(forwarder, remote_port);
+	if (entry) {
+		forward_port = entry->forward_port;
+		if (entry->num_idle > 0) {
+			*connection = entry->idle[--entry->num_idle];
+			mutex_unlock(&forwarder->mutex);
+			return COMPANION_PROXY_E_SUCCESS;
+		}
+	}
+	mutex_unlock(&forwarder->mutex);
+
+	if (forward_port == 0) {
+		return COMPANION_PROXY_E_UNKNOWN_ERROR;
+	}
+	if (idevice_connect(forwarder->device, forward_port, connection) != IDEVICE_E_SUCCESS) {
+		return COMPANION_PROXY_E_MUX_ERROR;
+	}
+	return COMPANION_PROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_forwarder_release(companion_proxy_forwarder_t forwarder, uint16_t remote_port, idevice_connection_t connection, int reusable)
+{
+	if (!forwarder || !connection) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	if (reusable) {
+		mutex_lock(&forwarder->mutex);
+		struct companion_proxy_forward_entry *entry = companion_proxy_forwarder_find(forwarder, remote_port);
+		if (entry && entry->num_idle < COMPANION_PROXY_FORWARDER_MAX_IDLE) {
+			entry->idle[entry->num_idle++] = connection;
+			connection = NULL;
+		}
+		mutex_unlock(&forwarder->mutex);
+	}
+	if (connection) {
+		idevice_disconnect(connection);
+	}
+	return COMPANION_PROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_forwarder_free(companion_proxy_forwarder_t forwarder)
+{
+	if (!forwarder) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	companion_proxy_error_t res = COMPANION_PROXY_E_SUCCESS;
+	unsigned int i;
+	for (i = 0; i < forwarder->num_entries; i++) {
+		while (forwarder->entries[i].num_idle > 0) {
+			idevice_disconnect(forwarder->entries[i].idle[--forwarder->entries[i].num_idle]);
+		}
+	}
+
+	if (forwarder->num_entries > 0) {
+		/* stop all forwardings, again with all requests in flight at once */
+		companion_proxy_client_t *clients = (companion_proxy_client_t*)malloc(sizeof(companion_proxy_client_t) * forwarder->num_entries);
+		res = companion_proxy_forwarder_open_clients(forwarder, forwarder->num_entries, clients);
+		if (res == COMPANION_PROXY_E_SUCCESS) {
+			for (i = 0; i < forwarder->num_entries; i++) {
+				plist_t dict = plist_new_dict();
+				plist_dict_set_item(dict, "Command", plist_new_string("StopForwardingServicePort"));
+				plist_dict_set_item(dict, "GizmoRemotePortNumber", plist_new_uint(forwarder->entries[i].remote_port));
+				companion_proxy_send(clients[i], dict);
+				plist_free(dict);
+			}
+			for (i = 0; i < forwarder->num_entries; i++) {
+				plist_t dict = NULL;
+				companion_proxy_receive(clients[i], &dict);
+				plist_free(dict);
+				companion_proxy_client_free(clients[i]);
+			}
+		}
+		free(clients);
+	}
+
+	plist_free(forwarder->registry);
+	free(forwarder->entries);
+	free(forwarder->label);
+	mutex_destroy(&forwarder->mutex);
+	free(forwarder);
+
+	return res;
+}
@@ -25,10 +25,21 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #define _GNU_SOURCE 1
 #define __USE_GNU 1
 #include <stdio.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DEBUGSERVER_USE_SSE2 1
+#define DEBUGSERVER_USE_SIMD 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DEBUGSERVER_USE_NEON 1
+#define DEBUGSERVER_USE_SIMD 1
+#endif
+
 #include "debugserver.h"
 #include "lockdown.h"
 #include "common/debug.h"
@@ -81,13 +92,19 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_new(idevice_t device
 		return ret;
 	}
 
-	if (service->identifier && (strcmp(service->identifier, DEBUGSERVER_SECURE_SERVICE_NAME) != 0)) {
-		service_disable_bypass_ssl(parent, 1);
-	}
+	/* the plain debugserver service continues without SSL after the
+	 * handshake, which service_client_new() takes care of */
 
 	debugserver_client_t client_loc = (debugserver_client_t) malloc(sizeof(struct debugserver_client_private));
 	client_loc->parent = parent;
 	client_loc->noack_mode = 0;
+	client_loc->recv_buffer = NULL;
+	client_loc->recv_capacity = 0;
+	client_loc->recv_offset = 0;
+	client_loc->recv_length = 0;
+	client_loc->memory_read_probed = 0;
+	client_loc->binary_memory_read = 0;
+	client_loc->max_packet_size = DEBUGSERVER_DEFAULT_PACKET_SIZE;
 
 	*client = client_loc;
 
@@ -113,6 +130,7 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_free(debugserver_cli
 
 	debugserver_error_t err = debugserver_error(service_client_free(client->parent));
 	client->parent = NULL;
+	free(client->recv_buffer);
 	free(client);
 
 	return err;
@@ -139,6 +157,18 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send(debugserver_cli
 	return res;
 }
 
+/**
+ * Marks the given number of bytes of the receive buffer as read.
+ */
+static void debugserver_client_consume(debugserver_client_t client, uint32_t length)
+{
+	client->recv_offset += length;
+	client->recv_length -= length;
+	if (client->recv_length == 0) {
+		client->recv_offset = 0;
+	}
+}
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_with_timeout(debugserver_client_t client, char* data, uint32_t size, uint32_t *received, unsigned int timeout)
 {
 	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
@@ -148,6 +178,17 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_with_timeout
 		return DEBUGSERVER_E_INVALID_ARG;
 	}
 
+	if (client->recv_length > 0) {
+		/* hand out data that was read ahead by debugserver_client_receive_response() first */
+		bytes = (client->recv_length < size) ? client->recv_length : size;
+		memcpy(data, client->recv_buffer + client->recv_offset, bytes);
+		debugserver_client_consume(client, bytes);
+		if (received) {
+			*received = (uint32_t)bytes;
+		}
+		return DEBUGSERVER_E_SUCCESS;
+	}
+
 	res = debugserver_error(service_receive_with_timeout(client->parent, data, size, (uint32_t*)&bytes, timeout));
 	if (bytes <= 0) {
 		debug_info("Could not read data, error %d", res);
@@ -164,6 +205,44 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive(debugserver_
 	return debugserver_client_receive_with_timeout(client, data, size, received, 1000);
 }
 
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_relay(debugserver_client_t client, int fd)
+{
+	idevice_connection_t connection = NULL;
+
+	if (!client || fd < 0) {
+		return DEBUGSERVER_E_INVALID_ARG;
+	}
+
+	if (service_get_connection(client->parent, &connection) != SERVICE_E_SUCCESS) {
+		return DEBUGSERVER_E_INVALID_ARG;
+	}
+
+	switch (idevice_connection_relay(connection, fd)) {
+		case IDEVICE_E_SUCCESS:
+			return DEBUGSERVER_E_SUCCESS;
+		case IDEVICE_E_INVALID_ARG:
+			return DEBUGSERVER_E_INVALID_ARG;
+		case IDEVICE_E_SSL_ERROR:
+			return DEBUGSERVER_E_SSL_ERROR;
+		default:
+			break;
+	}
+	return DEBUGSERVER_E_MUX_ERROR;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_get_connection(debugserver_client_t client, idevice_connection_t *connection)
+{
+	if (!client || !connection) {
+		return DEBUGSERVER_E_INVALID_ARG;
+	}
+
+	if (service_get_connection(client->parent, connection) != SERVICE_E_SUCCESS) {
+		return DEBUGSERVER_E_INVALID_ARG;
+	}
+
+	return DEBUGSERVER_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_command_new(const char* name, int argc, char* argv[], debugserver_command_t* command)
 {
 	int i;
@@ -236,16 +315,53 @@ static char debugserver_int2hex(int x)
 #define DEBUGSERVER_HEX_DECODE_FIRST_BYTE(byte) ((byte >> 0x4) & 0xf)
 #define DEBUGSERVER_HEX_DECODE_SECOND_BYTE(byte) (byte & 0xf)
 
+#if defined(DEBUGSERVER_USE_SSE2)
+static uint32_t debugserver_checksum_simd(const unsigned char* buffer, uint32_t size, uint32_t* done)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i sum = _mm_setzero_si128();
+	uint32_t i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		/* psadbw adds up the 8 bytes of each half into a 64 bit lane */
+		__m128i data = _mm_loadu_si128((const __m128i*)(buffer + i));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(data, zero));
+	}
+	*done = i;
+
+	return (uint32_t)_mm_cvtsi128_si32(sum) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+}
+#elif defined(DEBUGSERVER_USE_NEON)
+static uint32_t debugserver_checksum_simd(const unsigned char* buffer, uint32_t size, uint32_t* done)
+{
+	uint32x4_t sum = vdupq_n_u32(0);
+	uint32_t i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		uint16x8_t pairs = vpaddlq_u8(vld1q_u8(buffer + i));
+		sum = vpadalq_u16(sum, pairs);
+	}
+	*done = i;
+
+	return vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+}
+#endif
+
+/* only the lowest byte of the sum is part of the protocol */
 static uint32_t debugserver_get_checksum_for_buffer(const char* buffer, uint32_t size)
 {
+	const unsigned char* data = (const unsigned char*)buffer;
 	uint32_t checksum = 0;
-	uint32_t i;
+	uint32_t i = 0;
 
-	for (i = 0; i < size; i++) {
-		checksum += buffer[i];
+#ifdef DEBUGSERVER_USE_SIMD
+	checksum = debugserver_checksum_simd(data, size, &i);
+#endif
+	for (; i < size; i++) {
+		checksum += data[i];
 	}
 
-	return checksum;
+	return checksum & 0xff;
 }
 
 static int debugserver_response_is_checksum_valid(const char* response, uint32_t size)
@@ -267,16 +383,134 @@ static int debugserver_response_is_checksum_valid(const char* response, uint32_t
 	return 1;
 }
 
+#if defined(DEBUGSERVER_USE_SSE2)
+/* maps nibbles 0-15 in each byte lane to '0'-'9' and 'A'-'F' */
+static inline __m128i debugserver_nibble2hex_sse2(__m128i nibbles)
+{
+	__m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('A' - '0' - 10));
+	return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+
+static size_t debugserver_hex_encode_simd(const unsigned char* src, size_t length, char* dst)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i hi = debugserver_nibble2hex_sse2(_mm_and_si128(_mm_srli_epi16(data, 4), mask));
+		__m128i lo = debugserver_nibble2hex_sse2(_mm_and_si128(data, mask));
+		_mm_storeu_si128((__m128i*)(dst + (i * 2)), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*)(dst + (i * 2) + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+
+	return i;
+}
+
+/* converts hex chars to nibbles, sets *valid to 0 if any lane is not a hex digit */
+static inline __m128i debugserver_hex2nibble_sse2(__m128i chars, int* valid)
+{
+	__m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+	__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+	__m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff) {
+		*valid = 0;
+	}
+	__m128i digits = _mm_and_si128(is_digit, _mm_sub_epi8(chars, _mm_set1_epi8('0')));
+	__m128i letters = _mm_andnot_si128(is_digit, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+	return _mm_or_si128(digits, letters);
+}
+
+static size_t debugserver_hex_decode_simd(const char* src, size_t length, unsigned char* dst)
+{
+	const __m128i low_byte = _mm_set1_epi16(0x00ff);
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		int valid = 1;
+		__m128i n0 = debugserver_hex2nibble_sse2(_mm_loadu_si128((const __m128i*)(src + i)), &valid);
+		__m128i n1 = debugserver_hex2nibble_sse2(_mm_loadu_si128((const __m128i*)(src + i + 16)), &valid);
+		if (!valid) {
+			/* leave invalid input to the scalar code */
+			break;
+		}
+		/* each 16 bit lane holds the high nibble in its first and the low nibble in its second byte */
+		__m128i b0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n0, low_byte), 4), _mm_srli_epi16(n0, 8));
+		__m128i b1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n1, low_byte), 4), _mm_srli_epi16(n1, 8));
+		_mm_storeu_si128((__m128i*)(dst + (i / 2)), _mm_packus_epi16(b0, b1));
+	}
+
+	return i;
+}
+#elif defined(DEBUGSERVER_USE_NEON)
+static inline uint8x16_t debugserver_nibble2hex_neon(uint8x16_t nibbles)
+{
+	uint8x16_t letters = vandq_u8(vcgtq_u8(nibbles, vdupq_n_u8(9)), vdupq_n_u8('A' - '0' - 10));
+	return vaddq_u8(vaddq_u8(nibbles, vdupq_n_u8('0')), letters);
+}
+
+static size_t debugserver_hex_encode_simd(const unsigned char* src, size_t length, char* dst)
+{
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		uint8x16_t data = vld1q_u8(src + i);
+		uint8x16x2_t hex;
+		hex.val[0] = debugserver_nibble2hex_neon(vshrq_n_u8(data, 4));
+		hex.val[1] = debugserver_nibble2hex_neon(vandq_u8(data, vdupq_n_u8(0x0f)));
+		/* interleaving store writes high and low nibble chars in turn */
+		vst2q_u8((uint8_t*)(dst + (i * 2)), hex);
+	}
+
+	return i;
+}
+
+static inline uint8x16_t debugserver_hex2nibble_neon(uint8x16_t chars, uint8x16_t* valid)
+{
+	uint8x16_t lower = vorrq_u8(chars, vdupq_n_u8(0x20));
+	uint8x16_t digits = vsubq_u8(chars, vdupq_n_u8('0'));
+	uint8x16_t letters = vsubq_u8(lower, vdupq_n_u8('a'));
+	uint8x16_t is_digit = vcltq_u8(digits, vdupq_n_u8(10));
+	uint8x16_t is_letter = vcltq_u8(letters, vdupq_n_u8(6));
+	*valid = vandq_u8(*valid, vorrq_u8(is_digit, is_letter));
+	return vbslq_u8(is_digit, digits, vaddq_u8(letters, vdupq_n_u8(10)));
+}
+
+static size_t debugserver_hex_decode_simd(const char* src, size_t length, unsigned char* dst)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		/* deinterleaving load splits the chars into high and low nibbles */
+		uint8x16x2_t chars = vld2q_u8((const uint8_t*)(src + i));
+		uint8x16_t valid = vdupq_n_u8(0xff);
+		uint8x16_t hi = debugserver_hex2nibble_neon(chars.val[0], &valid);
+		uint8x16_t lo = debugserver_hex2nibble_neon(chars.val[1], &valid);
+		uint64x2_t check = vreinterpretq_u64_u8(valid);
+		if ((vgetq_lane_u64(check, 0) & vgetq_lane_u64(check, 1)) != UINT64_MAX) {
+			/* leave invalid input to the scalar code */
+			break;
+		}
+		vst1q_u8(dst + (i / 2), vorrq_u8(vshlq_n_u8(hi, 4), lo));
+	}
+
+	return i;
+}
+#endif
+
 LIBIMOBILEDEVICE_API void debugserver_encode_string(const char* buffer, char** encoded_buffer, uint32_t* encoded_length)
 {
 	uint32_t position;
-	uint32_t index;
+	uint32_t index = 0;
 	uint32_t length = strlen(buffer);
 	*encoded_length = (2 * length) + DEBUGSERVER_CHECKSUM_HASH_LENGTH + 1;
 
 	*encoded_buffer = malloc(sizeof(char) * (*encoded_length));
 	memset(*encoded_buffer, '\0', *encoded_length);
-	for (position = 0, index = 0; index < length; index++) {
+#ifdef DEBUGSERVER_USE_SIMD
+	index = (uint32_t)debugserver_hex_encode_simd((const unsigned char*)buffer, length, *encoded_buffer);
+#endif
+	for (position = 0; index < length; index++) {
 		position = (index * (2 * sizeof(char)));
 		(*encoded_buffer)[position] = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(buffer[index]);
 		(*encoded_buffer)[position + 1] = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(buffer[index]);
@@ -289,8 +523,14 @@ LIBIMOBILEDEVICE_API void debugserver_decode_string(const char *encoded_buffer,
 	char* t = *buffer;
 	const char *f = encoded_buffer;
 	const char *fend = f + encoded_length;
+#ifdef DEBUGSERVER_USE_SIMD
+	size_t done = debugserver_hex_decode_simd(encoded_buffer, encoded_length, (unsigned char*)t);
+	f += done;
+	t += done / 2;
+#endif
 	while (f < fend) {
-		*t++ = debugserver_hex2int(*f) << 4 | debugserver_hex2int(f[1]);
+		/* non-hex chars are passed through and may be negative, so shift unsigned */
+		*t++ = (char)((unsigned int)debugserver_hex2int(*f) << 4 | (unsigned int)debugserver_hex2int(f[1]));
 		f += 2;
 	}
 	*t = '\0';
@@ -354,127 +594,167 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_ack_mode(debugse
 	return DEBUGSERVER_E_SUCCESS;
 }
 
-static int debugserver_client_receive_internal_check(debugserver_client_t client, char* received_char)
+/**
+ * Reads more data from the device into the receive buffer of the client.
+ * The buffer is compacted first and grows geometrically when it is full,
+ * so that a packet can be assembled from bulk reads in linear time.
+ *
+ * @param client The debugserver client
+ * @param timeout Timeout in milliseconds
+ *
+ * @return DEBUGSERVER_E_SUCCESS if data was received, DEBUGSERVER_E_TIMEOUT
+ *     if no data arrived within the timeout, or another error code.
+ */
+static debugserver_error_t debugserver_client_fill_buffer(debugserver_client_t client, unsigned int timeout)
 {
-	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
-	int did_receive_char = 0;
-	char buffer = 0;
 	uint32_t bytes = 0;
 
-	/* we loop here as we expect an answer */
-	res = debugserver_client_receive_with_timeout(client, &buffer, sizeof(char), &bytes, 1000);
-	if (res == DEBUGSERVER_E_SUCCESS && received_char[0] != 0) {
-		if (memcmp(&buffer, received_char, sizeof(char)) == 0) {
-			did_receive_char = 1;
+	if (client->recv_offset > 0) {
+		if (client->recv_length > 0) {
+			memmove(client->recv_buffer, client->recv_buffer + client->recv_offset, client->recv_length);
 		}
-	} else {
-		did_receive_char = 0;
+		client->recv_offset = 0;
 	}
 
-	if (!did_receive_char) {
-		memcpy(received_char, &buffer, sizeof(char));
+	if (client->recv_length + DEBUGSERVER_RECV_CHUNK_SIZE > client->recv_capacity) {
+		uint32_t capacity = (client->recv_capacity) ? client->recv_capacity : DEBUGSERVER_RECV_CHUNK_SIZE;
+		while (client->recv_length + DEBUGSERVER_RECV_CHUNK_SIZE > capacity) {
+			capacity *= 2;
+		}
+		char* newbuffer = realloc(client->recv_buffer, capacity);
+		if (!newbuffer) {
+			return DEBUGSERVER_E_UNKNOWN_ERROR;
+		}
+		client->recv_buffer = newbuffer;
+		client->recv_capacity = capacity;
+	}
+
+	debugserver_error_t res = debugserver_error(service_receive_with_timeout(client->parent, client->recv_buffer + client->recv_length, client->recv_capacity - client->recv_length, &bytes, timeout));
+	if (res == DEBUGSERVER_E_SUCCESS && bytes == 0) {
+		res = DEBUGSERVER_E_TIMEOUT;
 	}
+	client->recv_length += bytes;
 
-	return did_receive_char;
+	return res;
+}
+
+/**
+ * Makes sure the receive buffer holds at least one unread byte.
+ *
+ * @return DEBUGSERVER_E_SUCCESS if a byte is available, an error code otherwise.
+ */
+static debugserver_error_t debugserver_client_peek_byte(debugserver_client_t client, char* byte)
+{
+	if (client->recv_length == 0) {
+		debugserver_error_t res = debugserver_client_fill_buffer(client, 1000);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			return res;
+		}
+	}
+	*byte = client->recv_buffer[client->recv_offset];
+	return DEBUGSERVER_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_response(debugserver_client_t client, char** response, size_t* response_size)
 {
 	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	char byte = 0;
 
-	int should_receive = 1;
-	int skip_prefix = 0;
-	char* command_prefix = strdup("$");
-
-	char* buffer = NULL;
-	uint32_t buffer_size = 0;
-	uint32_t buffer_capacity = 0;
+	if (!client)
+		return DEBUGSERVER_E_INVALID_ARG;
 
 	if (response)
 		*response = NULL;
 
 	if (!client->noack_mode) {
-		char ack[2] = {'+', '\0'};
-		debug_info("attempting to receive ACK %c", *ack);
-		should_receive = debugserver_client_receive_internal_check(client, ack);
-		debug_info("received char: %c", *ack);
-		if (strncmp(ack, command_prefix, sizeof(char)) == 0) {
-			should_receive = 1;
-			skip_prefix = 1;
-			buffer = malloc(1024);
-			buffer_capacity = 1024;
-			strcpy(buffer, command_prefix);
-			buffer_size += sizeof(char);
+		debug_info("attempting to receive ACK");
+		res = debugserver_client_peek_byte(client, &byte);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			return (res == DEBUGSERVER_E_TIMEOUT) ? DEBUGSERVER_E_SUCCESS : res;
+		}
+		debug_info("received char: %c", byte);
+		if (byte == '+') {
 			debug_info("received ACK");
+			/* with pipelined commands several ACKs can precede the response */
+			do {
+				debugserver_client_consume(client, 1);
+				res = debugserver_client_peek_byte(client, &byte);
+			} while (res == DEBUGSERVER_E_SUCCESS && byte == '+');
+			if (res != DEBUGSERVER_E_SUCCESS) {
+				return (res == DEBUGSERVER_E_TIMEOUT) ? DEBUGSERVER_E_SUCCESS : res;
+			}
+		} else if (byte != '$') {
+			debugserver_client_consume(client, 1);
+			return DEBUGSERVER_E_SUCCESS;
 		}
 	}
 
-	debug_info("should_receive: %d, skip_prefix: %d", should_receive, skip_prefix);
+	debug_info("attempting to receive prefix");
+	res = debugserver_client_peek_byte(client, &byte);
+	if (res != DEBUGSERVER_E_SUCCESS) {
+		return (res == DEBUGSERVER_E_TIMEOUT) ? DEBUGSERVER_E_SUCCESS : res;
+	}
+	if (byte != '$') {
+		debug_info("unexpected char %c instead of command prefix", byte);
+		debugserver_client_consume(client, 1);
+		return DEBUGSERVER_E_SUCCESS;
+	}
 
-	if (should_receive && !skip_prefix) {
-		debug_info("attempting to receive prefix");
-		should_receive = debugserver_client_receive_internal_check(client, command_prefix);
-		debug_info("received command_prefix: %c", *command_prefix);
-		if (should_receive) {
-			if (buffer) {
-				strcpy(buffer, command_prefix);
-			} else {
-				buffer = malloc(1024);
-				buffer_capacity = 1024;
-				strcpy(buffer, command_prefix);
-				buffer_size += sizeof(char);
+	/* scan the buffered data for the end of the packet, '#' followed by the two checksum chars */
+	debug_info("attempting to read up response until checksum");
+	uint32_t scanned = 1;
+	uint32_t packet_size = 0;
+	while (1) {
+		const char* hash = NULL;
+		if (client->recv_length > scanned) {
+			hash = memchr(client->recv_buffer + client->recv_offset + scanned, '#', client->recv_length - scanned);
+		}
+		if (hash) {
+			uint32_t hash_offset = (uint32_t)(hash - (client->recv_buffer + client->recv_offset));
+			if (hash_offset + DEBUGSERVER_CHECKSUM_HASH_LENGTH <= client->recv_length) {
+				packet_size = hash_offset + DEBUGSERVER_CHECKSUM_HASH_LENGTH;
+				break;
 			}
+			scanned = hash_offset;
+		} else {
+			scanned = client->recv_length;
+		}
+		/* the offsets are relative to recv_offset and stay valid across compaction */
+		res = debugserver_client_fill_buffer(client, 1000);
+		if (res == DEBUGSERVER_E_TIMEOUT) {
+			/* a packet has started, keep waiting for the rest of it */
+			continue;
+		}
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			debug_info("failed to receive response, error %d", res);
+			return res;
 		}
 	}
 
-	debug_info("buffer: %*s, should_receive: %d, skip_prefix: %d", buffer_size, buffer, should_receive, skip_prefix);
-
-	if (should_receive) {
-		uint32_t checksum_length = DEBUGSERVER_CHECKSUM_HASH_LENGTH;
-		int receiving_checksum_response = 0;
-		debug_info("attempting to read up response until checksum");
-
-		while ((checksum_length > 0)) {
-			char data[2] = {'#', '\0'};
-			if (debugserver_client_receive_internal_check(client, data)) {
-				receiving_checksum_response = 1;
-			}
-			if (receiving_checksum_response) {
-				checksum_length--;
-			}
-			if (buffer_size + 1 >= buffer_capacity) {
-				char* newbuffer = realloc(buffer, buffer_capacity+1024);
-				if (!newbuffer) {
-					return DEBUGSERVER_E_UNKNOWN_ERROR;
-				}
-				buffer = newbuffer;
-				buffer[buffer_capacity] = '\0';
-				buffer_capacity += 1024;
-			}
-			strcat(buffer, data);
-			buffer_size += sizeof(char);
-		}
-		debug_info("validating response checksum...");
-		if (client->noack_mode || debugserver_response_is_checksum_valid(buffer, buffer_size)) {
-			if (response) {
-				/* assemble response string */
-				uint32_t resp_size = sizeof(char) * (buffer_size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1);
-				*response = (char*)malloc(resp_size + 1);
-				memcpy(*response, buffer + 1, resp_size);
-				(*response)[resp_size] = '\0';
-				if (response_size) *response_size = resp_size;
-			}
-			if (!client->noack_mode) {
-				/* confirm valid command */
-				debugserver_client_send_ack(client);
-			}
-		} else {
-			/* response was invalid */
-			res = DEBUGSERVER_E_RESPONSE_ERROR;
-			if (!client->noack_mode) {
-				/* report invalid command */
-				debugserver_client_send_noack(client);
-			}
+	const char* packet = client->recv_buffer + client->recv_offset;
+	res = DEBUGSERVER_E_SUCCESS;
+	debug_info("validating response checksum...");
+	if (client->noack_mode || debugserver_response_is_checksum_valid(packet, packet_size)) {
+		if (response) {
+			/* assemble response string */
+			uint32_t resp_size = packet_size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1;
+			*response = (char*)malloc(resp_size + 1);
+			memcpy(*response, packet + 1, resp_size);
+			(*response)[resp_size] = '\0';
+			if (response_size) *response_size = resp_size;
+		}
+		debugserver_client_consume(client, packet_size);
+		if (!client->noack_mode) {
+			/* confirm valid command */
+			debugserver_client_send_ack(client);
+		}
+	} else {
+		/* response was invalid */
+		res = DEBUGSERVER_E_RESPONSE_ERROR;
+		debugserver_client_consume(client, packet_size);
+		if (!client->noack_mode) {
+			/* report invalid command */
+			debugserver_client_send_noack(client);
 		}
 	}
 
@@ -482,16 +762,14 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_response(deb
 		debug_info("response: %s", *response);
 	}
 
-	if (buffer)
-		free(buffer);
-
-	if (command_prefix)
-		free(command_prefix);
-
 	return res;
 }
 
-LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugserver_client_t client, debugserver_command_t command, char** response, size_t* response_size)
+/**
+ * Encodes the arguments of the given command and sends it without waiting
+ * for the response.
+ */
+static debugserver_error_t debugserver_client_send_command_packet(debugserver_client_t client, debugserver_command_t command)
 {
 	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
 	int i;
@@ -517,15 +795,28 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugse
 
 	res = debugserver_client_send(client, send_buffer, send_buffer_size, &bytes);
 	debug_info("command result: %d", res);
+
+	if (command_arguments)
+		free(command_arguments);
+
+	if (send_buffer)
+		free(send_buffer);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugserver_client_t client, debugserver_command_t command, char** response, size_t* response_size)
+{
+	debugserver_error_t res = debugserver_client_send_command_packet(client, command);
 	if (res != DEBUGSERVER_E_SUCCESS) {
-		goto cleanup;
+		return res;
 	}
 
 	/* receive response */
 	res = debugserver_client_receive_response(client, response, response_size);
 	debug_info("response result: %d", res);
 	if (res != DEBUGSERVER_E_SUCCESS) {
-		goto cleanup;
+		return res;
 	}
 
 	if (response) {
@@ -537,13 +828,6 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugse
 		debugserver_client_set_ack_mode(client, 0);
 	}
 
-cleanup:
-	if (command_arguments)
-		free(command_arguments);
-
-	if (send_buffer)
-		free(send_buffer);
-
 	return res;
 }
 
@@ -635,3 +919,297 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_argv(debugserver
 
 	return result;
 }
+
+/**
+ * Sends a packet with the given plain text payload without waiting for the
+ * response.
+ */
+static debugserver_error_t debugserver_client_send_packet(debugserver_client_t client, const char* payload)
+{
+	char* send_buffer = NULL;
+	uint32_t send_buffer_size = 0;
+
+	debugserver_format_command("$", payload, NULL, 1, &send_buffer, &send_buffer_size);
+	debugserver_error_t res = debugserver_client_send(client, send_buffer, send_buffer_size, NULL);
+	free(send_buffer);
+
+	return res;
+}
+
+/**
+ * Receives a response, waiting up to DEBUGSERVER_RESPONSE_RETRIES
+ * receive timeouts for it to arrive.
+ */
+static debugserver_error_t debugserver_client_wait_response(debugserver_client_t client, char** response, size_t* response_size)
+{
+	int retries = DEBUGSERVER_RESPONSE_RETRIES;
+	debugserver_error_t res;
+
+	do {
+		res = debugserver_client_receive_response(client, response, response_size);
+	} while (res == DEBUGSERVER_E_SUCCESS && !*response && --retries > 0);
+
+	if (res == DEBUGSERVER_E_SUCCESS && !*response) {
+		res = DEBUGSERVER_E_TIMEOUT;
+	}
+
+	return res;
+}
+
+/**
+ * Queries the maximum packet size and whether binary memory reads are
+ * supported. The results are cached in the client.
+ */
+static void debugserver_client_probe_memory_read(debugserver_client_t client, uint64_t address)
+{
+	char* response = NULL;
+	size_t response_size = 0;
+	char payload[48];
+
+	if (client->memory_read_probed)
+		return;
+
+	client->memory_read_probed = 1;
+	client->max_packet_size = DEBUGSERVER_DEFAULT_PACKET_SIZE;
+	client->binary_memory_read = 0;
+
+	if (debugserver_client_send_packet(client, "qSupported") == DEBUGSERVER_E_SUCCESS
+	    && debugserver_client_wait_response(client, &response, &response_size) == DEBUGSERVER_E_SUCCESS) {
+		const char* packet_size = strstr(response, "PacketSize=");
+		if (packet_size) {
+			unsigned long size = strtoul(packet_size + strlen("PacketSize="), NULL, 16);
+			if (size > DEBUGSERVER_MAX_PACKET_SIZE) {
+				size = DEBUGSERVER_MAX_PACKET_SIZE;
+			}
+			if (size > DEBUGSERVER_PACKET_OVERHEAD * 2) {
+				client->max_packet_size = (uint32_t)size;
+			}
+		}
+	}
+	free(response);
+	response = NULL;
+
+	/* a zero length binary read is answered with OK by servers that support it */
+	snprintf(payload, sizeof(payload), "x%" PRIx64 ",0", address);
+	if (debugserver_client_send_packet(client, payload) == DEBUGSERVER_E_SUCCESS
+	    && debugserver_client_wait_response(client, &response, &response_size) == DEBUGSERVER_E_SUCCESS) {
+		client->binary_memory_read = (strcmp(response, "OK") == 0);
+	}
+	free(response);
+
+	debug_info("max packet size: %u, binary memory read: %s", client->max_packet_size, client->binary_memory_read ? "yes" : "no");
+}
+
+/**
+ * Decodes the data of a binary response, resolving '}' escapes and run
+ * length encoding.
+ *
+ * @return The number of decoded bytes, at most max_length.
+ */
+static uint32_t debugserver_decode_binary(const char* data, size_t length, char* buffer, uint32_t max_length)
+{
+	uint32_t out = 0;
+	size_t i = 0;
+
+	while (i < length && out < max_length) {
+		char c = data[i++];
+		if (c == '}' && i < length) {
+			buffer[out++] = data[i++] ^ 0x20;
+		} else if (c == '*' && i < length && out > 0) {
+			/* repeat the previous byte, the count is encoded as count + 29 */
+			uint32_t count = (unsigned char)data[i++];
+			count = (count > 29) ? count - 29 : 0;
+			char prev = buffer[out - 1];
+			while (count-- > 0 && out < max_length) {
+				buffer[out++] = prev;
+			}
+		} else {
+			buffer[out++] = c;
+		}
+	}
+
+	return out;
+}
+
+/**
+ * Extracts the memory contents from a read response.
+ *
+ * @return The number of bytes stored in buffer, 0 for an error reply.
+ */
+static uint32_t debugserver_parse_memory_response(debugserver_client_t client, const char* response, size_t response_size, char* buffer, uint32_t max_length)
+{
+	if (response_size == 0 || (response_size == 3 && response[0] == 'E')) {
+		return 0;
+	}
+
+	if (client->binary_memory_read) {
+		return debugserver_decode_binary(response, response_size, buffer, max_length);
+	}
+
+	char* decoded = NULL;
+	uint32_t length = (uint32_t)(response_size / 2);
+	if (length > max_length) {
+		length = max_length;
+	}
+	debugserver_decode_string(response, length * 2, &decoded);
+	memcpy(buffer, decoded, length);
+	free(decoded);
+
+	return length;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_read_memory(debugserver_client_t client, uint64_t address, uint32_t length, char* buffer, uint32_t* bytes_read)
+{
+	uint32_t sizes[DEBUGSERVER_READ_MEMORY_DEPTH];
+	uint32_t head = 0;
+	uint32_t inflight = 0;
+	uint32_t requested = 0;
+	uint32_t done = 0;
+	uint32_t chunk_size;
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	char payload[48];
+
+	if (bytes_read)
+		*bytes_read = 0;
+
+	if (!client || !buffer)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	if (length == 0)
+		return DEBUGSERVER_E_SUCCESS;
+
+	debugserver_client_probe_memory_read(client, address);
+
+	chunk_size = client->max_packet_size - DEBUGSERVER_PACKET_OVERHEAD;
+	if (!client->binary_memory_read) {
+		/* hex encoding doubles the size of the response */
+		chunk_size /= 2;
+	}
+
+	while (done < length) {
+		/* keep several requests in flight to hide the round trip time */
+		while (inflight < DEBUGSERVER_READ_MEMORY_DEPTH && requested < length) {
+			uint32_t size = (length - requested > chunk_size) ? chunk_size : length - requested;
+			snprintf(payload, sizeof(payload), "%c%" PRIx64 ",%x", (client->binary_memory_read) ? 'x' : 'm', address + requested, size);
+			res = debugserver_client_send_packet(client, payload);
+			if (res != DEBUGSERVER_E_SUCCESS) {
+				break;
+			}
+			sizes[(head + inflight) % DEBUGSERVER_READ_MEMORY_DEPTH] = size;
+			inflight++;
+			requested += size;
+		}
+		if (inflight == 0) {
+			break;
+		}
+
+		/* responses arrive in order, the oldest one continues at offset done */
+		char* response = NULL;
+		size_t response_size = 0;
+		uint32_t expected = sizes[head];
+		head = (head + 1) % DEBUGSERVER_READ_MEMORY_DEPTH;
+		inflight--;
+
+		debugserver_error_t rres = debugserver_client_wait_response(client, &response, &response_size);
+		if (rres != DEBUGSERVER_E_SUCCESS) {
+			res = rres;
+			break;
+		}
+		uint32_t got = debugserver_parse_memory_response(client, response, response_size, buffer + done, expected);
+		free(response);
+		done += got;
+
+		if (got < expected) {
+			/* discard the replies for the following requests and continue after the short read */
+			while (inflight > 0) {
+				response = NULL;
+				rres = debugserver_client_wait_response(client, &response, &response_size);
+				free(response);
+				if (rres != DEBUGSERVER_E_SUCCESS) {
+					res = rres;
+					break;
+				}
+				inflight--;
+			}
+			if (got == 0 || inflight > 0) {
+				if (res == DEBUGSERVER_E_SUCCESS) {
+					res = DEBUGSERVER_E_RESPONSE_ERROR;
+				}
+				break;
+			}
+			/* the server returned less than asked for, use that as the chunk size from now on */
+			chunk_size = got;
+			requested = done;
+		}
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			break;
+		}
+	}
+
+	/* collect replies of requests sent before a send error */
+	while (inflight > 0) {
+		char* response = NULL;
+		size_t response_size = 0;
+		if (debugserver_client_wait_response(client, &response, &response_size) != DEBUGSERVER_E_SUCCESS) {
+			break;
+		}
+		free(response);
+		inflight--;
+	}
+
+	if (bytes_read)
+		*bytes_read = done;
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_commands(debugserver_client_t client, debugserver_command_t* commands, int count, char** responses)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	int sent = 0;
+	int i;
+
+	if (!client || !commands || count <= 0)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	if (responses) {
+		for (i = 0; i < count; i++) {
+			responses[i] = NULL;
+		}
+	}
+
+	/* send all commands back to back, the server processes them in order */
+	for (sent = 0; sent < count; sent++) {
+		if (!commands[sent]) {
+			res = DEBUGSERVER_E_INVALID_ARG;
+			break;
+		}
+		res = debugserver_client_send_command_packet(client, commands[sent]);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			break;
+		}
+	}
+
+	/* collect the responses of all commands that were sent */
+	for (i = 0; i < sent; i++) {
+		char* response = NULL;
+		debugserver_error_t rres = debugserver_client_wait_response(client, &response, NULL);
+		if (rres != DEBUGSERVER_E_SUCCESS) {
+			if (res == DEBUGSERVER_E_SUCCESS) {
+				res = rres;
+			}
+			break;
+		}
+		debug_info("response %d: %s", i, response);
+		if (!strncmp(commands[i]->name, "QStartNoAckMode", 16)) {
+			debugserver_client_set_ack_mode(client, 0);
+		}
+		if (responses) {
+			responses[i] = response;
+		} else {
+			free(response);
+		}
+	}
+
+	return res;
+}
@@ -26,10 +26,23 @@
 #include "service.h"
 
 #define DEBUGSERVER_CHECKSUM_HASH_LENGTH 0x3
+#define DEBUGSERVER_RECV_CHUNK_SIZE 16384
+#define DEBUGSERVER_DEFAULT_PACKET_SIZE 1024
+#define DEBUGSERVER_MAX_PACKET_SIZE (1024 * 1024)
+#define DEBUGSERVER_PACKET_OVERHEAD 32
+#define DEBUGSERVER_READ_MEMORY_DEPTH 4
+#define DEBUGSERVER_RESPONSE_RETRIES 10
 
 struct debugserver_client_private {
 	service_client_t parent;
 	int noack_mode;
+	char* recv_buffer;
+	uint32_t recv_capacity;
+	uint32_t recv_offset;
+	uint32_t recv_length;
+	int memory_read_probed;
+	int binary_memory_read;
+	uint32_t max_packet_size;
 };
 
 struct debugserver_command_private {
@@ -22,11 +22,14 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#define _GNU_SOURCE 1
+#define __USE_GNU 1
 #include <string.h>
 #include <stdlib.h>
 #include "device_link_service.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "asprintf.h"
 
 static device_link_service_error_t device_link_error(property_list_service_error_t err)
 {
@@ -95,6 +98,60 @@ static int device_link_service_get_message(plist_t dl_msg, char **message)
 	return 1;
 }
 
+/**
+ * Sends all data directly to the underlying service, bypassing the raw
+ * send buffer.
+ */
+static device_link_service_error_t device_link_raw_send_all(device_link_service_client_t client, const char *data, uint32_t length, uint32_t *sent)
+{
+	service_client_t raw = client->parent->parent;
+	uint32_t done = 0;
+
+	while (done < length) {
+		uint32_t bytes = 0;
+		service_error_t serr = service_send(raw, data + done, length - done, &bytes);
+		if (serr != SERVICE_E_SUCCESS || bytes == 0) {
+			debug_info("raw send error %d after %d of %d bytes", serr, done, length);
+			break;
+		}
+		done += bytes;
+	}
+	if (sent) {
+		*sent = done;
+	}
+
+	return (done == length) ? DEVICE_LINK_SERVICE_E_SUCCESS : DEVICE_LINK_SERVICE_E_MUX_ERROR;
+}
+
+/**
+ * Internally used helpers that make sure buffered raw data is written out
+ * before any DL* message is sent or a reply is awaited.
+ */
+static property_list_service_error_t device_link_send_plist(device_link_service_client_t client, plist_t plist)
+{
+	if (device_link_service_flush_raw(client) != DEVICE_LINK_SERVICE_E_SUCCESS)
+		return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+
+	return property_list_service_send_binary_plist(client->parent, plist);
+}
+
+static device_link_service_error_t device_link_send_cached(device_link_service_client_t client, const char *key, property_list_service_build_cb_t build, void *user_data)
+{
+	device_link_service_error_t err = device_link_service_flush_raw(client);
+	if (err != DEVICE_LINK_SERVICE_E_SUCCESS)
+		return err;
+
+	return device_link_error(property_list_service_send_cached(client->parent, key, 1, build, user_data));
+}
+
+static property_list_service_error_t device_link_receive_plist(device_link_service_client_t client, plist_t *plist)
+{
+	if (device_link_service_flush_raw(client) != DEVICE_LINK_SERVICE_E_SUCCESS)
+		return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+
+	return property_list_service_receive_plist(client->parent, plist);
+}
+
 /**
  * Creates a new device link service client.
  *
@@ -122,6 +179,9 @@ device_link_service_error_t device_link_service_client_new(idevice_t device, loc
 	/* create client object */
 	device_link_service_client_t client_loc = (device_link_service_client_t) malloc(sizeof(struct device_link_service_client_private));
 	client_loc->parent = plistclient;
+	client_loc->raw_buffer = NULL;
+	client_loc->raw_buffer_size = 0;
+	client_loc->raw_buffer_len = 0;
 
 	/* all done, return success */
 	*client = client_loc;
@@ -144,6 +204,7 @@ device_link_service_error_t device_link_service_client_free(device_link_service_
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 
 	device_link_service_error_t err = device_link_error(property_list_service_client_free(client->parent));
+	free(client->raw_buffer);
 	free(client);
 
 	return err;
@@ -178,7 +239,7 @@ device_link_service_error_t device_link_service_version_exchange(device_link_ser
 	char *msg = NULL;
 
 	/* receive DLMessageVersionExchange from device */
-	err = device_link_error(property_list_service_receive_plist(client->parent, &array));
+	err = device_link_error(device_link_receive_plist(client, &array));
 	if (err != DEVICE_LINK_SERVICE_E_SUCCESS) {
 		debug_info("Did not receive initial message from device!");
 		goto leave;
@@ -224,7 +285,7 @@ device_link_service_error_t device_link_service_version_exchange(device_link_ser
 	plist_array_append_item(array, plist_new_string("DLMessageVersionExchange"));
 	plist_array_append_item(array, plist_new_string("DLVersionsOk"));
 	plist_array_append_item(array, plist_new_uint(version_major));
-	err = device_link_error(property_list_service_send_binary_plist(client->parent, array));
+	err = device_link_error(device_link_send_plist(client, array));
 	if (err != DEVICE_LINK_SERVICE_E_SUCCESS) {
 		debug_info("Error when sending DLVersionsOk");
 		goto leave;
@@ -233,7 +294,7 @@ device_link_service_error_t device_link_service_version_exchange(device_link_ser
 
 	/* receive DeviceReady message */
 	array = NULL;
-	err = device_link_error(property_list_service_receive_plist(client->parent, &array));
+	err = device_link_error(device_link_receive_plist(client, &array));
 	if (err != DEVICE_LINK_SERVICE_E_SUCCESS) {
 		debug_info("Error when receiving DLMessageDeviceReady!");
 		goto leave;
@@ -279,12 +340,24 @@ device_link_service_error_t device_link_service_disconnect(device_link_service_c
 	else
 		plist_array_append_item(array, plist_new_string("___EmptyParameterString___"));
 
-	device_link_service_error_t err = device_link_error(property_list_service_send_binary_plist(client->parent, array));
+	device_link_service_error_t err = device_link_error(device_link_send_plist(client, array));
 	plist_free(array);
 
 	return err;
 }
 
+/**
+ * Builds a DLMessagePing plist for the given message.
+ * Used as build callback for property_list_service_send_cached().
+ */
+static plist_t device_link_build_ping(void *user_data)
+{
+	plist_t array = plist_new_array();
+	plist_array_append_item(array, plist_new_string("DLMessagePing"));
+	plist_array_append_item(array, plist_new_string((const char*)user_data));
+	return array;
+}
+
 /**
  * Sends a DLMessagePing plist.
  *
@@ -301,12 +374,12 @@ device_link_service_error_t device_link_service_send_ping(device_link_service_cl
 	if (!client || !client->parent || !message)
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 
-	plist_t array = plist_new_array();
-	plist_array_append_item(array, plist_new_string("DLMessagePing"));
-	plist_array_append_item(array, plist_new_string(message));
+	char *key = NULL;
+	if (asprintf(&key, "DLMessagePing\n%s", message) < 0 || !key)
+		return DEVICE_LINK_SERVICE_E_UNKNOWN_ERROR;
 
-	device_link_service_error_t err = device_link_error(property_list_service_send_binary_plist(client->parent, array));
-	plist_free(array);
+	device_link_service_error_t err = device_link_send_cached(client, key, device_link_build_ping, (void*)message);
+	free(key);
 
 	return err;
 }
@@ -334,12 +407,204 @@ device_link_service_error_t device_link_service_send_process_message(device_link
 	plist_array_append_item(array, plist_new_string("DLMessageProcessMessage"));
 	plist_array_append_item(array, plist_copy(message));
 
-	device_link_service_error_t err = device_link_error(property_list_service_send_binary_plist(client->parent, array));
+	device_link_service_error_t err = device_link_error(device_link_send_plist(client, array));
 	plist_free(array);
 
 	return err;
 }
 
+struct device_link_process_message_builder {
+	property_list_service_build_cb_t build;
+	void *user_data;
+};
+
+/**
+ * Wraps the message returned by the caller supplied build callback in a
+ * DLMessageProcessMessage plist.
+ */
+static plist_t device_link_build_process_message(void *user_data)
+{
+	struct device_link_process_message_builder *builder = (struct device_link_process_message_builder*)user_data;
+	plist_t message = builder->build(builder->user_data);
+	if (!message)
+		return NULL;
+
+	if (plist_get_node_type(message) != PLIST_DICT) {
+		plist_free(message);
+		return NULL;
+	}
+
+	plist_t array = plist_new_array();
+	plist_array_append_item(array, plist_new_string("DLMessageProcessMessage"));
+	plist_array_append_item(array, message);
+	return array;
+}
+
+/**
+ * Sends a constant DLMessageProcessMessage plist, reusing its serialized
+ * form if it has been sent with this client before.
+ *
+ * @param client The device link service client to use.
+ * @param key String that uniquely identifies the message content.
+ * @param build Callback returning a newly allocated PLIST_DICT message,
+ *     only invoked if the message is not cached yet.
+ * @param user_data User data passed to the build callback.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *     DEVICE_LINK_SERVICE_E_INVALID_ARG if one of the arguments is invalid,
+ *     DEVICE_LINK_SERVICE_E_PLIST_ERROR if the message could not be built,
+ *     or DEVICE_LINK_SERVICE_E_MUX_ERROR if it could not be sent.
+ */
+device_link_service_error_t device_link_service_send_process_message_cached(device_link_service_client_t client, const char *key, property_list_service_build_cb_t build, void *user_data)
+{
+	if (!client || !client->parent || !key || !build)
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	struct device_link_process_message_builder builder = { build, user_data };
+
+	return device_link_send_cached(client, key, device_link_build_process_message, &builder);
+}
+
+/**
+ * Sets the size of the buffer used to coalesce raw data sent with
+ * device_link_service_send_raw(). Any data still in the buffer is flushed.
+ *
+ * @param client The device link service client to use.
+ * @param size Size of the buffer in bytes, or 0 to send raw data unbuffered.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *     DEVICE_LINK_SERVICE_E_INVALID_ARG if client is invalid,
+ *     DEVICE_LINK_SERVICE_E_MUX_ERROR if flushing the buffer failed, or
+ *     DEVICE_LINK_SERVICE_E_UNKNOWN_ERROR if the buffer could not be allocated.
+ */
+device_link_service_error_t device_link_service_set_raw_buffer_size(device_link_service_client_t client, uint32_t size)
+{
+	if (!client || !client->parent)
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	device_link_service_error_t err = device_link_service_flush_raw(client);
+	if (err != DEVICE_LINK_SERVICE_E_SUCCESS)
+		return err;
+
+	free(client->raw_buffer);
+	client->raw_buffer = NULL;
+	client->raw_buffer_size = 0;
+
+	if (size > 0) {
+		client->raw_buffer = (char*)malloc(size);
+		if (!client->raw_buffer)
+			return DEVICE_LINK_SERVICE_E_UNKNOWN_ERROR;
+		client->raw_buffer_size = size;
+	}
+
+	return DEVICE_LINK_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Sends raw data bypassing the DL* message framing. If a raw buffer has
+ * been set up with device_link_service_set_raw_buffer_size() small writes
+ * are coalesced and only sent once the buffer is full, when
+ * device_link_service_flush_raw() is called, or before the next DL*
+ * message is sent or received.
+ *
+ * @param client The device link service client to use.
+ * @param data The data to send.
+ * @param length Number of bytes to send.
+ * @param sent Pointer that receives the number of bytes accepted.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *     DEVICE_LINK_SERVICE_E_INVALID_ARG if one of the parameters is invalid,
+ *     or DEVICE_LINK_SERVICE_E_MUX_ERROR if sending the data failed.
+ */
+device_link_service_error_t device_link_service_send_raw(device_link_service_client_t client, const char *data, uint32_t length, uint32_t *sent)
+{
+	if (!client || !client->parent || !data || !sent)
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	*sent = 0;
+
+	if (client->raw_buffer_size == 0) {
+		return device_link_raw_send_all(client, data, length, sent);
+	}
+
+	if (client->raw_buffer_len + length > client->raw_buffer_size) {
+		device_link_service_error_t err = device_link_service_flush_raw(client);
+		if (err != DEVICE_LINK_SERVICE_E_SUCCESS)
+			return err;
+	}
+
+	if (length >= client->raw_buffer_size) {
+		return device_link_raw_send_all(client, data, length, sent);
+	}
+
+	memcpy(client->raw_buffer + client->raw_buffer_len, data, length);
+	client->raw_buffer_len += length;
+	*sent = length;
+
+	return DEVICE_LINK_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Sends any raw data that is still held in the raw send buffer.
+ *
+ * @param client The device link service client to use.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *     DEVICE_LINK_SERVICE_E_INVALID_ARG if client is invalid,
+ *     or DEVICE_LINK_SERVICE_E_MUX_ERROR if sending the data failed.
+ */
+device_link_service_error_t device_link_service_flush_raw(device_link_service_client_t client)
+{
+	if (!client || !client->parent)
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	if (client->raw_buffer_len == 0)
+		return DEVICE_LINK_SERVICE_E_SUCCESS;
+
+	uint32_t len = client->raw_buffer_len;
+	client->raw_buffer_len = 0;
+
+	return device_link_raw_send_all(client, client->raw_buffer, len, NULL);
+}
+
+/**
+ * Receives raw data bypassing the DL* message framing. Pending buffered
+ * raw data is flushed first.
+ *
+ * @param client The device link service client to use.
+ * @param data Buffer that will be filled with the received data.
+ * @param length Number of bytes to receive.
+ * @param received Pointer that receives the number of bytes received.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS if any or no data was received,
+ *     DEVICE_LINK_SERVICE_E_INVALID_ARG if one of the parameters is invalid,
+ *     or DEVICE_LINK_SERVICE_E_MUX_ERROR if flushing pending data failed.
+ */
+device_link_service_error_t device_link_service_receive_raw(device_link_service_client_t client, char *data, uint32_t length, uint32_t *received)
+{
+	if (!client || !client->parent || !data || !received)
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	*received = 0;
+
+	device_link_service_error_t err = device_link_service_flush_raw(client);
+	if (err != DEVICE_LINK_SERVICE_E_SUCCESS)
+		return err;
+
+	service_client_t raw = client->parent->parent;
+	uint32_t done = 0;
+	while (done < length) {
+		uint32_t bytes = 0;
+		service_receive(raw, data + done, length - done, &bytes);
+		if (bytes == 0)
+			break;
+		done += bytes;
+	}
+	*received = done;
+
+	return DEVICE_LINK_SERVICE_E_SUCCESS;
+}
+
 /**
  * Receives a DL* message plist
  *
@@ -363,7 +628,7 @@ device_link_service_error_t device_link_service_receive_message(device_link_serv
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 
 	*msg_plist = NULL;
-	device_link_service_error_t err = device_link_error(property_list_service_receive_plist(client->parent, msg_plist));
+	device_link_service_error_t err = device_link_error(device_link_receive_plist(client, msg_plist));
 	if (err != DEVICE_LINK_SERVICE_E_SUCCESS) {
 		return err;
 	}
@@ -394,7 +659,7 @@ device_link_service_error_t device_link_service_receive_process_message(device_l
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 
 	plist_t pmsg = NULL;
-	device_link_service_error_t err = device_link_error(property_list_service_receive_plist(client->parent, &pmsg));
+	device_link_service_error_t err = device_link_error(device_link_receive_plist(client, &pmsg));
 	if (err != DEVICE_LINK_SERVICE_E_SUCCESS) {
 		return err;
 	}
@@ -433,6 +698,30 @@ leave:
 	return err;
 }
 
+/**
+ * Receives the next message as raw payload without parsing it, see
+ * property_list_service_receive_buffer().
+ *
+ * @param client The connected device link service client used for receiving.
+ * @param buffer Pointer that receives the payload, to be freed by the caller.
+ * @param length Pointer that receives the size of the payload.
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *    DEVICE_LINK_SERVICE_E_INVALID_ARG when one of the parameters is invalid,
+ *    or DEVICE_LINK_SERVICE_E_MUX_ERROR if receiving from device fails.
+ */
+device_link_service_error_t device_link_service_receive_buffer(device_link_service_client_t client, char **buffer, uint32_t *length)
+{
+	if (!client || !client->parent || !buffer || !length)
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+
+	device_link_service_error_t err = device_link_service_flush_raw(client);
+	if (err != DEVICE_LINK_SERVICE_E_SUCCESS)
+		return err;
+
+	return device_link_error(property_list_service_receive_buffer(client->parent, buffer, length, 30000));
+}
+
 /**
  * Generic device link service send function.
  *
@@ -449,7 +738,29 @@ device_link_service_error_t device_link_service_send(device_link_service_client_
 	if (!client || !plist) {
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 	}
-	return device_link_error(property_list_service_send_binary_plist(client->parent, plist));
+	return device_link_error(device_link_send_plist(client, plist));
+}
+
+/**
+ * Sends a constant message, reusing its serialized form if it has been
+ * sent with this client before.
+ *
+ * @param client The device link service client to use for sending
+ * @param key String that uniquely identifies the message content
+ * @param build Callback returning the newly allocated message, only invoked
+ *     if the message is not cached yet
+ * @param user_data User data passed to the build callback
+ *
+ * @return DEVICE_LINK_SERVICE_E_SUCCESS on success,
+ *     DEVICE_LINK_SERVICE_E_INVALID_ARG if one of the arguments is invalid,
+ *     or another DEVICE_LINK_SERVICE_E_* error code otherwise.
+ */
+device_link_service_error_t device_link_service_send_cached(device_link_service_client_t client, const char *key, property_list_service_build_cb_t build, void *user_data)
+{
+	if (!client || !client->parent || !key || !build) {
+		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
+	}
+	return device_link_send_cached(client, key, build, user_data);
 }
 
 /* Generic device link service receive function.
@@ -469,6 +780,6 @@ device_link_service_error_t device_link_service_receive(device_link_service_clie
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 	}
 
-	return device_link_error(property_list_service_receive_plist(client->parent, plist));
+	return device_link_error(device_link_receive_plist(client, plist));
 }
 
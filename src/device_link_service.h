@@ -38,6 +38,9 @@ typedef enum {
 
 struct device_link_service_client_private {
 	property_list_service_client_t parent;
+	char *raw_buffer;
+	uint32_t raw_buffer_size;
+	uint32_t raw_buffer_len;
 };
 
 typedef struct device_link_service_client_private *device_link_service_client_t;
@@ -48,9 +51,16 @@ device_link_service_error_t device_link_service_version_exchange(device_link_ser
 device_link_service_error_t device_link_service_send_ping(device_link_service_client_t client, const char *message);
 device_link_service_error_t device_link_service_receive_message(device_link_service_client_t client, plist_t *msg_plist, char **dlmessage);
 device_link_service_error_t device_link_service_send_process_message(device_link_service_client_t client, plist_t message);
+device_link_service_error_t device_link_service_send_process_message_cached(device_link_service_client_t client, const char *key, property_list_service_build_cb_t build, void *user_data);
 device_link_service_error_t device_link_service_receive_process_message(device_link_service_client_t client, plist_t *message);
+device_link_service_error_t device_link_service_receive_buffer(device_link_service_client_t client, char **buffer, uint32_t *length);
 device_link_service_error_t device_link_service_disconnect(device_link_service_client_t client, const char *message);
 device_link_service_error_t device_link_service_send(device_link_service_client_t client, plist_t plist);
+device_link_service_error_t device_link_service_send_cached(device_link_service_client_t client, const char *key, property_list_service_build_cb_t build, void *user_data);
+device_link_service_error_t device_link_service_set_raw_buffer_size(device_link_service_client_t client, uint32_t size);
+device_link_service_error_t device_link_service_send_raw(device_link_service_client_t client, const char *data, uint32_t length, uint32_t *sent);
+device_link_service_error_t device_link_service_flush_raw(device_link_service_client_t client);
+device_link_service_error_t device_link_service_receive_raw(device_link_service_client_t client, char *data, uint32_t length, uint32_t *received);
 device_link_service_error_t device_link_service_receive(device_link_service_client_t client, plist_t *plist);
 
 #endif
@@ -32,6 +32,9 @@
 #define RESULT_FAILURE 1
 #define RESULT_UNKNOWN_REQUEST 2
 
+/* number of requests sent ahead of their replies by query_multiple */
+#define QUERY_WINDOW 8
+
 /**
  * Internally used function for checking the result from a service response
  * plist to a previously sent request.
@@ -160,7 +163,7 @@ static diagnostics_relay_error_t diagnostics_relay_send(diagnostics_relay_client
 	diagnostics_relay_error_t ret = DIAGNOSTICS_RELAY_E_SUCCESS;
 	property_list_service_error_t err;
 
-	err = property_list_service_send_xml_plist(client->parent, plist);
+	err = property_list_service_send_plist(client->parent, plist);
 	if (err != PROPERTY_LIST_SERVICE_E_SUCCESS) {
 		ret = DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
 	}
@@ -456,3 +459,60 @@ LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_query_ioregistr
 	plist_free(dict);
 	return ret;
 }
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_query_multiple(diagnostics_relay_client_t client, plist_t requests, plist_t* results)
+{
+	if (!client || plist_get_node_type(requests) != PLIST_ARRAY || results == NULL)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	uint32_t count = plist_array_get_size(requests);
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		plist_t request = plist_array_get_item(requests, i);
+		const char *name = NULL;
+		if (plist_get_node_type(request) == PLIST_DICT) {
+			name = plist_get_string_ptr(plist_dict_get_item(request, "Request"), NULL);
+		}
+		if (!name || !strcmp(name, "Goodbye") || !strcmp(name, "Sleep") || !strcmp(name, "Restart") || !strcmp(name, "Shutdown")) {
+			debug_info("ERROR: invalid request at index %d", i);
+			return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+		}
+	}
+
+	diagnostics_relay_error_t ret = DIAGNOSTICS_RELAY_E_SUCCESS;
+	plist_t replies = plist_new_array();
+	uint32_t sent = 0;
+	uint32_t received = 0;
+
+	while (received < count) {
+		/* keep up to QUERY_WINDOW requests in flight */
+		while (sent < count && sent - received < QUERY_WINDOW) {
+			ret = diagnostics_relay_send(client, plist_array_get_item(requests, sent));
+			if (ret != DIAGNOSTICS_RELAY_E_SUCCESS) {
+				break;
+			}
+			sent++;
+		}
+		if (ret != DIAGNOSTICS_RELAY_E_SUCCESS) {
+			break;
+		}
+
+		plist_t dict = NULL;
+		ret = diagnostics_relay_receive(client, &dict);
+		if (ret != DIAGNOSTICS_RELAY_E_SUCCESS) {
+			plist_free(dict);
+			break;
+		}
+		plist_array_append_item(replies, dict);
+		received++;
+	}
+
+	if (ret != DIAGNOSTICS_RELAY_E_SUCCESS) {
+		debug_info("ERROR: query failed after %d of %d replies", received, count);
+		plist_free(replies);
+		return ret;
+	}
+
+	*results = replies;
+	return ret;
+}
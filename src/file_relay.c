@@ -24,10 +24,46 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "file_relay.h"
 #include "property_list_service.h"
 #include "common/debug.h"
 
+#define FILE_RELAY_RECV_BUFFER_SIZE 65536
+
+#define CPIO_ODC_HEADER_SIZE 76
+#define CPIO_NEWC_HEADER_SIZE 110
+#define CPIO_MAX_NAME_SIZE 4096
+#define CPIO_TRAILER "TRAILER!!!"
+
+enum cpio_state {
+	CPIO_STATE_HEADER,
+	CPIO_STATE_NAME,
+	CPIO_STATE_DATA,
+	CPIO_STATE_DONE
+};
+
+/* incremental reader for odc ("070707") and newc ("070701"/"070702") CPIO archives */
+struct cpio_reader {
+	enum cpio_state state;
+	char header[CPIO_NEWC_HEADER_SIZE];
+	uint32_t header_size;
+	uint32_t header_length;
+	int newc;
+	char name[CPIO_MAX_NAME_SIZE];
+	uint32_t name_size;
+	uint32_t name_length;
+	uint64_t remaining;
+	uint32_t skip;
+	int extract;
+	file_relay_entry_t entry;
+	file_relay_entry_filter_cb_t filter;
+	file_relay_entry_cb_t entry_cb;
+	void *user_data;
+};
+
 LIBIMOBILEDEVICE_API file_relay_error_t file_relay_client_new(idevice_t device, lockdownd_service_descriptor_t service, file_relay_client_t *client)
 {
 	if (!device || !service || service->port == 0 || !client || *client) {
@@ -84,7 +120,7 @@ LIBIMOBILEDEVICE_API file_relay_error_t file_relay_request_sources_timeout(file_
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "Sources", array);
 
-	if (property_list_service_send_xml_plist(client->parent, dict) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+	if (property_list_service_send_plist(client->parent, dict) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
 		debug_info("ERROR: Could not send request to device!");
 		err = FILE_RELAY_E_MUX_ERROR;
 		goto leave;
@@ -163,3 +199,277 @@ LIBIMOBILEDEVICE_API file_relay_error_t file_relay_request_sources(file_relay_cl
 {
 	return file_relay_request_sources_timeout(client, sources, connection, 60000);
 }
+
+static int cpio_parse_number(const char *str, size_t length, int base, uint64_t *value)
+{
+	uint64_t v = 0;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		int digit;
+		char c = str[i];
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (base == 16 && c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else if (base == 16 && c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		} else {
+			return -1;
+		}
+		if (digit >= base) {
+			return -1;
+		}
+		v = v * base + digit;
+	}
+	*value = v;
+	return 0;
+}
+
+static file_relay_error_t cpio_reader_parse_header(struct cpio_reader *reader)
+{
+	const char *hdr = reader->header;
+	uint64_t mode = 0;
+	uint64_t mtime = 0;
+	uint64_t namesize = 0;
+	uint64_t filesize = 0;
+	int res;
+
+	if (reader->newc) {
+		res = cpio_parse_number(hdr + 14, 8, 16, &mode)
+			| cpio_parse_number(hdr + 46, 8, 16, &mtime)
+			| cpio_parse_number(hdr + 54, 8, 16, &filesize)
+			| cpio_parse_number(hdr + 94, 8, 16, &namesize);
+	} else {
+		res = cpio_parse_number(hdr + 18, 6, 8, &mode)
+			| cpio_parse_number(hdr + 48, 11, 8, &mtime)
+			| cpio_parse_number(hdr + 59, 6, 8, &namesize)
+			| cpio_parse_number(hdr + 65, 11, 8, &filesize);
+	}
+	if (res != 0 || namesize == 0 || namesize > CPIO_MAX_NAME_SIZE) {
+		debug_info("ERROR: Invalid CPIO header");
+		return FILE_RELAY_E_ARCHIVE_ERROR;
+	}
+
+	memset(&reader->entry, '\0', sizeof(file_relay_entry_t));
+	reader->entry.mode = (uint32_t)mode;
+	reader->entry.mtime = mtime;
+	reader->entry.size = filesize;
+	reader->name_size = (uint32_t)namesize;
+	reader->name_length = 0;
+	reader->state = CPIO_STATE_NAME;
+
+	return FILE_RELAY_E_SUCCESS;
+}
+
+static file_relay_error_t cpio_reader_start_entry(struct cpio_reader *reader)
+{
+	reader->name[reader->name_size - 1] = '\0';
+	if (reader->newc) {
+		reader->skip = (4 - ((reader->header_size + reader->name_size) & 3)) & 3;
+	}
+	if (strcmp(reader->name, CPIO_TRAILER) == 0) {
+		reader->state = CPIO_STATE_DONE;
+		return FILE_RELAY_E_SUCCESS;
+	}
+	reader->entry.name = reader->name;
+	reader->extract = (reader->filter) ? reader->filter(&reader->entry, reader->user_data) : 1;
+	reader->remaining = reader->entry.size;
+	reader->state = CPIO_STATE_DATA;
+
+	return FILE_RELAY_E_SUCCESS;
+}
+
+static file_relay_error_t cpio_reader_finish_entry(struct cpio_reader *reader)
+{
+	if (reader->extract && reader->entry_cb(&reader->entry, NULL, 0, reader->user_data) != 0) {
+		return FILE_RELAY_E_ABORTED;
+	}
+	if (reader->newc) {
+		reader->skip += (4 - (reader->entry.size & 3)) & 3;
+	}
+	reader->header_length = 0;
+	reader->state = CPIO_STATE_HEADER;
+
+	return FILE_RELAY_E_SUCCESS;
+}
+
+/**
+ * Feeds uncompressed archive data to the CPIO reader. Entry data is passed
+ * to the entry callback directly from the given buffer.
+ */
+static file_relay_error_t cpio_reader_feed(struct cpio_reader *reader, const char *data, size_t length)
+{
+	file_relay_error_t err = FILE_RELAY_E_SUCCESS;
+
+	while (err == FILE_RELAY_E_SUCCESS && reader->state != CPIO_STATE_DONE) {
+		if (reader->state == CPIO_STATE_DATA && reader->remaining == 0) {
+			err = cpio_reader_finish_entry(reader);
+			continue;
+		}
+		if (length == 0) {
+			break;
+		}
+		if (reader->skip > 0) {
+			size_t amount = (length < reader->skip) ? length : reader->skip;
+			reader->skip -= amount;
+			data += amount;
+			length -= amount;
+			continue;
+		}
+
+		size_t amount = 0;
+		switch (reader->state) {
+		case CPIO_STATE_HEADER:
+			if (reader->header_length < 6) {
+				amount = 6 - reader->header_length;
+			} else {
+				amount = reader->header_size - reader->header_length;
+			}
+			amount = (length < amount) ? length : amount;
+			memcpy(reader->header + reader->header_length, data, amount);
+			reader->header_length += amount;
+			if (reader->header_length == 6) {
+				if (memcmp(reader->header, "070707", 6) == 0) {
+					reader->newc = 0;
+					reader->header_size = CPIO_ODC_HEADER_SIZE;
+				} else if (memcmp(reader->header, "070701", 6) == 0 || memcmp(reader->header, "070702", 6) == 0) {
+					reader->newc = 1;
+					reader->header_size = CPIO_NEWC_HEADER_SIZE;
+				} else {
+					debug_info("ERROR: Invalid CPIO magic");
+					err = FILE_RELAY_E_ARCHIVE_ERROR;
+				}
+			} else if (reader->header_length == reader->header_size) {
+				err = cpio_reader_parse_header(reader);
+			}
+			break;
+		case CPIO_STATE_NAME:
+			amount = reader->name_size - reader->name_length;
+			amount = (length < amount) ? length : amount;
+			memcpy(reader->name + reader->name_length, data, amount);
+			reader->name_length += amount;
+			if (reader->name_length == reader->name_size) {
+				err = cpio_reader_start_entry(reader);
+			}
+			break;
+		case CPIO_STATE_DATA:
+			amount = (length < reader->remaining) ? length : (size_t)reader->remaining;
+			if (amount > UINT32_MAX) {
+				amount = UINT32_MAX;
+			}
+			if (reader->extract && reader->entry_cb(&reader->entry, data, (uint32_t)amount, reader->user_data) != 0) {
+				err = FILE_RELAY_E_ABORTED;
+				break;
+			}
+			reader->entry.offset += amount;
+			reader->remaining -= amount;
+			break;
+		default:
+			break;
+		}
+		data += amount;
+		length -= amount;
+	}
+
+	return err;
+}
+
+LIBIMOBILEDEVICE_API file_relay_error_t file_relay_extract_archive(idevice_connection_t connection, file_relay_entry_filter_cb_t filter, file_relay_entry_cb_t entry_cb, void *user_data, unsigned int timeout)
+{
+	if (!connection || !entry_cb) {
+		return FILE_RELAY_E_INVALID_ARG;
+	}
+
+	struct cpio_reader *reader = (struct cpio_reader*)calloc(1, sizeof(struct cpio_reader));
+	char *buf = (char*)malloc(FILE_RELAY_RECV_BUFFER_SIZE);
+	if (!reader || !buf) {
+		free(reader);
+		free(buf);
+		return FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+	reader->filter = filter;
+	reader->entry_cb = entry_cb;
+	reader->user_data = user_data;
+
+	file_relay_error_t err = FILE_RELAY_E_SUCCESS;
+	uint32_t have = 0;
+	int compressed = -1;
+#ifdef HAVE_ZLIB
+	z_stream strm;
+	int stream_end = 0;
+	char *out = NULL;
+	memset(&strm, '\0', sizeof(z_stream));
+#endif
+
+	while (err == FILE_RELAY_E_SUCCESS && reader->state != CPIO_STATE_DONE) {
+		uint32_t recvd = 0;
+		idevice_error_t ierr = idevice_connection_receive_timeout(connection, buf + have, FILE_RELAY_RECV_BUFFER_SIZE - have, &recvd, timeout);
+		if (ierr != IDEVICE_E_SUCCESS || recvd == 0) {
+			debug_info("ERROR: Archive ended prematurely (%d)", ierr);
+			err = FILE_RELAY_E_MUX_ERROR;
+			break;
+		}
+		have += recvd;
+
+		if (compressed < 0) {
+			/* the gzip magic decides how the stream is processed */
+			if (have < 2) {
+				continue;
+			}
+			compressed = ((unsigned char)buf[0] == 0x1f && (unsigned char)buf[1] == 0x8b);
+			if (compressed) {
+#ifdef HAVE_ZLIB
+				out = (char*)malloc(FILE_RELAY_RECV_BUFFER_SIZE);
+				if (!out || inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+					free(out);
+					out = NULL;
+					err = FILE_RELAY_E_UNKNOWN_ERROR;
+					break;
+				}
+#else
+				debug_info("ERROR: Compressed archives are not supported without zlib");
+				err = FILE_RELAY_E_ARCHIVE_ERROR;
+				break;
+#endif
+			}
+		}
+
+		if (!compressed) {
+			err = cpio_reader_feed(reader, buf, have);
+			have = 0;
+			continue;
+		}
+#ifdef HAVE_ZLIB
+		strm.next_in = (Bytef*)buf;
+		strm.avail_in = have;
+		while (err == FILE_RELAY_E_SUCCESS && strm.avail_in > 0 && !stream_end) {
+			strm.next_out = (Bytef*)out;
+			strm.avail_out = FILE_RELAY_RECV_BUFFER_SIZE;
+			int zres = inflate(&strm, Z_NO_FLUSH);
+			if (zres != Z_OK && zres != Z_STREAM_END) {
+				debug_info("ERROR: inflate failed (%d)", zres);
+				err = FILE_RELAY_E_ARCHIVE_ERROR;
+				break;
+			}
+			err = cpio_reader_feed(reader, out, FILE_RELAY_RECV_BUFFER_SIZE - strm.avail_out);
+			stream_end = (zres == Z_STREAM_END);
+		}
+		have = 0;
+		if (err == FILE_RELAY_E_SUCCESS && stream_end && reader->state != CPIO_STATE_DONE) {
+			debug_info("ERROR: Compressed stream ended before the CPIO trailer");
+			err = FILE_RELAY_E_ARCHIVE_ERROR;
+		}
+#endif
+	}
+
+#ifdef HAVE_ZLIB
+	if (out) {
+		inflateEnd(&strm);
+		free(out);
+	}
+#endif
+	free(buf);
+	free(reader);
+
+	return err;
+}
@@ -24,6 +24,7 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include <plist/plist.h>
 
 #include "heartbeat.h"
@@ -145,3 +146,326 @@ LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_receive_with_timeout(heartbeat_
 
 	return res;
 }
+
+static uint64_t heartbeat_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* puts entry into the wheel slot due at the given time, scheduler locked */
+static void heartbeat_wheel_insert(heartbeat_scheduler_t scheduler, struct heartbeat_entry *entry, uint64_t due_ms)
+{
+	uint64_t now = heartbeat_time_ms();
+	uint64_t ticks = (due_ms > now) ? (due_ms - now) / HEARTBEAT_WHEEL_TICK_MS : 0;
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	entry->slot = (int)((scheduler->current_slot + ticks) % HEARTBEAT_WHEEL_SLOTS);
+	entry->rounds = (uint32_t)((ticks - 1) / HEARTBEAT_WHEEL_SLOTS);
+	entry->next = scheduler->wheel[entry->slot];
+	scheduler->wheel[entry->slot] = entry;
+}
+
+/* takes entry out of its wheel slot, scheduler locked */
+static void heartbeat_wheel_unlink(heartbeat_scheduler_t scheduler, struct heartbeat_entry *entry)
+{
+	if (entry->slot < 0) {
+		return;
+	}
+	struct heartbeat_entry **p = &scheduler->wheel[entry->slot];
+	while (*p) {
+		if (*p == entry) {
+			*p = entry->next;
+			break;
+		}
+		p = &(*p)->next;
+	}
+	entry->slot = -1;
+	entry->next = NULL;
+}
+
+/* unlinks and frees an entry that is not being serviced, scheduler locked */
+static void heartbeat_entry_destroy(heartbeat_scheduler_t scheduler, struct heartbeat_entry *entry)
+{
+	struct heartbeat_entry **p = &scheduler->entries;
+	while (*p) {
+		if (*p == entry) {
+			*p = entry->next_entry;
+			break;
+		}
+		p = &(*p)->next_entry;
+	}
+	heartbeat_wheel_unlink(scheduler, entry);
+	heartbeat_client_free(entry->client);
+	free(entry->udid);
+	free(entry);
+}
+
+static struct heartbeat_entry* heartbeat_entry_find(heartbeat_scheduler_t scheduler, const char *udid)
+{
+	struct heartbeat_entry *entry;
+	for (entry = scheduler->entries; entry; entry = entry->next_entry) {
+		if (!entry->removed && !strcmp(entry->udid, udid)) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Answers a pending heartbeat request on the entry's connection, if any.
+ * Called without the scheduler lock held.
+ *
+ * @return The time the entry needs to be looked at next, or 0 if the
+ *     connection is gone.
+ */
+static uint64_t heartbeat_entry_service(struct heartbeat_entry *entry)
+{
+	plist_t message = NULL;
+	uint64_t now = heartbeat_time_ms();
+
+	heartbeat_error_t res = heartbeat_error(property_list_service_receive_plist_with_timeout(entry->client->parent, &message, 1));
+	if (res == HEARTBEAT_E_TIMEOUT || (res == HEARTBEAT_E_SUCCESS && !message)) {
+		if (entry->expected_ms > 0 && now > entry->expected_ms + entry->interval_ms) {
+			/* a whole interval without a request */
+			entry->health.missed++;
+			entry->expected_ms += entry->interval_ms;
+		}
+		return now + HEARTBEAT_WHEEL_TICK_MS;
+	}
+	if (res != HEARTBEAT_E_SUCCESS) {
+		debug_info("heartbeat connection to %s failed, error %d", entry->udid, res);
+		plist_free(message);
+		return 0;
+	}
+
+	const char *command = plist_get_string_ptr(plist_dict_get_item(message, "Command"), NULL);
+	if (!command || strcmp(command, "Marco") != 0) {
+		/* e.g. SleepyTime, the device stops sending requests */
+		debug_info("heartbeat from %s sent command %s", entry->udid, (command) ? command : "(none)");
+		plist_free(message);
+		return 0;
+	}
+
+	uint64_t interval = 0;
+	plist_get_uint_val(plist_dict_get_item(message, "Interval"), &interval);
+	plist_free(message);
+
+	plist_t reply = plist_new_dict();
+	plist_dict_set_item(reply, "Command", plist_new_string("Polo"));
+	res = heartbeat_send(entry->client, reply);
+	plist_free(reply);
+	if (res != HEARTBEAT_E_SUCCESS) {
+		return 0;
+	}
+
+	if (entry->expected_ms > 0) {
+		uint32_t delay = (now > entry->expected_ms) ? (uint32_t)(now - entry->expected_ms) : 0;
+		entry->health.last_delay_ms = delay;
+		entry->health.average_delay_ms = (entry->health.beats > 1) ? (entry->health.average_delay_ms * 7 + delay) / 8 : delay;
+		if (delay > entry->health.max_delay_ms) {
+			entry->health.max_delay_ms = delay;
+		}
+	}
+	entry->health.beats++;
+	entry->interval_ms = (interval > 0) ? (uint32_t)(interval * 1000) : 10000;
+	entry->health.interval_ms = entry->interval_ms;
+	entry->expected_ms = now + entry->interval_ms;
+
+	/* wake up a tick early so the next request gets answered right away */
+	return entry->expected_ms - HEARTBEAT_WHEEL_TICK_MS;
+}
+
+static void* heartbeat_scheduler_thread(void *arg)
+{
+	heartbeat_scheduler_t scheduler = (heartbeat_scheduler_t)arg;
+
+	mutex_lock(&scheduler->mutex);
+	while (scheduler->running) {
+		cond_wait_timeout(&scheduler->cond, &scheduler->mutex, HEARTBEAT_WHEEL_TICK_MS);
+		if (!scheduler->running) {
+			break;
+		}
+		scheduler->current_slot = (scheduler->current_slot + 1) % HEARTBEAT_WHEEL_SLOTS;
+
+		/* take out everything due in this slot */
+		struct heartbeat_entry *due = NULL;
+		struct heartbeat_entry **p = &scheduler->wheel[scheduler->current_slot];
+		while (*p) {
+			struct heartbeat_entry *entry = *p;
+			if (entry->rounds > 0) {
+				entry->rounds--;
+				p = &entry->next;
+				continue;
+			}
+			*p = entry->next;
+			entry->slot = -1;
+			entry->next = due;
+			due = entry;
+		}
+
+		while (due) {
+			struct heartbeat_entry *entry = due;
+			due = entry->next;
+			entry->next = NULL;
+
+			mutex_unlock(&scheduler->mutex);
+			uint64_t next = heartbeat_entry_service(entry);
+			mutex_lock(&scheduler->mutex);
+
+			if (next == 0) {
+				entry->health.connected = 0;
+				entry->removed = 1;
+			}
+			if (entry->removed) {
+				heartbeat_entry_destroy(scheduler, entry);
+			} else {
+				heartbeat_wheel_insert(scheduler, entry, next);
+			}
+		}
+	}
+	mutex_unlock(&scheduler->mutex);
+
+	return NULL;
+}
+
+static void heartbeat_scheduler_device_event(const idevice_event_t *event, void *user_data)
+{
+	heartbeat_scheduler_t scheduler = (heartbeat_scheduler_t)user_data;
+	if (event->event != IDEVICE_DEVICE_REMOVE || !event->udid) {
+		return;
+	}
+
+	mutex_lock(&scheduler->mutex);
+	struct heartbeat_entry *entry = heartbeat_entry_find(scheduler, event->udid);
+	if (entry) {
+		debug_info("dropping %s from heartbeat polling", event->udid);
+		entry->health.connected = 0;
+		if (entry->slot >= 0) {
+			heartbeat_entry_destroy(scheduler, entry);
+		} else {
+			/* being serviced right now, the scheduler thread frees it */
+			entry->removed = 1;
+		}
+	}
+	mutex_unlock(&scheduler->mutex);
+}
+
+LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_scheduler_new(heartbeat_scheduler_t *scheduler)
+{
+	if (!scheduler)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	heartbeat_scheduler_t sched = (heartbeat_scheduler_t)calloc(1, sizeof(struct heartbeat_scheduler_private));
+	if (!sched)
+		return HEARTBEAT_E_UNKNOWN_ERROR;
+
+	mutex_init(&sched->mutex);
+	cond_init(&sched->cond);
+	sched->running = 1;
+	if (thread_new(&sched->thread, heartbeat_scheduler_thread, sched) != 0) {
+		cond_destroy(&sched->cond);
+		mutex_destroy(&sched->mutex);
+		free(sched);
+		return HEARTBEAT_E_UNKNOWN_ERROR;
+	}
+	if (idevice_events_subscribe(&sched->subscription, heartbeat_scheduler_device_event, sched) != IDEVICE_E_SUCCESS) {
+		debug_info("WARNING: could not subscribe to device events, removed devices will only be dropped on connection errors");
+		sched->subscription = NULL;
+	}
+
+	*scheduler = sched;
+	return HEARTBEAT_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_scheduler_add(heartbeat_scheduler_t scheduler, heartbeat_client_t client, const char *udid)
+{
+	if (!scheduler || !client || !udid)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	mutex_lock(&scheduler->mutex);
+	if (heartbeat_entry_find(scheduler, udid)) {
+		mutex_unlock(&scheduler->mutex);
+		return HEARTBEAT_E_INVALID_ARG;
+	}
+
+	struct heartbeat_entry *entry = (struct heartbeat_entry*)calloc(1, sizeof(struct heartbeat_entry));
+	entry->client = client;
+	entry->udid = strdup(udid);
+	entry->health.connected = 1;
+	entry->next_entry = scheduler->entries;
+	scheduler->entries = entry;
+
+	/* poll every tick until the first request tells the interval */
+	heartbeat_wheel_insert(scheduler, entry, 0);
+	mutex_unlock(&scheduler->mutex);
+
+	return HEARTBEAT_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_scheduler_remove(heartbeat_scheduler_t scheduler, const char *udid)
+{
+	if (!scheduler || !udid)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	heartbeat_error_t res = HEARTBEAT_E_INVALID_ARG;
+	mutex_lock(&scheduler->mutex);
+	struct heartbeat_entry *entry = heartbeat_entry_find(scheduler, udid);
+	if (entry) {
+		if (entry->slot >= 0) {
+			heartbeat_entry_destroy(scheduler, entry);
+		} else {
+			entry->removed = 1;
+		}
+		res = HEARTBEAT_E_SUCCESS;
+	}
+	mutex_unlock(&scheduler->mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_scheduler_get_health(heartbeat_scheduler_t scheduler, const char *udid, struct heartbeat_health *health)
+{
+	if (!scheduler || !udid || !health)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	heartbeat_error_t res = HEARTBEAT_E_INVALID_ARG;
+	mutex_lock(&scheduler->mutex);
+	struct heartbeat_entry *entry = heartbeat_entry_find(scheduler, udid);
+	if (entry) {
+		*health = entry->health;
+		res = HEARTBEAT_E_SUCCESS;
+	}
+	mutex_unlock(&scheduler->mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_scheduler_free(heartbeat_scheduler_t scheduler)
+{
+	if (!scheduler)
+		return HEARTBEAT_E_INVALID_ARG;
+
+	if (scheduler->subscription) {
+		idevice_events_unsubscribe(scheduler->subscription);
+	}
+
+	mutex_lock(&scheduler->mutex);
+	scheduler->running = 0;
+	cond_signal(&scheduler->cond);
+	mutex_unlock(&scheduler->mutex);
+	thread_join(scheduler->thread);
+	thread_free(scheduler->thread);
+
+	while (scheduler->entries) {
+		heartbeat_entry_destroy(scheduler, scheduler->entries);
+	}
+
+	cond_destroy(&scheduler->cond);
+	mutex_destroy(&scheduler->mutex);
+	free(scheduler);
+
+	return HEARTBEAT_E_SUCCESS;
+}
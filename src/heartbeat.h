@@ -24,9 +24,38 @@
 
 #include "libimobiledevice/heartbeat.h"
 #include "property_list_service.h"
+#include "common/thread.h"
 
 struct heartbeat_client_private {
 	property_list_service_client_t parent;
 };
 
+/* keepalive scheduler timer wheel geometry */
+#define HEARTBEAT_WHEEL_TICK_MS 250
+#define HEARTBEAT_WHEEL_SLOTS 64
+
+struct heartbeat_entry {
+	struct heartbeat_entry *next;
+	struct heartbeat_entry *next_entry;
+	heartbeat_client_t client;
+	char *udid;
+	int slot;
+	uint32_t rounds;
+	int removed;
+	uint64_t expected_ms;
+	uint32_t interval_ms;
+	struct heartbeat_health health;
+};
+
+struct heartbeat_scheduler_private {
+	mutex_t mutex;
+	cond_t cond;
+	THREAD_T thread;
+	int running;
+	uint32_t current_slot;
+	struct heartbeat_entry *wheel[HEARTBEAT_WHEEL_SLOTS];
+	struct heartbeat_entry *entries;
+	idevice_subscription_context_t subscription;
+};
+
 #endif
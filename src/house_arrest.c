@@ -31,6 +31,10 @@
 #include "property_list_service.h"
 #include "afc.h"
 #include "common/debug.h"
+#include "common/thread.h"
+
+/* maximum number of threads setting up connections in house_arrest_vend_containers */
+#define HOUSE_ARREST_VEND_MAX_THREADS 8
 
 /**
  * Convert a property_list_service_error_t value to a house_arrest_error_t
@@ -105,7 +109,7 @@ LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_send_request(house_arrest
 	if (client->mode != HOUSE_ARREST_CLIENT_MODE_NORMAL)
 		return HOUSE_ARREST_E_INVALID_MODE;
 
-	house_arrest_error_t res = house_arrest_error(property_list_service_send_xml_plist(client->parent, dict));
+	house_arrest_error_t res = house_arrest_error(property_list_service_send_plist(client->parent, dict));
 	if (res != HOUSE_ARREST_E_SUCCESS) {
 		debug_info("could not send plist, error %d", res);
 	}
@@ -161,3 +165,176 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_from_house_arrest_client(house_a
 	}
 	return err;
 }
+
+struct house_arrest_vend_batch {
+	idevice_t device;
+	const char *command;
+	const char **appids;
+	unsigned int count;
+	lockdownd_service_descriptor_t *services;
+	afc_client_t *afc_clients;
+	house_arrest_error_t *errors;
+	unsigned int next;
+	mutex_t mutex;
+};
+
+/**
+ * Connects to a started house_arrest service, vends the container of the
+ * given application and turns the connection into an AFC client that owns
+ * the connection.
+ */
+static house_arrest_error_t house_arrest_vend_one(idevice_t device, lockdownd_service_descriptor_t service, const char *command, const char *appid, afc_client_t *afc_client)
+{
+	house_arrest_client_t client = NULL;
+	plist_t dict = NULL;
+
+	house_arrest_error_t err = house_arrest_client_new(device, service, &client);
+	if (err != HOUSE_ARREST_E_SUCCESS) {
+		return err;
+	}
+
+	err = house_arrest_send_command(client, command, appid);
+	if (err == HOUSE_ARREST_E_SUCCESS) {
+		err = house_arrest_get_result(client, &dict);
+	}
+	if (err == HOUSE_ARREST_E_SUCCESS) {
+		plist_t node = plist_dict_get_item(dict, "Error");
+		if (node) {
+			char *errmsg = NULL;
+			plist_get_string_val(node, &errmsg);
+			debug_info("%s for %s failed: %s", command, appid, (errmsg) ? errmsg : "(unknown)");
+			free(errmsg);
+			err = HOUSE_ARREST_E_COMMAND_FAILED;
+		} else {
+			char *status = NULL;
+			plist_get_string_val(plist_dict_get_item(dict, "Status"), &status);
+			if (!status || strcmp(status, "Complete") != 0) {
+				err = HOUSE_ARREST_E_COMMAND_FAILED;
+			}
+			free(status);
+		}
+	}
+	plist_free(dict);
+
+	if (err == HOUSE_ARREST_E_SUCCESS) {
+		if (afc_client_new_with_service_client(client->parent->parent, afc_client) == AFC_E_SUCCESS) {
+			/* hand the connection over to the AFC client */
+			(*afc_client)->free_parent = 1;
+			client->parent->parent = NULL;
+		} else {
+			err = HOUSE_ARREST_E_UNKNOWN_ERROR;
+		}
+	}
+	if (client->parent) {
+		property_list_service_client_free(client->parent);
+	}
+	free(client);
+
+	return err;
+}
+
+static void* house_arrest_vend_worker(void *arg)
+{
+	struct house_arrest_vend_batch *batch = (struct house_arrest_vend_batch*)arg;
+
+	while (1) {
+		mutex_lock(&batch->mutex);
+		unsigned int i = batch->next++;
+		mutex_unlock(&batch->mutex);
+		if (i >= batch->count) {
+			break;
+		}
+		if (!batch->services[i]) {
+			continue;
+		}
+		batch->errors[i] = house_arrest_vend_one(batch->device, batch->services[i], batch->command, batch->appids[i], &batch->afc_clients[i]);
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_vend_containers(idevice_t device, const char *command, const char **appids, unsigned int count, const char *label, afc_client_t *afc_clients, house_arrest_error_t *errors)
+{
+	if (!device || !command || !appids || count == 0 || !afc_clients)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		if (!appids[i])
+			return HOUSE_ARREST_E_INVALID_ARG;
+		afc_clients[i] = NULL;
+	}
+
+	struct house_arrest_vend_batch batch;
+	memset(&batch, '\0', sizeof(batch));
+	batch.device = device;
+	batch.command = command;
+	batch.appids = appids;
+	batch.count = count;
+	batch.afc_clients = afc_clients;
+	batch.services = (lockdownd_service_descriptor_t*)calloc(count, sizeof(lockdownd_service_descriptor_t));
+	batch.errors = (house_arrest_error_t*)calloc(count, sizeof(house_arrest_error_t));
+	const char **identifiers = (const char**)calloc(count, sizeof(const char*));
+	if (!batch.services || !batch.errors || !identifiers) {
+		free(batch.services);
+		free(batch.errors);
+		free(identifiers);
+		return HOUSE_ARREST_E_UNKNOWN_ERROR;
+	}
+
+	/* start all services with one lockdownd session */
+	lockdownd_client_t lockdown = NULL;
+	if (lockdownd_client_new_with_handshake(device, &lockdown, label) != LOCKDOWN_E_SUCCESS) {
+		free(batch.services);
+		free(batch.errors);
+		free(identifiers);
+		return HOUSE_ARREST_E_CONN_FAILED;
+	}
+	for (i = 0; i < count; i++) {
+		identifiers[i] = HOUSE_ARREST_SERVICE_NAME;
+	}
+	lockdownd_error_t lerr = lockdownd_start_services(lockdown, identifiers, count, batch.services);
+	lockdownd_client_free(lockdown);
+	free(identifiers);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		debug_info("could not start all house_arrest services, error %d", lerr);
+	}
+	for (i = 0; i < count; i++) {
+		batch.errors[i] = (batch.services[i]) ? HOUSE_ARREST_E_SUCCESS : HOUSE_ARREST_E_CONN_FAILED;
+	}
+
+	/* set up the connections in parallel */
+	mutex_init(&batch.mutex);
+	unsigned int num_threads = (count < HOUSE_ARREST_VEND_MAX_THREADS) ? count : HOUSE_ARREST_VEND_MAX_THREADS;
+	THREAD_T threads[HOUSE_ARREST_VEND_MAX_THREADS];
+	unsigned int started = 0;
+	for (i = 1; i < num_threads; i++) {
+		if (thread_new(&threads[started], house_arrest_vend_worker, &batch) != 0) {
+			break;
+		}
+		started++;
+	}
+	house_arrest_vend_worker(&batch);
+	for (i = 0; i < started; i++) {
+		thread_join(threads[i]);
+		thread_free(threads[i]);
+	}
+	mutex_destroy(&batch.mutex);
+
+	house_arrest_error_t res = HOUSE_ARREST_E_SUCCESS;
+	for (i = 0; i < count; i++) {
+		if (batch.services[i]) {
+			lockdownd_service_descriptor_free(batch.services[i]);
+		}
+		if (res == HOUSE_ARREST_E_SUCCESS && batch.errors[i] != HOUSE_ARREST_E_SUCCESS) {
+			res = batch.errors[i];
+		}
+		if (errors) {
+			errors[i] = batch.errors[i];
+		}
+	}
+	free(batch.services);
+	free(batch.errors);
+
+	return res;
+}
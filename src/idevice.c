@@ -29,6 +29,7 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include <usbmuxd.h>
 #ifdef HAVE_OPENSSL
@@ -40,13 +41,21 @@
 #endif
 
 #include "idevice.h"
+#include "lockdown.h"
+#include "broker.h"
+#include "capture.h"
 #include "common/userpref.h"
 #include "common/socket.h"
 #include "common/thread.h"
 #include "common/debug.h"
+#include "common/trace.h"
+#include "common/metrics.h"
 
 #ifdef WIN32
 #include <windows.h>
+#else
+#include <sys/select.h>
+#include <unistd.h>
 #endif
 
 #ifndef ETIMEDOUT
@@ -104,8 +113,357 @@ static void id_function(CRYPTO_THREADID *thread)
 #endif
 #endif /* HAVE_OPENSSL */
 
+/* In-process TLS session cache, keyed by device UDID and pairing host ID,
+ * so that subsequent handshakes with the same device can be resumed. */
+struct ssl_session_cache_entry {
+	char *udid;
+	char *host_id;
+#ifdef HAVE_OPENSSL
+	SSL_SESSION *session;
+#else
+	gnutls_datum_t session;
+#endif
+	struct ssl_session_cache_entry *next;
+};
+
+static struct ssl_session_cache_entry *ssl_session_cache = NULL;
+static mutex_t ssl_session_cache_mutex;
+
+static void ssl_session_cache_entry_free(struct ssl_session_cache_entry *entry)
+{
+	free(entry->udid);
+	free(entry->host_id);
+#ifdef HAVE_OPENSSL
+	if (entry->session) {
+		SSL_SESSION_free(entry->session);
+	}
+#else
+	if (entry->session.data) {
+		gnutls_free(entry->session.data);
+	}
+#endif
+	free(entry);
+}
+
+/**
+ * Finds the cache entry for the given udid and host id, and optionally
+ * unlinks it from the cache. Must be called with the cache mutex held.
+ */
+static struct ssl_session_cache_entry *ssl_session_cache_find(const char *udid, const char *host_id, int unlink)
+{
+	struct ssl_session_cache_entry *entry = ssl_session_cache;
+	struct ssl_session_cache_entry *prev = NULL;
+	while (entry) {
+		if (!strcmp(entry->udid, udid) && !strcmp(entry->host_id, host_id)) {
+			if (unlink) {
+				if (prev) {
+					prev->next = entry->next;
+				} else {
+					ssl_session_cache = entry->next;
+				}
+				entry->next = NULL;
+			}
+			return entry;
+		}
+		prev = entry;
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+/**
+ * Stores the resumable state of the given established session in the cache,
+ * replacing any previous entry for the same udid and host id.
+ */
+static void ssl_session_cache_store(const char *udid, const char *host_id, ssl_data_t ssl_data)
+{
+	if (!udid || !host_id || !ssl_data || !ssl_data->session)
+		return;
+
+	struct ssl_session_cache_entry *entry = (struct ssl_session_cache_entry*)calloc(1, sizeof(struct ssl_session_cache_entry));
+	if (!entry)
+		return;
+#ifdef HAVE_OPENSSL
+	entry->session = SSL_get1_session(ssl_data->session);
+	if (!entry->session) {
+		free(entry);
+		return;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	if (!SSL_SESSION_is_resumable(entry->session)) {
+		SSL_SESSION_free(entry->session);
+		free(entry);
+		return;
+	}
+#endif
+#else
+	if (gnutls_session_get_data2(ssl_data->session, &entry->session) != GNUTLS_E_SUCCESS) {
+		free(entry);
+		return;
+	}
+#endif
+	entry->udid = strdup(udid);
+	entry->host_id = strdup(host_id);
+
+	mutex_lock(&ssl_session_cache_mutex);
+	struct ssl_session_cache_entry *old = ssl_session_cache_find(udid, host_id, 1);
+	entry->next = ssl_session_cache;
+	ssl_session_cache = entry;
+	mutex_unlock(&ssl_session_cache_mutex);
+
+	if (old) {
+		ssl_session_cache_entry_free(old);
+	}
+}
+
+/**
+ * Removes the cache entry for the given udid and host id, e.g. after a
+ * handshake using the cached session failed.
+ */
+static void ssl_session_cache_remove(const char *udid, const char *host_id)
+{
+	if (!udid || !host_id)
+		return;
+
+	mutex_lock(&ssl_session_cache_mutex);
+	struct ssl_session_cache_entry *entry = ssl_session_cache_find(udid, host_id, 1);
+	mutex_unlock(&ssl_session_cache_mutex);
+
+	if (entry) {
+		ssl_session_cache_entry_free(entry);
+	}
+}
+
+static void ssl_session_cache_flush(void)
+{
+	mutex_lock(&ssl_session_cache_mutex);
+	struct ssl_session_cache_entry *entry = ssl_session_cache;
+	ssl_session_cache = NULL;
+	mutex_unlock(&ssl_session_cache_mutex);
+
+	while (entry) {
+		struct ssl_session_cache_entry *next = entry->next;
+		ssl_session_cache_entry_free(entry);
+		entry = next;
+	}
+}
+
+/* Parsed pair record credentials and TLS context, shared and reference
+ * counted across all SSL connections to the same device. The cache holds
+ * one reference per entry, each SSL connection holds another one. */
+struct ssl_credentials {
+	char *udid;
+	char *host_id;
+	int legacy;
+	int refcount;
+#ifdef HAVE_OPENSSL
+	SSL_CTX *ctx;
+#else
+	gnutls_certificate_credentials_t certificate;
+	gnutls_x509_privkey_t root_privkey;
+	gnutls_x509_crt_t root_cert;
+	gnutls_x509_privkey_t host_privkey;
+	gnutls_x509_crt_t host_cert;
+#endif
+	struct ssl_credentials *next;
+};
+
+static struct ssl_credentials *ssl_credentials_cache = NULL;
+static mutex_t ssl_credentials_mutex;
+
+static void ssl_credentials_free(struct ssl_credentials *creds)
+{
+	free(creds->udid);
+	free(creds->host_id);
+#ifdef HAVE_OPENSSL
+	if (creds->ctx) {
+		SSL_CTX_free(creds->ctx);
+	}
+#else
+	if (creds->certificate) {
+		gnutls_certificate_free_credentials(creds->certificate);
+	}
+	if (creds->root_cert) {
+		gnutls_x509_crt_deinit(creds->root_cert);
+	}
+	if (creds->host_cert) {
+		gnutls_x509_crt_deinit(creds->host_cert);
+	}
+	if (creds->root_privkey) {
+		gnutls_x509_privkey_deinit(creds->root_privkey);
+	}
+	if (creds->host_privkey) {
+		gnutls_x509_privkey_deinit(creds->host_privkey);
+	}
+#endif
+	free(creds);
+}
+
+/**
+ * Drops a reference to the given credentials and frees them once the last
+ * reference is gone.
+ */
+static void ssl_credentials_release(struct ssl_credentials *creds)
+{
+	if (!creds)
+		return;
+
+	mutex_lock(&ssl_credentials_mutex);
+	int refcount = --creds->refcount;
+	mutex_unlock(&ssl_credentials_mutex);
+
+	if (refcount == 0) {
+		ssl_credentials_free(creds);
+	}
+}
+
+static void ssl_credentials_flush(void)
+{
+	mutex_lock(&ssl_credentials_mutex);
+	struct ssl_credentials *creds = ssl_credentials_cache;
+	ssl_credentials_cache = NULL;
+	mutex_unlock(&ssl_credentials_mutex);
+
+	while (creds) {
+		struct ssl_credentials *next = creds->next;
+		creds->next = NULL;
+		ssl_credentials_release(creds);
+		creds = next;
+	}
+}
+
+/* Process-wide registry of attached devices, maintained from usbmuxd
+ * events while subscribed, so idevice_new() can resolve a UDID without
+ * querying usbmuxd each time. */
+struct device_registry_entry {
+	usbmuxd_device_info_t info;
+	struct device_registry_entry *next;
+};
+
+static struct device_registry_entry *device_registry = NULL;
+static int device_registry_active = 0;
+static mutex_t device_registry_mutex;
+
+/* protects the list of event subscribers */
+static mutex_t event_subscribers_mutex;
+
+/* protects the process-wide and per-device network options */
+static mutex_t network_options_mutex;
+static mutex_t pending_fds_mutex;
+
+static void device_registry_clear(void)
+{
+	mutex_lock(&device_registry_mutex);
+	struct device_registry_entry *entry = device_registry;
+	device_registry = NULL;
+	device_registry_active = 0;
+	mutex_unlock(&device_registry_mutex);
+
+	while (entry) {
+		struct device_registry_entry *next = entry->next;
+		free(entry);
+		entry = next;
+	}
+}
+
+static void device_registry_update(const usbmuxd_event_t *event)
+{
+	struct device_registry_entry *entry = NULL;
+	struct device_registry_entry *prev = NULL;
+
+	mutex_lock(&device_registry_mutex);
+	if (!device_registry_active) {
+		mutex_unlock(&device_registry_mutex);
+		return;
+	}
+	entry = device_registry;
+	while (entry) {
+		if (entry->info.handle == event->device.handle) {
+			break;
+		}
+		prev = entry;
+		entry = entry->next;
+	}
+	switch (event->event) {
+	case UE_DEVICE_ADD:
+		if (!entry) {
+			entry = (struct device_registry_entry*)malloc(sizeof(struct device_registry_entry));
+			if (!entry) {
+				break;
+			}
+			entry->next = device_registry;
+			device_registry = entry;
+		}
+		memcpy(&entry->info, &event->device, sizeof(usbmuxd_device_info_t));
+		break;
+	case UE_DEVICE_REMOVE:
+		if (entry) {
+			if (prev) {
+				prev->next = entry->next;
+			} else {
+				device_registry = entry->next;
+			}
+			free(entry);
+		}
+		break;
+	default:
+		break;
+	}
+	mutex_unlock(&device_registry_mutex);
+}
+
+/**
+ * Looks up the device with the given udid in the registry, honoring the
+ * lookup options like usbmuxd_get_device() does.
+ *
+ * @return 1 if the device was found and copied to muxdev, 0 if the
+ *    registry can't answer the query and usbmuxd must be asked.
+ */
+static int device_registry_lookup(const char *udid, usbmuxd_device_info_t *muxdev, int usbmux_options)
+{
+	int found = 0;
+
+	if (!udid) {
+		return 0;
+	}
+	if (!(usbmux_options & (DEVICE_LOOKUP_USBMUX | DEVICE_LOOKUP_NETWORK))) {
+		usbmux_options |= DEVICE_LOOKUP_USBMUX;
+	}
+
+	mutex_lock(&device_registry_mutex);
+	if (device_registry_active) {
+		struct device_registry_entry *usb = NULL;
+		struct device_registry_entry *net = NULL;
+		struct device_registry_entry *entry = device_registry;
+		while (entry) {
+			if (!strcmp(entry->info.udid, udid)) {
+				if (entry->info.conn_type == CONNECTION_TYPE_USB && (usbmux_options & DEVICE_LOOKUP_USBMUX) && !usb) {
+					usb = entry;
+				} else if (entry->info.conn_type == CONNECTION_TYPE_NETWORK && (usbmux_options & DEVICE_LOOKUP_NETWORK) && !net) {
+					net = entry;
+				}
+			}
+			entry = entry->next;
+		}
+		entry = (usbmux_options & DEVICE_LOOKUP_PREFER_NETWORK) ? ((net) ? net : usb) : ((usb) ? usb : net);
+		if (entry) {
+			memcpy(muxdev, &entry->info, sizeof(usbmuxd_device_info_t));
+			found = 1;
+		}
+	}
+	mutex_unlock(&device_registry_mutex);
+
+	return found;
+}
+
 static void internal_idevice_init(void)
 {
+	mutex_init(&ssl_credentials_mutex);
+	mutex_init(&device_registry_mutex);
+	mutex_init(&event_subscribers_mutex);
+	mutex_init(&network_options_mutex);
+	mutex_init(&pending_fds_mutex);
+	mutex_init(&ssl_session_cache_mutex);
 #ifdef HAVE_OPENSSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
 	int i;
@@ -131,6 +489,15 @@ static void internal_idevice_init(void)
 
 static void internal_idevice_deinit(void)
 {
+	ssl_session_cache_flush();
+	mutex_destroy(&ssl_session_cache_mutex);
+	ssl_credentials_flush();
+	mutex_destroy(&ssl_credentials_mutex);
+	device_registry_clear();
+	mutex_destroy(&device_registry_mutex);
+	mutex_destroy(&event_subscribers_mutex);
+	mutex_destroy(&network_options_mutex);
+	mutex_destroy(&pending_fds_mutex);
 #ifdef HAVE_OPENSSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
 	int i;
@@ -187,44 +554,258 @@ static void __attribute__((destructor)) libimobiledevice_deinitialize(void)
 }
 #endif
 
-static idevice_event_cb_t event_cb = NULL;
+/* Number of events that can be queued for a single subscriber */
+#define IDEVICE_EVENT_QUEUE_SIZE 256
+
+struct idevice_event_entry {
+	enum idevice_event_type event;
+	enum idevice_connection_type conn_type;
+	char udid[sizeof(((usbmuxd_device_info_t*)NULL)->udid)];
+};
+
+/* Each subscriber owns a single-producer/single-consumer ring buffer that
+ * is filled from the usbmuxd event thread and drained by the subscriber's
+ * own dispatch thread. */
+struct idevice_subscription_context {
+	idevice_event_cb_t callback;
+	void *user_data;
+	struct idevice_event_entry queue[IDEVICE_EVENT_QUEUE_SIZE];
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	int running;
+	int self_free;
+	mutex_t mutex;
+	cond_t cond;
+	THREAD_T thread;
+	struct idevice_subscription_context *next;
+};
+
+static struct idevice_subscription_context *event_subscribers = NULL;
+static int usbmux_subscribed = 0;
+static idevice_subscription_context_t legacy_event_context = NULL;
+
+static void event_context_free(idevice_subscription_context_t context)
+{
+	cond_destroy(&context->cond);
+	mutex_destroy(&context->mutex);
+	free(context);
+}
 
-static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
+/**
+ * Queues an event for the given subscriber without blocking.
+ * Only called from the producer side with event_subscribers_mutex held.
+ */
+static void event_queue_push(idevice_subscription_context_t context, const struct idevice_event_entry *entry)
+{
+	uint32_t head = context->head;
+	uint32_t next = (head + 1) % IDEVICE_EVENT_QUEUE_SIZE;
+	if (next == context->tail) {
+		debug_info("WARNING: event queue of subscriber %p is full, dropping event %d for %s", context, entry->event, entry->udid);
+		return;
+	}
+	memcpy(&context->queue[head], entry, sizeof(struct idevice_event_entry));
+	__sync_synchronize();
+	context->head = next;
+
+	mutex_lock(&context->mutex);
+	cond_signal(&context->cond);
+	mutex_unlock(&context->mutex);
+}
+
+static void* event_dispatch_thread(void *arg)
 {
-	idevice_event_t ev;
+	idevice_subscription_context_t context = (idevice_subscription_context_t)arg;
+	int self_free = 0;
+
+	while (1) {
+		mutex_lock(&context->mutex);
+		while (context->running && context->tail == context->head) {
+			cond_wait(&context->cond, &context->mutex);
+		}
+		int running = context->running;
+		self_free = context->self_free;
+		mutex_unlock(&context->mutex);
+		if (!running) {
+			break;
+		}
+
+		uint32_t tail = context->tail;
+		struct idevice_event_entry entry;
+		memcpy(&entry, &context->queue[tail], sizeof(struct idevice_event_entry));
+		__sync_synchronize();
+		context->tail = (tail + 1) % IDEVICE_EVENT_QUEUE_SIZE;
+
+		idevice_event_t ev;
+		ev.event = entry.event;
+		ev.udid = entry.udid;
+		ev.conn_type = entry.conn_type;
+		context->callback(&ev, context->user_data);
+	}
+
+	if (self_free) {
+		/* unsubscribed from within the callback */
+		event_context_free(context);
+	}
+
+	return NULL;
+}
 
-	ev.event = event->event;
-	ev.udid = event->device.udid;
-	ev.conn_type = 0;
+static void event_entry_from_mux_event(const usbmuxd_event_t *event, struct idevice_event_entry *entry)
+{
+	entry->event = event->event;
+	strncpy(entry->udid, event->device.udid, sizeof(entry->udid)-1);
+	entry->udid[sizeof(entry->udid)-1] = '\0';
+	entry->conn_type = 0;
 	if (event->device.conn_type == CONNECTION_TYPE_USB) {
-		ev.conn_type = CONNECTION_USBMUXD;
+		entry->conn_type = CONNECTION_USBMUXD;
 	} else if (event->device.conn_type == CONNECTION_TYPE_NETWORK) {
-		ev.conn_type = CONNECTION_NETWORK;
+		entry->conn_type = CONNECTION_NETWORK;
 	} else {
 		debug_info("Unknown connection type %d", event->device.conn_type);
 	}
+}
+
+static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
+{
+	struct idevice_event_entry entry;
+	event_entry_from_mux_event(event, &entry);
+
+	if (event->event == UE_DEVICE_PAIRED) {
+		/* the pair record has been created or replaced */
+		userpref_invalidate_pair_record(event->device.udid);
+	}
+	if (event->event == UE_DEVICE_REMOVE) {
+		/* values cached until detach may change before the next attach */
+		lockdownd_value_cache_purge(event->device.udid);
+	}
 
-	if (event_cb) {
-		event_cb(&ev, user_data);
+	mutex_lock(&event_subscribers_mutex);
+	device_registry_update(event);
+	idevice_subscription_context_t context = event_subscribers;
+	while (context) {
+		event_queue_push(context, &entry);
+		context = context->next;
 	}
+	mutex_unlock(&event_subscribers_mutex);
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_data)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_events_subscribe(idevice_subscription_context_t *context, idevice_event_cb_t callback, void *user_data)
 {
-	event_cb = callback;
-	int res = usbmuxd_subscribe(usbmux_event_cb, user_data);
-	if (res != 0) {
-		event_cb = NULL;
-		debug_info("ERROR: usbmuxd_subscribe() returned %d!", res);
+	if (!context || !callback) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	idevice_subscription_context_t ctx = (idevice_subscription_context_t)calloc(1, sizeof(struct idevice_subscription_context));
+	if (!ctx) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	ctx->callback = callback;
+	ctx->user_data = user_data;
+	ctx->running = 1;
+	mutex_init(&ctx->mutex);
+	cond_init(&ctx->cond);
+
+	if (thread_new(&ctx->thread, event_dispatch_thread, ctx) != 0) {
+		debug_info("ERROR: Failed to create event dispatch thread");
+		event_context_free(ctx);
 		return IDEVICE_E_UNKNOWN_ERROR;
 	}
+
+	mutex_lock(&event_subscribers_mutex);
+	if (usbmux_subscribed) {
+		/* report devices that are already attached, a new usbmuxd
+		 * subscription does this for the initial subscriber */
+		mutex_lock(&device_registry_mutex);
+		struct device_registry_entry *dev = device_registry;
+		while (dev) {
+			usbmuxd_event_t muxev;
+			struct idevice_event_entry entry;
+			muxev.event = UE_DEVICE_ADD;
+			memcpy(&muxev.device, &dev->info, sizeof(usbmuxd_device_info_t));
+			event_entry_from_mux_event(&muxev, &entry);
+			event_queue_push(ctx, &entry);
+			dev = dev->next;
+		}
+		mutex_unlock(&device_registry_mutex);
+	} else {
+		mutex_lock(&device_registry_mutex);
+		device_registry_active = 1;
+		mutex_unlock(&device_registry_mutex);
+		int res = usbmuxd_subscribe(usbmux_event_cb, NULL);
+		if (res != 0) {
+			mutex_unlock(&event_subscribers_mutex);
+			debug_info("ERROR: usbmuxd_subscribe() returned %d!", res);
+			device_registry_clear();
+			mutex_lock(&ctx->mutex);
+			ctx->running = 0;
+			cond_signal(&ctx->cond);
+			mutex_unlock(&ctx->mutex);
+			thread_join(ctx->thread);
+			thread_free(ctx->thread);
+			event_context_free(ctx);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		usbmux_subscribed = 1;
+	}
+	ctx->next = event_subscribers;
+	event_subscribers = ctx;
+	mutex_unlock(&event_subscribers_mutex);
+
+	*context = ctx;
 	return IDEVICE_E_SUCCESS;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_event_unsubscribe(void)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_events_unsubscribe(idevice_subscription_context_t context)
 {
-	event_cb = NULL;
-	int res = usbmuxd_unsubscribe();
+	if (!context) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	int res = 0;
+	int found = 0;
+	mutex_lock(&event_subscribers_mutex);
+	idevice_subscription_context_t prev = NULL;
+	idevice_subscription_context_t ctx = event_subscribers;
+	while (ctx) {
+		if (ctx == context) {
+			if (prev) {
+				prev->next = ctx->next;
+			} else {
+				event_subscribers = ctx->next;
+			}
+			found = 1;
+			break;
+		}
+		prev = ctx;
+		ctx = ctx->next;
+	}
+	if (found && !event_subscribers && usbmux_subscribed) {
+		usbmux_subscribed = 0;
+		mutex_unlock(&event_subscribers_mutex);
+		res = usbmuxd_unsubscribe();
+		device_registry_clear();
+	} else {
+		mutex_unlock(&event_subscribers_mutex);
+	}
+	if (!found) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	int self = thread_is_self(context->thread);
+	mutex_lock(&context->mutex);
+	context->running = 0;
+	context->self_free = self;
+	cond_signal(&context->cond);
+	mutex_unlock(&context->mutex);
+
+	if (self) {
+		thread_detach(context->thread);
+	} else {
+		thread_join(context->thread);
+		thread_free(context->thread);
+		event_context_free(context);
+	}
+
 	if (res != 0) {
 		debug_info("ERROR: usbmuxd_unsubscribe() returned %d!", res);
 		return IDEVICE_E_UNKNOWN_ERROR;
@@ -232,6 +813,25 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_event_unsubscribe(void)
 	return IDEVICE_E_SUCCESS;
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_data)
+{
+	if (legacy_event_context) {
+		idevice_events_unsubscribe(legacy_event_context);
+		legacy_event_context = NULL;
+	}
+	return idevice_events_subscribe(&legacy_event_context, callback, user_data);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_unsubscribe(void)
+{
+	if (!legacy_event_context) {
+		return IDEVICE_E_SUCCESS;
+	}
+	idevice_error_t res = idevice_events_unsubscribe(legacy_event_context);
+	legacy_event_context = NULL;
+	return res;
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list_extended(idevice_info_t **devices, int *count)
 {
 	usbmuxd_device_info_t *dev_list;
@@ -338,6 +938,60 @@ LIBIMOBILEDEVICE_API void idevice_set_debug_level(int level)
 	internal_set_debug_level(level);
 }
 
+LIBIMOBILEDEVICE_API void idevice_trace_enable(uint32_t num_events)
+{
+	internal_trace_enable(num_events);
+}
+
+LIBIMOBILEDEVICE_API uint32_t idevice_trace_snapshot(idevice_trace_event_t *events, uint32_t max_events)
+{
+	return internal_trace_snapshot(events, max_events);
+}
+
+LIBIMOBILEDEVICE_API const char *idevice_trace_event_name(uint32_t event)
+{
+	return internal_trace_event_name(event);
+}
+
+LIBIMOBILEDEVICE_API int idevice_trace_dump(const char *filename)
+{
+	if (!filename) {
+		return internal_trace_dump(stderr);
+	}
+	FILE *f = fopen(filename, "w");
+	if (!f) {
+		return -1;
+	}
+	int res = internal_trace_dump(f);
+	if (fclose(f) != 0) {
+		res = -1;
+	}
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_metrics_get(plist_t *metrics)
+{
+	if (!metrics) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	*metrics = internal_metrics_snapshot();
+	return (*metrics) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_metrics_format_openmetrics(char **text, uint32_t *length)
+{
+	if (!text) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	*text = NULL;
+	return (internal_metrics_format(text, length) == 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_metrics_serve(uint16_t port)
+{
+	return (internal_metrics_serve(port) == 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
+}
+
 static idevice_t idevice_from_mux_device(usbmuxd_device_info_t *muxdev)
 {
 	if (!muxdev)
@@ -350,6 +1004,18 @@ static idevice_t idevice_from_mux_device(usbmuxd_device_info_t *muxdev)
 	device->udid = strdup(muxdev->udid);
 	device->mux_id = muxdev->handle;
 	device->version = 0;
+	device->net_options = NULL;
+	memset(&device->stats, '\0', sizeof(idevice_connection_stats_t));
+	device->metrics = metrics_device_get(device->udid);
+	device->broker = broker_get_path();
+	device->pending_fds = NULL;
+	mutex_init(&device->qos_mutex);
+	cond_init(&device->qos_cond);
+	memset(device->qos_active, '\0', sizeof(device->qos_active));
+	mutex_init(&device->plaintext_mutex);
+	device->plaintext_rejected = NULL;
+	device->replay = NULL;
+	capture_setup();
 	switch (muxdev->conn_type) {
 	case CONNECTION_TYPE_USB:
 		device->conn_type = CONNECTION_USBMUXD;
@@ -369,10 +1035,41 @@ static idevice_t idevice_from_mux_device(usbmuxd_device_info_t *muxdev)
 	return device;
 }
 
+/**
+ * Creates a device that is served from the given replay session.
+ */
+static idevice_error_t idevice_new_replayed(idevice_t *device, const char *udid, struct replay_session *replay)
+{
+	usbmuxd_device_info_t muxdev;
+	const char *recorded = replay_find_device(replay, udid);
+
+	if (!recorded) {
+		replay_release_session(replay);
+		return IDEVICE_E_NO_DEVICE;
+	}
+	memset(&muxdev, '\0', sizeof(usbmuxd_device_info_t));
+	strncpy(muxdev.udid, recorded, sizeof(muxdev.udid) - 1);
+	muxdev.conn_type = CONNECTION_TYPE_USB;
+	*device = idevice_from_mux_device(&muxdev);
+	if (!*device) {
+		replay_release_session(replay);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	/* the recorded connections are played locally */
+	free((*device)->broker);
+	(*device)->broker = NULL;
+	(*device)->replay = replay;
+	return IDEVICE_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_new_with_options(idevice_t * device, const char *udid, enum idevice_options options)
 {
 	usbmuxd_device_info_t muxdev;
 	int usbmux_options = 0;
+	struct replay_session *replay = replay_get_session();
+	if (replay) {
+		return idevice_new_replayed(device, udid, replay);
+	}
 	if (options & IDEVICE_LOOKUP_USBMUX) {
 		usbmux_options |= DEVICE_LOOKUP_USBMUX;
 	}
@@ -382,7 +1079,10 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_new_with_options(idevice_t * device
 	if (options & IDEVICE_LOOKUP_PREFER_NETWORK) {
 		usbmux_options |= DEVICE_LOOKUP_PREFER_NETWORK;
 	}
-	int res = usbmuxd_get_device(udid, &muxdev, usbmux_options);
+	int res = device_registry_lookup(udid, &muxdev, usbmux_options);
+	if (res <= 0) {
+		res = usbmuxd_get_device(udid, &muxdev, usbmux_options);
+	}
 	if (res > 0) {
 		*device = idevice_from_mux_device(&muxdev);
 		if (!*device) {
@@ -393,12 +1093,42 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_new_with_options(idevice_t * device
 	return IDEVICE_E_NO_DEVICE;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_new(idevice_t * device, const char *udid)
+/**
+ * Looks up the usbmux handle of the device again. A USB device that was
+ * re-enumerated, e.g. after a hub reset, comes back with a new handle and
+ * the old one cannot be connected to anymore.
+ */
+idevice_error_t idevice_refresh_handle(idevice_t device)
 {
-	return idevice_new_with_options(device, udid, 0);
-}
+	usbmuxd_device_info_t muxdev;
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_free(idevice_t device)
+	if (!device || !device->udid)
+		return IDEVICE_E_INVALID_ARG;
+	if (device->conn_type != CONNECTION_USBMUXD || device->replay)
+		return IDEVICE_E_SUCCESS;
+
+	int res = device_registry_lookup(device->udid, &muxdev, DEVICE_LOOKUP_USBMUX);
+	if (res <= 0) {
+		res = usbmuxd_get_device(device->udid, &muxdev, DEVICE_LOOKUP_USBMUX);
+	}
+	if (res <= 0 || muxdev.conn_type != CONNECTION_TYPE_USB) {
+		return IDEVICE_E_NO_DEVICE;
+	}
+	if (muxdev.handle != device->mux_id) {
+		debug_info("device %s re-enumerated, handle %u -> %u", device->udid, device->mux_id, muxdev.handle);
+		/* sessions of the previous enumeration are gone */
+		lockdownd_session_cache_purge(device);
+		atomic_write(&device->mux_id, muxdev.handle);
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_new(idevice_t * device, const char *udid)
+{
+	return idevice_new_with_options(device, udid, 0);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_free(idevice_t device)
 {
 	if (!device)
 		return IDEVICE_E_INVALID_ARG;
@@ -406,21 +1136,255 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_free(idevice_t device)
 
 	ret = IDEVICE_E_SUCCESS;
 
+	/* cached lockdown sessions refer to this device */
+	lockdownd_session_cache_purge(device);
+
+	while (device->pending_fds) {
+		struct idevice_pending_fd *next = device->pending_fds->next;
+		socket_close(device->pending_fds->fd);
+		free(device->pending_fds);
+		device->pending_fds = next;
+	}
+	free(device->broker);
 	free(device->udid);
 
 	if (device->conn_data) {
 		free(device->conn_data);
 	}
+	free(device->net_options);
+	while (device->plaintext_rejected) {
+		struct idevice_plaintext_rejection *next = device->plaintext_rejected->next;
+		free(device->plaintext_rejected->service);
+		free(device->plaintext_rejected);
+		device->plaintext_rejected = next;
+	}
+	cond_destroy(&device->qos_cond);
+	mutex_destroy(&device->qos_mutex);
+	mutex_destroy(&device->plaintext_mutex);
+	replay_release_session(device->replay);
 	free(device);
 	return ret;
 }
 
+static idevice_network_options_t default_network_options = {
+	1,		/* nodelay */
+	0,		/* keepalive */
+	0,		/* keepalive_idle */
+	0,		/* keepalive_interval */
+	0,		/* keepalive_count */
+	0x20000,	/* send_buffer_size */
+	0x20000		/* recv_buffer_size */
+};
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_network_options(idevice_t device, const idevice_network_options_t *options)
+{
+	if (options && (options->keepalive_idle < 0 || options->keepalive_interval < 0 || options->keepalive_count < 0 || options->send_buffer_size < 0 || options->recv_buffer_size < 0)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	mutex_lock(&network_options_mutex);
+	if (!device) {
+		if (options) {
+			memcpy(&default_network_options, options, sizeof(idevice_network_options_t));
+		} else {
+			default_network_options.nodelay = 1;
+			default_network_options.keepalive = 0;
+			default_network_options.keepalive_idle = 0;
+			default_network_options.keepalive_interval = 0;
+			default_network_options.keepalive_count = 0;
+			default_network_options.send_buffer_size = 0x20000;
+			default_network_options.recv_buffer_size = 0x20000;
+		}
+	} else if (options) {
+		if (!device->net_options) {
+			device->net_options = (idevice_network_options_t*)malloc(sizeof(idevice_network_options_t));
+		}
+		if (device->net_options) {
+			memcpy(device->net_options, options, sizeof(idevice_network_options_t));
+		}
+	} else {
+		free(device->net_options);
+		device->net_options = NULL;
+	}
+	mutex_unlock(&network_options_mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_get_network_options(idevice_t device, idevice_network_options_t *options)
+{
+	if (!options) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	mutex_lock(&network_options_mutex);
+	if (device && device->net_options) {
+		memcpy(options, device->net_options, sizeof(idevice_network_options_t));
+	} else {
+		memcpy(options, &default_network_options, sizeof(idevice_network_options_t));
+	}
+	mutex_unlock(&network_options_mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function to reset the priority, rate limit and other
+ * per-connection state of a freshly created connection.
+ */
+static void internal_qos_init(idevice_connection_t connection)
+{
+	connection->priority = IDEVICE_PRIORITY_NORMAL;
+	connection->rate_limit = 0;
+	connection->rate_credit = 0;
+	connection->rate_time = 0;
+	connection->plaintext = 0;
+	connection->plaintext_verify = 0;
+	connection->plaintext_service = NULL;
+	connection->plaintext_base = 0;
+	connection->capture_id = 0;
+}
+
+/**
+ * Internally used function to apply the network options of the given
+ * device to a freshly connected socket.
+ */
+static void internal_apply_network_options(idevice_t device, int sfd)
+{
+	idevice_network_options_t opts;
+	idevice_get_network_options(device, &opts);
+
+	if (socket_set_nodelay(sfd, opts.nodelay) < 0) {
+		debug_info("WARNING: Could not set TCP_NODELAY on socket: %s", strerror(errno));
+	}
+	if (socket_set_keepalive(sfd, opts.keepalive, opts.keepalive_idle, opts.keepalive_interval, opts.keepalive_count) < 0) {
+		debug_info("WARNING: Could not set keepalive options on socket: %s", strerror(errno));
+	}
+	if (socket_set_buffer_sizes(sfd, opts.send_buffer_size, opts.recv_buffer_size) < 0) {
+		debug_info("WARNING: Could not set socket buffer sizes: %s", strerror(errno));
+	}
+}
+
+/* Maximum number of candidate addresses raced when connecting to a network device */
+#define IDEVICE_MAX_CONNECT_ADDRS 4
+
+/**
+ * Internally used function to convert the usbmuxd network connection data
+ * into a sockaddr.
+ *
+ * @return 0 on success or -1 if the address family is not supported.
+ */
+static int internal_sockaddr_from_conn_data(const void *conn_data, struct sockaddr_storage *saddr_storage)
+{
+	struct sockaddr* saddr = (struct sockaddr*)saddr_storage;
+
+	memset(saddr_storage, '\0', sizeof(struct sockaddr_storage));
+
+	/* FIXME: Improve handling of this platform/host dependent connection data */
+	if (((char*)conn_data)[1] == 0x02) { // AF_INET
+		saddr->sa_family = AF_INET;
+		memcpy(&saddr->sa_data[0], (char*)conn_data + 2, 14);
+	}
+	else if (((char*)conn_data)[1] == 0x1E) { // AF_INET6 (bsd)
+#ifdef AF_INET6
+		saddr->sa_family = AF_INET6;
+		/* copy the address and the host dependent scope id */
+		memcpy(&saddr->sa_data[0], (char*)conn_data + 2, 26);
+#else
+		debug_info("ERROR: Got an IPv6 address but this system doesn't support IPv6");
+		return -1;
+#endif
+	}
+	else {
+		printf("WARNING Unsupported address family 0x%02x\n", ((char*)conn_data)[1]);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Registers a channel obtained from the broker, to be used by the next
+ * idevice_connect() to the given port from the calling thread.
+ */
+void idevice_set_pending_fd(idevice_t device, uint16_t port, int fd)
+{
+	struct idevice_pending_fd *pending = (struct idevice_pending_fd*)malloc(sizeof(struct idevice_pending_fd));
+	if (!pending) {
+		socket_close(fd);
+		return;
+	}
+	pending->port = port;
+	pending->fd = fd;
+	pending->owner = THREAD_ID;
+	mutex_lock(&pending_fds_mutex);
+	pending->next = device->pending_fds;
+	device->pending_fds = pending;
+	mutex_unlock(&pending_fds_mutex);
+}
+
+static int internal_take_pending_fd(idevice_t device, uint16_t port)
+{
+	struct idevice_pending_fd **link;
+	int fd = -1;
+
+	mutex_lock(&pending_fds_mutex);
+	for (link = &device->pending_fds; *link; link = &(*link)->next) {
+		if ((*link)->port == port && thread_id_equal((*link)->owner, THREAD_ID)) {
+			struct idevice_pending_fd *pending = *link;
+			*link = pending->next;
+			fd = pending->fd;
+			free(pending);
+			break;
+		}
+	}
+	mutex_unlock(&pending_fds_mutex);
+
+	return fd;
+}
+
+/**
+ * Closes the channel registered with idevice_set_pending_fd() if it has
+ * not been used.
+ */
+void idevice_clear_pending_fd(idevice_t device, uint16_t port)
+{
+	int fd = internal_take_pending_fd(device, port);
+	if (fd >= 0) {
+		socket_close(fd);
+	}
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection)
 {
 	if (!device) {
 		return IDEVICE_E_INVALID_ARG;
 	}
 
+	int pending_fd = -1;
+	if (device->replay) {
+		pending_fd = replay_connect(device->replay, device->udid, port);
+		if (pending_fd < 0) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+	} else if (device->pending_fds) {
+		pending_fd = internal_take_pending_fd(device, port);
+	}
+	if (pending_fd >= 0) {
+		idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
+		new_connection->type = device->conn_type;
+		new_connection->data = (void*)(long)pending_fd;
+		new_connection->ssl_data = NULL;
+		new_connection->nonblocking = 0;
+		memset(&new_connection->stats, '\0', sizeof(idevice_connection_stats_t));
+		new_connection->device = device;
+		internal_qos_init(new_connection);
+		if (capture_enabled) {
+			new_connection->capture_id = capture_connect(device, port);
+		}
+		*connection = new_connection;
+		return IDEVICE_E_SUCCESS;
+	}
+
 	if (device->conn_type == CONNECTION_USBMUXD) {
 		int sfd = usbmuxd_connect(device->mux_id, port);
 		if (sfd < 0) {
@@ -431,53 +1395,72 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connect(idevice_t device, uint16_t
 		new_connection->type = CONNECTION_USBMUXD;
 		new_connection->data = (void*)(long)sfd;
 		new_connection->ssl_data = NULL;
+		new_connection->nonblocking = 0;
+		memset(&new_connection->stats, '\0', sizeof(idevice_connection_stats_t));
 		new_connection->device = device;
+		internal_qos_init(new_connection);
+		if (capture_enabled) {
+			new_connection->capture_id = capture_connect(device, port);
+		}
+		if (device->metrics) {
+			metrics_add(&device->metrics->connections, 1);
+		}
 		*connection = new_connection;
 		return IDEVICE_E_SUCCESS;
 	} else if (device->conn_type == CONNECTION_NETWORK) {
-		struct sockaddr_storage saddr_storage;
-		struct sockaddr* saddr = (struct sockaddr*)&saddr_storage;
-
-		/* FIXME: Improve handling of this platform/host dependent connection data */
-		if (((char*)device->conn_data)[1] == 0x02) { // AF_INET
-			saddr->sa_family = AF_INET;
-			memcpy(&saddr->sa_data[0], (char*)device->conn_data + 2, 14);
-		}
-		else if (((char*)device->conn_data)[1] == 0x1E) { // AF_INET6 (bsd)
-#ifdef AF_INET6
-			saddr->sa_family = AF_INET6;
-			/* copy the address and the host dependent scope id */
-			memcpy(&saddr->sa_data[0], (char*)device->conn_data + 2, 26);
-#else
-			debug_info("ERROR: Got an IPv6 address but this system doesn't support IPv6");
+		struct sockaddr_storage saddr_storage[IDEVICE_MAX_CONNECT_ADDRS];
+		struct sockaddr* saddrs[IDEVICE_MAX_CONNECT_ADDRS];
+		int num_addrs = 0;
+		int res = internal_sockaddr_from_conn_data(device->conn_data, &saddr_storage[0]);
+		if (res < 0) {
 			return IDEVICE_E_UNKNOWN_ERROR;
-#endif
 		}
-		else {
-			printf("WARNING Unsupported address family 0x%02x\n", ((char*)device->conn_data)[1]);
-			return IDEVICE_E_UNKNOWN_ERROR;
+		saddrs[num_addrs++] = (struct sockaddr*)&saddr_storage[0];
+
+		/* add other addresses the device is known to be reachable at */
+		mutex_lock(&device_registry_mutex);
+		struct device_registry_entry *entry = device_registry;
+		while (entry && num_addrs < IDEVICE_MAX_CONNECT_ADDRS) {
+			if (entry->info.conn_type == CONNECTION_TYPE_NETWORK && entry->info.handle != device->mux_id && !strcmp(entry->info.udid, device->udid)
+			    && internal_sockaddr_from_conn_data(entry->info.conn_data, &saddr_storage[num_addrs]) == 0) {
+				saddrs[num_addrs] = (struct sockaddr*)&saddr_storage[num_addrs];
+				num_addrs++;
+			}
+			entry = entry->next;
 		}
+		mutex_unlock(&device_registry_mutex);
 
 		char addrtxt[48];
 		addrtxt[0] = '\0';
 
-		if (!socket_addr_to_string(saddr, addrtxt, sizeof(addrtxt))) {
+		if (!socket_addr_to_string(saddrs[0], addrtxt, sizeof(addrtxt))) {
 			debug_info("Failed to convert network address: %d (%s)", errno, strerror(errno));
 		}
 
-		debug_info("Connecting to %s port %d...", addrtxt, port);
+		debug_info("Connecting to %s port %d (%d address%s)...", addrtxt, port, num_addrs, (num_addrs == 1) ? "" : "es");
 
-		int sfd = socket_connect_addr(saddr, port);
+		int sfd = socket_connect_addrs(saddrs, num_addrs, port);
 		if (sfd < 0) {
 			debug_info("ERROR: Connecting to network device failed: %d (%s)", errno, strerror(errno));
 			return IDEVICE_E_NO_DEVICE;
 		}
 
+		internal_apply_network_options(device, sfd);
+
 		idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
 		new_connection->type = CONNECTION_NETWORK;
 		new_connection->data = (void*)(long)sfd;
 		new_connection->ssl_data = NULL;
+		new_connection->nonblocking = 0;
+		memset(&new_connection->stats, '\0', sizeof(idevice_connection_stats_t));
 		new_connection->device = device;
+		internal_qos_init(new_connection);
+		if (capture_enabled) {
+			new_connection->capture_id = capture_connect(device, port);
+		}
+		if (device->metrics) {
+			metrics_add(&device->metrics->connections, 1);
+		}
 
 		*connection = new_connection;
 
@@ -498,6 +1481,17 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_disconnect(idevice_connection_t con
 	if (connection->ssl_data) {
 		idevice_connection_disable_ssl(connection);
 	}
+	if (connection->plaintext && connection->device) {
+		uint64_t saved = connection->stats.bytes_sent + connection->stats.bytes_received - connection->plaintext_base;
+		__sync_fetch_and_add(&connection->device->stats.crypto_bytes_saved, saved);
+		if (connection->device->metrics) {
+			metrics_add(&connection->device->metrics->traffic.crypto_bytes_saved, saved);
+		}
+	}
+	free(connection->plaintext_service);
+	if (connection->capture_id) {
+		capture_frame(connection->capture_id, CAPTURE_FRAME_CLOSE, NULL, 0);
+	}
 	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
 	if (connection->type == CONNECTION_USBMUXD) {
 		usbmuxd_disconnect((int)(long)connection->data);
@@ -520,12 +1514,36 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_disconnect(idevice_connection_t con
 /**
  * Internally used function to send raw data over the given connection.
  */
+static uint64_t internal_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Adds value to the given counter of the connection, of the device
+ * aggregate and of the library-wide metrics; the latter two can be updated
+ * from multiple threads. */
+#define CONNECTION_STATS_ADD(connection, field, value) \
+	do { \
+		uint64_t __v = (uint64_t)(value); \
+		(connection)->stats.field += __v; \
+		if ((connection)->device) { \
+			__sync_fetch_and_add(&(connection)->device->stats.field, __v); \
+			if ((connection)->device->metrics) { \
+				metrics_add(&(connection)->device->metrics->traffic.field, __v); \
+			} \
+		} \
+	} while (0)
+
 static idevice_error_t internal_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
 {
 	if (!connection || !data) {
 		return IDEVICE_E_INVALID_ARG;
 	}
 
+	CONNECTION_STATS_ADD(connection, send_syscalls, 1);
+
 	if (connection->type == CONNECTION_USBMUXD) {
 		int res;
 		do {
@@ -551,7 +1569,11 @@ static idevice_error_t internal_connection_send(idevice_connection_t connection,
 
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+/**
+ * Internally used function for sending all len bytes over the given
+ * connection, using SSL if enabled.
+ */
+static idevice_error_t internal_connection_send_all(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
 {
 	if (!connection || !data || (connection->ssl_data && !connection->ssl_data->session)) {
 		return IDEVICE_E_INVALID_ARG;
@@ -561,12 +1583,14 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_
 		uint32_t sent = 0;
 		while (sent < len) {
 #ifdef HAVE_OPENSSL
+			CONNECTION_STATS_ADD(connection, send_syscalls, 1);
 			int c = socket_check_fd((int)(long)connection->data, FDM_WRITE, 100);
 			if (c == 0 || c == -ETIMEDOUT || c == -EAGAIN) {
 				continue;
 			} else if (c < 0) {
 				break;
 			}
+			CONNECTION_STATS_ADD(connection, send_syscalls, 1);
 			int s = SSL_write(connection->ssl_data->session, (const void*)(data+sent), (int)(len-sent));
 			if (s <= 0) {
 				int sslerr = SSL_get_error(connection->ssl_data->session, s);
@@ -581,9 +1605,10 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_
 			if (s < 0) {
 				break;
 			}
+			CONNECTION_STATS_ADD(connection, tls_records_sent, (s + IDEVICE_SSL_RECORD_SIZE - 1) / IDEVICE_SSL_RECORD_SIZE);
 			sent += s;
 		}
-		debug_info("SSL_write %d, sent %d", len, sent);
+		trace_event(TRACE_SSL_WRITE, len, sent, (sent < len) ? IDEVICE_E_SSL_ERROR : IDEVICE_E_SUCCESS);
 		if (sent < len) {
 			*sent_bytes = 0;
 			return IDEVICE_E_SSL_ERROR;
@@ -610,6 +1635,275 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_
 	}
 }
 
+/*
+ * Scheduling of the connections to a device, see idevice_connection_set_qos().
+ * A send waits while sends of a higher class are in progress on the same
+ * device handle, at most IDEVICE_QOS_MAX_DEFER ms so that it cannot starve.
+ * Bulk and rate limited connections send in slices of IDEVICE_QOS_SLICE
+ * bytes, which lets higher classes in between.
+ */
+
+static void internal_sleep_us(uint64_t us)
+{
+#ifdef WIN32
+	Sleep((DWORD)((us + 999) / 1000));
+#else
+	struct timespec ts = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/**
+ * Waits until len bytes may be transferred over the connection without
+ * exceeding its rate limit. The limit is a token bucket that allows bursts
+ * of a tenth of a second worth of data.
+ */
+static void internal_qos_throttle(idevice_connection_t connection, uint32_t len)
+{
+	if (connection->rate_limit == 0) {
+		return;
+	}
+	int64_t burst = connection->rate_limit / 10;
+	if (burst < IDEVICE_QOS_SLICE) {
+		burst = IDEVICE_QOS_SLICE;
+	}
+	uint64_t now = internal_time_us();
+	if (connection->rate_time == 0) {
+		connection->rate_credit = burst;
+	} else {
+		uint64_t elapsed = now - connection->rate_time;
+		if (elapsed > 10000000) {
+			elapsed = 10000000;
+		}
+		connection->rate_credit += (int64_t)(elapsed * connection->rate_limit / 1000000);
+		if (connection->rate_credit > burst) {
+			connection->rate_credit = burst;
+		}
+	}
+	connection->rate_time = now;
+	connection->rate_credit -= len;
+	if (connection->rate_credit < 0) {
+		uint64_t wait = (uint64_t)(-connection->rate_credit) * 1000000 / connection->rate_limit;
+		internal_sleep_us(wait);
+		connection->rate_credit = 0;
+		connection->rate_time = now + wait;
+	}
+}
+
+/**
+ * Registers a send of the connection with its device, waiting for sends of
+ * higher classes first.
+ *
+ * @return The class the send was registered with, for internal_qos_leave()
+ */
+static int internal_qos_enter(idevice_connection_t connection)
+{
+	idevice_t device = connection->device;
+	int priority = connection->priority;
+
+	mutex_lock(&device->qos_mutex);
+	if (priority > IDEVICE_PRIORITY_INTERACTIVE) {
+		uint64_t deadline = internal_time_us() + IDEVICE_QOS_MAX_DEFER * 1000;
+		while (1) {
+			int i, busy = 0;
+			for (i = IDEVICE_PRIORITY_INTERACTIVE; i < priority; i++) {
+				busy += device->qos_active[i];
+			}
+			if (!busy || internal_time_us() >= deadline) {
+				break;
+			}
+			/* waiters share the cond, so do not wait for a signal only */
+			cond_wait_timeout(&device->qos_cond, &device->qos_mutex, 1);
+		}
+	}
+	device->qos_active[priority]++;
+	mutex_unlock(&device->qos_mutex);
+
+	return priority;
+}
+
+static void internal_qos_leave(idevice_connection_t connection, int priority)
+{
+	idevice_t device = connection->device;
+
+	mutex_lock(&device->qos_mutex);
+	device->qos_active[priority]--;
+	if (priority < IDEVICE_PRIORITY_BULK && device->qos_active[priority] == 0) {
+		cond_signal(&device->qos_cond);
+	}
+	mutex_unlock(&device->qos_mutex);
+}
+
+/**
+ * Sends all len bytes like internal_connection_send_all(), scheduled
+ * against the other connections to the device.
+ */
+static idevice_error_t internal_connection_send_scheduled(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	if (!connection || !data || !connection->device) {
+		return internal_connection_send_all(connection, data, len, sent_bytes);
+	}
+
+	uint32_t slice = (connection->priority == IDEVICE_PRIORITY_BULK || connection->rate_limit) ? IDEVICE_QOS_SLICE : len;
+	uint32_t sent = 0;
+	idevice_error_t res;
+	do {
+		uint32_t bytes = 0;
+		uint32_t n = (len - sent > slice) ? slice : len - sent;
+		internal_qos_throttle(connection, n);
+		int priority = internal_qos_enter(connection);
+		res = internal_connection_send_all(connection, data + sent, n, &bytes);
+		internal_qos_leave(connection, priority);
+		if (res != IDEVICE_E_SUCCESS) {
+			*sent_bytes = 0;
+			return res;
+		}
+		sent += bytes;
+	} while (sent < len);
+
+	*sent_bytes = sent;
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	uint64_t start = internal_time_us();
+	idevice_error_t res = internal_connection_send_scheduled(connection, data, len, sent_bytes);
+	trace_event(TRACE_CONNECTION_SEND, len, (sent_bytes) ? *sent_bytes : 0, res);
+	if (connection && sent_bytes && res != IDEVICE_E_INVALID_ARG) {
+		if (connection->capture_id && *sent_bytes > 0) {
+			capture_frame(connection->capture_id, CAPTURE_FRAME_SEND, data, *sent_bytes);
+		}
+		CONNECTION_STATS_ADD(connection, bytes_sent, *sent_bytes);
+		CONNECTION_STATS_ADD(connection, send_blocked_us, internal_time_us() - start);
+	}
+	return res;
+}
+
+/**
+ * Sends multiple buffers over the given connection in one go.
+ * Without SSL the buffers are handed to the kernel with a single vectored
+ * send. With SSL the leading buffers are coalesced into one TLS record of
+ * up to IDEVICE_SSL_RECORD_SIZE bytes, so that a small protocol header does
+ * not end up in a record of its own.
+ *
+ * @param connection The connection to send data over.
+ * @param iov Array of buffers to send in order.
+ * @param iovcnt Number of buffers in iov, at most SOCKET_IOV_MAX.
+ * @param sent_bytes Pointer to an uint32_t that will be filled
+ *   with the total number of bytes actually sent.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const struct socket_iovec *iov, int iovcnt, uint32_t *sent_bytes)
+{
+	int i = 0;
+	uint32_t total = 0;
+
+	if (!connection || !iov || iovcnt <= 0 || iovcnt > SOCKET_IOV_MAX || !sent_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*sent_bytes = 0;
+
+	if (connection->ssl_data) {
+		char record[IDEVICE_SSL_RECORD_SIZE];
+		uint32_t fill = 0;
+		uint32_t sent = 0;
+		size_t offset = 0;
+		idevice_error_t res;
+
+		while (i < iovcnt && fill < sizeof(record)) {
+			size_t n = iov[i].length - offset;
+			if (n > sizeof(record) - fill) {
+				n = sizeof(record) - fill;
+			}
+			memcpy(record + fill, (const char*)iov[i].data + offset, n);
+			fill += n;
+			offset += n;
+			if (offset == iov[i].length) {
+				i++;
+				offset = 0;
+			}
+		}
+		if (fill > 0) {
+			res = idevice_connection_send(connection, record, fill, &sent);
+			if (res != IDEVICE_E_SUCCESS) {
+				return res;
+			}
+			total += sent;
+		}
+		for (; i < iovcnt; i++, offset = 0) {
+			if (iov[i].length - offset == 0) {
+				continue;
+			}
+			res = idevice_connection_send(connection, (const char*)iov[i].data + offset, (uint32_t)(iov[i].length - offset), &sent);
+			if (res != IDEVICE_E_SUCCESS) {
+				return res;
+			}
+			total += sent;
+		}
+		*sent_bytes = total;
+		return IDEVICE_E_SUCCESS;
+	}
+
+	if (connection->type != CONNECTION_USBMUXD && connection->type != CONNECTION_NETWORK) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	struct socket_iovec vec[SOCKET_IOV_MAX];
+	uint32_t len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		vec[i] = iov[i];
+		len += (uint32_t)iov[i].length;
+	}
+
+	internal_qos_throttle(connection, len);
+	int priority = internal_qos_enter(connection);
+	uint64_t start = internal_time_us();
+	i = 0;
+	while (total < len) {
+		while (i < iovcnt && vec[i].length == 0) {
+			i++;
+		}
+		CONNECTION_STATS_ADD(connection, send_syscalls, 1);
+		int s = socket_sendv((int)(long)connection->data, vec + i, iovcnt - i);
+		if (s < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			debug_info("ERROR: socket_sendv failed (%s)", strerror(errno));
+			break;
+		}
+		total += s;
+		/* advance past what has been sent */
+		while (s > 0 && i < iovcnt) {
+			if ((size_t)s >= vec[i].length) {
+				s -= vec[i].length;
+				vec[i].length = 0;
+				i++;
+			} else {
+				vec[i].data = (const char*)vec[i].data + s;
+				vec[i].length -= s;
+				s = 0;
+			}
+		}
+	}
+	internal_qos_leave(connection, priority);
+	debug_info("socket_sendv %d, sent %d", len, total);
+	if (connection->capture_id && total > 0) {
+		capture_framev(connection->capture_id, CAPTURE_FRAME_SEND, iov, iovcnt, total);
+	}
+	CONNECTION_STATS_ADD(connection, bytes_sent, total);
+	CONNECTION_STATS_ADD(connection, send_blocked_us, internal_time_us() - start);
+	if (total < len) {
+		return IDEVICE_E_NOT_ENOUGH_DATA;
+	}
+	*sent_bytes = total;
+	return IDEVICE_E_SUCCESS;
+}
+
 static idevice_error_t socket_recv_to_idevice_error(int conn_error, uint32_t len, uint32_t received)
 {
 	if (conn_error < 0) {
@@ -637,6 +1931,8 @@ static idevice_error_t internal_connection_receive_timeout(idevice_connection_t
 		return IDEVICE_E_INVALID_ARG;
 	}
 
+	CONNECTION_STATS_ADD(connection, recv_syscalls, 1);
+
 	if (connection->type == CONNECTION_USBMUXD) {
 		int conn_error = usbmuxd_recv_timeout((int)(long)connection->data, data, len, recv_bytes, timeout);
 		idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, *recv_bytes);
@@ -660,7 +1956,122 @@ static idevice_error_t internal_connection_receive_timeout(idevice_connection_t
 	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+/**
+ * Internally used function to copy already decrypted data out of the
+ * receive buffer of the given SSL connection.
+ *
+ * @return The number of bytes copied to data
+ */
+static uint32_t internal_ssl_buffer_read(ssl_data_t ssl_data, char *data, uint32_t len)
+{
+	uint32_t avail = ssl_data->recv_buffer_len - ssl_data->recv_buffer_pos;
+	if (avail == 0)
+		return 0;
+	if (len > avail)
+		len = avail;
+	memcpy(data, ssl_data->recv_buffer + ssl_data->recv_buffer_pos, len);
+	ssl_data->recv_buffer_pos += len;
+	if (ssl_data->recv_buffer_pos == ssl_data->recv_buffer_len) {
+		ssl_data->recv_buffer_pos = 0;
+		ssl_data->recv_buffer_len = 0;
+	}
+	return len;
+}
+
+/**
+ * Internally used function that returns non-zero if decrypted data is
+ * available without having to read from the socket.
+ */
+static int internal_ssl_pending(ssl_data_t ssl_data)
+{
+	if (ssl_data->recv_buffer_len > ssl_data->recv_buffer_pos)
+		return 1;
+#ifdef HAVE_OPENSSL
+	return (SSL_pending(ssl_data->session) > 0);
+#else
+	return (gnutls_record_check_pending(ssl_data->session) > 0);
+#endif
+}
+
+/**
+ * Internally used function that performs a single TLS read of at most
+ * len bytes into data.
+ *
+ * @return The number of bytes read, 0 if the operation should be retried,
+ *     or a negative value on error.
+ */
+static int internal_ssl_read_record(idevice_connection_t connection, char *data, uint32_t len)
+{
+	ssl_data_t ssl_data = connection->ssl_data;
+#ifdef HAVE_OPENSSL
+	if (SSL_pending(ssl_data->session) == 0) {
+		CONNECTION_STATS_ADD(connection, recv_syscalls, 1);
+	}
+	int r = SSL_read(ssl_data->session, (void*)data, (int)len);
+	if (r > 0) {
+		CONNECTION_STATS_ADD(connection, tls_records_received, 1);
+		return r;
+	}
+	int sslerr = SSL_get_error(ssl_data->session, r);
+	if (sslerr == SSL_ERROR_WANT_READ) {
+		return 0;
+	}
+	return -1;
+#else
+	ssize_t r = gnutls_record_recv(ssl_data->session, (void*)data, (size_t)len);
+	if (r > 0) {
+		CONNECTION_STATS_ADD(connection, tls_records_received, 1);
+		return (int)r;
+	}
+	if (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED) {
+		return 0;
+	}
+	return -1;
+#endif
+}
+
+/**
+ * Internally used function to read decrypted data from the given SSL
+ * connection. Small reads are served from a per-connection buffer that is
+ * refilled with whole TLS records, larger reads go directly to data.
+ *
+ * @return The number of bytes read, 0 if the operation should be retried,
+ *     or a negative value on error.
+ */
+static int internal_ssl_buffered_read(idevice_connection_t connection, char *data, uint32_t len)
+{
+	ssl_data_t ssl_data = connection->ssl_data;
+	uint32_t copied = internal_ssl_buffer_read(ssl_data, data, len);
+	if (copied > 0) {
+		return (int)copied;
+	}
+
+	if (len >= IDEVICE_SSL_RECV_BUFFER_SIZE) {
+		return internal_ssl_read_record(connection, data, len);
+	}
+
+	if (!ssl_data->recv_buffer) {
+		ssl_data->recv_buffer = (char*)malloc(IDEVICE_SSL_RECV_BUFFER_SIZE);
+		if (!ssl_data->recv_buffer) {
+			return internal_ssl_read_record(connection, data, len);
+		}
+	}
+
+	int r = internal_ssl_read_record(connection, ssl_data->recv_buffer, IDEVICE_SSL_RECV_BUFFER_SIZE);
+	if (r <= 0) {
+		return r;
+	}
+	ssl_data->recv_buffer_pos = 0;
+	ssl_data->recv_buffer_len = (uint32_t)r;
+
+	return (int)internal_ssl_buffer_read(ssl_data, data, len);
+}
+
+/**
+ * Internally used function for receiving exactly len bytes over the given
+ * connection, using SSL if enabled.
+ */
+static idevice_error_t internal_connection_receive_all_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
 {
 	if (!connection || (connection->ssl_data && !connection->ssl_data->session) || len == 0) {
 		return IDEVICE_E_INVALID_ARG;
@@ -668,13 +2079,10 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_
 
 	if (connection->ssl_data) {
 		uint32_t received = 0;
-		int do_select = 1;
 
 		while (received < len) {
-#ifdef HAVE_OPENSSL
-			do_select = (SSL_pending(connection->ssl_data->session) == 0);
-#endif
-			if (do_select) {
+			if (!internal_ssl_pending(connection->ssl_data)) {
+				CONNECTION_STATS_ADD(connection, recv_syscalls, 1);
 				int conn_error = socket_check_fd((int)(long)connection->data, FDM_READ, timeout);
 				idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, received);
 
@@ -688,90 +2096,451 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_
 				}
 			}
 
-#ifdef HAVE_OPENSSL
-			int r = SSL_read(connection->ssl_data->session, (void*)((char*)(data+received)), (int)len-received);
+			int r = internal_ssl_buffered_read(connection, data+received, len-received);
 			if (r > 0) {
 				received += r;
-			} else {
-				int sslerr = SSL_get_error(connection->ssl_data->session, r);
-				if (sslerr == SSL_ERROR_WANT_READ) {
-					continue;
-				}
+			} else if (r < 0) {
 				break;
 			}
-#else
-			ssize_t r = gnutls_record_recv(connection->ssl_data->session, (void*)(data+received), (size_t)len-received);
-			if (r > 0) {
-				received += r;
-			} else {
-				break;
-			}
-#endif
 		}
 
-		debug_info("SSL_read %d, received %d", len, received);
+		trace_event(TRACE_SSL_READ, len, received, (received < len) ? IDEVICE_E_SSL_ERROR : IDEVICE_E_SUCCESS);
 		if (received < len) {
 			*recv_bytes = 0;
 			return IDEVICE_E_SSL_ERROR;
 		}
-
-		*recv_bytes = received;
-		return IDEVICE_E_SUCCESS;
+
+		*recv_bytes = received;
+		return IDEVICE_E_SUCCESS;
+	}
+	return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
+}
+
+/**
+ * Checks the first data received on a connection that dropped SSL after the
+ * handshake on its own behalf. A device that did not accept plaintext
+ * answers with a TLS record, usually an alert, or closes the connection; the
+ * service is then recorded as rejected so later connections keep SSL, and
+ * the receive fails.
+ */
+static idevice_error_t internal_plaintext_check(idevice_connection_t connection, const char *data, uint32_t recv_bytes, idevice_error_t res)
+{
+	int rejected = 0;
+
+	if (res == IDEVICE_E_SUCCESS && recv_bytes > 0) {
+		/* TLS record header: content type 20-23, major version 3 */
+		unsigned char type = (unsigned char)data[0];
+		rejected = (type >= 0x14 && type <= 0x17 && (recv_bytes < 2 || data[1] == 0x03));
+	} else if (res == IDEVICE_E_TIMEOUT || res == IDEVICE_E_WOULD_BLOCK || (res == IDEVICE_E_SUCCESS && recv_bytes == 0)) {
+		return res;
+	} else {
+		rejected = 1;
+	}
+	connection->plaintext_verify = 0;
+	if (!rejected) {
+		return res;
+	}
+
+	debug_info("Device rejected plaintext after the SSL handshake for %s, keeping SSL from now on", connection->plaintext_service);
+	idevice_t device = connection->device;
+	mutex_lock(&device->plaintext_mutex);
+	struct idevice_plaintext_rejection *rejection = (struct idevice_plaintext_rejection*)malloc(sizeof(struct idevice_plaintext_rejection));
+	rejection->service = strdup(connection->plaintext_service);
+	rejection->next = device->plaintext_rejected;
+	device->plaintext_rejected = rejection;
+	mutex_unlock(&device->plaintext_mutex);
+	return IDEVICE_E_SSL_ERROR;
+}
+
+/* Only the first receive after dropping SSL has to be looked at */
+#define PLAINTEXT_CHECK(connection, data, recv_bytes, res) \
+	do { \
+		if ((connection) && (connection)->plaintext_verify && (recv_bytes)) { \
+			res = internal_plaintext_check(connection, data, *(recv_bytes), res); \
+		} \
+	} while (0)
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	uint64_t start = internal_time_us();
+	idevice_error_t res = internal_connection_receive_all_timeout(connection, data, len, recv_bytes, timeout);
+	PLAINTEXT_CHECK(connection, data, recv_bytes, res);
+	trace_event(TRACE_CONNECTION_RECEIVE, len, (recv_bytes) ? *recv_bytes : 0, res);
+	if (connection && recv_bytes && res != IDEVICE_E_INVALID_ARG) {
+		if (connection->capture_id && *recv_bytes > 0) {
+			capture_frame(connection->capture_id, CAPTURE_FRAME_RECEIVE, data, *recv_bytes);
+		}
+		CONNECTION_STATS_ADD(connection, bytes_received, *recv_bytes);
+		CONNECTION_STATS_ADD(connection, recv_blocked_us, internal_time_us() - start);
+		internal_qos_throttle(connection, *recv_bytes);
+	}
+	return res;
+}
+
+/**
+ * Internally used function for receiving raw data over the given connection.
+ */
+static idevice_error_t internal_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	CONNECTION_STATS_ADD(connection, recv_syscalls, 1);
+
+	if (connection->type == CONNECTION_USBMUXD) {
+		int res = usbmuxd_recv((int)(long)connection->data, data, len, recv_bytes);
+		if (res < 0) {
+			debug_info("ERROR: usbmuxd_recv returned %d (%s)", res, strerror(-res));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		return IDEVICE_E_SUCCESS;
+	} else if (connection->type == CONNECTION_NETWORK) {
+		int res = socket_receive((int)(long)connection->data, data, len);
+		if (res < 0) {
+			debug_info("ERROR: socket_receive returned %d (%s)", res, strerror(-res));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		*recv_bytes = (uint32_t)res;
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
+	}
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
+
+/**
+ * Internally used function for receiving up to len bytes over the given
+ * connection, using SSL if enabled.
+ */
+static idevice_error_t internal_connection_receive_any(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->ssl_data) {
+		int received = internal_ssl_buffer_read(connection->ssl_data, data, len);
+		if (received == 0) {
+			received = internal_ssl_read_record(connection, data, len);
+			trace_event(TRACE_SSL_READ, len, received, (received > 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_SSL_ERROR);
+		}
+		if (received > 0) {
+			*recv_bytes = received;
+			return IDEVICE_E_SUCCESS;
+		}
+		*recv_bytes = 0;
+		return IDEVICE_E_SSL_ERROR;
+	}
+	return internal_connection_receive(connection, data, len, recv_bytes);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	uint64_t start = internal_time_us();
+	idevice_error_t res = internal_connection_receive_any(connection, data, len, recv_bytes);
+	PLAINTEXT_CHECK(connection, data, recv_bytes, res);
+	trace_event(TRACE_CONNECTION_RECEIVE, len, (recv_bytes && res == IDEVICE_E_SUCCESS) ? *recv_bytes : 0, res);
+	if (connection && recv_bytes && res != IDEVICE_E_INVALID_ARG) {
+		if (connection->capture_id && res == IDEVICE_E_SUCCESS && *recv_bytes > 0) {
+			capture_frame(connection->capture_id, CAPTURE_FRAME_RECEIVE, data, *recv_bytes);
+		}
+		CONNECTION_STATS_ADD(connection, bytes_received, (res == IDEVICE_E_SUCCESS) ? *recv_bytes : 0);
+		CONNECTION_STATS_ADD(connection, recv_blocked_us, internal_time_us() - start);
+		if (res == IDEVICE_E_SUCCESS) {
+			internal_qos_throttle(connection, *recv_bytes);
+		}
+	}
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_try_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	if (!connection || (connection->ssl_data && !connection->ssl_data->session) || !data || len == 0 || !recv_bytes) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*recv_bytes = 0;
+
+	if (connection->type != CONNECTION_USBMUXD && connection->type != CONNECTION_NETWORK) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	int fd = (int)(long)connection->data;
+
+	if (connection->ssl_data) {
+		int r = internal_ssl_buffer_read(connection->ssl_data, data, len);
+		if (r == 0) {
+#ifdef HAVE_OPENSSL
+			/* the SSL BIO reads from the fd directly */
+			if (socket_set_nonblocking(fd, 1) < 0) {
+				debug_info("ERROR: Failed to put socket into non-blocking mode");
+				return IDEVICE_E_UNKNOWN_ERROR;
+			}
+			r = internal_ssl_buffered_read(connection, data, len);
+			socket_set_nonblocking(fd, 0);
+#else
+			connection->nonblocking = 1;
+			r = internal_ssl_buffered_read(connection, data, len);
+			connection->nonblocking = 0;
+#endif
+		}
+		if (r < 0) {
+			debug_info("ERROR: SSL read failed");
+			return IDEVICE_E_SSL_ERROR;
+		}
+		if (r == 0) {
+			return IDEVICE_E_WOULD_BLOCK;
+		}
+		*recv_bytes = (uint32_t)r;
+		CONNECTION_STATS_ADD(connection, bytes_received, r);
+		if (connection->capture_id) {
+			capture_frame(connection->capture_id, CAPTURE_FRAME_RECEIVE, data, *recv_bytes);
+		}
+		return IDEVICE_E_SUCCESS;
+	}
+
+	CONNECTION_STATS_ADD(connection, recv_syscalls, 1);
+	int res = socket_receive_nonblocking(fd, data, len);
+	if (res == -EAGAIN || res == -EWOULDBLOCK) {
+		return IDEVICE_E_WOULD_BLOCK;
+	}
+	idevice_error_t result = IDEVICE_E_SUCCESS;
+	if (res < 0) {
+		debug_info("ERROR: socket_receive_nonblocking returned %d (%s)", res, strerror(-res));
+		result = IDEVICE_E_UNKNOWN_ERROR;
+	} else {
+		*recv_bytes = (uint32_t)res;
+		CONNECTION_STATS_ADD(connection, bytes_received, res);
+		if (connection->capture_id && res > 0) {
+			capture_frame(connection->capture_id, CAPTURE_FRAME_RECEIVE, data, *recv_bytes);
+		}
+	}
+	PLAINTEXT_CHECK(connection, data, recv_bytes, result);
+	return result;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_pending_bytes(idevice_connection_t connection, uint32_t *pending)
+{
+	if (!connection || !pending) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*pending = 0;
+	if (connection->ssl_data && connection->ssl_data->session) {
+		ssl_data_t ssl_data = connection->ssl_data;
+		*pending = ssl_data->recv_buffer_len - ssl_data->recv_buffer_pos;
+#ifdef HAVE_OPENSSL
+		int n = SSL_pending(ssl_data->session);
+#else
+		size_t n = gnutls_record_check_pending(ssl_data->session);
+#endif
+		if (n > 0) {
+			*pending += (uint32_t)n;
+		}
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+/* Size of the buffer used by idevice_connection_relay() when data has to
+ * go through userspace */
+#define IDEVICE_RELAY_BUFFER_SIZE 131072
+
+/**
+ * Internally used function to send all len bytes to the local socket fd.
+ *
+ * @return 0 on success or a negative errno value on error.
+ */
+static int internal_relay_send_all(int fd, const char *data, int len)
+{
+	int done = 0;
+	while (done < len) {
+		int s = socket_send(fd, (void*)(data + done), len - done);
+		if (s < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				socket_check_fd(fd, FDM_WRITE, 1000);
+				continue;
+			}
+			return -errno;
+		}
+		done += s;
+	}
+	return 0;
+}
+
+/**
+ * Internally used function that relays data through a userspace buffer,
+ * used for SSL connections or when splice() is not available.
+ */
+static idevice_error_t internal_connection_relay_buffered(idevice_connection_t connection, int fd)
+{
+	int cfd = (int)(long)connection->data;
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	char *buffer = (char*)malloc(IDEVICE_RELAY_BUFFER_SIZE);
+	if (!buffer) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	while (1) {
+		uint32_t pending = 0;
+		idevice_connection_get_pending_bytes(connection, &pending);
+
+		struct socket_pollfd pfds[2];
+		pfds[0].fd = cfd;
+		pfds[0].events = SOCKET_POLL_READ;
+		pfds[1].fd = fd;
+		pfds[1].events = SOCKET_POLL_READ;
+		int sret = socket_poll(pfds, 2, (pending > 0) ? 0 : -1);
+		if (sret < 0) {
+			res = IDEVICE_E_UNKNOWN_ERROR;
+			break;
+		}
+
+		if (pending > 0 || pfds[0].revents) {
+			uint32_t recv_bytes = 0;
+			idevice_error_t err = idevice_connection_try_receive(connection, buffer, IDEVICE_RELAY_BUFFER_SIZE, &recv_bytes);
+			if (err == IDEVICE_E_SUCCESS) {
+				if (internal_relay_send_all(fd, buffer, (int)recv_bytes) < 0) {
+					debug_info("ERROR: Failed to forward data to fd %d: %s", fd, strerror(errno));
+					res = IDEVICE_E_UNKNOWN_ERROR;
+					break;
+				}
+			} else if (err != IDEVICE_E_WOULD_BLOCK) {
+				/* device side closed */
+				debug_info("Device side of relay closed (%d)", err);
+				res = (err == IDEVICE_E_SSL_ERROR) ? err : IDEVICE_E_SUCCESS;
+				break;
+			}
+		}
+
+		if (pfds[1].revents) {
+			int r = recv(fd, buffer, IDEVICE_RELAY_BUFFER_SIZE, 0);
+			if (r <= 0) {
+				if (r < 0 && errno == EINTR)
+					continue;
+				debug_info("Local side of relay closed");
+				break;
+			}
+			uint32_t sent = 0;
+			if (idevice_connection_send(connection, buffer, (uint32_t)r, &sent) != IDEVICE_E_SUCCESS) {
+				debug_info("ERROR: Failed to forward data to device");
+				res = IDEVICE_E_UNKNOWN_ERROR;
+				break;
+			}
+		}
 	}
-	return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
+
+	free(buffer);
+	return res;
 }
 
+#ifdef HAVE_SPLICE
 /**
- * Internally used function for receiving raw data over the given connection.
+ * Internally used function that relays data between the two sockets using
+ * splice() without copying it to userspace.
+ *
+ * @return IDEVICE_E_SUCCESS when one side closed, IDEVICE_E_NOT_ENOUGH_DATA
+ *     if splice() is not supported for the given fds and no data has been
+ *     moved yet, or another error code otherwise.
  */
-static idevice_error_t internal_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+static idevice_error_t internal_connection_relay_splice(idevice_connection_t connection, int fd)
 {
-	if (!connection) {
-		return IDEVICE_E_INVALID_ARG;
+	int cfd = (int)(long)connection->data;
+	int to_client[2] = { -1, -1 };
+	int to_device[2] = { -1, -1 };
+	int moved = 0;
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+
+	if (pipe(to_client) < 0) {
+		return IDEVICE_E_NOT_ENOUGH_DATA;
+	}
+	if (pipe(to_device) < 0) {
+		close(to_client[0]);
+		close(to_client[1]);
+		return IDEVICE_E_NOT_ENOUGH_DATA;
 	}
 
-	if (connection->type == CONNECTION_USBMUXD) {
-		int res = usbmuxd_recv((int)(long)connection->data, data, len, recv_bytes);
-		if (res < 0) {
-			debug_info("ERROR: usbmuxd_recv returned %d (%s)", res, strerror(-res));
-			return IDEVICE_E_UNKNOWN_ERROR;
+	while (1) {
+		struct socket_pollfd pfds[2];
+		pfds[0].fd = cfd;
+		pfds[0].events = SOCKET_POLL_READ;
+		pfds[1].fd = fd;
+		pfds[1].events = SOCKET_POLL_READ;
+		int sret = socket_poll(pfds, 2, -1);
+		if (sret < 0) {
+			res = IDEVICE_E_UNKNOWN_ERROR;
+			break;
 		}
-		return IDEVICE_E_SUCCESS;
-	} else if (connection->type == CONNECTION_NETWORK) {
-		int res = socket_receive((int)(long)connection->data, data, len);
-		if (res < 0) {
-			debug_info("ERROR: socket_receive returned %d (%s)", res, strerror(-res));
-			return IDEVICE_E_UNKNOWN_ERROR;
+
+		if (pfds[0].revents) {
+			CONNECTION_STATS_ADD(connection, recv_syscalls, 1);
+			int n = socket_splice(cfd, fd, to_client, IDEVICE_RELAY_BUFFER_SIZE);
+			if (n == 0) {
+				debug_info("Device side of relay closed");
+				break;
+			}
+			if (n < 0 && n != -EAGAIN) {
+				res = (n == -EINVAL && !moved) ? IDEVICE_E_NOT_ENOUGH_DATA : IDEVICE_E_UNKNOWN_ERROR;
+				break;
+			}
+			if (n > 0) {
+				moved = 1;
+				CONNECTION_STATS_ADD(connection, bytes_received, n);
+			}
+		}
+
+		if (pfds[1].revents) {
+			CONNECTION_STATS_ADD(connection, send_syscalls, 1);
+			int n = socket_splice(fd, cfd, to_device, IDEVICE_RELAY_BUFFER_SIZE);
+			if (n == 0) {
+				debug_info("Local side of relay closed");
+				break;
+			}
+			if (n < 0 && n != -EAGAIN) {
+				res = (n == -EINVAL && !moved) ? IDEVICE_E_NOT_ENOUGH_DATA : IDEVICE_E_UNKNOWN_ERROR;
+				break;
+			}
+			if (n > 0) {
+				moved = 1;
+				CONNECTION_STATS_ADD(connection, bytes_sent, n);
+			}
 		}
-		*recv_bytes = (uint32_t)res;
-		return IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", connection->type);
 	}
-	return IDEVICE_E_UNKNOWN_ERROR;
+
+	close(to_client[0]);
+	close(to_client[1]);
+	close(to_device[0]);
+	close(to_device[1]);
+
+	return res;
 }
+#endif
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_relay(idevice_connection_t connection, int fd)
 {
-	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
+	if (!connection || fd < 0 || (connection->ssl_data && !connection->ssl_data->session)) {
 		return IDEVICE_E_INVALID_ARG;
 	}
 
-	if (connection->ssl_data) {
-#ifdef HAVE_OPENSSL
-		int received = SSL_read(connection->ssl_data->session, (void*)data, (int)len);
-		debug_info("SSL_read %d, received %d", len, received);
-#else
-		ssize_t received = gnutls_record_recv(connection->ssl_data->session, (void*)data, (size_t)len);
-#endif
-		if (received > 0) {
-			*recv_bytes = received;
-			return IDEVICE_E_SUCCESS;
+	if (connection->type != CONNECTION_USBMUXD && connection->type != CONNECTION_NETWORK) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+#ifdef HAVE_SPLICE
+	if (!connection->ssl_data) {
+		idevice_error_t res = internal_connection_relay_splice(connection, fd);
+		if (res != IDEVICE_E_NOT_ENOUGH_DATA) {
+			return res;
 		}
-		*recv_bytes = 0;
-		return IDEVICE_E_SSL_ERROR;
+		debug_info("splice() not usable, falling back to buffered relay");
 	}
-	return internal_connection_receive(connection, data, len, recv_bytes);
+#endif
+
+	return internal_connection_relay_buffered(connection, fd);
 }
 
 LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd)
@@ -793,6 +2562,47 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connectio
 	return result;
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_stats(idevice_connection_t connection, idevice_connection_stats_t *stats)
+{
+	if (!connection || !stats) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	memcpy(stats, &connection->stats, sizeof(idevice_connection_stats_t));
+	if (connection->plaintext) {
+		stats->crypto_bytes_saved = stats->bytes_sent + stats->bytes_received - connection->plaintext_base;
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_set_qos(idevice_connection_t connection, idevice_connection_priority_t priority, uint32_t rate_limit)
+{
+	if (!connection || priority < IDEVICE_PRIORITY_INTERACTIVE || priority > IDEVICE_PRIORITY_BULK) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	connection->priority = priority;
+	connection->rate_limit = rate_limit;
+	connection->rate_credit = 0;
+	connection->rate_time = 0;
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_get_stats(idevice_t device, idevice_connection_stats_t *stats)
+{
+	if (!device || !stats) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	stats->bytes_sent = __sync_fetch_and_add(&device->stats.bytes_sent, 0);
+	stats->bytes_received = __sync_fetch_and_add(&device->stats.bytes_received, 0);
+	stats->send_syscalls = __sync_fetch_and_add(&device->stats.send_syscalls, 0);
+	stats->recv_syscalls = __sync_fetch_and_add(&device->stats.recv_syscalls, 0);
+	stats->tls_records_sent = __sync_fetch_and_add(&device->stats.tls_records_sent, 0);
+	stats->tls_records_received = __sync_fetch_and_add(&device->stats.tls_records_received, 0);
+	stats->send_blocked_us = __sync_fetch_and_add(&device->stats.send_blocked_us, 0);
+	stats->recv_blocked_us = __sync_fetch_and_add(&device->stats.recv_blocked_us, 0);
+	stats->crypto_bytes_saved = __sync_fetch_and_add(&device->stats.crypto_bytes_saved, 0);
+	return IDEVICE_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_get_handle(idevice_t device, uint32_t *handle)
 {
 	if (!device || !handle)
@@ -826,6 +2636,17 @@ static ssize_t internal_ssl_read(gnutls_transport_ptr_t transport, char *buffer,
 
 	debug_info("pre-read client wants %zi bytes", length);
 
+	if (connection->nonblocking) {
+		/* only return what is available right now, gnutls keeps track
+		 * of incomplete records */
+		bytes = socket_receive_nonblocking((int)(long)connection->data, buffer, length);
+		if (bytes < 0) {
+			gnutls_transport_set_errno(connection->ssl_data->session, (bytes == -EAGAIN) ? EAGAIN : -bytes);
+			return -1;
+		}
+		return bytes;
+	}
+
 	recv_buffer = (char *)malloc(sizeof(char) * this_len);
 
 	/* repeat until we have the full data or an error occurs */
@@ -875,43 +2696,6 @@ static ssize_t internal_ssl_write(gnutls_transport_ptr_t transport, char *buffer
 }
 #endif
 
-/**
- * Internally used function for cleaning up SSL stuff.
- */
-static void internal_ssl_cleanup(ssl_data_t ssl_data)
-{
-	if (!ssl_data)
-		return;
-
-#ifdef HAVE_OPENSSL
-	if (ssl_data->session) {
-		SSL_free(ssl_data->session);
-	}
-	if (ssl_data->ctx) {
-		SSL_CTX_free(ssl_data->ctx);
-	}
-#else
-	if (ssl_data->session) {
-		gnutls_deinit(ssl_data->session);
-	}
-	if (ssl_data->certificate) {
-		gnutls_certificate_free_credentials(ssl_data->certificate);
-	}
-	if (ssl_data->root_cert) {
-		gnutls_x509_crt_deinit(ssl_data->root_cert);
-	}
-	if (ssl_data->host_cert) {
-		gnutls_x509_crt_deinit(ssl_data->host_cert);
-	}
-	if (ssl_data->root_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->root_privkey);
-	}
-	if (ssl_data->host_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->host_privkey);
-	}
-#endif
-}
-
 #ifdef HAVE_OPENSSL
 static int ssl_verify_callback(int ok, X509_STORE_CTX *ctx)
 {
@@ -961,7 +2745,7 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 	gnutls_certificate_type_t type = gnutls_certificate_type_get(session);
 	if (type == GNUTLS_CRT_X509) {
 		ssl_data_t ssl_data = (ssl_data_t)gnutls_session_get_ptr(session);
-		if (ssl_data && ssl_data->host_privkey && ssl_data->host_cert) {
+		if (ssl_data && ssl_data->credentials && ssl_data->credentials->host_privkey && ssl_data->credentials->host_cert) {
 			debug_info("Passing certificate");
 #if GNUTLS_VERSION_NUMBER >= 0x020b07
 			st->cert_type = type;
@@ -970,8 +2754,8 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 			st->type = type;
 #endif
 			st->ncerts = 1;
-			st->cert.x509 = &ssl_data->host_cert;
-			st->key.x509 = ssl_data->host_privkey;
+			st->cert.x509 = &ssl_data->credentials->host_cert;
+			st->key.x509 = ssl_data->credentials->host_privkey;
 			st->deinit_all = 0;
 			res = 0;
 		}
@@ -980,19 +2764,49 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 }
 #endif
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
+/**
+ * Internally used function for cleaning up SSL stuff.
+ */
+static void internal_ssl_cleanup(ssl_data_t ssl_data)
 {
-	if (!connection || connection->ssl_data)
-		return IDEVICE_E_INVALID_ARG;
+	if (!ssl_data)
+		return;
 
-	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
-	plist_t pair_record = NULL;
+	free(ssl_data->host_id);
+	ssl_data->host_id = NULL;
+	free(ssl_data->recv_buffer);
+	ssl_data->recv_buffer = NULL;
+	ssl_data->recv_buffer_len = 0;
+	ssl_data->recv_buffer_pos = 0;
 
-	userpref_read_pair_record(connection->device->udid, &pair_record);
-	if (!pair_record) {
-		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->device->udid);
-		return ret;
+#ifdef HAVE_OPENSSL
+	if (ssl_data->session) {
+		SSL_free(ssl_data->session);
+	}
+#else
+	if (ssl_data->session) {
+		gnutls_deinit(ssl_data->session);
+	}
+#endif
+	ssl_data->session = NULL;
+
+	if (ssl_data->credentials) {
+		ssl_credentials_release(ssl_data->credentials);
+		ssl_data->credentials = NULL;
 	}
+}
+
+/**
+ * Internally used function to parse the certificates and keys from the
+ * given pair record and to set up the TLS context or credentials with them.
+ */
+static struct ssl_credentials *ssl_credentials_create(plist_t pair_record, int legacy)
+{
+	struct ssl_credentials *creds = (struct ssl_credentials*)calloc(1, sizeof(struct ssl_credentials));
+	if (!creds)
+		return NULL;
+	creds->legacy = legacy;
+	creds->refcount = 1;
 
 #ifdef HAVE_OPENSSL
 	key_data_t root_cert = { NULL, 0 };
@@ -1001,21 +2815,13 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &root_cert);
 	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &root_privkey);
 
-	if (pair_record)
-		plist_free(pair_record);
-
-	BIO *ssl_bio = BIO_new(BIO_s_socket());
-	if (!ssl_bio) {
-		debug_info("ERROR: Could not create SSL bio.");
-		return ret;
-	}
-	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
-
 	SSL_CTX *ssl_ctx = SSL_CTX_new(TLS_method());
 	if (ssl_ctx == NULL) {
 		debug_info("ERROR: Could not create SSL context.");
-		BIO_free(ssl_bio);
-		return ret;
+		free(root_cert.data);
+		free(root_privkey.data);
+		free(creds);
+		return NULL;
 	}
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
@@ -1025,7 +2831,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 #if OPENSSL_VERSION_NUMBER < 0x10100002L || \
 	(defined(LIBRESSL_VERSION_NUMBER) && (LIBRESSL_VERSION_NUMBER < 0x2060000fL))
 	/* force use of TLSv1 for older devices */
-	if (connection->device->version < DEVICE_VERSION(10,0,0)) {
+	if (legacy) {
 #ifdef SSL_OP_NO_TLSv1_1
 		long opts = SSL_CTX_get_options(ssl_ctx);
 		opts |= SSL_OP_NO_TLSv1_1;
@@ -1040,7 +2846,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	}
 #else
 	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_VERSION);
-	if (connection->device->version < DEVICE_VERSION(10,0,0)) {
+	if (legacy) {
 		SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_VERSION);
 	}
 #endif
@@ -1066,13 +2872,148 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	RSA_free(rootPrivKey);
 	free(root_privkey.data);
 
-	SSL *ssl = SSL_new(ssl_ctx);
+	creds->ctx = ssl_ctx;
+#else
+	gnutls_certificate_allocate_credentials(&creds->certificate);
+#if GNUTLS_VERSION_NUMBER >= 0x020b07
+	gnutls_certificate_set_retrieve_function(creds->certificate, internal_cert_callback);
+#else
+	gnutls_certificate_client_set_retrieve_function(creds->certificate, internal_cert_callback);
+#endif
+
+	gnutls_x509_crt_init(&creds->root_cert);
+	gnutls_x509_crt_init(&creds->host_cert);
+	gnutls_x509_privkey_init(&creds->root_privkey);
+	gnutls_x509_privkey_init(&creds->host_privkey);
+
+	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, creds->root_cert);
+	pair_record_import_crt_with_name(pair_record, USERPREF_HOST_CERTIFICATE_KEY, creds->host_cert);
+	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, creds->root_privkey);
+	pair_record_import_key_with_name(pair_record, USERPREF_HOST_PRIVATE_KEY_KEY, creds->host_privkey);
+#endif
+	return creds;
+}
+
+/**
+ * Returns a new reference to the cached credentials for the given device
+ * and host id, creating and caching them from the pair record if needed.
+ * A cached entry for the same device with a different host id (i.e. the
+ * device was paired again) is replaced.
+ */
+static struct ssl_credentials *ssl_credentials_acquire(const char *udid, const char *host_id, int legacy, plist_t pair_record)
+{
+	if (!host_id) {
+		/* can't reliably identify the pairing, don't cache */
+		return ssl_credentials_create(pair_record, legacy);
+	}
+
+	mutex_lock(&ssl_credentials_mutex);
+	struct ssl_credentials *creds = ssl_credentials_cache;
+	struct ssl_credentials *prev = NULL;
+	struct ssl_credentials *stale = NULL;
+	while (creds) {
+		if (!strcmp(creds->udid, udid)) {
+			if (!strcmp(creds->host_id, host_id) && creds->legacy == legacy) {
+				creds->refcount++;
+				mutex_unlock(&ssl_credentials_mutex);
+				return creds;
+			}
+			if (strcmp(creds->host_id, host_id) != 0 && !stale) {
+				/* unlink entry of a previous pairing */
+				stale = creds;
+				creds = creds->next;
+				if (prev) {
+					prev->next = creds;
+				} else {
+					ssl_credentials_cache = creds;
+				}
+				stale->next = NULL;
+				continue;
+			}
+		}
+		prev = creds;
+		creds = creds->next;
+	}
+
+	creds = ssl_credentials_create(pair_record, legacy);
+	if (creds) {
+		creds->udid = strdup(udid);
+		creds->host_id = strdup(host_id);
+		/* one reference for the cache, one for the caller */
+		creds->refcount = 2;
+		creds->next = ssl_credentials_cache;
+		ssl_credentials_cache = creds;
+	}
+	mutex_unlock(&ssl_credentials_mutex);
+
+	if (stale) {
+		ssl_credentials_release(stale);
+	}
+
+	return creds;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
+{
+	if (!connection || connection->ssl_data)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (connection->device && connection->device->replay) {
+		/* captures hold the payload after SSL was terminated */
+		return IDEVICE_E_SUCCESS;
+	}
+
+	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
+	plist_t pair_record = NULL;
+	char *host_id = NULL;
+	int resuming = 0;
+	int resumed = 0;
+	uint64_t handshake_start = internal_time_us();
+
+	userpref_read_pair_record(connection->device->udid, &pair_record);
+	if (!pair_record) {
+		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->device->udid);
+		return ret;
+	}
+	pair_record_get_host_id(pair_record, &host_id);
+
+	struct ssl_credentials *creds = ssl_credentials_acquire(connection->device->udid, host_id, (connection->device->version < DEVICE_VERSION(10,0,0)), pair_record);
+
+	if (pair_record)
+		plist_free(pair_record);
+
+	if (!creds) {
+		debug_info("ERROR: Failed to set up SSL credentials.");
+		free(host_id);
+		return ret;
+	}
+
+#ifdef HAVE_OPENSSL
+	BIO *ssl_bio = BIO_new(BIO_s_socket());
+	if (!ssl_bio) {
+		debug_info("ERROR: Could not create SSL bio.");
+		ssl_credentials_release(creds);
+		free(host_id);
+		return ret;
+	}
+	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
+
+	SSL *ssl = SSL_new(creds->ctx);
 	if (!ssl) {
 		debug_info("ERROR: Could not create SSL object");
 		BIO_free(ssl_bio);
-		SSL_CTX_free(ssl_ctx);
+		ssl_credentials_release(creds);
+		free(host_id);
 		return ret;
 	}
+	if (host_id) {
+		mutex_lock(&ssl_session_cache_mutex);
+		struct ssl_session_cache_entry *entry = ssl_session_cache_find(connection->device->udid, host_id, 0);
+		if (entry && SSL_set_session(ssl, entry->session) == 1) {
+			resuming = 1;
+		}
+		mutex_unlock(&ssl_session_cache_mutex);
+	}
 	SSL_set_connect_state(ssl);
 	SSL_set_verify(ssl, 0, ssl_verify_callback);
 	SSL_set_bio(ssl, ssl_bio, ssl_bio);
@@ -1093,47 +3034,52 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	} while (1);
 	if (ssl_error != 0) {
 		debug_info("ERROR during SSL handshake: %s", ssl_error_to_string(ssl_error));
+		if (resuming) {
+			ssl_session_cache_remove(connection->device->udid, host_id);
+		}
 		SSL_free(ssl);
-		SSL_CTX_free(ssl_ctx);
+		ssl_credentials_release(creds);
+		free(host_id);
 	} else {
 		ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
 		ssl_data_loc->session = ssl;
-		ssl_data_loc->ctx = ssl_ctx;
+		ssl_data_loc->credentials = creds;
+		ssl_data_loc->recv_buffer = NULL;
+		ssl_data_loc->recv_buffer_len = 0;
+		ssl_data_loc->recv_buffer_pos = 0;
+		ssl_data_loc->host_id = host_id;
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
-		debug_info("SSL mode enabled, %s, cipher: %s", SSL_get_version(ssl), SSL_get_cipher(ssl));
+		resumed = SSL_session_reused(ssl);
+		debug_info("SSL mode enabled, %s, cipher: %s%s", SSL_get_version(ssl), SSL_get_cipher(ssl), (resumed) ? " (resumed)" : "");
+		ssl_session_cache_store(connection->device->udid, host_id, ssl_data_loc);
 	}
 	/* required for proper multi-thread clean up to prevent leaks */
 	openssl_remove_thread_state();
 #else
 	ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
+	ssl_data_loc->host_id = host_id;
+	ssl_data_loc->credentials = creds;
+	ssl_data_loc->recv_buffer = NULL;
+	ssl_data_loc->recv_buffer_len = 0;
+	ssl_data_loc->recv_buffer_pos = 0;
 
 	/* Set up GnuTLS... */
 	debug_info("enabling SSL mode");
 	errno = 0;
-	gnutls_certificate_allocate_credentials(&ssl_data_loc->certificate);
-#if GNUTLS_VERSION_NUMBER >= 0x020b07
-	gnutls_certificate_set_retrieve_function(ssl_data_loc->certificate, internal_cert_callback);
-#else
-	gnutls_certificate_client_set_retrieve_function(ssl_data_loc->certificate, internal_cert_callback);
-#endif
 	gnutls_init(&ssl_data_loc->session, GNUTLS_CLIENT);
 	gnutls_priority_set_direct(ssl_data_loc->session, "NONE:+VERS-TLS1.0:+ANON-DH:+RSA:+AES-128-CBC:+AES-256-CBC:+SHA1:+MD5:+COMP-NULL", NULL);
-	gnutls_credentials_set(ssl_data_loc->session, GNUTLS_CRD_CERTIFICATE, ssl_data_loc->certificate);
+	gnutls_credentials_set(ssl_data_loc->session, GNUTLS_CRD_CERTIFICATE, creds->certificate);
 	gnutls_session_set_ptr(ssl_data_loc->session, ssl_data_loc);
 
-	gnutls_x509_crt_init(&ssl_data_loc->root_cert);
-	gnutls_x509_crt_init(&ssl_data_loc->host_cert);
-	gnutls_x509_privkey_init(&ssl_data_loc->root_privkey);
-	gnutls_x509_privkey_init(&ssl_data_loc->host_privkey);
-
-	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, ssl_data_loc->root_cert);
-	pair_record_import_crt_with_name(pair_record, USERPREF_HOST_CERTIFICATE_KEY, ssl_data_loc->host_cert);
-	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, ssl_data_loc->root_privkey);
-	pair_record_import_key_with_name(pair_record, USERPREF_HOST_PRIVATE_KEY_KEY, ssl_data_loc->host_privkey);
-
-	if (pair_record)
-		plist_free(pair_record);
+	if (host_id) {
+		mutex_lock(&ssl_session_cache_mutex);
+		struct ssl_session_cache_entry *entry = ssl_session_cache_find(connection->device->udid, host_id, 0);
+		if (entry && gnutls_session_set_data(ssl_data_loc->session, entry->session.data, entry->session.size) == GNUTLS_E_SUCCESS) {
+			resuming = 1;
+		}
+		mutex_unlock(&ssl_session_cache_mutex);
+	}
 
 	debug_info("GnuTLS step 1...");
 	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)connection);
@@ -1154,6 +3100,9 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	debug_info("GnuTLS handshake done...");
 
 	if (return_me != GNUTLS_E_SUCCESS) {
+		if (resuming) {
+			ssl_session_cache_remove(connection->device->udid, host_id);
+		}
 		internal_ssl_cleanup(ssl_data_loc);
 		free(ssl_data_loc);
 		debug_info("GnuTLS reported something wrong: %s", gnutls_strerror(return_me));
@@ -1161,9 +3110,21 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	} else {
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
-		debug_info("SSL mode enabled");
+		resumed = gnutls_session_is_resumed(ssl_data_loc->session);
+		debug_info("SSL mode enabled%s", (resumed) ? " (resumed)" : "");
+		ssl_session_cache_store(connection->device->udid, host_id, ssl_data_loc);
 	}
 #endif
+	if (connection->device->metrics) {
+		struct metrics_device *metrics = connection->device->metrics;
+		metrics_add(&metrics->handshakes, 1);
+		if (ret != IDEVICE_E_SUCCESS) {
+			metrics_add(&metrics->handshakes_failed, 1);
+		} else if (resumed) {
+			metrics_add(&metrics->handshakes_resumed, 1);
+		}
+		metrics_histogram_observe(&metrics->handshake_latency, internal_time_us() - handshake_start);
+	}
 	return ret;
 }
 
@@ -1181,6 +3142,10 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_disable_bypass_ssl(idevi
 		return IDEVICE_E_SUCCESS;
 	}
 
+	/* refresh the cached session; with TLS 1.3 the resumable session ticket
+	 * is only delivered after the handshake completed */
+	ssl_session_cache_store(connection->device->udid, connection->ssl_data->host_id, connection->ssl_data);
+
 	// some services require plain text communication after SSL handshake
 	// sending out SSL_shutdown will cause bytes
 	if (!sslBypass) {
@@ -1212,3 +3177,58 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_disable_bypass_ssl(idevi
 
 	return IDEVICE_E_SUCCESS;
 }
+
+/**
+ * Drops SSL after the handshake without notifying the device, for services
+ * whose device side continues in plaintext. Payload exchanged from now on
+ * is counted in crypto_bytes_saved.
+ *
+ * @param connection The connection SSL was just enabled on
+ * @param service_name Name of the service, used to record a rejection
+ * @param verify Whether the first data received decides if the device
+ *     accepted plaintext, see idevice_plaintext_rejected()
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_continue_plaintext(idevice_connection_t connection, const char *service_name, int verify)
+{
+	if (!connection || !connection->ssl_data) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	idevice_error_t res = idevice_connection_disable_bypass_ssl(connection, 1);
+	if (res != IDEVICE_E_SUCCESS) {
+		return res;
+	}
+	connection->plaintext = 1;
+	connection->plaintext_base = connection->stats.bytes_sent + connection->stats.bytes_received;
+	if (verify && service_name && connection->device) {
+		free(connection->plaintext_service);
+		connection->plaintext_service = strdup(service_name);
+		connection->plaintext_verify = 1;
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Checks whether the device rejected plaintext after the SSL handshake for
+ * the given service on an earlier connection.
+ *
+ * @return 1 if it did, 0 otherwise
+ */
+int idevice_plaintext_rejected(idevice_t device, const char *service_name)
+{
+	int rejected = 0;
+	if (!device || !service_name) {
+		return 0;
+	}
+	mutex_lock(&device->plaintext_mutex);
+	struct idevice_plaintext_rejection *rejection;
+	for (rejection = device->plaintext_rejected; rejection; rejection = rejection->next) {
+		if (!strcmp(rejection->service, service_name)) {
+			rejected = 1;
+			break;
+		}
+	}
+	mutex_unlock(&device->plaintext_mutex);
+	return rejected;
+}
@@ -44,21 +44,23 @@
 #endif
 
 #include "common/userpref.h"
+#include "common/thread.h"
 #include "libimobiledevice/libimobiledevice.h"
 
 #define DEVICE_VERSION(maj, min, patch) (((maj & 0xFF) << 16) | ((min & 0xFF) << 8) | (patch & 0xFF))
 
+struct ssl_credentials;
+
 struct ssl_data_private {
+	char *host_id;
+	struct ssl_credentials *credentials;
+	char *recv_buffer;
+	uint32_t recv_buffer_len;
+	uint32_t recv_buffer_pos;
 #ifdef HAVE_OPENSSL
 	SSL *session;
-	SSL_CTX *ctx;
 #else
-	gnutls_certificate_credentials_t certificate;
 	gnutls_session_t session;
-	gnutls_x509_privkey_t root_privkey;
-	gnutls_x509_crt_t root_cert;
-	gnutls_x509_privkey_t host_privkey;
-	gnutls_x509_crt_t host_cert;
 #endif
 };
 typedef struct ssl_data_private *ssl_data_t;
@@ -68,6 +70,17 @@ struct idevice_connection_private {
 	enum idevice_connection_type type;
 	void *data;
 	ssl_data_t ssl_data;
+	int nonblocking;
+	idevice_connection_stats_t stats;
+	idevice_connection_priority_t priority;
+	uint32_t rate_limit;
+	int64_t rate_credit;
+	uint64_t rate_time;
+	int plaintext;
+	int plaintext_verify;
+	char *plaintext_service;
+	uint64_t plaintext_base;
+	uint32_t capture_id;
 };
 
 struct idevice_private {
@@ -76,6 +89,58 @@ struct idevice_private {
 	enum idevice_connection_type conn_type;
 	void *conn_data;
 	int version;
+	idevice_network_options_t *net_options;
+	idevice_connection_stats_t stats;
+	struct metrics_device *metrics;
+	char *broker;
+	struct idevice_pending_fd *pending_fds;
+	mutex_t qos_mutex;
+	cond_t qos_cond;
+	int qos_active[IDEVICE_PRIORITY_BULK + 1];
+	mutex_t plaintext_mutex;
+	struct idevice_plaintext_rejection *plaintext_rejected;
+	struct replay_session *replay;
 };
 
+/* Size of the chunk that is coalesced into a single TLS record by
+ * idevice_connection_sendv() */
+#define IDEVICE_SSL_RECORD_SIZE 16384
+
+/* Size of the per-connection buffer used to serve small reads on SSL
+ * connections; matches the maximum TLS record payload */
+#define IDEVICE_SSL_RECV_BUFFER_SIZE 16384
+
+/* Size of the slices bulk and rate limited connections send in */
+#define IDEVICE_QOS_SLICE 16384
+
+/* Maximum time in ms a send is held back for sends of higher classes */
+#define IDEVICE_QOS_MAX_DEFER 20
+
+struct socket_iovec;
+struct metrics_device;
+struct replay_session;
+
+/* A channel obtained from the broker that the next idevice_connect() to the
+ * port from the same thread uses instead of connecting */
+struct idevice_pending_fd {
+	uint16_t port;
+	int fd;
+	thread_id_t owner;
+	struct idevice_pending_fd *next;
+};
+
+/* A service that rejected plaintext after the SSL handshake on a device;
+ * later connections to it keep SSL */
+struct idevice_plaintext_rejection {
+	char *service;
+	struct idevice_plaintext_rejection *next;
+};
+
+idevice_error_t idevice_refresh_handle(idevice_t device);
+idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const struct socket_iovec *iov, int iovcnt, uint32_t *sent_bytes);
+void idevice_set_pending_fd(idevice_t device, uint16_t port, int fd);
+void idevice_clear_pending_fd(idevice_t device, uint16_t port);
+idevice_error_t idevice_connection_continue_plaintext(idevice_connection_t connection, const char *service_name, int verify);
+int idevice_plaintext_rejected(idevice_t device, const char *service_name);
+
 #endif
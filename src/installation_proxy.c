@@ -38,11 +38,22 @@ typedef enum {
 	INSTPROXY_COMMAND_TYPE_SYNC
 } instproxy_command_type_t;
 
-struct instproxy_status_data {
-	instproxy_client_t client;
+/**
+ * A command waiting in the command queue of a client. The device handles one
+ * command per connection at a time, so the queue is worked off in order by
+ * a single worker per client that sends each command and receives its
+ * status messages. The worker runs on the shared thread pool and only
+ * occupies a thread while commands are pending.
+ */
+struct instproxy_command_job {
 	plist_t command;
 	instproxy_status_cb_t cbfunc;
 	void *user_data;
+	instproxy_command_type_t async;
+	instproxy_error_t result;
+	int done;
+	cond_t done_cond;
+	struct instproxy_command_job *next;
 };
 
 /**
@@ -189,7 +200,6 @@ static instproxy_error_t instproxy_strtoerr(const char* name)
  */
 static void instproxy_lock(instproxy_client_t client)
 {
-	debug_info("Locked");
 	mutex_lock(&client->mutex);
 }
 
@@ -200,7 +210,6 @@ static void instproxy_lock(instproxy_client_t client)
  */
 static void instproxy_unlock(instproxy_client_t client)
 {
-	debug_info("Unlocked");
 	mutex_unlock(&client->mutex);
 }
 
@@ -240,10 +249,21 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_new(idevice_t device, lo
 		return err;
 	}
 
+	property_list_service_client_set_binary_capable(plistclient, 1);
+
 	instproxy_client_t client_loc = (instproxy_client_t) malloc(sizeof(struct instproxy_client_private));
 	client_loc->parent = plistclient;
 	mutex_init(&client_loc->mutex);
-	client_loc->receive_status_thread = THREAD_T_NULL;
+	client_loc->worker_active = 0;
+	cond_init(&client_loc->queue_cond);
+	client_loc->queue_head = NULL;
+	client_loc->queue_tail = NULL;
+	client_loc->queue_closing = 0;
+	rwlock_init(&client_loc->cache_lock);
+	client_loc->cache = NULL;
+	client_loc->cache_generation = 0;
+	client_loc->cache_np = NULL;
+	client_loc->cache_sub = NULL;
 
 	*client = client_loc;
 	return INSTPROXY_E_SUCCESS;
@@ -263,19 +283,167 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_free(instproxy_client_t
 
 	property_list_service_client_t parent = client->parent;
 	client->parent = NULL;
-	if (client->receive_status_thread) {
-		debug_info("joining receive_status_thread");
-		thread_join(client->receive_status_thread);
-		thread_free(client->receive_status_thread);
-		client->receive_status_thread = THREAD_T_NULL;
+
+	/* let the command worker fail any queued commands and finish */
+	instproxy_lock(client);
+	client->queue_closing = 1;
+	while (client->worker_active) {
+		debug_info("waiting for command worker");
+		cond_wait(&client->queue_cond, &client->mutex);
 	}
+	instproxy_unlock(client);
 	property_list_service_client_free(parent);
+	if (client->cache_np) {
+		np_unsubscribe(client->cache_np, client->cache_sub);
+		np_client_free(client->cache_np);
+	}
+	plist_free(client->cache);
+	rwlock_destroy(&client->cache_lock);
+	cond_destroy(&client->queue_cond);
 	mutex_destroy(&client->mutex);
 	free(client);
 
 	return INSTPROXY_E_SUCCESS;
 }
 
+static void instproxy_cache_clear(instproxy_client_t client, int disable)
+{
+	rwlock_wrlock(&client->cache_lock);
+	client->cache_generation++;
+	if (client->cache) {
+		plist_free(client->cache);
+		client->cache = (disable) ? NULL : plist_new_dict();
+	}
+	rwlock_wrunlock(&client->cache_lock);
+}
+
+static void instproxy_cache_notify_cb(const char *notification, void *user_data)
+{
+	instproxy_client_t client = (instproxy_client_t)user_data;
+
+	if (!notification || notification[0] == '\0') {
+		/* notifications are lost, the cache can not be kept up to date anymore */
+		debug_info("notification connection failed, disabling lookup cache");
+		instproxy_cache_clear(client, 1);
+		return;
+	}
+	debug_info("%s, clearing lookup cache", notification);
+	instproxy_cache_clear(client, 0);
+}
+
+/* the cache is partitioned by the client options of a lookup, without BundleIDs */
+static char* instproxy_cache_key(plist_t client_options)
+{
+	char *xml = NULL;
+	uint32_t xml_len = 0;
+
+	if (!client_options)
+		return strdup("");
+
+	plist_t options = plist_copy(client_options);
+	plist_dict_remove_item(options, "BundleIDs");
+	plist_to_xml(options, &xml, &xml_len);
+	plist_free(options);
+
+	return (xml) ? xml : strdup("");
+}
+
+/**
+ * Answers a lookup from the cache.
+ * Only used internally.
+ *
+ * @return A PLIST_DICT holding the cached entries for all appids, or NULL if
+ *     any of them is not cached. generation is set to the generation of the
+ *     cache to pass to instproxy_cache_store().
+ */
+static plist_t instproxy_cache_lookup(instproxy_client_t client, const char *key, const char **appids, uint32_t *generation)
+{
+	plist_t result = NULL;
+	int i;
+
+	rwlock_rdlock(&client->cache_lock);
+	*generation = client->cache_generation;
+	plist_t entries = (client->cache) ? plist_dict_get_item(client->cache, key) : NULL;
+	if (entries) {
+		result = plist_new_dict();
+		for (i = 0; appids[i]; i++) {
+			plist_t item = plist_dict_get_item(entries, appids[i]);
+			if (!item) {
+				plist_free(result);
+				result = NULL;
+				break;
+			}
+			/* a PLIST_BOOLEAN marks an application that is not installed */
+			if (plist_get_node_type(item) == PLIST_DICT) {
+				plist_dict_set_item(result, appids[i], plist_copy(item));
+			}
+		}
+	}
+	rwlock_rdunlock(&client->cache_lock);
+
+	return result;
+}
+
+/* stores the result of a lookup unless the cache was cleared in the meantime */
+static void instproxy_cache_store(instproxy_client_t client, const char *key, const char **appids, plist_t lookup_result, uint32_t generation)
+{
+	int i;
+
+	rwlock_wrlock(&client->cache_lock);
+	if (client->cache && client->cache_generation == generation) {
+		plist_t entries = plist_dict_get_item(client->cache, key);
+		if (!entries) {
+			entries = plist_new_dict();
+			plist_dict_set_item(client->cache, key, entries);
+		}
+		for (i = 0; appids[i]; i++) {
+			plist_t item = plist_dict_get_item(lookup_result, appids[i]);
+			plist_dict_set_item(entries, appids[i], (item) ? plist_copy(item) : plist_new_bool(0));
+		}
+	}
+	rwlock_wrunlock(&client->cache_lock);
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_enable_cache(instproxy_client_t client, idevice_t device)
+{
+	const char *notifications[] = { NP_APP_INSTALLED, NP_APP_UNINSTALLED, NULL };
+	np_client_t np = NULL;
+
+	if (!client || !client->parent || !device)
+		return INSTPROXY_E_INVALID_ARG;
+
+	if (client->cache_np)
+		return INSTPROXY_E_SUCCESS;
+
+	if (np_client_start_service_shared(device, &np, NULL) != NP_E_SUCCESS) {
+		debug_info("could not start notification_proxy, not enabling lookup cache");
+		return INSTPROXY_E_CONN_FAILED;
+	}
+
+	rwlock_wrlock(&client->cache_lock);
+	client->cache = plist_new_dict();
+	rwlock_wrunlock(&client->cache_lock);
+
+	if (np_subscribe(np, notifications, instproxy_cache_notify_cb, client, &client->cache_sub) != NP_E_SUCCESS) {
+		np_client_free(np);
+		instproxy_cache_clear(client, 1);
+		return INSTPROXY_E_CONN_FAILED;
+	}
+	client->cache_np = np;
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_clear_cache(instproxy_client_t client)
+{
+	if (!client)
+		return INSTPROXY_E_INVALID_ARG;
+
+	instproxy_cache_clear(client, 0);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
 /**
  * Sends a command to the device.
  * Only used internally.
@@ -294,7 +462,7 @@ static instproxy_error_t instproxy_send_command(instproxy_client_t client, plist
 	if (!client || !command)
 		return INSTPROXY_E_INVALID_ARG;
 
-	instproxy_error_t res = instproxy_error(property_list_service_send_xml_plist(client->parent, command));
+	instproxy_error_t res = instproxy_error(property_list_service_send_plist(client->parent, command));
 
 	if (res != INSTPROXY_E_SUCCESS) {
 		debug_info("could not send command plist, error %d", res);
@@ -334,10 +502,9 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 	instproxy_command_get_name(command, &command_name);
 
 	do {
-		/* receive status response */
-		instproxy_lock(client);
+		/* receive status response; only the command thread receives, the
+		 * timeout is just for noticing instproxy_client_free() */
 		res = instproxy_error(property_list_service_receive_plist_with_timeout(client->parent, &node, 1000));
-		instproxy_unlock(client);
 
 		/* break out if we have a communication problem */
 		if (res != INSTPROXY_E_SUCCESS && res != INSTPROXY_E_RECEIVE_TIMEOUT) {
@@ -408,96 +575,66 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 }
 
 /**
- * Internally used "receive status" thread function that will call the specified
- * callback function when status update messages (or error messages) are
- * received.
+ * Internally used command worker function, run on the shared thread pool.
+ * Takes commands from the queue of the client, sends them and passes their
+ * status messages to the callback function of the command until it
+ * completes or an error occurs. Returns the thread to the pool once the
+ * queue is empty.
  *
- * @param arg Pointer to an allocated struct instproxy_status_data that holds
- *     the required data about the connected client and the callback function.
- *
- * @return Always NULL.
+ * @param arg The installation_proxy client.
  */
-static void* instproxy_receive_status_loop_thread(void* arg)
+static void instproxy_command_worker(void* arg)
 {
-	struct instproxy_status_data *data = (struct instproxy_status_data*)arg;
-
-	/* run until the command is complete or an error occurs */
-	(void)instproxy_receive_status_loop(data->client, data->command, data->cbfunc, data->user_data);
-
-	/* cleanup */
-	instproxy_lock(data->client);
-
-	debug_info("done, cleaning up.");
-
-	if (data->command) {
-		plist_free(data->command);
-	}
-
-	if (data->client->receive_status_thread) {
-		thread_free(data->client->receive_status_thread);
-		data->client->receive_status_thread = THREAD_T_NULL;
-	}
-
-	instproxy_unlock(data->client);
-	free(data);
+	instproxy_client_t client = (instproxy_client_t)arg;
 
-	return NULL;
-}
-
-/**
- * Internally used helper function that creates a "receive status" thread which
- * will call the passed callback function when a status is received.
- *
- * If async is 0 no thread will be created and the command will run
- * synchronously until it completes or an error occurs.
- *
- * @param client The connected installation proxy client
- * @param command Operation name. Will be passed to the callback function
- *        in async mode or shown in debug messages in sync mode.
- * @param async A boolean indicating if receive loop should be run
- *        asynchronously or block.
- * @param status_cb Pointer to a callback function or NULL.
- * @param user_data Callback data passed to status_cb.
- *
- * @return INSTPROXY_E_SUCCESS when the thread was created (async mode), or
- *         when the command completed successfully (sync).
- *         An INSTPROXY_E_* error value is returned if an error occurred.
- */
-static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data)
-{
-	if (!client || !client->parent || !command) {
-		return INSTPROXY_E_INVALID_ARG;
-	}
-
-	if (client->receive_status_thread) {
-		return INSTPROXY_E_OP_IN_PROGRESS;
-	}
+	instproxy_lock(client);
+	client->worker_id = THREAD_ID;
+	while (1) {
+		struct instproxy_command_job *job = client->queue_head;
+		if (!job) {
+			break;
+		}
+		client->queue_head = job->next;
+		if (!client->queue_head) {
+			client->queue_tail = NULL;
+		}
+		instproxy_unlock(client);
 
-	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
-	if (async == INSTPROXY_COMMAND_TYPE_ASYNC) {
-		/* async mode */
-		struct instproxy_status_data *data = (struct instproxy_status_data*)malloc(sizeof(struct instproxy_status_data));
-		if (data) {
-			data->client = client;
-			data->command = plist_copy(command);
-			data->cbfunc = status_cb;
-			data->user_data = user_data;
-
-			if (thread_new(&client->receive_status_thread, instproxy_receive_status_loop_thread, data) == 0) {
-				res = INSTPROXY_E_SUCCESS;
+		instproxy_error_t res = INSTPROXY_E_CONN_FAILED;
+		if (client->parent) {
+			res = instproxy_send_command(client, job->command);
+			if (res == INSTPROXY_E_SUCCESS) {
+				res = instproxy_receive_status_loop(client, job->command, job->cbfunc, job->user_data);
 			}
 		}
-	} else {
-		/* sync mode as a fallback */
-		res = instproxy_receive_status_loop(client, command, status_cb, user_data);
-	}
 
-	return res;
+		if (job->async == INSTPROXY_COMMAND_TYPE_ASYNC) {
+			debug_info("done, cleaning up.");
+			plist_free(job->command);
+			free(job);
+			instproxy_lock(client);
+		} else {
+			/* wake up the caller waiting in instproxy_perform_command() */
+			instproxy_lock(client);
+			job->result = res;
+			job->done = 1;
+			cond_signal(&job->done_cond);
+		}
+	}
+	client->worker_active = 0;
+	/* wake up instproxy_client_free() if it is waiting */
+	cond_signal(&client->queue_cond);
+	instproxy_unlock(client);
 }
 
 /**
  * Internal core function to send a command and process the response.
  *
+ * The command is added to the command queue of the client, which schedules
+ * the command worker on the shared thread pool if it is not running. In sync mode this function waits until the
+ * command completes; commands issued in async mode are processed in the
+ * order they were issued.
+ *
  * @param client The connected installation_proxy client
  * @param command The command specification dictionary.
  * @param async A boolean indicating whether the receive loop should be run
@@ -505,8 +642,9 @@ static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_c
  * @param status_cb Callback function to call if a command status is received.
  * @param user_data Callback data passed to status_cb.
  *
- * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
- *     an error occurred.
+ * @return INSTPROXY_E_SUCCESS when the command was queued (async mode), or
+ *         when the command completed successfully (sync).
+ *         An INSTPROXY_E_* error value is returned if an error occurred.
  */
 static instproxy_error_t instproxy_perform_command(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data)
 {
@@ -514,19 +652,91 @@ static instproxy_error_t instproxy_perform_command(instproxy_client_t client, pl
 		return INSTPROXY_E_INVALID_ARG;
 	}
 
-	if (client->receive_status_thread) {
-		return INSTPROXY_E_OP_IN_PROGRESS;
+	/* a status callback can not wait for a command queued behind its own */
+	if (async != INSTPROXY_COMMAND_TYPE_ASYNC && atomic_read(&client->worker_active)) {
+		instproxy_lock(client);
+		int in_worker = (client->worker_active && thread_id_equal(client->worker_id, THREAD_ID));
+		instproxy_unlock(client);
+		if (in_worker) {
+			return INSTPROXY_E_OP_IN_PROGRESS;
+		}
 	}
 
-	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	/* commands changing installed applications make cached lookups stale */
+	if (client->cache) {
+		char *command_name = NULL;
+		instproxy_command_get_name(command, &command_name);
+		if (command_name && strcmp(command_name, "Lookup") != 0 && strcmp(command_name, "Browse") != 0
+		    && strcmp(command_name, "LookupArchives") != 0 && strcmp(command_name, "CheckCapabilitiesMatch") != 0) {
+			instproxy_cache_clear(client, 0);
+		}
+		free(command_name);
+	}
+
+	struct instproxy_command_job *job = (struct instproxy_command_job*)malloc(sizeof(struct instproxy_command_job));
+	if (!job) {
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+	job->command = (async == INSTPROXY_COMMAND_TYPE_ASYNC) ? plist_copy(command) : command;
+	job->cbfunc = status_cb;
+	job->user_data = user_data;
+	job->async = async;
+	job->result = INSTPROXY_E_UNKNOWN_ERROR;
+	job->done = 0;
+	job->next = NULL;
+	if (async != INSTPROXY_COMMAND_TYPE_ASYNC) {
+		cond_init(&job->done_cond);
+	}
 
-	/* send command */
 	instproxy_lock(client);
-	res = instproxy_send_command(client, command);
-	instproxy_unlock(client);
+	if (client->queue_closing) {
+		instproxy_unlock(client);
+		if (async == INSTPROXY_COMMAND_TYPE_ASYNC) {
+			plist_free(job->command);
+		} else {
+			cond_destroy(&job->done_cond);
+		}
+		free(job);
+		return INSTPROXY_E_CONN_FAILED;
+	}
+	if (client->queue_tail) {
+		client->queue_tail->next = job;
+	} else {
+		client->queue_head = job;
+	}
+	client->queue_tail = job;
+	if (!client->worker_active) {
+		/* the queue is empty whenever no worker is active */
+		client->worker_active = 1;
+		instproxy_unlock(client);
+		if (threadpool_submit(threadpool_get_shared(), instproxy_command_worker, client) != 0) {
+			instproxy_lock(client);
+			client->queue_head = NULL;
+			client->queue_tail = NULL;
+			client->worker_active = 0;
+			cond_signal(&client->queue_cond);
+			instproxy_unlock(client);
+			if (async == INSTPROXY_COMMAND_TYPE_ASYNC) {
+				plist_free(job->command);
+			} else {
+				cond_destroy(&job->done_cond);
+			}
+			free(job);
+			return INSTPROXY_E_UNKNOWN_ERROR;
+		}
+		instproxy_lock(client);
+	}
 
-	/* loop until status or error is received */
-	res = instproxy_receive_status_loop_with_callback(client, command, async, status_cb, user_data);
+	instproxy_error_t res = INSTPROXY_E_SUCCESS;
+	if (async != INSTPROXY_COMMAND_TYPE_ASYNC) {
+		while (!job->done) {
+			cond_wait(&job->done_cond, &client->mutex);
+		}
+		res = job->result;
+		cond_destroy(&job->done_cond);
+		free(job);
+	}
+	instproxy_unlock(client);
 
 	return res;
 }
@@ -553,23 +763,72 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_with_callback(instproxy_
 static void instproxy_append_current_list_to_result_cb(plist_t command, plist_t status, void *user_data)
 {
 	plist_t *result_array = (plist_t*)user_data;
-	uint64_t current_amount = 0;
-	plist_t current_list = NULL;
-	uint64_t i;
+	uint32_t i;
 
-	instproxy_status_get_current_list(status, NULL, NULL, &current_amount, &current_list);
+	/* use the list of the status message directly, only the items are copied */
+	plist_t current_list = plist_dict_get_item(status, "CurrentList");
+	uint32_t current_amount = (plist_get_node_type(current_list) == PLIST_ARRAY) ? plist_array_get_size(current_list) : 0;
 
 	debug_info("current_amount: %d", current_amount);
 
-	if (current_amount > 0) {
-		for (i = 0; current_list && (i < current_amount); i++) {
-			plist_t item = plist_array_get_item(current_list, i);
-			plist_array_append_item(*result_array, plist_copy(item));
-		}
+	for (i = 0; i < current_amount; i++) {
+		plist_t item = plist_array_get_item(current_list, i);
+		plist_array_append_item(*result_array, plist_copy(item));
 	}
+}
+
+struct instproxy_browse_pages_data {
+	instproxy_browse_page_cb_t page_cb;
+	void *user_data;
+	int stopped;
+};
 
-	if (current_list)
-		plist_free(current_list);
+static void instproxy_browse_pages_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct instproxy_browse_pages_data *data = (struct instproxy_browse_pages_data*)user_data;
+	uint64_t total = 0;
+	uint64_t current_index = 0;
+
+	plist_t current_list = plist_dict_get_item(status, "CurrentList");
+	if (data->stopped || plist_get_node_type(current_list) != PLIST_ARRAY)
+		return;
+
+	instproxy_status_get_current_list(status, &total, &current_index, NULL, NULL);
+	if (data->page_cb(current_list, current_index, total, data->user_data) != 0) {
+		/* the remaining pages still have to be received */
+		data->stopped = 1;
+	}
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_pages(instproxy_client_t client, plist_t client_options, instproxy_browse_page_cb_t page_cb, void *user_data)
+{
+	if (!client || !client->parent || !page_cb)
+		return INSTPROXY_E_INVALID_ARG;
+
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	struct instproxy_browse_pages_data data = { page_cb, user_data, 0 };
+
+	plist_t options = (client_options) ? plist_copy(client_options) : plist_new_dict();
+	if (!plist_dict_get_item(options, "ReturnAttributes")) {
+		instproxy_client_options_set_return_attributes(options,
+			"CFBundleIdentifier",
+			"CFBundleShortVersionString",
+			"CFBundleVersion",
+			"CFBundleDisplayName",
+			"ApplicationType",
+			NULL
+		);
+	}
+
+	plist_t command = plist_new_dict();
+	plist_dict_set_item(command, "Command", plist_new_string("Browse"));
+	plist_dict_set_item(command, "ClientOptions", options);
+
+	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_browse_pages_cb, (void*)&data);
+
+	plist_free(command);
+
+	return res;
 }
 
 LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
@@ -621,6 +880,19 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_lookup(instproxy_client_t clien
 	if (!client || !client->parent || !result)
 		return INSTPROXY_E_INVALID_ARG;
 
+	char *cache_key = NULL;
+	uint32_t cache_generation = 0;
+	if (appids && client->cache_np) {
+		cache_key = instproxy_cache_key(client_options);
+		plist_t cached = instproxy_cache_lookup(client, cache_key, appids, &cache_generation);
+		if (cached) {
+			debug_info("answered lookup from cache");
+			free(cache_key);
+			*result = cached;
+			return INSTPROXY_E_SUCCESS;
+		}
+	}
+
 	command = plist_new_dict();
 	plist_dict_set_item(command, "Command", plist_new_string("Lookup"));
 	if (client_options) {
@@ -646,11 +918,15 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_lookup(instproxy_client_t clien
 	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)&lookup_result);
 
 	if (res == INSTPROXY_E_SUCCESS) {
+		if (cache_key) {
+			instproxy_cache_store(client, cache_key, appids, lookup_result, cache_generation);
+		}
 		*result = lookup_result;
 	} else {
 		plist_free(lookup_result);
 	}
 
+	free(cache_key);
 	plist_free(command);
 
 	return res;
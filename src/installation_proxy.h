@@ -24,13 +24,27 @@
 #define __INSTALLATION_PROXY_H
 
 #include "libimobiledevice/installation_proxy.h"
+#include "libimobiledevice/notification_proxy.h"
 #include "property_list_service.h"
 #include "common/thread.h"
 
 struct instproxy_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
-	THREAD_T receive_status_thread;
+	/* commands waiting for the command worker, see instproxy_perform_command();
+	 * the worker runs on the shared thread pool while the queue is not empty */
+	int worker_active;
+	thread_id_t worker_id;
+	cond_t queue_cond;
+	struct instproxy_command_job *queue_head;
+	struct instproxy_command_job *queue_tail;
+	int queue_closing;
+	/* lookup cache, see instproxy_client_enable_cache() */
+	rwlock_t cache_lock;
+	plist_t cache;
+	uint32_t cache_generation;
+	np_client_t cache_np;
+	np_subscription_t cache_sub;
 };
 
 #endif
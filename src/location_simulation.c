@@ -0,0 +1,174 @@
+/*
+ * location_simulation.c
+ * com.apple.dt.simulatelocation service implementation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "location_simulation.h"
+#include "lockdown.h"
+#include "common/debug.h"
+#include "common/socket.h"
+#include "endianness.h"
+
+/**
+ * Convert a service_error_t value to a location_simulation_error_t value.
+ * Used internally to get correct error codes.
+ *
+ * @param err An service_error_t error code
+ *
+ * @return A matching location_simulation_error_t error code,
+ *     LOCATION_SIMULATION_E_UNKNOWN_ERROR otherwise.
+ */
+static location_simulation_error_t location_simulation_error(service_error_t err)
+{
+	switch (err) {
+		case SERVICE_E_SUCCESS:
+			return LOCATION_SIMULATION_E_SUCCESS;
+		case SERVICE_E_INVALID_ARG:
+			return LOCATION_SIMULATION_E_INVALID_ARG;
+		case SERVICE_E_MUX_ERROR:
+			return LOCATION_SIMULATION_E_MUX_ERROR;
+		case SERVICE_E_SSL_ERROR:
+			return LOCATION_SIMULATION_E_SSL_ERROR;
+		default:
+			break;
+	}
+	return LOCATION_SIMULATION_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API location_simulation_error_t location_simulation_client_new(idevice_t device, lockdownd_service_descriptor_t service, location_simulation_client_t *client)
+{
+	if (!device || !service || service->port == 0 || !client) {
+		debug_info("Incorrect parameter passed to location_simulation_client_new.");
+		return LOCATION_SIMULATION_E_INVALID_ARG;
+	}
+	*client = NULL;
+
+	service_client_t parent = NULL;
+	location_simulation_error_t ret = location_simulation_error(service_client_new(device, service, &parent));
+	if (ret != LOCATION_SIMULATION_E_SUCCESS) {
+		debug_info("Creating base service client failed. Error: %i", ret);
+		return ret;
+	}
+
+	location_simulation_client_t client_loc = (location_simulation_client_t) malloc(sizeof(struct location_simulation_client_private));
+	client_loc->parent = parent;
+
+	*client = client_loc;
+
+	return LOCATION_SIMULATION_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API location_simulation_error_t location_simulation_client_start_service(idevice_t device, location_simulation_client_t *client, const char *label)
+{
+	location_simulation_error_t err = LOCATION_SIMULATION_E_UNKNOWN_ERROR;
+	service_client_factory_start_service(device, LOCATION_SIMULATION_SERVICE_NAME, (void**)client, label, SERVICE_CONSTRUCTOR(location_simulation_client_new), &err);
+	return err;
+}
+
+LIBIMOBILEDEVICE_API location_simulation_error_t location_simulation_client_free(location_simulation_client_t client)
+{
+	if (!client)
+		return LOCATION_SIMULATION_E_INVALID_ARG;
+
+	location_simulation_error_t err = location_simulation_error(service_client_free(client->parent));
+	free(client);
+
+	return err;
+}
+
+/**
+ * Sends a command of the simulatelocation protocol followed by its
+ * length-prefixed string arguments in a single write.
+ */
+static location_simulation_error_t location_simulation_send(location_simulation_client_t client, uint32_t command, const char **args, int num_args)
+{
+	struct socket_iovec iov[5];
+	uint32_t headers[3];
+	uint32_t total = 0;
+	uint32_t sent = 0;
+	int num = 0;
+	int i;
+
+	headers[0] = htobe32(command);
+	iov[num].data = &headers[0];
+	iov[num].length = sizeof(uint32_t);
+	total += iov[num++].length;
+	for (i = 0; i < num_args; i++) {
+		uint32_t len = (uint32_t)strlen(args[i]);
+		headers[i+1] = htobe32(len);
+		iov[num].data = &headers[i+1];
+		iov[num].length = sizeof(uint32_t);
+		total += iov[num++].length;
+		iov[num].data = args[i];
+		iov[num].length = len;
+		total += iov[num++].length;
+	}
+
+	location_simulation_error_t res = location_simulation_error(service_sendv(client->parent, iov, num, &sent));
+	if (res == LOCATION_SIMULATION_E_SUCCESS && sent != total) {
+		debug_info("ERROR: Could not send all data (%d of %d)!", sent, total);
+		res = LOCATION_SIMULATION_E_MUX_ERROR;
+	}
+
+	return res;
+}
+
+/**
+ * Formats a coordinate with a '.' as decimal separator, whatever the
+ * LC_NUMERIC locale of the application is.
+ */
+static void location_simulation_format(char *buf, size_t size, double value)
+{
+	char *p;
+
+	/* 7 decimals are about 1cm, more than GPS resolution */
+	snprintf(buf, size, "%.7f", value);
+	for (p = buf; *p; p++) {
+		if (*p == ',')
+			*p = '.';
+	}
+}
+
+LIBIMOBILEDEVICE_API location_simulation_error_t location_simulation_set(location_simulation_client_t client, double latitude, double longitude)
+{
+	char lat[32];
+	char lon[32];
+	const char *args[2] = { lat, lon };
+
+	if (!client || latitude < -90.0 || latitude > 90.0 || longitude < -180.0 || longitude > 180.0)
+		return LOCATION_SIMULATION_E_INVALID_ARG;
+
+	location_simulation_format(lat, sizeof(lat), latitude);
+	location_simulation_format(lon, sizeof(lon), longitude);
+
+	return location_simulation_send(client, LOCATION_SIMULATION_CMD_SET, args, 2);
+}
+
+LIBIMOBILEDEVICE_API location_simulation_error_t location_simulation_stop(location_simulation_client_t client)
+{
+	if (!client)
+		return LOCATION_SIMULATION_E_INVALID_ARG;
+
+	return location_simulation_send(client, LOCATION_SIMULATION_CMD_STOP, NULL, 0);
+}
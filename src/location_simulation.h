@@ -0,0 +1,34 @@
+/*
+ * location_simulation.h
+ * com.apple.dt.simulatelocation service header file.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __LOCATION_SIMULATION_H
+#define __LOCATION_SIMULATION_H
+
+#include "libimobiledevice/location_simulation.h"
+#include "service.h"
+
+/* commands of the simulatelocation protocol */
+#define LOCATION_SIMULATION_CMD_SET  0
+#define LOCATION_SIMULATION_CMD_STOP 1
+
+struct location_simulation_client_private {
+	service_client_t parent;
+};
+
+#endif
@@ -33,14 +33,17 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <time.h>
 #include <plist/plist.h>
 
 #include "property_list_service.h"
 #include "lockdown.h"
 #include "idevice.h"
+#include "broker.h"
 #include "common/debug.h"
 #include "common/userpref.h"
 #include "common/utils.h"
+#include "common/thread.h"
 #include "asprintf.h"
 
 #ifdef WIN32
@@ -242,6 +245,60 @@ static void plist_dict_add_label(plist_t plist, const char *label)
 	}
 }
 
+/**
+ * Sets a string item of a plist dict, reusing the node if the key already
+ * holds a string. Nothing is allocated if the value did not change.
+ *
+ * @param dict The plist dict to modify
+ * @param key The key of the item
+ * @param value The new string value, or NULL to remove the item
+ */
+static void plist_dict_update_string(plist_t dict, const char *key, const char *value)
+{
+	plist_t node = plist_dict_get_item(dict, key);
+
+	if (!value) {
+		if (node)
+			plist_dict_remove_item(dict, key);
+		return;
+	}
+
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		const char *current = plist_get_string_ptr(node, NULL);
+		if (!current || strcmp(current, value) != 0)
+			plist_set_string_val(node, value);
+		return;
+	}
+
+	plist_dict_set_item(dict, key, plist_new_string(value));
+}
+
+/**
+ * Returns the reusable request dict of the client, set up for the given
+ * request. The dict is kept for the lifetime of the client so that steady
+ * state requests do not allocate and free a new plist each time.
+ * Callers adding further items have to remove them again after sending.
+ *
+ * @param client The lockdown client
+ * @param request The request name
+ * @param domain The domain to add to the request or NULL
+ * @param key The key to add to the request or NULL
+ *
+ * @return The request dict, owned by the client.
+ */
+static plist_t lockdownd_request_prepare(lockdownd_client_t client, const char *request, const char *domain, const char *key)
+{
+	if (!client->request) {
+		client->request = plist_new_dict();
+	}
+	plist_dict_update_string(client->request, "Label", client->label);
+	plist_dict_update_string(client->request, "Domain", domain);
+	plist_dict_update_string(client->request, "Key", key);
+	plist_dict_update_string(client->request, "Request", request);
+
+	return client->request;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_stop_session(lockdownd_client_t client, const char *session_id)
 {
 	if (!client)
@@ -254,16 +311,14 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_stop_session(lockdownd_client_t
 
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
-	plist_t dict = plist_new_dict();
-	plist_dict_add_label(dict, client->label);
-	plist_dict_set_item(dict,"Request", plist_new_string("StopSession"));
+	plist_t dict = lockdownd_request_prepare(client, "StopSession", NULL, NULL);
 	plist_dict_set_item(dict,"SessionID", plist_new_string(session_id));
 
 	debug_info("stopping session %s", session_id);
 
 	ret = lockdownd_send(client, dict);
 
-	plist_free(dict);
+	plist_dict_remove_item(dict, "SessionID");
 	dict = NULL;
 
 	ret = lockdownd_receive(client, &dict);
@@ -317,6 +372,9 @@ static lockdownd_error_t lockdownd_client_free_simple(lockdownd_client_t client)
 	if (client->label) {
 		free(client->label);
 	}
+	if (client->request) {
+		plist_free(client->request);
+	}
 
 	free(client);
 	client = NULL;
@@ -324,20 +382,527 @@ static lockdownd_error_t lockdownd_client_free_simple(lockdownd_client_t client)
 	return ret;
 }
 
+/**
+ * Closes the session of the client, if any, and frees it.
+ */
+static lockdownd_error_t lockdownd_client_free_uncached(lockdownd_client_t client)
+{
+	if (client->session_id) {
+		lockdownd_stop_session(client, client->session_id);
+	}
+
+	return lockdownd_client_free_simple(client);
+}
+
+struct lockdownd_session_cache_entry {
+	lockdownd_client_t client;
+	time_t last_used;
+	struct lockdownd_session_cache_entry *next;
+};
+
+static struct lockdownd_session_cache_entry *session_cache = NULL;
+static unsigned int session_cache_timeout = 0;
+static mutex_t session_cache_mutex;
+static thread_once_t session_cache_once = THREAD_ONCE_INIT;
+
+static void lockdownd_session_cache_init(void)
+{
+	mutex_init(&session_cache_mutex);
+}
+
+/**
+ * Removes entries from the session cache. With device set, all entries for
+ * the device are removed, otherwise only those idle for longer than the
+ * cache timeout. Must be called with session_cache_mutex held.
+ *
+ * @return A list of the removed entries that the caller has to release using
+ *     lockdownd_session_cache_release() after dropping the lock.
+ */
+static struct lockdownd_session_cache_entry* lockdownd_session_cache_collect(idevice_t device)
+{
+	struct lockdownd_session_cache_entry *removed = NULL;
+	struct lockdownd_session_cache_entry **link = &session_cache;
+	time_t now = time(NULL);
+
+	while (*link) {
+		struct lockdownd_session_cache_entry *entry = *link;
+		if ((device && entry->client->device == device) || (!device && (now - entry->last_used) >= (time_t)session_cache_timeout)) {
+			*link = entry->next;
+			entry->next = removed;
+			removed = entry;
+		} else {
+			link = &entry->next;
+		}
+	}
+
+	return removed;
+}
+
+static void lockdownd_session_cache_release(struct lockdownd_session_cache_entry *entries)
+{
+	while (entries) {
+		struct lockdownd_session_cache_entry *next = entries->next;
+		debug_info("closing cached session for device %s", entries->client->udid);
+		lockdownd_client_free_uncached(entries->client);
+		free(entries);
+		entries = next;
+	}
+}
+
+/**
+ * Takes an idle authenticated client for the given device from the session
+ * cache, expiring stale entries on the way.
+ *
+ * @return A client with an open session, or NULL if none is cached.
+ */
+static lockdownd_client_t lockdownd_session_cache_take(idevice_t device)
+{
+	struct lockdownd_session_cache_entry *removed = NULL;
+	struct lockdownd_session_cache_entry **link;
+	lockdownd_client_t client = NULL;
+
+	thread_once(&session_cache_once, lockdownd_session_cache_init);
+
+	mutex_lock(&session_cache_mutex);
+	if (session_cache_timeout > 0) {
+		removed = lockdownd_session_cache_collect(NULL);
+	}
+	for (link = &session_cache; *link; link = &(*link)->next) {
+		if ((*link)->client->device == device) {
+			struct lockdownd_session_cache_entry *entry = *link;
+			*link = entry->next;
+			client = entry->client;
+			free(entry);
+			break;
+		}
+	}
+	mutex_unlock(&session_cache_mutex);
+
+	lockdownd_session_cache_release(removed);
+
+	return client;
+}
+
+/**
+ * Puts a client with an open session into the session cache.
+ *
+ * @return 1 if the client was cached, 0 if caching is disabled.
+ */
+static int lockdownd_session_cache_put(lockdownd_client_t client)
+{
+	struct lockdownd_session_cache_entry *removed = NULL;
+	int cached = 0;
+
+	thread_once(&session_cache_once, lockdownd_session_cache_init);
+
+	mutex_lock(&session_cache_mutex);
+	if (session_cache_timeout > 0) {
+		struct lockdownd_session_cache_entry *entry = (struct lockdownd_session_cache_entry*)malloc(sizeof(struct lockdownd_session_cache_entry));
+		if (entry) {
+			entry->client = client;
+			entry->last_used = time(NULL);
+			entry->next = session_cache;
+			session_cache = entry;
+			cached = 1;
+		}
+		removed = lockdownd_session_cache_collect(NULL);
+	}
+	mutex_unlock(&session_cache_mutex);
+
+	lockdownd_session_cache_release(removed);
+
+	return cached;
+}
+
+void lockdownd_session_cache_purge(idevice_t device)
+{
+	struct lockdownd_session_cache_entry *removed = NULL;
+
+	thread_once(&session_cache_once, lockdownd_session_cache_init);
+
+	mutex_lock(&session_cache_mutex);
+	removed = lockdownd_session_cache_collect(device);
+	mutex_unlock(&session_cache_mutex);
+
+	lockdownd_session_cache_release(removed);
+}
+
+LIBIMOBILEDEVICE_API void lockdownd_set_session_cache_timeout(unsigned int timeout)
+{
+	struct lockdownd_session_cache_entry *removed = NULL;
+
+	thread_once(&session_cache_once, lockdownd_session_cache_init);
+
+	mutex_lock(&session_cache_mutex);
+	session_cache_timeout = timeout;
+	if (timeout == 0) {
+		removed = session_cache;
+		session_cache = NULL;
+	} else {
+		removed = lockdownd_session_cache_collect(NULL);
+	}
+	mutex_unlock(&session_cache_mutex);
+
+	lockdownd_session_cache_release(removed);
+}
+
+/* Values of the global domain that do not change while a device is
+ * attached; cached values of a device are dropped when it is detached */
+#define VALUE_CACHE_IMMUTABLE_TTL 3600
+static const char *value_cache_immutable_keys[] = {
+	"UniqueDeviceID",
+	"UniqueChipID",
+	"ChipID",
+	"SerialNumber",
+	"ProductType",
+	"ProductVersion",
+	"BuildVersion",
+	"HardwareModel",
+	"HardwarePlatform",
+	"ModelNumber",
+	"DeviceClass",
+	"CPUArchitecture",
+	"BoardId",
+	"WiFiAddress",
+	"BluetoothAddress",
+	"EthernetAddress",
+	"InternationalMobileEquipmentIdentity",
+	NULL
+};
+
+/* Cached values that notification_proxy notifications report as changed;
+ * a NULL key drops all values of the domain */
+static const struct {
+	const char *notification;
+	const char *domain;
+	const char *key;
+} value_cache_invalidations[] = {
+	{ "com.apple.mobile.lockdown.device_name_changed", NULL, "DeviceName" },
+	{ "com.apple.mobile.lockdown.phone_number_changed", NULL, "PhoneNumber" },
+	{ "com.apple.mobile.lockdown.timezone_changed", NULL, "TimeZone" },
+	{ "com.apple.mobile.lockdown.timezone_changed", NULL, "TimeZoneOffsetFromUTC" },
+	{ "com.apple.mobile.lockdown.activation_state", NULL, "ActivationState" },
+	{ "com.apple.mobile.lockdown.brick_state", NULL, "BrickState" },
+	{ "com.apple.mobile.lockdown.disk_usage_changed", "com.apple.disk_usage", NULL },
+	{ "com.apple.language.changed", "com.apple.international", NULL },
+	{ NULL, NULL, NULL }
+};
+
+const char *lockdownd_value_cache_notifications[] = {
+	"com.apple.mobile.lockdown.device_name_changed",
+	"com.apple.mobile.lockdown.phone_number_changed",
+	"com.apple.mobile.lockdown.timezone_changed",
+	"com.apple.mobile.lockdown.activation_state",
+	"com.apple.mobile.lockdown.brick_state",
+	"com.apple.mobile.lockdown.disk_usage_changed",
+	"com.apple.language.changed",
+	NULL
+};
+
+struct lockdownd_value_cache_entry {
+	char *domain;
+	char *key;
+	plist_t value;
+	/* lockdownd answers with more values once a session is started */
+	int session;
+	/* values that do not change are kept until the device is detached, but
+	 * at least VALUE_CACHE_IMMUTABLE_TTL in case no detach event arrives */
+	time_t expires;
+	struct lockdownd_value_cache_entry *next;
+};
+
+/* Cached values of a device. Created on first use and kept for the
+ * lifetime of the process, as clients come and go. */
+struct lockdownd_value_cache {
+	char *udid;
+	struct lockdownd_value_cache_entry *entries;
+	struct lockdownd_value_cache *next;
+};
+
+struct lockdownd_value_cache_ttl {
+	char *domain;
+	unsigned int ttl;
+	struct lockdownd_value_cache_ttl *next;
+};
+
+static struct lockdownd_value_cache *value_caches = NULL;
+static struct lockdownd_value_cache_ttl *value_cache_ttls = NULL;
+static mutex_t value_cache_mutex;
+static thread_once_t value_cache_once = THREAD_ONCE_INIT;
+
+static void lockdownd_value_cache_init(void)
+{
+	mutex_init(&value_cache_mutex);
+}
+
+/* NULL is the global domain or all keys, unlike "" */
+static int value_cache_name_equal(const char *a, const char *b)
+{
+	if (!a || !b) {
+		return (a == b);
+	}
+	return !strcmp(a, b);
+}
+
+static void lockdownd_value_cache_entry_free(struct lockdownd_value_cache_entry *entry)
+{
+	free(entry->domain);
+	free(entry->key);
+	plist_free(entry->value);
+	free(entry);
+}
+
+/* Must be called with value_cache_mutex held */
+static struct lockdownd_value_cache_ttl *lockdownd_value_cache_find_ttl(const char *domain)
+{
+	struct lockdownd_value_cache_ttl *ttl;
+	for (ttl = value_cache_ttls; ttl; ttl = ttl->next) {
+		if (value_cache_name_equal(ttl->domain, domain)) {
+			return ttl;
+		}
+	}
+	return NULL;
+}
+
+/* Must be called with value_cache_mutex held */
+static struct lockdownd_value_cache *lockdownd_value_cache_find(const char *udid, int create)
+{
+	struct lockdownd_value_cache *cache;
+	for (cache = value_caches; cache; cache = cache->next) {
+		if (!strcmp(cache->udid, udid)) {
+			return cache;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	cache = (struct lockdownd_value_cache*)calloc(1, sizeof(struct lockdownd_value_cache));
+	cache->udid = strdup(udid);
+	cache->next = value_caches;
+	value_caches = cache;
+	return cache;
+}
+
+/**
+ * Removes the cached values of the domain matching key from the given
+ * device's cache, or all values of the domain if key is NULL. Whole domain
+ * values containing the key are removed as well. Must be called with
+ * value_cache_mutex held.
+ */
+static void lockdownd_value_cache_remove(struct lockdownd_value_cache *cache, const char *domain, const char *key, int all_domains)
+{
+	struct lockdownd_value_cache_entry **link = &cache->entries;
+	while (*link) {
+		struct lockdownd_value_cache_entry *entry = *link;
+		if (all_domains || (value_cache_name_equal(entry->domain, domain) && (!key || !entry->key || !strcmp(entry->key, key)))) {
+			*link = entry->next;
+			lockdownd_value_cache_entry_free(entry);
+		} else {
+			link = &entry->next;
+		}
+	}
+}
+
+/**
+ * Looks up a cached value of the device that was fetched with or without
+ * a session as given by session.
+ *
+ * @return 1 with a copy of the value in value if it was cached, 0 otherwise
+ */
+static int lockdownd_value_cache_lookup(const char *udid, int session, const char *domain, const char *key, plist_t *value)
+{
+	struct lockdownd_value_cache *cache;
+	int found = 0;
+
+	if (!value_cache_ttls || !udid) {
+		return 0;
+	}
+
+	mutex_lock(&value_cache_mutex);
+	cache = lockdownd_value_cache_find(udid, 0);
+	if (cache) {
+		time_t now = time(NULL);
+		struct lockdownd_value_cache_entry **link = &cache->entries;
+		while (*link) {
+			struct lockdownd_value_cache_entry *entry = *link;
+			if (now >= entry->expires) {
+				*link = entry->next;
+				lockdownd_value_cache_entry_free(entry);
+				continue;
+			}
+			if (entry->session == session && value_cache_name_equal(entry->domain, domain) && value_cache_name_equal(entry->key, key)) {
+				*value = plist_copy(entry->value);
+				found = 1;
+				break;
+			}
+			link = &entry->next;
+		}
+	}
+	mutex_unlock(&value_cache_mutex);
+
+	return found;
+}
+
+static void lockdownd_value_cache_store(const char *udid, int session, const char *domain, const char *key, plist_t value)
+{
+	struct lockdownd_value_cache_ttl *ttl;
+	struct lockdownd_value_cache *cache;
+	struct lockdownd_value_cache_entry **link;
+	int immutable = 0;
+	int i;
+
+	if (!value_cache_ttls || !udid || !value) {
+		return;
+	}
+	if (!domain && key) {
+		for (i = 0; value_cache_immutable_keys[i]; i++) {
+			if (!strcmp(key, value_cache_immutable_keys[i])) {
+				immutable = 1;
+				break;
+			}
+		}
+	}
+
+	mutex_lock(&value_cache_mutex);
+	ttl = lockdownd_value_cache_find_ttl(domain);
+	if (ttl) {
+		cache = lockdownd_value_cache_find(udid, 1);
+		/* replace the value fetched in the same session state only */
+		link = &cache->entries;
+		while (*link) {
+			struct lockdownd_value_cache_entry *old = *link;
+			if (old->session == session && value_cache_name_equal(old->domain, domain) && value_cache_name_equal(old->key, key)) {
+				*link = old->next;
+				lockdownd_value_cache_entry_free(old);
+			} else {
+				link = &old->next;
+			}
+		}
+		struct lockdownd_value_cache_entry *entry = (struct lockdownd_value_cache_entry*)malloc(sizeof(struct lockdownd_value_cache_entry));
+		entry->domain = (domain) ? strdup(domain) : NULL;
+		entry->key = (key) ? strdup(key) : NULL;
+		entry->value = plist_copy(value);
+		entry->session = session;
+		entry->expires = time(NULL) + ((immutable && ttl->ttl < VALUE_CACHE_IMMUTABLE_TTL) ? VALUE_CACHE_IMMUTABLE_TTL : ttl->ttl);
+		entry->next = cache->entries;
+		cache->entries = entry;
+	}
+	mutex_unlock(&value_cache_mutex);
+}
+
+/* Drops a cached value of the device after it was changed through this
+ * library */
+static void lockdownd_value_cache_invalidate(const char *udid, const char *domain, const char *key)
+{
+	struct lockdownd_value_cache *cache;
+
+	if (!value_cache_ttls || !udid) {
+		return;
+	}
+	mutex_lock(&value_cache_mutex);
+	cache = lockdownd_value_cache_find(udid, 0);
+	if (cache) {
+		lockdownd_value_cache_remove(cache, domain, key, 0);
+	}
+	mutex_unlock(&value_cache_mutex);
+}
+
+struct lockdownd_value_cache *lockdownd_value_cache_get(const char *udid)
+{
+	struct lockdownd_value_cache *cache;
+
+	if (!udid) {
+		return NULL;
+	}
+	thread_once(&value_cache_once, lockdownd_value_cache_init);
+	mutex_lock(&value_cache_mutex);
+	cache = lockdownd_value_cache_find(udid, 1);
+	mutex_unlock(&value_cache_mutex);
+
+	return cache;
+}
+
+void lockdownd_value_cache_notify(struct lockdownd_value_cache *cache, const char *notification)
+{
+	int i;
+
+	if (!cache || !notification) {
+		return;
+	}
+	mutex_lock(&value_cache_mutex);
+	for (i = 0; value_cache_invalidations[i].notification; i++) {
+		if (!strcmp(notification, value_cache_invalidations[i].notification)) {
+			debug_info("%s: dropping cached %s", cache->udid, (value_cache_invalidations[i].key) ? value_cache_invalidations[i].key : value_cache_invalidations[i].domain);
+			lockdownd_value_cache_remove(cache, value_cache_invalidations[i].domain, value_cache_invalidations[i].key, 0);
+		}
+	}
+	mutex_unlock(&value_cache_mutex);
+}
+
+void lockdownd_value_cache_purge(const char *udid)
+{
+	struct lockdownd_value_cache *cache;
+
+	if (!udid) {
+		return;
+	}
+	thread_once(&value_cache_once, lockdownd_value_cache_init);
+	mutex_lock(&value_cache_mutex);
+	cache = lockdownd_value_cache_find(udid, 0);
+	if (cache) {
+		lockdownd_value_cache_remove(cache, NULL, NULL, 1);
+	}
+	mutex_unlock(&value_cache_mutex);
+}
+
+LIBIMOBILEDEVICE_API void lockdownd_set_value_cache_ttl(const char *domain, unsigned int ttl)
+{
+	struct lockdownd_value_cache_ttl **link;
+	struct lockdownd_value_cache *cache;
+
+	thread_once(&value_cache_once, lockdownd_value_cache_init);
+
+	mutex_lock(&value_cache_mutex);
+	for (link = &value_cache_ttls; *link; link = &(*link)->next) {
+		if (value_cache_name_equal((*link)->domain, domain)) {
+			break;
+		}
+	}
+	if (ttl > 0) {
+		if (!*link) {
+			*link = (struct lockdownd_value_cache_ttl*)calloc(1, sizeof(struct lockdownd_value_cache_ttl));
+			(*link)->domain = (domain) ? strdup(domain) : NULL;
+		}
+		(*link)->ttl = ttl;
+	} else if (*link) {
+		struct lockdownd_value_cache_ttl *entry = *link;
+		*link = entry->next;
+		free(entry->domain);
+		free(entry);
+	}
+	/* values cached with the previous setting are dropped */
+	for (cache = value_caches; cache; cache = cache->next) {
+		lockdownd_value_cache_remove(cache, domain, NULL, 0);
+	}
+	mutex_unlock(&value_cache_mutex);
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_free(lockdownd_client_t client)
 {
 	if (!client)
 		return LOCKDOWN_E_INVALID_ARG;
 
-	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
-
-	if (client->session_id) {
-		lockdownd_stop_session(client, client->session_id);
+	if (client->brokered) {
+		/* the broker closes the session once the channel is gone */
+		return lockdownd_client_free_simple(client);
 	}
 
-	ret = lockdownd_client_free_simple(client);
+	if (client->cacheable && client->session_id && lockdownd_session_cache_put(client)) {
+		debug_info("keeping session %s for device %s", client->session_id, client->udid);
+		return LOCKDOWN_E_SUCCESS;
+	}
 
-	return ret;
+	return lockdownd_client_free_uncached(client);
 }
 
 LIBIMOBILEDEVICE_API void lockdownd_client_set_label(lockdownd_client_t client, const char *label)
@@ -347,6 +912,9 @@ LIBIMOBILEDEVICE_API void lockdownd_client_set_label(lockdownd_client_t client,
 			free(client->label);
 
 		client->label = (label != NULL) ? strdup(label): NULL;
+
+		/* cached requests contain the old label */
+		property_list_service_flush_send_cache(client->parent);
 	}
 }
 
@@ -363,7 +931,83 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_send(lockdownd_client_t client,
 	if (!client || !plist)
 		return LOCKDOWN_E_INVALID_ARG;
 
-	return lockdownd_error(property_list_service_send_xml_plist(client->parent, plist));
+	return lockdownd_error(property_list_service_send_plist(client->parent, plist));
+}
+
+struct lockdownd_request_template {
+	const char *label;
+	const char *request;
+	const char *domain;
+	const char *key;
+	const char *service;
+};
+
+/**
+ * Builds a request plist from a template.
+ * Used as build callback for property_list_service_send_cached().
+ */
+static plist_t lockdownd_build_request(void *user_data)
+{
+	struct lockdownd_request_template *tmpl = (struct lockdownd_request_template*)user_data;
+	plist_t dict = plist_new_dict();
+	plist_dict_add_label(dict, tmpl->label);
+	if (tmpl->domain) {
+		plist_dict_set_item(dict,"Domain", plist_new_string(tmpl->domain));
+	}
+	if (tmpl->key) {
+		plist_dict_set_item(dict,"Key", plist_new_string(tmpl->key));
+	}
+	plist_dict_set_item(dict,"Request", plist_new_string(tmpl->request));
+	if (tmpl->service) {
+		plist_dict_set_item(dict, "Service", plist_new_string(tmpl->service));
+	}
+	return dict;
+}
+
+/**
+ * Sends a constant request, reusing its serialized form if the same
+ * request has been sent with this client before.
+ *
+ * @param client The lockdown client
+ * @param request The request name
+ * @param domain The domain to add to the request or NULL
+ * @param key The key to add to the request or NULL
+ * @param service The service to add to the request or NULL
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, or an LOCKDOWN_E_* error code
+ *     otherwise.
+ */
+static lockdownd_error_t lockdownd_send_request_cached(lockdownd_client_t client, const char *request, const char *domain, const char *key, const char *service)
+{
+	struct lockdownd_request_template tmpl = { client->label, request, domain, key, service };
+	char key_buffer[256];
+	char *cache_key = key_buffer;
+	lockdownd_error_t ret;
+	int len;
+
+	/* NULL and empty domain or key produce different requests */
+#define LOCKDOWN_CACHE_KEY_FORMAT "%s\n%c%s\n%c%s\n%s"
+#define LOCKDOWN_CACHE_KEY_ARGS request, (domain) ? 'D' : '-', (domain) ? domain : "", (key) ? 'K' : '-', (key) ? key : "", (service) ? service : ""
+	len = snprintf(key_buffer, sizeof(key_buffer), LOCKDOWN_CACHE_KEY_FORMAT, LOCKDOWN_CACHE_KEY_ARGS);
+	if (len < 0) {
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+	/* only unusually long domains or keys need an allocated cache key */
+	if ((size_t)len >= sizeof(key_buffer)) {
+		cache_key = NULL;
+		if (asprintf(&cache_key, LOCKDOWN_CACHE_KEY_FORMAT, LOCKDOWN_CACHE_KEY_ARGS) < 0 || !cache_key) {
+			return LOCKDOWN_E_UNKNOWN_ERROR;
+		}
+	}
+#undef LOCKDOWN_CACHE_KEY_FORMAT
+#undef LOCKDOWN_CACHE_KEY_ARGS
+
+	ret = lockdownd_error(property_list_service_send_cached(client->parent, cache_key, property_list_service_client_prefers_binary(client->parent), lockdownd_build_request, &tmpl));
+	if (cache_key != key_buffer) {
+		free(cache_key);
+	}
+
+	return ret;
 }
 
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type)
@@ -372,16 +1016,12 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_query_type(lockdownd_client_t c
 		return LOCKDOWN_E_INVALID_ARG;
 
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
-
-	plist_t dict = plist_new_dict();
-	plist_dict_add_label(dict, client->label);
-	plist_dict_set_item(dict,"Request", plist_new_string("QueryType"));
+	plist_t dict = NULL;
 
 	debug_info("called");
-	ret = lockdownd_send(client, dict);
-
-	plist_free(dict);
-	dict = NULL;
+	ret = lockdownd_send_request_cached(client, "QueryType", NULL, NULL, NULL);
+	if (ret != LOCKDOWN_E_SUCCESS)
+		return ret;
 
 	ret = lockdownd_receive(client, &dict);
 
@@ -419,23 +1059,12 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t cl
 	plist_t dict = NULL;
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
-	/* setup request plist */
-	dict = plist_new_dict();
-	plist_dict_add_label(dict, client->label);
-	if (domain) {
-		plist_dict_set_item(dict,"Domain", plist_new_string(domain));
-	}
-	if (key) {
-		plist_dict_set_item(dict,"Key", plist_new_string(key));
+	if (lockdownd_value_cache_lookup(client->udid, (client->session_id != NULL), domain, key, value)) {
+		return LOCKDOWN_E_SUCCESS;
 	}
-	plist_dict_set_item(dict,"Request", plist_new_string("GetValue"));
-
-	/* send to device */
-	ret = lockdownd_send(client, dict);
-
-	plist_free(dict);
-	dict = NULL;
 
+	/* send request to device */
+	ret = lockdownd_send_request_cached(client, "GetValue", domain, key, NULL);
 	if (ret != LOCKDOWN_E_SUCCESS)
 		return ret;
 
@@ -459,12 +1088,98 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t cl
 	if (value_node) {
 		debug_info("has a value");
 		*value = plist_copy(value_node);
+		lockdownd_value_cache_store(client->udid, (client->session_id != NULL), domain, key, value_node);
 	}
 
 	plist_free(dict);
 	return ret;
 }
 
+/* Maximum number of GetValue requests in flight in lockdownd_get_values() */
+#define LOCKDOWN_GET_VALUES_WINDOW 16
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char *domain, const char **keys, plist_t *out)
+{
+	if (!client || !keys || !out)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	plist_t requests[LOCKDOWN_GET_VALUES_WINDOW];
+	plist_t result = plist_new_dict();
+	unsigned int done = 0;
+	unsigned int total = 0;
+	unsigned int num_keys = 0;
+	const char **uncached;
+
+	*out = NULL;
+
+	while (keys[num_keys])
+		num_keys++;
+
+	/* only values that are not cached are requested */
+	uncached = (const char**)malloc((num_keys + 1) * sizeof(char*));
+	for (done = 0; done < num_keys; done++) {
+		plist_t value = NULL;
+		if (lockdownd_value_cache_lookup(client->udid, (client->session_id != NULL), domain, keys[done], &value)) {
+			plist_dict_set_item(result, keys[done], value);
+		} else {
+			uncached[total++] = keys[done];
+		}
+	}
+	uncached[total] = NULL;
+	keys = uncached;
+	done = 0;
+
+	while (done < total && ret == LOCKDOWN_E_SUCCESS) {
+		unsigned int num = total - done;
+		unsigned int i;
+
+		if (num > LOCKDOWN_GET_VALUES_WINDOW)
+			num = LOCKDOWN_GET_VALUES_WINDOW;
+
+		/* pipeline a window of requests in as few writes as possible */
+		for (i = 0; i < num; i++) {
+			struct lockdownd_request_template tmpl = { client->label, "GetValue", domain, keys[done + i], NULL };
+			requests[i] = lockdownd_build_request(&tmpl);
+		}
+		ret = lockdownd_error(property_list_service_send_plist_batch(client->parent, (const plist_t*)requests, num, property_list_service_client_prefers_binary(client->parent)));
+		for (i = 0; i < num; i++) {
+			plist_free(requests[i]);
+		}
+		if (ret != LOCKDOWN_E_SUCCESS)
+			break;
+
+		/* replies arrive in request order */
+		for (i = 0; i < num; i++) {
+			plist_t dict = NULL;
+			ret = lockdownd_receive(client, &dict);
+			if (ret != LOCKDOWN_E_SUCCESS)
+				break;
+
+			if (lockdown_check_result(dict, "GetValue") == LOCKDOWN_E_SUCCESS) {
+				plist_t value_node = plist_dict_get_item(dict, "Value");
+				if (value_node) {
+					plist_dict_set_item(result, keys[done + i], plist_copy(value_node));
+					lockdownd_value_cache_store(client->udid, (client->session_id != NULL), domain, keys[done + i], value_node);
+				}
+			} else {
+				debug_info("no value for key %s", keys[done + i]);
+			}
+			plist_free(dict);
+		}
+		done += num;
+	}
+	free(uncached);
+
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		plist_free(result);
+		return ret;
+	}
+
+	*out = result;
+	return LOCKDOWN_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t client, const char *domain, const char *key, plist_t value)
 {
 	if (!client || !value)
@@ -474,21 +1189,14 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t cl
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
 	/* setup request plist */
-	dict = plist_new_dict();
-	plist_dict_add_label(dict, client->label);
-	if (domain) {
-		plist_dict_set_item(dict,"Domain", plist_new_string(domain));
-	}
-	if (key) {
-		plist_dict_set_item(dict,"Key", plist_new_string(key));
-	}
-	plist_dict_set_item(dict,"Request", plist_new_string("SetValue"));
+	dict = lockdownd_request_prepare(client, "SetValue", domain, key);
 	plist_dict_set_item(dict,"Value", value);
 
 	/* send to device */
 	ret = lockdownd_send(client, dict);
 
-	plist_free(dict);
+	/* frees the value as documented */
+	plist_dict_remove_item(dict, "Value");
 	dict = NULL;
 
 	if (ret != LOCKDOWN_E_SUCCESS)
@@ -499,6 +1207,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t cl
 	if (ret != LOCKDOWN_E_SUCCESS)
 		return ret;
 
+	lockdownd_value_cache_invalidate(client->udid, domain, key);
 	ret = lockdown_check_result(dict, "SetValue");
 	if (ret == LOCKDOWN_E_SUCCESS) {
 		debug_info("success");
@@ -522,20 +1231,10 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_remove_value(lockdownd_client_t
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
 	/* setup request plist */
-	dict = plist_new_dict();
-	plist_dict_add_label(dict, client->label);
-	if (domain) {
-		plist_dict_set_item(dict,"Domain", plist_new_string(domain));
-	}
-	if (key) {
-		plist_dict_set_item(dict,"Key", plist_new_string(key));
-	}
-	plist_dict_set_item(dict,"Request", plist_new_string("RemoveValue"));
+	dict = lockdownd_request_prepare(client, "RemoveValue", domain, key);
 
 	/* send to device */
 	ret = lockdownd_send(client, dict);
-
-	plist_free(dict);
 	dict = NULL;
 
 	if (ret != LOCKDOWN_E_SUCCESS)
@@ -546,6 +1245,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_remove_value(lockdownd_client_t
 	if (ret != LOCKDOWN_E_SUCCESS)
 		return ret;
 
+	lockdownd_value_cache_invalidate(client->udid, domain, key);
 	ret = lockdown_check_result(dict, "RemoveValue");
 	if (ret == LOCKDOWN_E_SUCCESS) {
 		debug_info("success");
@@ -630,7 +1330,8 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new(idevice_t device, lo
 
 	static struct lockdownd_service_descriptor service = {
 		.port = 0xf27e,
-		.ssl_enabled = 0
+		.ssl_enabled = 0,
+		.identifier = (char*)"com.apple.mobile.lockdown"
 	};
 
 	property_list_service_client_t plistclient = NULL;
@@ -640,10 +1341,16 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new(idevice_t device, lo
 	}
 
 	lockdownd_client_t client_loc = (lockdownd_client_t) malloc(sizeof(struct lockdownd_client_private));
+	property_list_service_client_set_binary_capable(plistclient, 1);
+
 	client_loc->parent = plistclient;
 	client_loc->ssl_enabled = 0;
 	client_loc->session_id = NULL;
 	client_loc->mux_id = device->mux_id;
+	client_loc->device = device;
+	client_loc->cacheable = 0;
+	client_loc->brokered = 0;
+	client_loc->request = NULL;
 
 	if (idevice_get_udid(device, &client_loc->udid) != IDEVICE_E_SUCCESS) {
 		debug_info("failed to get device udid.");
@@ -657,6 +1364,35 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new(idevice_t device, lo
 	return LOCKDOWN_E_SUCCESS;
 }
 
+/**
+ * Creates a lockdownd client on a session lent by the broker of the device.
+ */
+static lockdownd_error_t lockdownd_client_new_brokered(idevice_t device, lockdownd_client_t *client, const char *label)
+{
+	int fd = -1;
+	char *session_id = NULL;
+	int version = 0;
+
+	if (broker_lockdown_take(device, &fd, &session_id, &version) < 0) {
+		return LOCKDOWN_E_MUX_ERROR;
+	}
+	if (device->version == 0) {
+		device->version = version;
+	}
+
+	idevice_set_pending_fd(device, 0xf27e, fd);
+	lockdownd_error_t ret = lockdownd_client_new(device, client, label);
+	idevice_clear_pending_fd(device, 0xf27e);
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		free(session_id);
+		return ret;
+	}
+	(*client)->session_id = session_id;
+	(*client)->brokered = 1;
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdownd_client_t *client, const char *label)
 {
 	if (!client)
@@ -668,6 +1404,31 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake(idevi
 	char *host_id = NULL;
 	char *type = NULL;
 
+	if (!device)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	client_loc = lockdownd_session_cache_take(device);
+	if (client_loc) {
+		lockdownd_client_set_label(client_loc, label);
+		/* make sure the cached connection is still alive */
+		if (lockdownd_query_type(client_loc, NULL) == LOCKDOWN_E_SUCCESS) {
+			debug_info("reusing cached session %s", client_loc->session_id);
+			*client = client_loc;
+			return LOCKDOWN_E_SUCCESS;
+		}
+		debug_info("cached session is no longer valid");
+		lockdownd_client_free_simple(client_loc);
+		client_loc = NULL;
+	}
+
+	if (device->broker) {
+		if (lockdownd_client_new_brokered(device, client, label) == LOCKDOWN_E_SUCCESS) {
+			debug_info("using session %s of the broker", (*client)->session_id);
+			return LOCKDOWN_E_SUCCESS;
+		}
+		debug_info("broker unavailable, connecting directly");
+	}
+
 	ret = lockdownd_client_new(device, &client_loc, label);
 	if (LOCKDOWN_E_SUCCESS != ret) {
 		debug_info("failed to create lockdownd client.");
@@ -698,6 +1459,12 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake(idevi
 	}
 
 	userpref_read_pair_record(client_loc->udid, &pair_record);
+	if (!pair_record && device->replay) {
+		/* the recorded session was paired and requests are not compared
+		 * on replay, so any host id does */
+		pair_record = plist_new_dict();
+		pair_record_set_host_id(pair_record, "00000000-0000-0000-0000-000000000000");
+	}
 	if (pair_record) {
 		pair_record_get_host_id(pair_record, &host_id);
 	}
@@ -745,6 +1512,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake(idevi
 	}
 
 	if (LOCKDOWN_E_SUCCESS == ret) {
+		client_loc->cacheable = 1;
 		*client = client_loc;
 	} else {
 		lockdownd_client_free(client_loc);
@@ -1047,6 +1815,30 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_unpair(lockdownd_client_t clien
 	return lockdownd_do_pair(client, pair_record, "Unpair", NULL, NULL);
 }
 
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_pair_key_pool(unsigned int size, unsigned int workers)
+{
+	switch (userpref_key_pool_configure(size, workers)) {
+	case USERPREF_E_SUCCESS:
+		return LOCKDOWN_E_SUCCESS;
+	case USERPREF_E_INVALID_ARG:
+		return LOCKDOWN_E_INVALID_ARG;
+	default:
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_wait_pair_key_pool(unsigned int timeout)
+{
+	switch (userpref_key_pool_wait(timeout)) {
+	case USERPREF_E_SUCCESS:
+		return LOCKDOWN_E_SUCCESS;
+	case USERPREF_E_INVALID_CONF:
+		return LOCKDOWN_E_INVALID_CONF;
+	default:
+		return LOCKDOWN_E_RECEIVE_TIMEOUT;
+	}
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_enter_recovery(lockdownd_client_t client)
 {
 	if (!client)
@@ -1252,52 +2044,21 @@ static lockdownd_error_t lockdownd_build_start_service_request(lockdownd_client_
 }
 
 /**
- * Function used internally by lockdownd_start_service and lockdownd_start_service_with_escrow_bag.
+ * Fills a service descriptor from a StartService response.
  *
- * @param client The lockdownd client
- * @param identifier The identifier of the service to start
- * @param send_escrow_bag Should we send the device's escrow bag with the request
- * @param descriptor The service descriptor on success or NULL on failure
+ * @param dict The StartService response
+ * @param identifier The identifier of the requested service
+ * @param service The service descriptor to fill, allocated if it points
+ *     to NULL
  *
- * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG if a parameter
- *  is NULL, LOCKDOWN_E_INVALID_SERVICE if the requested service is not known
- *  by the device, LOCKDOWN_E_START_SERVICE_FAILED if the service could not because
- *  started by the device, LOCKDOWN_E_INVALID_CONF if the host id or escrow bag (when
- *  used) are missing from the device record.
+ * @return LOCKDOWN_E_SUCCESS on success, or the LOCKDOWN_E_* error code
+ *     matching the error reported by the device.
  */
-static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, const char *identifier, int send_escrow_bag, lockdownd_service_descriptor_t *service)
+static lockdownd_error_t lockdownd_parse_start_service_response(plist_t dict, const char *identifier, lockdownd_service_descriptor_t *service)
 {
-	if (!client || !identifier || !service)
-		return LOCKDOWN_E_INVALID_ARG;
-
-	if (*service) {
-		// reset fields if service descriptor is reused
-		(*service)->port = 0;
-		(*service)->ssl_enabled = 0;
-	}
-
-	plist_t dict = NULL;
 	uint16_t port_loc = 0;
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
-	/* create StartService request */
-	ret = lockdownd_build_start_service_request(client, identifier, send_escrow_bag, &dict);
-	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
-
-	/* send to device */
-	ret = lockdownd_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
-	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
-
-	ret = lockdownd_receive(client, &dict);
-
-	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
-
 	if (!dict)
 		return LOCKDOWN_E_PLIST_ERROR;
 
@@ -1341,6 +2102,62 @@ static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, c
 		}
 	}
 
+	return ret;
+}
+
+/**
+ * Function used internally by lockdownd_start_service and lockdownd_start_service_with_escrow_bag.
+ *
+ * @param client The lockdownd client
+ * @param identifier The identifier of the service to start
+ * @param send_escrow_bag Should we send the device's escrow bag with the request
+ * @param descriptor The service descriptor on success or NULL on failure
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG if a parameter
+ *  is NULL, LOCKDOWN_E_INVALID_SERVICE if the requested service is not known
+ *  by the device, LOCKDOWN_E_START_SERVICE_FAILED if the service could not because
+ *  started by the device, LOCKDOWN_E_INVALID_CONF if the host id or escrow bag (when
+ *  used) are missing from the device record.
+ */
+static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, const char *identifier, int send_escrow_bag, lockdownd_service_descriptor_t *service)
+{
+	if (!client || !identifier || !service)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	if (*service) {
+		// reset fields if service descriptor is reused
+		(*service)->port = 0;
+		(*service)->ssl_enabled = 0;
+	}
+
+	plist_t dict = NULL;
+	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
+
+	if (send_escrow_bag) {
+		/* create StartService request */
+		ret = lockdownd_build_start_service_request(client, identifier, send_escrow_bag, &dict);
+		if (LOCKDOWN_E_SUCCESS != ret)
+			return ret;
+
+		/* send to device */
+		ret = lockdownd_send(client, dict);
+		plist_free(dict);
+		dict = NULL;
+	} else {
+		/* the request only depends on the service identifier */
+		ret = lockdownd_send_request_cached(client, "StartService", NULL, NULL, identifier);
+	}
+
+	if (LOCKDOWN_E_SUCCESS != ret)
+		return ret;
+
+	ret = lockdownd_receive(client, &dict);
+
+	if (LOCKDOWN_E_SUCCESS != ret)
+		return ret;
+
+	ret = lockdownd_parse_start_service_response(dict, identifier, service);
+
 	plist_free(dict);
 	dict = NULL;
 
@@ -1357,6 +2174,64 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_start_service_with_escrow_bag(l
 	return lockdownd_do_start_service(client, identifier, 1, service);
 }
 
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_start_services(lockdownd_client_t client, const char **identifiers, unsigned int count, lockdownd_service_descriptor_t *services)
+{
+	if (!client || !identifiers || count == 0 || !services)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	plist_t *requests = NULL;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (!identifiers[i])
+			return LOCKDOWN_E_INVALID_ARG;
+		services[i] = NULL;
+	}
+
+	requests = (plist_t*)calloc(count, sizeof(plist_t));
+	if (!requests)
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+
+	for (i = 0; i < count; i++) {
+		ret = lockdownd_build_start_service_request(client, identifiers[i], 0, &requests[i]);
+		if (ret != LOCKDOWN_E_SUCCESS)
+			break;
+	}
+
+	/* pipeline all requests, then collect the replies in order */
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		ret = lockdownd_error(property_list_service_send_plist_batch(client->parent, (const plist_t*)requests, count, property_list_service_client_prefers_binary(client->parent)));
+	}
+	for (i = 0; i < count; i++) {
+		plist_free(requests[i]);
+	}
+	free(requests);
+
+	if (ret != LOCKDOWN_E_SUCCESS)
+		return ret;
+
+	for (i = 0; i < count; i++) {
+		plist_t dict = NULL;
+		lockdownd_error_t err = lockdownd_receive(client, &dict);
+		if (err != LOCKDOWN_E_SUCCESS) {
+			/* the remaining replies are lost */
+			return err;
+		}
+		err = lockdownd_parse_start_service_response(dict, identifiers[i], &services[i]);
+		plist_free(dict);
+		if (err != LOCKDOWN_E_SUCCESS) {
+			debug_info("Could not start service %s: %d", identifiers[i], err);
+			lockdownd_service_descriptor_free(services[i]);
+			services[i] = NULL;
+			if (ret == LOCKDOWN_E_SUCCESS)
+				ret = err;
+		}
+	}
+
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_activate(lockdownd_client_t client, plist_t activation_record)
 {
 	if (!client)
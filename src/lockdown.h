@@ -35,6 +35,29 @@ struct lockdownd_client_private {
 	char *udid;
 	char *label;
 	uint32_t mux_id;
+	idevice_t device;
+	int cacheable;
+	/* the session belongs to the broker and is relayed by it */
+	int brokered;
+	/* reusable request dict, see lockdownd_request_prepare() */
+	plist_t request;
 };
 
+void lockdownd_session_cache_purge(idevice_t device);
+
+struct lockdownd_value_cache;
+
+/* NULL terminated list of the notifications lockdownd_value_cache_notify()
+ * acts on */
+extern const char *lockdownd_value_cache_notifications[];
+
+/* Returns the value cache of the device, which is kept until the process
+ * exits */
+struct lockdownd_value_cache *lockdownd_value_cache_get(const char *udid);
+/* Drops the cached values the given notification_proxy notification
+ * reports as changed */
+void lockdownd_value_cache_notify(struct lockdownd_value_cache *cache, const char *notification);
+/* Drops all cached values of the device, e.g. when it is detached */
+void lockdownd_value_cache_purge(const char *udid);
+
 #endif
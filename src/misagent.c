@@ -32,6 +32,9 @@
 #include "property_list_service.h"
 #include "common/debug.h"
 
+/* number of requests sent ahead of their replies in the batch functions */
+#define MISAGENT_REQUEST_WINDOW 8
+
 /**
  * Convert a property_list_service_error_t value to a misagent_error_t
  * value. Used internally to get correct error codes.
@@ -140,7 +143,7 @@ LIBIMOBILEDEVICE_API misagent_error_t misagent_install(misagent_client_t client,
 	plist_dict_set_item(dict, "Profile", plist_copy(profile));
 	plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
 
-	misagent_error_t res = misagent_error(property_list_service_send_xml_plist(client->parent, dict));
+	misagent_error_t res = misagent_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 	dict = NULL;
 
@@ -176,7 +179,7 @@ LIBIMOBILEDEVICE_API misagent_error_t misagent_copy(misagent_client_t client, pl
 	plist_dict_set_item(dict, "MessageType", plist_new_string("Copy"));
 	plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
 
-	misagent_error_t res = misagent_error(property_list_service_send_xml_plist(client->parent, dict));
+	misagent_error_t res = misagent_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 	dict = NULL;
 
@@ -216,7 +219,7 @@ LIBIMOBILEDEVICE_API misagent_error_t misagent_copy_all(misagent_client_t client
 	plist_dict_set_item(dict, "MessageType", plist_new_string("CopyAll"));
 	plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
 
-	misagent_error_t res = misagent_error(property_list_service_send_xml_plist(client->parent, dict));
+	misagent_error_t res = misagent_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 	dict = NULL;
 
@@ -257,7 +260,151 @@ LIBIMOBILEDEVICE_API misagent_error_t misagent_remove(misagent_client_t client,
 	plist_dict_set_item(dict, "ProfileID", plist_new_string(profileID));
 	plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
 
-	misagent_error_t res = misagent_error(property_list_service_send_xml_plist(client->parent, dict));
+	misagent_error_t res = misagent_error(property_list_service_send_plist(client->parent, dict));
+	plist_free(dict);
+	dict = NULL;
+
+	if (res != MISAGENT_E_SUCCESS) {
+		debug_info("could not send plist, error %d", res);
+		return res;
+	}
+
+	res = misagent_error(property_list_service_receive_plist(client->parent, &dict));
+	if (res != MISAGENT_E_SUCCESS) {
+		debug_info("could not receive response, error %d", res);
+		return res;
+	}
+	if (!dict) {
+		debug_info("could not get response plist");
+		return MISAGENT_E_UNKNOWN_ERROR;
+	}
+
+	res = misagent_check_result(dict, &client->last_error);
+	plist_free(dict);
+
+	return res;
+}
+
+/**
+ * Sends a list of requests with up to MISAGENT_REQUEST_WINDOW of them in
+ * flight and checks the result of each reply. Internally used only.
+ */
+static misagent_error_t misagent_send_pipelined(misagent_client_t client, plist_t requests, int* status_codes)
+{
+	uint32_t count = plist_array_get_size(requests);
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	uint32_t i;
+	int failed = 0;
+	misagent_error_t res = MISAGENT_E_SUCCESS;
+
+	if (status_codes) {
+		for (i = 0; i < count; i++) {
+			status_codes[i] = -1;
+		}
+	}
+	client->last_error = 0;
+
+	while (received < count) {
+		while (sent < count && sent - received < MISAGENT_REQUEST_WINDOW) {
+			res = misagent_error(property_list_service_send_plist(client->parent, plist_array_get_item(requests, sent)));
+			if (res != MISAGENT_E_SUCCESS) {
+				debug_info("could not send plist, error %d", res);
+				return res;
+			}
+			sent++;
+		}
+
+		plist_t dict = NULL;
+		res = misagent_error(property_list_service_receive_plist(client->parent, &dict));
+		if (res != MISAGENT_E_SUCCESS) {
+			debug_info("could not receive response, error %d", res);
+			return res;
+		}
+		if (!dict) {
+			debug_info("could not get response plist");
+			return MISAGENT_E_UNKNOWN_ERROR;
+		}
+
+		int status_code = -1;
+		if (misagent_check_result(dict, &status_code) != MISAGENT_E_SUCCESS) {
+			failed++;
+			client->last_error = status_code;
+		}
+		if (status_codes) {
+			status_codes[received] = status_code;
+		}
+		plist_free(dict);
+		received++;
+	}
+
+	return (failed) ? MISAGENT_E_REQUEST_FAILED : MISAGENT_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_install_multiple(misagent_client_t client, plist_t profiles, int* status_codes)
+{
+	if (!client || !client->parent || plist_get_node_type(profiles) != PLIST_ARRAY)
+		return MISAGENT_E_INVALID_ARG;
+
+	uint32_t count = plist_array_get_size(profiles);
+	uint32_t i;
+	plist_t requests = plist_new_array();
+	for (i = 0; i < count; i++) {
+		plist_t profile = plist_array_get_item(profiles, i);
+		if (plist_get_node_type(profile) != PLIST_DATA) {
+			plist_free(requests);
+			return MISAGENT_E_INVALID_ARG;
+		}
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "MessageType", plist_new_string("Install"));
+		plist_dict_set_item(dict, "Profile", plist_copy(profile));
+		plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
+		plist_array_append_item(requests, dict);
+	}
+
+	misagent_error_t res = misagent_send_pipelined(client, requests, status_codes);
+	plist_free(requests);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_remove_multiple(misagent_client_t client, const char** profile_ids, uint32_t count, int* status_codes)
+{
+	if (!client || !client->parent || !profile_ids)
+		return MISAGENT_E_INVALID_ARG;
+
+	uint32_t i;
+	plist_t requests = plist_new_array();
+	for (i = 0; i < count; i++) {
+		if (!profile_ids[i]) {
+			plist_free(requests);
+			return MISAGENT_E_INVALID_ARG;
+		}
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "MessageType", plist_new_string("Remove"));
+		plist_dict_set_item(dict, "ProfileID", plist_new_string(profile_ids[i]));
+		plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
+		plist_array_append_item(requests, dict);
+	}
+
+	misagent_error_t res = misagent_send_pipelined(client, requests, status_codes);
+	plist_free(requests);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_profiles_foreach(misagent_client_t client, int copy_all, misagent_profile_cb_t callback, void* user_data)
+{
+	if (!client || !client->parent || !callback)
+		return MISAGENT_E_INVALID_ARG;
+
+	client->last_error = MISAGENT_E_UNKNOWN_ERROR;
+
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "MessageType", plist_new_string((copy_all) ? "CopyAll" : "Copy"));
+	plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
+
+	misagent_error_t res = misagent_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 	dict = NULL;
 
@@ -277,11 +424,129 @@ LIBIMOBILEDEVICE_API misagent_error_t misagent_remove(misagent_client_t client,
 	}
 
 	res = misagent_check_result(dict, &client->last_error);
+	if (res == MISAGENT_E_SUCCESS) {
+		plist_t payload = plist_dict_get_item(dict, "Payload");
+		uint32_t count = plist_array_get_size(payload);
+		uint32_t i;
+		for (i = 0; i < count; i++) {
+			plist_t profile = plist_array_get_item(payload, i);
+			uint64_t size = 0;
+			const char *data = plist_get_data_ptr(profile, &size);
+			if (!data) {
+				continue;
+			}
+			misagent_profile_info_t info;
+			misagent_profile_get_info(data, size, &info);
+			if (callback(data, size, &info, user_data) != 0) {
+				break;
+			}
+		}
+	}
 	plist_free(dict);
 
 	return res;
 }
 
+static const char* misagent_memfind(const char* haystack, const char* end, const char* needle)
+{
+	size_t len = strlen(needle);
+	while (haystack && (size_t)(end - haystack) >= len) {
+		const char *p = (const char*)memchr(haystack, needle[0], (end - haystack) - len + 1);
+		if (!p) {
+			return NULL;
+		}
+		if (!memcmp(p, needle, len)) {
+			return p;
+		}
+		haystack = p + 1;
+	}
+	return NULL;
+}
+
+/**
+ * Copies the text of the element following "<key>KEY</key>" into out.
+ * Internally used only.
+ *
+ * @return The number of characters copied, or -1 if the key was not found.
+ */
+static int misagent_scan_value(const char* start, const char* end, const char* key, const char* tag, char* out, size_t out_size)
+{
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "<key>%s</key>", key);
+	const char *p = misagent_memfind(start, end, pattern);
+	if (!p) {
+		return -1;
+	}
+	p += strlen(pattern);
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+		p++;
+	}
+	snprintf(pattern, sizeof(pattern), "<%s>", tag);
+	size_t len = strlen(pattern);
+	if ((size_t)(end - p) < len || memcmp(p, pattern, len) != 0) {
+		return -1;
+	}
+	p += len;
+	const char *value_end = (const char*)memchr(p, '<', end - p);
+	if (!value_end) {
+		return -1;
+	}
+	size_t n = value_end - p;
+	if (n >= out_size) {
+		n = out_size - 1;
+	}
+	memcpy(out, p, n);
+	out[n] = '\0';
+	return (int)n;
+}
+
+/* converts YYYY-MM-DDTHH:MM:SSZ to a UNIX timestamp */
+static int64_t misagent_parse_date(const char* str)
+{
+	int y, m, d, hh, mm, ss;
+	if (sscanf(str, "%4d-%2d-%2dT%2d:%2d:%2d", &y, &m, &d, &hh, &mm, &ss) != 6) {
+		return 0;
+	}
+	/* days from civil, proleptic Gregorian calendar */
+	y -= (m <= 2);
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;
+	int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	int64_t days = era * 146097 + doe - 719468;
+	return days * 86400 + hh * 3600 + mm * 60 + ss;
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_profile_get_info(const char* data, uint64_t size, misagent_profile_info_t* info)
+{
+	if (!data || !info)
+		return MISAGENT_E_INVALID_ARG;
+
+	memset(info, '\0', sizeof(misagent_profile_info_t));
+
+	/* the signed content of the CMS envelope is a plain XML plist */
+	const char *end = data + size;
+	const char *start = misagent_memfind(data, end, "<plist");
+	if (!start) {
+		return MISAGENT_E_PLIST_ERROR;
+	}
+	const char *plist_end = misagent_memfind(start, end, "</plist>");
+	if (plist_end) {
+		end = plist_end;
+	}
+
+	char date[32];
+	misagent_scan_value(start, end, "Name", "string", info->name, sizeof(info->name));
+	if (misagent_scan_value(start, end, "ExpirationDate", "date", date, sizeof(date)) > 0) {
+		info->expiration_date = misagent_parse_date(date);
+	}
+	if (misagent_scan_value(start, end, "UUID", "string", info->uuid, sizeof(info->uuid)) <= 0) {
+		return MISAGENT_E_PLIST_ERROR;
+	}
+
+	return MISAGENT_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API int misagent_get_status_code(misagent_client_t client)
 {
 	if (!client) {
@@ -31,6 +31,9 @@
 #include "property_list_service.h"
 #include "common/debug.h"
 
+/* size of the slices sent by mobile_image_mounter_upload_image_buffer */
+#define MOBILE_IMAGE_MOUNTER_UPLOAD_SLICE_SIZE (4 * 1024 * 1024)
+
 /**
  * Locks a mobile_image_mounter client, used for thread safety.
  *
@@ -86,6 +89,8 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_new(idevi
 		return err;
 	}
 
+	property_list_service_client_set_binary_capable(plistclient, 1);
+
 	mobile_image_mounter_client_t client_loc = (mobile_image_mounter_client_t) malloc(sizeof(struct mobile_image_mounter_client_private));
 	client_loc->parent = plistclient;
 
@@ -126,7 +131,7 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_lookup_im
 	plist_dict_set_item(dict,"Command", plist_new_string("LookupImage"));
 	plist_dict_set_item(dict,"ImageType", plist_new_string(image_type));
 
-	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_xml_plist(client->parent, dict));
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
@@ -144,6 +149,70 @@ leave_unlock:
 	return res;
 }
 
+/* returns non-zero if the data node holds the given signature */
+static int signature_matches(plist_t node, const char *signature, uint16_t signature_size)
+{
+	if (!node || plist_get_node_type(node) != PLIST_DATA) {
+		return 0;
+	}
+	uint64_t length = 0;
+	const char *data = plist_get_data_ptr(node, &length);
+	return (data && length == signature_size && memcmp(data, signature, signature_size) == 0);
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_get_mount_state(mobile_image_mounter_client_t client, const char *image_type, const char *signature, uint16_t signature_size, mobile_image_mounter_mount_state_t *state)
+{
+	if (!client || !image_type || !signature || signature_size == 0 || !state) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	*state = MOBILE_IMAGE_MOUNTER_STATE_NOT_MOUNTED;
+
+	plist_t result = NULL;
+	mobile_image_mounter_error_t res = mobile_image_mounter_lookup_image(client, image_type, &result);
+	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		return res;
+	}
+	if (!result || plist_get_node_type(result) != PLIST_DICT) {
+		plist_free(result);
+		return MOBILE_IMAGE_MOUNTER_E_PLIST_ERROR;
+	}
+	if (plist_dict_get_item(result, "Error")) {
+		debug_info("%s: lookup of image type %s failed", __func__, image_type);
+		plist_free(result);
+		return MOBILE_IMAGE_MOUNTER_E_COMMAND_FAILED;
+	}
+
+	plist_t node = plist_dict_get_item(result, "ImageSignature");
+	if (node && plist_get_node_type(node) == PLIST_ARRAY) {
+		uint32_t count = plist_array_get_size(node);
+		uint32_t i;
+		for (i = 0; i < count; i++) {
+			if (signature_matches(plist_array_get_item(node, i), signature, signature_size)) {
+				*state = MOBILE_IMAGE_MOUNTER_STATE_MOUNTED;
+				break;
+			}
+		}
+		if (i == count && count > 0) {
+			*state = MOBILE_IMAGE_MOUNTER_STATE_MOUNTED_OTHER;
+		}
+	} else if (node && plist_get_node_type(node) == PLIST_DATA) {
+		*state = signature_matches(node, signature, signature_size) ? MOBILE_IMAGE_MOUNTER_STATE_MOUNTED : MOBILE_IMAGE_MOUNTER_STATE_MOUNTED_OTHER;
+	} else {
+		/* older devices only tell if an image is present */
+		uint8_t present = 0;
+		node = plist_dict_get_item(result, "ImagePresent");
+		if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+			plist_get_bool_val(node, &present);
+		}
+		if (present) {
+			*state = MOBILE_IMAGE_MOUNTER_STATE_MOUNTED;
+		}
+	}
+	plist_free(result);
+
+	return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+}
+
 static mobile_image_mounter_error_t process_result(plist_t result, const char *expected_status)
 {
 	mobile_image_mounter_error_t res = MOBILE_IMAGE_MOUNTER_E_COMMAND_FAILED;
@@ -181,12 +250,12 @@ static mobile_image_mounter_error_t process_result(plist_t result, const char *e
 	return res;
 }
 
-LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata)
+/**
+ * Sends the ReceiveBytes request and waits for the device to accept the
+ * image data. The client must be locked.
+ */
+static mobile_image_mounter_error_t mobile_image_mounter_begin_upload(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size)
 {
-	if (!client || !image_type || (image_size == 0) || !upload_cb) {
-		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
-	}
-	mobile_image_mounter_lock(client);
 	plist_t result = NULL;
 
 	plist_t dict = plist_new_dict();
@@ -196,20 +265,52 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_im
 	plist_dict_set_item(dict, "ImageSize", plist_new_uint(image_size));
 	plist_dict_set_item(dict, "ImageType", plist_new_string(image_type));
 
-	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_xml_plist(client->parent, dict));
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 		debug_info("Error sending XML plist to device!");
-		goto leave_unlock;
+		return res;
 	}
 
 	res = mobile_image_mounter_error(property_list_service_receive_plist(client->parent, &result));
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 		debug_info("Error receiving response from device!");
-		goto leave_unlock;
+		return res;
 	}
 	res = process_result(result, "ReceiveBytesAck");
+	plist_free(result);
+
+	return res;
+}
+
+/**
+ * Waits for the device to confirm that the complete image was received.
+ * The client must be locked.
+ */
+static mobile_image_mounter_error_t mobile_image_mounter_finish_upload(mobile_image_mounter_client_t client)
+{
+	plist_t result = NULL;
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_receive_plist(client->parent, &result));
+	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		debug_info("Error receiving response from device!");
+		return res;
+	}
+	res = process_result(result, "Complete");
+	plist_free(result);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata)
+{
+	if (!client || !image_type || (image_size == 0) || !upload_cb) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	mobile_image_mounter_lock(client);
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_begin_upload(client, image_type, image_size, signature, signature_size);
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 		goto leave_unlock;
 	}
@@ -245,19 +346,51 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_im
 	}
 	debug_info("image uploaded");
 
-	res = mobile_image_mounter_error(property_list_service_receive_plist(client->parent, &result));
+	res = mobile_image_mounter_finish_upload(client);
+
+leave_unlock:
+	mobile_image_mounter_unlock(client);
+	return res;
+
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image_buffer(mobile_image_mounter_client_t client, const char *image_type, const char *image_data, size_t image_size, const char *signature, uint16_t signature_size)
+{
+	if (!client || !image_type || !image_data || (image_size == 0)) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	mobile_image_mounter_lock(client);
+
+	mobile_image_mounter_error_t res = mobile_image_mounter_begin_upload(client, image_type, image_size, signature, signature_size);
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
-		debug_info("Error receiving response from device!");
 		goto leave_unlock;
 	}
-	res = process_result(result, "Complete");
+
+	/* send large slices straight from the caller's buffer */
+	size_t tx = 0;
+	debug_info("uploading image (%d bytes)", (int)image_size);
+	while (tx < image_size) {
+		size_t remaining = image_size - tx;
+		uint32_t amount = (remaining < MOBILE_IMAGE_MOUNTER_UPLOAD_SLICE_SIZE) ? (uint32_t)remaining : MOBILE_IMAGE_MOUNTER_UPLOAD_SLICE_SIZE;
+		uint32_t sent = 0;
+		if (service_send(client->parent->parent, image_data + tx, amount, &sent) != SERVICE_E_SUCCESS || sent == 0) {
+			debug_info("service_send failed");
+			break;
+		}
+		tx += sent;
+	}
+	if (tx < image_size) {
+		debug_info("Error: failed to upload image");
+		res = MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
+		goto leave_unlock;
+	}
+	debug_info("image uploaded");
+
+	res = mobile_image_mounter_finish_upload(client);
 
 leave_unlock:
 	mobile_image_mounter_unlock(client);
-	if (result)
-		plist_free(result);
 	return res;
-
 }
 
 LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_mount_image(mobile_image_mounter_client_t client, const char *image_path, const char *signature, uint16_t signature_size, const char *image_type, plist_t *result)
@@ -274,7 +407,7 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_mount_ima
 		plist_dict_set_item(dict, "ImageSignature", plist_new_data(signature, signature_size));
 	plist_dict_set_item(dict, "ImageType", plist_new_string(image_type));
 
-	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_xml_plist(client->parent, dict));
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
@@ -302,7 +435,7 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_hangup(mo
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "Command", plist_new_string("Hangup"));
 
-	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_xml_plist(client->parent, dict));
+	mobile_image_mounter_error_t res = mobile_image_mounter_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
@@ -123,6 +123,38 @@ LIBIMOBILEDEVICE_API mobilebackup_error_t mobilebackup_receive(mobilebackup_clie
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API mobilebackup_error_t mobilebackup_receive_file_data(mobilebackup_client_t client, plist_t *plist, const char **data, uint64_t *length)
+{
+	if (!client || !plist || !data || !length)
+		return MOBILEBACKUP_E_INVALID_ARG;
+
+	*data = NULL;
+	*length = 0;
+
+	mobilebackup_error_t ret = mobilebackup_error(device_link_service_receive(client->parent, plist));
+	if (ret != MOBILEBACKUP_E_SUCCESS || !*plist)
+		return ret;
+
+	/* [ "DLSendFile", <data>, <file info> ] */
+	if (plist_get_node_type(*plist) != PLIST_ARRAY)
+		return ret;
+	plist_t node = plist_array_get_item(*plist, 0);
+	if (plist_get_node_type(node) != PLIST_STRING)
+		return ret;
+	char *str = NULL;
+	plist_get_string_val(node, &str);
+	int is_send_file = (str && !strcmp(str, "DLSendFile"));
+	free(str);
+	if (!is_send_file)
+		return ret;
+
+	node = plist_array_get_item(*plist, 1);
+	if (plist_get_node_type(node) == PLIST_DATA) {
+		*data = plist_get_data_ptr(node, length);
+	}
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API mobilebackup_error_t mobilebackup_send(mobilebackup_client_t client, plist_t plist)
 {
 	if (!client || !plist)
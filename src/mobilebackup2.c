@@ -226,27 +226,14 @@ LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_
 
 	*bytes = 0;
 
-	service_client_t raw = client->parent->parent->parent;
-
-	int bytes_loc = 0;
 	uint32_t sent = 0;
-	int loops = 0;
-	do {
-		bytes_loc = 0;
-		int status = service_send(raw, data+sent, length-sent, (uint32_t*)&bytes_loc);
-		if (bytes_loc <= 0) {
-		    printf("Raw send error %d (loops=%d)\n", status, loops);
-			break;
-		}
-		sent += bytes_loc;
-		loops++;
-	} while (sent < length);
+	mobilebackup2_error_t err = mobilebackup2_error(device_link_service_send_raw(client->parent, data, length, &sent));
 	if (sent > 0) {
 		*bytes = sent;
 		return MOBILEBACKUP2_E_SUCCESS;
-	} else {
-		return MOBILEBACKUP2_E_MUX_ERROR;
 	}
+	debug_info("Raw send error %d", err);
+	return (err != MOBILEBACKUP2_E_SUCCESS) ? err : MOBILEBACKUP2_E_MUX_ERROR;
 }
 
 LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_receive_raw(mobilebackup2_client_t client, char *data, uint32_t length, uint32_t *bytes)
@@ -254,26 +241,25 @@ LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_receive_raw(mobilebacku
 	if (!client || !client->parent || !data || (length == 0) || !bytes)
 		return MOBILEBACKUP2_E_INVALID_ARG;
 
-	service_client_t raw = client->parent->parent->parent;
-
 	*bytes = 0;
 
-	int bytes_loc = 0;
-	uint32_t received = 0;
-	do {
-		bytes_loc = 0;
-		service_receive(raw, data+received, length-received, (uint32_t*)&bytes_loc);
-		if (bytes_loc <= 0) break;
-		received += bytes_loc;
-	} while (received < length);
-	if (received > 0) {
-		*bytes = received;
-		return MOBILEBACKUP2_E_SUCCESS;
-	} else if (received == 0) {
-		return MOBILEBACKUP2_E_SUCCESS;
-	} else {
-		return MOBILEBACKUP2_E_MUX_ERROR;
-	}
+	return mobilebackup2_error(device_link_service_receive_raw(client->parent, data, length, bytes));
+}
+
+LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_set_raw_buffer_size(mobilebackup2_client_t client, uint32_t size)
+{
+	if (!client || !client->parent)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	return mobilebackup2_error(device_link_service_set_raw_buffer_size(client->parent, size));
+}
+
+LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_flush_raw(mobilebackup2_client_t client)
+{
+	if (!client || !client->parent)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	return mobilebackup2_error(device_link_service_flush_raw(client->parent));
 }
 
 LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_version_exchange(mobilebackup2_client_t client, double local_versions[], char count, double *remote_version)
@@ -30,15 +30,21 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <time.h>
+
 #include "mobilesync.h"
 #include "device_link_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
 
 #define MSYNC_VERSION_INT1 300
 #define MSYNC_VERSION_INT2 100
 
 #define EMPTY_PARAMETER_STRING "___EmptyParameterString___"
 
+#define MOBILESYNC_DEFAULT_BATCH_SIZE 500
+#define MOBILESYNC_DEFAULT_WINDOW 4
+
 /**
  * Convert an #device_link_service_error_t value to an #mobilesync_error_t value.
  * Used internally to get correct error codes when using device_link_service stuff.
@@ -133,7 +139,66 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_send(mobilesync_client_t clie
 	return mobilesync_error(device_link_service_send(client->parent, plist));
 }
 
-LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_start(mobilesync_client_t client, const char *data_class, mobilesync_anchors_t anchors, uint64_t computer_data_class_version, mobilesync_sync_type_t *sync_type, uint64_t *device_data_class_version, char** error_description)
+struct mobilesync_operation_template {
+	const char *operation;
+	const char *data_class;
+};
+
+/**
+ * Builds an [operation, data class] message.
+ * Used as build callback for device_link_service_send_cached().
+ */
+static plist_t mobilesync_build_operation(void *user_data)
+{
+	struct mobilesync_operation_template *tmpl = (struct mobilesync_operation_template*)user_data;
+	plist_t msg = plist_new_array();
+	plist_array_append_item(msg, plist_new_string(tmpl->operation));
+	plist_array_append_item(msg, plist_new_string(tmpl->data_class));
+	return msg;
+}
+
+/**
+ * Sends an [operation, data class] message for the data class of the
+ * current session. These are sent repeatedly while records are exchanged,
+ * so their serialized form is reused.
+ *
+ * @param client The mobilesync client
+ * @param operation The SDMessage* operation name
+ *
+ * @return MOBILESYNC_E_SUCCESS on success, or an MOBILESYNC_E_* error code
+ *     otherwise.
+ */
+static mobilesync_error_t mobilesync_send_operation(mobilesync_client_t client, const char *operation)
+{
+	struct mobilesync_operation_template tmpl = { operation, client->data_class };
+	char key_buffer[256];
+	char *key = key_buffer;
+	mobilesync_error_t err;
+
+	int len = snprintf(key_buffer, sizeof(key_buffer), "%s\n%s", operation, client->data_class);
+	if (len < 0) {
+		return MOBILESYNC_E_UNKNOWN_ERROR;
+	}
+	if ((size_t)len >= sizeof(key_buffer)) {
+		key = string_concat(operation, "\n", client->data_class, NULL);
+		if (!key) {
+			return MOBILESYNC_E_UNKNOWN_ERROR;
+		}
+	}
+
+	err = mobilesync_error(device_link_service_send_cached(client->parent, key, mobilesync_build_operation, &tmpl));
+	if (key != key_buffer) {
+		free(key);
+	}
+
+	return err;
+}
+
+/**
+ * Starts a sync session like mobilesync_start() and optionally returns the
+ * new anchor reported by the device.
+ */
+static mobilesync_error_t mobilesync_start_session(mobilesync_client_t client, const char *data_class, mobilesync_anchors_t anchors, uint64_t computer_data_class_version, mobilesync_sync_type_t *sync_type, uint64_t *device_data_class_version, char** error_description, char **new_device_anchor)
 {
 	if (!client || client->data_class || !data_class ||
 		!anchors || !anchors->computer_anchor) {
@@ -238,6 +303,10 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_start(mobilesync_client_t cli
 		plist_get_uint_val(device_data_class_version_node, device_data_class_version);
 	}
 
+	if (new_device_anchor != NULL) {
+		plist_get_string_val(plist_array_get_item(msg, 2), new_device_anchor);
+	}
+
 	err = MOBILESYNC_E_SUCCESS;
 
 	out:
@@ -259,6 +328,11 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_start(mobilesync_client_t cli
 	return err;
 }
 
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_start(mobilesync_client_t client, const char *data_class, mobilesync_anchors_t anchors, uint64_t computer_data_class_version, mobilesync_sync_type_t *sync_type, uint64_t *device_data_class_version, char** error_description)
+{
+	return mobilesync_start_session(client, data_class, anchors, computer_data_class_version, sync_type, device_data_class_version, error_description, NULL);
+}
+
 LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_finish(mobilesync_client_t client)
 {
 	if (!client || !client->data_class) {
@@ -328,20 +402,7 @@ static mobilesync_error_t mobilesync_get_records(mobilesync_client_t client, con
 		return MOBILESYNC_E_INVALID_ARG;
 	}
 
-	mobilesync_error_t err = MOBILESYNC_E_UNKNOWN_ERROR;
-	plist_t msg = NULL;
-
-	msg = plist_new_array();
-	plist_array_append_item(msg, plist_new_string(operation));
-	plist_array_append_item(msg, plist_new_string(client->data_class));
-
-	err = mobilesync_send(client, msg);
-
-	if (msg) {
-		plist_free(msg);
-		msg = NULL;
-	}
-	return err;
+	return mobilesync_send_operation(client, operation);
 }
 
 LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_get_all_records_from_device(mobilesync_client_t client)
@@ -496,16 +557,7 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_acknowledge_changes_from_devi
 		return MOBILESYNC_E_INVALID_ARG;
 	}
 
-	plist_t msg = NULL;
-	mobilesync_error_t err = MOBILESYNC_E_UNKNOWN_ERROR;
-
-	msg = plist_new_array();
-	plist_array_append_item(msg, plist_new_string("SDMessageAcknowledgeChangesFromDevice"));
-	plist_array_append_item(msg, plist_new_string(client->data_class));
-
-	err = mobilesync_send(client, msg);
-	plist_free(msg);
-	return err;
+	return mobilesync_send_operation(client, "SDMessageAcknowledgeChangesFromDevice");
 }
 
 static plist_t create_process_changes_message(const char *data_class, plist_t entities, uint8_t more_changes, plist_t actions)
@@ -688,6 +740,98 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_remap_identifiers(mobilesync_
 	return err;
 }
 
+/* collects up to batch_size entities from the iterator into a new dict */
+static plist_t mobilesync_next_batch(plist_t entities, plist_dict_iter iter, uint32_t batch_size)
+{
+	plist_t batch = plist_new_dict();
+	uint32_t count = 0;
+	while (count < batch_size) {
+		char *key = NULL;
+		plist_t value = NULL;
+		plist_dict_next_item(entities, iter, &key, &value);
+		if (!key) {
+			break;
+		}
+		plist_dict_set_item(batch, key, plist_copy(value));
+		free(key);
+		count++;
+	}
+	return batch;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_send_changes_windowed(mobilesync_client_t client, plist_t entities, plist_t actions, uint32_t batch_size, uint32_t window, plist_t *mapping)
+{
+	if (!client || !client->data_class || !entities) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	if (plist_get_node_type(entities) != PLIST_DICT) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	if (client->direction != MOBILESYNC_SYNC_DIR_COMPUTER_TO_DEVICE) {
+		return MOBILESYNC_E_WRONG_DIRECTION;
+	}
+
+	if (batch_size == 0) {
+		batch_size = MOBILESYNC_DEFAULT_BATCH_SIZE;
+	}
+	if (window == 0) {
+		window = MOBILESYNC_DEFAULT_WINDOW;
+	}
+
+	uint32_t total = plist_dict_get_size(entities);
+	uint32_t num_batches = (total == 0) ? 1 : (total + batch_size - 1) / batch_size;
+	uint32_t sent = 0;
+	uint32_t acknowledged = 0;
+	plist_t merged = NULL;
+	plist_dict_iter iter = NULL;
+	mobilesync_error_t err = MOBILESYNC_E_SUCCESS;
+
+	plist_dict_new_iter(entities, &iter);
+	debug_info("sending %u entities in %u batches, window %u", total, num_batches, window);
+
+	while (acknowledged < num_batches) {
+		/* keep up to window batches outstanding */
+		while (sent < num_batches && sent - acknowledged < window) {
+			plist_t batch = mobilesync_next_batch(entities, iter, batch_size);
+			plist_t msg = create_process_changes_message(client->data_class, batch, (sent + 1 < num_batches) ? 1 : 0, actions);
+			plist_free(batch);
+			err = mobilesync_send(client, msg);
+			plist_free(msg);
+			if (err != MOBILESYNC_E_SUCCESS) {
+				goto leave;
+			}
+			sent++;
+		}
+
+		plist_t remapped = NULL;
+		err = mobilesync_remap_identifiers(client, &remapped);
+		if (err != MOBILESYNC_E_SUCCESS) {
+			goto leave;
+		}
+		acknowledged++;
+		if (remapped) {
+			if (!merged) {
+				merged = remapped;
+			} else {
+				plist_dict_merge(&merged, remapped);
+				plist_free(remapped);
+			}
+		}
+	}
+
+leave:
+	free(iter);
+	if (err == MOBILESYNC_E_SUCCESS && mapping) {
+		*mapping = merged;
+	} else {
+		plist_free(merged);
+	}
+
+	return err;
+}
+
 LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_cancel(mobilesync_client_t client, const char* reason)
 {
 	if (!client || !client->data_class || !reason) {
@@ -745,6 +889,207 @@ LIBIMOBILEDEVICE_API void mobilesync_anchors_free(mobilesync_anchors_t anchors)
 	anchors = NULL;
 }
 
+LIBIMOBILEDEVICE_API mobilesync_anchors_t mobilesync_anchors_load(const char *path, const char *data_class)
+{
+	if (!path || !data_class) {
+		return NULL;
+	}
+
+	plist_t store = NULL;
+	mobilesync_anchors_t anchors = NULL;
+	if (plist_read_from_filename(&store, path) && plist_get_node_type(store) == PLIST_DICT) {
+		plist_t entry = plist_dict_get_item(store, data_class);
+		char *device_anchor = NULL;
+		char *computer_anchor = NULL;
+		if (entry && plist_get_node_type(entry) == PLIST_DICT) {
+			plist_get_string_val(plist_dict_get_item(entry, "DeviceAnchor"), &device_anchor);
+			plist_get_string_val(plist_dict_get_item(entry, "ComputerAnchor"), &computer_anchor);
+		}
+		if (device_anchor && computer_anchor) {
+			anchors = mobilesync_anchors_new(device_anchor, computer_anchor);
+		}
+		free(device_anchor);
+		free(computer_anchor);
+	}
+	plist_free(store);
+
+	return anchors;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_anchors_save(const char *path, const char *data_class, mobilesync_anchors_t anchors)
+{
+	if (!path || !data_class || (anchors && (!anchors->device_anchor || !anchors->computer_anchor))) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	plist_t store = NULL;
+	if (!plist_read_from_filename(&store, path) || plist_get_node_type(store) != PLIST_DICT) {
+		plist_free(store);
+		store = plist_new_dict();
+	}
+
+	if (anchors) {
+		plist_t entry = plist_new_dict();
+		plist_dict_set_item(entry, "DeviceAnchor", plist_new_string(anchors->device_anchor));
+		plist_dict_set_item(entry, "ComputerAnchor", plist_new_string(anchors->computer_anchor));
+		plist_dict_set_item(store, data_class, entry);
+	} else {
+		plist_dict_remove_item(store, data_class);
+	}
+
+	mobilesync_error_t err = plist_write_to_filename(store, path, PLIST_FORMAT_XML) ? MOBILESYNC_E_SUCCESS : MOBILESYNC_E_UNKNOWN_ERROR;
+	plist_free(store);
+
+	return err;
+}
+
+/**
+ * Receives the next SDMessageProcessChanges message of a sync session.
+ *
+ * @return MOBILESYNC_E_SUCCESS with msg set on success, or an error code.
+ */
+static mobilesync_error_t mobilesync_receive_process_changes(mobilesync_client_t client, plist_t *msg)
+{
+	char *response_type = NULL;
+
+	mobilesync_error_t err = mobilesync_receive(client, msg);
+	if (err != MOBILESYNC_E_SUCCESS) {
+		return err;
+	}
+
+	plist_get_string_val(plist_array_get_item(*msg, 0), &response_type);
+	if (!response_type) {
+		err = MOBILESYNC_E_PLIST_ERROR;
+	} else if (!strcmp(response_type, "SDMessageCancelSession")) {
+		char *reason = NULL;
+		plist_get_string_val(plist_array_get_item(*msg, 2), &reason);
+		debug_info("Device cancelled: %s", reason);
+		free(reason);
+		err = MOBILESYNC_E_CANCELLED;
+	} else if (strcmp(response_type, "SDMessageProcessChanges") != 0) {
+		debug_info("Unexpected message %s", response_type);
+		err = MOBILESYNC_E_PLIST_ERROR;
+	}
+	free(response_type);
+
+	if (err != MOBILESYNC_E_SUCCESS) {
+		plist_free(*msg);
+		*msg = NULL;
+	}
+	return err;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_sync_from_device(mobilesync_client_t client, const char *data_class, uint64_t computer_data_class_version, const char *anchor_store, mobilesync_records_cb_t records_cb, void *user_data, mobilesync_sync_type_t *sync_type)
+{
+	if (!client || client->data_class || !data_class || !anchor_store || !records_cb) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	mobilesync_sync_type_t type = MOBILESYNC_SYNC_TYPE_SLOW;
+	uint64_t device_data_class_version = 0;
+	char *error_description = NULL;
+	char *new_device_anchor = NULL;
+	char computer_anchor[32];
+
+	/* the computer anchor changes with every session, the device anchor of the last session tells if a fast sync is possible */
+	time_t now = time(NULL);
+	struct tm *tm = gmtime(&now);
+	strftime(computer_anchor, sizeof(computer_anchor), "%Y-%m-%d %H:%M:%S +0000", tm);
+
+	mobilesync_anchors_t stored = mobilesync_anchors_load(anchor_store, data_class);
+	mobilesync_anchors_t anchors = mobilesync_anchors_new((stored) ? stored->device_anchor : NULL, computer_anchor);
+	if (stored) {
+		mobilesync_anchors_free(stored);
+	}
+
+	mobilesync_error_t err = mobilesync_start_session(client, data_class, anchors, computer_data_class_version, &type, &device_data_class_version, &error_description, &new_device_anchor);
+	free(error_description);
+	if (err != MOBILESYNC_E_SUCCESS) {
+		free(client->data_class);
+		client->data_class = NULL;
+		goto leave;
+	}
+	debug_info("%s sync of %s", (type == MOBILESYNC_SYNC_TYPE_FAST) ? "fast" : "slow", data_class);
+	if (sync_type) {
+		*sync_type = type;
+	}
+
+	if (type == MOBILESYNC_SYNC_TYPE_FAST) {
+		err = mobilesync_get_changes_from_device(client);
+	} else {
+		err = mobilesync_get_all_records_from_device(client);
+	}
+	if (err != MOBILESYNC_E_SUCCESS) {
+		mobilesync_cancel(client, "Could not request records");
+		goto leave;
+	}
+
+	uint8_t has_more_changes = 1;
+	while (has_more_changes) {
+		plist_t msg = NULL;
+		err = mobilesync_receive_process_changes(client, &msg);
+		if (err != MOBILESYNC_E_SUCCESS) {
+			if (err != MOBILESYNC_E_CANCELLED) {
+				mobilesync_cancel(client, "Could not receive records");
+			} else {
+				free(client->data_class);
+				client->data_class = NULL;
+			}
+			goto leave;
+		}
+		has_more_changes = 0;
+		plist_get_bool_val(plist_array_get_item(msg, 3), &has_more_changes);
+
+		/* acknowledge first so the device prepares the next batch while this one is processed */
+		err = mobilesync_acknowledge_changes_from_device(client);
+		if (err != MOBILESYNC_E_SUCCESS) {
+			plist_free(msg);
+			mobilesync_cancel(client, "Could not acknowledge records");
+			goto leave;
+		}
+
+		plist_t entities = plist_array_get_item(msg, 2);
+		plist_t actions = plist_array_get_item(msg, 4);
+		if (plist_get_node_type(actions) != PLIST_DICT) {
+			actions = NULL;
+		}
+		int res = records_cb(entities, actions, (has_more_changes) ? 0 : 1, type, user_data);
+		plist_free(msg);
+		if (res != 0) {
+			mobilesync_cancel(client, "Cancelled by computer");
+			err = MOBILESYNC_E_CANCELLED;
+			goto leave;
+		}
+	}
+
+	err = mobilesync_ready_to_send_changes_from_computer(client);
+	if (err != MOBILESYNC_E_SUCCESS) {
+		if (client->data_class) {
+			mobilesync_cancel(client, "Device not ready");
+		}
+		goto leave;
+	}
+	err = mobilesync_finish(client);
+	if (err != MOBILESYNC_E_SUCCESS) {
+		goto leave;
+	}
+
+	/* the anchors are only advanced after a complete session */
+	if (new_device_anchor) {
+		mobilesync_anchors_t next = mobilesync_anchors_new(new_device_anchor, computer_anchor);
+		err = mobilesync_anchors_save(anchor_store, data_class, next);
+		mobilesync_anchors_free(next);
+	} else {
+		mobilesync_anchors_save(anchor_store, data_class, NULL);
+	}
+
+leave:
+	free(new_device_anchor);
+	mobilesync_anchors_free(anchors);
+
+	return err;
+}
+
 LIBIMOBILEDEVICE_API plist_t mobilesync_actions_new(void)
 {
 	return plist_new_dict();
@@ -24,22 +24,35 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
-#include <unistd.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 #include <plist/plist.h>
 
 #include "notification_proxy.h"
 #include "property_list_service.h"
+#include "lockdown.h"
+#include "idevice.h"
 #include "common/debug.h"
+#include "common/thread.h"
 
-#ifdef WIN32
-#define sleep(x) Sleep(x*1000)
-#endif
+/* Time the notifier waits for a notification before checking for shutdown */
+#define NP_NOTIFICATION_TIMEOUT 500
+/* interval in milliseconds at which the notifier retries to lock the client
+ * after a reconnect */
+#define NP_RECONNECT_LOCK_INTERVAL 10
 
-struct np_thread {
-	np_client_t client;
-	np_notify_cb_t cbfunc;
-	void *user_data;
-};
+/* clients shared between consumers, see np_client_start_service_shared() */
+static np_client_t shared_clients = NULL;
+static mutex_t shared_clients_mutex;
+static thread_once_t shared_clients_once = THREAD_ONCE_INIT;
+
+static void np_shared_clients_init(void)
+{
+	mutex_init(&shared_clients_mutex);
+}
 
 /**
  * Locks a notification_proxy client, used for thread safety.
@@ -48,7 +61,6 @@ struct np_thread {
  */
 static void np_lock(np_client_t client)
 {
-	debug_info("Locked");
 	mutex_lock(&client->mutex);
 }
 
@@ -59,7 +71,6 @@ static void np_lock(np_client_t client)
  */
 static void np_unlock(np_client_t client)
 {
-	debug_info("Unlocked");
 	mutex_unlock(&client->mutex);
 }
 
@@ -97,10 +108,16 @@ LIBIMOBILEDEVICE_API np_error_t np_client_new(idevice_t device, lockdownd_servic
 		return err;
 	}
 
-	np_client_t client_loc = (np_client_t) malloc(sizeof(struct np_client_private));
+	np_client_t client_loc = (np_client_t) calloc(1, sizeof(struct np_client_private));
+	if (!client_loc) {
+		property_list_service_client_free(plistclient);
+		return NP_E_UNKNOWN_ERROR;
+	}
 	client_loc->parent = plistclient;
+	client_loc->device = device;
 
 	mutex_init(&client_loc->mutex);
+	rwlock_init(&client_loc->subs_lock);
 	client_loc->notifier = THREAD_T_NULL;
 
 	*client = client_loc;
@@ -114,6 +131,53 @@ LIBIMOBILEDEVICE_API np_error_t np_client_start_service(idevice_t device, np_cli
 	return err;
 }
 
+LIBIMOBILEDEVICE_API np_error_t np_client_start_service_shared(idevice_t device, np_client_t* client, const char* label)
+{
+	np_client_t found = NULL;
+
+	if (!device || !client)
+		return NP_E_INVALID_ARG;
+
+	thread_once(&shared_clients_once, np_shared_clients_init);
+
+	mutex_lock(&shared_clients_mutex);
+	for (found = shared_clients; found; found = found->next_shared) {
+		if (found->device == device) {
+			found->shared_refs++;
+			break;
+		}
+	}
+	if (found) {
+		mutex_unlock(&shared_clients_mutex);
+		*client = found;
+		return NP_E_SUCCESS;
+	}
+
+	np_error_t err = np_client_start_service(device, &found, label);
+	if (err == NP_E_SUCCESS) {
+		found->device = device;
+		found->shared_refs = 1;
+		found->next_shared = shared_clients;
+		shared_clients = found;
+		*client = found;
+	}
+	mutex_unlock(&shared_clients_mutex);
+
+	return err;
+}
+
+static void np_free_names(char **names)
+{
+	char **p = names;
+	if (!names)
+		return;
+	while (*p) {
+		free(*p);
+		p++;
+	}
+	free(names);
+}
+
 LIBIMOBILEDEVICE_API np_error_t np_client_free(np_client_t client)
 {
 	plist_t dict;
@@ -122,9 +186,25 @@ LIBIMOBILEDEVICE_API np_error_t np_client_free(np_client_t client)
 	if (!client)
 		return NP_E_INVALID_ARG;
 
+	if (client->shared_refs > 0) {
+		mutex_lock(&shared_clients_mutex);
+		if (--client->shared_refs > 0) {
+			mutex_unlock(&shared_clients_mutex);
+			return NP_E_SUCCESS;
+		}
+		np_client_t *pclient = &shared_clients;
+		while (*pclient && *pclient != client) {
+			pclient = &(*pclient)->next_shared;
+		}
+		if (*pclient) {
+			*pclient = client->next_shared;
+		}
+		mutex_unlock(&shared_clients_mutex);
+	}
+
 	dict = plist_new_dict();
 	plist_dict_set_item(dict,"Command", plist_new_string("Shutdown"));
-	property_list_service_send_xml_plist(client->parent, dict);
+	property_list_service_send_plist(client->parent, dict);
 	plist_free(dict);
 
 	parent = client->parent;
@@ -162,6 +242,18 @@ LIBIMOBILEDEVICE_API np_error_t np_client_free(np_client_t client)
 
 	property_list_service_client_free(parent);
 
+	while (client->subscriptions) {
+		struct np_subscription *sub = client->subscriptions;
+		client->subscriptions = sub->next;
+		np_free_names(sub->names);
+		free(sub);
+	}
+	while (client->num_observed > 0) {
+		free(client->observed[--client->num_observed]);
+	}
+	free(client->observed);
+
+	rwlock_destroy(&client->subs_lock);
 	mutex_destroy(&client->mutex);
 	free(client);
 
@@ -179,7 +271,7 @@ LIBIMOBILEDEVICE_API np_error_t np_post_notification(np_client_t client, const c
 	plist_dict_set_item(dict,"Command", plist_new_string("PostNotification"));
 	plist_dict_set_item(dict,"Name", plist_new_string(notification));
 
-	np_error_t res = np_error(property_list_service_send_xml_plist(client->parent, dict));
+	np_error_t res = np_error(property_list_service_send_plist(client->parent, dict));
 	plist_free(dict);
 
 	if (res != NP_E_SUCCESS) {
@@ -189,17 +281,89 @@ LIBIMOBILEDEVICE_API np_error_t np_post_notification(np_client_t client, const c
 	return res;
 }
 
-static np_error_t internal_np_observe_notification(np_client_t client, const char *notification)
+/**
+ * Tells the device to send the given notifications. Names that are already
+ * observed by this client are skipped and all remaining requests are
+ * written at once. Must be called with the client locked.
+ */
+/**
+ * Sends an ObserveNotification request for each of the given names.
+ */
+static np_error_t np_send_observe_requests(np_client_t client, const char **names, uint32_t count)
 {
-	plist_t dict = plist_new_dict();
-	plist_dict_set_item(dict,"Command", plist_new_string("ObserveNotification"));
-	plist_dict_set_item(dict,"Name", plist_new_string(notification));
+	np_error_t res;
+	plist_t *requests = NULL;
+	uint32_t i;
+
+	requests = (plist_t*)malloc(sizeof(plist_t) * count);
+	if (!requests) {
+		return NP_E_UNKNOWN_ERROR;
+	}
+	for (i = 0; i < count; i++) {
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict,"Command", plist_new_string("ObserveNotification"));
+		plist_dict_set_item(dict,"Name", plist_new_string(names[i]));
+		requests[i] = dict;
+	}
 
-	np_error_t res = np_error(property_list_service_send_xml_plist(client->parent, dict));
+	res = np_error(property_list_service_send_plist_batch(client->parent, requests, count, property_list_service_client_prefers_binary(client->parent)));
 	if (res != NP_E_SUCCESS) {
 		debug_info("Error sending XML plist to device!");
 	}
-	plist_free(dict);
+
+	for (i = 0; i < count; i++) {
+		plist_free(requests[i]);
+	}
+	free(requests);
+
+	return res;
+}
+
+static np_error_t internal_np_observe_notifications(np_client_t client, const char **notifications, uint32_t count)
+{
+	np_error_t res = NP_E_SUCCESS;
+	const char **names = NULL;
+	uint32_t num = 0;
+	uint32_t i;
+	uint32_t j;
+
+	if (count == 0) {
+		return NP_E_SUCCESS;
+	}
+
+	names = (const char**)malloc(sizeof(char*) * count);
+	if (!names) {
+		return NP_E_UNKNOWN_ERROR;
+	}
+
+	for (i = 0; i < count; i++) {
+		int known = 0;
+		for (j = 0; j < client->num_observed && !known; j++) {
+			known = !strcmp(client->observed[j], notifications[i]);
+		}
+		for (j = 0; j < num && !known; j++) {
+			known = !strcmp(names[j], notifications[i]);
+		}
+		if (known) {
+			continue;
+		}
+		names[num++] = notifications[i];
+	}
+
+	if (num > 0) {
+		res = np_send_observe_requests(client, names, num);
+		if (res == NP_E_SUCCESS) {
+			char **observed = (char**)realloc(client->observed, sizeof(char*) * (client->num_observed + num));
+			if (observed) {
+				client->observed = observed;
+				for (i = 0; i < num; i++) {
+					client->observed[client->num_observed++] = strdup(names[i]);
+				}
+			}
+		}
+	}
+
+	free(names);
 
 	return res;
 }
@@ -210,40 +374,42 @@ LIBIMOBILEDEVICE_API np_error_t np_observe_notification( np_client_t client, con
 		return NP_E_INVALID_ARG;
 	}
 	np_lock(client);
-	np_error_t res = internal_np_observe_notification(client, notification);
+	np_error_t res = internal_np_observe_notifications(client, &notification, 1);
 	np_unlock(client);
 	return res;
 }
 
 LIBIMOBILEDEVICE_API np_error_t np_observe_notifications(np_client_t client, const char **notification_spec)
 {
-	int i = 0;
-	np_error_t res = NP_E_UNKNOWN_ERROR;
-	const char **notifications = notification_spec;
+	uint32_t count = 0;
 
 	if (!client) {
 		return NP_E_INVALID_ARG;
 	}
 
-	if (!notifications) {
+	if (!notification_spec) {
 		return NP_E_INVALID_ARG;
 	}
 
-	np_lock(client);
-	while (notifications[i]) {
-		res = internal_np_observe_notification(client, notifications[i]);
-		if (res != NP_E_SUCCESS) {
-			break;
-		}
-		i++;
+	while (notification_spec[count]) {
+		count++;
 	}
+	if (count == 0) {
+		return NP_E_UNKNOWN_ERROR;
+	}
+
+	np_lock(client);
+	np_error_t res = internal_np_observe_notifications(client, notification_spec, count);
 	np_unlock(client);
 
 	return res;
 }
 
 /**
- * Checks if a notification has been sent by the device.
+ * Waits up to NP_NOTIFICATION_TIMEOUT milliseconds for a notification
+ * sent by the device.
+ * The client is not locked while waiting since only the notifier thread
+ * receives from the connection, so sending requests is not delayed.
  *
  * @param client NP to get a notification from
  * @param notification Pointer to a buffer that will be allocated and filled
@@ -259,13 +425,14 @@ static int np_get_notification(np_client_t client, char **notification)
 {
 	int res = 0;
 	plist_t dict = NULL;
+	property_list_service_client_t parent = NULL;
 
 	if (!client || !client->parent || *notification)
 		return -1;
 
-	np_lock(client);
+	parent = client->parent;
 
-	property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(client->parent, &dict, 500);
+	property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(parent, &dict, NP_NOTIFICATION_TIMEOUT);
 	if (perr == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
 		debug_info("NotificationProxy: no notification received!");
 		res = 0;
@@ -311,9 +478,96 @@ static int np_get_notification(np_client_t client, char **notification)
 		dict = NULL;
 	}
 
+	return res;
+}
+
+/**
+ * Passes a notification to the legacy callback and all matching
+ * subscriptions. An empty notification is passed to everyone.
+ */
+static void np_dispatch(np_client_t client, const char *notification)
+{
+	struct np_subscription *sub;
+
+	rwlock_rdlock(&client->subs_lock);
+	if (client->cbfunc) {
+		client->cbfunc(notification, client->user_data);
+	}
+	for (sub = client->subscriptions; sub; sub = sub->next) {
+		int match = (!sub->names || notification[0] == '\0');
+		char **name = sub->names;
+		while (!match && *name) {
+			match = !strcmp(*name, notification);
+			name++;
+		}
+		if (match) {
+			sub->cbfunc(notification, sub->user_data);
+		}
+	}
+	rwlock_rdunlock(&client->subs_lock);
+}
+
+static int np_notifier_stopped(void *arg)
+{
+	np_client_t client = (np_client_t)arg;
+	return (client->parent == NULL);
+}
+
+/**
+ * Re-establishes a lost connection according to the reconnect policy and
+ * observes the previously observed notifications again. Returns 1 if the
+ * notifier can continue.
+ */
+static int np_reconnect(np_client_t client)
+{
+	property_list_service_client_t parent = client->parent;
+	service_client_t replacement = NULL;
+	service_reconnect_policy_t policy = client->reconnect;
+
+	if (!client->reconnect_enabled || !parent) {
+		return 0;
+	}
+	if (service_client_reconnect(parent->parent, NP_SERVICE_NAME, &policy, np_notifier_stopped, client, &replacement) != SERVICE_E_SUCCESS) {
+		return 0;
+	}
+
+	/* senders hold the client lock; np_stop_notifier() holds it while
+	 * joining this thread, so only try to take it */
+	while (mutex_trylock(&client->mutex) != 0) {
+		if (!client->parent) {
+			service_client_free(replacement);
+			return 0;
+		}
+#ifdef WIN32
+		Sleep(NP_RECONNECT_LOCK_INTERVAL);
+#else
+		struct timespec ts = { 0, NP_RECONNECT_LOCK_INTERVAL * 1000000 };
+		nanosleep(&ts, NULL);
+#endif
+	}
+	if (!client->parent) {
+		np_unlock(client);
+		service_client_free(replacement);
+		return 0;
+	}
+	service_client_replace_connection(parent->parent, replacement);
+	if (client->num_observed > 0) {
+		np_send_observe_requests(client, (const char**)client->observed, client->num_observed);
+	}
 	np_unlock(client);
 
-	return res;
+	debug_info("NotificationProxy connection re-established");
+	return 1;
+}
+
+/**
+ * Tells whether an np_get_notification() error means the connection was
+ * lost, as opposed to the proxy shutting down or sending garbage.
+ */
+static int np_is_connection_error(int res)
+{
+	return (res == PROPERTY_LIST_SERVICE_E_MUX_ERROR || res == PROPERTY_LIST_SERVICE_E_SSL_ERROR
+	    || res == PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA || res == PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR);
 }
 
 /**
@@ -322,40 +576,37 @@ static int np_get_notification(np_client_t client, char **notification)
 void* np_notifier( void* arg )
 {
 	char *notification = NULL;
-	struct np_thread *npt = (struct np_thread*)arg;
+	np_client_t client = (np_client_t)arg;
 
-	if (!npt) return NULL;
+	if (!client) return NULL;
 
 	debug_info("starting callback.");
-	while (npt->client->parent) {
-		if (np_get_notification(npt->client, &notification) < 0) {
-			npt->cbfunc("", npt->user_data);
+	while (client->parent) {
+		int res = np_get_notification(client, &notification);
+		if (res < 0) {
+			if (np_is_connection_error(res) && np_reconnect(client)) {
+				continue;
+			}
+			np_dispatch(client, "");
 			break;
 		}
+		/* no delay here, queued notifications are delivered back to back */
 		if (notification) {
-			npt->cbfunc(notification, npt->user_data);
+			np_dispatch(client, notification);
 			free(notification);
 			notification = NULL;
 		}
-		sleep(1);
-	}
-	if (npt) {
-		free(npt);
 	}
 
 	return NULL;
 }
 
-LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_notify_cb_t notify_cb, void *user_data )
+/**
+ * Stops the notifier thread. Must be called with the client locked.
+ */
+static void np_stop_notifier(np_client_t client)
 {
-	if (!client)
-		return NP_E_INVALID_ARG;
-
-	np_error_t res = NP_E_UNKNOWN_ERROR;
-
-	np_lock(client);
 	if (client->notifier) {
-		debug_info("callback already set, removing");
 		property_list_service_client_t parent = client->parent;
 		client->parent = NULL;
 		thread_join(client->notifier);
@@ -363,22 +614,171 @@ LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_n
 		client->notifier = THREAD_T_NULL;
 		client->parent = parent;
 	}
+}
 
-	if (notify_cb) {
-		struct np_thread *npt = (struct np_thread*)malloc(sizeof(struct np_thread));
-		if (npt) {
-			npt->client = client;
-			npt->cbfunc = notify_cb;
-			npt->user_data = user_data;
+/**
+ * Starts the notifier thread if it is not running. Must be called with the
+ * client locked.
+ */
+static np_error_t np_start_notifier(np_client_t client)
+{
+	if (client->notifier) {
+		return NP_E_SUCCESS;
+	}
+	if (thread_new(&client->notifier, np_notifier, client) != 0) {
+		client->notifier = THREAD_T_NULL;
+		return NP_E_UNKNOWN_ERROR;
+	}
+	return NP_E_SUCCESS;
+}
 
-			if (thread_new(&client->notifier, np_notifier, npt) == 0) {
-				res = NP_E_SUCCESS;
-			}
-		}
+LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_notify_cb_t notify_cb, void *user_data )
+{
+	if (!client)
+		return NP_E_INVALID_ARG;
+
+	np_error_t res = NP_E_UNKNOWN_ERROR;
+
+	np_lock(client);
+	if (client->notifier && client->cbfunc) {
+		debug_info("callback already set, removing");
+	}
+	rwlock_wrlock(&client->subs_lock);
+	client->cbfunc = notify_cb;
+	client->user_data = user_data;
+	rwlock_wrunlock(&client->subs_lock);
+
+	if (notify_cb || client->subscriptions) {
+		res = np_start_notifier(client);
 	} else {
 		debug_info("no callback set");
+		np_stop_notifier(client);
 	}
 	np_unlock(client);
 
 	return res;
 }
+
+LIBIMOBILEDEVICE_API np_error_t np_set_reconnect(np_client_t client, const service_reconnect_policy_t *policy)
+{
+	if (!client)
+		return NP_E_INVALID_ARG;
+
+	np_lock(client);
+	if (policy) {
+		client->reconnect = *policy;
+		client->reconnect_enabled = 1;
+	} else {
+		memset(&client->reconnect, '\0', sizeof(service_reconnect_policy_t));
+		client->reconnect_enabled = 0;
+	}
+	np_unlock(client);
+
+	return NP_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API np_error_t np_subscribe(np_client_t client, const char **notifications, np_notify_cb_t notify_cb, void *user_data, np_subscription_t *subscription)
+{
+	uint32_t count = 0;
+	uint32_t i;
+
+	if (!client || !notify_cb || !subscription)
+		return NP_E_INVALID_ARG;
+
+	struct np_subscription *sub = (struct np_subscription*)calloc(1, sizeof(struct np_subscription));
+	if (!sub)
+		return NP_E_UNKNOWN_ERROR;
+	sub->cbfunc = notify_cb;
+	sub->user_data = user_data;
+	if (notifications) {
+		while (notifications[count]) {
+			count++;
+		}
+		sub->names = (char**)calloc(count + 1, sizeof(char*));
+		if (!sub->names) {
+			free(sub);
+			return NP_E_UNKNOWN_ERROR;
+		}
+		for (i = 0; i < count; i++) {
+			sub->names[i] = strdup(notifications[i]);
+		}
+	}
+
+	np_lock(client);
+	np_error_t res = internal_np_observe_notifications(client, notifications, count);
+	if (res == NP_E_SUCCESS) {
+		rwlock_wrlock(&client->subs_lock);
+		sub->next = client->subscriptions;
+		client->subscriptions = sub;
+		rwlock_wrunlock(&client->subs_lock);
+		res = np_start_notifier(client);
+	}
+	np_unlock(client);
+
+	if (res != NP_E_SUCCESS) {
+		rwlock_wrlock(&client->subs_lock);
+		struct np_subscription **psub = &client->subscriptions;
+		while (*psub && *psub != sub) {
+			psub = &(*psub)->next;
+		}
+		if (*psub) {
+			*psub = sub->next;
+		}
+		rwlock_wrunlock(&client->subs_lock);
+		np_free_names(sub->names);
+		free(sub);
+		return res;
+	}
+
+	*subscription = sub;
+	return NP_E_SUCCESS;
+}
+
+static void np_lockdown_value_cache_cb(const char *notification, void *user_data)
+{
+	lockdownd_value_cache_notify((struct lockdownd_value_cache*)user_data, notification);
+}
+
+LIBIMOBILEDEVICE_API np_error_t np_subscribe_lockdown_value_cache(np_client_t client, np_subscription_t *subscription)
+{
+	if (!client || !client->device || !subscription)
+		return NP_E_INVALID_ARG;
+
+	struct lockdownd_value_cache *cache = lockdownd_value_cache_get(client->device->udid);
+	if (!cache)
+		return NP_E_UNKNOWN_ERROR;
+
+	return np_subscribe(client, lockdownd_value_cache_notifications, np_lockdown_value_cache_cb, cache, subscription);
+}
+
+LIBIMOBILEDEVICE_API np_error_t np_unsubscribe(np_client_t client, np_subscription_t subscription)
+{
+	if (!client || !subscription)
+		return NP_E_INVALID_ARG;
+
+	np_error_t res = NP_E_INVALID_ARG;
+
+	np_lock(client);
+	rwlock_wrlock(&client->subs_lock);
+	struct np_subscription **psub = &client->subscriptions;
+	while (*psub && *psub != subscription) {
+		psub = &(*psub)->next;
+	}
+	if (*psub) {
+		*psub = subscription->next;
+		res = NP_E_SUCCESS;
+	}
+	int idle = (!client->subscriptions && !client->cbfunc);
+	rwlock_wrunlock(&client->subs_lock);
+	if (res == NP_E_SUCCESS && idle) {
+		np_stop_notifier(client);
+	}
+	np_unlock(client);
+
+	if (res == NP_E_SUCCESS) {
+		np_free_names(subscription->names);
+		free(subscription);
+	}
+
+	return res;
+}
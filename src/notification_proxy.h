@@ -26,10 +26,31 @@
 #include "property_list_service.h"
 #include "common/thread.h"
 
+struct np_subscription {
+	char **names;
+	np_notify_cb_t cbfunc;
+	void *user_data;
+	struct np_subscription *next;
+};
+
 struct np_client_private {
 	property_list_service_client_t parent;
+	/* send side: requests, observed names and the notifier thread; only the
+	 * notifier thread receives, without taking any lock */
 	mutex_t mutex;
 	THREAD_T notifier;
+	/* read-locked while dispatching, write-locked to change callbacks */
+	rwlock_t subs_lock;
+	np_notify_cb_t cbfunc;
+	void *user_data;
+	struct np_subscription *subscriptions;
+	char **observed;
+	uint32_t num_observed;
+	int reconnect_enabled;
+	service_reconnect_policy_t reconnect;
+	idevice_t device;
+	uint32_t shared_refs;
+	struct np_client_private *next_shared;
 };
 
 void* np_notifier(void* arg);
@@ -0,0 +1,486 @@
+/*
+ * os_trace_relay.c
+ * com.apple.os_trace_relay service implementation.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#include <plist/plist.h>
+
+#include "os_trace_relay.h"
+#include "lockdown.h"
+#include "common/debug.h"
+#include "endianness.h"
+
+#define OS_TRACE_RELAY_BUFFER_SIZE 65536
+#define OS_TRACE_RELAY_MAX_ENTRY_SIZE (1024*1024)
+
+/* Each entry in the stream is a 0x02 marker followed by the entry length */
+#define OS_TRACE_ENTRY_MARKER 0x02
+#define OS_TRACE_ENTRY_PREFIX_SIZE 5
+
+/* Offsets of the fixed size fields of an entry (all little endian) */
+#define OS_TRACE_OFFSET_PID 9
+#define OS_TRACE_OFFSET_TIMESTAMP 55
+#define OS_TRACE_OFFSET_TIMESTAMP_USEC 63
+#define OS_TRACE_OFFSET_LEVEL 68
+#define OS_TRACE_OFFSET_IMAGE_NAME_SIZE 107
+#define OS_TRACE_OFFSET_MESSAGE_SIZE 109
+#define OS_TRACE_OFFSET_SUBSYSTEM_SIZE 117
+#define OS_TRACE_OFFSET_CATEGORY_SIZE 121
+#define OS_TRACE_HEADER_SIZE 129
+
+struct os_trace_relay_worker_thread {
+	os_trace_relay_client_t client;
+	os_trace_relay_entry_cb_t cbfunc;
+	void *user_data;
+};
+
+/**
+ * Convert a service_error_t value to an os_trace_relay_error_t value.
+ * Used internally to get correct error codes.
+ *
+ * @param err An service_error_t error code
+ *
+ * @return A matching os_trace_relay_error_t error code,
+ *     OS_TRACE_RELAY_E_UNKNOWN_ERROR otherwise.
+ */
+static os_trace_relay_error_t os_trace_relay_error(service_error_t err)
+{
+	switch (err) {
+		case SERVICE_E_SUCCESS:
+			return OS_TRACE_RELAY_E_SUCCESS;
+		case SERVICE_E_INVALID_ARG:
+			return OS_TRACE_RELAY_E_INVALID_ARG;
+		case SERVICE_E_MUX_ERROR:
+			return OS_TRACE_RELAY_E_MUX_ERROR;
+		case SERVICE_E_SSL_ERROR:
+			return OS_TRACE_RELAY_E_SSL_ERROR;
+		case SERVICE_E_NOT_ENOUGH_DATA:
+			return OS_TRACE_RELAY_E_NOT_ENOUGH_DATA;
+		case SERVICE_E_TIMEOUT:
+			return OS_TRACE_RELAY_E_TIMEOUT;
+		default:
+			break;
+	}
+	return OS_TRACE_RELAY_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API os_trace_relay_error_t os_trace_relay_client_new(idevice_t device, lockdownd_service_descriptor_t service, os_trace_relay_client_t * client)
+{
+	if (!device || !service || service->port == 0 || !client || *client) {
+		debug_info("Incorrect parameter passed to os_trace_relay_client_new.");
+		return OS_TRACE_RELAY_E_INVALID_ARG;
+	}
+
+	debug_info("Creating os_trace_relay_client, port = %d.", service->port);
+
+	service_client_t parent = NULL;
+	os_trace_relay_error_t ret = os_trace_relay_error(service_client_new(device, service, &parent));
+	if (ret != OS_TRACE_RELAY_E_SUCCESS) {
+		debug_info("Creating base service client failed. Error: %i", ret);
+		return ret;
+	}
+
+	os_trace_relay_client_t client_loc = (os_trace_relay_client_t) calloc(1, sizeof(struct os_trace_relay_client_private));
+	if (!client_loc) {
+		service_client_free(parent);
+		return OS_TRACE_RELAY_E_UNKNOWN_ERROR;
+	}
+	client_loc->parent = parent;
+	client_loc->worker = THREAD_T_NULL;
+
+	*client = client_loc;
+
+	debug_info("os_trace_relay_client successfully created.");
+	return OS_TRACE_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API os_trace_relay_error_t os_trace_relay_client_start_service(idevice_t device, os_trace_relay_client_t * client, const char* label)
+{
+	os_trace_relay_error_t err = OS_TRACE_RELAY_E_UNKNOWN_ERROR;
+	service_client_factory_start_service(device, OS_TRACE_RELAY_SERVICE_NAME, (void**)client, label, SERVICE_CONSTRUCTOR(os_trace_relay_client_new), &err);
+	return err;
+}
+
+LIBIMOBILEDEVICE_API os_trace_relay_error_t os_trace_relay_client_free(os_trace_relay_client_t client)
+{
+	if (!client)
+		return OS_TRACE_RELAY_E_INVALID_ARG;
+	os_trace_relay_stop_capture(client);
+	os_trace_relay_error_t err = os_trace_relay_error(service_client_free(client->parent));
+	free(client->buf);
+	free(client);
+
+	return err;
+}
+
+/**
+ * Makes sure at least needed bytes are available in the receive buffer,
+ * receiving as much data as the device has available.
+ */
+static os_trace_relay_error_t os_trace_relay_fill(os_trace_relay_client_t client, uint32_t needed, unsigned int timeout)
+{
+	if (client->buf_len - client->buf_pos >= needed) {
+		return OS_TRACE_RELAY_E_SUCCESS;
+	}
+
+	/* move the remaining data to the front */
+	if (client->buf_pos > 0) {
+		memmove(client->buf, client->buf + client->buf_pos, client->buf_len - client->buf_pos);
+		client->buf_len -= client->buf_pos;
+		client->buf_pos = 0;
+	}
+
+	if (needed > client->buf_size) {
+		uint32_t new_size = (client->buf_size > 0) ? client->buf_size : OS_TRACE_RELAY_BUFFER_SIZE;
+		while (new_size < needed) {
+			new_size <<= 1;
+		}
+		char *new_buf = (char*)realloc(client->buf, new_size);
+		if (!new_buf) {
+			return OS_TRACE_RELAY_E_UNKNOWN_ERROR;
+		}
+		client->buf = new_buf;
+		client->buf_size = new_size;
+	}
+
+	while (client->buf_len < needed) {
+		uint32_t bytes = 0;
+		service_error_t serr = service_receive_with_timeout(client->parent, client->buf + client->buf_len, client->buf_size - client->buf_len, &bytes, timeout);
+		client->buf_len += bytes;
+		if (serr != SERVICE_E_SUCCESS) {
+			if (client->buf_len >= needed) {
+				break;
+			}
+			return os_trace_relay_error(serr);
+		}
+		if (bytes == 0) {
+			return OS_TRACE_RELAY_E_TIMEOUT;
+		}
+	}
+
+	return OS_TRACE_RELAY_E_SUCCESS;
+}
+
+/**
+ * Consumes exactly length bytes from the receive buffer.
+ */
+static os_trace_relay_error_t os_trace_relay_read(os_trace_relay_client_t client, char *data, uint32_t length, unsigned int timeout)
+{
+	os_trace_relay_error_t res = os_trace_relay_fill(client, length, timeout);
+	if (res != OS_TRACE_RELAY_E_SUCCESS) {
+		return res;
+	}
+	memcpy(data, client->buf + client->buf_pos, length);
+	client->buf_pos += length;
+	return OS_TRACE_RELAY_E_SUCCESS;
+}
+
+static uint16_t get_le16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+	uint32_t val;
+	memcpy(&val, p, sizeof(val));
+	return le32toh(val);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+	uint64_t val;
+	memcpy(&val, p, sizeof(val));
+	return le64toh(val);
+}
+
+/**
+ * Takes a string of size bytes (including its terminator) from the entry.
+ */
+static int os_trace_relay_take_string(char **p, const char *end, uint32_t size, const char **str, uint32_t *length)
+{
+	static const char empty[] = "";
+
+	if (size == 0) {
+		*str = empty;
+		*length = 0;
+		return 0;
+	}
+	if ((uint32_t)(end - *p) < size) {
+		return -1;
+	}
+	/* make sure the string is terminated within the entry */
+	(*p)[size-1] = '\0';
+	*str = *p;
+	*length = strlen(*p);
+	*p += size;
+	return 0;
+}
+
+/**
+ * Parses an entry in place.
+ */
+static os_trace_relay_error_t os_trace_relay_parse_entry(char *data, uint32_t length, os_trace_relay_entry_t *entry)
+{
+	const unsigned char *hdr = (const unsigned char*)data;
+	char *end = data + length;
+	char *p = data + OS_TRACE_HEADER_SIZE;
+
+	if (length < OS_TRACE_HEADER_SIZE) {
+		debug_info("entry too short (%u bytes)", length);
+		return OS_TRACE_RELAY_E_MALFORMED_ENTRY;
+	}
+
+	entry->pid = get_le32(hdr + OS_TRACE_OFFSET_PID);
+	entry->timestamp = get_le64(hdr + OS_TRACE_OFFSET_TIMESTAMP);
+	entry->timestamp_usec = get_le32(hdr + OS_TRACE_OFFSET_TIMESTAMP_USEC);
+	entry->level = (os_trace_relay_level_t)hdr[OS_TRACE_OFFSET_LEVEL];
+
+	/* the filename is NUL-terminated without a size field */
+	char *nul = memchr(p, '\0', end - p);
+	if (!nul) {
+		return OS_TRACE_RELAY_E_MALFORMED_ENTRY;
+	}
+	entry->filename = p;
+	entry->filename_length = nul - p;
+	p = nul + 1;
+
+	if (os_trace_relay_take_string(&p, end, get_le16(hdr + OS_TRACE_OFFSET_IMAGE_NAME_SIZE), &entry->image_name, &entry->image_name_length) < 0
+	    || os_trace_relay_take_string(&p, end, get_le16(hdr + OS_TRACE_OFFSET_MESSAGE_SIZE), &entry->message, &entry->message_length) < 0
+	    || os_trace_relay_take_string(&p, end, get_le32(hdr + OS_TRACE_OFFSET_SUBSYSTEM_SIZE), &entry->subsystem, &entry->subsystem_length) < 0
+	    || os_trace_relay_take_string(&p, end, get_le32(hdr + OS_TRACE_OFFSET_CATEGORY_SIZE), &entry->category, &entry->category_length) < 0) {
+		debug_info("entry string sizes exceed entry length");
+		return OS_TRACE_RELAY_E_MALFORMED_ENTRY;
+	}
+
+	return OS_TRACE_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API os_trace_relay_error_t os_trace_relay_start_activity(os_trace_relay_client_t client, int pid)
+{
+	if (!client)
+		return OS_TRACE_RELAY_E_INVALID_ARG;
+
+	os_trace_relay_error_t res = OS_TRACE_RELAY_E_UNKNOWN_ERROR;
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Request", plist_new_string("StartActivity"));
+	plist_dict_set_item(dict, "MessageFilter", plist_new_uint(65535));
+	/* libplist writes 64 bit integers as signed values, so -1 survives */
+	plist_dict_set_item(dict, "Pid", plist_new_uint((uint64_t)(int64_t)pid));
+	plist_dict_set_item(dict, "StreamFlags", plist_new_uint(60));
+
+	char *xml = NULL;
+	uint32_t xml_len = 0;
+	plist_to_xml(dict, &xml, &xml_len);
+	plist_free(dict);
+	if (!xml) {
+		return OS_TRACE_RELAY_E_PLIST_ERROR;
+	}
+
+	/* the request is framed with its 4 byte big-endian length */
+	uint32_t sent = 0;
+	uint32_t nlen = htobe32(xml_len);
+	res = os_trace_relay_error(service_send(client->parent, (const char*)&nlen, sizeof(nlen), &sent));
+	if (res == OS_TRACE_RELAY_E_SUCCESS) {
+		res = os_trace_relay_error(service_send(client->parent, xml, xml_len, &sent));
+	}
+	free(xml);
+	if (res != OS_TRACE_RELAY_E_SUCCESS) {
+		debug_info("Could not send StartActivity request, error %d", res);
+		return res;
+	}
+
+	/* the response starts with the size of its length field (little endian),
+	 * followed by the length itself (big endian) */
+	unsigned char lsize[4];
+	res = os_trace_relay_read(client, (char*)lsize, sizeof(lsize), 5000);
+	if (res != OS_TRACE_RELAY_E_SUCCESS) {
+		return res;
+	}
+	uint32_t length_size = get_le32(lsize);
+	if (length_size == 0 || length_size > 8) {
+		debug_info("invalid response length size %u", length_size);
+		return OS_TRACE_RELAY_E_PLIST_ERROR;
+	}
+	unsigned char lbuf[8];
+	res = os_trace_relay_read(client, (char*)lbuf, length_size, 5000);
+	if (res != OS_TRACE_RELAY_E_SUCCESS) {
+		return res;
+	}
+	uint64_t length = 0;
+	uint32_t i;
+	for (i = 0; i < length_size; i++) {
+		length = (length << 8) | lbuf[i];
+	}
+	if (length == 0 || length > OS_TRACE_RELAY_MAX_ENTRY_SIZE) {
+		debug_info("invalid response length %llu", (unsigned long long)length);
+		return OS_TRACE_RELAY_E_PLIST_ERROR;
+	}
+
+	res = os_trace_relay_fill(client, (uint32_t)length, 5000);
+	if (res != OS_TRACE_RELAY_E_SUCCESS) {
+		return res;
+	}
+	plist_t response = NULL;
+	plist_from_memory(client->buf + client->buf_pos, (uint32_t)length, &response);
+	client->buf_pos += (uint32_t)length;
+	if (!response) {
+		return OS_TRACE_RELAY_E_PLIST_ERROR;
+	}
+
+	res = OS_TRACE_RELAY_E_REQUEST_FAILED;
+	plist_t status = plist_dict_get_item(response, "Status");
+	if (status && plist_get_node_type(status) == PLIST_STRING) {
+		char *s = NULL;
+		plist_get_string_val(status, &s);
+		if (s && !strcmp(s, "RequestSuccessful")) {
+			res = OS_TRACE_RELAY_E_SUCCESS;
+		} else {
+			debug_info("StartActivity failed with status %s", (s) ? s : "(null)");
+		}
+		free(s);
+	}
+	plist_free(response);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API os_trace_relay_error_t os_trace_relay_next_entry(os_trace_relay_client_t client, os_trace_relay_entry_t *entry, unsigned int timeout)
+{
+	if (!client || !entry)
+		return OS_TRACE_RELAY_E_INVALID_ARG;
+
+	os_trace_relay_error_t res = os_trace_relay_fill(client, OS_TRACE_ENTRY_PREFIX_SIZE, timeout);
+	if (res != OS_TRACE_RELAY_E_SUCCESS) {
+		return res;
+	}
+
+	const unsigned char *prefix = (const unsigned char*)client->buf + client->buf_pos;
+	if (prefix[0] != OS_TRACE_ENTRY_MARKER) {
+		debug_info("unexpected entry marker 0x%02x", prefix[0]);
+		/* skip the byte to resynchronize with the stream */
+		client->buf_pos++;
+		return OS_TRACE_RELAY_E_MALFORMED_ENTRY;
+	}
+	uint32_t length = get_le32(prefix + 1);
+	if (length > OS_TRACE_RELAY_MAX_ENTRY_SIZE) {
+		debug_info("entry too large (%u bytes)", length);
+		client->buf_pos++;
+		return OS_TRACE_RELAY_E_MALFORMED_ENTRY;
+	}
+
+	res = os_trace_relay_fill(client, OS_TRACE_ENTRY_PREFIX_SIZE + length, timeout);
+	if (res != OS_TRACE_RELAY_E_SUCCESS) {
+		/* the prefix stays in the buffer, so the entry can be completed by the next call */
+		return res;
+	}
+
+	char *data = client->buf + client->buf_pos + OS_TRACE_ENTRY_PREFIX_SIZE;
+	client->buf_pos += OS_TRACE_ENTRY_PREFIX_SIZE + length;
+
+	return os_trace_relay_parse_entry(data, length, entry);
+}
+
+void *os_trace_relay_worker(void *arg)
+{
+	struct os_trace_relay_worker_thread *otwt = (struct os_trace_relay_worker_thread*)arg;
+
+	if (!otwt)
+		return NULL;
+
+	debug_info("Running");
+
+	while (otwt->client->parent) {
+		os_trace_relay_entry_t entry;
+		os_trace_relay_error_t ret = os_trace_relay_next_entry(otwt->client, &entry, 100);
+		if (ret == OS_TRACE_RELAY_E_TIMEOUT || ret == OS_TRACE_RELAY_E_NOT_ENOUGH_DATA) {
+			continue;
+		} else if (ret == OS_TRACE_RELAY_E_MALFORMED_ENTRY) {
+			/* the entry has been consumed, so just skip it */
+			continue;
+		} else if (ret < 0) {
+			debug_info("Connection to os_trace_relay interrupted");
+			break;
+		}
+		otwt->cbfunc(&entry, otwt->user_data);
+	}
+
+	free(otwt);
+
+	debug_info("Exiting");
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API os_trace_relay_error_t os_trace_relay_start_capture(os_trace_relay_client_t client, int pid, os_trace_relay_entry_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return OS_TRACE_RELAY_E_INVALID_ARG;
+
+	os_trace_relay_error_t res = OS_TRACE_RELAY_E_UNKNOWN_ERROR;
+
+	if (client->worker) {
+		debug_info("Another capture thread appears to be running already.");
+		return res;
+	}
+
+	res = os_trace_relay_start_activity(client, pid);
+	if (res != OS_TRACE_RELAY_E_SUCCESS) {
+		return res;
+	}
+	res = OS_TRACE_RELAY_E_UNKNOWN_ERROR;
+
+	/* start worker thread */
+	struct os_trace_relay_worker_thread *otwt = (struct os_trace_relay_worker_thread*)malloc(sizeof(struct os_trace_relay_worker_thread));
+	if (otwt) {
+		otwt->client = client;
+		otwt->cbfunc = callback;
+		otwt->user_data = user_data;
+
+		if (thread_new(&client->worker, os_trace_relay_worker, otwt) == 0) {
+			res = OS_TRACE_RELAY_E_SUCCESS;
+		} else {
+			free(otwt);
+		}
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API os_trace_relay_error_t os_trace_relay_stop_capture(os_trace_relay_client_t client)
+{
+	if (!client)
+		return OS_TRACE_RELAY_E_INVALID_ARG;
+
+	if (client->worker) {
+		/* notify thread to finish */
+		service_client_t parent = client->parent;
+		client->parent = NULL;
+		/* join thread to make it exit */
+		thread_join(client->worker);
+		thread_free(client->worker);
+		client->worker = THREAD_T_NULL;
+		client->parent = parent;
+	}
+
+	return OS_TRACE_RELAY_E_SUCCESS;
+}
@@ -26,6 +26,9 @@
 
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/trace.h"
+#include "common/metrics.h"
+#include "common/socket.h"
 #include "endianness.h"
 
 /**
@@ -58,6 +61,8 @@ static property_list_service_error_t service_to_property_list_service_error(serv
 	return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
 }
 
+static property_list_service_format_t default_format = PROPERTY_LIST_SERVICE_FORMAT_AUTO;
+
 LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_new(idevice_t device, lockdownd_service_descriptor_t service, property_list_service_client_t *client)
 {
 	if (!device || !service || service->port == 0 || !client || *client)
@@ -72,12 +77,68 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 	/* create client object */
 	property_list_service_client_t client_loc = (property_list_service_client_t)malloc(sizeof(struct property_list_service_client_private));
 	client_loc->parent = parent;
+	client_loc->metrics = metrics_service_get(service->identifier);
+	client_loc->recv_buffer = NULL;
+	client_loc->recv_buffer_size = 0;
+	client_loc->xml_sanitize = 1;
+	client_loc->max_message_size = 0;
+	client_loc->format = PROPERTY_LIST_SERVICE_FORMAT_AUTO;
+	client_loc->binary_capable = 0;
+	memset(client_loc->send_cache, '\0', sizeof(client_loc->send_cache));
+	client_loc->send_cache_next = 0;
 
 	/* all done, return success */
 	*client = client_loc;
 	return PROPERTY_LIST_SERVICE_E_SUCCESS;
 }
 
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_set_xml_sanitize(property_list_service_client_t client, int enabled)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	client->xml_sanitize = (enabled) ? 1 : 0;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_set_max_message_size(property_list_service_client_t client, uint32_t max_size)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	client->max_message_size = max_size;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_set_default_format(property_list_service_format_t format)
+{
+	if (format < PROPERTY_LIST_SERVICE_FORMAT_AUTO || format > PROPERTY_LIST_SERVICE_FORMAT_BINARY)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	default_format = format;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_set_format(property_list_service_client_t client, property_list_service_format_t format)
+{
+	if (!client || format < PROPERTY_LIST_SERVICE_FORMAT_AUTO || format > PROPERTY_LIST_SERVICE_FORMAT_BINARY)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	client->format = format;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+void property_list_service_client_set_binary_capable(property_list_service_client_t client, int capable)
+{
+	if (client) {
+		client->binary_capable = capable;
+	}
+}
+
 LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_free(property_list_service_client_t client)
 {
 	if (!client)
@@ -85,19 +146,49 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 
 	property_list_service_error_t err = service_to_property_list_service_error(service_client_free(client->parent));
 
+	property_list_service_flush_send_cache(client);
+	free(client->recv_buffer);
 	free(client);
 	client = NULL;
 
 	return err;
 }
 
+/* Maximum number of framed messages written with one service_sendv() call */
+#define PLIST_SEND_BATCH_MAX (SOCKET_IOV_MAX / 2)
+
 /**
- * Sends a plist using the given property list service client.
+ * Serializes a plist for sending. Builds configured with PLIST_BINARY_ONLY
+ * always produce binary plists so the XML writer is never referenced.
+ *
+ * @param plist The plist to serialize
+ * @param binary 1 = binary plist, 0 = xml plist
+ * @param content Will be set to the newly allocated serialized data
+ * @param length Will be set to the length of the serialized data
+ */
+static void internal_plist_serialize(plist_t plist, int binary, char **content, uint32_t *length)
+{
+#ifdef PLIST_BINARY_ONLY
+	plist_to_bin(plist, content, length);
+#else
+	if (binary) {
+		plist_to_bin(plist, content, length);
+	} else {
+		plist_to_xml(plist, content, length);
+	}
+#endif
+}
+
+/**
+ * Sends a number of plists using the given property list service client.
+ * Each plist is framed with its 4 byte big-endian length and the frames
+ * are written with as few send calls as possible.
  * Internally used generic plist send function.
  *
  * @param client The property list service client to use for sending.
- * @param plist plist to send
- * @param binary 1 = send binary plist, 0 = send xml plist
+ * @param plists array of plists to send
+ * @param count number of plists in the array
+ * @param binary 1 = send binary plists, 0 = send xml plists
  *
  * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
  *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when one or more parameters are
@@ -106,52 +197,106 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
  *      occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified
  *      error occurs.
  */
-static property_list_service_error_t internal_plist_send(property_list_service_client_t client, plist_t plist, int binary)
+static property_list_service_error_t internal_plist_send_batch(property_list_service_client_t client, const plist_t *plists, uint32_t count, int binary)
 {
-	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
-	char *content = NULL;
-	uint32_t length = 0;
-	uint32_t nlen = 0;
-	uint32_t bytes = 0;
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+	struct socket_iovec iov[PLIST_SEND_BATCH_MAX * 2];
+	char *content[PLIST_SEND_BATCH_MAX];
+	uint32_t nlen[PLIST_SEND_BATCH_MAX];
+	uint32_t done = 0;
 
-	if (!client || (client && !client->parent) || !plist) {
+	if (!client || (client && !client->parent) || !plists || count == 0) {
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
 	}
 
-	if (binary) {
-		plist_to_bin(plist, &content, &length);
-	} else {
-		plist_to_xml(plist, &content, &length);
-	}
+	while (done < count && res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		uint32_t num = count - done;
+		uint32_t total = 0;
+		uint32_t bytes = 0;
+		uint32_t i;
 
-	if (!content || length == 0) {
-		return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
-	}
+		if (num > PLIST_SEND_BATCH_MAX) {
+			num = PLIST_SEND_BATCH_MAX;
+		}
+		memset(content, '\0', sizeof(content));
 
-	nlen = htobe32(length);
-	debug_info("sending %d bytes", length);
-	service_send(client->parent, (const char*)&nlen, sizeof(nlen), &bytes);
-	if (bytes == sizeof(nlen)) {
-		service_send(client->parent, content, length, &bytes);
-		if (bytes > 0) {
-			debug_info("sent %d bytes", bytes);
-			debug_plist(plist);
-			if (bytes == length) {
-				res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+		for (i = 0; i < num; i++) {
+			uint32_t length = 0;
+			if (!plists[done + i]) {
+				res = PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+				break;
+			}
+			internal_plist_serialize(plists[done + i], binary, &content[i], &length);
+			if (!content[i] || length == 0) {
+				res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+				break;
+			}
+			nlen[i] = htobe32(length);
+			iov[i*2].data = &nlen[i];
+			iov[i*2].length = sizeof(nlen[i]);
+			iov[i*2+1].data = content[i];
+			iov[i*2+1].length = length;
+			total += sizeof(nlen[i]) + length;
+		}
+
+		if (res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+			debug_info("sending %d bytes (%d plists)", total, num);
+			service_sendv(client->parent, iov, num * 2, &bytes);
+			if (bytes == total) {
+				debug_info("sent %d bytes", bytes);
+				for (i = 0; i < num; i++) {
+					debug_plist(plists[done + i]);
+				}
+			} else if (bytes > 0) {
+				debug_info("ERROR: Could not send all data (%d of %d)!", bytes, total);
+				res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
 			} else {
-				debug_info("ERROR: Could not send all data (%d of %d)!", bytes, length);
+				debug_info("ERROR: sending to device failed.");
+				res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+			}
+			trace_event(TRACE_PLIST_SEND, total, num, res);
+			if (client->metrics) {
+				if (res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+					metrics_add(&client->metrics->messages_sent, num);
+					metrics_add(&client->metrics->bytes_sent, total);
+				} else {
+					metrics_add(&client->metrics->errors, 1);
+				}
 			}
 		}
-	}
-	if (bytes <= 0) {
-		debug_info("ERROR: sending to device failed.");
-		res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+
+		for (i = 0; i < num; i++) {
+			free(content[i]);
+		}
+		done += num;
 	}
 
-	free(content);
 	return res;
 }
 
+/**
+ * Sends a plist using the given property list service client.
+ * Internally used generic plist send function.
+ *
+ * @param client The property list service client to use for sending.
+ * @param plist plist to send
+ * @param binary 1 = send binary plist, 0 = send xml plist
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, PROPERTY_LIST_SERVICE_E_PLIST_ERROR when dict is not a valid
+ *      plist, PROPERTY_LIST_SERVICE_E_MUX_ERROR when a communication error
+ *      occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs.
+ */
+static property_list_service_error_t internal_plist_send(property_list_service_client_t client, plist_t plist, int binary)
+{
+	if (!plist) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+	return internal_plist_send_batch(client, &plist, 1, binary);
+}
+
 LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_xml_plist(property_list_service_client_t client, plist_t plist)
 {
 	return internal_plist_send(client, plist, 0);
@@ -162,38 +307,230 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_bi
 	return internal_plist_send(client, plist, 1);
 }
 
+int property_list_service_client_prefers_binary(property_list_service_client_t client)
+{
+	property_list_service_format_t format = client->format;
+	if (format == PROPERTY_LIST_SERVICE_FORMAT_AUTO) {
+		format = default_format;
+	}
+	if (format == PROPERTY_LIST_SERVICE_FORMAT_AUTO) {
+		format = (client->binary_capable) ? PROPERTY_LIST_SERVICE_FORMAT_BINARY : PROPERTY_LIST_SERVICE_FORMAT_XML;
+	}
+	return (format == PROPERTY_LIST_SERVICE_FORMAT_BINARY);
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_plist(property_list_service_client_t client, plist_t plist)
+{
+	if (!client) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
+	return internal_plist_send(client, plist, property_list_service_client_prefers_binary(client));
+}
+
+void property_list_service_flush_send_cache(property_list_service_client_t client)
+{
+	unsigned int i;
+
+	if (!client)
+		return;
+
+	for (i = 0; i < PROPERTY_LIST_SERVICE_SEND_CACHE_SIZE; i++) {
+		free(client->send_cache[i].key);
+		free(client->send_cache[i].data);
+	}
+	memset(client->send_cache, '\0', sizeof(client->send_cache));
+	client->send_cache_next = 0;
+}
+
 /**
- * Receives a plist using the given property list service client.
- * Internally used generic plist receive function.
+ * Sends a message that only depends on the given key, reusing its
+ * serialized form from previous calls. On a cache miss the plist is
+ * obtained from the build callback, serialized and stored in the cache,
+ * replacing the oldest entry if the cache is full.
+ * Used internally for constant requests that are sent repeatedly.
  *
- * @param client The property list service client to use for receiving
- * @param plist pointer to a plist_t that will point to the received plist
- *      upon successful return
- * @param timeout Maximum time in milliseconds to wait for data.
+ * @param client The property list service client to use for sending.
+ * @param key String that uniquely identifies the message content
+ * @param binary 1 = send binary plist, 0 = send xml plist
+ * @param build Callback returning a newly allocated plist for the message
+ * @param user_data User data passed to the build callback
  *
- * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
- *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or *plist is NULL,
- *      PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA when not enough data
- *      received, PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
- *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the received data cannot be
- *      converted to a plist, PROPERTY_LIST_SERVICE_E_MUX_ERROR when a
- *      communication error occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
- *      when an unspecified error occurs.
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success, or an
+ *      PROPERTY_LIST_SERVICE_E_* error code otherwise.
  */
-static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
+property_list_service_error_t property_list_service_send_cached(property_list_service_client_t client, const char *key, int binary, property_list_service_build_cb_t build, void *user_data)
 {
-	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
-	uint32_t pktlen = 0;
+	struct property_list_service_send_cache_entry *entry = NULL;
+	unsigned int i;
+
+	if (!client || !client->parent || !key || !build) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
+	for (i = 0; i < PROPERTY_LIST_SERVICE_SEND_CACHE_SIZE; i++) {
+		if (client->send_cache[i].key && client->send_cache[i].binary == binary && !strcmp(client->send_cache[i].key, key)) {
+			entry = &client->send_cache[i];
+			break;
+		}
+	}
+
+	if (!entry) {
+		char *content = NULL;
+		uint32_t length = 0;
+		plist_t plist = build(user_data);
+		if (!plist) {
+			return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+		}
+		internal_plist_serialize(plist, binary, &content, &length);
+		debug_plist(plist);
+		plist_free(plist);
+		if (!content || length == 0) {
+			free(content);
+			return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+		}
+
+		entry = &client->send_cache[client->send_cache_next];
+		client->send_cache_next = (client->send_cache_next + 1) % PROPERTY_LIST_SERVICE_SEND_CACHE_SIZE;
+		free(entry->key);
+		free(entry->data);
+		entry->key = strdup(key);
+		entry->binary = binary;
+		entry->data = content;
+		entry->length = length;
+	}
+
+	debug_info("sending %d bytes (cached)", entry->length);
+	return property_list_service_send_serialized(client, entry->data, entry->length);
+}
+
+void property_list_service_serialize(plist_t plist, int binary, char **content, uint32_t *length)
+{
+	internal_plist_serialize(plist, binary, content, length);
+}
+
+/**
+ * Sends a message that has already been serialized with
+ * property_list_service_serialize(), framed with its length.
+ *
+ * @param client The property list service client to use for sending.
+ * @param data The serialized plist
+ * @param length The length of data
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success, or an
+ *      PROPERTY_LIST_SERVICE_E_* error code otherwise.
+ */
+property_list_service_error_t property_list_service_send_serialized(property_list_service_client_t client, const char *data, uint32_t length)
+{
+	struct socket_iovec iov[2];
+	uint32_t nlen = 0;
 	uint32_t bytes = 0;
 
-	if (!client || (client && !client->parent) || !plist) {
+	if (!client || !client->parent || !data || length == 0) {
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
 	}
 
-	*plist = NULL;
-	service_error_t serr = service_receive_with_timeout(client->parent, (char*)&pktlen, sizeof(pktlen), &bytes, timeout);
+	nlen = htobe32(length);
+	iov[0].data = &nlen;
+	iov[0].length = sizeof(nlen);
+	iov[1].data = data;
+	iov[1].length = length;
+
+	service_sendv(client->parent, iov, 2, &bytes);
+	if (bytes == sizeof(nlen) + length) {
+		if (client->metrics) {
+			metrics_add(&client->metrics->messages_sent, 1);
+			metrics_add(&client->metrics->bytes_sent, bytes);
+		}
+		return PROPERTY_LIST_SERVICE_E_SUCCESS;
+	}
+	if (client->metrics) {
+		metrics_add(&client->metrics->errors, 1);
+	}
+	if (bytes > 0) {
+		debug_info("ERROR: Could not send all data (%d of %d)!", bytes, (int)(sizeof(nlen) + length));
+		return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	}
+	debug_info("ERROR: sending to device failed.");
+	return PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_plist_batch(property_list_service_client_t client, const plist_t *plists, uint32_t count, int binary)
+{
+	return internal_plist_send_batch(client, plists, count, binary);
+}
+
+/**
+ * Releases the receive buffer of the client if it grew beyond
+ * PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP so that a single huge message
+ * does not pin its memory for the lifetime of the client.
+ */
+static void internal_recv_buffer_trim(property_list_service_client_t client)
+{
+	if (client->recv_buffer_size > PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP) {
+		free(client->recv_buffer);
+		client->recv_buffer = NULL;
+		client->recv_buffer_size = 0;
+	}
+}
+
+/**
+ * Replaces control characters other than tab, line feed and carriage
+ * return with spaces. The data is scanned a machine word at a time and
+ * only words that contain a byte below 0x20 are inspected bytewise.
+ *
+ * @param data The XML data to sanitize
+ * @param length Number of bytes to scan
+ */
+static void internal_xml_sanitize(char *data, uint32_t length)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	uint32_t i = 0;
+
+	while (i + sizeof(uint64_t) <= length) {
+		uint64_t w;
+		memcpy(&w, data + i, sizeof(w));
+		/* non-zero if any byte in w is < 0x20 (bytes >= 0x80 excluded) */
+		if (((w - ones * 0x20) & ~w & highs) == 0) {
+			i += sizeof(uint64_t);
+			continue;
+		}
+		uint32_t end = i + sizeof(uint64_t);
+		for (; i < end; i++) {
+			char c = data[i];
+			if ((c >= 0) && (c < 0x20) && (c != 0x09) && (c != 0x0a) && (c != 0x0d))
+				data[i] = 0x20;
+		}
+	}
+	for (; i < length; i++) {
+		char c = data[i];
+		if ((c >= 0) && (c < 0x20) && (c != 0x09) && (c != 0x0a) && (c != 0x0d))
+			data[i] = 0x20;
+	}
+}
+
+/* Chunk size used when streaming or discarding message payloads */
+#define PLIST_RECV_CHUNK_SIZE 65536
+
+/**
+ * Receives the 4 byte big-endian length prefix of the next message.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when no data arrived in time,
+ *      or another PROPERTY_LIST_SERVICE_E_* error code otherwise.
+ */
+static property_list_service_error_t internal_receive_length(property_list_service_client_t client, uint32_t *pktlen, unsigned int timeout)
+{
+	uint32_t bytes = 0;
+	uint32_t nlen = 0;
+
+	service_error_t serr = service_receive_with_timeout(client->parent, (char*)&nlen, sizeof(nlen), &bytes, timeout);
 	if (serr != SERVICE_E_SUCCESS) {
 		debug_info("initial read failed!");
+		if (client->metrics && serr != SERVICE_E_TIMEOUT) {
+			metrics_add(&client->metrics->errors, 1);
+		}
 		return service_to_property_list_service_error(serr);
 	}
 
@@ -204,19 +541,94 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 
 	debug_info("initial read=%i", bytes);
 
+	*pktlen = be32toh(nlen);
+	debug_info("%d bytes following", *pktlen);
+	if (client->metrics) {
+		metrics_add(&client->metrics->messages_received, 1);
+		metrics_add(&client->metrics->bytes_received, sizeof(nlen) + *pktlen);
+	}
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Receives pktlen bytes of payload in chunks and passes them to the given
+ * callback. If callback is NULL the payload is discarded.
+ */
+static property_list_service_error_t internal_receive_stream(property_list_service_client_t client, uint32_t pktlen, property_list_service_stream_cb_t callback, void *user_data)
+{
+	uint32_t chunk = (pktlen < PLIST_RECV_CHUNK_SIZE) ? pktlen : PLIST_RECV_CHUNK_SIZE;
 	uint32_t curlen = 0;
+
+	if (chunk > client->recv_buffer_size) {
+		char *buf = (char*)realloc(client->recv_buffer, chunk);
+		if (!buf) {
+			debug_info("out of memory when allocating %d bytes", chunk);
+			return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		}
+		client->recv_buffer = buf;
+		client->recv_buffer_size = chunk;
+	}
+
+	while (curlen < pktlen) {
+		uint32_t bytes = 0;
+		uint32_t want = pktlen - curlen;
+		if (want > chunk) {
+			want = chunk;
+		}
+		service_error_t serr = service_receive(client->parent, client->recv_buffer, want, &bytes);
+		if (serr != SERVICE_E_SUCCESS) {
+			debug_info("received incomplete payload (%d of %d bytes)", curlen, pktlen);
+			return service_to_property_list_service_error(serr);
+		}
+		if (bytes == 0) {
+			continue;
+		}
+		if (callback && callback(client->recv_buffer, bytes, pktlen, user_data) != 0) {
+			debug_info("aborted by callback after %d of %d bytes", curlen + bytes, pktlen);
+			return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		}
+		curlen += bytes;
+	}
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Receives the complete payload of a message of pktlen bytes into the
+ * receive buffer of the client. Messages larger than the maximum message
+ * size are discarded.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE if the message was discarded,
+ *      or another PROPERTY_LIST_SERVICE_E_* error code otherwise.
+ */
+static property_list_service_error_t internal_receive_payload(property_list_service_client_t client, uint32_t pktlen)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	uint32_t curlen = 0;
+	uint32_t bytes = 0;
 	char *content = NULL;
 
-	pktlen = be32toh(pktlen);
-	debug_info("%d bytes following", pktlen);
-	content = (char*)malloc(pktlen);
-	if (!content) {
-		debug_info("out of memory when allocating %d bytes", pktlen);
-		return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	if (client->max_message_size > 0 && pktlen > client->max_message_size) {
+		debug_info("ERROR: message of %d bytes exceeds maximum size of %d bytes, discarding", pktlen, client->max_message_size);
+		res = internal_receive_stream(client, pktlen, NULL, NULL);
+		return (res == PROPERTY_LIST_SERVICE_E_SUCCESS) ? PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE : res;
 	}
 
+	if (pktlen > client->recv_buffer_size) {
+		content = (char*)realloc(client->recv_buffer, pktlen);
+		if (!content) {
+			debug_info("out of memory when allocating %d bytes", pktlen);
+			return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		}
+		client->recv_buffer = content;
+		client->recv_buffer_size = pktlen;
+	}
+	content = client->recv_buffer;
+
 	while (curlen < pktlen) {
-		serr = service_receive(client->parent, content+curlen, pktlen-curlen, &bytes);
+		service_error_t serr = service_receive(client->parent, content+curlen, pktlen-curlen, &bytes);
 		if (serr != SERVICE_E_SUCCESS) {
 			res = service_to_property_list_service_error(serr);
 			break;
@@ -231,17 +643,58 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 			debug_info("incomplete packet following:");
 			debug_buffer(content, curlen);
 		}
-		free(content);
 		return res;
 	}
 
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Receives a plist using the given property list service client.
+ * Internally used generic plist receive function.
+ *
+ * @param client The property list service client to use for receiving
+ * @param plist pointer to a plist_t that will point to the received plist
+ *      upon successful return
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or *plist is NULL,
+ *      PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA when not enough data
+ *      received, PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the received data cannot be
+ *      converted to a plist, PROPERTY_LIST_SERVICE_E_MUX_ERROR when a
+ *      communication error occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
+ *      when an unspecified error occurs.
+ */
+static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	uint32_t pktlen = 0;
+
+	if (!client || (client && !client->parent) || !plist) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
+	*plist = NULL;
+	res = internal_receive_length(client, &pktlen, timeout);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		return res;
+	}
+
+	res = internal_receive_payload(client, pktlen);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		internal_recv_buffer_trim(client);
+		return res;
+	}
+	char *content = client->recv_buffer;
+
 	if ((pktlen > 8) && !memcmp(content, "bplist00", 8)) {
 		plist_from_bin(content, pktlen, plist);
 	} else if ((pktlen > 5) && !memcmp(content, "<?xml", 5)) {
 		/* iOS 4.3+ hack: plist data might contain invalid characters, thus we convert those to spaces */
-		for (bytes = 0; bytes < pktlen-1; bytes++) {
-			if ((content[bytes] >= 0) && (content[bytes] < 0x20) && (content[bytes] != 0x09) && (content[bytes] != 0x0a) && (content[bytes] != 0x0d))
-				content[bytes] = 0x20;
+		if (client->xml_sanitize) {
+			internal_xml_sanitize(content, pktlen-1);
 		}
 		plist_from_xml(content, pktlen, plist);
 	} else {
@@ -255,9 +708,9 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 	} else {
 		res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
 	}
+	trace_event(TRACE_PLIST_RECEIVE, pktlen, res, 0);
 
-	free(content);
-	content = NULL;
+	internal_recv_buffer_trim(client);
 
 	return res;
 }
@@ -272,6 +725,69 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive
 	return internal_plist_receive_timeout(client, plist, 30000);
 }
 
+/**
+ * Receives the next message without parsing it. The returned buffer holds
+ * the raw payload and is owned by the caller, which allows handing out
+ * parts of a large message without copying them.
+ *
+ * @param client The property list service client to use for receiving
+ * @param buffer Pointer that receives the payload, to be freed by the caller
+ * @param length Pointer that receives the size of the payload
+ * @param timeout Maximum time in milliseconds to wait for the message.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when a parameter is NULL,
+ *      or another PROPERTY_LIST_SERVICE_E_* error code otherwise.
+ */
+property_list_service_error_t property_list_service_receive_buffer(property_list_service_client_t client, char **buffer, uint32_t *length, unsigned int timeout)
+{
+	property_list_service_error_t res;
+	uint32_t pktlen = 0;
+
+	if (!client || !client->parent || !buffer || !length) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
+	*buffer = NULL;
+	*length = 0;
+
+	res = internal_receive_length(client, &pktlen, timeout);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		return res;
+	}
+
+	res = internal_receive_payload(client, pktlen);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		internal_recv_buffer_trim(client);
+		return res;
+	}
+
+	/* hand the receive buffer over to the caller, the next receive allocates a new one */
+	*buffer = client->recv_buffer;
+	*length = pktlen;
+	client->recv_buffer = NULL;
+	client->recv_buffer_size = 0;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive_stream(property_list_service_client_t client, property_list_service_stream_cb_t callback, void *user_data, unsigned int timeout)
+{
+	property_list_service_error_t res;
+	uint32_t pktlen = 0;
+
+	if (!client || !client->parent || !callback) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
+	res = internal_receive_length(client, &pktlen, timeout);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		return res;
+	}
+
+	return internal_receive_stream(client, pktlen, callback, user_data);
+}
+
 LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_enable_ssl(property_list_service_client_t client)
 {
 	if (!client || !client->parent)
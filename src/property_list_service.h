@@ -25,8 +25,43 @@
 #include "libimobiledevice/property_list_service.h"
 #include "service.h"
 
+/* Number of serialized messages kept by property_list_service_send_cached() */
+#define PROPERTY_LIST_SERVICE_SEND_CACHE_SIZE 16
+
+/* Receive buffers up to this size are kept for the next message */
+#define PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP (1024*1024)
+
+struct property_list_service_send_cache_entry {
+	char *key;
+	int binary;
+	char *data;
+	uint32_t length;
+};
+
+struct metrics_service;
+
 struct property_list_service_client_private {
 	service_client_t parent;
+	struct metrics_service *metrics;
+	char *recv_buffer;
+	uint32_t recv_buffer_size;
+	int xml_sanitize;
+	uint32_t max_message_size;
+	property_list_service_format_t format;
+	int binary_capable;
+	struct property_list_service_send_cache_entry send_cache[PROPERTY_LIST_SERVICE_SEND_CACHE_SIZE];
+	unsigned int send_cache_next;
 };
 
+/** Builds the plist for a message that is not in the send cache yet */
+typedef plist_t (*property_list_service_build_cb_t)(void *user_data);
+
+void property_list_service_client_set_binary_capable(property_list_service_client_t client, int capable);
+int property_list_service_client_prefers_binary(property_list_service_client_t client);
+property_list_service_error_t property_list_service_send_cached(property_list_service_client_t client, const char *key, int binary, property_list_service_build_cb_t build, void *user_data);
+void property_list_service_flush_send_cache(property_list_service_client_t client);
+void property_list_service_serialize(plist_t plist, int binary, char **content, uint32_t *length);
+property_list_service_error_t property_list_service_send_serialized(property_list_service_client_t client, const char *data, uint32_t length);
+property_list_service_error_t property_list_service_receive_buffer(property_list_service_client_t client, char **buffer, uint32_t *length, unsigned int timeout);
+
 #endif
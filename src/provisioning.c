@@ -0,0 +1,427 @@
+/*
+ * provisioning.c
+ * Pair and activate a batch of devices in overlapping stages
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdlib.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
+#include <plist/plist.h>
+
+#include "provisioning.h"
+#include "idevice.h"
+#include "libimobiledevice/lockdown.h"
+#include "common/debug.h"
+#include "common/userpref.h"
+
+#define PROVISIONING_LABEL "libimobiledevice"
+
+static uint64_t provisioning_time_us(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount64() * 1000;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/**
+ * Connects to lockdownd and pairs with the device. The host keys come from
+ * the key pool if it has any left.
+ */
+static provisioning_error_t provisioning_pair(struct provisioning_device *dev, int *code, int *skipped)
+{
+	lockdownd_client_t lockdown = NULL;
+	idevice_error_t ierr;
+	lockdownd_error_t lerr;
+
+	ierr = idevice_new_with_options(&dev->device, dev->udid, dev->options);
+	if (ierr != IDEVICE_E_SUCCESS) {
+		*code = ierr;
+		return PROVISIONING_E_CONNECTION_FAILED;
+	}
+
+	lerr = lockdownd_client_new(dev->device, &lockdown, PROVISIONING_LABEL);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		*code = lerr;
+		return PROVISIONING_E_CONNECTION_FAILED;
+	}
+
+	lerr = lockdownd_pair(lockdown, NULL);
+	lockdownd_client_free(lockdown);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		*code = lerr;
+		return PROVISIONING_E_PAIRING_FAILED;
+	}
+
+	return PROVISIONING_E_SUCCESS;
+}
+
+/**
+ * Starts the mobileactivation service and creates the activation info,
+ * unless the device is already activated.
+ */
+static provisioning_error_t provisioning_activation_info(struct provisioning_device *dev, int *code, int *skipped)
+{
+	mobileactivation_error_t merr;
+	plist_t state = NULL;
+
+	merr = mobileactivation_client_start_service(dev->device, &dev->activation, PROVISIONING_LABEL);
+	if (merr != MOBILEACTIVATION_E_SUCCESS) {
+		*code = merr;
+		return PROVISIONING_E_CONNECTION_FAILED;
+	}
+
+	if (mobileactivation_get_activation_state(dev->activation, &state) == MOBILEACTIVATION_E_SUCCESS) {
+		char *value = NULL;
+		if (plist_get_node_type(state) == PLIST_STRING) {
+			plist_get_string_val(state, &value);
+		}
+		*skipped = (value && !strcmp(value, "Activated"));
+		free(value);
+		plist_free(state);
+		if (*skipped) {
+			return PROVISIONING_E_SUCCESS;
+		}
+	}
+
+	merr = mobileactivation_create_activation_info(dev->activation, &dev->activation_info);
+	if (merr != MOBILEACTIVATION_E_SUCCESS) {
+		*code = merr;
+		return PROVISIONING_E_ACTIVATION_FAILED;
+	}
+
+	return PROVISIONING_E_SUCCESS;
+}
+
+/**
+ * Lets the caller exchange the activation info for an activation record.
+ */
+static provisioning_error_t provisioning_request(struct provisioning_device *dev, int *code, int *skipped)
+{
+	provisioning_batch_t batch = dev->batch;
+
+	*code = batch->request_cb(dev->udid, dev->activation_info, &dev->activation_record, batch->user_data);
+	if (*code != 0 || !dev->activation_record) {
+		return PROVISIONING_E_REQUEST_FAILED;
+	}
+
+	return PROVISIONING_E_SUCCESS;
+}
+
+/**
+ * Sends the activation record to the device.
+ */
+static provisioning_error_t provisioning_activate(struct provisioning_device *dev, int *code, int *skipped)
+{
+	mobileactivation_error_t merr = mobileactivation_activate(dev->activation, dev->activation_record);
+	if (merr != MOBILEACTIVATION_E_SUCCESS) {
+		*code = merr;
+		return PROVISIONING_E_ACTIVATION_FAILED;
+	}
+
+	return PROVISIONING_E_SUCCESS;
+}
+
+typedef provisioning_error_t (*provisioning_stage_func_t)(struct provisioning_device *dev, int *code, int *skipped);
+
+static const provisioning_stage_func_t provisioning_stages[PROVISIONING_STAGE_COUNT] = {
+	provisioning_pair,
+	provisioning_activation_info,
+	provisioning_request,
+	provisioning_activate
+};
+
+static void provisioning_emit(provisioning_batch_t batch, const provisioning_event_t *event)
+{
+	if (!batch->event_cb)
+		return;
+
+	mutex_lock(&batch->event_mutex);
+	batch->event_cb(event, batch->user_data);
+	mutex_unlock(&batch->event_mutex);
+}
+
+static void provisioning_finish(struct provisioning_device *dev, provisioning_error_t result)
+{
+	provisioning_batch_t batch = dev->batch;
+
+	if (dev->activation) {
+		mobileactivation_client_free(dev->activation);
+		dev->activation = NULL;
+	}
+	if (dev->device) {
+		idevice_free(dev->device);
+		dev->device = NULL;
+	}
+	plist_free(dev->activation_info);
+	dev->activation_info = NULL;
+	plist_free(dev->activation_record);
+	dev->activation_record = NULL;
+
+	if (result == PROVISIONING_E_SUCCESS) {
+		dev->stage = PROVISIONING_STAGE_COUNT;
+	}
+	dev->result = result;
+	debug_info("device %s done: %d", dev->udid, result);
+
+	mutex_lock(&batch->mutex);
+	batch->remaining--;
+	if (batch->remaining == 0) {
+		cond_signal(&batch->done_cond);
+	}
+	mutex_unlock(&batch->mutex);
+}
+
+static void provisioning_stage_worker(void *data);
+
+/**
+ * Queues the device for its current stage on the pool serving that stage.
+ */
+static void provisioning_enqueue(struct provisioning_device *dev)
+{
+	provisioning_batch_t batch = dev->batch;
+	threadpool_t pool = (dev->stage == PROVISIONING_STAGE_REQUEST) ? batch->network_pool : batch->device_pool;
+
+	dev->queued_at = provisioning_time_us();
+	if (threadpool_submit(pool, provisioning_stage_worker, dev) < 0) {
+		debug_info("ERROR: Could not queue device %s for stage %d", dev->udid, dev->stage);
+		provisioning_finish(dev, PROVISIONING_E_UNKNOWN_ERROR);
+	}
+}
+
+static void provisioning_stage_worker(void *data)
+{
+	struct provisioning_device *dev = (struct provisioning_device*)data;
+	provisioning_event_t event;
+	int code = 0;
+	int skipped = 0;
+
+	uint64_t start = provisioning_time_us();
+	provisioning_error_t err = provisioning_stages[dev->stage](dev, &code, &skipped);
+	uint64_t end = provisioning_time_us();
+
+	memset(&event, '\0', sizeof(event));
+	event.udid = dev->udid;
+	event.stage = dev->stage;
+	event.error = err;
+	event.code = code;
+	event.wait_us = start - dev->queued_at;
+	event.latency_us = end - start;
+	dev->latency_us[dev->stage] = end - dev->queued_at;
+	provisioning_emit(dev->batch, &event);
+
+	if (err != PROVISIONING_E_SUCCESS) {
+		provisioning_finish(dev, err);
+		return;
+	}
+
+	if (skipped) {
+		/* already activated, report the remaining stages as skipped */
+		for (dev->stage++; dev->stage < PROVISIONING_STAGE_COUNT; dev->stage++) {
+			memset(&event, '\0', sizeof(event));
+			event.udid = dev->udid;
+			event.stage = dev->stage;
+			event.skipped = 1;
+			provisioning_emit(dev->batch, &event);
+		}
+	} else {
+		dev->stage++;
+	}
+
+	if (dev->stage >= PROVISIONING_STAGE_COUNT) {
+		provisioning_finish(dev, PROVISIONING_E_SUCCESS);
+		return;
+	}
+	provisioning_enqueue(dev);
+}
+
+LIBIMOBILEDEVICE_API provisioning_error_t provisioning_batch_new(const provisioning_config_t *config, provisioning_request_cb_t request_cb, provisioning_event_cb_t event_cb, void *user_data, provisioning_batch_t *batch)
+{
+	if (!request_cb || !batch)
+		return PROVISIONING_E_INVALID_ARG;
+
+	provisioning_batch_t batch_loc = (provisioning_batch_t)calloc(1, sizeof(struct provisioning_batch_private));
+	if (!batch_loc)
+		return PROVISIONING_E_UNKNOWN_ERROR;
+
+	if (config) {
+		batch_loc->config = *config;
+	}
+	if (batch_loc->config.device_workers == 0)
+		batch_loc->config.device_workers = PROVISIONING_DEFAULT_DEVICE_WORKERS;
+	if (batch_loc->config.network_workers == 0)
+		batch_loc->config.network_workers = PROVISIONING_DEFAULT_NETWORK_WORKERS;
+	if (batch_loc->config.key_workers == 0)
+		batch_loc->config.key_workers = PROVISIONING_DEFAULT_KEY_WORKERS;
+	batch_loc->request_cb = request_cb;
+	batch_loc->event_cb = event_cb;
+	batch_loc->user_data = user_data;
+	mutex_init(&batch_loc->mutex);
+	cond_init(&batch_loc->done_cond);
+	mutex_init(&batch_loc->event_mutex);
+
+	*batch = batch_loc;
+	return PROVISIONING_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API provisioning_error_t provisioning_batch_free(provisioning_batch_t batch)
+{
+	uint32_t i;
+
+	if (!batch)
+		return PROVISIONING_E_INVALID_ARG;
+
+	for (i = 0; i < batch->num_devices; i++) {
+		free(batch->devices[i].udid);
+	}
+	free(batch->devices);
+	mutex_destroy(&batch->event_mutex);
+	cond_destroy(&batch->done_cond);
+	mutex_destroy(&batch->mutex);
+	free(batch);
+
+	return PROVISIONING_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API provisioning_error_t provisioning_batch_add(provisioning_batch_t batch, const char *udid, enum idevice_options options)
+{
+	if (!batch || !udid || batch->running)
+		return PROVISIONING_E_INVALID_ARG;
+
+	if (batch->num_devices == batch->capacity) {
+		uint32_t capacity = (batch->capacity) ? batch->capacity * 2 : 16;
+		struct provisioning_device *devices = (struct provisioning_device*)realloc(batch->devices, sizeof(struct provisioning_device) * capacity);
+		if (!devices)
+			return PROVISIONING_E_UNKNOWN_ERROR;
+		batch->devices = devices;
+		batch->capacity = capacity;
+	}
+
+	struct provisioning_device *dev = &batch->devices[batch->num_devices];
+	memset(dev, '\0', sizeof(struct provisioning_device));
+	dev->udid = strdup(udid);
+	if (!dev->udid)
+		return PROVISIONING_E_UNKNOWN_ERROR;
+	dev->options = options;
+	dev->result = PROVISIONING_E_UNKNOWN_ERROR;
+	batch->num_devices++;
+
+	return PROVISIONING_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API provisioning_error_t provisioning_batch_run(provisioning_batch_t batch)
+{
+	provisioning_error_t res = PROVISIONING_E_SUCCESS;
+	int own_key_pool = 0;
+	uint32_t i;
+
+	if (!batch || batch->running)
+		return PROVISIONING_E_INVALID_ARG;
+
+	if (batch->num_devices == 0)
+		return PROVISIONING_E_SUCCESS;
+
+	batch->device_pool = threadpool_new(0, batch->config.device_workers, batch->num_devices);
+	batch->network_pool = threadpool_new(0, batch->config.network_workers, batch->num_devices);
+	if (!batch->device_pool || !batch->network_pool) {
+		threadpool_free(batch->device_pool);
+		threadpool_free(batch->network_pool);
+		batch->device_pool = NULL;
+		batch->network_pool = NULL;
+		return PROVISIONING_E_UNKNOWN_ERROR;
+	}
+
+	/* generate the host keys for pairing in the background */
+	if (userpref_key_pool_get_size() == 0) {
+		unsigned int size = (batch->num_devices < 256) ? batch->num_devices : 256;
+		unsigned int workers = (batch->config.key_workers < 16) ? batch->config.key_workers : 16;
+		own_key_pool = (userpref_key_pool_configure(size, workers) == USERPREF_E_SUCCESS);
+	}
+
+	batch->running = 1;
+	batch->remaining = batch->num_devices;
+	for (i = 0; i < batch->num_devices; i++) {
+		struct provisioning_device *dev = &batch->devices[i];
+		dev->batch = batch;
+		dev->stage = PROVISIONING_STAGE_PAIR;
+		dev->result = PROVISIONING_E_UNKNOWN_ERROR;
+		memset(dev->latency_us, '\0', sizeof(dev->latency_us));
+		provisioning_enqueue(dev);
+	}
+
+	mutex_lock(&batch->mutex);
+	while (batch->remaining > 0) {
+		cond_wait(&batch->done_cond, &batch->mutex);
+	}
+	mutex_unlock(&batch->mutex);
+
+	threadpool_free(batch->device_pool);
+	threadpool_free(batch->network_pool);
+	batch->device_pool = NULL;
+	batch->network_pool = NULL;
+	if (own_key_pool) {
+		userpref_key_pool_configure(0, 0);
+	}
+	batch->running = 0;
+
+	for (i = 0; i < batch->num_devices; i++) {
+		if (batch->devices[i].result != PROVISIONING_E_SUCCESS) {
+			res = batch->devices[i].result;
+			break;
+		}
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API provisioning_error_t provisioning_batch_get_result(provisioning_batch_t batch, const char *udid, provisioning_stage_t *stage, uint64_t *latency_us)
+{
+	uint32_t i;
+
+	if (!batch || !udid || batch->running)
+		return PROVISIONING_E_INVALID_ARG;
+
+	for (i = 0; i < batch->num_devices; i++) {
+		struct provisioning_device *dev = &batch->devices[i];
+		if (strcmp(dev->udid, udid) != 0)
+			continue;
+		if (stage) {
+			*stage = dev->stage;
+		}
+		if (latency_us) {
+			memcpy(latency_us, dev->latency_us, sizeof(dev->latency_us));
+		}
+		return dev->result;
+	}
+
+	return PROVISIONING_E_INVALID_ARG;
+}
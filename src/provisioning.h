@@ -0,0 +1,62 @@
+/*
+ * provisioning.h
+ * Definitions for the batch provisioning driver
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __PROVISIONING_H
+#define __PROVISIONING_H
+
+#include "libimobiledevice/provisioning.h"
+#include "libimobiledevice/mobileactivation.h"
+#include "common/thread.h"
+
+#define PROVISIONING_DEFAULT_DEVICE_WORKERS 8
+#define PROVISIONING_DEFAULT_NETWORK_WORKERS 8
+#define PROVISIONING_DEFAULT_KEY_WORKERS 2
+
+struct provisioning_device {
+	provisioning_batch_t batch;
+	char *udid;
+	enum idevice_options options;
+	idevice_t device;
+	mobileactivation_client_t activation;
+	plist_t activation_info;
+	plist_t activation_record;
+	provisioning_stage_t stage;
+	provisioning_error_t result;
+	uint64_t queued_at;
+	uint64_t latency_us[PROVISIONING_STAGE_COUNT];
+};
+
+struct provisioning_batch_private {
+	provisioning_config_t config;
+	provisioning_request_cb_t request_cb;
+	provisioning_event_cb_t event_cb;
+	void *user_data;
+	struct provisioning_device *devices;
+	uint32_t num_devices;
+	uint32_t capacity;
+	threadpool_t device_pool;
+	threadpool_t network_pool;
+	int running;
+	uint32_t remaining;
+	mutex_t mutex;
+	cond_t done_cond;
+	mutex_t event_mutex;
+};
+
+#endif
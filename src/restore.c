@@ -25,16 +25,26 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
 #include <plist/plist.h>
 
 #include "property_list_service.h"
 #include "restore.h"
 #include "idevice.h"
 #include "common/debug.h"
+#include "common/socket.h"
 
 #define RESULT_SUCCESS 0
 #define RESULT_FAILURE 1
 
+/* maximum number of ready connections handled per wakeup of restored_multi_run() */
+#define RESTORED_MULTI_MAX_EVENTS 16
+
 /**
  * Internally used function for checking the result from restore's answer
  * plist to a previously sent request.
@@ -162,7 +172,7 @@ LIBIMOBILEDEVICE_API restored_error_t restored_send(restored_client_t client, pl
 	if (!client || !plist)
 		return RESTORE_E_INVALID_ARG;
 
-	return restored_error(property_list_service_send_xml_plist(client->parent, plist));
+	return restored_error(property_list_service_send_plist(client->parent, plist));
 }
 
 LIBIMOBILEDEVICE_API restored_error_t restored_query_type(restored_client_t client, char **type, uint64_t *version)
@@ -393,6 +403,422 @@ LIBIMOBILEDEVICE_API restored_error_t restored_start_restore(restored_client_t c
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API restored_error_t restored_query_values(restored_client_t client, const char **keys, uint32_t count, plist_t *values)
+{
+	if (!client || !keys || count == 0 || !values)
+		return RESTORE_E_INVALID_ARG;
+
+	restored_error_t ret = RESTORE_E_SUCCESS;
+	plist_t *requests = NULL;
+	uint32_t i;
+
+	requests = (plist_t*)malloc(sizeof(plist_t) * count);
+	if (!requests)
+		return RESTORE_E_UNKNOWN_ERROR;
+
+	for (i = 0; i < count; i++) {
+		values[i] = NULL;
+		requests[i] = plist_new_dict();
+		plist_dict_add_label(requests[i], client->label);
+		plist_dict_set_item(requests[i], "QueryKey", plist_new_string(keys[i]));
+		plist_dict_set_item(requests[i], "Request", plist_new_string("QueryValue"));
+	}
+
+	/* send all requests at once, restored answers them in order */
+	ret = restored_error(property_list_service_send_plist_batch(client->parent, requests, count, property_list_service_client_prefers_binary(client->parent)));
+
+	for (i = 0; i < count; i++) {
+		plist_free(requests[i]);
+	}
+	free(requests);
+
+	for (i = 0; i < count && ret == RESTORE_E_SUCCESS; i++) {
+		plist_t dict = NULL;
+		ret = restored_receive(client, &dict);
+		if (ret != RESTORE_E_SUCCESS)
+			break;
+
+		plist_t value_node = plist_dict_get_item(dict, keys[i]);
+		if (value_node) {
+			values[i] = plist_copy(value_node);
+		}
+		plist_free(dict);
+	}
+
+	if (ret != RESTORE_E_SUCCESS) {
+		for (i = 0; i < count; i++) {
+			plist_free(values[i]);
+			values[i] = NULL;
+		}
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_options_template_new(plist_t options, restored_options_template_t *tmpl)
+{
+	if (!options || plist_get_node_type(options) != PLIST_DICT || !tmpl)
+		return RESTORE_E_INVALID_ARG;
+
+	restored_options_template_t tmpl_loc = (restored_options_template_t)calloc(1, sizeof(struct restored_options_template_private));
+	if (!tmpl_loc)
+		return RESTORE_E_UNKNOWN_ERROR;
+
+	mutex_init(&tmpl_loc->mutex);
+	tmpl_loc->options = plist_copy(options);
+
+	*tmpl = tmpl_loc;
+	return RESTORE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_options_template_free(restored_options_template_t tmpl)
+{
+	unsigned int i;
+
+	if (!tmpl)
+		return RESTORE_E_INVALID_ARG;
+
+	for (i = 0; i < RESTORED_TEMPLATE_CACHE_SIZE; i++) {
+		free(tmpl->cache[i].label);
+		free(tmpl->cache[i].data);
+	}
+	plist_free(tmpl->options);
+	mutex_destroy(&tmpl->mutex);
+	free(tmpl);
+
+	return RESTORE_E_SUCCESS;
+}
+
+static int restored_label_equal(const char *a, const char *b)
+{
+	if (!a || !b)
+		return (a == b);
+	return !strcmp(a, b);
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_start_restore_with_template(restored_client_t client, restored_options_template_t tmpl, uint64_t version)
+{
+	if (!client || !tmpl)
+		return RESTORE_E_INVALID_ARG;
+
+	struct restored_template_message *entry = NULL;
+	int binary = property_list_service_client_prefers_binary(client->parent);
+	char *data = NULL;
+	uint32_t length = 0;
+	unsigned int i;
+
+	mutex_lock(&tmpl->mutex);
+	for (i = 0; i < tmpl->cache_next; i++) {
+		if (tmpl->cache[i].version == version && tmpl->cache[i].binary == binary && restored_label_equal(tmpl->cache[i].label, client->label)) {
+			entry = &tmpl->cache[i];
+			break;
+		}
+	}
+	if (!entry) {
+		plist_t dict = plist_new_dict();
+		plist_dict_add_label(dict, client->label);
+		plist_dict_set_item(dict,"Request", plist_new_string("StartRestore"));
+		plist_dict_set_item(dict, "RestoreOptions", plist_copy(tmpl->options));
+		plist_dict_set_item(dict,"RestoreProtocolVersion", plist_new_uint(version));
+		property_list_service_serialize(dict, binary, &data, &length);
+		plist_free(dict);
+		if (!data || length == 0) {
+			mutex_unlock(&tmpl->mutex);
+			free(data);
+			return RESTORE_E_PLIST_ERROR;
+		}
+		/* entries are never replaced so they can be sent without holding
+		 * the lock; once the cache is full the request is not kept */
+		if (tmpl->cache_next < RESTORED_TEMPLATE_CACHE_SIZE) {
+			entry = &tmpl->cache[tmpl->cache_next++];
+			entry->label = (client->label) ? strdup(client->label) : NULL;
+			entry->version = version;
+			entry->binary = binary;
+			entry->data = data;
+			entry->length = length;
+			data = NULL;
+		}
+	}
+	mutex_unlock(&tmpl->mutex);
+
+	restored_error_t ret;
+	if (entry) {
+		ret = restored_error(property_list_service_send_serialized(client->parent, entry->data, entry->length));
+	} else {
+		ret = restored_error(property_list_service_send_serialized(client->parent, data, length));
+		free(data);
+	}
+
+	return ret;
+}
+
+static uint64_t restored_time_ms(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_multi_new(restored_multi_t *multi)
+{
+	if (!multi)
+		return RESTORE_E_INVALID_ARG;
+
+	restored_multi_t multi_loc = (restored_multi_t)calloc(1, sizeof(struct restored_multi_private));
+	if (!multi_loc)
+		return RESTORE_E_UNKNOWN_ERROR;
+
+	*multi = multi_loc;
+	return RESTORE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_multi_free(restored_multi_t multi)
+{
+	if (!multi)
+		return RESTORE_E_INVALID_ARG;
+
+	free(multi->entries);
+	free(multi);
+
+	return RESTORE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_multi_add(restored_multi_t multi, restored_client_t client, restored_options_template_t tmpl, uint64_t version, restored_event_cb_t callback, void *user_data)
+{
+	uint32_t i;
+
+	if (!multi || !client || !callback)
+		return RESTORE_E_INVALID_ARG;
+
+	for (i = 0; i < multi->num_entries; i++) {
+		if (multi->entries[i].client == client)
+			return RESTORE_E_INVALID_ARG;
+	}
+
+	if (multi->num_entries == multi->capacity) {
+		uint32_t capacity = (multi->capacity) ? multi->capacity * 2 : 8;
+		struct restored_multi_entry *entries = (struct restored_multi_entry*)realloc(multi->entries, sizeof(struct restored_multi_entry) * capacity);
+		if (!entries)
+			return RESTORE_E_UNKNOWN_ERROR;
+		multi->entries = entries;
+		multi->capacity = capacity;
+	}
+
+	struct restored_multi_entry *entry = &multi->entries[multi->num_entries++];
+	memset(entry, '\0', sizeof(struct restored_multi_entry));
+	entry->client = client;
+	entry->tmpl = tmpl;
+	entry->version = version;
+	entry->callback = callback;
+	entry->user_data = user_data;
+	entry->fd = -1;
+
+	return RESTORE_E_SUCCESS;
+}
+
+static void restored_multi_finish(socket_poller_t poller, struct restored_multi_entry *entry, plist_t message, int64_t status, restored_error_t error)
+{
+	restored_event_t event;
+
+	if (entry->fd >= 0) {
+		socket_poller_remove(poller, entry->fd);
+		entry->fd = -1;
+	}
+	entry->finished = 1;
+
+	memset(&event, '\0', sizeof(event));
+	event.type = RESTORED_EVENT_FINISHED;
+	event.message = message;
+	event.progress = -1;
+	event.status = status;
+	event.error = error;
+	entry->callback(entry->client, &event, entry->user_data);
+}
+
+/**
+ * Internally used function that starts the restore of a device and
+ * registers its connection with the poller.
+ */
+static restored_error_t restored_multi_start(socket_poller_t poller, struct restored_multi_entry *entry)
+{
+	restored_error_t ret;
+	int fd = -1;
+
+	if (idevice_connection_get_fd(entry->client->parent->parent->connection, &fd) != IDEVICE_E_SUCCESS)
+		return RESTORE_E_MUX_ERROR;
+
+	if (entry->tmpl) {
+		ret = restored_start_restore_with_template(entry->client, entry->tmpl, entry->version);
+	} else {
+		ret = restored_start_restore(entry->client, NULL, entry->version);
+	}
+	if (ret != RESTORE_E_SUCCESS)
+		return ret;
+
+	if (socket_poller_add(poller, fd, SOCKET_POLL_READ, entry) < 0)
+		return RESTORE_E_UNKNOWN_ERROR;
+
+	entry->fd = fd;
+	entry->started = 1;
+	entry->last_activity = restored_time_ms();
+
+	return RESTORE_E_SUCCESS;
+}
+
+/**
+ * Internally used function that reads and dispatches one message of a
+ * device whose connection became readable.
+ */
+static void restored_multi_dispatch(socket_poller_t poller, struct restored_multi_entry *entry)
+{
+	restored_event_t event;
+	plist_t message = NULL;
+	char *type = NULL;
+
+	restored_error_t ret = restored_receive(entry->client, &message);
+	if (ret != RESTORE_E_SUCCESS) {
+		debug_info("restore of device %s failed: %d", entry->client->udid, ret);
+		restored_multi_finish(poller, entry, NULL, -1, ret);
+		return;
+	}
+	entry->last_activity = restored_time_ms();
+
+	memset(&event, '\0', sizeof(event));
+	event.type = RESTORED_EVENT_MESSAGE;
+	event.message = message;
+	event.progress = -1;
+	event.status = -1;
+
+	plist_t node = plist_dict_get_item(message, "MsgType");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &type);
+	}
+
+	if (type && !strcmp(type, "StatusMsg")) {
+		uint64_t status = 0;
+		node = plist_dict_get_item(message, "Status");
+		if (node && plist_get_node_type(node) == PLIST_UINT) {
+			plist_get_uint_val(node, &status);
+		}
+		free(type);
+		restored_multi_finish(poller, entry, message, (int64_t)status, RESTORE_E_SUCCESS);
+		plist_free(message);
+		return;
+	}
+
+	if (type && !strcmp(type, "ProgressMsg")) {
+		uint64_t value = 0;
+		event.type = RESTORED_EVENT_PROGRESS;
+		node = plist_dict_get_item(message, "Operation");
+		if (node && plist_get_node_type(node) == PLIST_UINT) {
+			plist_get_uint_val(node, &event.operation);
+		}
+		node = plist_dict_get_item(message, "Progress");
+		if (node && plist_get_node_type(node) == PLIST_UINT) {
+			plist_get_uint_val(node, &value);
+			event.progress = (int64_t)value;
+		}
+	}
+	free(type);
+
+	if (entry->callback(entry->client, &event, entry->user_data) != 0) {
+		debug_info("restore of device %s aborted by callback", entry->client->udid);
+		restored_multi_finish(poller, entry, NULL, -1, RESTORE_E_UNKNOWN_ERROR);
+	}
+	plist_free(message);
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_multi_run(restored_multi_t multi, unsigned int timeout)
+{
+	struct socket_poller_event events[RESTORED_MULTI_MAX_EVENTS];
+	restored_error_t ret = RESTORE_E_SUCCESS;
+	uint32_t remaining = 0;
+	uint32_t i;
+
+	if (!multi)
+		return RESTORE_E_INVALID_ARG;
+
+	socket_poller_t poller = socket_poller_new();
+	if (!poller)
+		return RESTORE_E_UNKNOWN_ERROR;
+
+	for (i = 0; i < multi->num_entries; i++) {
+		struct restored_multi_entry *entry = &multi->entries[i];
+		if (entry->finished)
+			continue;
+		restored_error_t err = restored_multi_start(poller, entry);
+		if (err != RESTORE_E_SUCCESS) {
+			debug_info("could not start restore of device %s: %d", entry->client->udid, err);
+			restored_multi_finish(poller, entry, NULL, -1, err);
+			continue;
+		}
+		remaining++;
+	}
+
+	while (remaining > 0) {
+		int wait = -1;
+
+		if (timeout > 0) {
+			uint64_t now = restored_time_ms();
+			uint64_t next = UINT64_MAX;
+			for (i = 0; i < multi->num_entries; i++) {
+				struct restored_multi_entry *entry = &multi->entries[i];
+				if (!entry->finished && entry->last_activity + timeout < next)
+					next = entry->last_activity + timeout;
+			}
+			wait = (next > now) ? (int)(next - now) : 0;
+		}
+
+		int num = socket_poller_wait(poller, events, RESTORED_MULTI_MAX_EVENTS, wait);
+		if (num < 0) {
+			if (num == -EINTR)
+				continue;
+			debug_info("waiting for restored connections failed: %d", num);
+			ret = RESTORE_E_UNKNOWN_ERROR;
+			break;
+		}
+
+		for (i = 0; i < (uint32_t)num; i++) {
+			struct restored_multi_entry *entry = (struct restored_multi_entry*)events[i].user_data;
+			if (!entry->finished)
+				restored_multi_dispatch(poller, entry);
+		}
+
+		remaining = 0;
+		uint64_t now = restored_time_ms();
+		for (i = 0; i < multi->num_entries; i++) {
+			struct restored_multi_entry *entry = &multi->entries[i];
+			if (entry->finished)
+				continue;
+			if (timeout > 0 && now - entry->last_activity >= timeout) {
+				debug_info("restore of device %s timed out", entry->client->udid);
+				restored_multi_finish(poller, entry, NULL, -1, RESTORE_E_RECEIVE_TIMEOUT);
+				continue;
+			}
+			remaining++;
+		}
+	}
+
+	/* report the devices that are left when waiting failed */
+	for (i = 0; i < multi->num_entries; i++) {
+		struct restored_multi_entry *entry = &multi->entries[i];
+		if (!entry->finished)
+			restored_multi_finish(poller, entry, NULL, -1, RESTORE_E_UNKNOWN_ERROR);
+	}
+
+	socket_poller_free(poller);
+
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API restored_error_t restored_reboot(restored_client_t client)
 {
 	if (!client)
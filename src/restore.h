@@ -26,6 +26,10 @@
 
 #include "libimobiledevice/restore.h"
 #include "property_list_service.h"
+#include "common/thread.h"
+
+/* Number of serialized StartRestore requests kept per options template */
+#define RESTORED_TEMPLATE_CACHE_SIZE 4
 
 struct restored_client_private {
 	property_list_service_client_t parent;
@@ -34,4 +38,37 @@ struct restored_client_private {
 	plist_t info;
 };
 
+struct restored_template_message {
+	char *label;
+	uint64_t version;
+	int binary;
+	char *data;
+	uint32_t length;
+};
+
+struct restored_options_template_private {
+	mutex_t mutex;
+	plist_t options;
+	struct restored_template_message cache[RESTORED_TEMPLATE_CACHE_SIZE];
+	unsigned int cache_next;
+};
+
+struct restored_multi_entry {
+	restored_client_t client;
+	restored_options_template_t tmpl;
+	uint64_t version;
+	restored_event_cb_t callback;
+	void *user_data;
+	int fd;
+	int started;
+	int finished;
+	uint64_t last_activity;
+};
+
+struct restored_multi_private {
+	struct restored_multi_entry *entries;
+	uint32_t num_entries;
+	uint32_t capacity;
+};
+
 #endif
@@ -30,6 +30,12 @@
 #include "sbservices.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
+
+/* number of icon requests sent ahead of their replies */
+#define ICON_REQUEST_WINDOW 8
+
+#define ICON_CACHE_INDEX "index.plist"
 
 /**
  * Locks an sbservices client, used for thread safety.
@@ -90,6 +96,7 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_client_new(idevice_t device,
 	sbservices_client_t client_loc = (sbservices_client_t) malloc(sizeof(struct sbservices_client_private));
 	client_loc->parent = plistclient;
 	mutex_init(&client_loc->mutex);
+	client_loc->last_state = NULL;
 
 	*client = client_loc;
 	return SBSERVICES_E_SUCCESS;
@@ -110,6 +117,9 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_client_free(sbservices_client
 	sbservices_error_t err = sbservices_error(property_list_service_client_free(client->parent));
 	client->parent = NULL;
 	mutex_destroy(&client->mutex);
+	if (client->last_state) {
+		plist_free(client->last_state);
+	}
 	free(client);
 
 	return err;
@@ -145,6 +155,12 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icon_state(sbservices_cli
 			plist_free(*state);
 			*state = NULL;
 		}
+	} else {
+		/* remember what the device has for sbservices_set_icon_state_changed() */
+		if (client->last_state) {
+			plist_free(client->last_state);
+		}
+		client->last_state = plist_copy(*state);
 	}
 
 leave_unlock:
@@ -171,6 +187,12 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_set_icon_state(sbservices_cli
 	res = sbservices_error(property_list_service_send_binary_plist(client->parent, dict));
 	if (res != SBSERVICES_E_SUCCESS) {
 		debug_info("could not send plist, error %d", res);
+	} else {
+		/* the state sent is the device's state from now on */
+		if (client->last_state) {
+			plist_free(client->last_state);
+		}
+		client->last_state = plist_copy(newstate);
 	}
 	/* NO RESPONSE */
 
@@ -181,6 +203,87 @@ LIBIMOBILEDEVICE_API sbservices_error_t sbservices_set_icon_state(sbservices_cli
 	return res;
 }
 
+/**
+ * Counts the differences between two icon states. Differing scalar values,
+ * array slots and dictionary keys each count as one change.
+ */
+static uint32_t icon_state_count_changes(plist_t old_node, plist_t new_node)
+{
+	plist_type type = plist_get_node_type(new_node);
+	if (plist_get_node_type(old_node) != type) {
+		return 1;
+	}
+
+	uint32_t changes = 0;
+	if (type == PLIST_ARRAY) {
+		uint32_t old_size = plist_array_get_size(old_node);
+		uint32_t new_size = plist_array_get_size(new_node);
+		uint32_t i;
+		for (i = 0; i < old_size && i < new_size; i++) {
+			changes += icon_state_count_changes(plist_array_get_item(old_node, i), plist_array_get_item(new_node, i));
+		}
+		changes += (old_size > new_size) ? old_size - new_size : new_size - old_size;
+	} else if (type == PLIST_DICT) {
+		plist_dict_iter iter = NULL;
+		char *key = NULL;
+		plist_t value = NULL;
+
+		plist_dict_new_iter(new_node, &iter);
+		while (1) {
+			plist_dict_next_item(new_node, iter, &key, &value);
+			if (!key) {
+				break;
+			}
+			plist_t old_value = plist_dict_get_item(old_node, key);
+			changes += (old_value) ? icon_state_count_changes(old_value, value) : 1;
+			free(key);
+		}
+		free(iter);
+
+		/* keys that were removed */
+		iter = NULL;
+		plist_dict_new_iter(old_node, &iter);
+		while (1) {
+			plist_dict_next_item(old_node, iter, &key, &value);
+			if (!key) {
+				break;
+			}
+			if (!plist_dict_get_item(new_node, key)) {
+				changes++;
+			}
+			free(key);
+		}
+		free(iter);
+	} else if (!plist_compare_node_value(old_node, new_node)) {
+		changes = 1;
+	}
+	return changes;
+}
+
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_set_icon_state_changed(sbservices_client_t client, plist_t newstate, uint32_t *changes)
+{
+	if (!client || !client->parent || !newstate)
+		return SBSERVICES_E_INVALID_ARG;
+
+	uint32_t count = 1;
+
+	sbservices_lock(client);
+	if (client->last_state) {
+		count = icon_state_count_changes(client->last_state, newstate);
+	}
+	sbservices_unlock(client);
+
+	if (changes) {
+		*changes = count;
+	}
+	if (count == 0) {
+		debug_info("icon state unchanged, skipping upload");
+		return SBSERVICES_E_SUCCESS;
+	}
+
+	return sbservices_set_icon_state(client, newstate);
+}
+
 LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icon_pngdata(sbservices_client_t client, const char *bundleId, char **pngdata, uint64_t *pngsize)
 {
 	if (!client || !client->parent || !bundleId || !pngdata)
@@ -218,6 +321,204 @@ leave_unlock:
 	return res;
 }
 
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icon_pngdata_multiple(sbservices_client_t client, const char **bundle_ids, uint32_t count, char **pngdata, uint64_t *pngsizes)
+{
+	if (!client || !client->parent || !bundle_ids || !pngdata || !pngsizes)
+		return SBSERVICES_E_INVALID_ARG;
+
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		if (!bundle_ids[i])
+			return SBSERVICES_E_INVALID_ARG;
+		pngdata[i] = NULL;
+		pngsizes[i] = 0;
+	}
+
+	sbservices_error_t res = SBSERVICES_E_SUCCESS;
+	uint32_t sent = 0;
+	uint32_t received = 0;
+
+	sbservices_lock(client);
+
+	while (received < count) {
+		/* keep up to ICON_REQUEST_WINDOW requests in flight */
+		while (sent < count && sent - received < ICON_REQUEST_WINDOW) {
+			plist_t dict = plist_new_dict();
+			plist_dict_set_item(dict, "command", plist_new_string("getIconPNGData"));
+			plist_dict_set_item(dict, "bundleId", plist_new_string(bundle_ids[sent]));
+			res = sbservices_error(property_list_service_send_binary_plist(client->parent, dict));
+			plist_free(dict);
+			if (res != SBSERVICES_E_SUCCESS) {
+				debug_info("could not send plist, error %d", res);
+				break;
+			}
+			sent++;
+		}
+		if (res != SBSERVICES_E_SUCCESS) {
+			break;
+		}
+
+		plist_t dict = NULL;
+		res = sbservices_error(property_list_service_receive_plist(client->parent, &dict));
+		if (res != SBSERVICES_E_SUCCESS) {
+			debug_info("could not receive plist, error %d", res);
+			plist_free(dict);
+			break;
+		}
+		plist_t node = plist_dict_get_item(dict, "pngData");
+		if (node) {
+			plist_get_data_val(node, &pngdata[received], &pngsizes[received]);
+		}
+		plist_free(dict);
+		received++;
+	}
+
+	sbservices_unlock(client);
+
+	if (res != SBSERVICES_E_SUCCESS) {
+		for (i = 0; i < received; i++) {
+			free(pngdata[i]);
+			pngdata[i] = NULL;
+			pngsizes[i] = 0;
+		}
+	}
+
+	return res;
+}
+
+/* builds the version key an icon is cached under from the app metadata */
+static char* icon_cache_version(plist_t app)
+{
+	const char *version = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleVersion"), NULL);
+	const char *short_version = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleShortVersionString"), NULL);
+	return string_concat((short_version) ? short_version : "", "/", (version) ? version : "", NULL);
+}
+
+/* bundle identifiers are only used as file names if they are harmless */
+static int icon_cache_valid_name(const char *bundle_id)
+{
+	const char *p;
+	if (!bundle_id[0] || bundle_id[0] == '.')
+		return 0;
+	for (p = bundle_id; *p; p++) {
+		if (*p == '/' || *p == '\\')
+			return 0;
+	}
+	return 1;
+}
+
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icon_pngdata_cached(sbservices_client_t client, const char *cache_dir, plist_t apps, plist_t *icons)
+{
+	if (!client || !client->parent || !cache_dir || plist_get_node_type(apps) != PLIST_ARRAY || !icons)
+		return SBSERVICES_E_INVALID_ARG;
+
+	char *index_path = string_build_path(cache_dir, ICON_CACHE_INDEX, NULL);
+	plist_t index = NULL;
+	if (!plist_read_from_filename(&index, index_path) || plist_get_node_type(index) != PLIST_DICT) {
+		plist_free(index);
+		index = plist_new_dict();
+	}
+
+	plist_t result = plist_new_dict();
+	plist_t new_index = plist_new_dict();
+	uint32_t count = plist_array_get_size(apps);
+	const char **missing = (const char**)malloc(sizeof(char*) * (count + 1));
+	uint32_t num_missing = 0;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		plist_t app = plist_array_get_item(apps, i);
+		const char *bundle_id = plist_get_string_ptr(plist_dict_get_item(app, "CFBundleIdentifier"), NULL);
+		if (!bundle_id || !icon_cache_valid_name(bundle_id) || plist_dict_get_item(new_index, bundle_id)) {
+			continue;
+		}
+		char *version = icon_cache_version(app);
+		const char *cached_version = plist_get_string_ptr(plist_dict_get_item(index, bundle_id), NULL);
+		if (cached_version && !strcmp(cached_version, version)) {
+			char *filename = string_concat(bundle_id, ".png", NULL);
+			char *path = string_build_path(cache_dir, filename, NULL);
+			char *data = NULL;
+			uint64_t size = 0;
+			buffer_read_from_filename(path, &data, &size);
+			free(path);
+			free(filename);
+			if (data && size > 0) {
+				plist_dict_set_item(result, bundle_id, plist_new_data(data, size));
+				plist_dict_set_item(new_index, bundle_id, plist_new_string(version));
+				free(data);
+				free(version);
+				continue;
+			}
+			free(data);
+		}
+		/* not cached or outdated, fetch it below */
+		plist_dict_set_item(new_index, bundle_id, plist_new_string(version));
+		missing[num_missing++] = bundle_id;
+		free(version);
+	}
+
+	sbservices_error_t res = SBSERVICES_E_SUCCESS;
+	if (num_missing > 0) {
+		char **pngdata = (char**)calloc(num_missing, sizeof(char*));
+		uint64_t *pngsizes = (uint64_t*)calloc(num_missing, sizeof(uint64_t));
+		res = sbservices_get_icon_pngdata_multiple(client, missing, num_missing, pngdata, pngsizes);
+		if (res == SBSERVICES_E_SUCCESS) {
+			for (i = 0; i < num_missing; i++) {
+				char *filename = string_concat(missing[i], ".png", NULL);
+				char *path = string_build_path(cache_dir, filename, NULL);
+				if (pngdata[i] && pngsizes[i] > 0) {
+					buffer_write_to_filename(path, pngdata[i], pngsizes[i]);
+					plist_dict_set_item(result, missing[i], plist_new_data(pngdata[i], pngsizes[i]));
+				} else {
+					/* no icon, make sure a stale one is not picked up again */
+					remove(path);
+					plist_dict_remove_item(new_index, missing[i]);
+				}
+				free(path);
+				free(filename);
+				free(pngdata[i]);
+			}
+		}
+		free(pngdata);
+		free(pngsizes);
+	}
+
+	if (res == SBSERVICES_E_SUCCESS) {
+		/* drop icons of apps that are no longer installed */
+		plist_dict_iter iter = NULL;
+		plist_dict_new_iter(index, &iter);
+		while (1) {
+			char *bundle_id = NULL;
+			plist_t value = NULL;
+			plist_dict_next_item(index, iter, &bundle_id, &value);
+			if (!bundle_id) {
+				break;
+			}
+			if (!plist_dict_get_item(new_index, bundle_id) && icon_cache_valid_name(bundle_id)) {
+				char *filename = string_concat(bundle_id, ".png", NULL);
+				char *path = string_build_path(cache_dir, filename, NULL);
+				remove(path);
+				free(path);
+				free(filename);
+			}
+			free(bundle_id);
+		}
+		free(iter);
+
+		plist_write_to_filename(new_index, index_path, PLIST_FORMAT_BINARY);
+		*icons = result;
+	} else {
+		plist_free(result);
+	}
+
+	free(missing);
+	plist_free(new_index);
+	plist_free(index);
+	free(index_path);
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_interface_orientation(sbservices_client_t client, sbservices_interface_orientation_t* interface_orientation)
 {
 	if (!client || !client->parent || !interface_orientation)
@@ -29,6 +29,7 @@
 struct sbservices_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
+	plist_t last_state;
 };
 
 #endif
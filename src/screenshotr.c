@@ -25,6 +25,9 @@
 #include <plist/plist.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include "screenshotr.h"
 #include "device_link_service.h"
@@ -79,6 +82,9 @@ LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_client_new(idevice_t device
 
 	screenshotr_client_t client_loc = (screenshotr_client_t) malloc(sizeof(struct screenshotr_client_private));
 	client_loc->parent = dlclient;
+	client_loc->stream_buffer = NULL;
+	client_loc->stream_pending = 0;
+	client_loc->stream_sequence = 0;
 
 	/* perform handshake */
 	ret = screenshotr_error(device_link_service_version_exchange(dlclient, SCREENSHOTR_VERSION_INT1, SCREENSHOTR_VERSION_INT2));
@@ -104,62 +110,262 @@ LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_client_free(screenshotr_cli
 {
 	if (!client)
 		return SCREENSHOTR_E_INVALID_ARG;
+	free(client->stream_buffer);
 	device_link_service_disconnect(client->parent, NULL);
 	screenshotr_error_t err = screenshotr_error(device_link_service_client_free(client->parent));
 	free(client);
 	return err;
 }
 
-LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize)
+/**
+ * Builds the ScreenShotRequest message.
+ * Used as build callback for device_link_service_send_process_message_cached().
+ */
+static plist_t screenshotr_build_request(void *user_data)
 {
-	if (!client || !client->parent || !imgdata)
-		return SCREENSHOTR_E_INVALID_ARG;
-
-	screenshotr_error_t res = SCREENSHOTR_E_UNKNOWN_ERROR;
-
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "MessageType", plist_new_string("ScreenShotRequest"));
+	return dict;
+}
 
-	res = screenshotr_error(device_link_service_send_process_message(client->parent, dict));
-	plist_free(dict);
+/**
+ * Receives a ScreenShotReply message and locates the image data in it.
+ * Binary replies are not parsed; the image data is returned as part of the
+ * received message. Other replies are parsed and the image data is copied.
+ *
+ * @param client The screenshotr client
+ * @param buffer Pointer that receives the buffer holding the image data,
+ *     to be freed by the caller
+ * @param data Pointer that receives the start of the image data in buffer
+ * @param size Pointer that receives the size of the image data
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, or an SCREENSHOTR_E_* error code.
+ */
+static screenshotr_error_t screenshotr_receive_reply(screenshotr_client_t client, char **buffer, const char **data, uint64_t *size)
+{
+	char *message = NULL;
+	uint32_t length = 0;
+	uint64_t offset = 0;
+	screenshotr_error_t res = screenshotr_error(device_link_service_receive_buffer(client->parent, &message, &length));
 	if (res != SCREENSHOTR_E_SUCCESS) {
-		debug_info("could not send plist, error %d", res);
+		debug_info("could not get screenshot data, error %d", res);
 		return res;
 	}
 
-	dict = NULL;
-	res = screenshotr_error(device_link_service_receive_process_message(client->parent, &dict));
-	if (res != SCREENSHOTR_E_SUCCESS) {
-		debug_info("could not get screenshot data, error %d", res);
-		goto leave;
+	if (screenshotr_find_image_data(message, length, &offset, size) == 0) {
+		*buffer = message;
+		*data = message + offset;
+		return SCREENSHOTR_E_SUCCESS;
 	}
-	if (!dict) {
+
+	/* not the expected binary layout, parse the message */
+	plist_t pmsg = NULL;
+	plist_from_memory(message, length, &pmsg);
+	free(message);
+	if (!pmsg) {
 		debug_info("did not receive screenshot data!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
-		goto leave;
+		return SCREENSHOTR_E_PLIST_ERROR;
 	}
 
-	plist_t node = plist_dict_get_item(dict, "MessageType");
+	res = SCREENSHOTR_E_PLIST_ERROR;
+	plist_t dict = (plist_get_node_type(pmsg) == PLIST_ARRAY && plist_array_get_size(pmsg) == 2) ? plist_array_get_item(pmsg, 1) : NULL;
+	plist_t node = (dict && plist_get_node_type(dict) == PLIST_DICT) ? plist_dict_get_item(dict, "MessageType") : NULL;
 	char *strval = NULL;
 	plist_get_string_val(node, &strval);
 	if (!strval || strcmp(strval, "ScreenShotReply")) {
 		debug_info("invalid screenshot data received!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
 		goto leave;
 	}
 	node = plist_dict_get_item(dict, "ScreenShotData");
 	if (!node || plist_get_node_type(node) != PLIST_DATA) {
 		debug_info("no PNG data received!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
 		goto leave;
 	}
 
-	plist_get_data_val(node, imgdata, imgsize);
+	plist_get_data_val(node, buffer, size);
+	*data = *buffer;
 	res = SCREENSHOTR_E_SUCCESS;
 
 leave:
-	if (dict)
-		plist_free(dict);
+	free(strval);
+	plist_free(pmsg);
+
+	return res;
+}
+
+static screenshotr_error_t screenshotr_request(screenshotr_client_t client)
+{
+	screenshotr_error_t res = screenshotr_error(device_link_service_send_process_message_cached(client->parent, "ScreenShotRequest", screenshotr_build_request, NULL));
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		debug_info("could not send plist, error %d", res);
+	}
+	return res;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize)
+{
+	if (!client || !client->parent || !imgdata)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	if (client->stream_pending > 0)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	screenshotr_error_t res = screenshotr_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+
+	char *buffer = NULL;
+	const char *data = NULL;
+	uint64_t size = 0;
+	res = screenshotr_receive_reply(client, &buffer, &data, &size);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+
+	/* move the image to the start of the message buffer instead of copying it out */
+	if (data != buffer) {
+		memmove(buffer, data, (size_t)size);
+		char *shrunk = (char*)realloc(buffer, (size_t)((size > 0) ? size : 1));
+		if (shrunk) {
+			buffer = shrunk;
+		}
+	}
+	*imgdata = buffer;
+	if (imgsize)
+		*imgsize = size;
+
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_take_screenshot_to_fd(screenshotr_client_t client, int fd, uint64_t *imgsize)
+{
+	if (!client || !client->parent || fd < 0)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	if (client->stream_pending > 0)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	screenshotr_error_t res = screenshotr_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+
+	char *buffer = NULL;
+	const char *data = NULL;
+	uint64_t size = 0;
+	res = screenshotr_receive_reply(client, &buffer, &data, &size);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+
+	uint64_t done = 0;
+	while (done < size) {
+		ssize_t w = write(fd, data + done, (size_t)(size - done));
+		if (w < 0 && errno == EINTR) {
+			continue;
+		}
+		if (w <= 0) {
+			debug_info("could not write screenshot data: %s", strerror(errno));
+			res = SCREENSHOTR_E_UNKNOWN_ERROR;
+			break;
+		}
+		done += (uint64_t)w;
+	}
+	free(buffer);
+
+	if (imgsize)
+		*imgsize = done;
+
+	return res;
+}
+
+static uint64_t screenshotr_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static screenshotr_error_t screenshotr_stream_send_request(screenshotr_client_t client)
+{
+	screenshotr_error_t res = screenshotr_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+	client->stream_sent[(client->stream_sequence + client->stream_pending) % SCREENSHOTR_STREAM_DEPTH] = screenshotr_time_us();
+	client->stream_pending++;
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_stream_next_frame(screenshotr_client_t client, screenshotr_frame_t *frame, int prefetch)
+{
+	if (!client || !client->parent || !frame)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	screenshotr_error_t res = SCREENSHOTR_E_SUCCESS;
+
+	/* the previous frame is released here */
+	free(client->stream_buffer);
+	client->stream_buffer = NULL;
+	memset(frame, '\0', sizeof(screenshotr_frame_t));
+
+	if (client->stream_pending == 0) {
+		res = screenshotr_stream_send_request(client);
+		if (res != SCREENSHOTR_E_SUCCESS) {
+			return res;
+		}
+	}
+	if (prefetch && client->stream_pending < SCREENSHOTR_STREAM_DEPTH) {
+		/* the device captures the next frame while this reply is being transferred */
+		res = screenshotr_stream_send_request(client);
+		if (res != SCREENSHOTR_E_SUCCESS) {
+			return res;
+		}
+	}
+
+	const char *data = NULL;
+	uint64_t size = 0;
+	res = screenshotr_receive_reply(client, &client->stream_buffer, &data, &size);
+	uint64_t sent = client->stream_sent[client->stream_sequence % SCREENSHOTR_STREAM_DEPTH];
+	client->stream_pending--;
+	client->stream_sequence++;
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+
+	frame->data = data;
+	frame->size = size;
+	frame->sequence = client->stream_sequence - 1;
+	frame->latency_us = screenshotr_time_us() - sent;
+
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_stream_stop(screenshotr_client_t client)
+{
+	if (!client || !client->parent)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	screenshotr_error_t res = SCREENSHOTR_E_SUCCESS;
+
+	free(client->stream_buffer);
+	client->stream_buffer = NULL;
+
+	/* collect the replies of prefetched requests */
+	while (client->stream_pending > 0) {
+		char *buffer = NULL;
+		const char *data = NULL;
+		uint64_t size = 0;
+		client->stream_pending--;
+		res = screenshotr_receive_reply(client, &buffer, &data, &size);
+		if (res != SCREENSHOTR_E_SUCCESS) {
+			client->stream_pending = 0;
+			break;
+		}
+		free(buffer);
+	}
+	client->stream_sequence = 0;
 
 	return res;
 }
@@ -25,8 +25,16 @@
 #include "libimobiledevice/screenshotr.h"
 #include "device_link_service.h"
 
+#define SCREENSHOTR_STREAM_DEPTH 2
+
 struct screenshotr_client_private {
 	device_link_service_client_t parent;
+	char *stream_buffer;
+	uint32_t stream_pending;
+	uint64_t stream_sequence;
+	uint64_t stream_sent[SCREENSHOTR_STREAM_DEPTH];
 };
 
+int screenshotr_find_image_data(const char *message, uint64_t length, uint64_t *offset, uint64_t *size);
+
 #endif
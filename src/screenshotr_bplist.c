@@ -0,0 +1,202 @@
+/*
+ * screenshotr_bplist.c
+ * Minimal binary plist reader for screenshotr replies.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdint.h>
+
+#include "screenshotr.h"
+
+/* minimal binary plist reader used to locate the image data without parsing the reply */
+struct screenshotr_bplist {
+	const unsigned char *data;
+	uint64_t length;
+	uint8_t offset_size;
+	uint8_t ref_size;
+	uint64_t num_objects;
+	uint64_t offset_table;
+	uint64_t top_object;
+};
+
+#define BPLIST_TRAILER_SIZE 32
+#define BPLIST_DATA 0x4
+#define BPLIST_STRING 0x5
+#define BPLIST_UNICODE 0x6
+#define BPLIST_ARRAY 0xA
+#define BPLIST_DICT 0xD
+
+static uint64_t screenshotr_bplist_uint(const unsigned char *p, uint8_t size)
+{
+	uint64_t v = 0;
+	uint8_t i;
+	for (i = 0; i < size; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static int screenshotr_bplist_init(struct screenshotr_bplist *bp, const char *data, uint64_t length)
+{
+	if (length < 8 + BPLIST_TRAILER_SIZE || memcmp(data, "bplist00", 8) != 0) {
+		return -1;
+	}
+	const unsigned char *trailer = (const unsigned char*)data + length - BPLIST_TRAILER_SIZE;
+	bp->data = (const unsigned char*)data;
+	bp->length = length;
+	bp->offset_size = trailer[6];
+	bp->ref_size = trailer[7];
+	bp->num_objects = screenshotr_bplist_uint(trailer + 8, 8);
+	bp->top_object = screenshotr_bplist_uint(trailer + 16, 8);
+	bp->offset_table = screenshotr_bplist_uint(trailer + 24, 8);
+	if (bp->offset_size == 0 || bp->offset_size > 8 || bp->ref_size == 0 || bp->ref_size > 8
+	    || bp->top_object >= bp->num_objects || bp->offset_table < 8
+	    || bp->offset_table > length - BPLIST_TRAILER_SIZE
+	    || bp->num_objects > (length - BPLIST_TRAILER_SIZE - bp->offset_table) / bp->offset_size) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Looks up an object and returns its type, its element or byte count and
+ * the offset of its contents, checking that the contents are in bounds.
+ */
+static int screenshotr_bplist_object(const struct screenshotr_bplist *bp, uint64_t index, uint8_t *type, uint64_t *count, uint64_t *offset)
+{
+	if (index >= bp->num_objects) {
+		return -1;
+	}
+	uint64_t pos = screenshotr_bplist_uint(bp->data + bp->offset_table + index * bp->offset_size, bp->offset_size);
+	if (pos < 8 || pos >= bp->offset_table) {
+		return -1;
+	}
+	uint8_t marker = bp->data[pos++];
+	uint64_t n = marker & 0x0f;
+	*type = marker >> 4;
+	if (n == 0x0f) {
+		/* the count follows as an integer object */
+		if (pos >= bp->offset_table || (bp->data[pos] >> 4) != 0x1) {
+			return -1;
+		}
+		uint8_t size = 1 << (bp->data[pos] & 0x0f);
+		pos++;
+		if (size > 8 || pos + size > bp->offset_table) {
+			return -1;
+		}
+		n = screenshotr_bplist_uint(bp->data + pos, size);
+		pos += size;
+	}
+
+	uint64_t bytes;
+	switch (*type) {
+	case BPLIST_DATA:
+	case BPLIST_STRING:
+		bytes = n;
+		break;
+	case BPLIST_UNICODE:
+		bytes = n * 2;
+		break;
+	case BPLIST_ARRAY:
+		bytes = n * bp->ref_size;
+		break;
+	case BPLIST_DICT:
+		bytes = n * 2 * bp->ref_size;
+		break;
+	default:
+		bytes = 0;
+		break;
+	}
+	if (n > bp->length || bytes > bp->offset_table - pos) {
+		return -1;
+	}
+	*count = n;
+	*offset = pos;
+	return 0;
+}
+
+/* returns non-zero if the object is the given ASCII string */
+static int screenshotr_bplist_string_equals(const struct screenshotr_bplist *bp, uint64_t index, const char *str)
+{
+	uint8_t type = 0;
+	uint64_t count = 0;
+	uint64_t offset = 0;
+	if (screenshotr_bplist_object(bp, index, &type, &count, &offset) < 0 || type != BPLIST_STRING) {
+		return 0;
+	}
+	return (count == strlen(str) && memcmp(bp->data + offset, str, count) == 0);
+}
+
+static int screenshotr_bplist_dict_get(const struct screenshotr_bplist *bp, uint64_t dict, const char *key, uint64_t *value)
+{
+	uint8_t type = 0;
+	uint64_t count = 0;
+	uint64_t offset = 0;
+	uint64_t i;
+	if (screenshotr_bplist_object(bp, dict, &type, &count, &offset) < 0 || type != BPLIST_DICT) {
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		uint64_t k = screenshotr_bplist_uint(bp->data + offset + i * bp->ref_size, bp->ref_size);
+		if (screenshotr_bplist_string_equals(bp, k, key)) {
+			*value = screenshotr_bplist_uint(bp->data + offset + (count + i) * bp->ref_size, bp->ref_size);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Finds the image data of a binary DLMessageProcessMessage/ScreenShotReply
+ * message.
+ *
+ * @return 0 on success with offset and size of the image data set, or -1
+ *     if the message has a different layout.
+ */
+int screenshotr_find_image_data(const char *message, uint64_t length, uint64_t *offset, uint64_t *size)
+{
+	struct screenshotr_bplist bp;
+	uint8_t type = 0;
+	uint64_t count = 0;
+	uint64_t pos = 0;
+	uint64_t node = 0;
+
+	if (screenshotr_bplist_init(&bp, message, length) < 0) {
+		return -1;
+	}
+	if (screenshotr_bplist_object(&bp, bp.top_object, &type, &count, &pos) < 0 || type != BPLIST_ARRAY || count != 2) {
+		return -1;
+	}
+	uint64_t name = screenshotr_bplist_uint(bp.data + pos, bp.ref_size);
+	uint64_t dict = screenshotr_bplist_uint(bp.data + pos + bp.ref_size, bp.ref_size);
+	if (!screenshotr_bplist_string_equals(&bp, name, "DLMessageProcessMessage")) {
+		return -1;
+	}
+	if (screenshotr_bplist_dict_get(&bp, dict, "MessageType", &node) < 0 || !screenshotr_bplist_string_equals(&bp, node, "ScreenShotReply")) {
+		return -1;
+	}
+	if (screenshotr_bplist_dict_get(&bp, dict, "ScreenShotData", &node) < 0
+	    || screenshotr_bplist_object(&bp, node, &type, &count, &pos) < 0 || type != BPLIST_DATA) {
+		return -1;
+	}
+	*offset = pos;
+	*size = count;
+	return 0;
+}
@@ -23,10 +23,40 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
 
 #include "service.h"
 #include "idevice.h"
+#include "broker.h"
 #include "common/debug.h"
+#include "common/socket.h"
+#include "common/thread.h"
+
+#define SERVICE_RECONNECT_INITIAL_DELAY 250
+#define SERVICE_RECONNECT_MAX_DELAY 30000
+/* granularity in milliseconds at which waiting clients check for cancellation */
+#define SERVICE_RECONNECT_POLL_INTERVAL 50
+
+/* Reconnect state shared by all clients of a device. Entries are created on
+ * first use and kept for the lifetime of the process. */
+struct service_reconnect_state {
+	struct service_reconnect_state *next;
+	char *udid;
+	/* serializes reconnect attempts to the device */
+	mutex_t mutex;
+	uint32_t failures;
+	uint64_t next_attempt;
+	uint32_t seed;
+};
+
+static struct service_reconnect_state *reconnect_states = NULL;
+static mutex_t reconnect_states_mutex;
+static thread_once_t reconnect_states_once = THREAD_ONCE_INIT;
 
 /**
  * Convert an idevice_error_t value to an service_error_t value.
@@ -50,12 +80,157 @@ static service_error_t idevice_to_service_error(idevice_error_t err)
 			return SERVICE_E_NOT_ENOUGH_DATA;
 		case IDEVICE_E_TIMEOUT:
 			return SERVICE_E_TIMEOUT;
+		case IDEVICE_E_WOULD_BLOCK:
+			return SERVICE_E_WOULD_BLOCK;
 		default:
 			break;
 	}
 	return SERVICE_E_UNKNOWN_ERROR;
 }
 
+/* Default priority classes of services, see idevice_connection_set_qos() */
+static const struct {
+	const char *name;
+	idevice_connection_priority_t priority;
+} service_priorities[] = {
+	{ "com.apple.debugserver", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.debugserver.DVTSecureSocketProxy", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.syslog_relay", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.os_trace_relay", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.mobile.installation_proxy", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.mobile.heartbeat", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.mobile.notification_proxy", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.dt.simulatelocation", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.webinspector", IDEVICE_PRIORITY_INTERACTIVE },
+	{ "com.apple.afc", IDEVICE_PRIORITY_BULK },
+	{ "com.apple.afc2", IDEVICE_PRIORITY_BULK },
+	{ "com.apple.mobile.house_arrest", IDEVICE_PRIORITY_BULK },
+	{ "com.apple.crashreportcopymobile", IDEVICE_PRIORITY_BULK },
+	{ "com.apple.mobile.file_relay", IDEVICE_PRIORITY_BULK },
+	{ "com.apple.mobilebackup", IDEVICE_PRIORITY_BULK },
+	{ "com.apple.mobilebackup2", IDEVICE_PRIORITY_BULK },
+	{ NULL, IDEVICE_PRIORITY_NORMAL }
+};
+
+static idevice_connection_priority_t service_default_priority(const char *identifier)
+{
+	int i;
+	if (identifier) {
+		for (i = 0; service_priorities[i].name; i++) {
+			if (!strcmp(identifier, service_priorities[i].name)) {
+				return service_priorities[i].priority;
+			}
+		}
+	}
+	return IDEVICE_PRIORITY_NORMAL;
+}
+
+/* Services whose device side continues in plaintext after the handshake */
+static const struct {
+	const char *name;
+	service_plaintext_policy_t policy;
+} service_plaintext_defaults[] = {
+	{ "com.apple.debugserver", SERVICE_PLAINTEXT_REQUIRED },
+	{ NULL, SERVICE_PLAINTEXT_NEVER }
+};
+
+/* Policies set with service_set_plaintext_policy() */
+struct service_plaintext_override {
+	struct service_plaintext_override *next;
+	char *name;
+	service_plaintext_policy_t policy;
+};
+
+static struct service_plaintext_override *plaintext_overrides = NULL;
+static mutex_t plaintext_overrides_mutex;
+static thread_once_t plaintext_overrides_once = THREAD_ONCE_INIT;
+
+static void plaintext_overrides_init(void)
+{
+	mutex_init(&plaintext_overrides_mutex);
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_set_plaintext_policy(const char *service_name, service_plaintext_policy_t policy)
+{
+	struct service_plaintext_override *entry;
+
+	if (!service_name || policy < SERVICE_PLAINTEXT_NEVER || policy > SERVICE_PLAINTEXT_REQUIRED) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	thread_once(&plaintext_overrides_once, plaintext_overrides_init);
+	mutex_lock(&plaintext_overrides_mutex);
+	for (entry = plaintext_overrides; entry; entry = entry->next) {
+		if (!strcmp(entry->name, service_name)) {
+			break;
+		}
+	}
+	if (!entry) {
+		entry = (struct service_plaintext_override*)malloc(sizeof(struct service_plaintext_override));
+		entry->name = strdup(service_name);
+		entry->next = plaintext_overrides;
+		plaintext_overrides = entry;
+	}
+	entry->policy = policy;
+	mutex_unlock(&plaintext_overrides_mutex);
+
+	return SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API service_plaintext_policy_t service_get_plaintext_policy(const char *service_name)
+{
+	struct service_plaintext_override *entry;
+	service_plaintext_policy_t policy = SERVICE_PLAINTEXT_NEVER;
+	int i;
+
+	if (!service_name) {
+		return SERVICE_PLAINTEXT_NEVER;
+	}
+	for (i = 0; service_plaintext_defaults[i].name; i++) {
+		if (!strcmp(service_name, service_plaintext_defaults[i].name)) {
+			policy = service_plaintext_defaults[i].policy;
+			break;
+		}
+	}
+
+	thread_once(&plaintext_overrides_once, plaintext_overrides_init);
+	mutex_lock(&plaintext_overrides_mutex);
+	for (entry = plaintext_overrides; entry; entry = entry->next) {
+		if (!strcmp(entry->name, service_name)) {
+			policy = entry->policy;
+			break;
+		}
+	}
+	mutex_unlock(&plaintext_overrides_mutex);
+
+	return policy;
+}
+
+/**
+ * Drops SSL on a connection the handshake was just completed on if the
+ * plaintext policy of the service asks for it.
+ *
+ * @return 1 if the connection continues in plaintext, 0 otherwise
+ */
+int service_apply_plaintext_policy(idevice_connection_t connection, const char *service_name)
+{
+	if (!connection || !connection->ssl_data || !service_name) {
+		return 0;
+	}
+	switch (service_get_plaintext_policy(service_name)) {
+	case SERVICE_PLAINTEXT_REQUIRED:
+		return (idevice_connection_continue_plaintext(connection, service_name, 0) == IDEVICE_E_SUCCESS);
+	case SERVICE_PLAINTEXT_USB:
+		if (connection->type != CONNECTION_USBMUXD || idevice_plaintext_rejected(connection->device, service_name)) {
+			return 0;
+		}
+		return (idevice_connection_continue_plaintext(connection, service_name, 1) == IDEVICE_E_SUCCESS);
+	default:
+		break;
+	}
+	return 0;
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_client_new(idevice_t device, lockdownd_service_descriptor_t service, service_client_t *client)
 {
 	if (!device || !service || service->port == 0 || !client || *client)
@@ -70,20 +245,64 @@ LIBIMOBILEDEVICE_API service_error_t service_client_new(idevice_t device, lockdo
 	/* create client object */
 	service_client_t client_loc = (service_client_t)malloc(sizeof(struct service_client_private));
 	client_loc->connection = connection;
+	idevice_connection_set_qos(connection, service_default_priority(service->identifier), 0);
 
 	/* enable SSL if requested */
-	if (service->ssl_enabled == 1)
-		service_enable_ssl(client_loc);
+	if (service->ssl_enabled == 1) {
+		if (service_enable_ssl(client_loc) == SERVICE_E_SUCCESS) {
+			service_apply_plaintext_policy(connection, service->identifier);
+		}
+	}
 
 	/* all done, return success */
 	*client = client_loc;
 	return SERVICE_E_SUCCESS;
 }
 
+/**
+ * Starts the service through the broker of the device, which terminates
+ * SSL if needed, and runs the constructor on the channel it hands over.
+ *
+ * @return 0 if the broker started the service, -1 if the caller should
+ *     connect directly
+ */
+static int service_client_factory_start_brokered(idevice_t device, const char* service_name, void **client, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), int32_t *ec)
+{
+	struct lockdownd_service_descriptor service;
+	int fd = -1;
+
+	if (broker_start_service(device, service_name, &service.port, &fd) < 0) {
+		return -1;
+	}
+	service.ssl_enabled = 0;
+	service.identifier = (char*)service_name;
+
+	idevice_set_pending_fd(device, service.port, fd);
+	if (constructor_func) {
+		*ec = (int32_t)constructor_func(device, &service, client);
+	} else {
+		*ec = service_client_new(device, &service, (service_client_t*)client);
+	}
+	idevice_clear_pending_fd(device, service.port);
+
+	return 0;
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service(idevice_t device, const char* service_name, void **client, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), int32_t *error_code)
 {
 	*client = NULL;
 
+	int32_t ec;
+	if (device && device->broker && service_client_factory_start_brokered(device, service_name, client, constructor_func, &ec) == 0) {
+		if (error_code) {
+			*error_code = ec;
+		}
+		if (ec != SERVICE_E_SUCCESS) {
+			debug_info("Could not connect to service %s through the broker, error: %i", service_name, ec);
+		}
+		return (ec == SERVICE_E_SUCCESS) ? SERVICE_E_SUCCESS : SERVICE_E_START_SERVICE_ERROR;
+	}
+
 	lockdownd_client_t lckd = NULL;
 	if (LOCKDOWN_E_SUCCESS != lockdownd_client_new_with_handshake(device, &lckd, label)) {
 		debug_info("Could not create a lockdown client.");
@@ -99,7 +318,6 @@ LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service(idevic
 		return SERVICE_E_START_SERVICE_ERROR;
 	}
 
-	int32_t ec;
 	if (constructor_func) {
 		ec = (int32_t)constructor_func(device, service, client);
 	} else {
@@ -119,6 +337,103 @@ LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service(idevic
 	return (ec == SERVICE_E_SUCCESS) ? SERVICE_E_SUCCESS : SERVICE_E_START_SERVICE_ERROR;
 }
 
+struct service_start_job {
+	idevice_t device;
+	lockdownd_service_descriptor_t service;
+	service_client_constructor_t constructor_func;
+	void *client;
+	int32_t error_code;
+	THREAD_T thread;
+};
+
+static void* service_start_job_run(void *data)
+{
+	struct service_start_job *job = (struct service_start_job*)data;
+
+	if (job->constructor_func) {
+		job->error_code = job->constructor_func(job->device, job->service, &job->client);
+	} else {
+		job->error_code = service_client_new(job->device, job->service, (service_client_t*)&job->client);
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_services(idevice_t device, const char **service_names, unsigned int count, void **clients, const char* label, const service_client_constructor_t *constructor_funcs, int32_t *error_codes)
+{
+	service_error_t res = SERVICE_E_SUCCESS;
+	lockdownd_service_descriptor_t *services = NULL;
+	struct service_start_job *jobs = NULL;
+	unsigned int i;
+
+	if (!device || !service_names || count == 0 || !clients)
+		return SERVICE_E_INVALID_ARG;
+
+	for (i = 0; i < count; i++) {
+		clients[i] = NULL;
+		if (error_codes)
+			error_codes[i] = SERVICE_E_START_SERVICE_ERROR;
+	}
+
+	services = (lockdownd_service_descriptor_t*)calloc(count, sizeof(lockdownd_service_descriptor_t));
+	jobs = (struct service_start_job*)calloc(count, sizeof(struct service_start_job));
+	if (!services || !jobs) {
+		free(services);
+		free(jobs);
+		return SERVICE_E_UNKNOWN_ERROR;
+	}
+
+	lockdownd_client_t lckd = NULL;
+	if (LOCKDOWN_E_SUCCESS != lockdownd_client_new_with_handshake(device, &lckd, label)) {
+		debug_info("Could not create a lockdown client.");
+		free(services);
+		free(jobs);
+		return SERVICE_E_START_SERVICE_ERROR;
+	}
+
+	lockdownd_start_services(lckd, service_names, count, services);
+	lockdownd_client_free(lckd);
+
+	/* connect and run the constructors (including SSL handshakes) in parallel */
+	for (i = 0; i < count; i++) {
+		jobs[i].device = device;
+		jobs[i].service = services[i];
+		jobs[i].constructor_func = (constructor_funcs) ? constructor_funcs[i] : NULL;
+		jobs[i].error_code = SERVICE_E_START_SERVICE_ERROR;
+		if (!services[i] || services[i]->port == 0) {
+			debug_info("Could not start service %s!", service_names[i]);
+			continue;
+		}
+		if (thread_new(&jobs[i].thread, service_start_job_run, &jobs[i]) != 0) {
+			jobs[i].thread = THREAD_T_NULL;
+			service_start_job_run(&jobs[i]);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (jobs[i].thread != THREAD_T_NULL) {
+			thread_join(jobs[i].thread);
+			thread_free(jobs[i].thread);
+		}
+		if (jobs[i].error_code == SERVICE_E_SUCCESS) {
+			clients[i] = jobs[i].client;
+		} else {
+			if (services[i] && services[i]->port) {
+				debug_info("Could not connect to service %s! Port: %i, error: %i", service_names[i], services[i]->port, jobs[i].error_code);
+			}
+			res = SERVICE_E_START_SERVICE_ERROR;
+		}
+		if (error_codes)
+			error_codes[i] = jobs[i].error_code;
+		lockdownd_service_descriptor_free(services[i]);
+	}
+
+	free(services);
+	free(jobs);
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_client_free(service_client_t client)
 {
 	if (!client)
@@ -132,6 +447,179 @@ LIBIMOBILEDEVICE_API service_error_t service_client_free(service_client_t client
 	return err;
 }
 
+static void reconnect_states_init(void)
+{
+	mutex_init(&reconnect_states_mutex);
+}
+
+static struct service_reconnect_state *service_reconnect_state_get(const char *udid)
+{
+	struct service_reconnect_state *state;
+
+	thread_once(&reconnect_states_once, reconnect_states_init);
+	mutex_lock(&reconnect_states_mutex);
+	for (state = reconnect_states; state; state = state->next) {
+		if (!strcmp(state->udid, udid)) {
+			break;
+		}
+	}
+	if (!state) {
+		state = (struct service_reconnect_state*)calloc(1, sizeof(struct service_reconnect_state));
+		if (state) {
+			state->udid = strdup(udid);
+			if (state->udid) {
+				const char *p;
+				mutex_init(&state->mutex);
+				/* decorrelates the jitter of different devices */
+				state->seed = 2166136261u;
+				for (p = udid; *p; p++) {
+					state->seed = (state->seed ^ (uint8_t)*p) * 16777619u;
+				}
+				state->next = reconnect_states;
+				reconnect_states = state;
+			} else {
+				free(state);
+				state = NULL;
+			}
+		}
+	}
+	mutex_unlock(&reconnect_states_mutex);
+
+	return state;
+}
+
+static uint64_t service_time_ms(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+static void service_sleep_ms(unsigned int ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/**
+ * Computes the delay before the next attempt after the given number of
+ * consecutive failures: exponential growth capped at max_delay, with the
+ * actual value picked from the upper half at random. Must be called with
+ * state->mutex held.
+ */
+static uint32_t service_reconnect_delay(struct service_reconnect_state *state, const service_reconnect_policy_t *policy)
+{
+	uint32_t initial = (policy->initial_delay) ? policy->initial_delay : SERVICE_RECONNECT_INITIAL_DELAY;
+	uint32_t max = (policy->max_delay) ? policy->max_delay : SERVICE_RECONNECT_MAX_DELAY;
+	uint64_t delay = initial;
+	uint32_t i;
+
+	for (i = 1; i < state->failures && delay < max; i++) {
+		delay <<= 1;
+	}
+	if (delay > max) {
+		delay = max;
+	}
+
+	/* xorshift32 */
+	state->seed ^= state->seed << 13;
+	state->seed ^= state->seed >> 17;
+	state->seed ^= state->seed << 5;
+
+	return (uint32_t)(delay / 2 + state->seed % (delay / 2 + 1));
+}
+
+/**
+ * Starts the service again on the device the client is connected to and
+ * connects to it. Attempts are coordinated with other clients of the same
+ * device: only one attempt is made at a time and all clients wait out the
+ * same backoff delay after a failure.
+ *
+ * @param client The client whose connection was lost.
+ * @param service_name The name of the service to start.
+ * @param policy The backoff policy to apply.
+ * @param cancelled Polled while waiting, a non-zero return value aborts
+ *     the reconnect.
+ * @param user_data Passed to cancelled.
+ * @param replacement Set to a new service client upon success, see
+ *     service_client_replace_connection().
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_START_SERVICE_ERROR if
+ *     the attempts were exhausted or the reconnect was cancelled.
+ */
+service_error_t service_client_reconnect(service_client_t client, const char *service_name, const service_reconnect_policy_t *policy, service_reconnect_cancel_cb_t cancelled, void *user_data, service_client_t *replacement)
+{
+	uint32_t attempts = 0;
+
+	if (!client || !client->connection || !client->connection->device || !service_name || !policy || !replacement)
+		return SERVICE_E_INVALID_ARG;
+
+	idevice_t device = client->connection->device;
+	struct service_reconnect_state *state = service_reconnect_state_get(device->udid);
+	if (!state)
+		return SERVICE_E_UNKNOWN_ERROR;
+
+	*replacement = NULL;
+	while (!(cancelled && cancelled(user_data))) {
+		mutex_lock(&state->mutex);
+		uint64_t now = service_time_ms();
+		if (now < state->next_attempt) {
+			uint64_t wait = state->next_attempt - now;
+			mutex_unlock(&state->mutex);
+			service_sleep_ms((wait < SERVICE_RECONNECT_POLL_INTERVAL) ? (unsigned int)wait : SERVICE_RECONNECT_POLL_INTERVAL);
+			continue;
+		}
+
+		debug_info("Reconnecting to %s on device %s", service_name, device->udid);
+		idevice_refresh_handle(device);
+		if (service_client_factory_start_service(device, service_name, (void**)replacement, NULL, NULL, NULL) == SERVICE_E_SUCCESS) {
+			state->failures = 0;
+			state->next_attempt = 0;
+			mutex_unlock(&state->mutex);
+			return SERVICE_E_SUCCESS;
+		}
+		*replacement = NULL;
+		state->failures++;
+		uint32_t delay = service_reconnect_delay(state, policy);
+		state->next_attempt = service_time_ms() + delay;
+		mutex_unlock(&state->mutex);
+		debug_info("Reconnecting to %s failed, retrying in %u ms", service_name, delay);
+
+		attempts++;
+		if (policy->max_attempts > 0 && attempts >= policy->max_attempts) {
+			break;
+		}
+	}
+
+	return SERVICE_E_START_SERVICE_ERROR;
+}
+
+/**
+ * Moves the connection of replacement into client, so handles referring
+ * to client stay valid. The previous connection of client is closed and
+ * replacement is freed. The caller must make sure no other thread uses
+ * the connection of client at the same time.
+ */
+void service_client_replace_connection(service_client_t client, service_client_t replacement)
+{
+	idevice_connection_t old = client->connection;
+	client->connection = replacement->connection;
+	replacement->connection = old;
+	service_client_free(replacement);
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_send(service_client_t client, const char* data, uint32_t size, uint32_t *sent)
 {
 	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
@@ -153,6 +641,41 @@ LIBIMOBILEDEVICE_API service_error_t service_send(service_client_t client, const
 	return res;
 }
 
+/**
+ * Sends multiple buffers to the device using the connection of the given
+ * service client in as few writes as possible.
+ *
+ * @param client The service client to use for sending.
+ * @param iov Array of buffers to send in order.
+ * @param iovcnt Number of buffers in iov.
+ * @param sent Number of bytes sent.
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *      SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, or SERVICE_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs.
+ */
+service_error_t service_sendv(service_client_t client, const struct socket_iovec *iov, int iovcnt, uint32_t *sent)
+{
+	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
+	uint32_t bytes = 0;
+
+	if (!client || (client && !client->connection) || !iov || (iovcnt <= 0)) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	debug_info("sending %d buffers", iovcnt);
+	res = idevice_to_service_error(idevice_connection_sendv(client->connection, iov, iovcnt, &bytes));
+	if (res != SERVICE_E_SUCCESS) {
+		debug_info("ERROR: sending to device failed.");
+	}
+	if (sent) {
+		*sent = bytes;
+	}
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_receive_with_timeout(service_client_t client, char* data, uint32_t size, uint32_t *received, unsigned int timeout)
 {
 	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
@@ -179,6 +702,33 @@ LIBIMOBILEDEVICE_API service_error_t service_receive(service_client_t client, ch
 	return service_receive_with_timeout(client, data, size, received, 30000);
 }
 
+LIBIMOBILEDEVICE_API service_error_t service_try_receive(service_client_t client, char* data, uint32_t size, uint32_t *received)
+{
+	uint32_t bytes = 0;
+
+	if (!client || (client && !client->connection) || !data || (size == 0)) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	service_error_t res = idevice_to_service_error(idevice_connection_try_receive(client->connection, data, size, &bytes));
+	if (res != SERVICE_E_SUCCESS && res != SERVICE_E_WOULD_BLOCK) {
+		debug_info("could not read data");
+	}
+	if (received) {
+		*received = bytes;
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_get_connection(service_client_t client, idevice_connection_t *connection)
+{
+	if (!client || !client->connection || !connection)
+		return SERVICE_E_INVALID_ARG;
+	*connection = client->connection;
+	return SERVICE_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_enable_ssl(service_client_t client)
 {
 	if (!client || !client->connection)
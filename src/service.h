@@ -29,4 +29,13 @@ struct service_client_private {
 	idevice_connection_t connection;
 };
 
+service_error_t service_sendv(service_client_t client, const struct socket_iovec *iov, int iovcnt, uint32_t *sent);
+int service_apply_plaintext_policy(idevice_connection_t connection, const char *service_name);
+
+/* Returns non-zero when a pending reconnect should be abandoned */
+typedef int (*service_reconnect_cancel_cb_t)(void *user_data);
+
+service_error_t service_client_reconnect(service_client_t client, const char *service_name, const service_reconnect_policy_t *policy, service_reconnect_cancel_cb_t cancelled, void *user_data, service_client_t *replacement);
+void service_client_replace_connection(service_client_t client, service_client_t replacement);
+
 #endif
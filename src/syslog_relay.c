@@ -30,11 +30,37 @@
 #include "lockdown.h"
 #include "common/debug.h"
 
+#define SYSLOG_RELAY_BUFFER_SIZE 16384
+#define SYSLOG_RELAY_DISPATCH_BUFFER_MAX (1 << 30)
+
 struct syslog_relay_worker_thread {
 	syslog_relay_client_t client;
+	syslog_relay_capture_mode_t mode;
+	syslog_relay_receive_buffer_cb_t cbfunc;
+	void *user_data;
+	char *buf;
+	uint32_t len;
+	/* single producer single consumer ring between receive and dispatch thread */
+	char *ring;
+	uint32_t ring_mask;
+	volatile uint32_t ring_head;
+	volatile uint32_t ring_tail;
+	volatile int receive_done;
+	int reconnect_enabled;
+	service_reconnect_policy_t reconnect;
+	THREAD_T dispatcher;
+	mutex_t wait_mutex;
+	cond_t wait_cond;
+};
+
+struct syslog_relay_char_cb_data {
 	syslog_relay_receive_cb_t cbfunc;
 	void *user_data;
-	int is_raw;
+};
+
+struct syslog_relay_line_cb_data {
+	syslog_relay_line_cb_t cbfunc;
+	void *user_data;
 };
 
 /**
@@ -88,6 +114,12 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_new(idevice_t devi
 	syslog_relay_client_t client_loc = (syslog_relay_client_t) malloc(sizeof(struct syslog_relay_client_private));
 	client_loc->parent = parent;
 	client_loc->worker = THREAD_T_NULL;
+	client_loc->cb_data = NULL;
+	client_loc->dispatch_capacity = 0;
+	client_loc->dropped_bytes = 0;
+	client_loc->dropped_chunks = 0;
+	client_loc->reconnect_enabled = 0;
+	memset(&client_loc->reconnect, '\0', sizeof(service_reconnect_policy_t));
 
 	*client = client_loc;
 
@@ -108,6 +140,7 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_free(syslog_relay_
 		return SYSLOG_RELAY_E_INVALID_ARG;
 	syslog_relay_stop_capture(client);
 	syslog_relay_error_t err = syslog_relay_error(service_client_free(client->parent));
+	free(client->cb_data);
 	free(client);
 
 	return err;
@@ -138,49 +171,245 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_receive_with_timeout(sysl
 	return res;
 }
 
+/**
+ * Processes bytes that have been appended to the worker buffer at
+ * srwt->buf + srwt->len according to the capture mode and passes them to
+ * the callback.
+ */
+static void syslog_relay_process(struct syslog_relay_worker_thread *srwt, uint32_t bytes)
+{
+	char *buf = srwt->buf;
+
+	if (srwt->mode == SYSLOG_RELAY_CAPTURE_RAW) {
+		srwt->cbfunc(buf, bytes, srwt->user_data);
+	} else if (srwt->mode == SYSLOG_RELAY_CAPTURE_BLOCK) {
+		/* strip NUL bytes in place */
+		char *p = buf;
+		char *end = buf + bytes;
+		char *out = buf;
+		while (p < end) {
+			char *nul = memchr(p, '\0', end - p);
+			size_t n = (nul) ? (size_t)(nul - p) : (size_t)(end - p);
+			if (out != p) {
+				memmove(out, p, n);
+			}
+			out += n;
+			p += n + 1;
+		}
+		if (out > buf) {
+			srwt->cbfunc(buf, out - buf, srwt->user_data);
+		}
+	} else {
+		char *p = buf;
+		char *end = buf + srwt->len + bytes;
+		char *nul;
+		while (p < end && (nul = memchr(p, '\0', end - p)) != NULL) {
+			if (nul > p) {
+				srwt->cbfunc(p, nul - p, srwt->user_data);
+			}
+			p = nul + 1;
+		}
+		srwt->len = end - p;
+		if (srwt->len == SYSLOG_RELAY_BUFFER_SIZE) {
+			/* message does not fit into the buffer, pass it in parts */
+			buf[srwt->len] = '\0';
+			srwt->cbfunc(buf, srwt->len, srwt->user_data);
+			srwt->len = 0;
+		} else if (srwt->len > 0 && p > buf) {
+			memmove(buf, p, srwt->len);
+		}
+	}
+}
+
+/**
+ * Appends received data to the dispatch ring. Called by the receive thread
+ * only. Drops the data if there is not enough room.
+ */
+static void syslog_relay_ring_push(struct syslog_relay_worker_thread *srwt, const char *data, uint32_t length)
+{
+	uint32_t capacity = srwt->ring_mask + 1;
+	uint32_t head = srwt->ring_head;
+	uint32_t tail = srwt->ring_tail;
+	__sync_synchronize();
+
+	if (capacity - (head - tail) < length) {
+		__sync_fetch_and_add(&srwt->client->dropped_bytes, (uint64_t)length);
+		__sync_fetch_and_add(&srwt->client->dropped_chunks, (uint64_t)1);
+		return;
+	}
+
+	uint32_t pos = head & srwt->ring_mask;
+	uint32_t first = capacity - pos;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(srwt->ring + pos, data, first);
+	memcpy(srwt->ring, data + first, length - first);
+
+	/* make the data visible before publishing the new head */
+	__sync_synchronize();
+	srwt->ring_head = head + length;
+	cond_signal(&srwt->wait_cond);
+}
+
+/**
+ * Takes up to length bytes from the dispatch ring. Called by the dispatch
+ * thread only.
+ */
+static uint32_t syslog_relay_ring_pop(struct syslog_relay_worker_thread *srwt, char *data, uint32_t length)
+{
+	uint32_t capacity = srwt->ring_mask + 1;
+	uint32_t tail = srwt->ring_tail;
+	uint32_t head = srwt->ring_head;
+	__sync_synchronize();
+
+	uint32_t avail = head - tail;
+	if (avail < length) {
+		length = avail;
+	}
+	if (length == 0) {
+		return 0;
+	}
+
+	uint32_t pos = tail & srwt->ring_mask;
+	uint32_t first = capacity - pos;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(data, srwt->ring + pos, first);
+	memcpy(data + first, srwt->ring, length - first);
+
+	/* finish reading before releasing the space */
+	__sync_synchronize();
+	srwt->ring_tail = tail + length;
+
+	return length;
+}
+
+static void *syslog_relay_dispatcher(void *arg)
+{
+	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)arg;
+
+	while (1) {
+		int done = srwt->receive_done;
+		__sync_synchronize();
+		uint32_t bytes = syslog_relay_ring_pop(srwt, srwt->buf + srwt->len, SYSLOG_RELAY_BUFFER_SIZE - srwt->len);
+		if (bytes > 0) {
+			syslog_relay_process(srwt, bytes);
+		} else if (done) {
+			break;
+		} else {
+			mutex_lock(&srwt->wait_mutex);
+			cond_wait_timeout(&srwt->wait_cond, &srwt->wait_mutex, 10);
+			mutex_unlock(&srwt->wait_mutex);
+		}
+	}
+
+	return NULL;
+}
+
+static int syslog_relay_capture_stopped(void *arg)
+{
+	syslog_relay_client_t client = (syslog_relay_client_t)arg;
+	return (client->parent == NULL);
+}
+
+/**
+ * Re-establishes the connection of a capture according to its reconnect
+ * policy. Returns 1 if the capture can continue.
+ */
+static int syslog_relay_reconnect(struct syslog_relay_worker_thread *srwt)
+{
+	service_client_t parent = srwt->client->parent;
+	service_client_t replacement = NULL;
+
+	if (!srwt->reconnect_enabled || !parent) {
+		return 0;
+	}
+	if (service_client_reconnect(parent, SYSLOG_RELAY_SERVICE_NAME, &srwt->reconnect, syslog_relay_capture_stopped, srwt->client, &replacement) != SERVICE_E_SUCCESS) {
+		return 0;
+	}
+	/* syslog_relay_stop_capture() only hands the client back after joining us */
+	service_client_replace_connection(parent, replacement);
+	debug_info("Connection to syslog relay re-established");
+	return 1;
+}
+
 void *syslog_relay_worker(void *arg)
 {
 	syslog_relay_error_t ret = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)arg;
+	char *recv_buf = NULL;
 
 	if (!srwt)
 		return NULL;
 
 	debug_info("Running");
 
+	if (srwt->ring) {
+		recv_buf = (char*)malloc(SYSLOG_RELAY_BUFFER_SIZE);
+		if (!recv_buf || thread_new(&srwt->dispatcher, syslog_relay_dispatcher, srwt) != 0) {
+			debug_info("Failed to start dispatch thread, invoking callback directly");
+			srwt->dispatcher = THREAD_T_NULL;
+			free(recv_buf);
+			recv_buf = NULL;
+		}
+	}
+
 	while (srwt->client->parent) {
-		char c;
 		uint32_t bytes = 0;
-		ret = syslog_relay_receive_with_timeout(srwt->client, &c, 1, &bytes, 100);
+		if (recv_buf) {
+			ret = syslog_relay_receive_with_timeout(srwt->client, recv_buf, SYSLOG_RELAY_BUFFER_SIZE, &bytes, 100);
+		} else {
+			ret = syslog_relay_receive_with_timeout(srwt->client, srwt->buf + srwt->len, SYSLOG_RELAY_BUFFER_SIZE - srwt->len, &bytes, 100);
+		}
 		if (ret == SYSLOG_RELAY_E_TIMEOUT || ret == SYSLOG_RELAY_E_NOT_ENOUGH_DATA || ((bytes == 0) && (ret == SYSLOG_RELAY_E_SUCCESS))) {
 			continue;
 		} else if (ret < 0) {
 			debug_info("Connection to syslog relay interrupted");
+			if (syslog_relay_reconnect(srwt)) {
+				continue;
+			}
 			break;
 		}
-		if (srwt->is_raw) {
-			srwt->cbfunc(c, srwt->user_data);
+
+		if (recv_buf) {
+			syslog_relay_ring_push(srwt, recv_buf, bytes);
 		} else {
-			if (c != 0) {
-				srwt->cbfunc(c, srwt->user_data);
-			}
+			syslog_relay_process(srwt, bytes);
 		}
 	}
 
-	if (srwt) {
-		free(srwt);
+	if (srwt->dispatcher) {
+		/* let the dispatch thread drain the ring */
+		__sync_synchronize();
+		srwt->receive_done = 1;
+		cond_signal(&srwt->wait_cond);
+		thread_join(srwt->dispatcher);
+		thread_free(srwt->dispatcher);
+	}
+
+	if (srwt->len > 0) {
+		srwt->buf[srwt->len] = '\0';
+		srwt->cbfunc(srwt->buf, srwt->len, srwt->user_data);
 	}
 
+	if (srwt->ring) {
+		mutex_destroy(&srwt->wait_mutex);
+		cond_destroy(&srwt->wait_cond);
+	}
+	free(recv_buf);
+	free(srwt->ring);
+	free(srwt->buf);
+	free(srwt);
+
 	debug_info("Exiting");
 
 	return NULL;
 }
 
-LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+static syslog_relay_error_t syslog_relay_start_worker(syslog_relay_client_t client, syslog_relay_capture_mode_t mode, syslog_relay_receive_buffer_cb_t callback, void* user_data)
 {
-	if (!client || !callback)
-		return SYSLOG_RELAY_E_INVALID_ARG;
-
 	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 
 	if (client->worker) {
@@ -189,47 +418,274 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_rela
 	}
 
 	/* start worker thread */
-	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)malloc(sizeof(struct syslog_relay_worker_thread));
-	if (srwt) {
-		srwt->client = client;
-		srwt->cbfunc = callback;
-		srwt->user_data = user_data;
-		srwt->is_raw = 0;
-
-		if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
-			res = SYSLOG_RELAY_E_SUCCESS;
+	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)calloc(1, sizeof(struct syslog_relay_worker_thread));
+	if (!srwt) {
+		return res;
+	}
+	srwt->client = client;
+	srwt->mode = mode;
+	srwt->cbfunc = callback;
+	srwt->user_data = user_data;
+	srwt->reconnect_enabled = client->reconnect_enabled;
+	srwt->reconnect = client->reconnect;
+	srwt->dispatcher = THREAD_T_NULL;
+
+	/* one extra byte to NUL-terminate partial messages */
+	srwt->buf = (char*)malloc(SYSLOG_RELAY_BUFFER_SIZE + 1);
+	if (!srwt->buf) {
+		free(srwt);
+		return res;
+	}
+
+	if (client->dispatch_capacity > 0) {
+		uint32_t capacity = SYSLOG_RELAY_BUFFER_SIZE;
+		while (capacity < client->dispatch_capacity) {
+			capacity <<= 1;
+		}
+		srwt->ring = (char*)malloc(capacity);
+		if (!srwt->ring) {
+			free(srwt->buf);
+			free(srwt);
+			return res;
 		}
+		srwt->ring_mask = capacity - 1;
+		mutex_init(&srwt->wait_mutex);
+		cond_init(&srwt->wait_cond);
+	}
+
+	if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
+		res = SYSLOG_RELAY_E_SUCCESS;
+	} else {
+		if (srwt->ring) {
+			mutex_destroy(&srwt->wait_mutex);
+			cond_destroy(&srwt->wait_cond);
+		}
+		free(srwt->ring);
+		free(srwt->buf);
+		free(srwt);
 	}
 
 	return res;
 }
 
-LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+/**
+ * Passes each character of a block to a per-character callback.
+ */
+static void syslog_relay_char_callback(const char *data, uint32_t length, void *user_data)
+{
+	struct syslog_relay_char_cb_data *cbdata = (struct syslog_relay_char_cb_data*)user_data;
+	uint32_t i;
+
+	for (i = 0; i < length; i++) {
+		cbdata->cbfunc(data[i], cbdata->user_data);
+	}
+}
+
+static syslog_relay_error_t syslog_relay_start_char_capture(syslog_relay_client_t client, syslog_relay_capture_mode_t mode, syslog_relay_receive_cb_t callback, void* user_data)
 {
 	if (!client || !callback)
 		return SYSLOG_RELAY_E_INVALID_ARG;
 
-	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
-
 	if (client->worker) {
 		debug_info("Another syslog capture thread appears to be running already.");
-		return res;
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
 	}
 
-	/* start worker thread */
-	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)malloc(sizeof(struct syslog_relay_worker_thread));
-	if (srwt) {
-		srwt->client = client;
-		srwt->cbfunc = callback;
-		srwt->user_data = user_data;
-		srwt->is_raw = 1;
-
-		if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
-			res = SYSLOG_RELAY_E_SUCCESS;
+	struct syslog_relay_char_cb_data *cbdata = (struct syslog_relay_char_cb_data*)malloc(sizeof(struct syslog_relay_char_cb_data));
+	if (!cbdata) {
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+	cbdata->cbfunc = callback;
+	cbdata->user_data = user_data;
+	free(client->cb_data);
+	client->cb_data = cbdata;
+
+	return syslog_relay_start_worker(client, mode, syslog_relay_char_callback, cbdata);
+}
+
+/**
+ * Splits a syslog line of the form
+ * "Mmm dd hh:mm:ss host process(sender)[pid] <Level>: message"
+ * into its fields.
+ */
+static void syslog_relay_parse_line(const char *data, uint32_t length, syslog_relay_line_t *entry)
+{
+	const char *end = data + length;
+	const char *p;
+	const char *bracket;
+	const char *close;
+	const char *paren;
+
+	memset(entry, '\0', sizeof(syslog_relay_line_t));
+	entry->line = data;
+	entry->line_length = length;
+	entry->pid = -1;
+	entry->message = data;
+	entry->message_length = length;
+
+	if (length < 16 || data[3] != ' ' || data[6] != ' ' || data[15] != ' ') {
+		return;
+	}
+	entry->timestamp = data;
+	entry->timestamp_length = 15;
+
+	/* device name */
+	p = data + 16;
+	close = memchr(p, ' ', end - p);
+	if (!close) {
+		return;
+	}
+	entry->host = p;
+	entry->host_length = close - p;
+	p = close + 1;
+
+	/* process name, sender and pid */
+	bracket = memchr(p, '[', end - p);
+	if (!bracket) {
+		return;
+	}
+	close = memchr(bracket, ']', end - bracket);
+	if (!close || close + 1 >= end || close[1] != ' ') {
+		return;
+	}
+	entry->process = p;
+	entry->process_length = bracket - p;
+	paren = memchr(p, '(', bracket - p);
+	if (paren) {
+		const char *paren_end = memchr(paren, ')', bracket - paren);
+		entry->process_length = paren - p;
+		if (paren_end) {
+			entry->sender = paren + 1;
+			entry->sender_length = paren_end - paren - 1;
+		}
+	}
+	if (close > bracket + 1) {
+		int pid = 0;
+		const char *q = bracket + 1;
+		while (q < close && *q >= '0' && *q <= '9') {
+			pid = pid * 10 + (*q - '0');
+			q++;
+		}
+		if (q == close) {
+			entry->pid = pid;
 		}
 	}
+	p = close + 2;
+
+	/* log level */
+	if (end - p >= 9 && !strncmp(p, "<Notice>:", 9)) {
+		entry->level = SYSLOG_RELAY_LEVEL_NOTICE;
+		entry->level_tag_length = 9;
+	} else if (end - p >= 8 && !strncmp(p, "<Error>:", 8)) {
+		entry->level = SYSLOG_RELAY_LEVEL_ERROR;
+		entry->level_tag_length = 8;
+	} else if (end - p >= 10 && !strncmp(p, "<Warning>:", 10)) {
+		entry->level = SYSLOG_RELAY_LEVEL_WARNING;
+		entry->level_tag_length = 10;
+	} else if (end - p >= 8 && !strncmp(p, "<Debug>:", 8)) {
+		entry->level = SYSLOG_RELAY_LEVEL_DEBUG;
+		entry->level_tag_length = 8;
+	}
+	if (entry->level != SYSLOG_RELAY_LEVEL_NONE) {
+		entry->level_tag = p;
+		p += entry->level_tag_length;
+	}
 
-	return res;
+	entry->message = p;
+	entry->message_length = end - p;
+}
+
+/**
+ * Parses each message of a block and passes it to a line callback.
+ */
+static void syslog_relay_line_callback(const char *data, uint32_t length, void *user_data)
+{
+	struct syslog_relay_line_cb_data *cbdata = (struct syslog_relay_line_cb_data*)user_data;
+	syslog_relay_line_t entry;
+
+	syslog_relay_parse_line(data, length, &entry);
+	cbdata->cbfunc(&entry, cbdata->user_data);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+{
+	return syslog_relay_start_char_capture(client, SYSLOG_RELAY_CAPTURE_BLOCK, callback, user_data);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+{
+	return syslog_relay_start_char_capture(client, SYSLOG_RELAY_CAPTURE_RAW, callback, user_data);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_buffered(syslog_relay_client_t client, syslog_relay_capture_mode_t mode, syslog_relay_receive_buffer_cb_t callback, void* user_data)
+{
+	if (!client || !callback || mode < SYSLOG_RELAY_CAPTURE_RAW || mode > SYSLOG_RELAY_CAPTURE_LINES)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_worker(client, mode, callback, user_data);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_line_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (client->worker) {
+		debug_info("Another syslog capture thread appears to be running already.");
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	struct syslog_relay_line_cb_data *cbdata = (struct syslog_relay_line_cb_data*)malloc(sizeof(struct syslog_relay_line_cb_data));
+	if (!cbdata) {
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+	cbdata->cbfunc = callback;
+	cbdata->user_data = user_data;
+	free(client->cb_data);
+	client->cb_data = cbdata;
+
+	return syslog_relay_start_worker(client, SYSLOG_RELAY_CAPTURE_LINES, syslog_relay_line_callback, cbdata);
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_set_dispatch_buffer(syslog_relay_client_t client, uint32_t capacity)
+{
+	if (!client || capacity > SYSLOG_RELAY_DISPATCH_BUFFER_MAX)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	client->dispatch_capacity = capacity;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_set_reconnect(syslog_relay_client_t client, const service_reconnect_policy_t *policy)
+{
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (policy) {
+		client->reconnect = *policy;
+		client->reconnect_enabled = 1;
+	} else {
+		memset(&client->reconnect, '\0', sizeof(service_reconnect_policy_t));
+		client->reconnect_enabled = 0;
+	}
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_get_dropped(syslog_relay_client_t client, uint64_t *bytes, uint64_t *chunks)
+{
+	if (!client)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (bytes) {
+		*bytes = __sync_add_and_fetch(&client->dropped_bytes, 0);
+	}
+	if (chunks) {
+		*chunks = __sync_add_and_fetch(&client->dropped_chunks, 0);
+	}
+
+	return SYSLOG_RELAY_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client)
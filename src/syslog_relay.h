@@ -29,6 +29,12 @@
 struct syslog_relay_client_private {
 	service_client_t parent;
 	THREAD_T worker;
+	void *cb_data;
+	uint32_t dispatch_capacity;
+	uint64_t dropped_bytes;
+	uint64_t dropped_chunks;
+	int reconnect_enabled;
+	service_reconnect_policy_t reconnect;
 };
 
 void *syslog_relay_worker(void *arg);
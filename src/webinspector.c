@@ -82,6 +82,8 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_client_new(idevice_t devi
 
 	webinspector_client_t client_loc = (webinspector_client_t) malloc(sizeof(struct webinspector_client_private));
 	client_loc->parent = plclient;
+	client_loc->packet = NULL;
+	client_loc->packet_capacity = 0;
 
 	*client = client_loc;
 
@@ -102,6 +104,7 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_client_free(webinspector_
 		return WEBINSPECTOR_E_INVALID_ARG;
 
 	webinspector_error_t err = webinspector_error(property_list_service_client_free(client->parent));
+	free(client->packet);
 	free(client);
 
 	return err;
@@ -154,6 +157,7 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_send(webinspector_client_
 		outplist = NULL;
 		if (res != WEBINSPECTOR_E_SUCCESS) {
 			debug_info("Sending plist failed with error %d", res);
+			free(packet);
 			return res;
 		}
 	} while(packet_length > 0);
@@ -171,17 +175,18 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive(webinspector_clie
 
 LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webinspector_client_t client, plist_t * plist, uint32_t timeout_ms)
 {
+	if (!client || !plist)
+		return WEBINSPECTOR_E_INVALID_ARG;
+
 	webinspector_error_t res = WEBINSPECTOR_E_UNKNOWN_ERROR;
 	plist_t message = NULL;
 	plist_t key = NULL;
 
 	int is_final_message = 1;
 
-	char* buffer = NULL;
+	const char* buffer = NULL;
 	uint64_t length = 0;
 
-	char* packet = NULL;
-	char* newpacket = NULL;
 	uint64_t packet_length = 0;
 
 	debug_info("Receiving webinspector message...");
@@ -210,33 +215,46 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webi
 		}
 
 		/* read partial data */
-		plist_get_data_val(key, &buffer, &length);
-		if (!buffer || length == 0 || length > 0xFFFFFFFF) {
+		buffer = plist_get_data_ptr(key, &length);
+		if (!buffer || length == 0 || packet_length + length > 0xFFFFFFFF) {
 			debug_info("ERROR: Unable to get the inner plist binary data.");
-			free(packet);
-			free(buffer);
+			plist_free(message);
 			return WEBINSPECTOR_E_PLIST_ERROR;
 		}
 
-		/* (re)allocate packet data */
-		if (!packet) {
-			packet = (char*)malloc(length * sizeof(char));
-		} else {
-			newpacket = (char*)realloc(packet, (packet_length + length) * sizeof(char));
-			packet = newpacket;
+		if (is_final_message && packet_length == 0) {
+			/* unsplit message, parse it straight from the received data */
+			plist_from_bin(buffer, (uint32_t)length, plist);
+			plist_free(message);
+			if (!*plist) {
+				debug_info("Error restoring the final plist.");
+				return WEBINSPECTOR_E_PLIST_ERROR;
+			}
+			debug_plist(*plist);
+			return res;
 		}
 
-		/* copy partial data into final packet data */
-		memcpy(packet + packet_length, buffer, length);
+		/* grow the reassembly buffer geometrically, it is kept for later messages */
+		if (packet_length + length > client->packet_capacity) {
+			uint64_t capacity = (client->packet_capacity) ? client->packet_capacity : WEBINSPECTOR_REASSEMBLY_MIN_CAPACITY;
+			while (capacity < packet_length + length) {
+				capacity *= 2;
+			}
+			char *newpacket = (char*)realloc(client->packet, capacity);
+			if (!newpacket) {
+				debug_info("ERROR: Out of memory reassembling message.");
+				plist_free(message);
+				return WEBINSPECTOR_E_UNKNOWN_ERROR;
+			}
+			client->packet = newpacket;
+			client->packet_capacity = capacity;
+		}
 
-		/* cleanup buffer */
-		free(buffer);
-		buffer = NULL;
+		/* copy partial data into final packet data */
+		memcpy(client->packet + packet_length, buffer, length);
 
-		if (message) {
-			plist_free(message);
-			message = NULL;
-		}
+		plist_free(message);
+		message = NULL;
 
 		/* adjust packet length */
 		packet_length += length;
@@ -244,20 +262,50 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webi
 	} while(!is_final_message);
 
 	/* read final message */
-	if (packet_length) {
-		plist_from_bin(packet, (uint32_t)packet_length, plist);
-		if (!*plist) {
-			debug_info("Error restoring the final plist.");
-			free(packet);
-			return WEBINSPECTOR_E_PLIST_ERROR;
-		}
+	plist_from_bin(client->packet, (uint32_t)packet_length, plist);
+	if (!*plist) {
+		debug_info("Error restoring the final plist.");
+		return WEBINSPECTOR_E_PLIST_ERROR;
+	}
+
+	debug_plist(*plist);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_dispatch(webinspector_client_t client, const webinspector_handler_t *handlers, uint32_t count, webinspector_message_cb_t fallback, void *user_data, uint32_t timeout_ms)
+{
+	if (!client || (count > 0 && !handlers))
+		return WEBINSPECTOR_E_INVALID_ARG;
 
-		debug_plist(*plist);
+	plist_t message = NULL;
+	webinspector_error_t res = webinspector_receive_with_timeout(client, &message, timeout_ms);
+	if (res != WEBINSPECTOR_E_SUCCESS) {
+		return res;
 	}
 
-	if (packet) {
-		free(packet);
+	const char *selector = plist_get_string_ptr(plist_dict_get_item(message, "__selector"), NULL);
+	if (!selector) {
+		debug_info("ERROR: Message without selector.");
+		plist_free(message);
+		return WEBINSPECTOR_E_PLIST_ERROR;
+	}
+	plist_t argument = plist_dict_get_item(message, "__argument");
+
+	webinspector_message_cb_t callback = fallback;
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		if (!strcmp(handlers[i].selector, selector)) {
+			callback = handlers[i].callback;
+			break;
+		}
+	}
+	if (callback) {
+		callback(selector, argument, user_data);
+	} else {
+		debug_info("Ignoring message with selector %s", selector);
 	}
 
+	plist_free(message);
 	return res;
 }
@@ -27,8 +27,13 @@
 
 #define WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE 8096
 
+/* initial capacity of the buffer partial messages are reassembled in */
+#define WEBINSPECTOR_REASSEMBLY_MIN_CAPACITY (64 * 1024)
+
 struct webinspector_client_private {
 	property_list_service_client_t parent;
+	char *packet;
+	uint64_t packet_capacity;
 };
 
 #endif
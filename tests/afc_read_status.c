@@ -0,0 +1,203 @@
+/*
+ * afc_read_status.c
+ * Checks that a STATUS reply to FILE_READ is reported as an empty read
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+
+#include "idevice.h"
+#include "afc.h"
+#include "common/socket.h"
+#include "common/thread.h"
+
+#define TEST_BUFFER_SIZE 4096
+
+/*
+ * Mock device. Like the benchmarks, the AFC client talks to a peer thread
+ * on a loopback socket through a network device pointing at 127.0.0.1.
+ * The peer answers FILE_READ with a successful STATUS reply, as devices do
+ * at the end of a file.
+ */
+
+struct test_peer {
+	int listen_fd;
+	uint16_t port;
+	THREAD_T thread;
+};
+
+static int peer_recv_all(int fd, void *data, uint32_t length)
+{
+	uint32_t done = 0;
+	while (done < length) {
+		int res = socket_receive_timeout(fd, (char*)data + done, length - done, 0, 5000);
+		if (res <= 0) {
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+static void* afc_peer_thread(void *arg)
+{
+	struct test_peer *peer = (struct test_peer*)arg;
+	AFCPacket header;
+	char body[256];
+	char reply[sizeof(AFCPacket) + sizeof(uint64_t)];
+
+	int fd = socket_accept(peer->listen_fd, peer->port);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	while (peer_recv_all(fd, &header, sizeof(AFCPacket)) == 0) {
+		AFCPacket_from_LE(&header);
+		uint32_t length = (uint32_t)(header.entire_length - sizeof(AFCPacket));
+		if (length > sizeof(body) || (length > 0 && peer_recv_all(fd, body, length) < 0)) {
+			break;
+		}
+
+		AFCPacket *out = (AFCPacket*)reply;
+		memcpy(out->magic, AFC_MAGIC, AFC_MAGIC_LEN);
+		out->entire_length = sizeof(reply);
+		out->this_length = sizeof(reply);
+		out->packet_num = header.packet_num;
+		out->operation = (header.operation == AFC_OP_FILE_OPEN) ? AFC_OP_FILE_OPEN_RES : AFC_OP_STATUS;
+		AFCPacket_to_LE(out);
+		/* file handle 1 for FILE_OPEN, AFC_E_SUCCESS for everything else */
+		*(uint64_t*)(reply + sizeof(AFCPacket)) = htole64((header.operation == AFC_OP_FILE_OPEN) ? 1 : 0);
+		if (socket_send(fd, reply, sizeof(reply)) != (int)sizeof(reply)) {
+			break;
+		}
+	}
+	socket_close(fd);
+
+	return NULL;
+}
+
+static int check_untouched(const char *buffer, const char *what)
+{
+	int i;
+	for (i = 0; i < TEST_BUFFER_SIZE; i++) {
+		if ((unsigned char)buffer[i] != 0xAA) {
+			fprintf(stderr, "FAIL: %s wrote to the buffer at offset %d\n", what, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct test_peer peer;
+	struct sockaddr_in saddr;
+	socklen_t len = sizeof(saddr);
+	struct lockdownd_service_descriptor service;
+	afc_client_t afc = NULL;
+	uint64_t handle = 0;
+	uint32_t bytes = 0;
+	afc_error_t err;
+	char buffer[TEST_BUFFER_SIZE];
+	int failed = 0;
+
+	(void)argc;
+	(void)argv;
+
+	memset(&peer, '\0', sizeof(peer));
+	peer.listen_fd = socket_create(0);
+	if (peer.listen_fd < 0 || getsockname(peer.listen_fd, (struct sockaddr*)&saddr, &len) < 0) {
+		fprintf(stderr, "ERROR: Could not create mock device socket\n");
+		return 99;
+	}
+	peer.port = ntohs(saddr.sin_port);
+	if (thread_new(&peer.thread, afc_peer_thread, &peer) != 0) {
+		fprintf(stderr, "ERROR: Could not start mock device\n");
+		return 99;
+	}
+
+	idevice_t device = (idevice_t)calloc(1, sizeof(struct idevice_private));
+	unsigned char *addr = (unsigned char*)calloc(1, 16);
+	if (!device || !addr) {
+		return 99;
+	}
+	/* BSD style sockaddr_in as reported by usbmuxd: len, family, port, address */
+	addr[0] = 16;
+	addr[1] = 0x02;
+	addr[4] = 127;
+	addr[7] = 1;
+	device->udid = strdup("00000000-test-loopback");
+	device->conn_type = CONNECTION_NETWORK;
+	device->conn_data = addr;
+
+	service.port = peer.port;
+	service.ssl_enabled = 0;
+	service.identifier = NULL;
+	if (afc_client_new(device, &service, &afc) != AFC_E_SUCCESS
+	    || afc_file_open(afc, "/test", AFC_FOPEN_RDONLY, &handle) != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to mock AFC service\n");
+		return 99;
+	}
+
+	memset(buffer, 0xAA, sizeof(buffer));
+	bytes = 0xFFFFFFFF;
+	err = afc_file_read(afc, handle, buffer, sizeof(buffer), &bytes);
+	if (err != AFC_E_SUCCESS || bytes != 0) {
+		fprintf(stderr, "FAIL: afc_file_read returned %d with %u bytes, expected an empty read\n", err, bytes);
+		failed = 1;
+	}
+	if (check_untouched(buffer, "afc_file_read") < 0) {
+		failed = 1;
+	}
+
+	memset(buffer, 0xAA, sizeof(buffer));
+	bytes = 0xFFFFFFFF;
+	err = afc_file_read_pipelined(afc, handle, buffer, sizeof(buffer), 1024, 4, &bytes);
+	if (err != AFC_E_SUCCESS || bytes != 0) {
+		fprintf(stderr, "FAIL: afc_file_read_pipelined returned %d with %u bytes, expected an empty read\n", err, bytes);
+		failed = 1;
+	}
+	if (check_untouched(buffer, "afc_file_read_pipelined") < 0) {
+		failed = 1;
+	}
+
+	afc_file_close(afc, handle);
+	afc_client_free(afc);
+	thread_join(peer.thread);
+	thread_free(peer.thread);
+	socket_close(peer.listen_fd);
+	idevice_free(device);
+
+	if (!failed) {
+		printf("PASS: STATUS replies to FILE_READ are empty reads\n");
+	}
+	return failed;
+}
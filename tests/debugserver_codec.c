@@ -0,0 +1,333 @@
+/*
+ * debugserver_codec.c
+ * Checks the debugserver hex codec and packet checksum against scalar code
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/debugserver.h>
+
+#include "mock_device.h"
+
+#define MAX_LENGTH 40
+#define LONG_LENGTH 1000
+
+/*
+ * The library uses SSE2 or NEON kernels for whole blocks and scalar code
+ * for the rest, depending on the build. Its results are compared with the
+ * plain scalar definitions below for every length up to MAX_LENGTH, which
+ * covers inputs without a full block, with one or two blocks and with
+ * every tail length. Decoding must give the same bytes as the scalar code
+ * for invalid hex characters at every position, since blocks containing
+ * them are left to the scalar loop. The checksum is internal, so it is
+ * checked on the packets exchanged with a mock debugserver.
+ */
+
+static const char hexchars[] = "0123456789ABCDEF";
+
+/* characters around the hex ranges and outside of ASCII */
+static const char invalid_chars[] = { '/', ':', '@', 'G', '`', 'g', 'x', ' ', '\0', (char)0x80, (char)0xb0, (char)0xe6, (char)0xff };
+
+static int reference_hex2int(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return 10 + c - 'a';
+	else if (c >= 'A' && c <= 'F')
+		return 10 + c - 'A';
+	else
+		return c;
+}
+
+static void reference_decode(const char *encoded, size_t length, char *decoded)
+{
+	size_t i;
+	for (i = 0; i + 1 < length; i += 2) {
+		decoded[i / 2] = (char)(((unsigned int)reference_hex2int(encoded[i]) << 4) | (unsigned int)reference_hex2int(encoded[i + 1]));
+	}
+	decoded[length / 2] = '\0';
+}
+
+static unsigned int reference_checksum(const unsigned char *data, size_t length)
+{
+	unsigned int sum = 0;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		sum += data[i];
+	}
+	return sum & 0xff;
+}
+
+static void fill_random(unsigned char *data, size_t length, int avoid)
+{
+	size_t i;
+	for (i = 0; i < length; i++) {
+		unsigned char c;
+		do {
+			c = (unsigned char)(rand() & 0xff);
+		} while (c == 0 || c == avoid);
+		data[i] = c;
+	}
+}
+
+static int check_encode(size_t length)
+{
+	char input[LONG_LENGTH + 1];
+	char expected[2 * LONG_LENGTH + 1];
+	char *encoded = NULL;
+	char *decoded = NULL;
+	uint32_t encoded_length = 0;
+	size_t i;
+	int failed = 0;
+
+	fill_random((unsigned char*)input, length, 0);
+	input[length] = '\0';
+	for (i = 0; i < length; i++) {
+		expected[2 * i] = hexchars[(unsigned char)input[i] >> 4];
+		expected[2 * i + 1] = hexchars[(unsigned char)input[i] & 0xf];
+	}
+
+	debugserver_encode_string(input, &encoded, &encoded_length);
+	if (encoded_length != 2 * length + 4 || memcmp(encoded, expected, 2 * length) != 0 || encoded[2 * length] != '\0') {
+		fprintf(stderr, "FAIL: encoding %u bytes differs from the scalar result\n", (unsigned int)length);
+		failed = 1;
+	} else {
+		debugserver_decode_string(encoded, 2 * length, &decoded);
+		if (memcmp(decoded, input, length + 1) != 0) {
+			fprintf(stderr, "FAIL: %u bytes do not survive a round-trip\n", (unsigned int)length);
+			failed = 1;
+		}
+		free(decoded);
+	}
+	free(encoded);
+
+	return (failed) ? -1 : 0;
+}
+
+static int check_decode(const char *what, const char *encoded, size_t length)
+{
+	char expected[LONG_LENGTH + 1];
+	char *decoded = NULL;
+
+	/* exactly sized copy, so overreads show up under valgrind or AddressSanitizer */
+	char *copy = (char*)malloc((length > 0) ? length : 1);
+	if (!copy) {
+		exit(99);
+	}
+	memcpy(copy, encoded, length);
+	reference_decode(copy, length, expected);
+	debugserver_decode_string(copy, length, &decoded);
+	free(copy);
+
+	int res = memcmp(decoded, expected, length / 2 + 1);
+	free(decoded);
+	if (res != 0) {
+		fprintf(stderr, "FAIL: decoding %s of %u chars differs from the scalar result\n", what, (unsigned int)length);
+		return -1;
+	}
+	return 0;
+}
+
+static int check_decode_length(size_t length)
+{
+	char encoded[2 * MAX_LENGTH];
+	size_t count = 2 * length;
+	size_t pos;
+	unsigned int c;
+	int failed = 0;
+
+	for (pos = 0; pos < count; pos++) {
+		encoded[pos] = "0123456789abcdefABCDEF"[rand() % 22];
+	}
+	if (check_decode("mixed case hex", encoded, count) < 0) {
+		failed = 1;
+	}
+
+	for (pos = 0; pos < count; pos++) {
+		char valid = encoded[pos];
+		for (c = 0; c < sizeof(invalid_chars); c++) {
+			char what[64];
+			encoded[pos] = invalid_chars[c];
+			snprintf(what, sizeof(what), "0x%02x at %u", (unsigned char)invalid_chars[c], (unsigned int)pos);
+			if (check_decode(what, encoded, count) < 0) {
+				failed = 1;
+			}
+		}
+		encoded[pos] = valid;
+	}
+
+	return (failed) ? -1 : 0;
+}
+
+struct checksum_peer {
+	int packets;
+	int mismatches;
+	unsigned char payloads[MAX_LENGTH + 1][MAX_LENGTH];
+};
+
+static int read_packet(int fd, unsigned char *body, size_t size, size_t *length, unsigned int *checksum)
+{
+	unsigned char c = 0;
+	char hash[2];
+
+	/* skip the acknowledgements of the previous response */
+	do {
+		if (mock_device_recv_all(fd, &c, 1) < 0) {
+			return -1;
+		}
+	} while (c == '+' || c == '-');
+	if (c != '$') {
+		return -1;
+	}
+	*length = 0;
+	while (mock_device_recv_all(fd, &c, 1) == 0 && c != '#') {
+		if (*length >= size) {
+			return -1;
+		}
+		body[(*length)++] = c;
+	}
+	if (c != '#' || mock_device_recv_all(fd, hash, 2) < 0) {
+		return -1;
+	}
+	*checksum = (unsigned int)(reference_hex2int(hash[0]) << 4 | reference_hex2int(hash[1]));
+	return 0;
+}
+
+static void checksum_peer(int fd, void *user_data)
+{
+	struct checksum_peer *peer = (struct checksum_peer*)user_data;
+	unsigned char body[MAX_LENGTH];
+	unsigned char reply[MAX_LENGTH + 8];
+	size_t length = 0;
+	unsigned int checksum = 0;
+
+	while (read_packet(fd, body, sizeof(body), &length, &checksum) == 0) {
+		if (checksum != reference_checksum(body, length)) {
+			peer->mismatches++;
+		}
+		/* the response has the same length as the command, every other one with a wrong checksum */
+		int n = peer->packets / 2;
+		unsigned int sum = reference_checksum(peer->payloads[n], n);
+		if (peer->packets & 1) {
+			sum = (sum + 1) & 0xff;
+		}
+		reply[0] = '+';
+		reply[1] = '$';
+		memcpy(reply + 2, peer->payloads[n], n);
+		reply[n + 2] = '#';
+		reply[n + 3] = hexchars[sum >> 4];
+		reply[n + 4] = hexchars[sum & 0xf];
+		if (mock_device_send_all(fd, reply, n + 5) < 0) {
+			break;
+		}
+		peer->packets++;
+	}
+}
+
+static int check_checksum(void)
+{
+	struct checksum_peer peer;
+	struct mock_device mock;
+	debugserver_client_t client = NULL;
+	int length;
+	int failed = 0;
+
+	memset(&peer, '\0', sizeof(peer));
+	for (length = 0; length <= MAX_LENGTH; length++) {
+		fill_random(peer.payloads[length], length, '#');
+	}
+	if (mock_device_start(&mock, checksum_peer, &peer) < 0
+	    || debugserver_client_new(mock.device, &mock.service, &client) != DEBUGSERVER_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to mock device\n");
+		return 99;
+	}
+
+	for (length = 0; length <= MAX_LENGTH && !failed; length++) {
+		int wrong;
+		for (wrong = 0; wrong <= 1; wrong++) {
+			/* the command name is sent as is, so it sets the packet body */
+			char name[MAX_LENGTH + 1];
+			debugserver_command_t command = NULL;
+			char *response = NULL;
+			size_t response_size = 0;
+			fill_random((unsigned char*)name, length, '#');
+			name[length] = '\0';
+			debugserver_command_new(name, 0, NULL, &command);
+			debugserver_error_t err = debugserver_client_send_command(client, command, &response, &response_size);
+			debugserver_command_free(command);
+			if (wrong && err != DEBUGSERVER_E_RESPONSE_ERROR) {
+				fprintf(stderr, "FAIL: response of %d bytes with a wrong checksum returned %d\n", length, err);
+				failed = 1;
+			} else if (!wrong && (err != DEBUGSERVER_E_SUCCESS || response_size != (size_t)length
+			           || memcmp(response, peer.payloads[length], length) != 0)) {
+				fprintf(stderr, "FAIL: response of %d bytes was not accepted (%d)\n", length, err);
+				failed = 1;
+			}
+			free(response);
+		}
+	}
+
+	debugserver_client_free(client);
+	mock_device_stop(&mock);
+
+	if (peer.mismatches > 0) {
+		fprintf(stderr, "FAIL: %d of %d packets were sent with a wrong checksum\n", peer.mismatches, peer.packets);
+		failed = 1;
+	}
+	return (failed) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t length;
+	int failed = 0;
+
+	(void)argc;
+	(void)argv;
+
+	srand(1);
+	for (length = 0; length <= MAX_LENGTH; length++) {
+		if (check_encode(length) < 0 || check_decode_length(length) < 0) {
+			failed = 1;
+		}
+	}
+	/* several blocks in a row */
+	if (check_encode(LONG_LENGTH) < 0) {
+		failed = 1;
+	}
+	int res = check_checksum();
+	if (res == 99) {
+		return 99;
+	}
+	if (res < 0) {
+		failed = 1;
+	}
+
+	if (!failed) {
+		printf("PASS: debugserver hex codec and checksum match the scalar results\n");
+	}
+	return failed;
+}
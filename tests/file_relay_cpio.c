@@ -0,0 +1,349 @@
+/*
+ * file_relay_cpio.c
+ * Checks the CPIO reader of file_relay_extract_archive() with malformed archives
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/file_relay.h>
+
+#include "mock_device.h"
+
+#define ARCHIVE_BUFFER_SIZE 16384
+
+/*
+ * The mock device sends a hand-built archive and closes the connection, the
+ * way file_relay does after the last byte. Archives that end early must fail
+ * with FILE_RELAY_E_MUX_ERROR, invalid headers with FILE_RELAY_E_ARCHIVE_ERROR,
+ * and no entry may ever report more data than its header announced.
+ */
+
+struct archive {
+	char data[ARCHIVE_BUFFER_SIZE];
+	uint32_t length;
+};
+
+struct extract_result {
+	uint32_t entries;
+	uint32_t completed;
+	uint64_t bytes;
+	uint64_t entry_size;
+	int overrun;
+	char name[64];
+	char content[64];
+};
+
+static void archive_add(struct archive *ar, const void *data, uint32_t length)
+{
+	if (ar->length + length > sizeof(ar->data)) {
+		fprintf(stderr, "ERROR: Test archive too large\n");
+		exit(99);
+	}
+	memcpy(ar->data + ar->length, data, length);
+	ar->length += length;
+}
+
+static void archive_pad(struct archive *ar)
+{
+	static const char zeros[4] = { 0, 0, 0, 0 };
+	archive_add(ar, zeros, (4 - (ar->length & 3)) & 3);
+}
+
+static void archive_add_newc(struct archive *ar, const char *name, uint32_t namesize, const char *content, uint32_t filesize)
+{
+	char hdr[111];
+	snprintf(hdr, sizeof(hdr), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+		1, 0100644, 0, 0, 1, 0x5f000000, filesize, 0, 0, 0, 0, namesize, 0);
+	archive_add(ar, hdr, 110);
+	archive_add(ar, name, strlen(name) + 1);
+	archive_pad(ar);
+	if (content) {
+		archive_add(ar, content, strlen(content));
+		archive_pad(ar);
+	}
+}
+
+static void archive_add_odc(struct archive *ar, const char *name, uint32_t namesize, const char *content, uint32_t filesize)
+{
+	char hdr[77];
+	snprintf(hdr, sizeof(hdr), "070707%06o%06o%06o%06o%06o%06o%06o%011o%06o%011o",
+		0, 1, 0100644, 0, 0, 1, 0, 0x5f000000, namesize, filesize);
+	archive_add(ar, hdr, 76);
+	archive_add(ar, name, strlen(name) + 1);
+	if (content) {
+		archive_add(ar, content, strlen(content));
+	}
+}
+
+static void archive_add_file(struct archive *ar, int newc, const char *name, const char *content)
+{
+	if (newc) {
+		archive_add_newc(ar, name, strlen(name) + 1, content, strlen(content));
+	} else {
+		archive_add_odc(ar, name, strlen(name) + 1, content, strlen(content));
+	}
+}
+
+static void archive_add_trailer(struct archive *ar, int newc)
+{
+	archive_add_file(ar, newc, "TRAILER!!!", "");
+}
+
+static void send_archive(int fd, void *user_data)
+{
+	struct archive *ar = (struct archive*)user_data;
+	mock_device_send_all(fd, ar->data, ar->length);
+}
+
+static int entry_cb(const file_relay_entry_t *entry, const char *data, uint32_t length, void *user_data)
+{
+	struct extract_result *result = (struct extract_result*)user_data;
+
+	if (entry->offset == 0 && result->entries == result->completed) {
+		result->entries++;
+		snprintf(result->name, sizeof(result->name), "%s", entry->name);
+		result->entry_size = entry->size;
+	}
+	if (!data) {
+		result->completed++;
+		return 0;
+	}
+	if (entry->offset + length > entry->size) {
+		result->overrun = 1;
+	}
+	if (entry->offset + length <= sizeof(result->content) - 1) {
+		memcpy(result->content + entry->offset, data, length);
+	}
+	result->bytes += length;
+
+	return 0;
+}
+
+static int run_case(const char *what, struct archive *ar, file_relay_error_t expected, struct extract_result *result)
+{
+	struct mock_device mock;
+	idevice_connection_t connection = NULL;
+
+	memset(result, '\0', sizeof(struct extract_result));
+	if (mock_device_start(&mock, send_archive, ar) < 0 || mock_device_connect(&mock, &connection) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to mock device\n");
+		exit(99);
+	}
+	file_relay_error_t err = file_relay_extract_archive(connection, NULL, entry_cb, result, 5000);
+	idevice_disconnect(connection);
+	mock_device_stop(&mock);
+
+	if (err != expected) {
+		fprintf(stderr, "FAIL: %s: file_relay_extract_archive returned %d, expected %d\n", what, err, expected);
+		return -1;
+	}
+	if (result->overrun) {
+		fprintf(stderr, "FAIL: %s: entry data ran past the announced file size\n", what);
+		return -1;
+	}
+	return 0;
+}
+
+static int check_valid(int newc)
+{
+	struct archive ar;
+	struct extract_result result;
+	const char *what = (newc) ? "newc archive" : "odc archive";
+
+	memset(&ar, '\0', sizeof(ar));
+	archive_add_file(&ar, newc, "a", "hello");
+	archive_add_file(&ar, newc, "dir/b", "world!");
+	archive_add_trailer(&ar, newc);
+	if (run_case(what, &ar, FILE_RELAY_E_SUCCESS, &result) < 0) {
+		return -1;
+	}
+	if (result.entries != 2 || result.completed != 2 || result.bytes != 11
+	    || strcmp(result.name, "dir/b") != 0 || strcmp(result.content, "world!") != 0) {
+		fprintf(stderr, "FAIL: %s: got %u entries (%u completed) with %llu bytes\n", what, result.entries, result.completed, (unsigned long long)result.bytes);
+		return -1;
+	}
+	return 0;
+}
+
+static int check_truncated_header(int newc)
+{
+	struct archive ar;
+	struct extract_result result;
+	const char *what = (newc) ? "truncated newc header" : "truncated odc header";
+	uint32_t header_size = (newc) ? 110 : 76;
+	uint32_t cut;
+	int failed = 0;
+
+	/* every length from the bare magic up to one byte short of a full header */
+	for (cut = 2; cut < header_size; cut++) {
+		memset(&ar, '\0', sizeof(ar));
+		archive_add_file(&ar, newc, "a", "hello");
+		ar.length = cut;
+		if (run_case(what, &ar, FILE_RELAY_E_MUX_ERROR, &result) < 0) {
+			failed = 1;
+		} else if (result.entries != 0) {
+			fprintf(stderr, "FAIL: %s: an entry was reported for %u header bytes\n", what, cut);
+			failed = 1;
+		}
+	}
+	return (failed) ? -1 : 0;
+}
+
+static int check_invalid_header(void)
+{
+	struct archive ar;
+	struct extract_result result;
+	int failed = 0;
+
+	memset(&ar, '\0', sizeof(ar));
+	archive_add(&ar, "070708", 6);
+	archive_add_file(&ar, 1, "a", "hello");
+	if (run_case("bad magic", &ar, FILE_RELAY_E_ARCHIVE_ERROR, &result) < 0) {
+		failed = 1;
+	}
+
+	memset(&ar, '\0', sizeof(ar));
+	archive_add_file(&ar, 1, "a", "hello");
+	ar.data[60] = 'g';
+	if (run_case("non-hex newc file size", &ar, FILE_RELAY_E_ARCHIVE_ERROR, &result) < 0) {
+		failed = 1;
+	}
+
+	memset(&ar, '\0', sizeof(ar));
+	archive_add_file(&ar, 0, "a", "hello");
+	ar.data[70] = '8';
+	if (run_case("non-octal odc file size", &ar, FILE_RELAY_E_ARCHIVE_ERROR, &result) < 0) {
+		failed = 1;
+	}
+
+	return (failed) ? -1 : 0;
+}
+
+static int check_name_size(int newc)
+{
+	struct archive ar;
+	struct extract_result result;
+	char what[64];
+	static const uint32_t sizes[] = { 0, 4097, 0x7FFFF, 0xFFFFFFFF };
+	unsigned int i;
+	int failed = 0;
+
+	/* oversized header: empty, larger than the name buffer or the field width */
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (!newc && sizes[i] > 0777777) {
+			continue;
+		}
+		snprintf(what, sizeof(what), "%s name size %u", (newc) ? "newc" : "odc", sizes[i]);
+		memset(&ar, '\0', sizeof(ar));
+		if (newc) {
+			archive_add_newc(&ar, "a", sizes[i], "hello", 5);
+		} else {
+			archive_add_odc(&ar, "a", sizes[i], "hello", 5);
+		}
+		archive_add_trailer(&ar, newc);
+		if (run_case(what, &ar, FILE_RELAY_E_ARCHIVE_ERROR, &result) < 0 || result.entries != 0) {
+			failed = 1;
+		}
+	}
+
+	/* a valid name size that runs past the end of the archive */
+	snprintf(what, sizeof(what), "%s name past the end", (newc) ? "newc" : "odc");
+	memset(&ar, '\0', sizeof(ar));
+	if (newc) {
+		archive_add_newc(&ar, "a", 4096, "", 0);
+	} else {
+		archive_add_odc(&ar, "a", 4096, "", 0);
+	}
+	if (run_case(what, &ar, FILE_RELAY_E_MUX_ERROR, &result) < 0 || result.entries != 0) {
+		failed = 1;
+	}
+
+	return (failed) ? -1 : 0;
+}
+
+static int check_file_size(int newc)
+{
+	struct archive ar;
+	struct extract_result result;
+	char what[64];
+	static const uint32_t sizes[] = { 9, 4096, 0xFFFFFFFF };
+	unsigned int i;
+	int failed = 0;
+
+	/* the data ends before the announced size, so the entry never completes */
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		uint32_t filesize = sizes[i];
+		if (!newc && filesize > 077777777777U) {
+			continue;
+		}
+		snprintf(what, sizeof(what), "%s file size %u past the end", (newc) ? "newc" : "odc", filesize);
+		memset(&ar, '\0', sizeof(ar));
+		if (newc) {
+			archive_add_newc(&ar, "a", 2, "hello", filesize);
+		} else {
+			archive_add_odc(&ar, "a", 2, "hello", filesize);
+		}
+		if (run_case(what, &ar, FILE_RELAY_E_MUX_ERROR, &result) < 0) {
+			failed = 1;
+		} else if (result.completed != 0 || result.bytes > 8 || result.entry_size != filesize) {
+			fprintf(stderr, "FAIL: %s: %u entries completed with %llu bytes\n", what, result.completed, (unsigned long long)result.bytes);
+			failed = 1;
+		}
+	}
+
+	return (failed) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+	int newc;
+
+	(void)argc;
+	(void)argv;
+
+	for (newc = 0; newc <= 1; newc++) {
+		if (check_valid(newc) < 0) {
+			failed = 1;
+		}
+		if (check_truncated_header(newc) < 0) {
+			failed = 1;
+		}
+		if (check_name_size(newc) < 0) {
+			failed = 1;
+		}
+		if (check_file_size(newc) < 0) {
+			failed = 1;
+		}
+	}
+	if (check_invalid_header() < 0) {
+		failed = 1;
+	}
+
+	if (!failed) {
+		printf("PASS: file_relay CPIO reader rejects truncated and oversized entries\n");
+	}
+	return failed;
+}
@@ -0,0 +1,132 @@
+/*
+ * mock_device.c
+ * Loopback network device for the tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "idevice.h"
+#include "common/socket.h"
+#include "mock_device.h"
+
+static void* mock_device_thread(void *arg)
+{
+	struct mock_device *mock = (struct mock_device*)arg;
+
+	int fd = socket_accept(mock->listen_fd, mock->port);
+	if (fd < 0) {
+		return NULL;
+	}
+	mock->handler(fd, mock->user_data);
+	socket_close(fd);
+
+	return NULL;
+}
+
+int mock_device_start(struct mock_device *mock, mock_device_handler_t handler, void *user_data)
+{
+	struct sockaddr_in saddr;
+	socklen_t len = sizeof(saddr);
+
+	memset(mock, '\0', sizeof(struct mock_device));
+	mock->handler = handler;
+	mock->user_data = user_data;
+	mock->listen_fd = socket_create(0);
+	if (mock->listen_fd < 0 || getsockname(mock->listen_fd, (struct sockaddr*)&saddr, &len) < 0) {
+		return -1;
+	}
+	mock->port = ntohs(saddr.sin_port);
+
+	idevice_t device = (idevice_t)calloc(1, sizeof(struct idevice_private));
+	unsigned char *addr = (unsigned char*)calloc(1, 16);
+	if (!device || !addr) {
+		free(device);
+		free(addr);
+		socket_close(mock->listen_fd);
+		return -1;
+	}
+	/* BSD style sockaddr_in as reported by usbmuxd: len, family, port, address */
+	addr[0] = 16;
+	addr[1] = 0x02;
+	addr[4] = 127;
+	addr[7] = 1;
+	device->udid = strdup("00000000-test-loopback");
+	device->conn_type = CONNECTION_NETWORK;
+	device->conn_data = addr;
+	mock->device = device;
+
+	mock->service.port = mock->port;
+	mock->service.ssl_enabled = 0;
+	mock->service.identifier = NULL;
+
+	if (thread_new(&mock->thread, mock_device_thread, mock) != 0) {
+		idevice_free(mock->device);
+		socket_close(mock->listen_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void mock_device_stop(struct mock_device *mock)
+{
+	thread_join(mock->thread);
+	thread_free(mock->thread);
+	socket_close(mock->listen_fd);
+	idevice_free(mock->device);
+	mock->device = NULL;
+}
+
+idevice_error_t mock_device_connect(struct mock_device *mock, idevice_connection_t *connection)
+{
+	return idevice_connect(mock->device, mock->port, connection);
+}
+
+int mock_device_recv_all(int fd, void *data, uint32_t length)
+{
+	uint32_t done = 0;
+	while (done < length) {
+		int res = socket_receive_timeout(fd, (char*)data + done, length - done, 0, 5000);
+		if (res <= 0) {
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+int mock_device_send_all(int fd, const void *data, uint32_t length)
+{
+	uint32_t done = 0;
+	while (done < length) {
+		int res = socket_send(fd, (void*)((const char*)data + done), length - done);
+		if (res <= 0) {
+			return -1;
+		}
+		done += res;
+	}
+	return 0;
+}
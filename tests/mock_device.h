@@ -0,0 +1,78 @@
+/*
+ * mock_device.h
+ * Loopback network device for the tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __MOCK_DEVICE_H
+#define __MOCK_DEVICE_H
+
+#include <stdint.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+#include "common/thread.h"
+
+/**
+ * Called on the peer thread with the accepted connection. The socket is
+ * closed once the handler returns.
+ */
+typedef void (*mock_device_handler_t)(int fd, void *user_data);
+
+struct mock_device {
+	int listen_fd;
+	uint16_t port;
+	THREAD_T thread;
+	mock_device_handler_t handler;
+	void *user_data;
+	idevice_t device;
+	struct lockdownd_service_descriptor service;
+};
+
+/**
+ * Starts a peer thread that accepts a single connection on a loopback
+ * socket and sets up a network device and service descriptor pointing at it.
+ *
+ * @return 0 on success or -1 on error.
+ */
+int mock_device_start(struct mock_device *mock, mock_device_handler_t handler, void *user_data);
+
+/**
+ * Waits for the peer thread and frees the device.
+ */
+void mock_device_stop(struct mock_device *mock);
+
+/**
+ * Connects to the mock device, which runs the handler on the peer side.
+ */
+idevice_error_t mock_device_connect(struct mock_device *mock, idevice_connection_t *connection);
+
+/**
+ * Receives exactly length bytes on the peer side.
+ *
+ * @return 0 on success or -1 on error or timeout.
+ */
+int mock_device_recv_all(int fd, void *data, uint32_t length);
+
+/**
+ * Sends all data on the peer side.
+ *
+ * @return 0 on success or -1 on error.
+ */
+int mock_device_send_all(int fd, const void *data, uint32_t length);
+
+#endif
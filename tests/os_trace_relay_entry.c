@@ -0,0 +1,378 @@
+/*
+ * os_trace_relay_entry.c
+ * Checks the os_trace_relay entry parser with malformed entries
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/os_trace_relay.h>
+
+#include "mock_device.h"
+
+#define STREAM_BUFFER_SIZE 65536
+#define MAX_EXPECTED 160
+
+/* entry layout, see src/os_trace_relay.c */
+#define ENTRY_MARKER 0x02
+#define ENTRY_PREFIX_SIZE 5
+#define ENTRY_OFFSET_PID 9
+#define ENTRY_OFFSET_TIMESTAMP 55
+#define ENTRY_OFFSET_LEVEL 68
+#define ENTRY_OFFSET_IMAGE_NAME_SIZE 107
+#define ENTRY_OFFSET_MESSAGE_SIZE 109
+#define ENTRY_OFFSET_SUBSYSTEM_SIZE 117
+#define ENTRY_OFFSET_CATEGORY_SIZE 121
+#define ENTRY_HEADER_SIZE 129
+
+/*
+ * The mock device sends a stream of hand-built entries. Malformed entries
+ * must be reported as OS_TRACE_RELAY_E_MALFORMED_ENTRY without touching
+ * the entry that follows them in the receive buffer, which is then
+ * returned intact by the next call.
+ */
+
+struct stream {
+	unsigned char data[STREAM_BUFFER_SIZE];
+	uint32_t length;
+	struct {
+		os_trace_relay_error_t err;
+		const char *message;
+		const char *subsystem;
+		const char *category;
+	} expected[MAX_EXPECTED];
+	int count;
+};
+
+static void put_le(unsigned char *p, uint64_t value, int size)
+{
+	int i;
+	for (i = 0; i < size; i++) {
+		p[i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+static uint32_t get_le(const unsigned char *p, int size)
+{
+	uint32_t value = 0;
+	while (size > 0) {
+		size--;
+		value = (value << 8) | p[size];
+	}
+	return value;
+}
+
+static unsigned char* stream_reserve(struct stream *s, uint32_t length)
+{
+	if (s->length + length > sizeof(s->data)) {
+		fprintf(stderr, "ERROR: Test stream too large\n");
+		exit(99);
+	}
+	unsigned char *p = s->data + s->length;
+	memset(p, '\0', length);
+	s->length += length;
+	return p;
+}
+
+static void stream_expect(struct stream *s, os_trace_relay_error_t err, const char *message, const char *subsystem, const char *category)
+{
+	if (s->count >= MAX_EXPECTED) {
+		fprintf(stderr, "ERROR: Too many test entries\n");
+		exit(99);
+	}
+	s->expected[s->count].err = err;
+	s->expected[s->count].message = message;
+	s->expected[s->count].subsystem = subsystem;
+	s->expected[s->count].category = category;
+	s->count++;
+}
+
+static uint32_t string_size(const char *str)
+{
+	return (str) ? strlen(str) + 1 : 0;
+}
+
+static void put_string(unsigned char **p, const char *str)
+{
+	uint32_t size = string_size(str);
+	if (size > 0) {
+		memcpy(*p, str, size);
+		*p += size;
+	}
+}
+
+/**
+ * Adds an entry and returns its start, so tests can corrupt the header.
+ */
+static unsigned char* add_entry(struct stream *s, const char *message, const char *subsystem, const char *category)
+{
+	static const char filename[] = "/usr/libexec/testd";
+	static const char image_name[] = "/usr/lib/libtest.dylib";
+	uint32_t length = ENTRY_HEADER_SIZE + sizeof(filename) + sizeof(image_name) + string_size(message) + string_size(subsystem) + string_size(category);
+	unsigned char *prefix = stream_reserve(s, ENTRY_PREFIX_SIZE + length);
+	unsigned char *entry = prefix + ENTRY_PREFIX_SIZE;
+	unsigned char *p = entry + ENTRY_HEADER_SIZE;
+
+	prefix[0] = ENTRY_MARKER;
+	put_le(prefix + 1, length, 4);
+	put_le(entry + ENTRY_OFFSET_PID, 4242, 4);
+	put_le(entry + ENTRY_OFFSET_TIMESTAMP, 1700000000, 8);
+	entry[ENTRY_OFFSET_LEVEL] = 0x02;
+	put_le(entry + ENTRY_OFFSET_IMAGE_NAME_SIZE, sizeof(image_name), 2);
+	put_le(entry + ENTRY_OFFSET_MESSAGE_SIZE, string_size(message), 2);
+	put_le(entry + ENTRY_OFFSET_SUBSYSTEM_SIZE, string_size(subsystem), 4);
+	put_le(entry + ENTRY_OFFSET_CATEGORY_SIZE, string_size(category), 4);
+	memcpy(p, filename, sizeof(filename));
+	p += sizeof(filename);
+	memcpy(p, image_name, sizeof(image_name));
+	p += sizeof(image_name);
+	put_string(&p, message);
+	put_string(&p, subsystem);
+	put_string(&p, category);
+
+	return entry;
+}
+
+static void add_valid_entry(struct stream *s, const char *message)
+{
+	add_entry(s, message, "com.example.test", "general");
+	stream_expect(s, OS_TRACE_RELAY_E_SUCCESS, message, "com.example.test", "general");
+}
+
+static void add_malformed(struct stream *s)
+{
+	stream_expect(s, OS_TRACE_RELAY_E_MALFORMED_ENTRY, NULL, NULL, NULL);
+}
+
+/**
+ * Returns the number of bytes from the start of a string field to the end
+ * of the entry.
+ */
+static uint32_t bytes_from_field(const unsigned char *entry, int field_offset)
+{
+	static const int offsets[] = { ENTRY_OFFSET_IMAGE_NAME_SIZE, ENTRY_OFFSET_MESSAGE_SIZE, ENTRY_OFFSET_SUBSYSTEM_SIZE, ENTRY_OFFSET_CATEGORY_SIZE };
+	static const int sizes[] = { 2, 2, 4, 4 };
+	uint32_t length = get_le(entry - ENTRY_PREFIX_SIZE + 1, 4);
+	uint32_t start = ENTRY_HEADER_SIZE + strlen((const char*)entry + ENTRY_HEADER_SIZE) + 1;
+	int i;
+	for (i = 0; offsets[i] != field_offset; i++) {
+		start += get_le(entry + offsets[i], sizes[i]);
+	}
+	return length - start;
+}
+
+static void send_stream(int fd, void *user_data)
+{
+	struct stream *s = (struct stream*)user_data;
+	mock_device_send_all(fd, s->data, s->length);
+}
+
+static int check_string(const char *str, uint32_t length, const char *expected)
+{
+	if (!expected) {
+		expected = "";
+	}
+	return (str && length == strlen(expected) && strcmp(str, expected) == 0);
+}
+
+static int check_entry(const char *what, int index, const os_trace_relay_entry_t *entry, const char *message, const char *subsystem, const char *category)
+{
+	if (entry->pid != 4242 || entry->timestamp != 1700000000 || entry->level != 0x02
+	    || entry->filename_length != 18 || strcmp(entry->filename, "/usr/libexec/testd") != 0
+	    || entry->image_name_length != 22 || strcmp(entry->image_name, "/usr/lib/libtest.dylib") != 0
+	    || !check_string(entry->message, entry->message_length, message)
+	    || !check_string(entry->subsystem, entry->subsystem_length, subsystem)
+	    || !check_string(entry->category, entry->category_length, category)) {
+		fprintf(stderr, "FAIL: %s: entry %d was not parsed intact\n", what, index);
+		return -1;
+	}
+	return 0;
+}
+
+static int run_stream(const char *what, struct stream *s)
+{
+	struct mock_device mock;
+	os_trace_relay_client_t client = NULL;
+	int failed = 0;
+	int i;
+
+	if (mock_device_start(&mock, send_stream, s) < 0
+	    || os_trace_relay_client_new(mock.device, &mock.service, &client) != OS_TRACE_RELAY_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to mock device\n");
+		exit(99);
+	}
+
+	for (i = 0; i < s->count; i++) {
+		os_trace_relay_entry_t entry;
+		memset(&entry, '\0', sizeof(entry));
+		os_trace_relay_error_t err = os_trace_relay_next_entry(client, &entry, 5000);
+		if (err != s->expected[i].err) {
+			fprintf(stderr, "FAIL: %s: entry %d returned %d, expected %d\n", what, i, err, s->expected[i].err);
+			failed = 1;
+			break;
+		}
+		if (err == OS_TRACE_RELAY_E_SUCCESS && check_entry(what, i, &entry, s->expected[i].message, s->expected[i].subsystem, s->expected[i].category) < 0) {
+			failed = 1;
+		}
+	}
+
+	os_trace_relay_client_free(client);
+	mock_device_stop(&mock);
+
+	return (failed) ? -1 : 0;
+}
+
+static int check_valid(void)
+{
+	struct stream *s = (struct stream*)calloc(1, sizeof(struct stream));
+	if (!s) {
+		exit(99);
+	}
+
+	add_valid_entry(s, "first");
+	add_valid_entry(s, "");
+	/* strings that are not present are empty */
+	add_entry(s, "no subsystem", NULL, NULL);
+	stream_expect(s, OS_TRACE_RELAY_E_SUCCESS, "no subsystem", NULL, NULL);
+	add_entry(s, NULL, NULL, NULL);
+	stream_expect(s, OS_TRACE_RELAY_E_SUCCESS, NULL, NULL, NULL);
+	add_valid_entry(s, "last");
+
+	int res = run_stream("valid entries", s);
+	free(s);
+	return res;
+}
+
+static int check_short_entries(void)
+{
+	struct stream *s = (struct stream*)calloc(1, sizeof(struct stream));
+	uint32_t length;
+	if (!s) {
+		exit(99);
+	}
+
+	/* every length shorter than the fixed header */
+	for (length = 0; length < ENTRY_HEADER_SIZE; length++) {
+		unsigned char *prefix = stream_reserve(s, ENTRY_PREFIX_SIZE + length);
+		prefix[0] = ENTRY_MARKER;
+		put_le(prefix + 1, length, 4);
+		add_malformed(s);
+	}
+	add_valid_entry(s, "after short entries");
+
+	int res = run_stream("short entries", s);
+	free(s);
+	return res;
+}
+
+static int check_string_sizes(void)
+{
+	static const struct {
+		const char *name;
+		int offset;
+		int size;
+	} fields[] = {
+		{ "image name", ENTRY_OFFSET_IMAGE_NAME_SIZE, 2 },
+		{ "message", ENTRY_OFFSET_MESSAGE_SIZE, 2 },
+		{ "subsystem", ENTRY_OFFSET_SUBSYSTEM_SIZE, 4 },
+		{ "category", ENTRY_OFFSET_CATEGORY_SIZE, 4 }
+	};
+	struct stream *s = (struct stream*)calloc(1, sizeof(struct stream));
+	unsigned int f;
+	if (!s) {
+		exit(99);
+	}
+
+	add_valid_entry(s, "before");
+	for (f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+		uint64_t max = (fields[f].size == 2) ? 0xFFFF : 0xFFFFFFFF;
+		uint64_t sizes[3];
+		unsigned int i;
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			unsigned char *entry = add_entry(s, "message", "com.example.test", "general");
+			uint32_t available = bytes_from_field(entry, fields[f].offset);
+			/* one byte past the end of the entry, into the following entry, and the field maximum */
+			sizes[0] = available + 1;
+			sizes[1] = available + ENTRY_PREFIX_SIZE + ENTRY_HEADER_SIZE;
+			sizes[2] = max;
+			put_le(entry + fields[f].offset, sizes[i], fields[f].size);
+			add_malformed(s);
+			add_valid_entry(s, fields[f].name);
+		}
+	}
+
+	/* a filename without terminator */
+	unsigned char *entry = add_entry(s, NULL, NULL, NULL);
+	put_le(entry + ENTRY_OFFSET_IMAGE_NAME_SIZE, 0, 2);
+	memset(entry + ENTRY_HEADER_SIZE, 'x', s->data + s->length - (entry + ENTRY_HEADER_SIZE));
+	add_malformed(s);
+	add_valid_entry(s, "after filename");
+
+	int res = run_stream("string sizes", s);
+	free(s);
+	return res;
+}
+
+static int check_markers(void)
+{
+	struct stream *s = (struct stream*)calloc(1, sizeof(struct stream));
+	if (!s) {
+		exit(99);
+	}
+
+	/* a stray byte is skipped to resynchronize */
+	stream_reserve(s, 1)[0] = 0x7f;
+	add_malformed(s);
+	add_valid_entry(s, "after stray byte");
+
+	int res = run_stream("entry markers", s);
+	free(s);
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+
+	(void)argc;
+	(void)argv;
+
+	if (check_valid() < 0) {
+		failed = 1;
+	}
+	if (check_short_entries() < 0) {
+		failed = 1;
+	}
+	if (check_string_sizes() < 0) {
+		failed = 1;
+	}
+	if (check_markers() < 0) {
+		failed = 1;
+	}
+
+	if (!failed) {
+		printf("PASS: os_trace_relay rejects entries with strings larger than the entry\n");
+	}
+	return failed;
+}
@@ -0,0 +1,366 @@
+/*
+ * screenshotr_bplist.c
+ * Checks the binary plist reader that locates screenshot data in place
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* the reader is not exported by the library, so the test is built with its source */
+#include "src/screenshotr_bplist.c"
+
+#define MESSAGE_BUFFER_SIZE 4096
+
+/*
+ * The ScreenShotReply message is built by hand as
+ *   [ "DLMessageProcessMessage", { MessageType: "ScreenShotReply", ScreenShotData: <data> } ]
+ * with the objects in this order. Every malformed variant must be rejected,
+ * so the caller falls back to regular parsing. Each message is checked from
+ * an exactly sized heap copy, so out of bounds reads show up under valgrind
+ * or AddressSanitizer.
+ */
+
+enum {
+	REPLY_TOP,
+	REPLY_NAME,
+	REPLY_DICT,
+	REPLY_KEY_TYPE,
+	REPLY_KEY_DATA,
+	REPLY_TYPE,
+	REPLY_DATA,
+	REPLY_COUNT
+};
+
+struct message {
+	unsigned char data[MESSAGE_BUFFER_SIZE];
+	uint32_t length;
+	uint32_t objects[REPLY_COUNT];
+	uint32_t offset_table;
+	uint8_t offset_size;
+	uint8_t ref_size;
+	uint32_t image_offset;
+	uint32_t image_size;
+};
+
+static void put_uint(unsigned char *p, uint64_t value, uint8_t size)
+{
+	while (size > 0) {
+		size--;
+		p[size] = (unsigned char)value;
+		value >>= 8;
+	}
+}
+
+static void add_bytes(struct message *msg, const void *data, uint32_t length)
+{
+	if (msg->length + length > sizeof(msg->data)) {
+		fprintf(stderr, "ERROR: Test message too large\n");
+		exit(99);
+	}
+	memcpy(msg->data + msg->length, data, length);
+	msg->length += length;
+}
+
+static void add_marker(struct message *msg, int obj, uint8_t type, uint32_t count)
+{
+	unsigned char m[4];
+	msg->objects[obj] = msg->length;
+	if (count < 15) {
+		m[0] = (type << 4) | count;
+		add_bytes(msg, m, 1);
+	} else if (count < 256) {
+		m[0] = (type << 4) | 0x0f;
+		m[1] = 0x10;
+		m[2] = count;
+		add_bytes(msg, m, 3);
+	} else {
+		m[0] = (type << 4) | 0x0f;
+		m[1] = 0x11;
+		put_uint(m + 2, count, 2);
+		add_bytes(msg, m, 4);
+	}
+}
+
+static void add_string(struct message *msg, int obj, const char *str)
+{
+	add_marker(msg, obj, BPLIST_STRING, strlen(str));
+	add_bytes(msg, str, strlen(str));
+}
+
+static void add_refs(struct message *msg, const int *refs, int count)
+{
+	unsigned char r[8];
+	int i;
+	for (i = 0; i < count; i++) {
+		put_uint(r, refs[i], msg->ref_size);
+		add_bytes(msg, r, msg->ref_size);
+	}
+}
+
+static void build_reply(struct message *msg, uint32_t image_size, uint8_t offset_size, uint8_t ref_size)
+{
+	static const int top_refs[] = { REPLY_NAME, REPLY_DICT };
+	static const int dict_refs[] = { REPLY_KEY_TYPE, REPLY_KEY_DATA, REPLY_TYPE, REPLY_DATA };
+	unsigned char trailer[BPLIST_TRAILER_SIZE];
+	unsigned char entry[8];
+	uint32_t i;
+
+	memset(msg, '\0', sizeof(struct message));
+	msg->offset_size = offset_size;
+	msg->ref_size = ref_size;
+	add_bytes(msg, "bplist00", 8);
+
+	add_marker(msg, REPLY_TOP, BPLIST_ARRAY, 2);
+	add_refs(msg, top_refs, 2);
+	add_string(msg, REPLY_NAME, "DLMessageProcessMessage");
+	add_marker(msg, REPLY_DICT, BPLIST_DICT, 2);
+	add_refs(msg, dict_refs, 4);
+	add_string(msg, REPLY_KEY_TYPE, "MessageType");
+	add_string(msg, REPLY_KEY_DATA, "ScreenShotData");
+	add_string(msg, REPLY_TYPE, "ScreenShotReply");
+	add_marker(msg, REPLY_DATA, BPLIST_DATA, image_size);
+	msg->image_offset = msg->length;
+	msg->image_size = image_size;
+	for (i = 0; i < image_size; i++) {
+		unsigned char c = (unsigned char)(i * 7 + 1);
+		add_bytes(msg, &c, 1);
+	}
+
+	msg->offset_table = msg->length;
+	for (i = 0; i < REPLY_COUNT; i++) {
+		put_uint(entry, msg->objects[i], offset_size);
+		add_bytes(msg, entry, offset_size);
+	}
+
+	memset(trailer, '\0', sizeof(trailer));
+	trailer[6] = offset_size;
+	trailer[7] = ref_size;
+	put_uint(trailer + 8, REPLY_COUNT, 8);
+	put_uint(trailer + 16, REPLY_TOP, 8);
+	put_uint(trailer + 24, msg->offset_table, 8);
+	add_bytes(msg, trailer, sizeof(trailer));
+}
+
+static unsigned char* trailer_of(struct message *msg)
+{
+	return msg->data + msg->length - BPLIST_TRAILER_SIZE;
+}
+
+static int check_message(const char *what, const struct message *msg, uint32_t length, int valid)
+{
+	char *copy = (char*)malloc((length > 0) ? length : 1);
+	uint64_t offset = 0;
+	uint64_t size = 0;
+	int failed = 0;
+
+	if (!copy) {
+		exit(99);
+	}
+	memcpy(copy, msg->data, length);
+	int res = screenshotr_find_image_data(copy, length, &offset, &size);
+	if (valid) {
+		if (res != 0 || offset != msg->image_offset || size != msg->image_size) {
+			fprintf(stderr, "FAIL: %s: image data not found (%d, offset %llu, size %llu)\n", what, res, (unsigned long long)offset, (unsigned long long)size);
+			failed = 1;
+		}
+	} else if (res != -1) {
+		fprintf(stderr, "FAIL: %s: accepted with offset %llu and size %llu in %u bytes\n", what, (unsigned long long)offset, (unsigned long long)size, length);
+		failed = 1;
+	}
+	free(copy);
+
+	return (failed) ? -1 : 0;
+}
+
+static int check_valid(void)
+{
+	struct message msg;
+	int failed = 0;
+
+	build_reply(&msg, 0, 1, 1);
+	failed |= check_message("empty image", &msg, msg.length, 1);
+	build_reply(&msg, 100, 1, 1);
+	failed |= check_message("1 byte offsets", &msg, msg.length, 1);
+	build_reply(&msg, 1000, 2, 2);
+	failed |= check_message("2 byte offsets", &msg, msg.length, 1);
+	build_reply(&msg, 1000, 8, 8);
+	failed |= check_message("8 byte offsets", &msg, msg.length, 1);
+
+	return failed;
+}
+
+static int check_truncated(void)
+{
+	struct message msg;
+	uint32_t cut;
+	int failed = 0;
+
+	/* every prefix, which cuts through the trailer and then the offset table and objects */
+	build_reply(&msg, 100, 1, 1);
+	for (cut = 0; cut < msg.length; cut++) {
+		failed |= check_message("truncated message", &msg, cut, 0);
+	}
+
+	return failed;
+}
+
+static int check_trailer(void)
+{
+	struct message msg;
+	int failed = 0;
+
+	build_reply(&msg, 100, 1, 1);
+	trailer_of(&msg)[6] = 0;
+	failed |= check_message("offset size 0", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	trailer_of(&msg)[6] = 9;
+	failed |= check_message("offset size 9", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	trailer_of(&msg)[7] = 0;
+	failed |= check_message("reference size 0", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	trailer_of(&msg)[7] = 9;
+	failed |= check_message("reference size 9", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	put_uint(trailer_of(&msg) + 8, REPLY_COUNT + 1, 8);
+	failed |= check_message("object count past the offset table", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	put_uint(trailer_of(&msg) + 8, UINT64_MAX, 8);
+	failed |= check_message("object count overflow", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	put_uint(trailer_of(&msg) + 16, REPLY_COUNT, 8);
+	failed |= check_message("top object out of range", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	put_uint(trailer_of(&msg) + 24, 7, 8);
+	failed |= check_message("offset table in the header", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	put_uint(trailer_of(&msg) + 24, msg.length - BPLIST_TRAILER_SIZE + 1, 8);
+	failed |= check_message("offset table in the trailer", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	put_uint(trailer_of(&msg) + 24, UINT64_MAX, 8);
+	failed |= check_message("offset table overflow", &msg, msg.length, 0);
+
+	return failed;
+}
+
+static int check_offset_table(void)
+{
+	struct message msg;
+	char what[64];
+	int obj;
+	int failed = 0;
+
+	for (obj = 0; obj < REPLY_COUNT; obj++) {
+		uint8_t sizes[] = { 1, 2, 8 };
+		unsigned int s;
+		for (s = 0; s < sizeof(sizes); s++) {
+			uint64_t values[5];
+			unsigned int v;
+			build_reply(&msg, 100, sizes[s], 1);
+			values[0] = 0;
+			values[1] = 7;
+			values[2] = msg.offset_table;
+			values[3] = msg.length - 1;
+			values[4] = (sizes[s] == 8) ? UINT64_MAX : (1ULL << (sizes[s] * 8)) - 1;
+			for (v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+				build_reply(&msg, 100, sizes[s], 1);
+				put_uint(msg.data + msg.offset_table + obj * sizes[s], values[v], sizes[s]);
+				snprintf(what, sizeof(what), "object %d at offset %llu", obj, (unsigned long long)values[v]);
+				failed |= check_message(what, &msg, msg.length, 0);
+			}
+		}
+	}
+
+	return failed;
+}
+
+static int check_objects(void)
+{
+	struct message msg;
+	int failed = 0;
+
+	/* reference past the object count */
+	build_reply(&msg, 100, 1, 1);
+	msg.data[msg.objects[REPLY_DICT] + 4] = REPLY_COUNT;
+	failed |= check_message("dictionary value out of range", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	msg.data[msg.objects[REPLY_TOP] + 2] = 0xff;
+	failed |= check_message("array item out of range", &msg, msg.length, 0);
+
+	/* counts that run into the offset table */
+	build_reply(&msg, 100, 1, 1);
+	msg.data[msg.objects[REPLY_DATA] + 2] = 101;
+	failed |= check_message("data past the offset table", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	msg.data[msg.objects[REPLY_DICT]] = (BPLIST_DICT << 4) | 14;
+	failed |= check_message("dictionary past the offset table", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	msg.data[msg.objects[REPLY_DATA] + 1] = 0x13;
+	failed |= check_message("8 byte data count", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	msg.data[msg.objects[REPLY_DATA] + 1] = 0x14;
+	failed |= check_message("16 byte data count", &msg, msg.length, 0);
+
+	build_reply(&msg, 100, 1, 1);
+	msg.data[msg.objects[REPLY_DATA] + 1] = 0x20;
+	failed |= check_message("data count not an integer", &msg, msg.length, 0);
+
+	/* count marker as the last byte before the offset table */
+	build_reply(&msg, 0, 1, 1);
+	msg.data[msg.objects[REPLY_DATA]] = (BPLIST_DATA << 4) | 0x0f;
+	failed |= check_message("data count missing", &msg, msg.length, 0);
+
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+
+	(void)argc;
+	(void)argv;
+
+	failed |= check_valid();
+	failed |= check_truncated();
+	failed |= check_trailer();
+	failed |= check_offset_table();
+	failed |= check_objects();
+
+	if (!failed) {
+		printf("PASS: screenshotr binary plist reader rejects malformed replies\n");
+	}
+	return (failed) ? 1 : 0;
+}
@@ -29,12 +29,316 @@
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <signal.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
+#include "common/thread.h"
 
 #define MODE_NONE 0
 #define MODE_SHOW_ID 1
 #define MODE_LIST_DEVICES 2
+#define MODE_WATCH 3
+
+/* number of threads resolving device names at the same time */
+#define NAME_RESOLVERS 16
+
+static int quit_flag = 0;
+
+static void clean_exit(int sig)
+{
+	quit_flag++;
+}
+
+static mutex_t name_mutex;
+static plist_t name_cache = NULL;
+
+/* connection types are cached separately as the same device can show up twice */
+static const char* cache_key(const char *udid, enum idevice_connection_type conn_type, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s%s", udid, (conn_type == CONNECTION_NETWORK) ? "/net" : "");
+	return buf;
+}
+
+/**
+ * Returns the name of a device, connecting to it only if the name is not
+ * cached yet. The returned string has to be freed by the caller.
+ */
+static char* resolve_device_name(const char *udid, enum idevice_connection_type conn_type)
+{
+	char key[256];
+	char *name = NULL;
+
+	cache_key(udid, conn_type, key, sizeof(key));
+	mutex_lock(&name_mutex);
+	plist_t node = plist_dict_get_item(name_cache, key);
+	if (node) {
+		plist_get_string_val(node, &name);
+	}
+	mutex_unlock(&name_mutex);
+	if (name) {
+		return name;
+	}
+
+	idevice_t device = NULL;
+	lockdownd_client_t client = NULL;
+	idevice_new_with_options(&device, udid, (conn_type == CONNECTION_NETWORK) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
+	if (device && lockdownd_client_new(device, &client, TOOL_NAME) == LOCKDOWN_E_SUCCESS) {
+		lockdownd_get_device_name(client, &name);
+		lockdownd_client_free(client);
+	}
+	idevice_free(device);
+
+	if (name) {
+		mutex_lock(&name_mutex);
+		plist_dict_set_item(name_cache, key, plist_new_string(name));
+		mutex_unlock(&name_mutex);
+	}
+	return name;
+}
+
+/* returns a cached name without connecting to the device, or NULL */
+static char* cached_device_name(const char *udid, enum idevice_connection_type conn_type)
+{
+	char key[256];
+	char *name = NULL;
+	mutex_lock(&name_mutex);
+	plist_t node = plist_dict_get_item(name_cache, cache_key(udid, conn_type, key, sizeof(key)));
+	if (node) {
+		plist_get_string_val(node, &name);
+	}
+	mutex_unlock(&name_mutex);
+	return name;
+}
+
+static void print_device_line(const char *prefix, const char *udid, enum idevice_connection_type conn_type, int show_type, const char *name)
+{
+	mutex_lock(&name_mutex);
+	printf("%s%s", prefix, udid);
+	if (show_type) {
+		printf((conn_type == CONNECTION_NETWORK) ? " (Network)" : " (USB)");
+	}
+	if (name) {
+		printf(" %s", name);
+	}
+	printf("\n");
+	fflush(stdout);
+	mutex_unlock(&name_mutex);
+}
+
+struct name_job {
+	struct name_job *next;
+	char *udid;
+	enum idevice_connection_type conn_type;
+};
+
+struct name_queue {
+	mutex_t mutex;
+	cond_t cond;
+	struct name_job *head;
+	struct name_job *tail;
+	int stop;
+	int show_type;
+};
+
+static void* name_resolver_thread(void *arg)
+{
+	struct name_queue *queue = (struct name_queue*)arg;
+	while (1) {
+		mutex_lock(&queue->mutex);
+		while (!queue->head && !queue->stop) {
+			cond_wait(&queue->cond, &queue->mutex);
+		}
+		struct name_job *job = queue->head;
+		if (!job) {
+			mutex_unlock(&queue->mutex);
+			break;
+		}
+		queue->head = job->next;
+		if (!queue->head) {
+			queue->tail = NULL;
+		}
+		mutex_unlock(&queue->mutex);
+
+		char *name = resolve_device_name(job->udid, job->conn_type);
+		print_device_line("+ ", job->udid, job->conn_type, queue->show_type, name);
+		free(name);
+		free(job->udid);
+		free(job);
+	}
+	return NULL;
+}
+
+struct watch_context {
+	int include_usb;
+	int include_network;
+	int show_names;
+	struct name_queue *queue;
+};
+
+static void device_event_cb(const idevice_event_t *event, void *user_data)
+{
+	struct watch_context *ctx = (struct watch_context*)user_data;
+	int show_type = (ctx->include_usb && ctx->include_network);
+
+	if (event->conn_type == CONNECTION_USBMUXD && !ctx->include_usb) return;
+	if (event->conn_type == CONNECTION_NETWORK && !ctx->include_network) return;
+
+	if (event->event == IDEVICE_DEVICE_ADD) {
+		if (!ctx->show_names) {
+			print_device_line("+ ", event->udid, event->conn_type, show_type, NULL);
+			return;
+		}
+		char *name = cached_device_name(event->udid, event->conn_type);
+		if (name) {
+			print_device_line("+ ", event->udid, event->conn_type, show_type, name);
+			free(name);
+			return;
+		}
+		/* resolve in the background so further events are not held up */
+		struct name_job *job = (struct name_job*)calloc(1, sizeof(struct name_job));
+		job->udid = strdup(event->udid);
+		job->conn_type = event->conn_type;
+		mutex_lock(&ctx->queue->mutex);
+		if (ctx->queue->tail) {
+			ctx->queue->tail->next = job;
+		} else {
+			ctx->queue->head = job;
+		}
+		ctx->queue->tail = job;
+		cond_signal(&ctx->queue->cond);
+		mutex_unlock(&ctx->queue->mutex);
+	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
+		char *name = (ctx->show_names) ? cached_device_name(event->udid, event->conn_type) : NULL;
+		print_device_line("- ", event->udid, event->conn_type, show_type, name);
+		free(name);
+	}
+}
+
+static int watch_devices(int include_usb, int include_network, int show_names)
+{
+	struct name_queue queue;
+	struct watch_context ctx;
+	idevice_subscription_context_t subscription = NULL;
+	THREAD_T resolvers[NAME_RESOLVERS];
+	int num_resolvers = 0;
+	int i;
+
+	memset(&queue, '\0', sizeof(queue));
+	mutex_init(&queue.mutex);
+	cond_init(&queue.cond);
+	queue.show_type = (include_usb && include_network);
+	if (show_names) {
+		for (i = 0; i < NAME_RESOLVERS; i++) {
+			if (thread_new(&resolvers[num_resolvers], name_resolver_thread, &queue) != 0) {
+				break;
+			}
+			num_resolvers++;
+		}
+	}
+
+	ctx.include_usb = include_usb;
+	ctx.include_network = include_network;
+	ctx.show_names = (show_names && num_resolvers > 0);
+	ctx.queue = &queue;
+
+	int res = 0;
+	if (idevice_events_subscribe(&subscription, device_event_cb, &ctx) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to subscribe to device events!\n");
+		res = -1;
+	} else {
+		while (!quit_flag) {
+#ifdef WIN32
+			Sleep(100);
+#else
+			usleep(100000);
+#endif
+		}
+		idevice_events_unsubscribe(subscription);
+	}
+
+	mutex_lock(&queue.mutex);
+	queue.stop = 1;
+	mutex_unlock(&queue.mutex);
+	for (i = 0; i < num_resolvers; i++) {
+		/* wake every resolver up so it sees the stop flag */
+		mutex_lock(&queue.mutex);
+		cond_signal(&queue.cond);
+		mutex_unlock(&queue.mutex);
+	}
+	for (i = 0; i < num_resolvers; i++) {
+		thread_join(resolvers[i]);
+		thread_free(resolvers[i]);
+	}
+	while (queue.head) {
+		struct name_job *job = queue.head;
+		queue.head = job->next;
+		free(job->udid);
+		free(job);
+	}
+	cond_destroy(&queue.cond);
+	mutex_destroy(&queue.mutex);
+
+	return res;
+}
+
+struct name_list {
+	idevice_info_t *devices;
+	int count;
+	int next;
+	char **names;
+	mutex_t mutex;
+};
+
+static void* name_list_worker(void *arg)
+{
+	struct name_list *list = (struct name_list*)arg;
+	while (1) {
+		mutex_lock(&list->mutex);
+		int idx = list->next++;
+		mutex_unlock(&list->mutex);
+		if (idx >= list->count) {
+			break;
+		}
+		list->names[idx] = resolve_device_name(list->devices[idx]->udid, list->devices[idx]->conn_type);
+	}
+	return NULL;
+}
+
+/* resolves the names of all devices in the list with parallel connections */
+static char** resolve_device_names(idevice_info_t *devices, int count)
+{
+	struct name_list list;
+	THREAD_T workers[NAME_RESOLVERS];
+	int started = 0;
+	int i;
+
+	list.devices = devices;
+	list.count = count;
+	list.next = 0;
+	list.names = (char**)calloc(count + 1, sizeof(char*));
+	mutex_init(&list.mutex);
+
+	int num_workers = (count < NAME_RESOLVERS) ? count : NAME_RESOLVERS;
+	for (i = 1; i < num_workers; i++) {
+		if (thread_new(&workers[started], name_list_worker, &list) != 0) {
+			break;
+		}
+		started++;
+	}
+	name_list_worker(&list);
+	for (i = 0; i < started; i++) {
+		thread_join(workers[i]);
+		thread_free(workers[i]);
+	}
+	mutex_destroy(&list.mutex);
+
+	return list.names;
+}
 
 static void print_usage(int argc, char **argv, int is_error)
 {
@@ -51,6 +355,8 @@ static void print_usage(int argc, char **argv, int is_error)
 		"OPTIONS:\n" \
 		"  -l, --list      list UDIDs of all devices attached via USB\n" \
 		"  -n, --network   list UDIDs of all devices available via network\n" \
+		"  -N, --names     also print the device names, resolved in parallel\n" \
+		"  -w, --watch     print devices as they are attached (+) or detached (-)\n" \
 		"  -d, --debug     enable communication debugging\n" \
 		"  -h, --help      prints usage information\n" \
 		"  -v, --version   prints version information\n" \
@@ -71,6 +377,8 @@ int main(int argc, char **argv)
 	int mode = MODE_LIST_DEVICES;
 	int include_usb = 0;
 	int include_network = 0;
+	int show_names = 0;
+	int watch = 0;
 	const char* udid = NULL;
 
 	int c = 0;
@@ -79,11 +387,13 @@ int main(int argc, char **argv)
 		{ "help",  no_argument, NULL, 'h' },
 		{ "list",  no_argument, NULL, 'l' },
 		{ "network", no_argument, NULL, 'n' },
+		{ "names", no_argument, NULL, 'N' },
+		{ "watch", no_argument, NULL, 'w' },
 		{ "version", no_argument, NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "dhlnv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhlnNwv", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -99,6 +409,12 @@ int main(int argc, char **argv)
 			mode = MODE_LIST_DEVICES;
 			include_network = 1;
 			break;
+		case 'N':
+			show_names = 1;
+			break;
+		case 'w':
+			watch = 1;
+			break;
 		case 'v':
 			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
 			return 0;
@@ -112,12 +428,18 @@ int main(int argc, char **argv)
 
 	if (argc == 1) {
 		mode = MODE_SHOW_ID;
-	} else if (argc == 0 && optind == 1) {
+	} else if (argc == 0 && !include_usb && !include_network) {
 		include_usb = 1;
 		include_network = 1;
 	}
+	if (watch && mode != MODE_SHOW_ID) {
+		mode = MODE_WATCH;
+	}
 	udid = argv[0];
 
+	mutex_init(&name_mutex);
+	name_cache = plist_new_dict();
+
 	switch (mode) {
 	case MODE_SHOW_ID:
 		idevice_new_with_options(&device, udid, IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK);
@@ -155,6 +477,25 @@ int main(int argc, char **argv)
 			fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
 			return -1;
 		}
+		if (show_names) {
+			/* only resolve the devices that will be listed */
+			int count = 0;
+			idevice_info_t *listed = (idevice_info_t*)malloc(sizeof(idevice_info_t) * (i + 1));
+			for (i = 0; dev_list[i] != NULL; i++) {
+				if (dev_list[i]->conn_type == CONNECTION_USBMUXD && !include_usb) continue;
+				if (dev_list[i]->conn_type == CONNECTION_NETWORK && !include_network) continue;
+				listed[count++] = dev_list[i];
+			}
+			char **names = resolve_device_names(listed, count);
+			for (i = 0; i < count; i++) {
+				print_device_line("", listed[i]->udid, listed[i]->conn_type, include_usb && include_network, names[i]);
+				free(names[i]);
+			}
+			free(names);
+			free(listed);
+			idevice_device_list_extended_free(dev_list);
+			break;
+		}
 		for (i = 0; dev_list[i] != NULL; i++) {
 			if (dev_list[i]->conn_type == CONNECTION_USBMUXD && !include_usb) continue;
 			if (dev_list[i]->conn_type == CONNECTION_NETWORK && !include_network) continue;
@@ -170,6 +511,17 @@ int main(int argc, char **argv)
 		}
 		idevice_device_list_extended_free(dev_list);
 		break;
+
+	case MODE_WATCH:
+		signal(SIGINT, clean_exit);
+		signal(SIGTERM, clean_exit);
+#ifndef WIN32
+		signal(SIGPIPE, SIG_IGN);
+#endif
+		ret = watch_devices(include_usb, include_network, show_names);
+		break;
 	}
+	plist_free(name_cache);
+	mutex_destroy(&name_mutex);
 	return ret;
 }
@@ -1028,10 +1028,13 @@ int main(int argc, char *argv[])
 			char *format_size = NULL;
 			int is_manifest = 0;
 			uint8_t b = 0;
+			const char *file_data = NULL;
+			uint64_t file_data_length = 0;
+			FILE *mddata_file = NULL;
 
 			/* process series of DLSendFile messages */
 			do {
-				mobilebackup_receive(mobilebackup, &message);
+				mobilebackup_receive_file_data(mobilebackup, &message, &file_data, &file_data_length);
 				if (!message) {
 					printf("Device is not ready yet. Going to try again in 2 seconds...\n");
 					sleep(2);
@@ -1121,34 +1124,40 @@ int main(int argc, char *argv[])
 				}
 
 				/* save <hash>.mddata */
-				node = plist_dict_get_item(node_tmp, "BackupFileInfo");
 				if (node_tmp) {
-					node = plist_dict_get_item(node_tmp, "DLFileDest");
-					plist_get_string_val(node, &file_path);
-
-					filename_mddata = mobilebackup_build_path(backup_directory, file_path, is_manifest ? NULL: ".mddata");
-
-					/* if this is the first hunk, remove any existing file */
-					if ((hunk_index == 0) && (stat(filename_mddata, &st) == 0))
-						remove(filename_mddata);
+					/* the first hunk replaces any existing file, the following ones are appended */
+					if (hunk_index == 0) {
+						node = plist_dict_get_item(node_tmp, "DLFileDest");
+						plist_get_string_val(node, &file_path);
 
-					/* get file data hunk */
-					node_tmp = plist_array_get_item(message, 1);
-					plist_get_data_val(node_tmp, &buffer, &length);
+						if (mddata_file)
+							fclose(mddata_file);
+						free(filename_mddata);
+						filename_mddata = mobilebackup_build_path(backup_directory, file_path, is_manifest ? NULL: ".mddata");
+						mddata_file = fopen(filename_mddata, "wb");
+						if (!mddata_file)
+							printf("ERROR: could not open %s for writing: %s\n", filename_mddata, strerror(errno));
+					}
 
-					buffer_write_to_filename(filename_mddata, buffer, length);
+					/* write the file data hunk straight from the received message */
+					if (mddata_file && (file_data_length > 0) && (fwrite(file_data, 1, file_data_length, mddata_file) != file_data_length))
+						printf("ERROR: could not write to %s: %s\n", filename_mddata, strerror(errno));
 					if (!is_manifest)
-						file_size_current += length;
+						file_size_current += file_data_length;
 
-					/* activate currently sent manifest */
-					if ((file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) && (is_manifest)) {
-						rename(filename_mddata, manifest_path);
-					}
+					if (file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) {
+						if (mddata_file) {
+							fclose(mddata_file);
+							mddata_file = NULL;
+						}
 
-					free(buffer);
-					buffer = NULL;
+						/* activate currently sent manifest */
+						if (is_manifest)
+							rename(filename_mddata, manifest_path);
 
-					free(filename_mddata);
+						free(filename_mddata);
+						filename_mddata = NULL;
+					}
 				}
 
 				if ((!is_manifest)) {
@@ -1195,6 +1204,11 @@ files_out:
 				}
 			} while (1);
 
+			if (mddata_file)
+				fclose(mddata_file);
+			free(filename_mddata);
+			filename_mddata = NULL;
+
 			printf("Received %d files from device.\n", file_index);
 
 			if (!quit_flag && !plist_strcmp(node, "DLMessageProcessMessage")) {
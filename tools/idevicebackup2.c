@@ -26,6 +26,9 @@
 
 #define TOOL_NAME "idevicebackup2"
 
+/* for copy_file_range() */
+#define _GNU_SOURCE 1
+#define __USE_GNU 1
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -36,6 +39,7 @@
 #include <libgen.h>
 #include <ctype.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -46,9 +50,20 @@
 #include <libimobiledevice/sbservices.h>
 #include <libimobiledevice/diagnostics_relay.h>
 #include "common/utils.h"
+#include "common/thread.h"
 
 #include <endianness.h>
 
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#else
+#include <gcrypt.h>
+#endif
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+
 #define LOCK_ATTEMPTS 50
 #define LOCK_WAIT 200000
 
@@ -62,6 +77,17 @@
 #else
 #include <termios.h>
 #include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_CLONEFILE
+#include <sys/clonefile.h>
+#endif
 #endif
 #include <sys/stat.h>
 
@@ -70,9 +96,37 @@
 #define CODE_ERROR_REMOTE 0x0b
 #define CODE_FILE_DATA 0x0c
 
+#ifdef WIN32
+#define MB2_THREAD_LOCAL __declspec(thread)
+#else
+#define MB2_THREAD_LOCAL __thread
+#endif
+
 static int verbose = 1;
 static int quit_flag = 0;
 
+/* set when backing up or restoring all attached devices at once with --all */
+static int multi_device = 0;
+
+/*
+ * Per device state. Everything touched while talking to a device is thread
+ * local so that --all can run one backup per thread. The notification
+ * callback runs on the notifier thread and gets a pointer to this.
+ */
+struct mb2_device_state {
+	int quit;
+	int backup_domain_changed;
+	const char *udid;
+	double *progress;
+};
+
+static MB2_THREAD_LOCAL struct mb2_device_state device_state;
+
+static int mb2_quit_requested(void)
+{
+	return quit_flag || device_state.quit;
+}
+
 #define PRINT_VERBOSE(min_level, ...) if (verbose >= min_level) { printf(__VA_ARGS__); };
 
 enum cmd_mode {
@@ -83,7 +137,8 @@ enum cmd_mode {
 	CMD_UNBACK,
 	CMD_CHANGEPW,
 	CMD_LEAVE,
-	CMD_CLOUD
+	CMD_CLOUD,
+	CMD_INDEX
 };
 
 enum cmd_flags {
@@ -101,23 +156,472 @@ enum cmd_flags {
 	CMD_FLAG_RESTORE_SKIP_APPS          = (1 << 12)
 };
 
-static int backup_domain_changed = 0;
-static uint64_t expected_space = 0;
-static uint64_t available_space = 0;
+static MB2_THREAD_LOCAL uint64_t expected_space = 0;
+static MB2_THREAD_LOCAL uint64_t available_space = 0;
 
 // Minimum allowed free space when checking what's available: 5GB
 static uint64_t min_free_space = 5368709120;
 
+#define TRANSFER_BLOCK_SIZE_DEFAULT (1024*1024)
+#define TRANSFER_BLOCK_SIZE_MIN 4096
+#define TRANSFER_BLOCK_SIZE_MAX (256*1024*1024)
+#define WRITER_BUFFERS 8
+#define WRITER_QUEUE_SIZE (WRITER_BUFFERS*2)
+
+// Size of the blocks file data is written to disk and sent to the device in
+static uint32_t transfer_block_size = TRANSFER_BLOCK_SIZE_DEFAULT;
+
+/*
+ * Time and bytes spent in the phases of a backup or restore, and per
+ * DLMessage type. The phases are updated from the writer and reader
+ * threads too, so they use atomic adds. Written as JSON with --stats.
+ */
+enum mb2_phase {
+	PHASE_WAIT,    /* waiting for the next message from the device */
+	PHASE_RECEIVE, /* receiving file data from the device */
+	PHASE_CREATE,  /* removing and creating files */
+	PHASE_WRITE,   /* writing and closing files */
+	PHASE_READ,    /* reading files for the device */
+	PHASE_SEND,    /* sending file data to the device */
+	PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = { "wait", "receive", "create", "write", "read", "send" };
+
+struct mb2_phase_stats {
+	uint64_t count;
+	uint64_t time_us;
+	uint64_t bytes;
+};
+
+struct mb2_message_stats {
+	char *name;
+	uint64_t count;
+	uint64_t time_us;
+};
+
+static struct mb2_phase_stats phase_stats[PHASE_COUNT];
+static struct mb2_message_stats *message_stats = NULL;
+static uint32_t num_message_stats = 0;
+
+static uint64_t stats_now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void stats_add_phase(enum mb2_phase phase, uint64_t start_us, uint64_t bytes)
+{
+	uint64_t now = stats_now_us();
+	__sync_add_and_fetch(&phase_stats[phase].count, 1);
+	__sync_add_and_fetch(&phase_stats[phase].time_us, (now > start_us) ? now - start_us : 0);
+	__sync_add_and_fetch(&phase_stats[phase].bytes, bytes);
+}
+
+/* only called from the main thread */
+static void stats_add_message(const char *name, uint64_t start_us)
+{
+	uint64_t now = stats_now_us();
+	uint32_t i;
+
+	for (i = 0; i < num_message_stats; i++) {
+		if (!strcmp(message_stats[i].name, name)) {
+			break;
+		}
+	}
+	if (i == num_message_stats) {
+		struct mb2_message_stats *new_stats = (struct mb2_message_stats*)realloc(message_stats, sizeof(struct mb2_message_stats) * (num_message_stats + 1));
+		if (!new_stats) {
+			return;
+		}
+		message_stats = new_stats;
+		message_stats[i].name = strdup(name);
+		message_stats[i].count = 0;
+		message_stats[i].time_us = 0;
+		num_message_stats++;
+	}
+	message_stats[i].count++;
+	message_stats[i].time_us += (now > start_us) ? now - start_us : 0;
+}
+
+static void stats_write_json(const char *filename, idevice_t device, uint64_t start_us)
+{
+	idevice_connection_stats_t cstats;
+	uint64_t total_us = stats_now_us() - start_us;
+	uint32_t i;
+	FILE *f = (!strcmp(filename, "-")) ? stdout : fopen(filename, "w");
+
+	if (!f) {
+		printf("ERROR: Could not write statistics to '%s': %s\n", filename, strerror(errno));
+		return;
+	}
+
+	fprintf(f, "{\n  \"total_us\": %llu,\n  \"phases\": {\n", (unsigned long long)total_us);
+	for (i = 0; i < PHASE_COUNT; i++) {
+		double secs = (double)phase_stats[i].time_us / 1000000.0;
+		fprintf(f, "    \"%s\": { \"count\": %llu, \"time_us\": %llu, \"bytes\": %llu, \"bytes_per_second\": %.0f }%s\n",
+			phase_names[i], (unsigned long long)phase_stats[i].count, (unsigned long long)phase_stats[i].time_us,
+			(unsigned long long)phase_stats[i].bytes, (secs > 0) ? (double)phase_stats[i].bytes / secs : 0.0,
+			(i + 1 < PHASE_COUNT) ? "," : "");
+	}
+	fprintf(f, "  },\n  \"messages\": {\n");
+	for (i = 0; i < num_message_stats; i++) {
+		fprintf(f, "    \"%s\": { \"count\": %llu, \"time_us\": %llu }%s\n",
+			message_stats[i].name, (unsigned long long)message_stats[i].count, (unsigned long long)message_stats[i].time_us,
+			(i + 1 < num_message_stats) ? "," : "");
+	}
+	fprintf(f, "  }");
+	if (device && idevice_get_stats(device, &cstats) == IDEVICE_E_SUCCESS) {
+		fprintf(f, ",\n  \"connection\": { \"bytes_sent\": %llu, \"bytes_received\": %llu, \"send_blocked_us\": %llu, \"recv_blocked_us\": %llu }",
+			(unsigned long long)cstats.bytes_sent, (unsigned long long)cstats.bytes_received,
+			(unsigned long long)cstats.send_blocked_us, (unsigned long long)cstats.recv_blocked_us);
+	}
+	fprintf(f, "\n}\n");
+
+	if (f != stdout) {
+		fclose(f);
+	}
+}
+
+/*
+ * Global limit for the rate file data is read from and written to disk, shared
+ * by all devices. Each request reserves its share of the bandwidth right away
+ * and then sleeps until the reserved time has come. Since the reader and
+ * writer of a device only ever have one block in flight, the devices get
+ * served in turns of one block each.
+ */
+struct mb2_io_limit {
+	mutex_t mutex;
+	uint64_t rate;
+	uint64_t next_us;
+};
+
+static struct mb2_io_limit io_limit;
+static thread_once_t io_limit_once = THREAD_ONCE_INIT;
+
+static void mb2_io_limit_init(void)
+{
+	mutex_init(&io_limit.mutex);
+}
+
+static void mb2_io_limit_set(uint64_t rate)
+{
+	thread_once(&io_limit_once, mb2_io_limit_init);
+	mutex_lock(&io_limit.mutex);
+	io_limit.rate = rate;
+	mutex_unlock(&io_limit.mutex);
+}
+
+static void mb2_io_throttle(size_t bytes)
+{
+	uint64_t now, wait_us = 0;
+
+	if (io_limit.rate == 0 || bytes == 0) {
+		return;
+	}
+	mutex_lock(&io_limit.mutex);
+	now = stats_now_us();
+	if (io_limit.next_us < now) {
+		io_limit.next_us = now;
+	}
+	wait_us = io_limit.next_us - now;
+	io_limit.next_us += (uint64_t)bytes * 1000000 / io_limit.rate;
+	mutex_unlock(&io_limit.mutex);
+
+	if (wait_us > 0) {
+#ifdef WIN32
+		Sleep((DWORD)(wait_us / 1000));
+#else
+		usleep((useconds_t)wait_us);
+#endif
+	}
+}
+
+/*
+ * Read cache for restores, shared by all devices. The first reader of a file
+ * loads it into memory block by block while sending it, the readers of the
+ * other devices copy the blocks from there as soon as they have been read,
+ * so restoring the same backup to several devices reads every file from
+ * disk once. Loaded files stay cached up to the configured size and the
+ * least recently used ones are dropped first. Files larger than a quarter
+ * of the cache are always read from disk.
+ */
+#define READ_CACHE_HASH_SIZE 1024
+#define READ_CACHE_DEFAULT (256*1024*1024)
+
+/* a reader waiting for more of a file to be loaded, signalled on its own */
+struct mb2_read_cache_waiter {
+	cond_t cond;
+	struct mb2_read_cache_waiter *next;
+};
+
+struct mb2_read_cache_entry {
+	char *path;
+	uint64_t size;
+	int64_t mtime;
+	char *data;
+	uint64_t loaded;
+	int error;
+	int detached;
+	uint32_t refs;
+	struct mb2_read_cache_waiter *waiters;
+	struct mb2_read_cache_entry *next;
+	struct mb2_read_cache_entry *lru_prev;
+	struct mb2_read_cache_entry *lru_next;
+};
+
+struct mb2_read_cache {
+	mutex_t mutex;
+	uint64_t limit;
+	uint64_t used;
+	struct mb2_read_cache_entry *buckets[READ_CACHE_HASH_SIZE];
+	struct mb2_read_cache_entry *lru_head;
+	struct mb2_read_cache_entry *lru_tail;
+	uint64_t bytes_loaded;
+	uint64_t bytes_shared;
+};
+
+static struct mb2_read_cache read_cache;
+static thread_once_t read_cache_once = THREAD_ONCE_INIT;
+
+static void mb2_read_cache_init(void)
+{
+	mutex_init(&read_cache.mutex);
+}
+
+static uint32_t mb2_read_cache_hash(const char *path)
+{
+	uint32_t hash = 2166136261u;
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
+	}
+	return hash & (READ_CACHE_HASH_SIZE - 1);
+}
+
+static void mb2_read_cache_free_entry(struct mb2_read_cache_entry *entry)
+{
+	read_cache.used -= entry->size;
+	free(entry->data);
+	free(entry->path);
+	free(entry);
+}
+
+/* removes entry from lookups, it is freed once the last reference is gone */
+static void mb2_read_cache_detach(struct mb2_read_cache_entry *entry)
+{
+	struct mb2_read_cache_entry **pentry = &read_cache.buckets[mb2_read_cache_hash(entry->path)];
+	while (*pentry && *pentry != entry) {
+		pentry = &(*pentry)->next;
+	}
+	if (*pentry) {
+		*pentry = entry->next;
+	}
+	if (entry->lru_prev) {
+		entry->lru_prev->lru_next = entry->lru_next;
+	} else {
+		read_cache.lru_head = entry->lru_next;
+	}
+	if (entry->lru_next) {
+		entry->lru_next->lru_prev = entry->lru_prev;
+	} else {
+		read_cache.lru_tail = entry->lru_prev;
+	}
+	entry->detached = 1;
+	if (entry->refs == 0) {
+		mb2_read_cache_free_entry(entry);
+	}
+}
+
+/* drops unused entries, least recently used first, until size more bytes fit */
+static int mb2_read_cache_make_room(uint64_t size)
+{
+	struct mb2_read_cache_entry *entry = read_cache.lru_tail;
+	while (read_cache.used + size > read_cache.limit && entry) {
+		struct mb2_read_cache_entry *prev = entry->lru_prev;
+		if (entry->refs == 0) {
+			mb2_read_cache_detach(entry);
+		}
+		entry = prev;
+	}
+	return (read_cache.used + size > read_cache.limit) ? -1 : 0;
+}
+
+static void mb2_read_cache_set_limit(uint64_t limit)
+{
+	thread_once(&read_cache_once, mb2_read_cache_init);
+	mutex_lock(&read_cache.mutex);
+	read_cache.limit = limit;
+	mb2_read_cache_make_room(0);
+	mutex_unlock(&read_cache.mutex);
+}
+
+/*
+ * Returns the cache entry for the file at path with a reference held, or
+ * NULL if the file has to be read from disk directly. If *load is set on
+ * return, the caller is the one reading the file and has to pass the data
+ * on with mb2_read_cache_fill().
+ */
+static struct mb2_read_cache_entry* mb2_read_cache_acquire(const char *path, uint64_t size, int64_t mtime, int *load)
+{
+	struct mb2_read_cache_entry *entry = NULL;
+
+	*load = 0;
+	if (read_cache.limit == 0 || size == 0) {
+		return NULL;
+	}
+
+	mutex_lock(&read_cache.mutex);
+	uint32_t hash = mb2_read_cache_hash(path);
+	for (entry = read_cache.buckets[hash]; entry; entry = entry->next) {
+		if (!strcmp(entry->path, path)) {
+			break;
+		}
+	}
+	if (entry && (entry->size != size || entry->mtime != mtime)) {
+		/* the file changed since it was cached */
+		mb2_read_cache_detach(entry);
+		entry = NULL;
+	}
+	if (entry) {
+		if (entry != read_cache.lru_head) {
+			entry->lru_prev->lru_next = entry->lru_next;
+			if (entry->lru_next) {
+				entry->lru_next->lru_prev = entry->lru_prev;
+			} else {
+				read_cache.lru_tail = entry->lru_prev;
+			}
+			entry->lru_prev = NULL;
+			entry->lru_next = read_cache.lru_head;
+			read_cache.lru_head->lru_prev = entry;
+			read_cache.lru_head = entry;
+		}
+		entry->refs++;
+		mutex_unlock(&read_cache.mutex);
+		return entry;
+	}
+
+	if (size > read_cache.limit / 4 || mb2_read_cache_make_room(size) < 0) {
+		mutex_unlock(&read_cache.mutex);
+		return NULL;
+	}
+	entry = (struct mb2_read_cache_entry*)calloc(1, sizeof(struct mb2_read_cache_entry));
+	if (entry) {
+		entry->path = strdup(path);
+		entry->data = (char*)malloc(size);
+	}
+	if (!entry || !entry->path || !entry->data) {
+		if (entry) {
+			free(entry->path);
+			free(entry->data);
+			free(entry);
+		}
+		mutex_unlock(&read_cache.mutex);
+		return NULL;
+	}
+	entry->size = size;
+	entry->mtime = mtime;
+	entry->refs = 1;
+	entry->next = read_cache.buckets[hash];
+	read_cache.buckets[hash] = entry;
+	entry->lru_next = read_cache.lru_head;
+	if (read_cache.lru_head) {
+		read_cache.lru_head->lru_prev = entry;
+	} else {
+		read_cache.lru_tail = entry;
+	}
+	read_cache.lru_head = entry;
+	read_cache.used += size;
+	mutex_unlock(&read_cache.mutex);
+
+	*load = 1;
+	return entry;
+}
+
+/* called by the loading reader after the first loaded bytes were stored */
+static void mb2_read_cache_fill(struct mb2_read_cache_entry *entry, uint64_t loaded, int error)
+{
+	mutex_lock(&read_cache.mutex);
+	read_cache.bytes_loaded += loaded - entry->loaded;
+	entry->loaded = loaded;
+	if (error) {
+		/* the other readers fall back to reading the file themselves */
+		entry->error = error;
+		if (!entry->detached) {
+			mb2_read_cache_detach(entry);
+		}
+	}
+	struct mb2_read_cache_waiter *waiter;
+	for (waiter = entry->waiters; waiter; waiter = waiter->next) {
+		cond_signal(&waiter->cond);
+	}
+	mutex_unlock(&read_cache.mutex);
+}
+
+/* waits until the first length bytes are loaded, returns 0 or an errno */
+static int mb2_read_cache_wait(struct mb2_read_cache_entry *entry, uint64_t length)
+{
+	mutex_lock(&read_cache.mutex);
+	if (entry->loaded < length && !entry->error) {
+		/* the loading reader always ends with a final fill, even when stopped */
+		struct mb2_read_cache_waiter waiter;
+		cond_init(&waiter.cond);
+		waiter.next = entry->waiters;
+		entry->waiters = &waiter;
+		while (entry->loaded < length && !entry->error) {
+			cond_wait(&waiter.cond, &read_cache.mutex);
+		}
+		struct mb2_read_cache_waiter **link = &entry->waiters;
+		while (*link != &waiter) {
+			link = &(*link)->next;
+		}
+		*link = waiter.next;
+		cond_destroy(&waiter.cond);
+	}
+	int error = (entry->loaded >= length) ? 0 : entry->error;
+	mutex_unlock(&read_cache.mutex);
+
+	return error;
+}
+
+static void mb2_read_cache_shared(uint64_t bytes)
+{
+	__sync_add_and_fetch(&read_cache.bytes_shared, bytes);
+}
+
+static void mb2_read_cache_release(struct mb2_read_cache_entry *entry)
+{
+	mutex_lock(&read_cache.mutex);
+	entry->refs--;
+	if (entry->detached && entry->refs == 0) {
+		mb2_read_cache_free_entry(entry);
+	}
+	mutex_unlock(&read_cache.mutex);
+}
+
+static void stats_free(void)
+{
+	uint32_t i;
+	for (i = 0; i < num_message_stats; i++) {
+		free(message_stats[i].name);
+	}
+	free(message_stats);
+	message_stats = NULL;
+	num_message_stats = 0;
+}
+
 static void notify_cb(const char *notification, void *userdata)
 {
+	struct mb2_device_state *state = (struct mb2_device_state*)userdata;
 	if (strlen(notification) == 0) {
 		return;
 	}
 	if (!strcmp(notification, NP_SYNC_CANCEL_REQUEST)) {
 		PRINT_VERBOSE(1, "User has cancelled the backup process on the device.\n");
-		quit_flag++;
+		state->quit++;
 	} else if (!strcmp(notification, NP_BACKUP_DOMAIN_CHANGED)) {
-		backup_domain_changed = 1;
+		state->backup_domain_changed = 1;
 	} else {
 		PRINT_VERBOSE(1, "Unhandled notification '%s' (TODO: implement)\n", notification);
 	}
@@ -235,6 +739,85 @@ static int remove_file(const char* path)
 	return e;
 }
 
+#if !defined(WIN32) && defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_UNLINKAT) && defined(HAVE_FDOPENDIR)
+#define HAVE_FD_RELATIVE_FS 1
+#endif
+
+#ifdef HAVE_FD_RELATIVE_FS
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/*
+ * Removes the directory name relative to parentfd together with everything
+ * below it. Entries are unlinked relative to the descriptor of their parent,
+ * so no full paths are built and symlinks are removed, never followed.
+ * Returns 0 or the first errno encountered; vanished entries are no error.
+ */
+static int rmdir_recursive_at(int parentfd, const char *name)
+{
+	int res = 0;
+	int fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		return (errno == ENOENT) ? 0 : errno;
+	}
+	DIR *cur_dir = fdopendir(fd);
+	if (!cur_dir) {
+		res = errno;
+		close(fd);
+		return res;
+	}
+	struct dirent *ep;
+	while ((ep = readdir(cur_dir))) {
+		if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+			continue;
+		}
+		int is_dir = 0;
+#ifdef HAVE_DIRENT_D_TYPE
+		if (ep->d_type == DT_DIR) {
+			is_dir = 1;
+		} else if (ep->d_type == DT_UNKNOWN)
+#endif
+		{
+			struct stat st;
+			if (fstatat(fd, ep->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+				is_dir = S_ISDIR(st.st_mode);
+			}
+		}
+		int e = 0;
+		if (is_dir) {
+			e = rmdir_recursive_at(fd, ep->d_name);
+		} else if (unlinkat(fd, ep->d_name, 0) < 0 && errno != ENOENT) {
+			e = errno;
+		}
+		if (e && !res) {
+			res = e;
+		}
+	}
+	closedir(cur_dir);
+	if (unlinkat(parentfd, name, AT_REMOVEDIR) < 0 && errno != ENOENT && !res) {
+		res = errno;
+	}
+	return res;
+}
+
+/* removes the file or the directory tree at path, returns 0 or an errno */
+static int remove_path(const char* path)
+{
+	if (unlinkat(AT_FDCWD, path, 0) == 0) {
+		return 0;
+	}
+	int e = errno;
+	/* Linux reports EISDIR for directories, POSIX allows EPERM */
+	if (e == EISDIR || e == EPERM) {
+		int res = rmdir_recursive_at(AT_FDCWD, path);
+		if (res != ENOTDIR) {
+			return res;
+		}
+	}
+	return e;
+}
+#else
 static int remove_directory(const char* path)
 {
 	int e = 0;
@@ -329,6 +912,17 @@ static int rmdir_recursive(const char* path)
 	return res;
 }
 
+/* removes the file or the directory tree at path, returns 0 or an errno */
+static int remove_path(const char* path)
+{
+	struct stat st;
+	if ((stat(path, &st) == 0) && S_ISDIR(st.st_mode)) {
+		return rmdir_recursive(path);
+	}
+	return remove_file(path);
+}
+#endif
+
 static char* get_uuid()
 {
 	const char *chars = "ABCDEF0123456789";
@@ -346,6 +940,50 @@ static char* get_uuid()
 	return uuid;
 }
 
+struct installed_apps_data {
+	plist_t app_dict;
+	plist_t installed_apps;
+	sbservices_client_t sbs;
+};
+
+static int installed_apps_page_cb(plist_t current_list, uint64_t current_index, uint64_t total, void *user_data)
+{
+	struct installed_apps_data *data = (struct installed_apps_data*)user_data;
+	uint32_t app_count = plist_array_get_size(current_list);
+	uint32_t i;
+
+	for (i = 0; i < app_count; i++) {
+		plist_t app_entry = plist_array_get_item(current_list, i);
+		plist_t bundle_id = plist_dict_get_item(app_entry, "CFBundleIdentifier");
+		if (bundle_id) {
+			char *bundle_id_str = NULL;
+			plist_array_append_item(data->installed_apps, plist_copy(bundle_id));
+
+			plist_get_string_val(bundle_id, &bundle_id_str);
+			plist_t sinf = plist_dict_get_item(app_entry, "ApplicationSINF");
+			plist_t meta = plist_dict_get_item(app_entry, "iTunesMetadata");
+			if (sinf && meta) {
+				plist_t adict = plist_new_dict();
+				plist_dict_set_item(adict, "ApplicationSINF", plist_copy(sinf));
+				if (data->sbs) {
+					char *pngdata = NULL;
+					uint64_t pngsize = 0;
+					sbservices_get_icon_pngdata(data->sbs, bundle_id_str, &pngdata, &pngsize);
+					if (pngdata) {
+						plist_dict_set_item(adict, "PlaceholderIcon", plist_new_data(pngdata, pngsize));
+						free(pngdata);
+					}
+				}
+				plist_dict_set_item(adict, "iTunesMetadata", plist_copy(meta));
+				plist_dict_set_item(data->app_dict, bundle_id_str, adict);
+			}
+			free(bundle_id_str);
+		}
+	}
+
+	return 0;
+}
+
 static plist_t mobilebackup_factory_info_plist_new(const char* udid, idevice_t device, afc_client_t afc)
 {
 	/* gather data from lockdown */
@@ -374,58 +1012,24 @@ static plist_t mobilebackup_factory_info_plist_new(const char* udid, idevice_t d
 	lockdownd_client_free(lockdown);
 
 	/* get a list of installed user applications */
-	plist_t app_dict = plist_new_dict();
-	plist_t installed_apps = plist_new_array();
+	struct installed_apps_data apps_data = { plist_new_dict(), plist_new_array(), NULL };
+	plist_t app_dict = apps_data.app_dict;
+	plist_t installed_apps = apps_data.installed_apps;
 	instproxy_client_t ip = NULL;
 	if (instproxy_client_start_service(device, &ip, TOOL_NAME) == INSTPROXY_E_SUCCESS) {
 		plist_t client_opts = instproxy_client_options_new();
 		instproxy_client_options_add(client_opts, "ApplicationType", "User", NULL);
 		instproxy_client_options_set_return_attributes(client_opts, "CFBundleIdentifier", "ApplicationSINF", "iTunesMetadata", NULL);
 
-		plist_t apps = NULL;
-		instproxy_browse(ip, client_opts, &apps);
-
-		sbservices_client_t sbs = NULL;
-		if (sbservices_client_start_service(device, &sbs, TOOL_NAME) != SBSERVICES_E_SUCCESS) {
+		if (sbservices_client_start_service(device, &apps_data.sbs, TOOL_NAME) != SBSERVICES_E_SUCCESS) {
 			printf("Couldn't establish sbservices connection. Continuing anyway.\n");
 		}
 
-		if (apps && (plist_get_node_type(apps) == PLIST_ARRAY)) {
-			uint32_t app_count = plist_array_get_size(apps);
-			uint32_t i;
-			for (i = 0; i < app_count; i++) {
-				plist_t app_entry = plist_array_get_item(apps, i);
-				plist_t bundle_id = plist_dict_get_item(app_entry, "CFBundleIdentifier");
-				if (bundle_id) {
-					char *bundle_id_str = NULL;
-					plist_array_append_item(installed_apps, plist_copy(bundle_id));
-
-					plist_get_string_val(bundle_id, &bundle_id_str);
-					plist_t sinf = plist_dict_get_item(app_entry, "ApplicationSINF");
-					plist_t meta = plist_dict_get_item(app_entry, "iTunesMetadata");
-					if (sinf && meta) {
-						plist_t adict = plist_new_dict();
-						plist_dict_set_item(adict, "ApplicationSINF", plist_copy(sinf));
-						if (sbs) {
-							char *pngdata = NULL;
-							uint64_t pngsize = 0;
-							sbservices_get_icon_pngdata(sbs, bundle_id_str, &pngdata, &pngsize);
-							if (pngdata) {
-								plist_dict_set_item(adict, "PlaceholderIcon", plist_new_data(pngdata, pngsize));
-								free(pngdata);
-							}
-						}
-						plist_dict_set_item(adict, "iTunesMetadata", plist_copy(meta));
-						plist_dict_set_item(app_dict, bundle_id_str, adict);
-					}
-					free(bundle_id_str);
-				}
-			}
-		}
-		plist_free(apps);
+		/* handle the applications page by page instead of collecting them all first */
+		instproxy_browse_pages(ip, client_opts, installed_apps_page_cb, &apps_data);
 
-		if (sbs) {
-			sbservices_client_free(sbs);
+		if (apps_data.sbs) {
+			sbservices_client_free(apps_data.sbs);
 		}
 
 		instproxy_client_options_free(client_opts);
@@ -664,6 +1268,10 @@ static void do_post_notification(idevice_t device, const char *notification)
 static void print_progress_real(double progress, int flush)
 {
 	int i = 0;
+	if (multi_device) {
+		/* progress bars of several devices would overwrite each other */
+		return;
+	}
 	PRINT_VERBOSE(1, "\r[");
 	for(i = 0; i < 50; i++) {
 		if(i < progress / 2) {
@@ -683,7 +1291,7 @@ static void print_progress(uint64_t current, uint64_t total)
 {
 	char *format_size = NULL;
 	double progress = ((double)current/(double)total)*100;
-	if (progress < 0)
+	if (progress < 0 || multi_device)
 		return;
 
 	if (progress > 100)
@@ -704,12 +1312,18 @@ static void print_progress(uint64_t current, uint64_t total)
 	fflush(stdout);
 }
 
-static double overall_progress = 0;
+static MB2_THREAD_LOCAL double overall_progress = 0;
 
 static void mb2_set_overall_progress(double progress)
 {
-	if (progress > 0.0)
-		overall_progress = progress;
+	if (progress <= 0.0)
+		return;
+	if (multi_device && (int)progress != (int)overall_progress) {
+		printf("%s: %3.0f%%\n", device_state.udid, progress);
+	}
+	overall_progress = progress;
+	if (device_state.progress)
+		*device_state.progress = progress;
 }
 
 static void mb2_set_overall_progress_from_message(plist_t message, char* identifier)
@@ -764,289 +1378,1605 @@ static int errno_to_device_error(int errno_value)
 	}
 }
 
-static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, const char *backup_dir, const char *path, plist_t *errplist)
-{
-	uint32_t nlen = 0;
-	uint32_t pathlen = strlen(path);
-	uint32_t bytes = 0;
-	char *localfile = string_build_path(backup_dir, path, NULL);
-	char buf[32768];
-#ifdef WIN32
-	struct _stati64 fst;
-#else
-	struct stat fst;
-#endif
+/*
+ * Optional single file output (--archive FILE). Per-file data of the
+ * backup, i.e. every path below the first directory level of a device
+ * directory, is appended to a tar archive instead of being created as a
+ * file. The few top level files like Info.plist, Status.plist or
+ * Manifest.db stay in the backup directory. An index member listing the
+ * current location of every path is written after the data, and a locator
+ * block after the end of archive marker points to it. Later backups
+ * append to the archive and write a new index; removed, moved or replaced
+ * paths only change the index. Restores read the files from the archive.
+ */
+#define ARCHIVE_BLOCK 512
+#define ARCHIVE_INDEX_NAME ".mb2index"
+#define ARCHIVE_LOCATOR_MAGIC "MB2ARCHIVE"
+#define ARCHIVE_HASH_SIZE 65536
 
-	FILE *f = NULL;
-	uint32_t slen = 0;
-	int errcode = -1;
-	int result = -1;
-	uint32_t length;
 #ifdef WIN32
-	uint64_t total;
-	uint64_t sent;
-#else
-	off_t total;
-	off_t sent;
+#define fseeko _fseeki64
+#define ftello _ftelli64
 #endif
 
-	mobilebackup2_error_t err;
+struct mb2_archive_entry {
+	char *path;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t mtime;
+	struct mb2_archive_entry *next;
+};
 
-	/* send path length */
-	nlen = htobe32(pathlen);
-	err = mobilebackup2_send_raw(mobilebackup2, (const char*)&nlen, sizeof(nlen), &bytes);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		goto leave_proto_err;
-	}
-	if (bytes != (uint32_t)sizeof(nlen)) {
-		err = MOBILEBACKUP2_E_MUX_ERROR;
-		goto leave_proto_err;
-	}
-
-	/* send path */
-	err = mobilebackup2_send_raw(mobilebackup2, path, pathlen, &bytes);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		goto leave_proto_err;
-	}
-	if (bytes != pathlen) {
-		err = MOBILEBACKUP2_E_MUX_ERROR;
-		goto leave_proto_err;
-	}
+struct mb2_archive {
+	FILE *f;
+	struct mb2_archive_entry *buckets[ARCHIVE_HASH_SIZE];
+	uint32_t count;
+	/* position the next member header is written to */
+	uint64_t end;
+	/* set once data was written over the previous index */
+	int dirty;
+	/* member currently being written */
+	char *cur_path;
+	uint64_t cur_offset;
+	uint64_t cur_size;
+};
 
-#ifdef WIN32
-	if (_stati64(localfile, &fst) < 0)
-#else
-	if (stat(localfile, &fst) < 0)
-#endif
-	{
-		if (errno != ENOENT)
-			printf("%s: stat failed on '%s': %d\n", __func__, localfile, errno);
-        else
-            result = -ENOENT;
+static struct mb2_archive *backup_archive = NULL;
 
-		errcode = errno;
-		goto leave;
+static uint32_t mb2_archive_hash(const char *path)
+{
+	uint32_t hash = 2166136261u;
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
 	}
+	return hash & (ARCHIVE_HASH_SIZE - 1);
+}
 
-	total = fst.st_size;
-
-	char *format_size = string_format_size(total);
-	PRINT_VERBOSE(1, "Sending '%s' (%s)\n", path, format_size);
-	free(format_size);
-    fflush(stdout);
+/* returns 1 if the given backup relative path is kept in the archive */
+static int mb2_archive_handles(const char *path)
+{
+	const char *p = (backup_archive) ? strchr(path, '/') : NULL;
+	return (p && strchr(p+1, '/') != NULL);
+}
 
-	if (total == 0) {
-		errcode = 0;
-		goto leave;
+static struct mb2_archive_entry* mb2_archive_lookup(struct mb2_archive *archive, const char *path)
+{
+	struct mb2_archive_entry *entry = archive->buckets[mb2_archive_hash(path)];
+	while (entry && strcmp(entry->path, path) != 0) {
+		entry = entry->next;
 	}
+	return entry;
+}
 
-	f = fopen(localfile, "rb");
-	if (!f) {
-		printf("%s: Error opening local file '%s': %d\n", __func__, localfile, errno);
-		errcode = errno;
-		goto leave;
+static void mb2_archive_unlink(struct mb2_archive *archive, struct mb2_archive_entry *entry)
+{
+	struct mb2_archive_entry **pentry = &archive->buckets[mb2_archive_hash(entry->path)];
+	while (*pentry && *pentry != entry) {
+		pentry = &(*pentry)->next;
 	}
+	if (*pentry) {
+		*pentry = entry->next;
+		archive->count--;
+	}
+}
 
-	sent = 0;
-    print_progress(sent, total);
+/* adds an entry for path, replacing an existing one */
+static int mb2_archive_insert(struct mb2_archive *archive, const char *path, uint64_t offset, uint64_t size, uint64_t mtime)
+{
+	struct mb2_archive_entry *entry = mb2_archive_lookup(archive, path);
+	if (entry) {
+		mb2_archive_unlink(archive, entry);
+		free(entry->path);
+		free(entry);
+	}
+	entry = (struct mb2_archive_entry*)malloc(sizeof(struct mb2_archive_entry));
+	if (!entry) {
+		return -1;
+	}
+	entry->path = strdup(path);
+	entry->offset = offset;
+	entry->size = size;
+	entry->mtime = mtime;
+	uint32_t hash = mb2_archive_hash(path);
+	entry->next = archive->buckets[hash];
+	archive->buckets[hash] = entry;
+	archive->count++;
+	return 0;
+}
 
-	do {
-		length = ((total-sent) < (long long)sizeof(buf)) ? (uint32_t)total-sent : (uint32_t)sizeof(buf);
-		/* send data size (file size + 1) */
-		nlen = htobe32(length+1);
-		memcpy(buf, &nlen, sizeof(nlen));
-		buf[4] = CODE_FILE_DATA;
-		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, 5, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-		    printf("Error sending file size '%s': %d\n", localfile, err);
-			goto leave_proto_err;
-		}
-		if (bytes != 5) {
-		    printf("Error sending file size '%s': (%d != 5)\n", localfile, bytes);
-			goto leave_proto_err;
+/* removes path and everything below it, returns the number of removed entries */
+static uint32_t mb2_archive_remove(struct mb2_archive *archive, const char *path)
+{
+	size_t len = strlen(path);
+	uint32_t removed = 0;
+	uint32_t i;
+
+	for (i = 0; i < ARCHIVE_HASH_SIZE; i++) {
+		struct mb2_archive_entry **pentry = &archive->buckets[i];
+		while (*pentry) {
+			struct mb2_archive_entry *entry = *pentry;
+			if (strncmp(entry->path, path, len) == 0 && (entry->path[len] == '\0' || entry->path[len] == '/')) {
+				*pentry = entry->next;
+				archive->count--;
+				free(entry->path);
+				free(entry);
+				removed++;
+			} else {
+				pentry = &entry->next;
+			}
 		}
+	}
+	return removed;
+}
 
-		/* send file contents */
-		size_t r = fread(buf, 1, sizeof(buf), f);
-		if (r <= 0) {
-			printf("%s: read error\n", __func__);
-			errcode = errno;
-			goto leave;
-		}
-		err = mobilebackup2_send_raw(mobilebackup2, buf, r, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-            printf("Error sending file block '%s': %d (%lld)\n", localfile, err, sent);
-			goto leave_proto_err;
-		}
-		if (bytes != (uint32_t)r) {
-			printf("Error: sent only %d of %d bytes\n", bytes, (int)r);
-			goto leave_proto_err;
+/* moves or copies path and everything below it to newpath */
+static uint32_t mb2_archive_rename(struct mb2_archive *archive, const char *path, const char *newpath, int copy)
+{
+	size_t len = strlen(path);
+	struct mb2_archive_entry *matches = NULL;
+	uint32_t count = 0;
+	uint32_t i;
+
+	mb2_archive_remove(archive, newpath);
+
+	/* collect first, the entries are reinserted under a new hash */
+	for (i = 0; i < ARCHIVE_HASH_SIZE; i++) {
+		struct mb2_archive_entry **pentry = &archive->buckets[i];
+		while (*pentry) {
+			struct mb2_archive_entry *entry = *pentry;
+			if (strncmp(entry->path, path, len) == 0 && (entry->path[len] == '\0' || entry->path[len] == '/')) {
+				struct mb2_archive_entry *match = entry;
+				if (copy) {
+					match = (struct mb2_archive_entry*)malloc(sizeof(struct mb2_archive_entry));
+					if (!match) {
+						break;
+					}
+					*match = *entry;
+					match->path = strdup(entry->path);
+					pentry = &entry->next;
+				} else {
+					*pentry = entry->next;
+					archive->count--;
+				}
+				match->next = matches;
+				matches = match;
+				count++;
+			} else {
+				pentry = &entry->next;
+			}
 		}
-		sent += r;
+	}
+	while (matches) {
+		struct mb2_archive_entry *entry = matches;
+		matches = entry->next;
+		char *renamed = string_concat(newpath, entry->path + len, NULL);
+		mb2_archive_insert(archive, renamed, entry->offset, entry->size, entry->mtime);
+		free(renamed);
+		free(entry->path);
+		free(entry);
+	}
+	return count;
+}
 
-		print_progress(sent, total);
+static void tar_set_octal(char *field, size_t len, uint64_t value)
+{
+	if (len <= 12 && value >= (1ULL << (3 * (len - 1)))) {
+		/* GNU base-256 encoding for values that do not fit */
+		size_t i;
+		for (i = len - 1; i > 0; i--) {
+			field[i] = (char)(value & 0xFF);
+			value >>= 8;
+		}
+		field[0] = (char)0x80;
+		return;
+	}
+	snprintf(field, len, "%0*llo", (int)(len - 1), (unsigned long long)value);
+}
 
-	} while (sent < total);
-	fclose(f);
-	f = NULL;
-	errcode = 0;
+static int mb2_archive_write_header(FILE *f, const char *path, uint64_t size, uint64_t mtime)
+{
+	char header[ARCHIVE_BLOCK];
+	size_t path_len = strlen(path);
+	unsigned int checksum = 0;
+	int i;
 
-leave:
-	if (errcode == 0) {
-		result = 0;
-		nlen = 1;
-		nlen = htobe32(nlen);
-		memcpy(buf, &nlen, 4);
-		buf[4] = CODE_SUCCESS;
-		mobilebackup2_send_raw(mobilebackup2, buf, 5, &bytes);
+	memset(header, '\0', sizeof(header));
+	if (path_len < 100) {
+		memcpy(header, path, path_len);
 	} else {
-		if (!*errplist) {
-			*errplist = plist_new_dict();
-		}
-		char *errdesc = strerror(errcode);
-		mb2_multi_status_add_file_error(*errplist, path, errno_to_device_error(errcode), errdesc);
-
-		length = strlen(errdesc);
-		nlen = htobe32(length+1);
-		memcpy(buf, &nlen, 4);
-		buf[4] = CODE_ERROR_LOCAL;
-		slen = 5;
-		memcpy(buf+slen, errdesc, length);
-		slen += length;
-		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, slen, &bytes);
-		if (err != MOBILEBACKUP2_E_SUCCESS) {
-			printf("could not send message\n");
+		/* split into prefix and name at a path separator */
+		const char *sep = path + path_len - 100;
+		while (*sep && *sep != '/') {
+			sep++;
 		}
-		if (bytes != slen) {
-			printf("could only send %d from %d\n", bytes, slen);
+		if (!*sep || (size_t)(sep - path) > 155) {
+			return -1;
 		}
+		memcpy(header + 345, path, sep - path);
+		memcpy(header, sep + 1, path_len - (sep - path) - 1);
 	}
+	tar_set_octal(header + 100, 8, 0644);
+	tar_set_octal(header + 108, 8, 0);
+	tar_set_octal(header + 116, 8, 0);
+	tar_set_octal(header + 124, 12, size);
+	tar_set_octal(header + 136, 12, mtime);
+	header[156] = '0';
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+	memset(header + 148, ' ', 8);
+	for (i = 0; i < ARCHIVE_BLOCK; i++) {
+		checksum += (unsigned char)header[i];
+	}
+	snprintf(header + 148, 8, "%06o", checksum);
 
-leave_proto_err:
-	if (f)
-		fclose(f);
-	free(localfile);
-	return result;
+	return (fwrite(header, 1, ARCHIVE_BLOCK, f) == ARCHIVE_BLOCK) ? 0 : -1;
 }
 
-static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+static int mb2_archive_load_index(struct mb2_archive *archive)
 {
-	uint32_t cnt;
-	uint32_t i = 0;
-	uint32_t sent;
-	plist_t errplist = NULL;
-
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2) || !backup_dir) return;
+	char block[ARCHIVE_BLOCK + 1];
+	unsigned long long index_offset = 0;
+	unsigned long long index_size = 0;
 
-	plist_t files = plist_array_get_item(message, 1);
-	cnt = plist_array_get_size(files);
+	if (fseeko(archive->f, -ARCHIVE_BLOCK, SEEK_END) != 0 || fread(block, 1, ARCHIVE_BLOCK, archive->f) != ARCHIVE_BLOCK) {
+		return -1;
+	}
+	block[ARCHIVE_BLOCK] = '\0';
+	if (strncmp(block, ARCHIVE_LOCATOR_MAGIC " ", strlen(ARCHIVE_LOCATOR_MAGIC) + 1) != 0
+	    || sscanf(block + strlen(ARCHIVE_LOCATOR_MAGIC) + 1, "%llu %llu", &index_offset, &index_size) != 2) {
+		return -1;
+	}
 
-	for (i = 0; i < cnt; i++) {
-		plist_t val = plist_array_get_item(files, i);
-		if (plist_get_node_type(val) != PLIST_STRING) {
-			continue;
+	char *data = (char*)malloc(index_size + 1);
+	if (!data) {
+		return -1;
+	}
+	if (fseeko(archive->f, index_offset + ARCHIVE_BLOCK, SEEK_SET) != 0 || fread(data, 1, index_size, archive->f) != index_size) {
+		free(data);
+		return -1;
+	}
+	data[index_size] = '\0';
+
+	char *line = data;
+	while (line && *line) {
+		char *eol = strchr(line, '\n');
+		unsigned long long offset = 0;
+		unsigned long long size = 0;
+		unsigned long long mtime = 0;
+		int pos = 0;
+		if (eol) {
+			*eol = '\0';
 		}
-		char *str = NULL;
-		plist_get_string_val(val, &str);
-		if (!str)
-			continue;
+		if (sscanf(line, "%llu %llu %llu %n", &offset, &size, &mtime, &pos) == 3 && line[pos]) {
+			mb2_archive_insert(archive, line + pos, offset, size, mtime);
+		}
+		line = (eol) ? eol + 1 : NULL;
+	}
+	free(data);
 
-        int errCode = mb2_handle_send_file(mobilebackup2, backup_dir, str, &errplist);
+	archive->end = index_offset;
+	return 0;
+}
 
-		if (errCode < 0) {
-			free(str);
+static struct mb2_archive* mb2_archive_open(const char *filename)
+{
+	struct mb2_archive *archive = (struct mb2_archive*)calloc(1, sizeof(struct mb2_archive));
+	if (!archive) {
+		return NULL;
+	}
+	archive->f = fopen(filename, "r+b");
+	if (archive->f) {
+		if (mb2_archive_load_index(archive) < 0) {
+			printf("ERROR: '%s' is not a backup archive or its index is damaged.\n", filename);
+			fclose(archive->f);
+			free(archive);
+			return NULL;
+		}
+	} else {
+		archive->f = fopen(filename, "w+b");
+		if (!archive->f) {
+			printf("ERROR: Could not create archive '%s': %s\n", filename, strerror(errno));
+			free(archive);
+			return NULL;
+		}
+		/* write an initial index so the archive is valid right away */
+		archive->dirty = 1;
+	}
+	return archive;
+}
 
-			if(errCode != -ENOENT)
-            {
-    			printf("Error when sending file '%s' to device (%d)\n", str, errCode);
+/* starts a new member for path at the end of the archive, called on the writer thread */
+static int mb2_archive_begin_file(struct mb2_archive *archive, char *path)
+{
+	static const char zero_header[ARCHIVE_BLOCK] = { 0 };
+
+	archive->dirty = 1;
+	/* a member that was not finished is overwritten */
+	free(archive->cur_path);
+	archive->cur_path = path;
+	archive->cur_offset = archive->end;
+	archive->cur_size = 0;
+	/* the header is written once the size is known */
+	if (fseeko(archive->f, archive->end, SEEK_SET) != 0 || fwrite(zero_header, 1, ARCHIVE_BLOCK, archive->f) != ARCHIVE_BLOCK) {
+		return errno;
+	}
+	return 0;
+}
 
-                if(errplist)
-                    plist_print_to_stream(errplist, stdout);
+static int mb2_archive_write(struct mb2_archive *archive, const char *buf, uint32_t len)
+{
+	if (fwrite(buf, 1, len, archive->f) != len) {
+		return errno;
+	}
+	archive->cur_size += len;
+	return 0;
+}
 
-                fflush(stdout);
-            }
+/* finishes the current member and adds it to the index, called on the writer thread */
+static int mb2_archive_end_file(struct mb2_archive *archive)
+{
+	static const char padding[ARCHIVE_BLOCK] = { 0 };
+	uint32_t pad = (uint32_t)((ARCHIVE_BLOCK - (archive->cur_size % ARCHIVE_BLOCK)) % ARCHIVE_BLOCK);
+	uint64_t mtime = (uint64_t)time(NULL);
+	int error = 0;
 
-			// TODO: perhaps we can continue, we've got a multi status response?!
-			break;
+	if (!archive->cur_path) {
+		return 0;
+	}
+	if (fwrite(padding, 1, pad, archive->f) != pad
+	    || fseeko(archive->f, archive->cur_offset, SEEK_SET) != 0
+	    || mb2_archive_write_header(archive->f, archive->cur_path, archive->cur_size, mtime) < 0) {
+		error = (errno) ? errno : EIO;
+	} else {
+		archive->end = archive->cur_offset + ARCHIVE_BLOCK + archive->cur_size + pad;
+		if (mb2_archive_insert(archive, archive->cur_path, archive->cur_offset + ARCHIVE_BLOCK, archive->cur_size, mtime) < 0) {
+			error = ENOMEM;
 		}
-
-		free(str);
 	}
+	free(archive->cur_path);
+	archive->cur_path = NULL;
 
-	/* send terminating 0 dword */
-	uint32_t zero = 0;
-	mobilebackup2_send_raw(mobilebackup2, (char*)&zero, 4, &sent);
+	return error;
+}
 
-	if (!errplist) {
-		plist_t emptydict = plist_new_dict();
-		mobilebackup2_send_status_response(mobilebackup2, 0, NULL, emptydict);
-		plist_free(emptydict);
-	} else {
-		mobilebackup2_send_status_response(mobilebackup2, -13, "Multi status", errplist);
-		plist_free(errplist);
+/* adds the members and implied directories directly below path to dirlist */
+static void mb2_archive_list_directory(struct mb2_archive *archive, const char *path, plist_t dirlist)
+{
+	char *prefix = string_concat(path, "/", NULL);
+	size_t prefix_len = strlen(prefix);
+	uint32_t i;
+
+	for (i = 0; i < ARCHIVE_HASH_SIZE; i++) {
+		struct mb2_archive_entry *entry;
+		for (entry = archive->buckets[i]; entry; entry = entry->next) {
+			if (strncmp(entry->path, prefix, prefix_len) != 0) {
+				continue;
+			}
+			const char *name = entry->path + prefix_len;
+			const char *sep = strchr(name, '/');
+			if (sep) {
+				char *dirname = strndup(name, sep - name);
+				if (!plist_dict_get_item(dirlist, dirname)) {
+					plist_t fdict = plist_new_dict();
+					plist_dict_set_item(fdict, "DLFileType", plist_new_string("DLFileTypeDirectory"));
+					plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(0));
+					plist_dict_set_item(fdict, "DLFileModificationDate", plist_new_date((int32_t)(entry->mtime - MAC_EPOCH), 0));
+					plist_dict_set_item(dirlist, dirname, fdict);
+				}
+				free(dirname);
+			} else {
+				plist_t fdict = plist_new_dict();
+				plist_dict_set_item(fdict, "DLFileType", plist_new_string("DLFileTypeRegular"));
+				plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(entry->size));
+				plist_dict_set_item(fdict, "DLFileModificationDate", plist_new_date((int32_t)(entry->mtime - MAC_EPOCH), 0));
+				plist_dict_set_item(dirlist, name, fdict);
+			}
+		}
 	}
+	free(prefix);
 }
 
-static int mb2_receive_filename(mobilebackup2_client_t mobilebackup2, char** filename)
+/* writes the index, the end of archive marker and the locator block */
+static int mb2_archive_close(struct mb2_archive *archive)
 {
-	uint32_t nlen = 0;
-	uint32_t rlen = 0;
-
-	do {
-		nlen = 0;
-		rlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &rlen);
-		nlen = be32toh(nlen);
+	static const char zero_block[ARCHIVE_BLOCK] = { 0 };
+	char *index = NULL;
+	size_t index_len = 0;
+	size_t index_cap = 0;
+	int res = 0;
+	uint32_t i;
+
+	if (archive->dirty) {
+		for (i = 0; i < ARCHIVE_HASH_SIZE; i++) {
+			struct mb2_archive_entry *entry;
+			for (entry = archive->buckets[i]; entry; entry = entry->next) {
+				char line[64];
+				int line_len = snprintf(line, sizeof(line), "%llu %llu %llu ", (unsigned long long)entry->offset, (unsigned long long)entry->size, (unsigned long long)entry->mtime);
+				size_t path_len = strlen(entry->path);
+				if (index_len + line_len + path_len + 1 > index_cap) {
+					size_t new_cap = (index_cap) ? index_cap * 2 : 65536;
+					while (new_cap < index_len + line_len + path_len + 1) {
+						new_cap *= 2;
+					}
+					char *new_index = (char*)realloc(index, new_cap);
+					if (!new_index) {
+						res = -1;
+						break;
+					}
+					index = new_index;
+					index_cap = new_cap;
+				}
+				memcpy(index + index_len, line, line_len);
+				index_len += line_len;
+				memcpy(index + index_len, entry->path, path_len);
+				index_len += path_len;
+				index[index_len++] = '\n';
+			}
+		}
 
-		if ((nlen == 0) && (rlen == 4)) {
-			// a zero length means no more files to receive
-			return 0;
-		} else if(rlen == 0) {
-			// device needs more time, waiting...
-			continue;
-		} else if (nlen > 4096) {
-			// filename length is too large
-			printf("ERROR: %s: too large filename length (%d)!\n", __func__, nlen);
-			return 0;
+		if (res == 0) {
+			char locator[ARCHIVE_BLOCK];
+			uint32_t pad = (uint32_t)((ARCHIVE_BLOCK - (index_len % ARCHIVE_BLOCK)) % ARCHIVE_BLOCK);
+
+			memset(locator, '\0', sizeof(locator));
+			snprintf(locator, sizeof(locator), "%s %llu %llu\n", ARCHIVE_LOCATOR_MAGIC, (unsigned long long)archive->end, (unsigned long long)index_len);
+			if (fseeko(archive->f, archive->end, SEEK_SET) != 0
+			    || mb2_archive_write_header(archive->f, ARCHIVE_INDEX_NAME, index_len, (uint64_t)time(NULL)) < 0
+			    || fwrite(index, 1, index_len, archive->f) != index_len
+			    || fwrite(zero_block, 1, pad, archive->f) != pad
+			    || fwrite(zero_block, 1, ARCHIVE_BLOCK, archive->f) != ARCHIVE_BLOCK
+			    || fwrite(zero_block, 1, ARCHIVE_BLOCK, archive->f) != ARCHIVE_BLOCK
+			    || fwrite(locator, 1, ARCHIVE_BLOCK, archive->f) != ARCHIVE_BLOCK
+			    || fflush(archive->f) != 0) {
+				res = -1;
+			}
+#ifndef WIN32
+			if (res == 0 && ftruncate(fileno(archive->f), ftello(archive->f)) != 0) {
+				res = -1;
+			}
+#endif
 		}
+		if (res < 0) {
+			printf("ERROR: Could not write archive index: %s\n", strerror(errno));
+		}
+		free(index);
+	}
 
-		if (*filename != NULL) {
-			free(*filename);
-			*filename = NULL;
+	if (fclose(archive->f) != 0) {
+		res = -1;
+	}
+	for (i = 0; i < ARCHIVE_HASH_SIZE; i++) {
+		while (archive->buckets[i]) {
+			struct mb2_archive_entry *entry = archive->buckets[i];
+			archive->buckets[i] = entry->next;
+			free(entry->path);
+			free(entry);
 		}
+	}
+	free(archive);
 
-		*filename = (char*)malloc(nlen+1);
+	return res;
+}
 
-		rlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, *filename, nlen, &rlen);
-		if (rlen != nlen) {
-			printf("ERROR: %s: could not read filename\n", __func__);
-			return 0;
-		}
+/*
+ * Files requested with DLMessageDownloadFiles are read ahead on a separate
+ * thread, in the order of the request, into a small ring of blocks. Each
+ * block has room for the 5 byte length and code header in front of the
+ * data so that header and data go out with a single send.
+ */
+#define READER_BLOCKS 4
+#define SEND_BLOCK_SIZE_MAX (4*1024*1024)
 
-		char* p = *filename;
-		p[rlen] = 0;
+struct mb2_read_block {
+	uint32_t file;
+	int error;
+	uint64_t total;
+	uint32_t len;
+	int last;
+	char *buf;
+};
 
-		break;
-	} while(1 && !quit_flag);
+struct mb2_reader {
+	THREAD_T thread;
+	mutex_t mutex;
+	cond_t data_available;
+	cond_t space_available;
+	struct mb2_read_block blocks[READER_BLOCKS];
+	uint32_t head;
+	uint32_t count;
+	uint32_t block_size;
+	const char *backup_dir;
+	char **paths;
+	uint32_t num_paths;
+	int stop;
+};
 
-	return nlen;
+/* waits for a free block, returns NULL when the reader is stopped */
+static struct mb2_read_block* mb2_reader_get_free(struct mb2_reader *reader)
+{
+	struct mb2_read_block *block = NULL;
+
+	mutex_lock(&reader->mutex);
+	while (reader->count == READER_BLOCKS && !reader->stop) {
+		cond_wait(&reader->space_available, &reader->mutex);
+	}
+	if (!reader->stop) {
+		block = &reader->blocks[(reader->head + reader->count) % READER_BLOCKS];
+	}
+	mutex_unlock(&reader->mutex);
+
+	return block;
 }
 
-static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir, const char **writeFiles, int writeCnt)
+static void mb2_reader_push(struct mb2_reader *reader)
 {
-	uint64_t backup_real_size = 0;
-	uint64_t backup_total_size = 0;
-	uint32_t blocksize;
-	uint32_t bdone;
-	uint32_t rlen;
-	uint32_t nlen = 0;
-	uint32_t r;
-	char buf[32768];
-	char *fname = NULL;
-	char *dname = NULL;
-	char *bname = NULL;
-	char code = 0;
+	mutex_lock(&reader->mutex);
+	reader->count++;
+	cond_signal(&reader->data_available);
+	mutex_unlock(&reader->mutex);
+}
+
+static void* mb2_reader_thread(void *arg)
+{
+	struct mb2_reader *reader = (struct mb2_reader*)arg;
+	uint32_t i;
+
+	for (i = 0; i < reader->num_paths; i++) {
+		struct mb2_archive_entry *archive_entry = NULL;
+		struct mb2_read_cache_entry *cache = NULL;
+		int cache_load = 0;
+		char *localfile = NULL;
+		FILE *f = NULL;
+		uint64_t total = 0;
+		uint64_t done = 0;
+		int error = 0;
+
+		if (mb2_archive_handles(reader->paths[i])) {
+			archive_entry = mb2_archive_lookup(backup_archive, reader->paths[i]);
+			if (!archive_entry) {
+				error = ENOENT;
+			} else {
+				total = archive_entry->size;
+				f = backup_archive->f;
+				if (total > 0 && fseeko(f, archive_entry->offset, SEEK_SET) != 0) {
+					error = errno;
+				}
+			}
+		} else {
+			localfile = string_build_path(reader->backup_dir, reader->paths[i], NULL);
+#ifdef WIN32
+			struct _stati64 fst;
+			if (_stati64(localfile, &fst) < 0)
+#else
+			struct stat fst;
+			if (stat(localfile, &fst) < 0)
+#endif
+			{
+				error = errno;
+				if (error != ENOENT)
+					printf("%s: stat failed on '%s': %d\n", __func__, localfile, errno);
+			} else {
+				total = fst.st_size;
+				if (total > 0) {
+					cache = mb2_read_cache_acquire(localfile, total, (int64_t)fst.st_mtime, &cache_load);
+				}
+				if (total > 0 && (!cache || cache_load)) {
+					f = fopen(localfile, "rb");
+					if (!f) {
+						printf("%s: Error opening local file '%s': %d\n", __func__, localfile, errno);
+						error = errno;
+					}
+				}
+			}
+		}
+
+		do {
+			struct mb2_read_block *block = mb2_reader_get_free(reader);
+			if (!block) {
+				break;
+			}
+			block->file = i;
+			block->error = error;
+			block->total = total;
+			block->len = 0;
+			if (!error && done < total) {
+				uint32_t length = ((total - done) < reader->block_size) ? (uint32_t)(total - done) : reader->block_size;
+				size_t r = 0;
+				if (cache && !cache_load && mb2_read_cache_wait(cache, done + length) != 0) {
+					/* the loading reader failed or stopped, continue from disk */
+					mb2_read_cache_release(cache);
+					cache = NULL;
+					f = fopen(localfile, "rb");
+					if (f && fseeko(f, done, SEEK_SET) != 0) {
+						fclose(f);
+						f = NULL;
+					}
+				}
+				if (cache && !cache_load) {
+					memcpy(block->buf + 5, cache->data + done, length);
+					mb2_read_cache_shared(length);
+					r = length;
+				} else if (f) {
+					mb2_io_throttle(length);
+					uint64_t start = stats_now_us();
+					r = fread(block->buf + 5, 1, length, f);
+					stats_add_phase(PHASE_READ, start, r);
+					if (cache && r > 0) {
+						memcpy(cache->data + done, block->buf + 5, r);
+						mb2_read_cache_fill(cache, done + r, 0);
+					}
+				}
+				if (r == 0) {
+					printf("%s: read error\n", __func__);
+					error = (errno) ? errno : EIO;
+					block->error = error;
+				} else {
+					block->len = (uint32_t)r;
+					done += r;
+				}
+			}
+			block->last = (error || done >= total);
+			mb2_reader_push(reader);
+		} while (!error && done < total);
+
+		if (f && !archive_entry) {
+			fclose(f);
+		}
+		if (cache) {
+			if (cache_load && done < total) {
+				mb2_read_cache_fill(cache, done, (error) ? error : EIO);
+			}
+			mb2_read_cache_release(cache);
+		}
+		free(localfile);
+		mutex_lock(&reader->mutex);
+		int stop = reader->stop;
+		mutex_unlock(&reader->mutex);
+		if (stop) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int mb2_reader_start(struct mb2_reader *reader, const char *backup_dir, char **paths, uint32_t num_paths)
+{
+	uint32_t i;
+
+	memset(reader, '\0', sizeof(struct mb2_reader));
+	reader->block_size = (transfer_block_size > SEND_BLOCK_SIZE_MAX) ? SEND_BLOCK_SIZE_MAX : transfer_block_size;
+	reader->backup_dir = backup_dir;
+	reader->paths = paths;
+	reader->num_paths = num_paths;
+	for (i = 0; i < READER_BLOCKS; i++) {
+		reader->blocks[i].buf = (char*)malloc(reader->block_size + 5);
+		if (!reader->blocks[i].buf) {
+			while (i-- > 0) {
+				free(reader->blocks[i].buf);
+			}
+			return -1;
+		}
+	}
+	mutex_init(&reader->mutex);
+	cond_init(&reader->data_available);
+	cond_init(&reader->space_available);
+	if (thread_new(&reader->thread, mb2_reader_thread, reader) != 0) {
+		for (i = 0; i < READER_BLOCKS; i++) {
+			free(reader->blocks[i].buf);
+		}
+		cond_destroy(&reader->space_available);
+		cond_destroy(&reader->data_available);
+		mutex_destroy(&reader->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+/* returns the next block, it stays valid until mb2_reader_release() is called */
+static struct mb2_read_block* mb2_reader_next(struct mb2_reader *reader)
+{
+	mutex_lock(&reader->mutex);
+	while (reader->count == 0) {
+		cond_wait(&reader->data_available, &reader->mutex);
+	}
+	struct mb2_read_block *block = &reader->blocks[reader->head];
+	mutex_unlock(&reader->mutex);
+
+	return block;
+}
+
+static void mb2_reader_release(struct mb2_reader *reader)
+{
+	mutex_lock(&reader->mutex);
+	reader->head = (reader->head + 1) % READER_BLOCKS;
+	reader->count--;
+	cond_signal(&reader->space_available);
+	mutex_unlock(&reader->mutex);
+}
+
+static void mb2_reader_stop(struct mb2_reader *reader)
+{
+	uint32_t i;
+
+	mutex_lock(&reader->mutex);
+	reader->stop = 1;
+	cond_signal(&reader->space_available);
+	mutex_unlock(&reader->mutex);
+
+	thread_join(reader->thread);
+	thread_free(reader->thread);
+
+	for (i = 0; i < READER_BLOCKS; i++) {
+		free(reader->blocks[i].buf);
+	}
+	cond_destroy(&reader->space_available);
+	cond_destroy(&reader->data_available);
+	mutex_destroy(&reader->mutex);
+}
+
+static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, struct mb2_reader *reader, const char *path, plist_t *errplist)
+{
+	uint32_t nlen = 0;
+	uint32_t pathlen = strlen(path);
+	uint32_t bytes = 0;
+	char buf[512];
+	struct mb2_read_block *block = NULL;
+	uint32_t slen = 0;
+	int errcode = -1;
+	int result = -1;
+	uint32_t length;
+	uint64_t total;
+	uint64_t sent;
+
+	mobilebackup2_error_t err;
+
+	/* send path length */
+	nlen = htobe32(pathlen);
+	err = mobilebackup2_send_raw(mobilebackup2, (const char*)&nlen, sizeof(nlen), &bytes);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		goto leave_proto_err;
+	}
+	if (bytes != (uint32_t)sizeof(nlen)) {
+		err = MOBILEBACKUP2_E_MUX_ERROR;
+		goto leave_proto_err;
+	}
+
+	/* send path */
+	err = mobilebackup2_send_raw(mobilebackup2, path, pathlen, &bytes);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		goto leave_proto_err;
+	}
+	if (bytes != pathlen) {
+		err = MOBILEBACKUP2_E_MUX_ERROR;
+		goto leave_proto_err;
+	}
+
+	block = mb2_reader_next(reader);
+	if (block->error && block->len == 0) {
+		if (block->error == ENOENT) {
+			result = -ENOENT;
+		}
+		errcode = block->error;
+		goto leave;
+	}
+
+	total = block->total;
+
+	char *format_size = string_format_size(total);
+	PRINT_VERBOSE(1, "Sending '%s' (%s)\n", path, format_size);
+	free(format_size);
+    fflush(stdout);
+
+	if (total == 0) {
+		errcode = 0;
+		goto leave;
+	}
+
+	sent = 0;
+    print_progress(sent, total);
+
+	do {
+		if (block->len == 0) {
+			errcode = block->error;
+			goto leave;
+		}
+		length = block->len;
+		/* send data size (block size + 1), code and data at once */
+		nlen = htobe32(length+1);
+		memcpy(block->buf, &nlen, sizeof(nlen));
+		block->buf[4] = CODE_FILE_DATA;
+		uint64_t start = stats_now_us();
+		err = mobilebackup2_send_raw(mobilebackup2, block->buf, length + 5, &bytes);
+		stats_add_phase(PHASE_SEND, start, length);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			printf("Error sending file block '%s': %d (%llu)\n", path, err, (unsigned long long)sent);
+			goto leave_proto_err;
+		}
+		if (bytes != length + 5) {
+			printf("Error: sent only %d of %d bytes\n", bytes, length + 5);
+			goto leave_proto_err;
+		}
+		sent += length;
+
+		print_progress(sent, total);
+
+		if (block->last) {
+			errcode = block->error;
+			break;
+		}
+		mb2_reader_release(reader);
+		block = mb2_reader_next(reader);
+	} while (1);
+
+leave:
+	if (block) {
+		/* skip what is left of this file, e.g. after an error */
+		while (!block->last) {
+			mb2_reader_release(reader);
+			block = mb2_reader_next(reader);
+		}
+		mb2_reader_release(reader);
+		block = NULL;
+	}
+	if (errcode == 0) {
+		result = 0;
+		nlen = 1;
+		nlen = htobe32(nlen);
+		memcpy(buf, &nlen, 4);
+		buf[4] = CODE_SUCCESS;
+		mobilebackup2_send_raw(mobilebackup2, buf, 5, &bytes);
+	} else {
+		if (!*errplist) {
+			*errplist = plist_new_dict();
+		}
+		char *errdesc = strerror(errcode);
+		mb2_multi_status_add_file_error(*errplist, path, errno_to_device_error(errcode), errdesc);
+
+		length = strlen(errdesc);
+		if (length > sizeof(buf) - 5) {
+			length = sizeof(buf) - 5;
+		}
+		nlen = htobe32(length+1);
+		memcpy(buf, &nlen, 4);
+		buf[4] = CODE_ERROR_LOCAL;
+		slen = 5;
+		memcpy(buf+slen, errdesc, length);
+		slen += length;
+		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, slen, &bytes);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			printf("could not send message\n");
+		}
+		if (bytes != slen) {
+			printf("could only send %d from %d\n", bytes, slen);
+		}
+	}
+
+leave_proto_err:
+	if (block) {
+		mb2_reader_release(reader);
+	}
+	return result;
+}
+
+static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+{
+	uint32_t cnt;
+	uint32_t i = 0;
+	uint32_t num_paths = 0;
+	uint32_t sent;
+	plist_t errplist = NULL;
+	struct mb2_reader reader;
+	char **paths = NULL;
+
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2) || !backup_dir) return;
+
+	plist_t files = plist_array_get_item(message, 1);
+	cnt = plist_array_get_size(files);
+
+	paths = (char**)calloc(cnt + 1, sizeof(char*));
+	for (i = 0; paths && i < cnt; i++) {
+		plist_t val = plist_array_get_item(files, i);
+		if (plist_get_node_type(val) != PLIST_STRING) {
+			continue;
+		}
+		char *str = NULL;
+		plist_get_string_val(val, &str);
+		if (!str)
+			continue;
+		paths[num_paths++] = str;
+	}
+
+	if (paths && mb2_reader_start(&reader, backup_dir, paths, num_paths) == 0) {
+		for (i = 0; i < num_paths; i++) {
+			int errCode = mb2_handle_send_file(mobilebackup2, &reader, paths[i], &errplist);
+
+			if (errCode < 0) {
+				if(errCode != -ENOENT)
+				{
+					printf("Error when sending file '%s' to device (%d)\n", paths[i], errCode);
+
+					if(errplist)
+						plist_print_to_stream(errplist, stdout);
+
+					fflush(stdout);
+				}
+
+				// TODO: perhaps we can continue, we've got a multi status response?!
+				break;
+			}
+		}
+		mb2_reader_stop(&reader);
+	} else {
+		printf("ERROR: %s: could not start reader thread!\n", __func__);
+	}
+
+	for (i = 0; i < num_paths; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+
+	/* send terminating 0 dword */
+	uint32_t zero = 0;
+	mobilebackup2_send_raw(mobilebackup2, (char*)&zero, 4, &sent);
+
+	if (!errplist) {
+		plist_t emptydict = plist_new_dict();
+		mobilebackup2_send_status_response(mobilebackup2, 0, NULL, emptydict);
+		plist_free(emptydict);
+	} else {
+		mobilebackup2_send_status_response(mobilebackup2, -13, "Multi status", errplist);
+		plist_free(errplist);
+	}
+}
+
+static int mb2_receive_filename(mobilebackup2_client_t mobilebackup2, char** filename)
+{
+	uint32_t nlen = 0;
+	uint32_t rlen = 0;
+
+	do {
+		nlen = 0;
+		rlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &rlen);
+		nlen = be32toh(nlen);
+
+		if ((nlen == 0) && (rlen == 4)) {
+			// a zero length means no more files to receive
+			return 0;
+		} else if(rlen == 0) {
+			// device needs more time, waiting...
+			continue;
+		} else if (nlen > 4096) {
+			// filename length is too large
+			printf("ERROR: %s: too large filename length (%d)!\n", __func__, nlen);
+			return 0;
+		}
+
+		if (*filename != NULL) {
+			free(*filename);
+			*filename = NULL;
+		}
+
+		*filename = (char*)malloc(nlen+1);
+
+		rlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, *filename, nlen, &rlen);
+		if (rlen != nlen) {
+			printf("ERROR: %s: could not read filename\n", __func__);
+			return 0;
+		}
+
+		char* p = *filename;
+		p[rlen] = 0;
+
+		break;
+	} while(1 && !mb2_quit_requested());
+
+	return nlen;
+}
+
+#define COPY_BUFFER_SIZE (1024*1024)
+#define COPY_WORKERS_MAX 16
+
+#if !defined(WIN32) && (defined(FICLONE) || defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SYS_SENDFILE_H))
+#define HAVE_KERNEL_COPY 1
+/*
+ * Lets the kernel copy the file: a reflink where the filesystem supports it
+ * (FICLONE on Btrfs/XFS), otherwise copy_file_range() or sendfile(). Returns 0 when the file was copied, -1 if the caller has to
+ * fall back to copying through userspace. Only falls back when nothing was
+ * written yet.
+ */
+static int mb2_copy_file_kernel(FILE *from, FILE *to, uint64_t size)
+{
+	int in_fd = fileno(from);
+	int out_fd = fileno(to);
+	uint64_t done = 0;
+
+#ifdef FICLONE
+	if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+		return 0;
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	while (done < size) {
+		ssize_t res = copy_file_range(in_fd, NULL, out_fd, NULL, (size_t)(size - done), 0);
+		if (res <= 0) {
+			break;
+		}
+		done += res;
+	}
+	if (done == size) {
+		return 0;
+	}
+	if (done > 0) {
+		return 1;
+	}
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+	while (done < size) {
+		ssize_t res = sendfile(out_fd, in_fd, NULL, (size_t)(size - done));
+		if (res <= 0) {
+			break;
+		}
+		done += res;
+	}
+	if (done == size) {
+		return 0;
+	}
+	if (done > 0) {
+		return 1;
+	}
+#endif
+	return -1;
+}
+#endif
+
+static int mb2_copy_file_by_path(const char *src, const char *dst)
+{
+	FILE *from, *to;
+	char *buf;
+	size_t length;
+	int res = 0;
+
+#ifdef HAVE_CLONEFILE
+	/* APFS: clone the file, clonefile() requires that dst does not exist */
+	remove_file(dst);
+	if (clonefile(src, dst, 0) == 0) {
+		return 0;
+	}
+#endif
+
+	/* open source file */
+	if ((from = fopen(src, "rb")) == NULL) {
+		printf("Cannot open source path '%s'.\n", src);
+		return -1;
+	}
+
+	/* open destination file */
+	if ((to = fopen(dst, "wb")) == NULL) {
+		printf("Cannot open destination file '%s'.\n", dst);
+		fclose(from);
+		return -1;
+	}
+
+#ifdef HAVE_KERNEL_COPY
+	struct stat fst;
+	if (fstat(fileno(from), &fst) == 0 && S_ISREG(fst.st_mode)) {
+		int kres = mb2_copy_file_kernel(from, to, (uint64_t)fst.st_size);
+		if (kres >= 0) {
+			if (kres > 0) {
+				printf("Error copying '%s': %s\n", src, strerror(errno));
+				res = -1;
+			}
+			fclose(from);
+			if (fclose(to) == EOF) {
+				printf("Error closing destination file.\n");
+				res = -1;
+			}
+			return res;
+		}
+	}
+#endif
+
+	buf = (char*)malloc(COPY_BUFFER_SIZE);
+	if (!buf) {
+		fclose(from);
+		fclose(to);
+		return -1;
+	}
+
+	/* copy the file */
+	while ((length = fread(buf, 1, COPY_BUFFER_SIZE, from)) != 0) {
+		if (fwrite(buf, 1, length, to) != length) {
+			printf("Error writing '%s': %s\n", dst, strerror(errno));
+			res = -1;
+			break;
+		}
+	}
+	free(buf);
+
+	if(fclose(from) == EOF) {
+		printf("Error closing source file.\n");
+	}
+
+	if(fclose(to) == EOF) {
+		printf("Error closing destination file.\n");
+		res = -1;
+	}
+
+	return res;
+}
+
+/*
+ * Optional content addressed store shared by all backups (--store DIR).
+ * Received files are written to DIR/tmp while their SHA-256 is computed,
+ * then moved to DIR/xx/<digest> unless a blob with that content exists
+ * already, and hardlinked into the backup tree. Where hardlinks are not
+ * possible the blob is copied (or cloned) instead.
+ */
+static char *blob_store_dir = NULL;
+
+struct mb2_store_file {
+	char *tmp_path;
+	char *dst_path;
+#ifdef HAVE_OPENSSL
+	SHA256_CTX ctx;
+#else
+	gcry_md_hd_t hd;
+#endif
+};
+
+static int blob_store_init(const char *dir)
+{
+	char *tmp_dir = string_build_path(dir, "tmp", NULL);
+	int res = mkdir_with_parents(tmp_dir, 0755);
+	if (res < 0) {
+		printf("ERROR: Unable to create blob store directory '%s': %s\n", tmp_dir, strerror(errno));
+	}
+	free(tmp_dir);
+#ifndef HAVE_OPENSSL
+	gcry_check_version(NULL);
+#endif
+	return res;
+}
+
+/* creates the temporary file a received file is written to before it is stored */
+static struct mb2_store_file* blob_store_file_new(const char *dst_path, FILE **f)
+{
+	struct mb2_store_file *sf = (struct mb2_store_file*)calloc(1, sizeof(struct mb2_store_file));
+	if (!sf) {
+		return NULL;
+	}
+	char *uuid = generate_uuid();
+	sf->tmp_path = string_build_path(blob_store_dir, "tmp", uuid, NULL);
+	free(uuid);
+	sf->dst_path = strdup(dst_path);
+	*f = fopen(sf->tmp_path, "wb");
+	if (!*f) {
+		free(sf->tmp_path);
+		free(sf->dst_path);
+		free(sf);
+		return NULL;
+	}
+#ifdef HAVE_OPENSSL
+	SHA256_Init(&sf->ctx);
+#else
+	gcry_md_open(&sf->hd, GCRY_MD_SHA256, 0);
+#endif
+	return sf;
+}
+
+static void blob_store_file_update(struct mb2_store_file *sf, const char *buf, uint32_t len)
+{
+#ifdef HAVE_OPENSSL
+	SHA256_Update(&sf->ctx, buf, len);
+#else
+	gcry_md_write(sf->hd, buf, len);
+#endif
+}
+
+static void blob_store_file_free(struct mb2_store_file *sf)
+{
+#ifndef HAVE_OPENSSL
+	gcry_md_close(sf->hd);
+#endif
+	free(sf->tmp_path);
+	free(sf->dst_path);
+	free(sf);
+}
+
+/* moves the closed temporary file into the store and links it to its destination, returns 0 or an errno value */
+static int blob_store_file_commit(struct mb2_store_file *sf)
+{
+	unsigned char digest[32];
+	char hex[65];
+	char prefix[3];
+	struct stat st;
+	int error = 0;
+	int i;
+
+#ifdef HAVE_OPENSSL
+	SHA256_Final(digest, &sf->ctx);
+#else
+	memcpy(digest, gcry_md_read(sf->hd, GCRY_MD_SHA256), 32);
+#endif
+	for (i = 0; i < 32; i++) {
+		sprintf(hex + i*2, "%02x", digest[i]);
+	}
+	memcpy(prefix, hex, 2);
+	prefix[2] = '\0';
+
+	char *blob_dir = string_build_path(blob_store_dir, prefix, NULL);
+	char *blob_path = string_build_path(blob_dir, hex, NULL);
+	if (stat(blob_path, &st) == 0) {
+		/* content is stored already */
+		remove_file(sf->tmp_path);
+	} else if (mkdir_with_parents(blob_dir, 0755) < 0 || rename(sf->tmp_path, blob_path) != 0) {
+		error = errno;
+		remove_file(sf->tmp_path);
+	}
+
+	if (!error) {
+		remove_file(sf->dst_path);
+#ifdef WIN32
+		if (mb2_copy_file_by_path(blob_path, sf->dst_path) < 0) {
+			error = EIO;
+		}
+#else
+		if (link(blob_path, sf->dst_path) != 0 && mb2_copy_file_by_path(blob_path, sf->dst_path) < 0) {
+			error = EIO;
+		}
+#endif
+	}
+	free(blob_path);
+	free(blob_dir);
+
+	return error;
+}
+
+/*
+ * Set of path suffixes given with -w/--write. A received file passes the
+ * filter if its path equals an entry or ends in '/' followed by an entry.
+ * Entries are kept in an open addressing hash table so each path component
+ * of a received file costs a single lookup.
+ */
+struct write_filter {
+	char **entries;
+	uint32_t count;
+	uint32_t table_size;
+};
+
+static uint32_t write_filter_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int write_filter_add(struct write_filter *filter, const char *entry)
+{
+	uint32_t i;
+
+	if (filter->count + 1 > filter->table_size / 2) {
+		uint32_t new_size = (filter->table_size) ? filter->table_size * 2 : 64;
+		char **new_entries = (char**)calloc(new_size, sizeof(char*));
+		if (!new_entries) {
+			return -1;
+		}
+		for (i = 0; i < filter->table_size; i++) {
+			if (filter->entries[i]) {
+				uint32_t pos = write_filter_hash(filter->entries[i]) & (new_size - 1);
+				while (new_entries[pos]) {
+					pos = (pos + 1) & (new_size - 1);
+				}
+				new_entries[pos] = filter->entries[i];
+			}
+		}
+		free(filter->entries);
+		filter->entries = new_entries;
+		filter->table_size = new_size;
+	}
+
+	uint32_t pos = write_filter_hash(entry) & (filter->table_size - 1);
+	while (filter->entries[pos]) {
+		if (!strcmp(filter->entries[pos], entry)) {
+			return 0;
+		}
+		pos = (pos + 1) & (filter->table_size - 1);
+	}
+	filter->entries[pos] = strdup(entry);
+	if (!filter->entries[pos]) {
+		return -1;
+	}
+	filter->count++;
+
+	return 0;
+}
+
+static const char* write_filter_lookup(const struct write_filter *filter, const char *str)
+{
+	uint32_t pos = write_filter_hash(str) & (filter->table_size - 1);
+	while (filter->entries[pos]) {
+		if (!strcmp(filter->entries[pos], str)) {
+			return filter->entries[pos];
+		}
+		pos = (pos + 1) & (filter->table_size - 1);
+	}
+	return NULL;
+}
+
+/* returns the matching filter entry for the given path or NULL */
+static const char* write_filter_match(const struct write_filter *filter, const char *path)
+{
+	const char *match = write_filter_lookup(filter, path);
+	const char *p = path;
+
+	while (!match && (p = strchr(p, '/')) != NULL) {
+		p++;
+		if (*p) {
+			match = write_filter_lookup(filter, p);
+		}
+	}
+
+	return match;
+}
+
+static void write_filter_free(struct write_filter *filter)
+{
+	uint32_t i;
+	for (i = 0; i < filter->table_size; i++) {
+		free(filter->entries[i]);
+	}
+	free(filter->entries);
+	memset(filter, '\0', sizeof(struct write_filter));
+}
+
+/*
+ * File data received from the device is handed to a dedicated writer
+ * thread so that a slow disk does not throttle the connection. The
+ * receiving thread fills buffers from a fixed pool and queues them, the
+ * writer thread writes them out and returns them to the pool. Closing a
+ * file is queued as well, so it happens after all its data was written.
+ */
+enum mb2_write_job_type {
+	WRITE_JOB_DATA,
+	WRITE_JOB_CLOSE,
+	WRITE_JOB_ARCHIVE_BEGIN,
+	WRITE_JOB_STOP
+};
+
+struct mb2_write_job {
+	enum mb2_write_job_type type;
+	FILE *f;
+	struct mb2_store_file *store;
+	char *archive_path;
+	char *buf;
+	uint32_t len;
+};
+
+struct mb2_writer {
+	THREAD_T thread;
+	mutex_t mutex;
+	cond_t job_available;
+	cond_t space_available;
+	struct mb2_write_job jobs[WRITER_QUEUE_SIZE];
+	uint32_t job_head;
+	uint32_t job_count;
+	char *buffers[WRITER_BUFFERS];
+	uint32_t num_buffers;
+	char *free_buffers[WRITER_BUFFERS];
+	uint32_t num_free;
+	uint32_t block_size;
+	int error;
+};
+
+static void* mb2_writer_thread(void *arg)
+{
+	struct mb2_writer *writer = (struct mb2_writer*)arg;
+
+	while (1) {
+		struct mb2_write_job job;
+
+		mutex_lock(&writer->mutex);
+		while (writer->job_count == 0) {
+			cond_wait(&writer->job_available, &writer->mutex);
+		}
+		job = writer->jobs[writer->job_head];
+		writer->job_head = (writer->job_head + 1) % WRITER_QUEUE_SIZE;
+		writer->job_count--;
+		mutex_unlock(&writer->mutex);
+
+		if (job.type == WRITE_JOB_STOP) {
+			break;
+		}
+
+		int error = 0;
+		if (job.type == WRITE_JOB_DATA) {
+			mb2_io_throttle(job.len);
+		}
+		uint64_t start = stats_now_us();
+		switch (job.type) {
+		case WRITE_JOB_DATA:
+			if (!job.f) {
+				error = mb2_archive_write(backup_archive, job.buf, job.len);
+			} else if (fwrite(job.buf, 1, job.len, job.f) != job.len) {
+				error = errno;
+			}
+			if (job.store) {
+				blob_store_file_update(job.store, job.buf, job.len);
+			}
+			break;
+		case WRITE_JOB_CLOSE:
+			if (!job.f) {
+				error = mb2_archive_end_file(backup_archive);
+			} else if (fclose(job.f) != 0) {
+				error = errno;
+			}
+			if (job.store) {
+				int store_error = blob_store_file_commit(job.store);
+				if (!error) {
+					error = store_error;
+				}
+				blob_store_file_free(job.store);
+			}
+			break;
+		case WRITE_JOB_ARCHIVE_BEGIN:
+			error = mb2_archive_begin_file(backup_archive, job.archive_path);
+			break;
+		case WRITE_JOB_STOP:
+		default:
+			break;
+		}
+		stats_add_phase(PHASE_WRITE, start, (job.type == WRITE_JOB_DATA) ? job.len : 0);
+
+		mutex_lock(&writer->mutex);
+		if (error && !writer->error) {
+			writer->error = error;
+		}
+		if (job.type == WRITE_JOB_DATA) {
+			writer->free_buffers[writer->num_free++] = job.buf;
+		}
+		cond_signal(&writer->space_available);
+		mutex_unlock(&writer->mutex);
+	}
+
+	return NULL;
+}
+
+static int mb2_writer_start(struct mb2_writer *writer, uint32_t block_size)
+{
+	memset(writer, '\0', sizeof(struct mb2_writer));
+	writer->block_size = block_size;
+	mutex_init(&writer->mutex);
+	cond_init(&writer->job_available);
+	cond_init(&writer->space_available);
+	if (thread_new(&writer->thread, mb2_writer_thread, writer) != 0) {
+		cond_destroy(&writer->space_available);
+		cond_destroy(&writer->job_available);
+		mutex_destroy(&writer->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+/* must be called with the writer locked */
+static void mb2_writer_queue(struct mb2_writer *writer, enum mb2_write_job_type type, FILE *f, struct mb2_store_file *store, char *buf, uint32_t len)
+{
+	while (writer->job_count == WRITER_QUEUE_SIZE) {
+		cond_wait(&writer->space_available, &writer->mutex);
+	}
+	struct mb2_write_job *job = &writer->jobs[(writer->job_head + writer->job_count) % WRITER_QUEUE_SIZE];
+	job->type = type;
+	job->f = f;
+	job->store = store;
+	job->archive_path = NULL;
+	job->buf = buf;
+	job->len = len;
+	writer->job_count++;
+	cond_signal(&writer->job_available);
+}
+
+/* returns a buffer of block_size bytes, waiting for one to become free if necessary */
+static char* mb2_writer_get_buffer(struct mb2_writer *writer)
+{
+	char *buf = NULL;
+
+	mutex_lock(&writer->mutex);
+	if (writer->num_free == 0 && writer->num_buffers < WRITER_BUFFERS) {
+		buf = (char*)malloc(writer->block_size);
+		if (buf) {
+			writer->buffers[writer->num_buffers++] = buf;
+		}
+	}
+	if (!buf) {
+		while (writer->num_free == 0 && writer->num_buffers > 0) {
+			cond_wait(&writer->space_available, &writer->mutex);
+		}
+		if (writer->num_free > 0) {
+			buf = writer->free_buffers[--writer->num_free];
+		}
+	}
+	mutex_unlock(&writer->mutex);
+
+	return buf;
+}
+
+static void mb2_writer_put_buffer(struct mb2_writer *writer, char *buf)
+{
+	mutex_lock(&writer->mutex);
+	writer->free_buffers[writer->num_free++] = buf;
+	mutex_unlock(&writer->mutex);
+}
+
+/* queues len bytes of buf to be written to f (NULL: the archive), buf is returned to the pool afterwards */
+static void mb2_writer_write(struct mb2_writer *writer, FILE *f, struct mb2_store_file *store, char *buf, uint32_t len)
+{
+	mutex_lock(&writer->mutex);
+	mb2_writer_queue(writer, WRITE_JOB_DATA, f, store, buf, len);
+	mutex_unlock(&writer->mutex);
+}
+
+/* queues closing f after all of its pending data was written, a store file is committed afterwards */
+static void mb2_writer_close(struct mb2_writer *writer, FILE *f, struct mb2_store_file *store)
+{
+	mutex_lock(&writer->mutex);
+	mb2_writer_queue(writer, WRITE_JOB_CLOSE, f, store, NULL, 0);
+	mutex_unlock(&writer->mutex);
+}
+
+/* queues starting a new archive member for path, following writes with f NULL go there */
+static void mb2_writer_archive_begin(struct mb2_writer *writer, const char *path)
+{
+	mutex_lock(&writer->mutex);
+	mb2_writer_queue(writer, WRITE_JOB_ARCHIVE_BEGIN, NULL, NULL, NULL, 0);
+	writer->jobs[(writer->job_head + writer->job_count - 1) % WRITER_QUEUE_SIZE].archive_path = strdup(path);
+	mutex_unlock(&writer->mutex);
+}
+
+/* waits for all queued jobs, stops the writer thread and returns the first write error (errno) */
+static int mb2_writer_finish(struct mb2_writer *writer)
+{
+	uint32_t i;
+
+	mutex_lock(&writer->mutex);
+	mb2_writer_queue(writer, WRITE_JOB_STOP, NULL, NULL, NULL, 0);
+	mutex_unlock(&writer->mutex);
+
+	thread_join(writer->thread);
+	thread_free(writer->thread);
+
+	for (i = 0; i < writer->num_buffers; i++) {
+		free(writer->buffers[i]);
+	}
+	cond_destroy(&writer->space_available);
+	cond_destroy(&writer->job_available);
+	mutex_destroy(&writer->mutex);
+
+	return writer->error;
+}
+
+static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir, const struct write_filter *filter)
+{
+	uint64_t backup_real_size = 0;
+	uint64_t backup_total_size = 0;
+	uint32_t blocksize;
+	uint32_t bdone;
+	uint32_t rlen;
+	uint32_t nlen = 0;
+	uint32_t r;
+	struct mb2_writer writer;
+	struct mb2_store_file *store_file = NULL;
+	char *buf = NULL;
+	uint32_t buf_used = 0;
+	char *fname = NULL;
+	char *dname = NULL;
+	char *bname = NULL;
+	char code = 0;
 	char last_code = 0;
 	plist_t node = NULL;
 	FILE *f = NULL;
@@ -1054,436 +2984,1857 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 	int errcode = 0;
 	char *errdesc = NULL;
 
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 4 || !backup_dir) return 0;
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 4 || !backup_dir) return 0;
+
+	node = plist_array_get_item(message, 3);
+	if (plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &backup_total_size);
+	}
+	if (backup_total_size > 0) {
+		PRINT_VERBOSE(2, "Receiving files\n");
+	}
+
+	if (mb2_writer_start(&writer, transfer_block_size) < 0) {
+		printf("ERROR: %s: could not start writer thread!\n", __func__);
+		return 0;
+	}
+
+	do {
+		if (mb2_quit_requested())
+			break;
+
+		nlen = mb2_receive_filename(mobilebackup2, &dname);
+		if (nlen == 0) {
+			break;
+		}
+
+		nlen = mb2_receive_filename(mobilebackup2, &fname);
+		if (!nlen) {
+			break;
+		}
+
+		int writeContent = 1;
+		int writeFiltered = 0;
+		const char *filterFile = NULL;
+
+		if (filter && filter->count > 0) {
+			writeFiltered = 1;
+			filterFile = write_filter_match(filter, fname);
+			writeContent = (filterFile != NULL);
+		}
+
+		if (bname != NULL) {
+			free(bname);
+			bname = NULL;
+		}
+
+		bname = string_build_path(backup_dir, fname, NULL);
+
+		int to_archive = (writeContent && mb2_archive_handles(fname));
+		if (to_archive) {
+			mb2_writer_archive_begin(&writer, fname);
+			f = NULL;
+		}
+
+		if (fname != NULL) {
+			free(fname);
+			fname = NULL;
+		}
+
+		r = 0;
+		nlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
+		if (r != 4) {
+			printf("ERROR: %s: could not receive code length!\n", __func__);
+			break;
+		}
+		nlen = be32toh(nlen);
+
+		last_code = code;
+		code = 0;
+
+		mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
+		if (r != 1) {
+			printf("ERROR: %s: could not receive code!\n", __func__);
+			break;
+		}
+
+		/* TODO remove this */
+		if ((code != CODE_SUCCESS) && (code != CODE_FILE_DATA) && (code != CODE_ERROR_REMOTE)) {
+			PRINT_VERBOSE(1, "Found new flag %02x\n", code);
+		}
+
+        uint64_t totalLen = 0;
+
+		/* files that do not pass the filter are drained without touching the disk */
+		uint64_t create_start = stats_now_us();
+		store_file = NULL;
+		if (to_archive) {
+			/* goes to the archive member started above */
+		} else if (writeContent && blob_store_dir) {
+			store_file = blob_store_file_new(bname, &f);
+			if (!store_file) {
+				f = NULL;
+			}
+		} else if (writeContent) {
+			remove_file(bname);
+			f = fopen(bname, "wb");
+		} else {
+			f = NULL;
+		}
+		if (writeContent) {
+			stats_add_phase(PHASE_CREATE, create_start, 0);
+		}
+		while ((f || to_archive || !writeContent) && (code == CODE_FILE_DATA)) {
+			blocksize = nlen-1;
+			bdone = 0;
+			rlen = 0;
+			while (bdone < blocksize) {
+				if (!buf) {
+					buf = mb2_writer_get_buffer(&writer);
+					buf_used = 0;
+					if (!buf) {
+						printf("ERROR: %s: out of memory!\n", __func__);
+						break;
+					}
+				}
+				if ((blocksize - bdone) < (writer.block_size - buf_used)) {
+					rlen = blocksize - bdone;
+				} else {
+					rlen = writer.block_size - buf_used;
+				}
+				uint64_t receive_start = stats_now_us();
+				mobilebackup2_receive_raw(mobilebackup2, buf + buf_used, rlen, &r);
+				stats_add_phase(PHASE_RECEIVE, receive_start, ((int)r > 0) ? r : 0);
+				if ((int)r <= 0) {
+					break;
+				}
+
+                totalLen += r;
+
+				if (writeContent) {
+					buf_used += r;
+					if (buf_used == writer.block_size) {
+						mb2_writer_write(&writer, f, store_file, buf, buf_used);
+						buf = NULL;
+					}
+				}
+
+				bdone += r;
+			}
+			if (bdone == blocksize) {
+				backup_real_size += blocksize;
+			}
+			if (backup_total_size > 0) {
+				print_progress(backup_real_size, backup_total_size);
+			}
+			if (mb2_quit_requested())
+				break;
+			nlen = 0;
+			mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
+			nlen = be32toh(nlen);
+			if (nlen > 0) {
+				last_code = code;
+				mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
+			} else {
+				break;
+			}
+		}
+		if (f || to_archive) {
+			if (buf && buf_used > 0) {
+				mb2_writer_write(&writer, f, store_file, buf, buf_used);
+				buf = NULL;
+			}
+			buf_used = 0;
+		    if(writeFiltered && writeContent) {
+		    	char *format_size = string_format_size(totalLen);
+            	PRINT_VERBOSE(1, "\nReceived '%s' (%s)\n", filterFile, format_size);
+            	free(format_size);
+                fflush(stdout);
+		    }
+
+			mb2_writer_close(&writer, f, store_file);
+			file_count++;
+		} else if (writeContent) {
+			errcode = errno_to_device_error(errno);
+			errdesc = strerror(errno);
+			printf("Error opening '%s' for writing: %s\n", bname, errdesc);
+			break;
+		}
+		if (nlen == 0) {
+			break;
+		}
+
+		/* check if an error message was received */
+		if (code == CODE_ERROR_REMOTE) {
+			/* error message */
+			char *msg = (char*)malloc(nlen);
+			mobilebackup2_receive_raw(mobilebackup2, msg, nlen-1, &r);
+			msg[r] = 0;
+			/* If sent using CODE_FILE_DATA, end marker will be CODE_ERROR_REMOTE which is not an error! */
+			if (last_code != CODE_FILE_DATA) {
+				fprintf(stdout, "\nReceived an error message from device: %s\n", msg);
+			}
+			free(msg);
+		}
+	} while (1);
+
+	if (fname != NULL)
+		free(fname);
+
+	if (buf) {
+		mb2_writer_put_buffer(&writer, buf);
+	}
+	int write_error = mb2_writer_finish(&writer);
+	if (write_error && !errcode) {
+		errcode = errno_to_device_error(write_error);
+		errdesc = strerror(write_error);
+		printf("Error writing backup data: %s\n", errdesc);
+	}
+
+	/* if there are leftovers to read, finish up cleanly */
+	if ((int)nlen-1 > 0) {
+		PRINT_VERBOSE(1, "\nDiscarding current data hunk.\n");
+		fname = (char*)malloc(nlen-1);
+		mobilebackup2_receive_raw(mobilebackup2, fname, nlen-1, &r);
+		free(fname);
+		remove_file(bname);
+	}
+
+	/* clean up */
+	if (bname != NULL)
+		free(bname);
+
+	if (dname != NULL)
+		free(dname);
+
+	plist_t empty_plist = plist_new_dict();
+	mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_plist);
+	plist_free(empty_plist);
+
+	return file_count;
+}
+
+static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+{
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+
+	plist_t node = plist_array_get_item(message, 1);
+	char *str = NULL;
+	if (plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &str);
+	}
+	if (!str) {
+		printf("ERROR: Malformed DLContentsOfDirectory message\n");
+		// TODO error handling
+		return;
+	}
+
+	char *path = string_build_path(backup_dir, str, NULL);
+
+	plist_t dirlist = plist_new_dict();
+
+	if (backup_archive) {
+		mb2_archive_list_directory(backup_archive, str, dirlist);
+	}
+	free(str);
+
+	DIR* cur_dir = opendir(path);
+	if (cur_dir) {
+#ifdef HAVE_FD_RELATIVE_FS
+		int fd = dirfd(cur_dir);
+#endif
+		struct dirent* ep;
+		while ((ep = readdir(cur_dir))) {
+			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+				continue;
+			}
+			struct stat st;
+#ifdef HAVE_FD_RELATIVE_FS
+			/* stat relative to the open directory, no path lookup per entry */
+			if (fstatat(fd, ep->d_name, &st, 0) < 0) {
+				continue;
+			}
+#else
+			char *fpath = string_build_path(path, ep->d_name, NULL);
+			int sres = (fpath) ? stat(fpath, &st) : -1;
+			free(fpath);
+			if (sres < 0) {
+				continue;
+			}
+#endif
+			const char *ftype = "DLFileTypeUnknown";
+			if (S_ISDIR(st.st_mode)) {
+				ftype = "DLFileTypeDirectory";
+			} else if (S_ISREG(st.st_mode)) {
+				ftype = "DLFileTypeRegular";
+			}
+			plist_t fdict = plist_new_dict();
+			plist_dict_set_item(fdict, "DLFileType", plist_new_string(ftype));
+			plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(st.st_size));
+			plist_dict_set_item(fdict, "DLFileModificationDate",
+					    plist_new_date(st.st_mtime - MAC_EPOCH, 0));
+
+			plist_dict_set_item(dirlist, ep->d_name, fdict);
+		}
+		closedir(cur_dir);
+	}
+	free(path);
+
+	/* TODO error handling */
+	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, 0, NULL, dirlist);
+	plist_free(dirlist);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+{
+	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+
+	plist_t dir = plist_array_get_item(message, 1);
+	char *str = NULL;
+	int errcode = 0;
+	char *errdesc = NULL;
+	plist_get_string_val(dir, &str);
+
+	if (str && mb2_archive_handles(str)) {
+		/* directories in the archive are implied by the paths of its members */
+		free(str);
+		mobilebackup2_send_status_response(mobilebackup2, 0, NULL, NULL);
+		return;
+	}
+
+	char *newpath = string_build_path(backup_dir, str, NULL);
+	free(str);
+
+	if (mkdir_with_parents(newpath, 0755) < 0) {
+		errdesc = strerror(errno);
+		if (errno != EEXIST) {
+			printf("mkdir: %s (%d)\n", errdesc, errno);
+		}
+		errcode = errno_to_device_error(errno);
+	}
+	free(newpath);
+	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, NULL);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
+
+/*
+ * Pool of threads copying files in parallel. Jobs are queued by the caller
+ * and picked up by the workers, mb2_copy_pool_finish() waits for all of them.
+ */
+/*
+ * Decryption of encrypted backups. Manifest.plist holds the backup keybag
+ * with the class keys, which are wrapped (RFC 3394) with a key derived from
+ * the backup password. Every file has its own key, wrapped with the key of
+ * its protection class, and is encrypted using AES-256 in CBC mode with a
+ * zero IV. Manifest.db is encrypted the same way using ManifestKey.
+ */
+#define KEYBAG_MAX_CLASSES 16
+#define KEYBAG_WRAP_PASSCODE 2
+#define WRAPPED_KEY_SIZE 40
+#define FILE_KEY_SIZE 32
+
+struct backup_keybag_class {
+	uint32_t protection_class;
+	uint32_t wrap;
+	unsigned char wrapped_key[WRAPPED_KEY_SIZE];
+	unsigned char key[FILE_KEY_SIZE];
+	int unlocked;
+};
+
+struct backup_keybag {
+	unsigned char salt[64];
+	uint32_t salt_length;
+	uint32_t iterations;
+	unsigned char dp_salt[64];
+	uint32_t dp_salt_length;
+	uint32_t dp_iterations;
+	struct backup_keybag_class classes[KEYBAG_MAX_CLASSES];
+	int num_classes;
+	unsigned char manifest_key[FILE_KEY_SIZE];
+	int have_manifest_key;
+};
+
+struct backup_cipher {
+#ifdef HAVE_OPENSSL
+	EVP_CIPHER_CTX *ctx;
+#else
+	gcry_cipher_hd_t hd;
+#endif
+};
+
+static uint32_t keybag_get_u32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* parses the TLV encoded keybag; tags before the second UUID belong to the keybag itself */
+static int backup_keybag_parse(struct backup_keybag *keybag, const unsigned char *data, uint64_t length)
+{
+	struct backup_keybag_class *cur = NULL;
+	int have_uuid = 0;
+	uint64_t offset = 0;
+
+	memset(keybag, '\0', sizeof(struct backup_keybag));
+	while (offset + 8 <= length) {
+		const unsigned char *tag = data + offset;
+		uint32_t len = keybag_get_u32(data + offset + 4);
+		const unsigned char *value = data + offset + 8;
+		if (len > length - offset - 8) {
+			return -1;
+		}
+		offset += 8 + len;
+
+		if (!memcmp(tag, "UUID", 4)) {
+			if (!have_uuid) {
+				have_uuid = 1;
+				continue;
+			}
+			if (keybag->num_classes == KEYBAG_MAX_CLASSES) {
+				return -1;
+			}
+			cur = &keybag->classes[keybag->num_classes++];
+		} else if (!cur) {
+			if (!memcmp(tag, "SALT", 4) && len <= sizeof(keybag->salt)) {
+				memcpy(keybag->salt, value, len);
+				keybag->salt_length = len;
+			} else if (!memcmp(tag, "ITER", 4) && len == 4) {
+				keybag->iterations = keybag_get_u32(value);
+			} else if (!memcmp(tag, "DPSL", 4) && len <= sizeof(keybag->dp_salt)) {
+				memcpy(keybag->dp_salt, value, len);
+				keybag->dp_salt_length = len;
+			} else if (!memcmp(tag, "DPIC", 4) && len == 4) {
+				keybag->dp_iterations = keybag_get_u32(value);
+			}
+		} else if (!memcmp(tag, "CLAS", 4) && len == 4) {
+			cur->protection_class = keybag_get_u32(value);
+		} else if (!memcmp(tag, "WRAP", 4) && len == 4) {
+			cur->wrap = keybag_get_u32(value);
+		} else if (!memcmp(tag, "WPKY", 4) && len == WRAPPED_KEY_SIZE) {
+			memcpy(cur->wrapped_key, value, WRAPPED_KEY_SIZE);
+		}
+	}
+
+	return (keybag->num_classes > 0 && keybag->salt_length > 0 && keybag->iterations > 0) ? 0 : -1;
+}
+
+static int backup_pbkdf2(int use_sha256, const unsigned char *pass, size_t pass_len, const unsigned char *salt, size_t salt_len, uint32_t iterations, unsigned char *out)
+{
+#ifdef HAVE_OPENSSL
+	return (PKCS5_PBKDF2_HMAC((const char*)pass, (int)pass_len, salt, (int)salt_len, (int)iterations, (use_sha256) ? EVP_sha256() : EVP_sha1(), 32, out) == 1) ? 0 : -1;
+#else
+	return (gcry_kdf_derive(pass, pass_len, GCRY_KDF_PBKDF2, (use_sha256) ? GCRY_MD_SHA256 : GCRY_MD_SHA1, salt, salt_len, iterations, 32, out) == 0) ? 0 : -1;
+#endif
+}
+
+/* RFC 3394 key unwrap of a 40 byte wrapped key; fails if the integrity check does */
+static int backup_aes_unwrap(const unsigned char *kek, const unsigned char *wrapped, unsigned char *key)
+{
+	int res = -1;
+#ifdef HAVE_OPENSSL
+	unsigned char out[WRAPPED_KEY_SIZE];
+	int len = 0;
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if (!ctx) {
+		return -1;
+	}
+	EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+	if (EVP_DecryptInit_ex(ctx, EVP_aes_256_wrap(), NULL, kek, NULL) == 1
+	    && EVP_DecryptUpdate(ctx, out, &len, wrapped, WRAPPED_KEY_SIZE) == 1
+	    && len == FILE_KEY_SIZE) {
+		memcpy(key, out, FILE_KEY_SIZE);
+		res = 0;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+#else
+	gcry_cipher_hd_t hd = NULL;
+	if (gcry_cipher_open(&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_AESWRAP, 0) != 0) {
+		return -1;
+	}
+	if (gcry_cipher_setkey(hd, kek, 32) == 0 && gcry_cipher_decrypt(hd, key, FILE_KEY_SIZE, wrapped, WRAPPED_KEY_SIZE) == 0) {
+		res = 0;
+	}
+	gcry_cipher_close(hd);
+#endif
+	return res;
+}
+
+/* derives the key from the password and unwraps all class keys with it */
+static int backup_keybag_unlock(struct backup_keybag *keybag, const char *password)
+{
+	unsigned char dp_key[32];
+	unsigned char passcode_key[32];
+	const unsigned char *pass = (const unsigned char*)password;
+	size_t pass_len = strlen(password);
+	int res = -1;
+	int i;
+
+#ifndef HAVE_OPENSSL
+	gcry_check_version(NULL);
+#endif
+	if (keybag->dp_salt_length > 0 && keybag->dp_iterations > 0) {
+		/* iOS 10.2 and later derive the key in two rounds */
+		if (backup_pbkdf2(1, pass, pass_len, keybag->dp_salt, keybag->dp_salt_length, keybag->dp_iterations, dp_key) < 0) {
+			return -1;
+		}
+		pass = dp_key;
+		pass_len = sizeof(dp_key);
+	}
+	if (backup_pbkdf2(0, pass, pass_len, keybag->salt, keybag->salt_length, keybag->iterations, passcode_key) == 0) {
+		res = 0;
+		for (i = 0; i < keybag->num_classes; i++) {
+			struct backup_keybag_class *cls = &keybag->classes[i];
+			if ((cls->wrap & KEYBAG_WRAP_PASSCODE) == 0) {
+				continue;
+			}
+			if (backup_aes_unwrap(passcode_key, cls->wrapped_key, cls->key) < 0) {
+				res = -1;
+				break;
+			}
+			cls->unlocked = 1;
+		}
+	}
+	memset(dp_key, '\0', sizeof(dp_key));
+	memset(passcode_key, '\0', sizeof(passcode_key));
+
+	return res;
+}
+
+/* unwraps a key stored as 4 byte little endian protection class followed by the wrapped key */
+static int backup_keybag_unwrap_key(const struct backup_keybag *keybag, const unsigned char *data, size_t length, unsigned char *key)
+{
+	uint32_t protection_class;
+	int i;
+
+	if (length != 4 + WRAPPED_KEY_SIZE) {
+		return -1;
+	}
+	protection_class = data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+	for (i = 0; i < keybag->num_classes; i++) {
+		if (keybag->classes[i].protection_class == protection_class && keybag->classes[i].unlocked) {
+			return backup_aes_unwrap(keybag->classes[i].key, data + 4, key);
+		}
+	}
+	return -1;
+}
+
+static int backup_is_encrypted(const char *backup_path)
+{
+	plist_t manifest_plist = NULL;
+	uint8_t is_encrypted = 0;
+
+	char *manifest_path = string_build_path(backup_path, "Manifest.plist", NULL);
+	plist_read_from_filename(&manifest_plist, manifest_path);
+	free(manifest_path);
+	plist_t node = plist_dict_get_item(manifest_plist, "IsEncrypted");
+	if (plist_get_node_type(node) == PLIST_BOOLEAN) {
+		plist_get_bool_val(node, &is_encrypted);
+	}
+	plist_free(manifest_plist);
+
+	return is_encrypted;
+}
+
+/*
+ * Reads and unlocks the keybag of an encrypted backup. Returns 1 if the
+ * backup is not encrypted, 0 on success and -1 on error.
+ */
+static int backup_keybag_load(struct backup_keybag *keybag, const char *backup_path, const char *password)
+{
+	plist_t manifest_plist = NULL;
+	uint8_t is_encrypted = 0;
+	int res = -1;
+
+	char *manifest_path = string_build_path(backup_path, "Manifest.plist", NULL);
+	plist_read_from_filename(&manifest_plist, manifest_path);
+	free(manifest_path);
+	if (!manifest_plist) {
+		/* nothing to unlock */
+		return 1;
+	}
+
+	plist_t node = plist_dict_get_item(manifest_plist, "IsEncrypted");
+	if (plist_get_node_type(node) == PLIST_BOOLEAN) {
+		plist_get_bool_val(node, &is_encrypted);
+	}
+	if (!is_encrypted) {
+		plist_free(manifest_plist);
+		return 1;
+	}
+	if (!password) {
+		printf("ERROR: The backup is encrypted, a password is required.\n");
+		plist_free(manifest_plist);
+		return -1;
+	}
+
+	uint64_t length = 0;
+	const char *data = NULL;
+	node = plist_dict_get_item(manifest_plist, "BackupKeyBag");
+	if (plist_get_node_type(node) == PLIST_DATA) {
+		data = plist_get_data_ptr(node, &length);
+	}
+	if (!data || backup_keybag_parse(keybag, (const unsigned char*)data, length) < 0) {
+		printf("ERROR: Could not parse the keybag of the backup.\n");
+	} else if (backup_keybag_unlock(keybag, password) < 0) {
+		printf("ERROR: Could not unlock the keybag, wrong password?\n");
+	} else {
+		res = 0;
+		data = NULL;
+		node = plist_dict_get_item(manifest_plist, "ManifestKey");
+		if (plist_get_node_type(node) == PLIST_DATA) {
+			data = plist_get_data_ptr(node, &length);
+		}
+		if (data && backup_keybag_unwrap_key(keybag, (const unsigned char*)data, length, keybag->manifest_key) == 0) {
+			keybag->have_manifest_key = 1;
+		}
+	}
+	plist_free(manifest_plist);
+
+	return res;
+}
+
+static void backup_keybag_free(struct backup_keybag *keybag)
+{
+	memset(keybag, '\0', sizeof(struct backup_keybag));
+}
+
+static int backup_cipher_init(struct backup_cipher *cipher, const unsigned char *key)
+{
+	static const unsigned char iv[16] = { 0 };
+#ifdef HAVE_OPENSSL
+	cipher->ctx = EVP_CIPHER_CTX_new();
+	if (!cipher->ctx || EVP_DecryptInit_ex(cipher->ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1) {
+		EVP_CIPHER_CTX_free(cipher->ctx);
+		cipher->ctx = NULL;
+		return -1;
+	}
+	EVP_CIPHER_CTX_set_padding(cipher->ctx, 0);
+#else
+	cipher->hd = NULL;
+	if (gcry_cipher_open(&cipher->hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CBC, 0) != 0) {
+		return -1;
+	}
+	if (gcry_cipher_setkey(cipher->hd, key, FILE_KEY_SIZE) != 0 || gcry_cipher_setiv(cipher->hd, iv, sizeof(iv)) != 0) {
+		gcry_cipher_close(cipher->hd);
+		cipher->hd = NULL;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* decrypts len bytes in place, len has to be a multiple of the block size */
+static int backup_cipher_decrypt(struct backup_cipher *cipher, unsigned char *buf, size_t len)
+{
+#ifdef HAVE_OPENSSL
+	int outlen = 0;
+	return (EVP_DecryptUpdate(cipher->ctx, buf, &outlen, buf, (int)len) == 1 && (size_t)outlen == len) ? 0 : -1;
+#else
+	return (gcry_cipher_decrypt(cipher->hd, buf, len, NULL, 0) == 0) ? 0 : -1;
+#endif
+}
+
+static void backup_cipher_free(struct backup_cipher *cipher)
+{
+#ifdef HAVE_OPENSSL
+	EVP_CIPHER_CTX_free(cipher->ctx);
+	cipher->ctx = NULL;
+#else
+	gcry_cipher_close(cipher->hd);
+	cipher->hd = NULL;
+#endif
+}
+
+/* decrypts src to dst in one pass, the output is cut to the original size */
+static int backup_decrypt_file(const char *src, const char *dst, const unsigned char *key, uint64_t size)
+{
+	struct backup_cipher cipher;
+	uint64_t remaining = size;
+	int res = 0;
+
+	FILE *from = fopen(src, "rb");
+	if (!from) {
+		printf("Error opening '%s' for reading: %s\n", src, strerror(errno));
+		return -1;
+	}
+	FILE *to = fopen(dst, "wb");
+	if (!to) {
+		printf("Error opening '%s' for writing: %s\n", dst, strerror(errno));
+		fclose(from);
+		return -1;
+	}
+	unsigned char *buf = (unsigned char*)malloc(COPY_BUFFER_SIZE);
+	if (!buf || backup_cipher_init(&cipher, key) < 0) {
+		free(buf);
+		fclose(from);
+		fclose(to);
+		return -1;
+	}
+
+	while (remaining > 0) {
+		size_t r = fread(buf, 1, COPY_BUFFER_SIZE, from);
+		if (r == 0) {
+			break;
+		}
+		r &= ~(size_t)15;
+		if (r == 0 || backup_cipher_decrypt(&cipher, buf, r) < 0) {
+			break;
+		}
+		size_t len = (r < remaining) ? r : (size_t)remaining;
+		if (fwrite(buf, 1, len, to) != len) {
+			res = -1;
+			break;
+		}
+		remaining -= len;
+	}
+	if (remaining > 0) {
+		printf("Error decrypting '%s'\n", src);
+		res = -1;
+	}
+	backup_cipher_free(&cipher);
+	free(buf);
+	fclose(from);
+	if (fclose(to) != 0) {
+		res = -1;
+	}
+
+	return res;
+}
+
+struct mb2_copy_job {
+	char *src;
+	char *dst;
+	int decrypt;
+	unsigned char key[FILE_KEY_SIZE];
+	uint64_t size;
+	struct mb2_copy_job *next;
+};
+
+struct mb2_copy_pool {
+	THREAD_T threads[COPY_WORKERS_MAX];
+	int num_threads;
+	mutex_t mutex;
+	cond_t cond;
+	struct mb2_copy_job *head;
+	struct mb2_copy_job *tail;
+	int closing;
+	uint32_t copied;
+	uint32_t failed;
+};
+
+static int mb2_copy_default_workers(void)
+{
+#ifdef WIN32
+	return 4;
+#else
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		return 1;
+	}
+	return (cpus > COPY_WORKERS_MAX) ? COPY_WORKERS_MAX : (int)cpus;
+#endif
+}
+
+static void* mb2_copy_worker(void *arg)
+{
+	struct mb2_copy_pool *pool = (struct mb2_copy_pool*)arg;
+
+	while (1) {
+		mutex_lock(&pool->mutex);
+		while (!pool->head && !pool->closing) {
+			cond_wait(&pool->cond, &pool->mutex);
+		}
+		struct mb2_copy_job *job = pool->head;
+		if (job) {
+			pool->head = job->next;
+			if (!pool->head) {
+				pool->tail = NULL;
+			}
+		}
+		if (!job) {
+			/* pass the wakeup on to the next worker */
+			cond_signal(&pool->cond);
+			mutex_unlock(&pool->mutex);
+			break;
+		}
+		mutex_unlock(&pool->mutex);
+
+		int res = -1;
+		if (!quit_flag) {
+			res = (job->decrypt) ? backup_decrypt_file(job->src, job->dst, job->key, job->size) : mb2_copy_file_by_path(job->src, job->dst);
+		}
+		memset(job->key, '\0', sizeof(job->key));
+		if (res < 0) {
+			__sync_add_and_fetch(&pool->failed, 1);
+		} else {
+			__sync_add_and_fetch(&pool->copied, 1);
+		}
+		free(job->src);
+		free(job->dst);
+		free(job);
+	}
+
+	return NULL;
+}
+
+static void mb2_copy_pool_start(struct mb2_copy_pool *pool, int num_threads)
+{
+	memset(pool, '\0', sizeof(struct mb2_copy_pool));
+	mutex_init(&pool->mutex);
+	cond_init(&pool->cond);
+	if (num_threads > COPY_WORKERS_MAX) {
+		num_threads = COPY_WORKERS_MAX;
+	}
+	for (pool->num_threads = 0; pool->num_threads < num_threads; pool->num_threads++) {
+		if (thread_new(&pool->threads[pool->num_threads], mb2_copy_worker, pool) != 0) {
+			break;
+		}
+	}
+}
+
+/* queues a file to be copied, or decrypted with key if it is not NULL */
+static void mb2_copy_pool_add_file(struct mb2_copy_pool *pool, const char *src, const char *dst, const unsigned char *key, uint64_t size)
+{
+	if (pool->num_threads == 0) {
+		/* no workers, copy right away */
+		int res = (key) ? backup_decrypt_file(src, dst, key, size) : mb2_copy_file_by_path(src, dst);
+		if (res < 0) {
+			pool->failed++;
+		} else {
+			pool->copied++;
+		}
+		return;
+	}
+
+	struct mb2_copy_job *job = (struct mb2_copy_job*)malloc(sizeof(struct mb2_copy_job));
+	if (!job) {
+		pool->failed++;
+		return;
+	}
+	job->src = strdup(src);
+	job->dst = strdup(dst);
+	job->decrypt = (key != NULL);
+	if (key) {
+		memcpy(job->key, key, FILE_KEY_SIZE);
+	}
+	job->size = size;
+	job->next = NULL;
+
+	mutex_lock(&pool->mutex);
+	if (pool->tail) {
+		pool->tail->next = job;
+	} else {
+		pool->head = job;
+	}
+	pool->tail = job;
+	cond_signal(&pool->cond);
+	mutex_unlock(&pool->mutex);
+}
+
+static void mb2_copy_pool_add(struct mb2_copy_pool *pool, const char *src, const char *dst)
+{
+	mb2_copy_pool_add_file(pool, src, dst, NULL, 0);
+}
+
+/* waits until all queued files are copied, returns the number of failures */
+static uint32_t mb2_copy_pool_finish(struct mb2_copy_pool *pool)
+{
+	int i;
+
+	mutex_lock(&pool->mutex);
+	pool->closing = 1;
+	cond_signal(&pool->cond);
+	mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) {
+		thread_join(pool->threads[i]);
+		thread_free(pool->threads[i]);
+	}
+	cond_destroy(&pool->cond);
+	mutex_destroy(&pool->mutex);
+
+	return pool->failed;
+}
+
+static void mb2_copy_directory_recursive(struct mb2_copy_pool *pool, const char *src, const char *dst)
+{
+	struct stat st;
+
+	/* if dst directory does not exist */
+	if ((stat(dst, &st) < 0) || !S_ISDIR(st.st_mode)) {
+		/* create it */
+		if (mkdir_with_parents(dst, 0755) < 0) {
+			printf("ERROR: Unable to create destination directory '%s': %s (%d)\n", dst, strerror(errno), errno);
+			return;
+		}
+	}
+
+	/* loop over src directory contents */
+	DIR *cur_dir = opendir(src);
+	if (cur_dir) {
+		struct dirent* ep;
+		while ((ep = readdir(cur_dir)) && !quit_flag) {
+			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+				continue;
+			}
+			char *srcpath = string_build_path(src, ep->d_name, NULL);
+			char *dstpath = string_build_path(dst, ep->d_name, NULL);
+			if (srcpath && dstpath) {
+				if ((stat(srcpath, &st) == 0) && S_ISDIR(st.st_mode)) {
+					mb2_copy_directory_recursive(pool, srcpath, dstpath);
+				} else {
+					/* copy file */
+					mb2_copy_pool_add(pool, srcpath, dstpath);
+				}
+			}
+
+			if (srcpath)
+				free(srcpath);
+			if (dstpath)
+				free(dstpath);
+		}
+		closedir(cur_dir);
+	}
+}
 
-	node = plist_array_get_item(message, 3);
-	if (plist_get_node_type(node) == PLIST_UINT) {
-		plist_get_uint_val(node, &backup_total_size);
+static void mb2_copy_directory_by_path(const char *src, const char *dst)
+{
+	if (!src || !dst) {
+		return;
 	}
-	if (backup_total_size > 0) {
-		PRINT_VERBOSE(2, "Receiving files\n");
+
+	struct stat st;
+
+	/* if src does not exist */
+	if ((stat(src, &st) < 0) || !S_ISDIR(st.st_mode)) {
+		printf("ERROR: Source directory does not exist '%s': %s (%d)\n", src, strerror(errno), errno);
+		return;
 	}
 
-	do {
-		if (quit_flag)
-			break;
+	struct mb2_copy_pool pool;
+	mb2_copy_pool_start(&pool, mb2_copy_default_workers());
+	mb2_copy_directory_recursive(&pool, src, dst);
+	mb2_copy_pool_finish(&pool);
+}
 
-		nlen = mb2_receive_filename(mobilebackup2, &dname);
-		if (nlen == 0) {
-			break;
-		}
+/* lists shorter than this are removed on the calling thread alone */
+#define REMOVE_PARALLEL_MIN 64
 
-		nlen = mb2_receive_filename(mobilebackup2, &fname);
-		if (!nlen) {
+struct mb2_remove_item {
+	char *path;
+	int result;
+	int suppress_warning;
+};
+
+struct mb2_remove_pool {
+	struct mb2_remove_item *items;
+	uint32_t count;
+	uint32_t next;
+};
+
+static void* mb2_remove_worker(void *arg)
+{
+	struct mb2_remove_pool *pool = (struct mb2_remove_pool*)arg;
+
+	while (!quit_flag) {
+		uint32_t i = __sync_fetch_and_add(&pool->next, 1);
+		if (i >= pool->count) {
 			break;
 		}
+		if (pool->items[i].path) {
+			pool->items[i].result = remove_path(pool->items[i].path);
+		}
+	}
 
-        int writeContent = 1;
-        int writeFiltered = 0;
-        const char *filterFile;
+	return NULL;
+}
 
-        if(writeCnt) {
-            writeContent = 0;
-            writeFiltered = 1;
+static void mb2_handle_remove_items(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+{
+	plist_t removes = plist_array_get_item(message, 1);
+	uint32_t cnt = plist_array_get_size(removes);
+	PRINT_VERBOSE(1, "Removing %d file%s\n", cnt, (cnt == 1) ? "" : "s");
+	fflush(stdout);
 
-            for(int wi = 0; wi < writeCnt; wi++) {
-                const char *writeFile = writeFiles[wi];
-                int writeLen = strlen(writeFile);
-                int fileLen = strlen(fname);
-                int offset = fileLen-writeLen;
+	int errcode = 0;
+	const char *errdesc = NULL;
+	uint32_t ii = 0;
+
+	struct mb2_remove_pool pool;
+	memset(&pool, '\0', sizeof(struct mb2_remove_pool));
+	pool.items = (struct mb2_remove_item*)calloc((cnt > 0) ? cnt : 1, sizeof(struct mb2_remove_item));
+	if (!pool.items) {
+		errcode = errno_to_device_error(ENOMEM);
+		errdesc = strerror(ENOMEM);
+		cnt = 0;
+	}
 
-                // Compare the end of the filename to our list of files that need to match
+	/* archive entries are handled right away, the rest is collected */
+	for (ii = 0; ii < cnt; ii++) {
+		plist_t val = plist_array_get_item(removes, ii);
+		if (plist_get_node_type(val) != PLIST_STRING) {
+			continue;
+		}
+		char *str = NULL;
+		plist_get_string_val(val, &str);
+		if (!str) {
+			continue;
+		}
+		if (mb2_archive_handles(str)) {
+			mb2_archive_remove(backup_archive, str);
+			free(str);
+			continue;
+		}
+		struct mb2_remove_item *item = &pool.items[pool.count++];
+		const char *checkfile = strchr(str, '/');
+		item->path = string_build_path(backup_dir, str, NULL);
+		/* not removed unless a worker gets to it */
+		item->result = EINTR;
+		item->suppress_warning = (checkfile && (strcmp(checkfile+1, "Manifest.mbdx") == 0));
+		free(str);
+	}
 
-                if((offset > 0) && (fname[offset-1] == '/') && (strcmp(fname+offset, writeFile) == 0)) {
-                    writeContent = 1;
-                    filterFile = writeFile;
-                    break;
-                } else if((offset == 0) && (strcmp(fname, writeFile) == 0)) {
-                    writeContent = 1;
-                    filterFile = writeFile;
-                    break;
-                }
-            }
-        }
+	/* the calling thread takes part in the removal as well */
+	THREAD_T threads[COPY_WORKERS_MAX];
+	int num_threads = 0;
+	if (pool.count >= REMOVE_PARALLEL_MIN) {
+		int wanted = mb2_copy_default_workers() - 1;
+		for (num_threads = 0; num_threads < wanted; num_threads++) {
+			if (thread_new(&threads[num_threads], mb2_remove_worker, &pool) != 0) {
+				break;
+			}
+		}
+	}
+	mb2_remove_worker(&pool);
+	for (ii = 0; ii < (uint32_t)num_threads; ii++) {
+		thread_join(threads[ii]);
+		thread_free(threads[ii]);
+	}
 
-		if (bname != NULL) {
-			free(bname);
-			bname = NULL;
+	for (ii = 0; ii < pool.count; ii++) {
+		struct mb2_remove_item *item = &pool.items[ii];
+		int res = (item->path) ? item->result : ENOMEM;
+		if (res == ENOTEMPTY && num_threads > 0) {
+			/* a nested path was still being removed by another worker */
+			res = remove_path(item->path);
+		}
+		if (res != 0 && res != ENOENT) {
+			/* items skipped after an interruption are not worth a line each */
+			if (!item->suppress_warning && item->path && res != EINTR)
+				printf("Could not remove '%s': %s (%d)\n", item->path, strerror(res), res);
+			errcode = errno_to_device_error(res);
+			errdesc = strerror(res);
 		}
+		free(item->path);
+	}
+	free(pool.items);
 
-		bname = string_build_path(backup_dir, fname, NULL);
+	plist_t empty_dict = plist_new_dict();
+	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_dict);
+	plist_free(empty_dict);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		printf("Could not send status response, error %d\n", err);
+	}
+}
 
-		if (fname != NULL) {
-			free(fname);
-			fname = NULL;
-		}
+#ifdef WIN32
+#define BS_CC '\b'
+#define my_getch getch
+#else
+#define BS_CC 0x7f
+static int my_getch(void)
+{
+	struct termios oldt, newt;
+	int ch;
+	tcgetattr(STDIN_FILENO, &oldt);
+	newt = oldt;
+	newt.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+	ch = getchar();
+	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
+	return ch;
+}
+#endif
 
-		r = 0;
-		nlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-		if (r != 4) {
-			printf("ERROR: %s: could not receive code length!\n", __func__);
+static void get_hidden_input(char *buf, int maxlen)
+{
+	int pwlen = 0;
+	int c;
+
+	while ((c = my_getch())) {
+		if ((c == '\r') || (c == '\n')) {
 			break;
+		} else if (isprint(c)) {
+			if (pwlen < maxlen-1)
+				buf[pwlen++] = c;
+			fputc('*', stderr);
+		} else if (c == BS_CC) {
+			if (pwlen > 0) {
+				fputs("\b \b", stderr);
+				pwlen--;
+			}
 		}
-		nlen = be32toh(nlen);
+	}
+	buf[pwlen] = 0;
+}
 
-		last_code = code;
-		code = 0;
+static char* ask_for_password(const char* msg, int type_again)
+{
+	char pwbuf[256];
 
-		mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
-		if (r != 1) {
-			printf("ERROR: %s: could not receive code!\n", __func__);
-			break;
-		}
+	fprintf(stderr, "%s: ", msg);
+	fflush(stderr);
+	get_hidden_input(pwbuf, 256);
+	fputc('\n', stderr);
 
-		/* TODO remove this */
-		if ((code != CODE_SUCCESS) && (code != CODE_FILE_DATA) && (code != CODE_ERROR_REMOTE)) {
-			PRINT_VERBOSE(1, "Found new flag %02x\n", code);
+	if (type_again) {
+		char pwrep[256];
+
+		fprintf(stderr, "%s (repeat): ", msg);
+		fflush(stderr);
+		get_hidden_input(pwrep, 256);
+		fputc('\n', stderr);
+
+		if (strcmp(pwbuf, pwrep) != 0) {
+			printf("ERROR: passwords don't match\n");
+			return NULL;
 		}
+	}
+	return strdup(pwbuf);
+}
 
-        uint64_t totalLen = 0;
+/**
+ * signal handler function for cleaning up properly
+ */
+static void clean_exit(int sig)
+{
+	fprintf(stderr, "Exiting...\n");
+	quit_flag++;
+}
 
-		remove_file(bname);
-		f = fopen(bname, "wb");
-		while (f && (code == CODE_FILE_DATA)) {
-			blocksize = nlen-1;
-			bdone = 0;
-			rlen = 0;
-			while (bdone < blocksize) {
-				if ((blocksize - bdone) < sizeof(buf)) {
-					rlen = blocksize - bdone;
-				} else {
-					rlen = sizeof(buf);
-				}
-				mobilebackup2_receive_raw(mobilebackup2, buf, rlen, &r);
-				if ((int)r <= 0) {
-					break;
-				}
+/*
+ * Host side index of a backup. The Files table of Manifest.db is read once
+ * and written to Manifest.idx next to it as an array of fixed size entries
+ * sorted by "domain/relativePath", followed by a pool holding the keys.
+ * The index is mapped into memory for lookups and is rebuilt automatically
+ * when Manifest.db changes. It is a local cache and uses host byte order.
+ */
+#define BACKUP_INDEX_MAGIC "MB2INDEX"
+#define BACKUP_INDEX_VERSION 2
+#define BACKUP_INDEX_NAME "Manifest.idx"
+
+#define BACKUP_INDEX_FLAG_FILE 1
+#define BACKUP_INDEX_FLAG_DIRECTORY 2
+#define BACKUP_INDEX_FLAG_SYMLINK 4
+#define BACKUP_INDEX_FLAG_ENCRYPTED (1 << 8)
+#define BACKUP_INDEX_FLAG_DIGEST (1 << 9)
+
+struct backup_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint64_t manifest_size;
+	uint64_t manifest_mtime;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+};
 
-                totalLen += r;
+struct backup_index_entry {
+	uint64_t key_offset;
+	uint64_t size;
+	uint64_t mtime;
+	uint32_t key_length;
+	uint32_t flags;
+	unsigned char file_id[20];
+	unsigned char digest[20];
+	/* wrapped file key of encrypted backups, see backup_keybag_unwrap_key() */
+	uint32_t encryption_key_length;
+	unsigned char encryption_key[4 + WRAPPED_KEY_SIZE];
+};
 
-				if(writeContent)
-    				fwrite(buf, 1, r, f);
+struct backup_index {
+	struct mapped_buffer map;
+	const struct backup_index_header *header;
+	const struct backup_index_entry *entries;
+	const char *strings;
+	char *backup_path;
+};
 
-				bdone += r;
-			}
-			if (bdone == blocksize) {
-				backup_real_size += blocksize;
-			}
-			if (backup_total_size > 0) {
-				print_progress(backup_real_size, backup_total_size);
-			}
-			if (quit_flag)
-				break;
-			nlen = 0;
-			mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-			nlen = be32toh(nlen);
-			if (nlen > 0) {
-				last_code = code;
-				mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
-			} else {
-				break;
-			}
-		}
-		if (f) {
-		    if(writeFiltered && writeContent) {
-		    	char *format_size = string_format_size(totalLen);
-            	PRINT_VERBOSE(1, "\nReceived '%s' (%s)\n", filterFile, format_size);
-            	free(format_size);
-                fflush(stdout);
-		    }
+static const char* backup_index_key(const struct backup_index *index, const struct backup_index_entry *entry)
+{
+	return index->strings + entry->key_offset;
+}
 
-			fclose(f);
-			file_count++;
+static int backup_index_stat_manifest(const char *backup_path, uint64_t *size, uint64_t *mtime)
+{
+	struct stat fst;
+	char *manifest_path = string_build_path(backup_path, "Manifest.db", NULL);
+	int res = stat(manifest_path, &fst);
+	free(manifest_path);
+	if (res != 0) {
+		return -1;
+	}
+	*size = (uint64_t)fst.st_size;
+	*mtime = (uint64_t)fst.st_mtime;
+	return 0;
+}
+
+static void backup_index_close(struct backup_index *index)
+{
+	buffer_unmap(&index->map);
+	free(index->backup_path);
+	memset(index, '\0', sizeof(struct backup_index));
+}
+
+/* maps an existing index, fails if it is missing, invalid or outdated */
+static int backup_index_open(struct backup_index *index, const char *backup_path)
+{
+	uint64_t manifest_size = 0;
+	uint64_t manifest_mtime = 0;
+	char *index_path = string_build_path(backup_path, BACKUP_INDEX_NAME, NULL);
+
+	memset(index, '\0', sizeof(struct backup_index));
+	int res = buffer_map_from_filename(index_path, &index->map, 0);
+	free(index_path);
+	if (res < 0) {
+		return -1;
+	}
+	index->header = (const struct backup_index_header*)index->map.data;
+	index->entries = (const struct backup_index_entry*)(index->map.data + sizeof(struct backup_index_header));
+	if (index->map.length < sizeof(struct backup_index_header)
+	    || memcmp(index->header->magic, BACKUP_INDEX_MAGIC, 8) != 0
+	    || index->header->version != BACKUP_INDEX_VERSION
+	    || index->header->strings_offset != sizeof(struct backup_index_header) + (uint64_t)index->header->count * sizeof(struct backup_index_entry)
+	    || index->header->strings_offset + index->header->strings_size != index->map.length) {
+		backup_index_close(index);
+		return -1;
+	}
+	index->strings = index->map.data + index->header->strings_offset;
+
+	if (backup_index_stat_manifest(backup_path, &manifest_size, &manifest_mtime) == 0
+	    && (manifest_size != index->header->manifest_size || manifest_mtime != index->header->manifest_mtime)) {
+		/* Manifest.db changed since the index was built */
+		backup_index_close(index);
+		return -1;
+	}
+	index->backup_path = strdup(backup_path);
+
+	return 0;
+}
+
+/* returns the first entry with a key >= key */
+static uint32_t backup_index_lower_bound(const struct backup_index *index, const char *key)
+{
+	uint32_t lo = 0;
+	uint32_t hi = index->header->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (strcmp(backup_index_key(index, &index->entries[mid]), key) < 0) {
+			lo = mid + 1;
 		} else {
-			errcode = errno_to_device_error(errno);
-			errdesc = strerror(errno);
-			printf("Error opening '%s' for writing: %s\n", bname, errdesc);
-			break;
-		}
-		if (nlen == 0) {
-			break;
+			hi = mid;
 		}
+	}
+	return lo;
+}
 
-		/* check if an error message was received */
-		if (code == CODE_ERROR_REMOTE) {
-			/* error message */
-			char *msg = (char*)malloc(nlen);
-			mobilebackup2_receive_raw(mobilebackup2, msg, nlen-1, &r);
-			msg[r] = 0;
-			/* If sent using CODE_FILE_DATA, end marker will be CODE_ERROR_REMOTE which is not an error! */
-			if (last_code != CODE_FILE_DATA) {
-				fprintf(stdout, "\nReceived an error message from device: %s\n", msg);
-			}
-			free(msg);
+/* finds the entries below path, or the entry for path itself if it has none */
+static void backup_index_find(const struct backup_index *index, const char *path, uint32_t *first, uint32_t *last)
+{
+	size_t path_len = strlen(path);
+	char *prefix = (path_len > 0 && path[path_len-1] == '/') ? strdup(path) : string_concat(path, "/", NULL);
+	size_t prefix_len = strlen(prefix);
+	uint32_t i = backup_index_lower_bound(index, prefix);
+
+	*first = i;
+	while (i < index->header->count && strncmp(backup_index_key(index, &index->entries[i]), prefix, prefix_len) == 0) {
+		i++;
+	}
+	*last = i;
+	free(prefix);
+
+	if (*first == *last) {
+		i = backup_index_lower_bound(index, path);
+		if (i < index->header->count && strcmp(backup_index_key(index, &index->entries[i]), path) == 0) {
+			*first = i;
+			*last = i + 1;
 		}
-	} while (1);
+	}
+}
 
-	if (fname != NULL)
-		free(fname);
+/* returns the location of the stored file for the given entry */
+static char* backup_index_file_path(const struct backup_index *index, const struct backup_index_entry *entry)
+{
+	char file_id[41];
+	char prefix[3];
+	struct stat fst;
+	int i;
 
-	/* if there are leftovers to read, finish up cleanly */
-	if ((int)nlen-1 > 0) {
-		PRINT_VERBOSE(1, "\nDiscarding current data hunk.\n");
-		fname = (char*)malloc(nlen-1);
-		mobilebackup2_receive_raw(mobilebackup2, fname, nlen-1, &r);
-		free(fname);
-		remove_file(bname);
+	for (i = 0; i < 20; i++) {
+		sprintf(file_id + i*2, "%02x", entry->file_id[i]);
 	}
+	memcpy(prefix, file_id, 2);
+	prefix[2] = '\0';
+
+	char *path = string_build_path(index->backup_path, prefix, file_id, NULL);
+	if (stat(path, &fst) != 0) {
+		/* flat layout used before iOS 10 */
+		free(path);
+		path = string_build_path(index->backup_path, file_id, NULL);
+	}
+	return path;
+}
 
-	/* clean up */
-	if (bname != NULL)
-		free(bname);
-
-	if (dname != NULL)
-		free(dname);
+#ifdef HAVE_SQLITE3
+struct backup_index_build_entry {
+	char *key;
+	struct backup_index_entry entry;
+};
 
-	plist_t empty_plist = plist_new_dict();
-	mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_plist);
-	plist_free(empty_plist);
+static int backup_index_build_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct backup_index_build_entry*)a)->key, ((const struct backup_index_build_entry*)b)->key);
+}
 
-	return file_count;
+static int hex_to_bin(const char *hex, unsigned char *bin, size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned int byte = 0;
+		if (!isxdigit((unsigned char)hex[i*2]) || !isxdigit((unsigned char)hex[i*2+1]) || sscanf(hex + i*2, "%2x", &byte) != 1) {
+			return -1;
+		}
+		bin[i] = (unsigned char)byte;
+	}
+	return 0;
 }
 
-static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+/* reads size, modification time, digest and encryption state from the
+ * keyed archive (MBFile) that Manifest.db stores for each file */
+static void backup_index_parse_file_info(const void *blob, int blob_len, struct backup_index_entry *entry)
 {
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+	plist_t archive = NULL;
+	uint64_t uid = 0;
 
-	plist_t node = plist_array_get_item(message, 1);
-	char *str = NULL;
-	if (plist_get_node_type(node) == PLIST_STRING) {
-		plist_get_string_val(node, &str);
+	if (!blob || blob_len <= 0) {
+		return;
 	}
-	if (!str) {
-		printf("ERROR: Malformed DLContentsOfDirectory message\n");
-		// TODO error handling
+	plist_from_bin((const char*)blob, (uint32_t)blob_len, &archive);
+	if (!archive) {
 		return;
 	}
 
-	char *path = string_build_path(backup_dir, str, NULL);
-	free(str);
-
-	plist_t dirlist = plist_new_dict();
-
-	DIR* cur_dir = opendir(path);
-	if (cur_dir) {
-		struct dirent* ep;
-		while ((ep = readdir(cur_dir))) {
-			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
-				continue;
+	plist_t objects = plist_dict_get_item(archive, "$objects");
+	plist_t root = plist_access_path(archive, 2, "$top", "root");
+	if (plist_get_node_type(root) == PLIST_UID && plist_get_node_type(objects) == PLIST_ARRAY) {
+		plist_get_uid_val(root, &uid);
+		plist_t file = plist_array_get_item(objects, (uint32_t)uid);
+		plist_t node = plist_dict_get_item(file, "Size");
+		if (plist_get_node_type(node) == PLIST_UINT) {
+			plist_get_uint_val(node, &entry->size);
+		}
+		node = plist_dict_get_item(file, "LastModified");
+		if (plist_get_node_type(node) == PLIST_UINT) {
+			plist_get_uint_val(node, &entry->mtime);
+		}
+		node = plist_dict_get_item(file, "EncryptionKey");
+		if (node) {
+			entry->flags |= BACKUP_INDEX_FLAG_ENCRYPTED;
+			if (plist_get_node_type(node) == PLIST_UID) {
+				plist_get_uid_val(node, &uid);
+				node = plist_dict_get_item(plist_array_get_item(objects, (uint32_t)uid), "NS.data");
 			}
-			char *fpath = string_build_path(path, ep->d_name, NULL);
-			if (fpath) {
-				plist_t fdict = plist_new_dict();
-				struct stat st;
-				stat(fpath, &st);
-				const char *ftype = "DLFileTypeUnknown";
-				if (S_ISDIR(st.st_mode)) {
-					ftype = "DLFileTypeDirectory";
-				} else if (S_ISREG(st.st_mode)) {
-					ftype = "DLFileTypeRegular";
+			if (plist_get_node_type(node) == PLIST_DATA) {
+				uint64_t key_len = 0;
+				const char *key = plist_get_data_ptr(node, &key_len);
+				if (key && key_len == sizeof(entry->encryption_key)) {
+					memcpy(entry->encryption_key, key, key_len);
+					entry->encryption_key_length = (uint32_t)key_len;
 				}
-				plist_dict_set_item(fdict, "DLFileType", plist_new_string(ftype));
-				plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(st.st_size));
-				plist_dict_set_item(fdict, "DLFileModificationDate",
-						    plist_new_date(st.st_mtime - MAC_EPOCH, 0));
-
-				plist_dict_set_item(dirlist, ep->d_name, fdict);
-				free(fpath);
 			}
 		}
-		closedir(cur_dir);
-	}
-	free(path);
-
-	/* TODO error handling */
-	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, 0, NULL, dirlist);
-	plist_free(dirlist);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		printf("Could not send status response, error %d\n", err);
+		node = plist_dict_get_item(file, "Digest");
+		if (plist_get_node_type(node) == PLIST_UID) {
+			plist_get_uid_val(node, &uid);
+			node = plist_array_get_item(objects, (uint32_t)uid);
+			if (plist_get_node_type(node) == PLIST_DICT) {
+				node = plist_dict_get_item(node, "NS.data");
+			}
+		}
+		if (plist_get_node_type(node) == PLIST_DATA) {
+			uint64_t digest_len = 0;
+			const char *digest = plist_get_data_ptr(node, &digest_len);
+			if (digest && digest_len == 20) {
+				memcpy(entry->digest, digest, 20);
+				entry->flags |= BACKUP_INDEX_FLAG_DIGEST;
+			}
+		}
 	}
+	plist_free(archive);
 }
 
-static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+/* opens the encrypted Manifest.db of a backup by decrypting it into memory */
+static int backup_index_open_encrypted_db(sqlite3 **db, const char *manifest_path, const struct backup_keybag *keybag)
 {
-	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
+#ifdef SQLITE_DESERIALIZE_READONLY
+	struct backup_cipher cipher;
+	struct mapped_buffer data;
+	uint64_t length = 0;
 
-	plist_t dir = plist_array_get_item(message, 1);
-	char *str = NULL;
-	int errcode = 0;
-	char *errdesc = NULL;
-	plist_get_string_val(dir, &str);
-
-	char *newpath = string_build_path(backup_dir, str, NULL);
-	free(str);
-
-	if (mkdir_with_parents(newpath, 0755) < 0) {
-		errdesc = strerror(errno);
-		if (errno != EEXIST) {
-			printf("mkdir: %s (%d)\n", errdesc, errno);
+	if (!keybag->have_manifest_key) {
+		printf("ERROR: The backup has no ManifestKey.\n");
+		return -1;
+	}
+	/* map the file, the only heap copy is the buffer that is decrypted in place */
+	if (buffer_map_from_filename(manifest_path, &data, 1) < 0 || (data.length % 16) != 0) {
+		printf("ERROR: Could not read '%s'.\n", manifest_path);
+		buffer_unmap(&data);
+		return -1;
+	}
+	length = data.length;
+	unsigned char *plain = (unsigned char*)sqlite3_malloc64(length);
+	if (!plain || backup_cipher_init(&cipher, keybag->manifest_key) < 0) {
+		sqlite3_free(plain);
+		buffer_unmap(&data);
+		return -1;
+	}
+	memcpy(plain, data.data, length);
+	buffer_unmap(&data);
+	int res = backup_cipher_decrypt(&cipher, plain, length);
+	backup_cipher_free(&cipher);
+	if (res == 0) {
+		/* strip the PKCS#7 padding */
+		unsigned char pad = plain[length - 1];
+		if (pad > 0 && pad <= 16) {
+			length -= pad;
 		}
-		errcode = errno_to_device_error(errno);
 	}
-	free(newpath);
-	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, NULL);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		printf("Could not send status response, error %d\n", err);
+	if (res == 0 && sqlite3_open(":memory:", db) == SQLITE_OK) {
+		/* the buffer is owned by SQLite from here on, even on failure */
+		if (sqlite3_deserialize(*db, "main", plain, length, length, SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_READONLY) == SQLITE_OK) {
+			return 0;
+		}
+	} else {
+		sqlite3_free(plain);
 	}
+	printf("ERROR: Could not decrypt '%s'.\n", manifest_path);
+	sqlite3_close(*db);
+	*db = NULL;
+	return -1;
+#else
+	printf("ERROR: Reading encrypted backups requires SQLite with sqlite3_deserialize().\n");
+	return -1;
+#endif
 }
 
-static void mb2_copy_file_by_path(const char *src, const char *dst)
+/* builds Manifest.idx from Manifest.db, keybag is required for encrypted backups */
+static int backup_index_build(const char *backup_path, const struct backup_keybag *keybag)
 {
-	FILE *from, *to;
-	char buf[BUFSIZ];
-	size_t length;
+	sqlite3 *db = NULL;
+	sqlite3_stmt *stmt = NULL;
+	struct backup_index_build_entry *items = NULL;
+	uint32_t count = 0;
+	uint32_t capacity = 0;
+	uint64_t strings_size = 0;
+	struct backup_index_header header;
+	int res = -1;
+	uint32_t i;
 
-	/* open source file */
-	if ((from = fopen(src, "rb")) == NULL) {
-		printf("Cannot open source path '%s'.\n", src);
-		return;
+	memset(&header, '\0', sizeof(header));
+	if (backup_index_stat_manifest(backup_path, &header.manifest_size, &header.manifest_mtime) < 0) {
+		printf("ERROR: No Manifest.db found in '%s'.\n", backup_path);
+		return -1;
 	}
 
-	/* open destination file */
-	if ((to = fopen(dst, "wb")) == NULL) {
-		printf("Cannot open destination file '%s'.\n", dst);
-		fclose(from);
-		return;
+	char *manifest_path = string_build_path(backup_path, "Manifest.db", NULL);
+	if (keybag) {
+		if (backup_index_open_encrypted_db(&db, manifest_path, keybag) < 0) {
+			free(manifest_path);
+			return -1;
+		}
+	} else if (sqlite3_open_v2(manifest_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		printf("ERROR: Could not open '%s': %s\n", manifest_path, sqlite3_errmsg(db));
+		free(manifest_path);
+		sqlite3_close(db);
+		return -1;
 	}
+	free(manifest_path);
 
-	/* copy the file */
-	while ((length = fread(buf, 1, BUFSIZ, from)) != 0) {
-		fwrite(buf, 1, length, to);
+	if (sqlite3_prepare_v2(db, "SELECT fileID, domain, relativePath, flags, file FROM Files", -1, &stmt, NULL) != SQLITE_OK) {
+		printf("ERROR: Could not read Manifest.db: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return -1;
 	}
 
-	if(fclose(from) == EOF) {
-		printf("Error closing source file.\n");
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *file_id = (const char*)sqlite3_column_text(stmt, 0);
+		const char *domain = (const char*)sqlite3_column_text(stmt, 1);
+		const char *relative_path = (const char*)sqlite3_column_text(stmt, 2);
+
+		if (!file_id || !domain || strlen(file_id) != 40) {
+			continue;
+		}
+		if (count == capacity) {
+			uint32_t new_capacity = (capacity) ? capacity * 2 : 4096;
+			struct backup_index_build_entry *new_items = (struct backup_index_build_entry*)realloc(items, sizeof(struct backup_index_build_entry) * new_capacity);
+			if (!new_items) {
+				printf("ERROR: Out of memory\n");
+				goto leave;
+			}
+			items = new_items;
+			capacity = new_capacity;
+		}
+		struct backup_index_build_entry *item = &items[count];
+		memset(item, '\0', sizeof(struct backup_index_build_entry));
+		if (hex_to_bin(file_id, item->entry.file_id, 20) < 0) {
+			continue;
+		}
+		item->key = (relative_path && *relative_path) ? string_concat(domain, "/", relative_path, NULL) : strdup(domain);
+		item->entry.flags = (uint32_t)sqlite3_column_int(stmt, 3) & 0xFF;
+		backup_index_parse_file_info(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4), &item->entry);
+		item->entry.key_length = (uint32_t)strlen(item->key);
+		strings_size += item->entry.key_length + 1;
+		count++;
 	}
 
-	if(fclose(to) == EOF) {
-		printf("Error closing destination file.\n");
+	if (count > 0) {
+		qsort(items, count, sizeof(struct backup_index_build_entry), backup_index_build_entry_cmp);
+	}
+
+	memcpy(header.magic, BACKUP_INDEX_MAGIC, 8);
+	header.version = BACKUP_INDEX_VERSION;
+	header.count = count;
+	header.strings_offset = sizeof(struct backup_index_header) + (uint64_t)count * sizeof(struct backup_index_entry);
+	header.strings_size = strings_size;
+
+	char *index_path = string_build_path(backup_path, BACKUP_INDEX_NAME, NULL);
+	char *tmp_path = string_concat(index_path, ".tmp", NULL);
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f) {
+		printf("ERROR: Could not create '%s': %s\n", tmp_path, strerror(errno));
+	} else {
+		int ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+		uint64_t offset = 0;
+		for (i = 0; ok && i < count; i++) {
+			items[i].entry.key_offset = offset;
+			offset += items[i].entry.key_length + 1;
+			ok = (fwrite(&items[i].entry, sizeof(struct backup_index_entry), 1, f) == 1);
+		}
+		for (i = 0; ok && i < count; i++) {
+			ok = (fwrite(items[i].key, 1, items[i].entry.key_length + 1, f) == items[i].entry.key_length + 1);
+		}
+		if (fclose(f) != 0) {
+			ok = 0;
+		}
+		if (ok) {
+			remove_file(index_path);
+			if (rename(tmp_path, index_path) == 0) {
+				res = 0;
+			}
+		}
+		if (res < 0) {
+			printf("ERROR: Could not write '%s': %s\n", index_path, strerror(errno));
+			remove_file(tmp_path);
+		}
+	}
+	free(tmp_path);
+	free(index_path);
+
+leave:
+	for (i = 0; i < count; i++) {
+		free(items[i].key);
 	}
+	free(items);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	return res;
 }
+#endif
 
-static void mb2_copy_directory_by_path(const char *src, const char *dst)
+/* opens the index of the backup, building it first if necessary */
+static int backup_index_load(struct backup_index *index, const char *backup_path, const struct backup_keybag *keybag)
 {
-	if (!src || !dst) {
-		return;
+	if (backup_index_open(index, backup_path) == 0) {
+		return 0;
+	}
+#ifdef HAVE_SQLITE3
+	PRINT_VERBOSE(1, "Building index of '%s'...\n", backup_path);
+	if (backup_index_build(backup_path, keybag) == 0 && backup_index_open(index, backup_path) == 0) {
+		return 0;
 	}
+#else
+	printf("ERROR: No up to date index found and %s was built without SQLite support.\n", TOOL_NAME);
+#endif
+	return -1;
+}
 
-	struct stat st;
+struct backup_index_verify {
+	const struct backup_index *index;
+	uint32_t last;
+	uint32_t next;
+	uint32_t checked;
+	uint32_t missing;
+	uint32_t mismatch;
+	mutex_t mutex;
+};
 
-	/* if src does not exist */
-	if ((stat(src, &st) < 0) || !S_ISDIR(st.st_mode)) {
-		printf("ERROR: Source directory does not exist '%s': %s (%d)\n", src, strerror(errno), errno);
-		return;
+static void sha1_file(FILE *f, unsigned char *digest, uint64_t *size)
+{
+	unsigned char buf[65536];
+	size_t len;
+
+	*size = 0;
+#ifdef HAVE_OPENSSL
+	SHA_CTX ctx;
+	SHA1_Init(&ctx);
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		SHA1_Update(&ctx, buf, len);
+		*size += len;
+	}
+	SHA1_Final(digest, &ctx);
+#else
+	gcry_md_hd_t hd = NULL;
+	gcry_md_open(&hd, GCRY_MD_SHA1, 0);
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		gcry_md_write(hd, buf, len);
+		*size += len;
 	}
+	memcpy(digest, gcry_md_read(hd, GCRY_MD_SHA1), 20);
+	gcry_md_close(hd);
+#endif
+}
 
-	/* if dst directory does not exist */
-	if ((stat(dst, &st) < 0) || !S_ISDIR(st.st_mode)) {
-		/* create it */
-		if (mkdir_with_parents(dst, 0755) < 0) {
-			printf("ERROR: Unable to create destination directory '%s': %s (%d)\n", dst, strerror(errno), errno);
-			return;
+static void* backup_index_verify_thread(void *arg)
+{
+	struct backup_index_verify *verify = (struct backup_index_verify*)arg;
+	const struct backup_index *index = verify->index;
+
+	while (!quit_flag) {
+		uint32_t i = __sync_fetch_and_add(&verify->next, 1);
+		if (i >= verify->last) {
+			break;
+		}
+		const struct backup_index_entry *entry = &index->entries[i];
+		if ((entry->flags & BACKUP_INDEX_FLAG_FILE) == 0) {
+			continue;
 		}
-	}
 
-	/* loop over src directory contents */
-	DIR *cur_dir = opendir(src);
-	if (cur_dir) {
-		struct dirent* ep;
-		while ((ep = readdir(cur_dir))) {
-			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
-				continue;
+		const char *problem = NULL;
+		char *path = backup_index_file_path(index, entry);
+		FILE *f = fopen(path, "rb");
+		if (!f) {
+			__sync_add_and_fetch(&verify->missing, 1);
+			problem = "missing";
+		} else {
+			unsigned char digest[20];
+			uint64_t size = 0;
+			sha1_file(f, digest, &size);
+			fclose(f);
+			if (entry->flags & BACKUP_INDEX_FLAG_ENCRYPTED) {
+				/* stored data is encrypted and padded, only check that it is complete */
+				if (size < entry->size) {
+					problem = "size mismatch";
+				}
+			} else if (size != entry->size) {
+				problem = "size mismatch";
+			} else if ((entry->flags & BACKUP_INDEX_FLAG_DIGEST) && memcmp(digest, entry->digest, 20) != 0) {
+				problem = "digest mismatch";
 			}
-			char *srcpath = string_build_path(src, ep->d_name, NULL);
-			char *dstpath = string_build_path(dst, ep->d_name, NULL);
-			if (srcpath && dstpath) {
-				/* copy file */
-				mb2_copy_file_by_path(srcpath, dstpath);
+			if (problem) {
+				__sync_add_and_fetch(&verify->mismatch, 1);
 			}
-
-			if (srcpath)
-				free(srcpath);
-			if (dstpath)
-				free(dstpath);
 		}
-		closedir(cur_dir);
+		__sync_add_and_fetch(&verify->checked, 1);
+		if (problem) {
+			mutex_lock(&verify->mutex);
+			printf("%s: %s (%s)\n", backup_index_key(index, entry), problem, path);
+			mutex_unlock(&verify->mutex);
+		}
+		free(path);
 	}
-}
 
-#ifdef WIN32
-#define BS_CC '\b'
-#define my_getch getch
-#else
-#define BS_CC 0x7f
-static int my_getch(void)
-{
-	struct termios oldt, newt;
-	int ch;
-	tcgetattr(STDIN_FILENO, &oldt);
-	newt = oldt;
-	newt.c_lflag &= ~(ICANON | ECHO);
-	tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-	ch = getchar();
-	tcsetattr(STDIN_FILENO, TCSANOW, &oldt);
-	return ch;
+	return NULL;
 }
-#endif
 
-static void get_hidden_input(char *buf, int maxlen)
+/* checks the stored files of the given entry range using a number of threads */
+static int backup_index_verify_files(const struct backup_index *index, uint32_t first, uint32_t last, int num_threads)
 {
-	int pwlen = 0;
-	int c;
+	struct backup_index_verify verify;
+	THREAD_T *threads;
+	int i;
 
-	while ((c = my_getch())) {
-		if ((c == '\r') || (c == '\n')) {
+	memset(&verify, '\0', sizeof(verify));
+	verify.index = index;
+	verify.last = last;
+	verify.next = first;
+	mutex_init(&verify.mutex);
+
+#ifndef HAVE_OPENSSL
+	gcry_check_version(NULL);
+#endif
+	threads = (THREAD_T*)calloc(num_threads, sizeof(THREAD_T));
+	for (i = 0; threads && i < num_threads; i++) {
+		if (thread_new(&threads[i], backup_index_verify_thread, &verify) != 0) {
 			break;
-		} else if (isprint(c)) {
-			if (pwlen < maxlen-1)
-				buf[pwlen++] = c;
-			fputc('*', stderr);
-		} else if (c == BS_CC) {
-			if (pwlen > 0) {
-				fputs("\b \b", stderr);
-				pwlen--;
-			}
 		}
 	}
-	buf[pwlen] = 0;
+	if (i == 0) {
+		/* no threads available, verify on this thread */
+		backup_index_verify_thread(&verify);
+	}
+	while (i-- > 0) {
+		thread_join(threads[i]);
+		thread_free(threads[i]);
+	}
+	free(threads);
+	mutex_destroy(&verify.mutex);
+
+	PRINT_VERBOSE(1, "Verified %u files: %u missing, %u damaged.\n", verify.checked, verify.missing, verify.mismatch);
+
+	return (verify.missing || verify.mismatch) ? -1 : 0;
 }
 
-static char* ask_for_password(const char* msg, int type_again)
+/* copies the stored files of the given entry range to DIR/domain/relativePath,
+ * decrypting them on the way if a keybag is given */
+static int backup_index_extract_files(const struct backup_index *index, uint32_t first, uint32_t last, const char *target, int num_threads, const struct backup_keybag *keybag)
 {
-	char pwbuf[256];
+	struct mb2_copy_pool pool;
+	uint32_t i;
+
+	mb2_copy_pool_start(&pool, num_threads);
+
+	for (i = first; i < last && !quit_flag; i++) {
+		const struct backup_index_entry *entry = &index->entries[i];
+		char *dst = string_build_path(target, backup_index_key(index, entry), NULL);
+		if (entry->flags & BACKUP_INDEX_FLAG_DIRECTORY) {
+			mkdir_with_parents(dst, 0755);
+		} else if (entry->flags & BACKUP_INDEX_FLAG_FILE) {
+			unsigned char key[FILE_KEY_SIZE];
+			int encrypted = (entry->flags & BACKUP_INDEX_FLAG_ENCRYPTED) != 0;
+			if (encrypted && (!keybag || backup_keybag_unwrap_key(keybag, entry->encryption_key, entry->encryption_key_length, key) < 0)) {
+				printf("Skipping encrypted file '%s'\n", backup_index_key(index, entry));
+			} else {
+				char *dir = strdup(dst);
+				char *sep = strrchr(dir, '/');
+				if (sep) {
+					*sep = '\0';
+					mkdir_with_parents(dir, 0755);
+				}
+				free(dir);
+				char *src = backup_index_file_path(index, entry);
+				PRINT_VERBOSE(2, "%s\n", backup_index_key(index, entry));
+				mb2_copy_pool_add_file(&pool, src, dst, (encrypted) ? key : NULL, entry->size);
+				free(src);
+			}
+			memset(key, '\0', sizeof(key));
+		}
+		free(dst);
+	}
 
-	fprintf(stderr, "%s: ", msg);
-	fflush(stderr);
-	get_hidden_input(pwbuf, 256);
-	fputc('\n', stderr);
+	uint32_t failed = mb2_copy_pool_finish(&pool);
+	PRINT_VERBOSE(1, "Extracted %u files to '%s'.\n", pool.copied, target);
 
-	if (type_again) {
-		char pwrep[256];
+	return (failed > 0) ? -1 : 0;
+}
 
-		fprintf(stderr, "%s (repeat): ", msg);
-		fflush(stderr);
-		get_hidden_input(pwrep, 256);
-		fputc('\n', stderr);
+struct backup_index_options {
+	char **paths;
+	int num_paths;
+	int verify;
+	int jobs;
+	char *extract_dir;
+	char *password;
+	int interactive;
+};
 
-		if (strcmp(pwbuf, pwrep) != 0) {
-			printf("ERROR: passwords don't match\n");
-			return NULL;
-		}
+static void backup_index_print_entry(const struct backup_index *index, const struct backup_index_entry *entry)
+{
+	char file_id[41];
+	int i;
+	for (i = 0; i < 20; i++) {
+		sprintf(file_id + i*2, "%02x", entry->file_id[i]);
 	}
-	return strdup(pwbuf);
+	printf("%s,%s,%s,%llu,%llu\n", file_id, backup_index_key(index, entry),
+		(entry->flags & BACKUP_INDEX_FLAG_DIRECTORY) ? "dir" : (entry->flags & BACKUP_INDEX_FLAG_SYMLINK) ? "link" : "file",
+		(unsigned long long)entry->size, (unsigned long long)entry->mtime);
 }
 
-/**
- * signal handler function for cleaning up properly
- */
-static void clean_exit(int sig)
+static int backup_index_command(const char *backup_directory, const char *source_udid, struct backup_index_options *options)
 {
-	fprintf(stderr, "Exiting...\n");
-	quit_flag++;
+	struct backup_index index;
+	struct backup_keybag keybag;
+	struct backup_keybag *use_keybag = NULL;
+	int res = 0;
+	int i;
+	uint32_t j;
+
+	char *backup_path = string_build_path(backup_directory, source_udid, NULL);
+	if (options->extract_dir || backup_index_open(&index, backup_path) < 0) {
+		/* file keys are needed for extracting, ManifestKey for building the index */
+		char *password = options->password;
+		if (!password && options->interactive && backup_is_encrypted(backup_path)) {
+			password = ask_for_password("Enter backup password", 0);
+		}
+		res = backup_keybag_load(&keybag, backup_path, password);
+		if (password != options->password) {
+			free(password);
+		}
+		if (res < 0) {
+			free(backup_path);
+			return -1;
+		}
+		use_keybag = (res == 0) ? &keybag : NULL;
+		res = 0;
+	} else {
+		backup_index_close(&index);
+	}
+	if (backup_index_load(&index, backup_path, use_keybag) < 0) {
+		free(backup_path);
+		if (use_keybag) {
+			backup_keybag_free(use_keybag);
+		}
+		return -1;
+	}
+	free(backup_path);
+
+	PRINT_VERBOSE(1, "Index contains %u entries.\n", index.header->count);
+
+	for (i = 0; i < ((options->num_paths > 0) ? options->num_paths : 1); i++) {
+		uint32_t first = 0;
+		uint32_t last = index.header->count;
+		if (options->num_paths > 0) {
+			backup_index_find(&index, options->paths[i], &first, &last);
+			if (first == last) {
+				printf("No entries found for '%s'\n", options->paths[i]);
+				res = -1;
+				continue;
+			}
+			if (!options->verify && !options->extract_dir) {
+				for (j = first; j < last; j++) {
+					backup_index_print_entry(&index, &index.entries[j]);
+				}
+			}
+		}
+		if (options->verify && backup_index_verify_files(&index, first, last, options->jobs) < 0) {
+			res = -1;
+		}
+		if (options->extract_dir && backup_index_extract_files(&index, first, last, options->extract_dir, options->jobs, use_keybag) < 0) {
+			res = -1;
+		}
+	}
+
+	backup_index_close(&index);
+	if (use_keybag) {
+		backup_keybag_free(use_keybag);
+	}
+
+	return res;
 }
 
 static void print_usage(int argc, char **argv)
@@ -1497,6 +4848,9 @@ static void print_usage(int argc, char **argv)
 	printf("CMD:\n");
 	printf("  backup\tcreate backup for the device\n");
 	printf("    --full\t\tforce full backup from device.\n");
+	printf("    --archive FILE\twrite the files of the backup to the tar archive FILE\n");
+	printf("    --store DIR\t\tstore file contents once in the content addressed\n");
+	printf("               \t\tstore DIR and hardlink them into the backup\n");
 	printf("  restore\trestore last backup to the device\n");
 	printf("    --system\t\trestore system files, too.\n");
 	printf("    --no-reboot\t\tdo NOT reboot the device when done (default: yes).\n");
@@ -1505,6 +4859,7 @@ static void print_usage(int argc, char **argv)
 	printf("    --remove\t\tremove items which are not being restored\n");
 	printf("    --skip-apps\t\tdo not trigger re-installation of apps after restore\n");
 	printf("    --password PWD\tsupply the password of the source backup\n");
+	printf("    --archive FILE\trestore the files from the backup archive FILE\n");
 	printf("  info\t\tshow details about last completed backup of device\n");
 	printf("  list\t\tlist files of last completed backup in CSV format\n");
 	printf("  unback\tunpack a completed backup in DIRECTORY/_unback_/\n");
@@ -1513,12 +4868,33 @@ static void print_usage(int argc, char **argv)
 	printf("  changepw [OLD NEW]  change backup password on target device\n");
 	printf("    NOTE: passwords will be requested in interactive mode if omitted\n");
 	printf("  cloud on|off\tenable or disable cloud use (requires iCloud account)\n");
+	printf("  index\t\tshow or check files of the backup using a local index\n");
+	printf("    --find PATH\t\tlist entries of domain/relativePath PATH and below,\n");
+	printf("               \t\tcan be given multiple times\n");
+	printf("    --verify\t\tcheck the stored files against the index\n");
+	printf("    --jobs N\t\tuse N threads for --verify and --extract\n");
+	printf("            \t\t(default: number of CPUs)\n");
+	printf("    --extract DIR\tcopy the files to DIR/domain/relativePath\n");
+	printf("    --password PWD\tpassword of an encrypted backup, files are decrypted\n");
+	printf("                  \twhen extracted\n");
 	printf("\n");
 	printf("OPTIONS:\n");
 	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
 	printf("  -s, --source UDID\tuse backup data from device specified by UDID\n");
 	printf("  -n, --network\t\tconnect to network device\n");
+	printf("  -w, --write FILE\tonly write files whose path ends in FILE, can be\n");
+	printf("                  \tgiven multiple times\n");
+	printf("  -b, --block-size SIZE\ttransfer file data in blocks of SIZE bytes (suffix K\n");
+	printf("                       \tor M, default: 1M)\n");
 	printf("  -i, --interactive\trequest passwords interactively\n");
+	printf("  --all\t\t\tback up or restore all attached devices at the same time\n");
+	printf("  --max-disk-rate RATE\tlimit reading and writing files to RATE bytes per\n");
+	printf("                      \tsecond for all devices (suffix K, M or G)\n");
+	printf("  --read-cache SIZE\tkeep up to SIZE bytes of files read for restores in\n");
+	printf("                   \tmemory for all devices (suffix K, M or G, default: 0,\n");
+	printf("                   \t256M with --all)\n");
+	printf("  --stats FILE\t\twrite time and bytes per phase and message type as\n");
+	printf("              \t\tJSON to FILE (- for stdout)\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -1527,9 +4903,36 @@ static void print_usage(int argc, char **argv)
 	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
 }
 
+/* parses a byte count with an optional K, M or G suffix */
+static int mb2_parse_size(const char *str, uint64_t *size)
+{
+	char *endChar = NULL;
+	uint64_t value = strtoull(str, &endChar, 10);
+	if (endChar == str) {
+		return -1;
+	}
+	switch (*endChar) {
+	case 'k': case 'K':
+		value *= 1024;
+		break;
+	case 'm': case 'M':
+		value *= 1024*1024;
+		break;
+	case 'g': case 'G':
+		value *= 1024*1024*1024ULL;
+		break;
+	case '\0':
+		break;
+	default:
+		return -1;
+	}
+	*size = value;
+	return 0;
+}
+
 #define DEVICE_VERSION(maj, min, patch) (((maj & 0xFF) << 16) | ((min & 0xFF) << 8) | (patch & 0xFF))
 
-int main(int argc, char *argv[])
+static int mb2_main(int argc, char *argv[])
 {
 	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
 	lockdownd_error_t ldret = LOCKDOWN_E_UNKNOWN_ERROR;
@@ -1551,8 +4954,10 @@ int main(int argc, char *argv[])
 	plist_t info_plist = NULL;
 	plist_t opts = NULL;
 	mobilebackup2_error_t err;
-	const char* writeFiles[64];
-	int writeCnt = 0;
+	struct write_filter filter = { NULL, 0, 0 };
+	const char *archive_filename = NULL;
+	const char *stats_filename = NULL;
+	struct backup_index_options index_options = { NULL, 0, 0, mb2_copy_default_workers(), NULL, NULL, 0 };
 
 	/* we need to exit cleanly on running backups and restores or we cause havok */
 	signal(SIGINT, clean_exit);
@@ -1579,11 +4984,14 @@ int main(int argc, char *argv[])
 		}
 		else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--write")) {
 			i++;
-			if (!argv[i] || !*argv[i] || writeCnt == 64) {
+			if (!argv[i] || !*argv[i]) {
 				print_usage(argc, argv);
 				return -1;
 			}
-			writeFiles[writeCnt++] = strdup(argv[i]);
+			if (write_filter_add(&filter, argv[i]) < 0) {
+				printf("ERROR: Out of memory\n");
+				return -1;
+			}
 			continue;
 		}
 		else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--free")) {
@@ -1597,6 +5005,76 @@ int main(int argc, char *argv[])
 			min_free_space = strtoull(argv[i], &endChar, 10);
 			continue;
 		}
+		else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--block-size")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+
+			uint64_t bsize = 0;
+			if (mb2_parse_size(argv[i], &bsize) < 0 || bsize < TRANSFER_BLOCK_SIZE_MIN || bsize > TRANSFER_BLOCK_SIZE_MAX) {
+				printf("ERROR: block size must be between %d and %d bytes\n", TRANSFER_BLOCK_SIZE_MIN, TRANSFER_BLOCK_SIZE_MAX);
+				return -1;
+			}
+			transfer_block_size = (uint32_t)bsize;
+			continue;
+		}
+		else if (!strcmp(argv[i], "--max-disk-rate")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			uint64_t rate = 0;
+			if (mb2_parse_size(argv[i], &rate) < 0 || rate == 0) {
+				printf("ERROR: Invalid disk rate '%s'\n", argv[i]);
+				return -1;
+			}
+			mb2_io_limit_set(rate);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--read-cache")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			uint64_t cache_size = 0;
+			if (mb2_parse_size(argv[i], &cache_size) < 0) {
+				printf("ERROR: Invalid read cache size '%s'\n", argv[i]);
+				return -1;
+			}
+			mb2_read_cache_set_limit(cache_size);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--stats")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			stats_filename = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--archive")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			archive_filename = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--store")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			blob_store_dir = argv[i];
+			continue;
+		}
 		else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--source")) {
 			i++;
 			if (!argv[i] || !*argv[i]) {
@@ -1691,6 +5169,45 @@ int main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "unback")) {
 			cmd = CMD_UNBACK;
 		}
+		else if (!strcmp(argv[i], "index")) {
+			cmd = CMD_INDEX;
+		}
+		else if (!strcmp(argv[i], "--find")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			char **paths = (char**)realloc(index_options.paths, sizeof(char*) * (index_options.num_paths + 1));
+			if (!paths) {
+				printf("ERROR: Out of memory\n");
+				return -1;
+			}
+			index_options.paths = paths;
+			index_options.paths[index_options.num_paths++] = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--verify")) {
+			index_options.verify = 1;
+		}
+		else if (!strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || atoi(argv[i]) <= 0) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			index_options.jobs = atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--extract")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			index_options.extract_dir = argv[i];
+			continue;
+		}
 		else if (!strcmp(argv[i], "encryption")) {
 			cmd = CMD_CHANGEPW;
 			i++;
@@ -1782,6 +5299,34 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (blob_store_dir && blob_store_init(blob_store_dir) < 0) {
+		return -1;
+	}
+
+	if (archive_filename && blob_store_dir) {
+		printf("ERROR: --archive and --store can not be used together.\n");
+		return -1;
+	}
+
+	if (archive_filename && (cmd == CMD_BACKUP || cmd == CMD_RESTORE)) {
+		backup_archive = mb2_archive_open(archive_filename);
+		if (!backup_archive) {
+			return -1;
+		}
+	}
+
+	if (cmd == CMD_INDEX && (source_udid || udid)) {
+		/* works on the backup only, no device required */
+		index_options.password = backup_password;
+		index_options.interactive = interactive_mode;
+		result_code = backup_index_command(backup_directory, (source_udid) ? source_udid : udid, &index_options);
+		free(index_options.paths);
+		write_filter_free(&filter);
+		free(udid);
+		free(source_udid);
+		return result_code;
+	}
+
 	idevice_t device = NULL;
 	ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
@@ -1801,6 +5346,18 @@ int main(int argc, char *argv[])
 		source_udid = strdup(udid);
 	}
 
+	if (cmd == CMD_INDEX) {
+		idevice_free(device);
+		index_options.password = backup_password;
+		index_options.interactive = interactive_mode;
+		result_code = backup_index_command(backup_directory, source_udid, &index_options);
+		free(index_options.paths);
+		write_filter_free(&filter);
+		free(udid);
+		free(source_udid);
+		return result_code;
+	}
+
 	uint8_t is_encrypted = 0;
 	char *info_path = NULL;
 	if (cmd == CMD_CHANGEPW) {
@@ -1905,7 +5462,7 @@ int main(int argc, char *argv[])
 	ldret = lockdownd_start_service(lockdown, NP_SERVICE_NAME, &service);
 	if ((ldret == LOCKDOWN_E_SUCCESS) && service && service->port) {
 		np_client_new(device, service, &np);
-		np_set_notify_callback(np, notify_cb, NULL);
+		np_set_notify_callback(np, notify_cb, &device_state);
 		const char *noties[5] = {
 			NP_SYNC_CANCEL_REQUEST,
 			NP_SYNC_SUSPEND_REQUEST,
@@ -1943,6 +5500,9 @@ int main(int argc, char *argv[])
 		PRINT_VERBOSE(1, "Started \"%s\" service on port %d.\n", MOBILEBACKUP2_SERVICE_NAME, service->port);
 		mobilebackup2_client_new(device, service, &mobilebackup2);
 
+		/* coalesce the small header writes of file transfers with the data */
+		mobilebackup2_set_raw_buffer_size(mobilebackup2, 131072);
+
 		if (service) {
 			lockdownd_service_descriptor_free(service);
 			service = NULL;
@@ -1961,7 +5521,7 @@ int main(int argc, char *argv[])
 		PRINT_VERBOSE(1, "Negotiated Protocol Version %.1f\n", remote_version);
 
 		/* check abort conditions */
-		if (quit_flag > 0) {
+		if (mb2_quit_requested()) {
 			PRINT_VERBOSE(1, "Aborting as requested by user...\n");
 			cmd = CMD_LEAVE;
 			goto checkpoint;
@@ -2279,7 +5839,7 @@ checkpoint:
 				}
 				/*if (cmd_flags & CMD_FLAG_ENCRYPTION_ENABLE) {
 					int retr = 10;
-					while ((retr-- >= 0) && !backup_domain_changed) {
+					while ((retr-- >= 0) && !device_state.backup_domain_changed) {
 						sleep(1);
 					}
 				}*/
@@ -2304,17 +5864,23 @@ checkpoint:
 			const char *errdesc = NULL;
 			int progress_finished = 0;
 
+			uint64_t stats_start = stats_now_us();
+			uint64_t message_start = 0;
+
 			/* process series of DLMessage* operations */
 			do {
 				free(dlmsg);
 				dlmsg = NULL;
+				message_start = stats_now_us();
 				mberr = mobilebackup2_receive_message(mobilebackup2, &message, &dlmsg);
+				stats_add_phase(PHASE_WAIT, message_start, 0);
+				message_start = stats_now_us();
 				if (mberr == MOBILEBACKUP2_E_RECEIVE_TIMEOUT) {
 					PRINT_VERBOSE(2, "Device is not ready yet, retrying...\n");
 					goto files_out;
 				} else if (mberr != MOBILEBACKUP2_E_SUCCESS) {
 					PRINT_VERBOSE(0, "ERROR: Could not receive from mobilebackup2 (%d)\n", mberr);
-					quit_flag++;
+					device_state.quit++;
 					goto files_out;
 				}
 
@@ -2325,7 +5891,7 @@ checkpoint:
 				} else if (!strcmp(dlmsg, "DLMessageUploadFiles")) {
 					/* device wants to send files to the computer */
 					mb2_set_overall_progress_from_message(message, dlmsg);
-					file_count += mb2_handle_receive_files(mobilebackup2, message, backup_directory, (const char **)writeFiles, writeCnt);
+					file_count += mb2_handle_receive_files(mobilebackup2, message, backup_directory, &filter);
 				} else if (!strcmp(dlmsg, "DLMessageGetFreeDiskSpace")) {
 					/* device wants to know how much disk space is available on the computer */
 					uint64_t freespace = 0;
@@ -2400,14 +5966,25 @@ checkpoint:
 								char *str = NULL;
 								plist_get_string_val(val, &str);
 								if (str) {
+									if (mb2_archive_handles(key) || mb2_archive_handles(str)) {
+										/* only the archive index changes */
+										if (mb2_archive_handles(key) && mb2_archive_handles(str)) {
+											mb2_archive_rename(backup_archive, key, str, 0);
+										} else {
+											printf("Moving '%s' to '%s' in and out of the archive is not supported\n", key, str);
+											errcode = -1;
+											errdesc = "Unsupported move";
+										}
+										free(str);
+										free(key);
+										key = NULL;
+										continue;
+									}
 									char *newpath = string_build_path(backup_directory, str, NULL);
 									free(str);
 									char *oldpath = string_build_path(backup_directory, key, NULL);
 
-									if ((stat(newpath, &st) == 0) && S_ISDIR(st.st_mode))
-										rmdir_recursive(newpath);
-									else
-										remove_file(newpath);
+									remove_path(newpath);
 									if (rename(oldpath, newpath) < 0) {
 										printf("Renameing '%s' to '%s' failed: %s (%d)\n", oldpath, newpath, strerror(errno), errno);
 										errcode = errno_to_device_error(errno);
@@ -2435,50 +6012,7 @@ checkpoint:
 					}
 				} else if (!strcmp(dlmsg, "DLMessageRemoveFiles") || !strcmp(dlmsg, "DLMessageRemoveItems")) {
 					mb2_set_overall_progress_from_message(message, dlmsg);
-					plist_t removes = plist_array_get_item(message, 1);
-					uint32_t cnt = plist_array_get_size(removes);
-					PRINT_VERBOSE(1, "Removing %d file%s\n", cnt, (cnt == 1) ? "" : "s");
-                    fflush(stdout);
-					uint32_t ii = 0;
-					errcode = 0;
-					errdesc = NULL;
-					for (ii = 0; ii < cnt; ii++) {
-						plist_t val = plist_array_get_item(removes, ii);
-						if (plist_get_node_type(val) == PLIST_STRING) {
-							char *str = NULL;
-							plist_get_string_val(val, &str);
-							if (str) {
-								const char *checkfile = strchr(str, '/');
-								int suppress_warning = 0;
-								if (checkfile) {
-									if (strcmp(checkfile+1, "Manifest.mbdx") == 0) {
-										suppress_warning = 1;
-									}
-								}
-								char *newpath = string_build_path(backup_directory, str, NULL);
-								free(str);
-								int res = 0;
-								if ((stat(newpath, &st) == 0) && S_ISDIR(st.st_mode)) {
-									res = rmdir_recursive(newpath);
-								} else {
-									res = remove_file(newpath);
-								}
-								if (res != 0 && res != ENOENT) {
-									if (!suppress_warning)
-										printf("Could not remove '%s': %s (%d)\n", newpath, strerror(res), res);
-									errcode = errno_to_device_error(res);
-									errdesc = strerror(res);
-								}
-								free(newpath);
-							}
-						}
-					}
-					plist_t empty_dict = plist_new_dict();
-					err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_dict);
-					plist_free(empty_dict);
-					if (err != MOBILEBACKUP2_E_SUCCESS) {
-						printf("Could not send status response, error %d\n", err);
-					}
+					mb2_handle_remove_items(mobilebackup2, message, backup_directory);
 				} else if (!strcmp(dlmsg, "DLMessageCopyItem")) {
 					plist_t srcpath = plist_array_get_item(message, 1);
 					plist_t dstpath = plist_array_get_item(message, 2);
@@ -2489,7 +6023,16 @@ checkpoint:
 						char *dst = NULL;
 						plist_get_string_val(srcpath, &src);
 						plist_get_string_val(dstpath, &dst);
-						if (src && dst) {
+						if (src && dst && (mb2_archive_handles(src) || mb2_archive_handles(dst))) {
+							if (mb2_archive_handles(src) && mb2_archive_handles(dst)) {
+								PRINT_VERBOSE(1, "Copying '%s' to '%s'\n", src, dst);
+								mb2_archive_rename(backup_archive, src, dst, 1);
+							} else {
+								printf("Copying '%s' to '%s' in and out of the archive is not supported\n", src, dst);
+								errcode = -1;
+								errdesc = "Unsupported copy";
+							}
+						} else if (src && dst) {
 							char *oldpath = string_build_path(backup_directory, src, NULL);
 							char *newpath = string_build_path(backup_directory, dst, NULL);
 
@@ -2573,12 +6116,15 @@ checkpoint:
 				}
 
 files_out:
+				if (dlmsg) {
+					stats_add_message(dlmsg, message_start);
+				}
 				plist_free(message);
 				message = NULL;
 				free(dlmsg);
 				dlmsg = NULL;
 
-				if (quit_flag > 0) {
+				if (mb2_quit_requested()) {
 					/* need to cancel the backup here */
 					//mobilebackup_send_error(mobilebackup, "Cancelling DLSendFile");
 
@@ -2594,6 +6140,10 @@ files_out:
 			plist_free(message);
 			free(dlmsg);
 
+			if (stats_filename) {
+				stats_write_json(stats_filename, device, stats_start);
+			}
+
 			/* report operation status to user */
 			switch (cmd) {
 				case CMD_CLOUD:
@@ -2616,7 +6166,7 @@ files_out:
 					if (operation_ok && mb2_status_check_snapshot_state(backup_directory, udid, "finished")) {
 						PRINT_VERBOSE(1, "Backup Successful.\n");
 					} else {
-						if (quit_flag) {
+						if (mb2_quit_requested()) {
 							PRINT_VERBOSE(1, "Backup Aborted.\n");
 						} else {
 							PRINT_VERBOSE(1, "Backup Failed (Error Code %d).\n", -result_code);
@@ -2624,7 +6174,7 @@ files_out:
 					}
 				break;
 				case CMD_UNBACK:
-				if (quit_flag) {
+				if (mb2_quit_requested()) {
 					PRINT_VERBOSE(1, "Unback Aborted.\n");
 				} else {
 					PRINT_VERBOSE(1, "The files can now be found in the \"_unback_\" directory.\n");
@@ -2660,7 +6210,7 @@ files_out:
 				} else {
 					afc_remove_path(afc, "/iTunesRestore/RestoreApplications.plist");
 					afc_remove_path(afc, "/iTunesRestore");
-					if (quit_flag) {
+					if (mb2_quit_requested()) {
 						PRINT_VERBOSE(1, "Restore Aborted.\n");
 					} else {
 						PRINT_VERBOSE(1, "Restore Failed (Error Code %d).\n", -result_code);
@@ -2671,7 +6221,7 @@ files_out:
 				case CMD_LIST:
 				case CMD_LEAVE:
 				default:
-				if (quit_flag) {
+				if (mb2_quit_requested()) {
 					PRINT_VERBOSE(1, "Operation Aborted.\n");
 				} else if (cmd == CMD_LEAVE) {
 					PRINT_VERBOSE(1, "Operation Failed.\n");
@@ -2721,6 +6271,16 @@ files_out:
 		free(backup_password);
 	}
 
+	write_filter_free(&filter);
+	stats_free();
+
+	if (backup_archive) {
+		if (mb2_archive_close(backup_archive) < 0) {
+			result_code = -1;
+		}
+		backup_archive = NULL;
+	}
+
 	if (udid) {
 		free(udid);
 		udid = NULL;
@@ -2733,3 +6293,185 @@ files_out:
 	return result_code;
 }
 
+/*
+ * Backing up or restoring all attached devices. Every device gets its own
+ * thread running the regular command line with -u UDID added; the devices
+ * share the disk bandwidth limit from --max-disk-rate and, for restores, the
+ * read cache, so restoring one backup given with -s to all devices reads
+ * its files only once.
+ */
+struct mb2_device_worker {
+	THREAD_T thread;
+	char *udid;
+	int argc;
+	char **argv;
+	double progress;
+	int result;
+};
+
+static void* mb2_device_worker_thread(void *arg)
+{
+	struct mb2_device_worker *worker = (struct mb2_device_worker*)arg;
+
+	device_state.udid = worker->udid;
+	device_state.progress = &worker->progress;
+	worker->result = mb2_main(worker->argc, worker->argv);
+
+	return NULL;
+}
+
+static int mb2_backup_all(int argc, char *argv[])
+{
+	idevice_info_t *devices = NULL;
+	struct mb2_device_worker *workers = NULL;
+	int use_network = 0;
+	int count = 0;
+	int num_workers = 0;
+	int failed = 0;
+	int is_backup = 0;
+	int is_restore = 0;
+	int has_source = 0;
+	int i, j;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--udid")) {
+			printf("ERROR: --all can not be used together with %s.\n", argv[i]);
+			return -1;
+		} else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--source")) {
+			has_source = 1;
+		} else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--interactive")
+		 || !strcmp(argv[i], "--archive") || !strcmp(argv[i], "--stats")) {
+			printf("ERROR: %s is not supported in combination with --all.\n", argv[i]);
+			return -1;
+		} else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--network")) {
+			use_network = 1;
+		} else if (!strcmp(argv[i], "backup")) {
+			is_backup = 1;
+		} else if (!strcmp(argv[i], "restore")) {
+			is_restore = 1;
+		}
+	}
+	if (!is_backup && !is_restore) {
+		printf("ERROR: --all can only be used with the backup and restore commands.\n");
+		return -1;
+	}
+	if (has_source && !is_restore) {
+		printf("ERROR: --all can only be used together with -s for restores.\n");
+		return -1;
+	}
+	const char *what = (is_restore) ? "restore" : "backup";
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS || count == 0) {
+		printf("No device found.\n");
+		return -1;
+	}
+
+	workers = (struct mb2_device_worker*)calloc(count, sizeof(struct mb2_device_worker));
+	if (!workers) {
+		idevice_device_list_extended_free(devices);
+		printf("ERROR: Out of memory\n");
+		return -1;
+	}
+
+	signal(SIGINT, clean_exit);
+	signal(SIGTERM, clean_exit);
+#ifndef WIN32
+	signal(SIGQUIT, clean_exit);
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	multi_device = 1;
+	if (is_restore) {
+		/* overridden by --read-cache when the workers parse their arguments */
+		mb2_read_cache_set_limit(READ_CACHE_DEFAULT);
+	}
+	for (i = 0; i < count; i++) {
+		struct mb2_device_worker *worker = &workers[num_workers];
+		int k;
+
+		if (devices[i]->conn_type == CONNECTION_NETWORK && !use_network) {
+			continue;
+		}
+		/* a device connected via USB and network is listed twice */
+		for (j = 0; j < num_workers; j++) {
+			if (!strcmp(workers[j].udid, devices[i]->udid)) {
+				break;
+			}
+		}
+		if (j < num_workers) {
+			continue;
+		}
+
+		worker->udid = strdup(devices[i]->udid);
+		worker->argv = (char**)malloc(sizeof(char*) * (argc + 3));
+		if (!worker->udid || !worker->argv) {
+			free(worker->udid);
+			free(worker->argv);
+			continue;
+		}
+		k = 0;
+		worker->argv[k++] = argv[0];
+		worker->argv[k++] = (char*)"-u";
+		worker->argv[k++] = worker->udid;
+		for (j = 1; j < argc; j++) {
+			if (strcmp(argv[j], "--all") != 0) {
+				worker->argv[k++] = argv[j];
+			}
+		}
+		worker->argv[k] = NULL;
+		worker->argc = k;
+
+		if (thread_new(&worker->thread, mb2_device_worker_thread, worker) != 0) {
+			printf("ERROR: Could not start %s of %s\n", what, worker->udid);
+			free(worker->udid);
+			free(worker->argv);
+			continue;
+		}
+		printf("Starting %s of %s\n", what, worker->udid);
+		num_workers++;
+	}
+	idevice_device_list_extended_free(devices);
+
+	for (i = 0; i < num_workers; i++) {
+		thread_join(workers[i].thread);
+		thread_free(workers[i].thread);
+	}
+
+	printf("\n");
+	for (i = 0; i < num_workers; i++) {
+		if (is_restore) {
+			printf("%s: %s\n", workers[i].udid, (workers[i].result == 0) ? "Restore Successful." : "Restore Failed.");
+		} else {
+			printf("%s: %s\n", workers[i].udid, (workers[i].result == 0) ? "Backup Successful." : "Backup Failed.");
+		}
+		if (workers[i].result != 0) {
+			failed++;
+		}
+		free(workers[i].udid);
+		free(workers[i].argv);
+	}
+	free(workers);
+
+	if (is_restore && read_cache.bytes_shared > 0) {
+		char *loaded = string_format_size(read_cache.bytes_loaded);
+		char *shared = string_format_size(read_cache.bytes_shared);
+		printf("Read cache: %s read from disk, %s more served from memory\n", loaded, shared);
+		free(loaded);
+		free(shared);
+	}
+
+	return (failed || num_workers == 0) ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--all")) {
+			return mb2_backup_all(argc, argv);
+		}
+	}
+
+	return mb2_main(argc, argv);
+}
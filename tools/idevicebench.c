@@ -0,0 +1,649 @@
+/*
+ * idevicebench.c
+ * Measure the I/O throughput and latency a device connection can sustain
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "idevicebench"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/service.h>
+#include <libimobiledevice/afc.h>
+
+#define BENCH_MAX_SERVICES 16
+#define BENCH_AFC_FILE "/idevicebench.tmp"
+
+static const char *default_services[] = {
+	"com.apple.afc",
+	"com.apple.mobile.notification_proxy",
+	"com.apple.mobile.installation_proxy",
+	NULL
+};
+
+struct bench_samples {
+	uint64_t *values;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t failed;
+};
+
+struct bench_throughput {
+	struct bench_samples latency;
+	uint64_t bytes;
+	uint64_t elapsed;
+};
+
+static uint64_t bench_now(void)
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void samples_add(struct bench_samples *samples, uint64_t value)
+{
+	if (samples->count == samples->capacity) {
+		uint32_t capacity = (samples->capacity) ? samples->capacity * 2 : 64;
+		uint64_t *values = (uint64_t*)realloc(samples->values, capacity * sizeof(uint64_t));
+		if (!values) {
+			return;
+		}
+		samples->values = values;
+		samples->capacity = capacity;
+	}
+	samples->values[samples->count++] = value;
+}
+
+static void samples_free(struct bench_samples *samples)
+{
+	free(samples->values);
+	memset(samples, '\0', sizeof(struct bench_samples));
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+/* nearest-rank percentile of the sorted samples */
+static uint64_t samples_percentile(struct bench_samples *samples, unsigned int percent)
+{
+	uint32_t rank;
+	if (samples->count == 0) {
+		return 0;
+	}
+	rank = (uint32_t)(((uint64_t)percent * samples->count + 99) / 100);
+	if (rank < 1) {
+		rank = 1;
+	}
+	return samples->values[rank - 1];
+}
+
+static void json_print_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; str && *str; str++) {
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void json_print_latency(FILE *out, struct bench_samples *samples)
+{
+	uint64_t sum = 0;
+	uint32_t i;
+
+	qsort(samples->values, samples->count, sizeof(uint64_t), compare_u64);
+	for (i = 0; i < samples->count; i++) {
+		sum += samples->values[i];
+	}
+
+	fprintf(out, "{ \"count\": %u, \"failed\": %u", samples->count, samples->failed);
+	if (samples->count > 0) {
+		fprintf(out, ", \"min\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu",
+			(unsigned long long)samples->values[0],
+			(unsigned long long)(sum / samples->count),
+			(unsigned long long)samples_percentile(samples, 50),
+			(unsigned long long)samples_percentile(samples, 90),
+			(unsigned long long)samples_percentile(samples, 99),
+			(unsigned long long)samples->values[samples->count - 1]);
+	}
+	fprintf(out, " }");
+}
+
+static void json_print_throughput(FILE *out, struct bench_throughput *tp)
+{
+	double seconds = (tp->elapsed > 0) ? (double)tp->elapsed / 1000000.0 : 0.000001;
+	fprintf(out, "{ \"bytes\": %llu, \"elapsed_us\": %llu, \"mb_per_sec\": %.2f, \"latency_us\": ",
+		(unsigned long long)tp->bytes, (unsigned long long)tp->elapsed,
+		(double)tp->bytes / (1024.0 * 1024.0) / seconds);
+	json_print_latency(out, &tp->latency);
+	fprintf(out, " }");
+}
+
+static void bench_lockdown_handshake(idevice_t device, uint32_t iterations, struct bench_samples *samples)
+{
+	uint32_t i;
+
+	fprintf(stderr, "Measuring lockdown handshake latency...\n");
+	for (i = 0; i < iterations; i++) {
+		lockdownd_client_t lockdown = NULL;
+		uint64_t start = bench_now();
+		lockdownd_error_t lerr = lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME);
+		uint64_t elapsed = bench_now() - start;
+		if (lerr != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not connect to lockdownd, error code %d\n", lerr);
+			samples->failed++;
+			continue;
+		}
+		samples_add(samples, elapsed);
+		lockdownd_client_free(lockdown);
+	}
+}
+
+static void bench_plist_round_trip(lockdownd_client_t lockdown, uint32_t iterations, struct bench_samples *samples)
+{
+	uint32_t i;
+
+	fprintf(stderr, "Measuring plist round trip latency...\n");
+	for (i = 0; i < iterations; i++) {
+		plist_t value = NULL;
+		uint64_t start = bench_now();
+		lockdownd_error_t lerr = lockdownd_get_value(lockdown, NULL, "ProductVersion", &value);
+		uint64_t elapsed = bench_now() - start;
+		if (lerr != LOCKDOWN_E_SUCCESS) {
+			samples->failed++;
+			continue;
+		}
+		samples_add(samples, elapsed);
+		plist_free(value);
+	}
+}
+
+static void bench_start_service(idevice_t device, lockdownd_client_t lockdown, const char *name, uint32_t iterations, struct bench_samples *samples, int *ssl_enabled)
+{
+	uint32_t i;
+
+	fprintf(stderr, "Measuring StartService latency for %s...\n", name);
+	for (i = 0; i < iterations; i++) {
+		lockdownd_service_descriptor_t service = NULL;
+		service_client_t client = NULL;
+		uint64_t start = bench_now();
+		lockdownd_error_t lerr = lockdownd_start_service(lockdown, name, &service);
+		if (lerr != LOCKDOWN_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not start service %s, lockdown error %d\n", name, lerr);
+			samples->failed++;
+			continue;
+		}
+		/* connects and performs the SSL handshake if the service requires it */
+		service_error_t serr = service_client_new(device, service, &client);
+		uint64_t elapsed = bench_now() - start;
+		*ssl_enabled = service->ssl_enabled;
+		lockdownd_service_descriptor_free(service);
+		if (serr != SERVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not connect to service %s, error %d\n", name, serr);
+			samples->failed++;
+			continue;
+		}
+		samples_add(samples, elapsed);
+		service_client_free(client);
+	}
+}
+
+static int bench_afc(idevice_t device, lockdownd_client_t lockdown, uint64_t size, uint32_t chunk_size, uint32_t depth, struct bench_throughput *write_tp, struct bench_throughput *read_tp)
+{
+	lockdownd_service_descriptor_t service = NULL;
+	afc_client_t afc = NULL;
+	uint64_t handle = 0;
+	uint64_t done;
+	uint64_t start;
+	uint32_t block_size = chunk_size * depth;
+	char *buffer = NULL;
+	int res = -1;
+
+	if (lockdownd_start_service(lockdown, AFC_SERVICE_NAME, &service) != LOCKDOWN_E_SUCCESS || !service || service->port == 0) {
+		fprintf(stderr, "ERROR: Could not start service %s\n", AFC_SERVICE_NAME);
+		lockdownd_service_descriptor_free(service);
+		return -1;
+	}
+	afc_error_t aerr = afc_client_new(device, service, &afc);
+	lockdownd_service_descriptor_free(service);
+	if (aerr != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to AFC, error %d\n", aerr);
+		return -1;
+	}
+
+	buffer = (char*)malloc(block_size);
+	if (!buffer) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		afc_client_free(afc);
+		return -1;
+	}
+	memset(buffer, 0x5A, block_size);
+
+	afc_set_max_chunk_size(afc, chunk_size);
+	afc_set_write_window(afc, depth);
+
+	fprintf(stderr, "Measuring AFC sequential write (%llu bytes, chunk size %u, depth %u)...\n", (unsigned long long)size, chunk_size, depth);
+	aerr = afc_file_open(afc, BENCH_AFC_FILE, AFC_FOPEN_WRONLY, &handle);
+	if (aerr != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not create %s on the device, error %d\n", BENCH_AFC_FILE, aerr);
+		goto leave;
+	}
+	done = 0;
+	start = bench_now();
+	while (done < size) {
+		uint32_t length = (size - done < chunk_size) ? (uint32_t)(size - done) : chunk_size;
+		uint32_t written = 0;
+		uint64_t t = bench_now();
+		aerr = afc_file_write(afc, handle, buffer, length, &written);
+		if (aerr != AFC_E_SUCCESS || written == 0) {
+			fprintf(stderr, "ERROR: AFC write failed, error %d\n", aerr);
+			write_tp->latency.failed++;
+			break;
+		}
+		samples_add(&write_tp->latency, bench_now() - t);
+		done += written;
+	}
+	/* closing waits for the outstanding write replies */
+	afc_file_close(afc, handle);
+	write_tp->elapsed = bench_now() - start;
+	write_tp->bytes = done;
+	if (done < size) {
+		goto leave;
+	}
+
+	fprintf(stderr, "Measuring AFC sequential read (%llu bytes, chunk size %u, depth %u)...\n", (unsigned long long)size, chunk_size, depth);
+	aerr = afc_file_open(afc, BENCH_AFC_FILE, AFC_FOPEN_RDONLY, &handle);
+	if (aerr != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not open %s on the device, error %d\n", BENCH_AFC_FILE, aerr);
+		goto leave;
+	}
+	done = 0;
+	start = bench_now();
+	while (done < size) {
+		uint32_t length = (size - done < block_size) ? (uint32_t)(size - done) : block_size;
+		uint32_t bytes_read = 0;
+		uint64_t t = bench_now();
+		if (depth > 1) {
+			aerr = afc_file_read_pipelined(afc, handle, buffer, length, chunk_size, depth, &bytes_read);
+		} else {
+			aerr = afc_file_read(afc, handle, buffer, length, &bytes_read);
+		}
+		if (aerr != AFC_E_SUCCESS || bytes_read == 0) {
+			fprintf(stderr, "ERROR: AFC read failed, error %d\n", aerr);
+			read_tp->latency.failed++;
+			break;
+		}
+		samples_add(&read_tp->latency, bench_now() - t);
+		done += bytes_read;
+	}
+	read_tp->elapsed = bench_now() - start;
+	read_tp->bytes = done;
+	afc_file_close(afc, handle);
+	if (done == size) {
+		res = 0;
+	}
+
+leave:
+	afc_remove_path(afc, BENCH_AFC_FILE);
+	afc_client_free(afc);
+	free(buffer);
+
+	return res;
+}
+
+static void print_usage(int argc, char **argv, int is_error)
+{
+	char *name = strrchr(argv[0], '/');
+	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS] [TEST ...]\n", (name ? name + 1: argv[0]));
+	fprintf(is_error ? stderr : stdout,
+		"\n"
+		"Measure the I/O throughput and latency a device connection can sustain\n"
+		"and print the results as JSON.\n"
+		"\n"
+		"TESTS:\n"
+		"  handshake     lockdown handshake latency\n"
+		"  plist         plist round trip latency\n"
+		"  service       StartService and SSL latency per service\n"
+		"  afc           AFC sequential write and read throughput\n"
+		"\n"
+		"All tests are run if none is given.\n"
+		"\n"
+		"OPTIONS:\n"
+		"  -u, --udid UDID       target specific device by UDID\n"
+		"  -n, --network         connect to network device\n"
+		"  -i, --iterations N    number of samples per latency test (default 20)\n"
+		"  -S, --service NAME    service to measure, can be given multiple times\n"
+		"  -s, --size MB         amount of data to transfer with AFC (default 64)\n"
+		"  -c, --chunk-size N    AFC chunk size in bytes (default 65536)\n"
+		"  -p, --depth N         AFC pipeline depth (default 8)\n"
+		"  -o, --output FILE     write the JSON results to FILE instead of stdout\n"
+		"  -d, --debug           enable communication debugging\n"
+		"  -h, --help            prints usage information\n"
+		"  -v, --version         prints version information\n"
+		"\n"
+		"Homepage:    <" PACKAGE_URL ">\n"
+		"Bug Reports: <" PACKAGE_BUGREPORT ">\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	int c = 0;
+	int i;
+	int res = 0;
+	const char *udid = NULL;
+	const char *output = NULL;
+	int use_network = 0;
+	uint32_t iterations = 20;
+	uint64_t size = 64 * 1024 * 1024;
+	uint32_t chunk_size = 65536;
+	uint32_t depth = 8;
+	const char *services[BENCH_MAX_SERVICES + 1];
+	int num_services = 0;
+	int run_handshake = 0;
+	int run_plist = 0;
+	int run_service = 0;
+	int run_afc = 0;
+	const struct option longopts[] = {
+		{ "udid", required_argument, NULL, 'u' },
+		{ "network", no_argument, NULL, 'n' },
+		{ "iterations", required_argument, NULL, 'i' },
+		{ "service", required_argument, NULL, 'S' },
+		{ "size", required_argument, NULL, 's' },
+		{ "chunk-size", required_argument, NULL, 'c' },
+		{ "depth", required_argument, NULL, 'p' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "debug", no_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "version", no_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0}
+	};
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	while ((c = getopt_long(argc, argv, "u:ni:S:s:c:p:o:dhv", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'u':
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: UDID must not be empty!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			udid = optarg;
+			break;
+		case 'n':
+			use_network = 1;
+			break;
+		case 'i':
+			iterations = (uint32_t)strtoul(optarg, NULL, 10);
+			if (iterations == 0) {
+				fprintf(stderr, "ERROR: Invalid number of iterations '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'S':
+			if (num_services == BENCH_MAX_SERVICES) {
+				fprintf(stderr, "ERROR: Too many services, at most %d are supported\n", BENCH_MAX_SERVICES);
+				return 2;
+			}
+			services[num_services++] = optarg;
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			if (size == 0) {
+				fprintf(stderr, "ERROR: Invalid size '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'c':
+			chunk_size = (uint32_t)strtoul(optarg, NULL, 10);
+			if (chunk_size == 0 || chunk_size > 16 * 1024 * 1024) {
+				fprintf(stderr, "ERROR: Invalid chunk size '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'p':
+			depth = (uint32_t)strtoul(optarg, NULL, 10);
+			if (depth == 0 || depth > 64) {
+				fprintf(stderr, "ERROR: Invalid pipeline depth '%s', must be between 1 and 64\n", optarg);
+				return 2;
+			}
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'h':
+			print_usage(argc, argv, 0);
+			return 0;
+		case 'v':
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		default:
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], "handshake")) {
+			run_handshake = 1;
+		} else if (!strcmp(argv[i], "plist")) {
+			run_plist = 1;
+		} else if (!strcmp(argv[i], "service")) {
+			run_service = 1;
+		} else if (!strcmp(argv[i], "afc")) {
+			run_afc = 1;
+		} else {
+			fprintf(stderr, "ERROR: Unknown test '%s'\n", argv[i]);
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+	if (!run_handshake && !run_plist && !run_service && !run_afc) {
+		run_handshake = run_plist = run_service = run_afc = 1;
+	}
+	if (num_services == 0) {
+		for (num_services = 0; default_services[num_services]; num_services++) {
+			services[num_services] = default_services[num_services];
+		}
+	}
+	services[num_services] = NULL;
+
+	idevice_t device = NULL;
+	if (idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		if (udid) {
+			fprintf(stderr, "ERROR: Device %s not found!\n", udid);
+		} else {
+			fprintf(stderr, "ERROR: No device found!\n");
+		}
+		return 1;
+	}
+
+	lockdownd_client_t lockdown = NULL;
+	lockdownd_error_t lerr = lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not connect to lockdownd, error code %d\n", lerr);
+		idevice_free(device);
+		return 1;
+	}
+
+	char *device_udid = NULL;
+	char *product_type = NULL;
+	char *product_version = NULL;
+	plist_t node = NULL;
+	idevice_get_udid(device, &device_udid);
+	if (lockdownd_get_value(lockdown, NULL, "ProductType", &node) == LOCKDOWN_E_SUCCESS) {
+		plist_get_string_val(node, &product_type);
+		plist_free(node);
+		node = NULL;
+	}
+	if (lockdownd_get_value(lockdown, NULL, "ProductVersion", &node) == LOCKDOWN_E_SUCCESS) {
+		plist_get_string_val(node, &product_version);
+		plist_free(node);
+		node = NULL;
+	}
+
+	struct bench_samples handshake;
+	struct bench_samples plist_rtt;
+	struct bench_samples service_samples[BENCH_MAX_SERVICES];
+	int service_ssl[BENCH_MAX_SERVICES];
+	struct bench_throughput afc_write;
+	struct bench_throughput afc_read;
+	memset(&handshake, '\0', sizeof(handshake));
+	memset(&plist_rtt, '\0', sizeof(plist_rtt));
+	memset(service_samples, '\0', sizeof(service_samples));
+	memset(service_ssl, '\0', sizeof(service_ssl));
+	memset(&afc_write, '\0', sizeof(afc_write));
+	memset(&afc_read, '\0', sizeof(afc_read));
+
+	if (run_handshake) {
+		bench_lockdown_handshake(device, iterations, &handshake);
+	}
+	if (run_plist) {
+		bench_plist_round_trip(lockdown, iterations, &plist_rtt);
+	}
+	if (run_service) {
+		for (i = 0; i < num_services; i++) {
+			bench_start_service(device, lockdown, services[i], iterations, &service_samples[i], &service_ssl[i]);
+		}
+	}
+	if (run_afc) {
+		if (bench_afc(device, lockdown, size, chunk_size, depth, &afc_write, &afc_read) < 0) {
+			res = 1;
+		}
+	}
+
+	lockdownd_client_free(lockdown);
+	idevice_free(device);
+
+	FILE *out = stdout;
+	if (output) {
+		out = fopen(output, "w");
+		if (!out) {
+			fprintf(stderr, "ERROR: Could not open %s for writing\n", output);
+			out = stdout;
+			res = 1;
+		}
+	}
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"tool\": \"%s\",\n", TOOL_NAME);
+	fprintf(out, "  \"version\": \"%s\",\n", PACKAGE_VERSION);
+	fprintf(out, "  \"device\": { \"udid\": ");
+	json_print_string(out, device_udid);
+	fprintf(out, ", \"product_type\": ");
+	json_print_string(out, product_type);
+	fprintf(out, ", \"product_version\": ");
+	json_print_string(out, product_version);
+	fprintf(out, ", \"network\": %s },\n", (use_network) ? "true" : "false");
+	fprintf(out, "  \"iterations\": %u", iterations);
+	if (run_handshake) {
+		fprintf(out, ",\n  \"lockdown_handshake\": { \"latency_us\": ");
+		json_print_latency(out, &handshake);
+		fprintf(out, " }");
+	}
+	if (run_plist) {
+		fprintf(out, ",\n  \"plist_round_trip\": { \"latency_us\": ");
+		json_print_latency(out, &plist_rtt);
+		fprintf(out, " }");
+	}
+	if (run_service) {
+		fprintf(out, ",\n  \"start_service\": [\n");
+		for (i = 0; i < num_services; i++) {
+			fprintf(out, "    { \"service\": ");
+			json_print_string(out, services[i]);
+			fprintf(out, ", \"ssl\": %s, \"latency_us\": ", (service_ssl[i]) ? "true" : "false");
+			json_print_latency(out, &service_samples[i]);
+			fprintf(out, " }%s\n", (i < num_services - 1) ? "," : "");
+		}
+		fprintf(out, "  ]");
+	}
+	if (run_afc) {
+		fprintf(out, ",\n  \"afc\": {\n");
+		fprintf(out, "    \"size\": %llu, \"chunk_size\": %u, \"depth\": %u,\n", (unsigned long long)size, chunk_size, depth);
+		fprintf(out, "    \"write\": ");
+		json_print_throughput(out, &afc_write);
+		fprintf(out, ",\n    \"read\": ");
+		json_print_throughput(out, &afc_read);
+		fprintf(out, "\n  }");
+	}
+	fprintf(out, "\n}\n");
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	samples_free(&handshake);
+	samples_free(&plist_rtt);
+	for (i = 0; i < num_services; i++) {
+		samples_free(&service_samples[i]);
+	}
+	samples_free(&afc_write.latency);
+	samples_free(&afc_read.latency);
+	free(device_udid);
+	free(product_type);
+	free(product_version);
+
+	return res;
+}
@@ -0,0 +1,135 @@
+/*
+ * idevicebroker.c
+ * Keep warm lockdown sessions for other processes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "idevicebroker"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+
+static volatile int quit_flag = 0;
+
+static void handle_signal(int sig)
+{
+	quit_flag = 1;
+}
+
+static void print_usage(int argc, char **argv, int is_error)
+{
+	char *name = strrchr(argv[0], '/');
+	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS] [SOCKET]\n", (name ? name + 1: argv[0]));
+	fprintf(is_error ? stderr : stdout,
+		"\n"
+		"Keep a warm lockdown session for every attached device and hand ready\n"
+		"connections to other processes through the Unix socket SOCKET, so they\n"
+		"skip the pairing and SSL handshakes. Tools use the broker when the\n"
+		"LIBIMOBILEDEVICE_BROKER environment variable is set to SOCKET, which is\n"
+		"also the default for SOCKET.\n"
+		"\n"
+		"OPTIONS:\n"
+		"  -d, --debug           enable communication debugging\n"
+		"  -h, --help            prints usage information\n"
+		"  -v, --version         prints version information\n"
+		"\n"
+		"Homepage:    <" PACKAGE_URL ">\n"
+		"Bug Reports: <" PACKAGE_BUGREPORT ">\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	int c = 0;
+	const char *path = NULL;
+	const struct option longopts[] = {
+		{ "debug", no_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "version", no_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0}
+	};
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	while ((c = getopt_long(argc, argv, "dhv", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'h':
+			print_usage(argc, argv, 0);
+			return 0;
+		case 'v':
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		default:
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 0) {
+		path = argv[0];
+	} else {
+		path = getenv("LIBIMOBILEDEVICE_BROKER");
+	}
+	if (!path || !*path) {
+		fprintf(stderr, "ERROR: No socket given and LIBIMOBILEDEVICE_BROKER is not set\n");
+		return 2;
+	}
+
+	/* the broker itself talks to the devices directly */
+	idevice_set_broker(NULL);
+
+	if (idevice_broker_serve(path) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not listen on %s\n", path);
+		return 1;
+	}
+	printf("Brokering connections at %s\n", path);
+	fflush(stdout);
+
+	while (!quit_flag) {
+#ifdef WIN32
+		Sleep(500);
+#else
+		usleep(500000);
+#endif
+	}
+
+	idevice_broker_serve(NULL);
+
+	return 0;
+}
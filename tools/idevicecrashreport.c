@@ -30,10 +30,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
 #ifndef WIN32
 #include <signal.h>
 #endif
 #include "common/utils.h"
+#include "common/thread.h"
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -47,9 +50,15 @@
 #define S_IFSOCK S_IFREG
 #endif
 
+#define COPY_WORKERS 4
+#define TRANSFER_BLOCK_SIZE (1024 * 1024)
+#define MANIFEST_FILENAME ".idevicecrashreport.plist"
+
 const char* target_directory = NULL;
 static int extract_raw_crash_reports = 0;
 static int keep_crash_reports = 0;
+static uint64_t since_ns = 0;
+static plist_t manifest = NULL;
 
 static int file_exists(const char* path)
 {
@@ -100,99 +109,345 @@ static int extract_raw_crash_report(const char* filename)
 	return res;
 }
 
-static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char* device_directory, const char* host_directory)
+enum raw_extract_state {
+	RAW_EXTRACT_SEEK_KEY,
+	RAW_EXTRACT_SEEK_STRING,
+	RAW_EXTRACT_IN_STRING,
+	RAW_EXTRACT_IN_ENTITY,
+	RAW_EXTRACT_DONE
+};
+
+/* incremental scanner extracting the description string of an XML crash report */
+struct raw_extractor {
+	enum raw_extract_state state;
+	size_t match;
+	char entity[12];
+	size_t entity_length;
+	FILE *output;
+	char buffer[4096];
+	size_t buffer_length;
+	int found;
+};
+
+static const char RAW_KEY_PATTERN[] = "<key>description</key>";
+static const char RAW_STRING_PATTERN[] = "<string>";
+
+static void raw_extractor_put(struct raw_extractor *ex, const char *data, size_t length)
 {
-	afc_error_t afc_error;
-	int k;
-	int res = -1;
-	int crash_report_count = 0;
-	uint64_t handle;
-	char source_filename[512];
-	char target_filename[512];
-
-	if (!afc)
-		return res;
+	if (ex->buffer_length + length > sizeof(ex->buffer)) {
+		fwrite(ex->buffer, 1, ex->buffer_length, ex->output);
+		ex->buffer_length = 0;
+	}
+	if (length > sizeof(ex->buffer)) {
+		fwrite(data, 1, length, ex->output);
+		return;
+	}
+	memcpy(ex->buffer + ex->buffer_length, data, length);
+	ex->buffer_length += length;
+}
 
-	char** list = NULL;
-	afc_error = afc_read_directory(afc, device_directory, &list);
-	if (afc_error != AFC_E_SUCCESS) {
-		fprintf(stderr, "ERROR: Could not read device directory '%s'\n", device_directory);
-		return res;
+/* writes the UTF-8 encoding of an XML entity like &amp; or &#x41; */
+static void raw_extractor_put_entity(struct raw_extractor *ex)
+{
+	const char *e = ex->entity;
+	char out[4];
+	size_t n = 0;
+	unsigned long cp = 0;
+
+	if (!strcmp(e, "lt")) {
+		cp = '<';
+	} else if (!strcmp(e, "gt")) {
+		cp = '>';
+	} else if (!strcmp(e, "amp")) {
+		cp = '&';
+	} else if (!strcmp(e, "quot")) {
+		cp = '"';
+	} else if (!strcmp(e, "apos")) {
+		cp = '\'';
+	} else if (e[0] == '#') {
+		cp = (e[1] == 'x') ? strtoul(e + 2, NULL, 16) : strtoul(e + 1, NULL, 10);
+	}
+	if (cp == 0 || cp > 0x10FFFF) {
+		/* leave unknown entities untouched */
+		raw_extractor_put(ex, "&", 1);
+		raw_extractor_put(ex, e, ex->entity_length);
+		raw_extractor_put(ex, ";", 1);
+		return;
+	}
+	if (cp < 0x80) {
+		out[n++] = (char)cp;
+	} else if (cp < 0x800) {
+		out[n++] = (char)(0xC0 | (cp >> 6));
+		out[n++] = (char)(0x80 | (cp & 0x3F));
+	} else if (cp < 0x10000) {
+		out[n++] = (char)(0xE0 | (cp >> 12));
+		out[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		out[n++] = (char)(0x80 | (cp & 0x3F));
+	} else {
+		out[n++] = (char)(0xF0 | (cp >> 18));
+		out[n++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+		out[n++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		out[n++] = (char)(0x80 | (cp & 0x3F));
 	}
+	raw_extractor_put(ex, out, n);
+}
 
-	/* ensure we have a trailing slash */
-	strcpy(source_filename, device_directory);
-	if (source_filename[strlen(source_filename)-1] != '/') {
-		strcat(source_filename, "/");
+static void raw_extractor_feed(struct raw_extractor *ex, const char *data, size_t length)
+{
+	size_t i = 0;
+	while (i < length && ex->state != RAW_EXTRACT_DONE) {
+		char c = data[i];
+		switch (ex->state) {
+		case RAW_EXTRACT_SEEK_KEY:
+			if (c == RAW_KEY_PATTERN[ex->match]) {
+				ex->match++;
+			} else {
+				ex->match = (c == '<') ? 1 : 0;
+			}
+			if (ex->match == sizeof(RAW_KEY_PATTERN) - 1) {
+				ex->match = 0;
+				ex->state = RAW_EXTRACT_SEEK_STRING;
+			}
+			i++;
+			break;
+		case RAW_EXTRACT_SEEK_STRING:
+			if (ex->match == 0 && (c == ' ' || c == '\t' || c == '\r' || c == '\n')) {
+				i++;
+				break;
+			}
+			if (c != RAW_STRING_PATTERN[ex->match]) {
+				/* the value is not a string, or an empty <string/> */
+				ex->state = RAW_EXTRACT_DONE;
+				break;
+			}
+			ex->match++;
+			i++;
+			if (ex->match == sizeof(RAW_STRING_PATTERN) - 1) {
+				ex->state = RAW_EXTRACT_IN_STRING;
+				ex->found = 1;
+			}
+			break;
+		case RAW_EXTRACT_IN_STRING: {
+			/* copy everything up to the next markup character in one go */
+			size_t start = i;
+			while (i < length && data[i] != '<' && data[i] != '&') {
+				i++;
+			}
+			if (i > start) {
+				raw_extractor_put(ex, data + start, i - start);
+			}
+			if (i < length) {
+				if (data[i] == '<') {
+					ex->state = RAW_EXTRACT_DONE;
+				} else {
+					ex->entity_length = 0;
+					ex->state = RAW_EXTRACT_IN_ENTITY;
+				}
+				i++;
+			}
+			break;
+		}
+		case RAW_EXTRACT_IN_ENTITY:
+			if (c == ';' || ex->entity_length == sizeof(ex->entity) - 1) {
+				ex->entity[ex->entity_length] = '\0';
+				raw_extractor_put_entity(ex);
+				ex->state = RAW_EXTRACT_IN_STRING;
+				if (c != ';') {
+					/* not an entity after all, process the character as text */
+					break;
+				}
+			} else {
+				ex->entity[ex->entity_length++] = c;
+			}
+			i++;
+			break;
+		default:
+			i++;
+			break;
+		}
 	}
-	int device_directory_length = strlen(source_filename);
+}
 
-	/* ensure we have a trailing slash */
-	strcpy(target_filename, host_directory);
-	if (target_filename[strlen(target_filename)-1] != '/') {
-		strcat(target_filename, "/");
+/**
+ * Copies a crash report from the device and extracts the raw crash report
+ * into a separate '.crash' file while the data arrives.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t download_and_extract_crash_report(afc_client_t afc, const char *source, const char *target)
+{
+	uint64_t handle = 0;
+	afc_error_t afc_error = afc_file_open(afc, source, AFC_FOPEN_RDONLY, &handle);
+	if (afc_error != AFC_E_SUCCESS) {
+		return afc_error;
 	}
-	int host_directory_length = strlen(target_filename);
 
-	/* loop over file entries */
-	for (k = 0; list[k]; k++) {
-		if (!strcmp(list[k], ".") || !strcmp(list[k], "..")) {
-			continue;
-		}
+	char *raw_filename = strdup(target);
+	strcpy(strrchr(raw_filename, '.'), ".crash");
 
-		char **fileinfo = NULL;
-		struct stat stbuf;
-		memset(&stbuf, '\0', sizeof(struct stat));
+	FILE *output = fopen(target, "wb");
+	FILE *raw_output = fopen(raw_filename, "wb");
+	char *data = (char*)malloc(TRANSFER_BLOCK_SIZE);
+	if (!output || !raw_output || !data) {
+		if (output)
+			fclose(output);
+		if (raw_output)
+			fclose(raw_output);
+		free(data);
+		remove(raw_filename);
+		free(raw_filename);
+		afc_file_close(afc, handle);
+		return AFC_E_IO_ERROR;
+	}
 
-		/* assemble absolute source filename */
-		strcpy(((char*)source_filename) + device_directory_length, list[k]);
+	struct raw_extractor *ex = (struct raw_extractor*)calloc(1, sizeof(struct raw_extractor));
+	ex->output = raw_output;
 
-		/* assemble absolute target filename */
-		char* p = strrchr(list[k], '.');
-		if (p != NULL && !strncmp(p, ".synced", 7)) {
-			/* make sure to strip ".synced" extension as seen on iOS 5 */
-			int newlen = strlen(list[k]) - 7;
-			strncpy(((char*)target_filename) + host_directory_length, list[k], newlen);
-			target_filename[host_directory_length + newlen] = '\0';
-		} else {
-			strcpy(((char*)target_filename) + host_directory_length, list[k]);
+	int binary = 0;
+	uint64_t total = 0;
+	while (1) {
+		uint32_t bytes_read = 0;
+		afc_error = afc_file_read_pipelined(afc, handle, data, TRANSFER_BLOCK_SIZE, 0, 8, &bytes_read);
+		if (afc_error != AFC_E_SUCCESS || bytes_read == 0) {
+			break;
+		}
+		if (total == 0 && bytes_read >= 8 && memcmp(data, "bplist00", 8) == 0) {
+			binary = 1;
 		}
+		if (fwrite(data, 1, bytes_read, output) != bytes_read) {
+			afc_error = AFC_E_IO_ERROR;
+			break;
+		}
+		if (!binary) {
+			raw_extractor_feed(ex, data, bytes_read);
+		}
+		total += bytes_read;
+		if (bytes_read < TRANSFER_BLOCK_SIZE) {
+			break;
+		}
+	}
+	afc_file_close(afc, handle);
+	fclose(output);
 
-		/* get file information */
-		afc_get_file_info(afc, source_filename, &fileinfo);
-		if (!fileinfo) {
-			printf("Failed to read information for '%s'. Skipping...\n", source_filename);
-			continue;
+	if (ex->buffer_length > 0) {
+		fwrite(ex->buffer, 1, ex->buffer_length, raw_output);
+	}
+	fclose(raw_output);
+	int found = ex->found;
+	free(ex);
+	free(data);
+
+	if (!found || afc_error != AFC_E_SUCCESS) {
+		remove(raw_filename);
+	}
+	free(raw_filename);
+
+	/* binary reports cannot be scanned as text, parse them instead */
+	if (afc_error == AFC_E_SUCCESS && binary) {
+		extract_raw_crash_report(target);
+	}
+
+	return afc_error;
+}
+
+struct crash_report_job {
+	char *source;
+	char *target;
+	uint64_t size;
+	uint64_t mtime;
+};
+
+struct crash_report_queue {
+	afc_pool_t pool;
+	struct crash_report_job *jobs;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t next;
+	char **directories;
+	uint32_t directory_count;
+	int copied;
+	int failed;
+	mutex_t mutex;
+};
+
+static void crash_report_queue_add_job(struct crash_report_queue *queue, const char *source, const char *target, uint64_t size, uint64_t mtime)
+{
+	if (queue->count == queue->capacity) {
+		queue->capacity = (queue->capacity) ? queue->capacity * 2 : 64;
+		queue->jobs = (struct crash_report_job*)realloc(queue->jobs, queue->capacity * sizeof(struct crash_report_job));
+	}
+	struct crash_report_job *job = &queue->jobs[queue->count++];
+	job->source = strdup(source);
+	job->target = strdup(target);
+	job->size = size;
+	job->mtime = mtime;
+}
+
+static int manifest_contains(const char *path, uint64_t size, uint64_t mtime)
+{
+	if (!manifest) {
+		return 0;
+	}
+	plist_t entry = plist_dict_get_item(manifest, path);
+	if (!entry || plist_get_node_type(entry) != PLIST_DICT) {
+		return 0;
+	}
+	uint64_t known_size = 0;
+	uint64_t known_mtime = 0;
+	plist_get_uint_val(plist_dict_get_item(entry, "Size"), &known_size);
+	plist_get_uint_val(plist_dict_get_item(entry, "MTime"), &known_mtime);
+	return (known_size == size && known_mtime == mtime);
+}
+
+static void manifest_add(const char *path, uint64_t size, uint64_t mtime)
+{
+	if (!manifest) {
+		return;
+	}
+	plist_t entry = plist_new_dict();
+	plist_dict_set_item(entry, "Size", plist_new_uint(size));
+	plist_dict_set_item(entry, "MTime", plist_new_uint(mtime));
+	plist_dict_set_item(manifest, path, entry);
+}
+
+/**
+ * Walks a directory on the device, recreates the directory structure and
+ * symlinks on the host and queues the crash reports that have to be copied.
+ */
+static int collect_crash_reports(afc_client_t afc, struct crash_report_queue *queue, const char* device_directory, const char* host_directory)
+{
+	afc_dir_entry_t *entries = NULL;
+	uint32_t count = 0;
+	uint32_t k;
+
+	afc_error_t afc_error = afc_read_directory_with_info(afc, device_directory, &entries, &count);
+	if (afc_error != AFC_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not read device directory '%s'\n", device_directory);
+		return -1;
+	}
+
+	for (k = 0; k < count; k++) {
+		afc_dir_entry_t *entry = &entries[k];
+		char *source_filename = string_build_path(device_directory, entry->name, NULL);
+		char *target_filename = NULL;
+
+		/* make sure to strip ".synced" extension as seen on iOS 5 */
+		char* p = strrchr(entry->name, '.');
+		if (p != NULL && !strcmp(p, ".synced")) {
+			char *name = strdup(entry->name);
+			name[p - entry->name] = '\0';
+			target_filename = string_build_path(host_directory, name, NULL);
+			free(name);
+		} else {
+			target_filename = string_build_path(host_directory, entry->name, NULL);
 		}
 
-		/* parse file information */
-		int i;
-		for (i = 0; fileinfo[i]; i+=2) {
-			if (!strcmp(fileinfo[i], "st_size")) {
-				stbuf.st_size = atoll(fileinfo[i+1]);
-			} else if (!strcmp(fileinfo[i], "st_ifmt")) {
-				if (!strcmp(fileinfo[i+1], "S_IFREG")) {
-					stbuf.st_mode = S_IFREG;
-				} else if (!strcmp(fileinfo[i+1], "S_IFDIR")) {
-					stbuf.st_mode = S_IFDIR;
-				} else if (!strcmp(fileinfo[i+1], "S_IFLNK")) {
-					stbuf.st_mode = S_IFLNK;
-				} else if (!strcmp(fileinfo[i+1], "S_IFBLK")) {
-					stbuf.st_mode = S_IFBLK;
-				} else if (!strcmp(fileinfo[i+1], "S_IFCHR")) {
-					stbuf.st_mode = S_IFCHR;
-				} else if (!strcmp(fileinfo[i+1], "S_IFIFO")) {
-					stbuf.st_mode = S_IFIFO;
-				} else if (!strcmp(fileinfo[i+1], "S_IFSOCK")) {
-					stbuf.st_mode = S_IFSOCK;
-				}
-			} else if (!strcmp(fileinfo[i], "st_nlink")) {
-				stbuf.st_nlink = atoi(fileinfo[i+1]);
-			} else if (!strcmp(fileinfo[i], "st_mtime")) {
-				stbuf.st_mtime = (time_t)(atoll(fileinfo[i+1]) / 1000000000);
-			} else if (!strcmp(fileinfo[i], "LinkTarget")) {
+		if (entry->type == AFC_FILE_TYPE_SYMLINK) {
+			afc_file_info_t *info = NULL;
+			afc_get_file_info_typed(afc, source_filename, &info);
+			if (info && info->link_target) {
 				/* report latest crash report filename */
-				printf("Link: %s\n", (char*)target_filename + strlen(target_directory));
+				printf("Link: %s\n", target_filename + strlen(target_directory));
 
 				/* remove any previous symlink */
 				if (file_exists(target_filename)) {
@@ -201,12 +456,8 @@ static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char
 
 #ifndef WIN32
 				/* use relative filename */
-				char* b = strrchr(fileinfo[i+1], '/');
-				if (b == NULL) {
-					b = fileinfo[i+1];
-				} else {
-					b++;
-				}
+				char* b = strrchr(info->link_target, '/');
+				b = (b) ? b + 1 : info->link_target;
 
 				/* create a symlink pointing to latest log */
 				if (symlink(b, target_filename) < 0) {
@@ -216,88 +467,190 @@ static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char
 
 				if (!keep_crash_reports)
 					afc_remove_path(afc, source_filename);
-
-				res = 0;
 			}
-		}
-
-		/* free file information */
-		afc_dictionary_free(fileinfo);
-
-		/* recurse into child directories */
-		if (S_ISDIR(stbuf.st_mode)) {
+			afc_file_info_free(info);
+		} else if (entry->type == AFC_FILE_TYPE_DIRECTORY) {
 #ifdef WIN32
 			mkdir(target_filename);
 #else
 			mkdir(target_filename, 0755);
 #endif
-			res = afc_client_copy_and_remove_crash_reports(afc, source_filename, target_filename);
-
-			/* remove directory from device */
-			if (!keep_crash_reports)
-				afc_remove_path(afc, source_filename);
-		} else if (S_ISREG(stbuf.st_mode)) {
-			/* copy file to host */
-			afc_error = afc_file_open(afc, source_filename, AFC_FOPEN_RDONLY, &handle);
-			if(afc_error != AFC_E_SUCCESS) {
-				if (afc_error == AFC_E_OBJECT_NOT_FOUND) {
-					continue;
-				}
-				fprintf(stderr, "Unable to open device file '%s' (%d). Skipping...\n", source_filename, afc_error);
-				continue;
-			}
+			collect_crash_reports(afc, queue, source_filename, target_filename);
 
-			FILE* output = fopen(target_filename, "wb");
-			if(output == NULL) {
-				fprintf(stderr, "Unable to open local file '%s'. Skipping...\n", target_filename);
-				afc_file_close(afc, handle);
-				continue;
+			/* the directory is removed from the device once its contents were moved */
+			if (!keep_crash_reports) {
+				queue->directories = (char**)realloc(queue->directories, (queue->directory_count + 1) * sizeof(char*));
+				queue->directories[queue->directory_count++] = strdup(source_filename);
 			}
+		} else if (entry->type == AFC_FILE_TYPE_REGULAR) {
+			if (since_ns > 0 && entry->mtime < since_ns) {
+				/* older than the requested date */
+			} else if (manifest_contains(source_filename, entry->size, entry->mtime)) {
+				/* pulled by an earlier run */
+			} else {
+				crash_report_queue_add_job(queue, source_filename, target_filename, entry->size, entry->mtime);
+			}
+		} else if (entry->type == AFC_FILE_TYPE_UNKNOWN) {
+			printf("Failed to read information for '%s'. Skipping...\n", source_filename);
+		}
 
-			printf("%s: %s\n", (keep_crash_reports ? "Copy": "Move") , (char*)target_filename + strlen(target_directory));
+		free(source_filename);
+		free(target_filename);
+	}
+	afc_dir_entries_free(entries);
 
-			uint32_t bytes_read = 0;
-			uint32_t bytes_total = 0;
-			unsigned char data[0x1000];
+	return 0;
+}
 
-			afc_error = afc_file_read(afc, handle, (char*)data, 0x1000, &bytes_read);
-			while(afc_error == AFC_E_SUCCESS && bytes_read > 0) {
-				fwrite(data, 1, bytes_read, output);
-				bytes_total += bytes_read;
-				afc_error = afc_file_read(afc, handle, (char*)data, 0x1000, &bytes_read);
-			}
-			afc_file_close(afc, handle);
-			fclose(output);
+static void* crash_report_worker(void *arg)
+{
+	struct crash_report_queue *queue = (struct crash_report_queue*)arg;
+	afc_client_t afc = NULL;
 
-			if ((uint32_t)stbuf.st_size != bytes_total) {
-				fprintf(stderr, "File size mismatch. Skipping...\n");
-				continue;
-			}
+	if (afc_pool_acquire(queue->pool, &afc) != AFC_E_SUCCESS) {
+		return NULL;
+	}
 
-			/* remove file from device */
-			if (!keep_crash_reports) {
-				afc_remove_path(afc, source_filename);
-			}
+	while (1) {
+		mutex_lock(&queue->mutex);
+		uint32_t i = queue->next++;
+		mutex_unlock(&queue->mutex);
+		if (i >= queue->count) {
+			break;
+		}
+		struct crash_report_job *job = &queue->jobs[i];
+
+		/* large pipelined reads straight into the local file */
+		afc_error_t afc_error;
+		const char *ext = strrchr(job->target, '.');
+		int extract = (extract_raw_crash_reports && ext && !strcmp(ext, ".plist"));
+		if (extract) {
+			afc_error = download_and_extract_crash_report(afc, job->source, job->target);
+		} else {
+			afc_error = afc_download_file(afc, job->source, job->target, 0, NULL, NULL);
+		}
+		if (afc_error == AFC_E_OBJECT_NOT_FOUND) {
+			continue;
+		}
 
-			/* extract raw crash information into separate '.crash' file */
-			if (extract_raw_crash_reports) {
-				extract_raw_crash_report(target_filename);
-			}
+		struct stat st;
+		int ok = (afc_error == AFC_E_SUCCESS && stat(job->target, &st) == 0 && (uint64_t)st.st_size == job->size);
+
+		mutex_lock(&queue->mutex);
+		if (afc_error != AFC_E_SUCCESS) {
+			fprintf(stderr, "Unable to copy device file '%s' (%d). Skipping...\n", job->source, afc_error);
+			queue->failed++;
+		} else if (!ok) {
+			fprintf(stderr, "File size mismatch. Skipping...\n");
+			queue->failed++;
+		} else {
+			printf("%s: %s\n", (keep_crash_reports ? "Copy": "Move"), job->target + strlen(target_directory));
+			manifest_add(job->source, job->size, job->mtime);
+			queue->copied++;
+		}
+		mutex_unlock(&queue->mutex);
+
+		if (!ok) {
+			continue;
+		}
+
+		/* remove file from device */
+		if (!keep_crash_reports) {
+			afc_remove_path(afc, job->source);
+		}
+	}
+
+	afc_pool_release(queue->pool, afc);
+
+	return NULL;
+}
 
-			crash_report_count++;
+static int afc_client_copy_and_remove_crash_reports(afc_pool_t pool, const char* device_directory, const char* host_directory)
+{
+	struct crash_report_queue queue;
+	afc_client_t afc = NULL;
+	uint32_t i;
+	int res;
+
+	memset(&queue, '\0', sizeof(queue));
+	queue.pool = pool;
+
+	if (afc_pool_acquire(pool, &afc) != AFC_E_SUCCESS) {
+		return -1;
+	}
+	res = collect_crash_reports(afc, &queue, device_directory, host_directory);
+	afc_pool_release(pool, afc);
+
+	if (res == 0 && queue.count > 0) {
+		uint32_t num_workers = (queue.count < COPY_WORKERS) ? queue.count : COPY_WORKERS;
+		THREAD_T workers[COPY_WORKERS];
+		uint32_t started = 0;
+		mutex_init(&queue.mutex);
+		for (i = 0; i < num_workers; i++) {
+			if (thread_new(&workers[started], crash_report_worker, &queue) != 0) {
+				break;
+			}
+			started++;
+		}
+		if (started == 0) {
+			crash_report_worker(&queue);
+		}
+		for (i = 0; i < started; i++) {
+			thread_join(workers[i]);
+			thread_free(workers[i]);
+		}
+		mutex_destroy(&queue.mutex);
+	}
 
-			res = 0;
+	/* remove the emptied directories, innermost first */
+	if (queue.directory_count > 0 && afc_pool_acquire(pool, &afc) == AFC_E_SUCCESS) {
+		for (i = queue.directory_count; i > 0; i--) {
+			afc_remove_path(afc, queue.directories[i-1]);
 		}
+		afc_pool_release(pool, afc);
 	}
-	afc_dictionary_free(list);
+	for (i = 0; i < queue.directory_count; i++) {
+		free(queue.directories[i]);
+	}
+	free(queue.directories);
+
+	for (i = 0; i < queue.count; i++) {
+		free(queue.jobs[i].source);
+		free(queue.jobs[i].target);
+	}
+	free(queue.jobs);
 
-	/* no reports, no error */
-	if (crash_report_count == 0)
-		res = 0;
+	/* copying no reports is no error, but failing all of them is */
+	if (res == 0 && queue.failed > 0 && queue.copied == 0) {
+		res = -1;
+	}
 
 	return res;
 }
 
+/**
+ * Parses a date given as YYYY-MM-DD[THH:MM[:SS]] in local time.
+ *
+ * @return the date in nanoseconds since the epoch, or 0 if invalid.
+ */
+static uint64_t parse_since_date(const char *str)
+{
+	struct tm tm;
+	memset(&tm, '\0', sizeof(tm));
+	int n = sscanf(str, "%d-%d-%d%*1[T ]%d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	if (n != 3 && n < 5) {
+		return 0;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_isdst = -1;
+	time_t t = mktime(&tm);
+	if (t == (time_t)-1 || t < 0) {
+		return 0;
+	}
+	return (uint64_t)t * 1000000000ULL;
+}
+
 static void print_usage(int argc, char **argv)
 {
 	char *name = NULL;
@@ -312,6 +665,9 @@ static void print_usage(int argc, char **argv)
 	printf("  -n, --network\t\tconnect to network device\n");
 	printf("  -e, --extract\t\textract raw crash report into separate '.crash' file\n");
 	printf("  -k, --keep\t\tcopy but do not remove crash reports from device\n");
+	printf("  -i, --incremental\tskip crash reports that were copied by an earlier run\n");
+	printf("  -s, --since DATE\tonly copy crash reports modified since DATE,\n");
+	printf("            \t\tgiven as YYYY-MM-DD[THH:MM[:SS]] in local time\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -324,7 +680,6 @@ int main(int argc, char* argv[])
 {
 	idevice_t device = NULL;
 	lockdownd_client_t lockdownd = NULL;
-	afc_client_t afc = NULL;
 
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 	lockdownd_error_t lockdownd_error = LOCKDOWN_E_SUCCESS;
@@ -333,6 +688,8 @@ int main(int argc, char* argv[])
 	int i;
 	const char* udid = NULL;
 	int use_network = 0;
+	int incremental = 0;
+	char *manifest_path = NULL;
 
 #ifndef WIN32
 	signal(SIGPIPE, SIG_IGN);
@@ -372,6 +729,18 @@ int main(int argc, char* argv[])
 			keep_crash_reports = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--incremental")) {
+			incremental = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--since")) {
+			i++;
+			if (!argv[i] || (since_ns = parse_since_date(argv[i])) == 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
 		else if (target_directory == NULL) {
 			target_directory = argv[i];
 			continue;
@@ -457,38 +826,41 @@ int main(int argc, char* argv[])
 		return -1;
 	}
 
-	lockdownd_error = lockdownd_start_service(lockdownd, "com.apple.crashreportcopymobile", &service);
-	if (lockdownd_error != LOCKDOWN_E_SUCCESS) {
-		lockdownd_client_free(lockdownd);
-		idevice_free(device);
-		return -1;
-	}
 	lockdownd_client_free(lockdownd);
 
-	afc = NULL;
-	afc_error = afc_client_new(device, service, &afc);
-	if(afc_error != AFC_E_SUCCESS) {
-		lockdownd_client_free(lockdownd);
+	afc_pool_t pool = NULL;
+	afc_error = afc_pool_new(device, "com.apple.crashreportcopymobile", COPY_WORKERS, TOOL_NAME, &pool);
+	if (afc_error != AFC_E_SUCCESS) {
 		idevice_free(device);
 		return -1;
 	}
 
-	if (service) {
-		lockdownd_service_descriptor_free(service);
-		service = NULL;
+	if (incremental) {
+		manifest_path = string_build_path(target_directory, MANIFEST_FILENAME, NULL);
+		if (!plist_read_from_filename(&manifest, manifest_path) || plist_get_node_type(manifest) != PLIST_DICT) {
+			plist_free(manifest);
+			manifest = plist_new_dict();
+		}
 	}
 
 	/* recursively copy crash reports from the device to a local directory */
-	if (afc_client_copy_and_remove_crash_reports(afc, ".", target_directory) < 0) {
+	int res = afc_client_copy_and_remove_crash_reports(pool, ".", target_directory);
+	afc_pool_free(pool);
+
+	if (manifest) {
+		plist_write_to_filename(manifest, manifest_path, PLIST_FORMAT_XML);
+		plist_free(manifest);
+		free(manifest_path);
+	}
+
+	if (res < 0) {
 		fprintf(stderr, "ERROR: Failed to get crash reports from device.\n");
-		afc_client_free(afc);
 		idevice_free(device);
 		return -1;
 	}
 
 	printf("Done.\n");
 
-	afc_client_free(afc);
 	idevice_free(device);
 
 	return 0;
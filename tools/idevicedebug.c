@@ -183,6 +183,24 @@ static debugserver_error_t debugserver_client_handle_response(debugserver_client
 	return dres;
 }
 
+/* handles the first response of a batch that is not OK and frees all responses */
+static int debugserver_client_check_responses(debugserver_client_t client, char** responses, int count, int checked)
+{
+	int res = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (res == 0 && i < checked && responses[i] && strncmp(responses[i], "OK", 2)) {
+			debugserver_client_handle_response(client, &responses[i], 0);
+			res = -1;
+		}
+		free(responses[i]);
+		responses[i] = NULL;
+	}
+
+	return res;
+}
+
 static void print_usage(int argc, char **argv)
 {
 	char *name = NULL;
@@ -361,65 +379,68 @@ int main(int argc, char *argv[])
 				goto cleanup;
 			}
 
+			/* disable ACKs early, this halves the number of messages */
+			log_debug("Enabling no-ack mode...");
+			debugserver_command_new("QStartNoAckMode", 0, NULL, &command);
+			dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
+			debugserver_command_free(command);
+			command = NULL;
+			if (!response || strncmp(response, "OK", 2)) {
+				/* not supported by the server, stay in ack mode */
+				log_debug("no-ack mode not supported");
+				debugserver_client_set_ack_mode(debugserver_client, 1);
+			}
+			free(response);
+			response = NULL;
+
+			/* the launch settings do not depend on each other, send them in one batch */
+			int setup_count = 0;
+			int setup_checked = 0;
+			debugserver_command_t* setup_commands = (debugserver_command_t*)malloc(sizeof(debugserver_command_t) * (environment_count + 3));
+			char** setup_responses = (char**)malloc(sizeof(char*) * (environment_count + 3));
+
 			/* enable logging for the session in debug mode */
 			if (debug_level) {
 				log_debug("Setting logging bitmask...");
-				debugserver_command_new("QSetLogging:bitmask=LOG_ALL|LOG_RNB_REMOTE|LOG_RNB_PACKETS", 0, NULL, &command);
-				dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
-				debugserver_command_free(command);
-				command = NULL;
-				if (response) {
-					if (strncmp(response, "OK", 2)) {
-						debugserver_client_handle_response(debugserver_client, &response, 0);
-						goto cleanup;
-					}
-					free(response);
-					response = NULL;
-				}
+				debugserver_command_new("QSetLogging:bitmask=LOG_ALL|LOG_RNB_REMOTE|LOG_RNB_PACKETS", 0, NULL, &setup_commands[setup_count++]);
 			}
 
 			/* set maximum packet size */
 			log_debug("Setting maximum packet size...");
 			char* packet_size[2] = {strdup("1024"), NULL};
-			debugserver_command_new("QSetMaxPacketSize:", 1, packet_size, &command);
+			debugserver_command_new("QSetMaxPacketSize:", 1, packet_size, &setup_commands[setup_count++]);
 			free(packet_size[0]);
-			dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
-			debugserver_command_free(command);
-			command = NULL;
-			if (response) {
-				if (strncmp(response, "OK", 2)) {
-					debugserver_client_handle_response(debugserver_client, &response, 0);
-					goto cleanup;
-				}
-				free(response);
-				response = NULL;
-			}
 
 			/* set working directory */
 			log_debug("Setting working directory...");
 			char* working_dir[2] = {working_directory, NULL};
-			debugserver_command_new("QSetWorkingDir:", 1, working_dir, &command);
-			dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
-			debugserver_command_free(command);
-			command = NULL;
-			if (response) {
-				if (strncmp(response, "OK", 2)) {
-					debugserver_client_handle_response(debugserver_client, &response, 0);
-					goto cleanup;
-				}
-				free(response);
-				response = NULL;
-			}
+			debugserver_command_new("QSetWorkingDir:", 1, working_dir, &setup_commands[setup_count++]);
+
+			/* responses to the environment are not checked */
+			setup_checked = setup_count;
 
 			/* set environment */
 			if (environment) {
 				log_debug("Setting environment...");
 				for (environment_index = 0; environment_index < environment_count; environment_index++) {
 					log_debug("setting environment variable: %s", environment[environment_index]);
-					debugserver_client_set_environment_hex_encoded(debugserver_client, environment[environment_index], NULL);
+					char* env_arg[2] = {environment[environment_index], NULL};
+					debugserver_command_new("QEnvironmentHexEncoded:", 1, env_arg, &setup_commands[setup_count++]);
 				}
 			}
 
+			dres = debugserver_client_send_commands(debugserver_client, setup_commands, setup_count, setup_responses);
+			for (environment_index = 0; environment_index < setup_count; environment_index++) {
+				debugserver_command_free(setup_commands[environment_index]);
+			}
+			free(setup_commands);
+			int setup_failed = debugserver_client_check_responses(debugserver_client, setup_responses, setup_count, setup_checked);
+			free(setup_responses);
+			if (dres != DEBUGSERVER_E_SUCCESS || setup_failed) {
+				fprintf(stderr, "Could not set up launch parameters, error %d\n", dres);
+				goto cleanup;
+			}
+
 			/* set arguments and run app */
 			log_debug("Setting argv...");
 			i++; /* i is the offset of the bundle identifier, thus skip it */
@@ -437,19 +458,21 @@ int main(int argc, char *argv[])
 			debugserver_client_set_argv(debugserver_client, app_argc, app_argv, NULL);
 			free(app_argv);
 
-			/* check if launch succeeded */
+			/* check if launch succeeded, selecting the thread does not need to wait for it */
 			log_debug("Checking if launch succeeded...");
-			debugserver_command_new("qLaunchSuccess", 0, NULL, &command);
-			dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
-			debugserver_command_free(command);
-			command = NULL;
-			if (response) {
-				if (strncmp(response, "OK", 2)) {
-					debugserver_client_handle_response(debugserver_client, &response, 0);
-					goto cleanup;
-				}
-				free(response);
-				response = NULL;
+			debugserver_command_t launch_commands[2] = { NULL, NULL };
+			char* launch_responses[2] = { NULL, NULL };
+			int launch_count = 1;
+			debugserver_command_new("qLaunchSuccess", 0, NULL, &launch_commands[0]);
+			if (!detach_after_start) {
+				log_debug("Setting thread...");
+				debugserver_command_new("Hc0", 0, NULL, &launch_commands[launch_count++]);
+			}
+			dres = debugserver_client_send_commands(debugserver_client, launch_commands, launch_count, launch_responses);
+			debugserver_command_free(launch_commands[0]);
+			debugserver_command_free(launch_commands[1]);
+			if (debugserver_client_check_responses(debugserver_client, launch_responses, launch_count, launch_count)) {
+				goto cleanup;
 			}
 
 			if (detach_after_start) {
@@ -463,21 +486,6 @@ int main(int argc, char *argv[])
 				break;
 			}
 
-			/* set thread */
-			log_debug("Setting thread...");
-			debugserver_command_new("Hc0", 0, NULL, &command);
-			dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
-			debugserver_command_free(command);
-			command = NULL;
-			if (response) {
-				if (strncmp(response, "OK", 2)) {
-					debugserver_client_handle_response(debugserver_client, &response, 0);
-					goto cleanup;
-				}
-				free(response);
-				response = NULL;
-			}
-
 			/* continue running process */
 			log_debug("Continue running process...");
 			debugserver_command_new("c", 0, NULL, &command);
@@ -30,34 +30,57 @@
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#ifdef WIN32
+#include <winsock2.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/debugserver.h>
 
 #include "common/socket.h"
-#include "common/thread.h"
 
 #define info(...) fprintf(stdout, __VA_ARGS__); fflush(stdout)
 #define debug(...) if(debug_mode) fprintf(stdout, __VA_ARGS__)
 
+#define PROXY_BUFFER_SIZE 65536
+#define PROXY_POLL_TIMEOUT_MS 1000
+
 static int debug_mode = 0;
 static int quit_flag = 0;
 
-typedef struct {
-	int client_fd;
+/* a local port whose clients are connected to debugserver on one device */
+struct proxy_listener {
+	int server_fd;
+	uint16_t port;
+	char *udid;
 	idevice_t device;
-	debugserver_client_t debugserver_client;
-	volatile int stop_ctod;
-	volatile int stop_dtoc;
-} socket_info_t;
-
-struct thread_info {
-	THREAD_T th;
-	struct thread_info *next;
+	struct proxy_listener *next;
 };
 
-typedef struct thread_info thread_info_t;
+/* data read from one side that has not been written to the other side yet */
+struct proxy_buffer {
+	char data[PROXY_BUFFER_SIZE];
+	uint32_t offset;
+	uint32_t length;
+};
 
+struct proxy_session {
+	unsigned int id;
+	int client_fd;
+	int device_fd;
+	debugserver_client_t debugserver_client;
+	idevice_connection_t connection;
+	struct proxy_listener *listener;
+	struct proxy_buffer to_device;
+	struct proxy_buffer to_client;
+	uint64_t bytes_to_device;
+	uint64_t bytes_to_client;
+	int closing;
+	struct proxy_session *next;
+};
 
 static void clean_exit(int sig)
 {
@@ -70,12 +93,16 @@ static void print_usage(int argc, char **argv)
 	char *name = NULL;
 
 	name = strrchr(argv[0], '/');
-	printf("Usage: %s [OPTIONS] <PORT>\n", (name ? name + 1: argv[0]));
+	printf("Usage: %s [OPTIONS] [<PORT>]\n", (name ? name + 1: argv[0]));
 	printf("\n");
 	printf("Proxy debugserver connection from device to a local socket at PORT.\n");
+	printf("Any number of clients can connect at the same time, each of them gets\n");
+	printf("its own debugserver connection.\n");
 	printf("\n");
 	printf("OPTIONS:\n");
 	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
+	printf("  -m, --map UDID:PORT\talso proxy device UDID at local PORT, can be given\n");
+	printf("                   \tmultiple times\n");
 	printf("  -n, --network\t\tconnect to network device\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
@@ -85,175 +112,172 @@ static void print_usage(int argc, char **argv)
 	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
 }
 
-static void *thread_device_to_client(void *data)
+static struct proxy_listener* listener_add(struct proxy_listener **list, const char *udid, uint16_t port)
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
-
-	int recv_len;
-	int sent;
-	char buffer[131072];
-
-	debug("%s: started thread...\n", __func__);
-
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
-
-	while (!quit_flag && !socket_info->stop_dtoc && socket_info->client_fd > 0) {
-		debug("%s: receiving data from device...\n", __func__);
-
-		res = debugserver_client_receive_with_timeout(socket_info->debugserver_client, buffer, sizeof(buffer), (uint32_t*)&recv_len, 5000);
-
-		if (recv_len <= 0) {
-			if (recv_len == 0 && res == DEBUGSERVER_E_SUCCESS) {
-				// try again
-				continue;
-			} else {
-				fprintf(stderr, "recv failed: %s\n", strerror(errno));
-				break;
-			}
-		} else {
-			/* send to device */
-			debug("%s: sending data to client...\n", __func__);
-			sent = socket_send(socket_info->client_fd, buffer, recv_len);
-			if (sent < recv_len) {
-				if (sent <= 0) {
-					fprintf(stderr, "send failed: %s\n", strerror(errno));
-					break;
-				} else {
-					fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
-				}
-			} else {
-				// sending succeeded, receive from device
-				debug("%s: pushed %d bytes to client\n", __func__, sent);
-			}
-		}
+	struct proxy_listener *l = (struct proxy_listener*)malloc(sizeof(struct proxy_listener));
+	if (!l) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
 	}
+	l->server_fd = -1;
+	l->port = port;
+	l->udid = (udid) ? strdup(udid) : NULL;
+	l->device = NULL;
+	l->next = NULL;
+
+	/* keep the order of the command line */
+	while (*list) {
+		list = &(*list)->next;
+	}
+	*list = l;
 
-	debug("%s: shutting down...\n", __func__);
-
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+	return l;
+}
 
-	socket_info->client_fd = -1;
-	socket_info->stop_ctod = 1;
+static void session_free(struct proxy_session *session)
+{
+	info("Session %u closed: %llu bytes to device, %llu bytes to client\n", session->id, (unsigned long long)session->bytes_to_device, (unsigned long long)session->bytes_to_client);
 
-	return NULL;
+	if (session->debugserver_client) {
+		debugserver_client_free(session->debugserver_client);
+	}
+	if (session->client_fd >= 0) {
+		socket_shutdown(session->client_fd, SHUT_RDWR);
+		socket_close(session->client_fd);
+	}
+	free(session);
 }
 
-static void *thread_client_to_device(void *data)
+static struct proxy_session* session_new(struct proxy_listener *listener, int client_fd, unsigned int id)
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
+	struct proxy_session *session = (struct proxy_session*)malloc(sizeof(struct proxy_session));
+	if (!session) {
+		socket_close(client_fd);
+		return NULL;
+	}
+	memset(session, '\0', sizeof(struct proxy_session));
+	session->id = id;
+	session->client_fd = client_fd;
+	session->device_fd = -1;
+	session->listener = listener;
 
-	int recv_len;
-	int sent;
-	char buffer[131072];
-	THREAD_T dtoc;
+	debugserver_error_t derr = debugserver_client_start_service(listener->device, &session->debugserver_client, TOOL_NAME);
+	if (derr != DEBUGSERVER_E_SUCCESS) {
+		fprintf(stderr, "Could not start debugserver on device!\nPlease make sure to mount a developer disk image first.\n");
+		session_free(session);
+		return NULL;
+	}
+	if (debugserver_client_get_connection(session->debugserver_client, &session->connection) != DEBUGSERVER_E_SUCCESS
+	    || idevice_connection_get_fd(session->connection, &session->device_fd) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "Could not get debugserver connection\n");
+		session_free(session);
+		return NULL;
+	}
+	socket_set_nonblocking(client_fd, 1);
+	socket_set_nodelay(client_fd, 1);
 
-	debug("%s: started thread...\n", __func__);
+	info("Session %u started on port %d\n", session->id, listener->port);
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
+	return session;
+}
 
-	/* spawn server to client thread */
-	socket_info->stop_dtoc = 0;
-	if (thread_new(&dtoc, thread_device_to_client, data) != 0) {
-		fprintf(stderr, "Failed to start device to client thread...\n");
+/* returns non-zero if decrypted device data is waiting that poll() does not know about */
+static int session_has_pending_device_data(struct proxy_session *session)
+{
+	uint32_t pending = 0;
+	if (session->to_client.length > 0) {
+		return 0;
 	}
+	idevice_connection_get_pending_bytes(session->connection, &pending);
+	return (pending > 0);
+}
 
-	while (!quit_flag && !socket_info->stop_ctod && socket_info->client_fd > 0) {
-		debug("%s: receiving data from client...\n", __func__);
-
-		/* attempt to read incoming data from client */
-		recv_len = socket_receive_timeout(socket_info->client_fd, buffer, sizeof(buffer), 0, 5000);
-
-		/* any data received? */
-		if (recv_len <= 0) {
-			if (recv_len == 0) {
-				/* try again */
-				continue;
-			} else {
-				fprintf(stderr, "Receive failed: %s\n", strerror(errno));
-				break;
-			}
-		} else {
-			/* forward data to device */
-			debug("%s: sending data to device...\n", __func__);
-			res = debugserver_client_send(socket_info->debugserver_client, buffer, recv_len, (uint32_t*)&sent);
-
-			if (sent < recv_len || res != DEBUGSERVER_E_SUCCESS) {
-				if (sent <= 0) {
-					fprintf(stderr, "send failed: %s\n", strerror(errno));
-					break;
-				} else {
-					fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
-				}
-			} else {
-				// sending succeeded, receive from device
-				debug("%s: sent %d bytes to device\n", __func__, sent);
+static void session_flush_to_client(struct proxy_session *session)
+{
+	struct proxy_buffer *buf = &session->to_client;
+	while (buf->length > 0) {
+		int r = socket_send(session->client_fd, buf->data + buf->offset, buf->length);
+		if (r <= 0) {
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				return;
 			}
+			session->closing = 1;
+			return;
 		}
+		buf->offset += r;
+		buf->length -= r;
+		session->bytes_to_client += r;
 	}
-
-	debug("%s: shutting down...\n", __func__);
-
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
-
-	socket_info->client_fd = -1;
-	socket_info->stop_dtoc = 1;
-
-	/* join other thread to allow it to stop */
-	thread_join(dtoc);
-	thread_free(dtoc);
-
-	return NULL;
+	buf->offset = 0;
 }
 
-static void* connection_handler(void* data)
+static void session_flush_to_device(struct proxy_session *session)
 {
-	debugserver_error_t derr = DEBUGSERVER_E_SUCCESS;
-	socket_info_t* socket_info = (socket_info_t*)data;
-	THREAD_T ctod;
-
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
-
-	derr = debugserver_client_start_service(socket_info->device, &socket_info->debugserver_client, TOOL_NAME);
-	if (derr != DEBUGSERVER_E_SUCCESS) {
-		fprintf(stderr, "Could not start debugserver on device!\nPlease make sure to mount a developer disk image first.\n");
-		return NULL;
+	struct proxy_buffer *buf = &session->to_device;
+	if (buf->length == 0) {
+		return;
 	}
-
-	/* spawn client to device thread */
-	socket_info->stop_ctod = 0;
-	if (thread_new(&ctod, thread_client_to_device, data) != 0) {
-		fprintf(stderr, "Failed to start client to device thread...\n");
+	/* only called once the device socket is writable, so this does not block for long */
+	uint32_t sent = 0;
+	if (idevice_connection_send(session->connection, buf->data + buf->offset, buf->length, &sent) != IDEVICE_E_SUCCESS || sent == 0) {
+		session->closing = 1;
+		return;
 	}
+	buf->offset += sent;
+	buf->length -= sent;
+	session->bytes_to_device += sent;
+	if (buf->length == 0) {
+		buf->offset = 0;
+	}
+}
 
-	/* join the fun */
-	thread_join(ctod);
-	thread_free(ctod);
-
-	debug("%s: shutting down...\n", __func__);
-
-	debugserver_client_free(socket_info->debugserver_client);
-	socket_info->debugserver_client = NULL;
-
-	/* shutdown client socket */
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+static void session_read_client(struct proxy_session *session)
+{
+	struct proxy_buffer *buf = &session->to_device;
+	int r = recv(session->client_fd, buf->data, PROXY_BUFFER_SIZE, 0);
+	if (r <= 0) {
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			return;
+		}
+		debug("Session %u: client closed the connection\n", session->id);
+		session->closing = 1;
+		return;
+	}
+	buf->offset = 0;
+	buf->length = (uint32_t)r;
+	session_flush_to_device(session);
+}
 
-	return NULL;
+static void session_read_device(struct proxy_session *session)
+{
+	struct proxy_buffer *buf = &session->to_client;
+	uint32_t recv_bytes = 0;
+	idevice_error_t err = idevice_connection_try_receive(session->connection, buf->data, PROXY_BUFFER_SIZE, &recv_bytes);
+	if (err == IDEVICE_E_WOULD_BLOCK) {
+		return;
+	}
+	if (err != IDEVICE_E_SUCCESS) {
+		debug("Session %u: device closed the connection (%d)\n", session->id, err);
+		session->closing = 1;
+		return;
+	}
+	buf->offset = 0;
+	buf->length = recv_bytes;
+	session_flush_to_client(session);
 }
 
 int main(int argc, char *argv[])
 {
-	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
-	idevice_t device = NULL;
-	thread_info_t *thread_list = NULL;
+	struct proxy_listener *listeners = NULL;
+	struct proxy_listener *l;
+	struct proxy_session *sessions = NULL;
+	struct pollfd *fds = NULL;
+	unsigned int fds_size = 0;
+	unsigned int session_count = 0;
+	unsigned int next_session_id = 1;
 	const char* udid = NULL;
 	int use_network = 0;
 	uint16_t local_port = 0;
-	int server_fd;
 	int result = EXIT_SUCCESS;
 	int i;
 
@@ -296,6 +320,17 @@ int main(int argc, char *argv[])
 			udid = argv[i];
 			continue;
 		}
+		else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--map")) {
+			i++;
+			char *sep = (argv[i]) ? strrchr(argv[i], ':') : NULL;
+			if (!sep || sep == argv[i] || atoi(sep + 1) <= 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			*sep = '\0';
+			listener_add(&listeners, argv[i], (uint16_t)atoi(sep + 1));
+			continue;
+		}
 		else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--network")) {
 			use_network = 1;
 			continue;
@@ -318,87 +353,167 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (local_port) {
+		listener_add(&listeners, udid, local_port);
+	}
+
 	/* a PORT is mandatory */
-	if (!local_port) {
+	if (!listeners) {
 		fprintf(stderr, "Please specify a PORT.\n");
 		print_usage(argc, argv);
 		goto leave_cleanup;
 	}
 
-	/* start services and connect to device */
-	ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
-	if (ret != IDEVICE_E_SUCCESS) {
-		if (udid) {
-			fprintf(stderr, "No device found with udid %s.\n", udid);
-		} else {
-			fprintf(stderr, "No device found.\n");
+	/* connect to the devices and create the local sockets */
+	for (l = listeners; l; l = l->next) {
+		idevice_error_t ret = idevice_new_with_options(&l->device, l->udid, (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
+		if (ret != IDEVICE_E_SUCCESS) {
+			if (l->udid) {
+				fprintf(stderr, "No device found with udid %s.\n", l->udid);
+			} else {
+				fprintf(stderr, "No device found.\n");
+			}
+			result = EXIT_FAILURE;
+			goto leave_cleanup;
 		}
-		result = EXIT_FAILURE;
-		goto leave_cleanup;
-	}
 
-	/* create local socket */
-	server_fd = socket_create(local_port);
-	if (server_fd < 0) {
-		fprintf(stderr, "Could not create socket\n");
-		result = EXIT_FAILURE;
-		goto leave_cleanup;
+		l->server_fd = socket_create(l->port);
+		if (l->server_fd < 0) {
+			fprintf(stderr, "Could not create socket on port %d\n", l->port);
+			result = EXIT_FAILURE;
+			goto leave_cleanup;
+		}
+		debug("%s: Waiting for connections on local port %d\n", __func__, l->port);
 	}
 
+	/* a single loop serves all listeners and sessions */
 	while (!quit_flag) {
-		debug("%s: Waiting for connection on local port %d\n", __func__, local_port);
+		unsigned int listener_count = 0;
+		unsigned int nfds = 0;
+		int timeout = PROXY_POLL_TIMEOUT_MS;
+		struct proxy_session *s;
 
-		/* wait for client */
-		int client_fd = socket_accept(server_fd, local_port);
-		if (client_fd < 0) {
-			continue;
+		for (l = listeners; l; l = l->next) {
+			listener_count++;
+		}
+		if (listener_count + (session_count * 2) > fds_size) {
+			fds_size = listener_count + (session_count * 2) + 64;
+			struct pollfd *newfds = (struct pollfd*)realloc(fds, sizeof(struct pollfd) * fds_size);
+			if (!newfds) {
+				fprintf(stderr, "Out of memory\n");
+				result = EXIT_FAILURE;
+				break;
+			}
+			fds = newfds;
 		}
 
-		debug("%s: Handling new client connection...\n", __func__);
+		for (l = listeners; l; l = l->next) {
+			fds[nfds].fd = l->server_fd;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+		for (s = sessions; s; s = s->next) {
+			/* read from a side only once everything it sent before has been forwarded */
+			fds[nfds].fd = s->client_fd;
+			fds[nfds].events = ((s->to_device.length == 0) ? POLLIN : 0) | ((s->to_client.length > 0) ? POLLOUT : 0);
+			fds[nfds].revents = 0;
+			nfds++;
+			fds[nfds].fd = s->device_fd;
+			fds[nfds].events = ((s->to_client.length == 0) ? POLLIN : 0) | ((s->to_device.length > 0) ? POLLOUT : 0);
+			fds[nfds].revents = 0;
+			nfds++;
+			if (session_has_pending_device_data(s)) {
+				timeout = 0;
+			}
+		}
 
-		thread_info_t *el = (thread_info_t*)malloc(sizeof(thread_info_t));
-		if (!el) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
+		int ready = poll(fds, nfds, timeout);
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			result = EXIT_FAILURE;
+			break;
 		}
-		el->next = NULL;
 
-		if (thread_list) {
-			thread_list->next = el;
-		} else {
-			thread_list = el;
+		/* serve existing sessions first, their entries follow the listeners */
+		nfds = listener_count;
+		for (s = sessions; s; s = s->next) {
+			short crev = fds[nfds].revents;
+			short drev = fds[nfds + 1].revents;
+			nfds += 2;
+
+			if ((drev & POLLOUT) && !s->closing) {
+				session_flush_to_device(s);
+			}
+			if ((crev & POLLOUT) && !s->closing) {
+				session_flush_to_client(s);
+			}
+			if ((crev & (POLLIN | POLLHUP | POLLERR)) && s->to_device.length == 0 && !s->closing) {
+				session_read_client(s);
+			}
+			if (((drev & (POLLIN | POLLHUP | POLLERR)) || session_has_pending_device_data(s)) && s->to_client.length == 0 && !s->closing) {
+				session_read_device(s);
+			}
 		}
 
-		socket_info_t *sinfo = (socket_info_t*)malloc(sizeof(socket_info_t));
-		if (!sinfo) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
+		/* drop finished sessions */
+		struct proxy_session **sp = &sessions;
+		while (*sp) {
+			if ((*sp)->closing) {
+				struct proxy_session *done = *sp;
+				*sp = done->next;
+				session_free(done);
+				session_count--;
+			} else {
+				sp = &(*sp)->next;
+			}
 		}
-		sinfo->client_fd = client_fd;
-		sinfo->device = device;
 
-		if (thread_new(&(el->th), connection_handler, (void*)sinfo) != 0) {
-			fprintf(stderr, "Could not start connection handler.\n");
-			socket_shutdown(server_fd, SHUT_RDWR);
-			socket_close(server_fd);
-			break;
+		/* accept new clients */
+		nfds = 0;
+		for (l = listeners; l; l = l->next, nfds++) {
+			if (!(fds[nfds].revents & POLLIN)) {
+				continue;
+			}
+			int client_fd = socket_accept(l->server_fd, l->port);
+			if (client_fd < 0) {
+				continue;
+			}
+			debug("%s: Handling new client connection on port %d...\n", __func__, l->port);
+			struct proxy_session *session = session_new(l, client_fd, next_session_id++);
+			if (session) {
+				session->next = sessions;
+				sessions = session;
+				session_count++;
+			}
 		}
 	}
 
 	debug("%s: Shutting down debugserver proxy...\n", __func__);
 
-	/* join and clean up threads */
-	while (thread_list) {
-		thread_info_t *el = thread_list;
-		thread_join(el->th);
-		thread_free(el->th);
-		thread_list = el->next;
-		free(el);
+	while (sessions) {
+		struct proxy_session *s = sessions;
+		sessions = s->next;
+		session_free(s);
 	}
+	free(fds);
 
 leave_cleanup:
-	if (device) {
-		idevice_free(device);
+	while (listeners) {
+		l = listeners;
+		listeners = l->next;
+		if (l->server_fd >= 0) {
+			socket_shutdown(l->server_fd, SHUT_RDWR);
+			socket_close(l->server_fd);
+		}
+		if (l->device) {
+			idevice_free(l->device);
+		}
+		free(l->udid);
+		free(l);
 	}
 
 	return result;
@@ -30,13 +30,15 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
-#ifndef WIN32
+#include <unistd.h>
 #include <signal.h>
-#endif
+#include <inttypes.h>
+#include <sys/time.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/diagnostics_relay.h>
+#include "common/utils.h"
 
 enum cmd_mode {
 	CMD_NONE = 0,
@@ -46,17 +48,363 @@ enum cmd_mode {
 	CMD_DIAGNOSTICS,
 	CMD_MOBILEGESTALT,
 	CMD_IOREGISTRY,
-	CMD_IOREGISTRY_ENTRY
+	CMD_IOREGISTRY_ENTRY,
+	CMD_BATCH,
+	CMD_SAMPLE
 };
 
+static int quit_flag = 0;
+static int use_json = 0;
+
+static void clean_exit(int sig)
+{
+	quit_flag++;
+}
+
+static uint64_t time_now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
 static void print_xml(plist_t node)
 {
 	char *xml = NULL;
 	uint32_t len = 0;
+	if (use_json) {
+		plist_print_to_stream_with_format(node, stdout, PLIST_PRINT_JSON);
+		return;
+	}
 	plist_to_xml(node, &xml, &len);
 	if (xml) {
 		puts(xml);
+		free(xml);
+	}
+}
+
+/**
+ * Turns one line of batch input into a diagnostics_relay request dictionary.
+ *
+ * @return The request or NULL if the line is empty, a comment or invalid.
+ */
+static plist_t batch_parse_request(char *line, int *invalid)
+{
+	const char *delim = " \t\r\n";
+	char *command = strtok(line, delim);
+	char *arg = NULL;
+	plist_t request = NULL;
+
+	*invalid = 0;
+	if (!command || command[0] == '#') {
+		return NULL;
+	}
+	arg = strtok(NULL, delim);
+
+	request = plist_new_dict();
+	if (!strcmp(command, "diagnostics")) {
+		plist_dict_set_item(request, "Request", plist_new_string(arg ? arg : "All"));
+	} else if (!strcmp(command, "mobilegestalt") && arg) {
+		plist_t keys = plist_new_array();
+		while (arg) {
+			plist_array_append_item(keys, plist_new_string(arg));
+			arg = strtok(NULL, delim);
+		}
+		plist_dict_set_item(request, "MobileGestaltKeys", keys);
+		plist_dict_set_item(request, "Request", plist_new_string("MobileGestalt"));
+	} else if (!strcmp(command, "ioreg")) {
+		plist_dict_set_item(request, "CurrentPlane", plist_new_string(arg ? arg : ""));
+		plist_dict_set_item(request, "Request", plist_new_string("IORegistry"));
+	} else if (!strcmp(command, "ioregentry") && arg) {
+		plist_dict_set_item(request, "EntryName", plist_new_string(arg));
+		plist_dict_set_item(request, "Request", plist_new_string("IORegistry"));
+	} else if (!strcmp(command, "ioregclass") && arg) {
+		plist_dict_set_item(request, "EntryClass", plist_new_string(arg));
+		plist_dict_set_item(request, "Request", plist_new_string("IORegistry"));
+	} else {
+		plist_free(request);
+		request = NULL;
+		*invalid = 1;
+	}
+	return request;
+}
+
+/**
+ * Reads one query per line from the given stream.
+ *
+ * @return A PLIST_ARRAY of request dictionaries or NULL on invalid input.
+ */
+static plist_t batch_read_requests(FILE *input)
+{
+	plist_t requests = plist_new_array();
+	char line[1024];
+	int lineno = 0;
+
+	while (fgets(line, sizeof(line), input)) {
+		int invalid = 0;
+		lineno++;
+		plist_t request = batch_parse_request(line, &invalid);
+		if (invalid) {
+			fprintf(stderr, "ERROR: Invalid query on line %d\n", lineno);
+			plist_free(requests);
+			return NULL;
+		}
+		if (request) {
+			plist_array_append_item(requests, request);
+		}
 	}
+	return requests;
+}
+
+static int batch_query(diagnostics_relay_client_t client, plist_t requests)
+{
+	plist_t replies = NULL;
+	int res = EXIT_SUCCESS;
+	uint32_t i;
+
+	if (diagnostics_relay_query_multiple(client, requests, &replies) != DIAGNOSTICS_RELAY_E_SUCCESS) {
+		printf("ERROR: Unable to query diagnostics from device.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* print one array with the results in input order */
+	plist_t output = plist_new_array();
+	for (i = 0; i < plist_array_get_size(replies); i++) {
+		plist_t reply = plist_array_get_item(replies, i);
+		const char *status = plist_get_string_ptr(plist_dict_get_item(reply, "Status"), NULL);
+		plist_t value = plist_dict_get_item(reply, "Diagnostics");
+		if (status && !strcmp(status, "Success") && value) {
+			plist_array_append_item(output, plist_copy(value));
+		} else {
+			fprintf(stderr, "ERROR: Query %d failed with status %s\n", i + 1, status ? status : "(none)");
+			plist_array_append_item(output, plist_new_dict());
+			res = EXIT_FAILURE;
+		}
+	}
+	print_xml(output);
+	plist_free(output);
+	plist_free(replies);
+
+	return res;
+}
+
+/* appends s to the line buffer, escaping the characters in special */
+static void line_append_escaped(char **line, size_t *length, size_t *capacity, const char *s, const char *special)
+{
+	size_t needed = *length + strlen(s) * 2 + 1;
+	if (needed > *capacity) {
+		*capacity = needed * 2;
+		*line = (char*)realloc(*line, *capacity);
+	}
+	while (*s) {
+		if (strchr(special, *s)) {
+			(*line)[(*length)++] = '\\';
+		}
+		(*line)[(*length)++] = *s++;
+	}
+	(*line)[*length] = '\0';
+}
+
+/**
+ * Flattens a diagnostics result into "path" -> "line protocol field value"
+ * pairs. Nested dictionary keys and array indices are joined with '.'.
+ * Data and date nodes are not representable and are skipped.
+ */
+static void sample_flatten(plist_t node, const char *path, plist_t fields)
+{
+	char buf[64];
+	char *str = NULL;
+	size_t length = 0;
+	size_t capacity = 0;
+
+	switch (plist_get_node_type(node)) {
+	case PLIST_DICT: {
+		plist_dict_iter iter = NULL;
+		plist_dict_new_iter(node, &iter);
+		while (1) {
+			char *key = NULL;
+			plist_t value = NULL;
+			plist_dict_next_item(node, iter, &key, &value);
+			if (!key) {
+				break;
+			}
+			if (path[0] == '\0') {
+				sample_flatten(value, key, fields);
+			} else {
+				char *child = (char*)malloc(strlen(path) + strlen(key) + 2);
+				sprintf(child, "%s.%s", path, key);
+				sample_flatten(value, child, fields);
+				free(child);
+			}
+			free(key);
+		}
+		free(iter);
+		break;
+	}
+	case PLIST_ARRAY: {
+		uint32_t i;
+		for (i = 0; i < plist_array_get_size(node); i++) {
+			char *child = (char*)malloc(strlen(path) + 16);
+			sprintf(child, "%s.%u", path, i);
+			sample_flatten(plist_array_get_item(node, i), child, fields);
+			free(child);
+		}
+		break;
+	}
+	case PLIST_BOOLEAN: {
+		uint8_t b = 0;
+		plist_get_bool_val(node, &b);
+		plist_dict_set_item(fields, path, plist_new_string(b ? "true" : "false"));
+		break;
+	}
+	case PLIST_UINT: {
+		uint64_t u = 0;
+		plist_get_uint_val(node, &u);
+		/* negative values are stored as their two's complement */
+		snprintf(buf, sizeof(buf), "%" PRId64 "i", (int64_t)u);
+		plist_dict_set_item(fields, path, plist_new_string(buf));
+		break;
+	}
+	case PLIST_REAL: {
+		double d = 0;
+		plist_get_real_val(node, &d);
+		snprintf(buf, sizeof(buf), "%.17g", d);
+		plist_dict_set_item(fields, path, plist_new_string(buf));
+		break;
+	}
+	case PLIST_STRING:
+		line_append_escaped(&str, &length, &capacity, "\"", "");
+		line_append_escaped(&str, &length, &capacity, plist_get_string_ptr(node, NULL), "\"\\");
+		line_append_escaped(&str, &length, &capacity, "\"", "");
+		plist_dict_set_item(fields, path, plist_new_string(str));
+		free(str);
+		break;
+	default:
+		break;
+	}
+}
+
+/* returns the measurement name to use for the given batch request */
+static const char* sample_measurement_name(plist_t request)
+{
+	static const char *keys[] = { "EntryName", "EntryClass", "CurrentPlane", NULL };
+	const char *name = plist_get_string_ptr(plist_dict_get_item(request, "Request"), NULL);
+	int i;
+	for (i = 0; keys[i]; i++) {
+		const char *value = plist_get_string_ptr(plist_dict_get_item(request, keys[i]), NULL);
+		if (value && *value) {
+			return value;
+		}
+	}
+	return name;
+}
+
+/**
+ * Writes one line protocol record with the fields that differ from the
+ * previous sample and remembers the new values in previous.
+ */
+static void sample_emit_changes(FILE *out, const char *measurement, const char *udid, plist_t fields, plist_t previous, uint64_t timestamp_ms)
+{
+	char *line = NULL;
+	size_t length = 0;
+	size_t capacity = 0;
+	int changed = 0;
+	plist_dict_iter iter = NULL;
+
+	line_append_escaped(&line, &length, &capacity, measurement, ", ");
+	line_append_escaped(&line, &length, &capacity, ",udid=", "");
+	line_append_escaped(&line, &length, &capacity, udid, ",= ");
+
+	plist_dict_new_iter(fields, &iter);
+	while (1) {
+		char *key = NULL;
+		plist_t value = NULL;
+		plist_dict_next_item(fields, iter, &key, &value);
+		if (!key) {
+			break;
+		}
+		const char *val = plist_get_string_ptr(value, NULL);
+		const char *old = plist_get_string_ptr(plist_dict_get_item(previous, key), NULL);
+		if (!old || strcmp(old, val) != 0) {
+			line_append_escaped(&line, &length, &capacity, (changed) ? "," : " ", "");
+			line_append_escaped(&line, &length, &capacity, key, ",= ");
+			line_append_escaped(&line, &length, &capacity, "=", "");
+			line_append_escaped(&line, &length, &capacity, val, "");
+			plist_dict_set_item(previous, key, plist_copy(value));
+			changed++;
+		}
+		free(key);
+	}
+	free(iter);
+
+	if (changed) {
+		fprintf(out, "%s %" PRIu64 "000000\n", line, timestamp_ms);
+		fflush(out);
+	}
+	free(line);
+}
+
+/**
+ * Runs the queries every interval_ms milliseconds over the same connection
+ * and writes changed values as line protocol to stdout until interrupted.
+ */
+static int sample_loop(diagnostics_relay_client_t client, plist_t requests, const char *udid, uint64_t interval_ms)
+{
+	uint32_t count = plist_array_get_size(requests);
+	plist_t *previous = (plist_t*)calloc(count, sizeof(plist_t));
+	uint64_t start = time_now_ms();
+	uint64_t samples = 0;
+	int res = EXIT_SUCCESS;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		previous[i] = plist_new_dict();
+	}
+
+	while (!quit_flag) {
+		plist_t replies = NULL;
+		uint64_t now = time_now_ms();
+
+		if (diagnostics_relay_query_multiple(client, requests, &replies) != DIAGNOSTICS_RELAY_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Unable to query diagnostics from device.\n");
+			res = EXIT_FAILURE;
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			plist_t request = plist_array_get_item(requests, i);
+			plist_t reply = plist_array_get_item(replies, i);
+			const char *status = plist_get_string_ptr(plist_dict_get_item(reply, "Status"), NULL);
+			plist_t value = plist_dict_get_item(reply, "Diagnostics");
+			if (!status || strcmp(status, "Success") != 0 || !value) {
+				fprintf(stderr, "ERROR: Query %d failed with status %s\n", i + 1, status ? status : "(none)");
+				continue;
+			}
+			/* IORegistry replies wrap the entry in an "IORegistry" dictionary */
+			plist_t inner = plist_dict_get_item(value, "IORegistry");
+			plist_t fields = plist_new_dict();
+			sample_flatten((inner) ? inner : value, "", fields);
+			sample_emit_changes(stdout, sample_measurement_name(request), udid, fields, previous[i], now);
+			plist_free(fields);
+		}
+		plist_free(replies);
+		samples++;
+
+		/* pace against the start time so that delays do not add up */
+		uint64_t next = start + samples * interval_ms;
+		now = time_now_ms();
+		while (!quit_flag && now < next) {
+			uint64_t wait = next - now;
+			usleep((useconds_t)((wait > 100) ? 100 : wait) * 1000);
+			now = time_now_ms();
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		plist_free(previous[i]);
+	}
+	free(previous);
+
+	return res;
 }
 
 void print_usage(int argc, char **argv);
@@ -74,9 +422,13 @@ int main(int argc, char **argv)
 	int use_network = 0;
 	int cmd = CMD_NONE;
 	char* cmd_arg = NULL;
+	uint64_t interval_ms = 0;
 	plist_t node = NULL;
 	plist_t keys = NULL;
+	plist_t requests = NULL;
 
+	signal(SIGINT, clean_exit);
+	signal(SIGTERM, clean_exit);
 #ifndef WIN32
 	signal(SIGPIPE, SIG_IGN);
 #endif
@@ -100,6 +452,10 @@ int main(int argc, char **argv)
 			use_network = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--json")) {
+			use_json = 1;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			result = EXIT_SUCCESS;
@@ -175,6 +531,26 @@ int main(int argc, char **argv)
 			}
 			continue;
 		}
+		else if (!strcmp(argv[i], "batch")) {
+			cmd = CMD_BATCH;
+			continue;
+		}
+		else if (!strcmp(argv[i], "sample")) {
+			cmd = CMD_SAMPLE;
+			/* read interval in seconds */
+			i++;
+			double seconds = (argv[i]) ? strtod(argv[i], NULL) : 0;
+			if (seconds <= 0) {
+				printf("ERROR: Please supply a sampling interval in seconds.\n");
+				print_usage(argc, argv);
+				goto cleanup;
+			}
+			interval_ms = (uint64_t)(seconds * 1000);
+			if (interval_ms == 0) {
+				interval_ms = 1;
+			}
+			continue;
+		}
 		else if (!strcmp(argv[i], "ioregentry")) {
 			cmd = CMD_IOREGISTRY_ENTRY;
 			/* read key */
@@ -196,6 +572,14 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	if (cmd == CMD_BATCH || cmd == CMD_SAMPLE) {
+		/* read all queries before connecting so input errors fail early */
+		requests = batch_read_requests(stdin);
+		if (!requests) {
+			goto cleanup;
+		}
+	}
+
 	if (IDEVICE_E_SUCCESS != idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX)) {
 		if (udid) {
 			printf("No device found with udid %s.\n", udid);
@@ -281,6 +665,16 @@ int main(int argc, char **argv)
 						printf("ERROR: Unable to retrieve IORegistry from device.\n");
 					}
 					break;
+				case CMD_BATCH:
+					result = batch_query(diagnostics_client, requests);
+					break;
+				case CMD_SAMPLE: {
+					char *device_udid = NULL;
+					idevice_get_udid(device, &device_udid);
+					result = sample_loop(diagnostics_client, requests, (device_udid) ? device_udid : "", interval_ms);
+					free(device_udid);
+					break;
+				}
 				case CMD_DIAGNOSTICS:
 				default:
 					if (diagnostics_relay_request_diagnostics(diagnostics_client, cmd_arg, &node) == DIAGNOSTICS_RELAY_E_SUCCESS) {
@@ -315,6 +709,9 @@ cleanup:
 	if (keys) {
 		plist_free(keys);
 	}
+	if (requests) {
+		plist_free(requests);
+	}
 	if (cmd_arg) {
 		free(cmd_arg);
 	}
@@ -334,6 +731,10 @@ void print_usage(int argc, char **argv)
 	printf("  mobilegestalt KEY [...]\tprint mobilegestalt keys passed as arguments separated by a space.\n");
 	printf("  ioreg [PLANE]\t\t\tprint IORegistry of device, optionally by PLANE (IODeviceTree, IOPower, IOService) (iOS 5+ only)\n");
 	printf("  ioregentry [KEY]\t\tprint IORegistry entry of device (AppleARMPMUCharger, ASPStorage, ...) (iOS 5+ only)\n");
+	printf("  batch\t\t\t\trun queries read from stdin, one per line, over a single\n");
+	printf("  \t\t\t\tconnection (diagnostics, mobilegestalt, ioreg, ioregentry, ioregclass)\n");
+	printf("  sample INTERVAL\t\trun the stdin queries every INTERVAL seconds and print\n");
+	printf("  \t\t\t\tchanged values as line protocol until interrupted\n");
 	printf("  shutdown\t\t\tshutdown device\n");
 	printf("  restart\t\t\trestart device\n");
 	printf("  sleep\t\t\t\tput device into sleep mode (disconnects from host)\n");
@@ -341,6 +742,7 @@ void print_usage(int argc, char **argv)
 	printf("The following OPTIONS are accepted:\n");
 	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
 	printf("  -n, --network\t\tconnect to network device\n");
+	printf("  -j, --json\t\tprint results as JSON instead of XML\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
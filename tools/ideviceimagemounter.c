@@ -38,7 +38,9 @@
 #include <inttypes.h>
 #ifndef WIN32
 #include <signal.h>
+#include <unistd.h>
 #endif
+#include <sys/stat.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -51,12 +53,17 @@
 static int list_mode = 0;
 static int use_network = 0;
 static int xml_mode = 0;
+static int force_mode = 0;
 static const char *udid = NULL;
 static const char *imagetype = NULL;
 
 static const char PKG_PATH[] = "PublicStaging";
 static const char PATH_PREFIX[] = "/private/var/mobile/Media";
 
+/* size of the slices written with each pipelined AFC write */
+#define AFC_UPLOAD_CHUNK_SIZE (1024 * 1024)
+#define AFC_UPLOAD_WRITE_WINDOW 16
+
 typedef enum {
 	DISK_IMAGE_UPLOAD_TYPE_AFC,
 	DISK_IMAGE_UPLOAD_TYPE_UPLOAD_IMAGE
@@ -77,6 +84,7 @@ static void print_usage(int argc, char **argv)
 	printf("  -l, --list\t\tList mount information\n");
 	printf("  -t, --imagetype\tImage type to use, default is 'Developer'\n");
 	printf("  -x, --xml\t\tUse XML output\n");
+	printf("  -f, --force\t\tupload and mount even if the image is already mounted\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -94,6 +102,7 @@ static void parse_opts(int argc, char **argv)
 		{ "list",      no_argument,       NULL, 'l' },
 		{ "imagetype", required_argument, NULL, 't' },
 		{ "xml",       no_argument,       NULL, 'x' },
+		{ "force",     no_argument,       NULL, 'f' },
 		{ "debug",     no_argument,       NULL, 'd' },
 		{ "version",   no_argument,       NULL, 'v' },
 		{ NULL, 0, NULL, 0 }
@@ -101,7 +110,7 @@ static void parse_opts(int argc, char **argv)
 	int c;
 
 	while (1) {
-		c = getopt_long(argc, argv, "hu:lt:xdnv", longopts, NULL);
+		c = getopt_long(argc, argv, "hu:lt:xfdnv", longopts, NULL);
 		if (c == -1) {
 			break;
 		}
@@ -130,6 +139,9 @@ static void parse_opts(int argc, char **argv)
 		case 'x':
 			xml_mode = 1;
 			break;
+		case 'f':
+			force_mode = 1;
+			break;
 		case 'd':
 			idevice_set_debug_level(1);
 			break;
@@ -152,11 +164,6 @@ static void print_xml(plist_t node)
 		puts(xml);
 }
 
-static ssize_t mim_upload_cb(void* buf, size_t size, void* userdata)
-{
-	return fread(buf, 1, size, (FILE*)userdata);
-}
-
 int main(int argc, char **argv)
 {
 	idevice_t device = NULL;
@@ -306,11 +313,30 @@ int main(int argc, char **argv)
 			goto leave;
 		}
 
-		f = fopen(image_path, "rb");
-		if (!f) {
+		if (!imagetype) {
+			imagetype = "Developer";
+		}
+
+		if (!force_mode) {
+			mobile_image_mounter_mount_state_t state = MOBILE_IMAGE_MOUNTER_STATE_NOT_MOUNTED;
+			err = mobile_image_mounter_get_mount_state(mim, imagetype, sig, sig_length, &state);
+			if (err == MOBILE_IMAGE_MOUNTER_E_SUCCESS && state == MOBILE_IMAGE_MOUNTER_STATE_MOUNTED) {
+				printf("Image is already mounted.\n");
+				res = 0;
+				goto error_out;
+			}
+			if (err == MOBILE_IMAGE_MOUNTER_E_SUCCESS && state == MOBILE_IMAGE_MOUNTER_STATE_MOUNTED_OTHER) {
+				printf("WARNING: An image with a different signature is already mounted.\n");
+			}
+		}
+
+		struct mapped_buffer image;
+		if (buffer_map_from_filename(image_path, &image, 1) < 0) {
 			fprintf(stderr, "Error opening image file '%s': %s\n", image_path, strerror(errno));
 			goto leave;
 		}
+		char *image_data = image.data;
+		image_size = (size_t)image.length;
 
 		char *targetname = NULL;
 		if (asprintf(&targetname, "%s/%s", PKG_PATH, "staging.dimage") < 0) {
@@ -324,14 +350,10 @@ int main(int argc, char **argv)
 		}
 
 
-		if (!imagetype) {
-			imagetype = "Developer";
-		}
-
 		switch(disk_image_upload_type) {
 			case DISK_IMAGE_UPLOAD_TYPE_UPLOAD_IMAGE:
 				printf("Uploading %s\n", image_path);
-				err = mobile_image_mounter_upload_image(mim, imagetype, image_size, sig, sig_length, mim_upload_cb, f);
+				err = mobile_image_mounter_upload_image_buffer(mim, imagetype, image_data, image_size, sig, sig_length);
 				break;
 			case DISK_IMAGE_UPLOAD_TYPE_AFC:
 			default:
@@ -354,42 +376,42 @@ int main(int argc, char **argv)
 				uint64_t af = 0;
 				if ((afc_file_open(afc, targetname, AFC_FOPEN_WRONLY, &af) !=
 					 AFC_E_SUCCESS) || !af) {
-					fclose(f);
+					buffer_unmap(&image);
 					fprintf(stderr, "afc_file_open on '%s' failed!\n", targetname);
 					goto leave;
 				}
 
-				char buf[8192];
-				size_t amount = 0;
-				do {
-					amount = fread(buf, 1, sizeof(buf), f);
-					if (amount > 0) {
-						uint32_t written, total = 0;
-						while (total < amount) {
-							written = 0;
-							if (afc_file_write(afc, af, buf + total, amount - total, &written) !=
-								AFC_E_SUCCESS) {
-								fprintf(stderr, "AFC Write error!\n");
-								break;
-							}
-							total += written;
-						}
-						if (total != amount) {
-							fprintf(stderr, "Error: wrote only %d of %d\n", total,
-									(unsigned int)amount);
-							afc_file_close(afc, af);
-							fclose(f);
-							goto leave;
-						}
+				/* write errors are reported by a later write or by close */
+				afc_set_write_window(afc, AFC_UPLOAD_WRITE_WINDOW);
+
+				afc_error_t afc_err = AFC_E_SUCCESS;
+				size_t total = 0;
+				while (total < image_size) {
+					uint32_t amount = (image_size - total > AFC_UPLOAD_CHUNK_SIZE) ? AFC_UPLOAD_CHUNK_SIZE : (uint32_t)(image_size - total);
+					uint32_t written = 0;
+					afc_err = afc_file_write(afc, af, image_data + total, amount, &written);
+					if (afc_err != AFC_E_SUCCESS || written == 0) {
+						fprintf(stderr, "AFC Write error!\n");
+						break;
 					}
+					total += written;
 				}
-				while (amount > 0);
 
-				afc_file_close(afc, af);
+				afc_error_t close_err = afc_file_close(afc, af);
+				if (afc_err == AFC_E_SUCCESS && close_err != AFC_E_SUCCESS) {
+					fprintf(stderr, "AFC Write error!\n");
+					afc_err = close_err;
+				}
+				if (afc_err != AFC_E_SUCCESS || total != image_size) {
+					fprintf(stderr, "Error: wrote only %zu of %zu\n", total, image_size);
+					buffer_unmap(&image);
+					goto leave;
+				}
+				err = MOBILE_IMAGE_MOUNTER_E_SUCCESS;
 				break;
 		}
 
-		fclose(f);
+		buffer_unmap(&image);
 
 		if (err != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 			if (err == MOBILE_IMAGE_MOUNTER_E_DEVICE_LOCKED) {
@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <time.h>
 #ifndef WIN32
 #include <signal.h>
 #endif
@@ -38,9 +39,14 @@
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include "common/utils.h"
+#include "common/thread.h"
 
 #define FORMAT_KEY_VALUE 1
 #define FORMAT_XML 2
+#define FORMAT_JSON 3
+
+#define DEFAULT_PARALLEL 16
+#define MAX_PARALLEL 64
 
 static const char *domains[] = {
 	"com.apple.disk_usage",
@@ -88,6 +94,210 @@ static int is_domain_known(const char *domain)
 	return 0;
 }
 
+struct strbuf {
+	char *data;
+	size_t length;
+	size_t capacity;
+};
+
+static void strbuf_append(struct strbuf *buf, const char *str, size_t length)
+{
+	if (buf->length + length + 1 > buf->capacity) {
+		size_t capacity = (buf->capacity) ? buf->capacity : 256;
+		while (capacity < buf->length + length + 1) {
+			capacity *= 2;
+		}
+		buf->data = (char*)realloc(buf->data, capacity);
+		buf->capacity = capacity;
+	}
+	memcpy(buf->data + buf->length, str, length);
+	buf->length += length;
+	buf->data[buf->length] = '\0';
+}
+
+static void strbuf_puts(struct strbuf *buf, const char *str)
+{
+	strbuf_append(buf, str, strlen(str));
+}
+
+static void json_append_string(struct strbuf *buf, const char *str)
+{
+	strbuf_append(buf, "\"", 1);
+	while (*str) {
+		unsigned char c = (unsigned char)*str;
+		const char *start = str;
+		while (*str && (unsigned char)*str >= 0x20 && *str != '"' && *str != '\\') {
+			str++;
+		}
+		if (str > start) {
+			strbuf_append(buf, start, str - start);
+			continue;
+		}
+		char esc[8];
+		switch (c) {
+		case '"': strbuf_puts(buf, "\\\""); break;
+		case '\\': strbuf_puts(buf, "\\\\"); break;
+		case '\n': strbuf_puts(buf, "\\n"); break;
+		case '\r': strbuf_puts(buf, "\\r"); break;
+		case '\t': strbuf_puts(buf, "\\t"); break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			strbuf_puts(buf, esc);
+			break;
+		}
+		str++;
+	}
+	strbuf_append(buf, "\"", 1);
+}
+
+static void json_append_node(struct strbuf *buf, plist_t node)
+{
+	char *json = plist_to_json_string(node);
+	strbuf_puts(buf, (json) ? json : "null");
+	free(json);
+}
+
+struct inventory {
+	idevice_info_t *devices;
+	int count;
+	int next;
+	int simple;
+	const char *domain;
+	const char **keys;
+	mutex_t mutex;
+	int failed;
+};
+
+/* queries one device and returns its JSON line */
+static char* inventory_query_device(struct inventory *inv, idevice_info_t info)
+{
+	struct strbuf buf = { NULL, 0, 0 };
+	idevice_t device = NULL;
+	lockdownd_client_t client = NULL;
+	lockdownd_error_t ldret = LOCKDOWN_E_UNKNOWN_ERROR;
+	plist_t node = NULL;
+	const char *error = NULL;
+
+	strbuf_puts(&buf, "{\"udid\":");
+	json_append_string(&buf, info->udid);
+	strbuf_puts(&buf, ",\"connection\":");
+	strbuf_puts(&buf, (info->conn_type == CONNECTION_NETWORK) ? "\"network\"" : "\"usb\"");
+
+	if (idevice_new_with_options(&device, info->udid, (info->conn_type == CONNECTION_NETWORK) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		error = "Device not found";
+	} else if (LOCKDOWN_E_SUCCESS != (ldret = inv->simple ?
+			lockdownd_client_new(device, &client, TOOL_NAME):
+			lockdownd_client_new_with_handshake(device, &client, TOOL_NAME))) {
+		error = lockdownd_strerror(ldret);
+	} else {
+		ldret = (inv->keys) ? lockdownd_get_values(client, inv->domain, inv->keys, &node) : lockdownd_get_value(client, inv->domain, NULL, &node);
+		if (ldret != LOCKDOWN_E_SUCCESS) {
+			error = lockdownd_strerror(ldret);
+		}
+	}
+
+	if (error) {
+		strbuf_puts(&buf, ",\"error\":");
+		json_append_string(&buf, error);
+		mutex_lock(&inv->mutex);
+		inv->failed++;
+		mutex_unlock(&inv->mutex);
+	} else {
+		strbuf_puts(&buf, ",\"values\":");
+		json_append_node(&buf, node);
+	}
+	strbuf_puts(&buf, "}\n");
+
+	plist_free(node);
+	lockdownd_client_free(client);
+	idevice_free(device);
+
+	return buf.data;
+}
+
+static void* inventory_worker(void *arg)
+{
+	struct inventory *inv = (struct inventory*)arg;
+	while (1) {
+		mutex_lock(&inv->mutex);
+		int idx = inv->next++;
+		mutex_unlock(&inv->mutex);
+		if (idx >= inv->count) {
+			break;
+		}
+		char *line = inventory_query_device(inv, inv->devices[idx]);
+		/* one complete line per device as soon as it is ready */
+		mutex_lock(&inv->mutex);
+		fputs(line, stdout);
+		fflush(stdout);
+		mutex_unlock(&inv->mutex);
+		free(line);
+	}
+	return NULL;
+}
+
+/* queries all attached devices concurrently and prints one JSON object per line */
+static int inventory_all_devices(int use_network, int simple, int parallel, const char *domain, const char **keys)
+{
+	idevice_info_t *dev_list = NULL;
+	int count = 0;
+	int i;
+
+	if (idevice_get_device_list_extended(&dev_list, &count) < 0) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		return -1;
+	}
+
+	/* query every device once, preferring the USB connection */
+	struct inventory inv;
+	memset(&inv, '\0', sizeof(inv));
+	inv.devices = (idevice_info_t*)malloc(sizeof(idevice_info_t) * (count + 1));
+	inv.simple = simple;
+	inv.domain = domain;
+	inv.keys = keys;
+	for (i = 0; i < count; i++) {
+		int j;
+		int duplicate = 0;
+		if (dev_list[i]->conn_type == CONNECTION_NETWORK && !use_network) {
+			continue;
+		}
+		for (j = 0; j < inv.count; j++) {
+			if (!strcmp(inv.devices[j]->udid, dev_list[i]->udid)) {
+				if (dev_list[i]->conn_type != CONNECTION_NETWORK) {
+					inv.devices[j] = dev_list[i];
+				}
+				duplicate = 1;
+				break;
+			}
+		}
+		if (!duplicate) {
+			inv.devices[inv.count++] = dev_list[i];
+		}
+	}
+	mutex_init(&inv.mutex);
+
+	int num_workers = (inv.count < parallel) ? inv.count : parallel;
+	THREAD_T workers[MAX_PARALLEL];
+	int started = 0;
+	for (i = 1; i < num_workers; i++) {
+		if (thread_new(&workers[started], inventory_worker, &inv) != 0) {
+			break;
+		}
+		started++;
+	}
+	inventory_worker(&inv);
+	for (i = 0; i < started; i++) {
+		thread_join(workers[i]);
+		thread_free(workers[i]);
+	}
+
+	mutex_destroy(&inv.mutex);
+	free(inv.devices);
+	idevice_device_list_extended_free(dev_list);
+
+	return (inv.failed > 0) ? 1 : 0;
+}
+
 static void print_usage(int argc, char **argv, int is_error)
 {
 	int i = 0;
@@ -104,7 +314,12 @@ static void print_usage(int argc, char **argv, int is_error)
 		"  -s, --simple       use a simple connection to avoid auto-pairing with the device\n" \
 		"  -q, --domain NAME  set domain of query to NAME. Default: None\n" \
 		"  -k, --key NAME     only query key specified by NAME. Default: All keys.\n" \
+		"                     Can be given multiple times to query a set of keys.\n" \
 		"  -x, --xml          output information as xml plist instead of key/value pairs\n" \
+		"  -j, --json         output information as JSON\n" \
+		"  -a, --all-devices  query all attached devices concurrently, printing one\n" \
+		"                     JSON object per device and line as results arrive\n" \
+		"  -P, --parallel N   query up to N devices at a time (default: 16)\n" \
 		"  -h, --help         prints usage information\n" \
 		"  -d, --debug        enable communication debugging\n" \
 		"  -v, --version      prints version information\n" \
@@ -133,6 +348,10 @@ int main(int argc, char *argv[])
 	int use_network = 0;
 	const char *domain = NULL;
 	const char *key = NULL;
+	const char **keys = NULL;
+	int num_keys = 0;
+	int all_devices = 0;
+	int parallel = DEFAULT_PARALLEL;
 	char *xml_doc = NULL;
 	uint32_t xml_length;
 	plist_t node = NULL;
@@ -147,6 +366,9 @@ int main(int argc, char *argv[])
 		{ "key", required_argument, NULL, 'k' },
 		{ "simple", no_argument, NULL, 's' },
 		{ "xml", no_argument, NULL, 'x' },
+		{ "json", no_argument, NULL, 'j' },
+		{ "all-devices", no_argument, NULL, 'a' },
+		{ "parallel", required_argument, NULL, 'P' },
 		{ "version", no_argument, NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
@@ -155,7 +377,7 @@ int main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	while ((c = getopt_long(argc, argv, "dhu:nq:k:sxv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:nq:k:sxjaP:v", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -186,10 +408,27 @@ int main(int argc, char *argv[])
 				return 2;
 			}
 			key = optarg;
+			keys = (const char**)realloc(keys, sizeof(char*) * (num_keys + 2));
+			keys[num_keys++] = optarg;
+			keys[num_keys] = NULL;
 			break;
 		case 'x':
 			format = FORMAT_XML;
 			break;
+		case 'j':
+			format = FORMAT_JSON;
+			break;
+		case 'a':
+			all_devices = 1;
+			break;
+		case 'P':
+			parallel = atoi(optarg);
+			if (parallel < 1 || parallel > MAX_PARALLEL) {
+				fprintf(stderr, "ERROR: 'parallel' must be between 1 and %d!\n", MAX_PARALLEL);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
 		case 's':
 			simple = 1;
 			break;
@@ -208,6 +447,21 @@ int main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (domain && !is_domain_known(domain)) {
+		fprintf(stderr, "WARNING: Sending query with unknown domain \"%s\".\n", domain);
+	}
+
+	if (all_devices) {
+		if (udid) {
+			fprintf(stderr, "ERROR: --all-devices cannot be combined with --udid!\n");
+			free(keys);
+			return 2;
+		}
+		int res = inventory_all_devices(use_network, simple, parallel, domain, keys);
+		free(keys);
+		return res;
+	}
+
 	ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
 		if (udid) {
@@ -215,6 +469,7 @@ int main(int argc, char *argv[])
 		} else {
 			printf("ERROR: No device found!\n");
 		}
+		free(keys);
 		return -1;
 	}
 
@@ -223,17 +478,22 @@ int main(int argc, char *argv[])
 			lockdownd_client_new_with_handshake(device, &client, TOOL_NAME))) {
 		fprintf(stderr, "ERROR: Could not connect to lockdownd: %s (%d)\n", lockdownd_strerror(ldret), ldret);
 		idevice_free(device);
+		free(keys);
 		return -1;
 	}
 
-	if (domain && !is_domain_known(domain)) {
-		fprintf(stderr, "WARNING: Sending query with unknown domain \"%s\".\n", domain);
-	}
-
 	/* run query and output information */
-	if(lockdownd_get_value(client, domain, key, &node) == LOCKDOWN_E_SUCCESS) {
+	if (num_keys > 1) {
+		ldret = lockdownd_get_values(client, domain, keys, &node);
+	} else {
+		ldret = lockdownd_get_value(client, domain, key, &node);
+	}
+	if (ldret == LOCKDOWN_E_SUCCESS) {
 		if (node) {
 			switch (format) {
+			case FORMAT_JSON:
+				plist_print_to_stream_with_format(node, stdout, PLIST_PRINT_JSON);
+				break;
 			case FORMAT_XML:
 				plist_to_xml(node, &xml_doc, &xml_length);
 				printf("%s", xml_doc);
@@ -254,6 +514,7 @@ int main(int argc, char *argv[])
 
 	lockdownd_client_free(client);
 	idevice_free(device);
+	free(keys);
 
 	return 0;
 }
@@ -0,0 +1,511 @@
+/*
+ * ideviceinstall.c
+ * Install an application package on one or more devices in parallel
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "ideviceinstall"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <signal.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/installation_proxy.h>
+#include "common/utils.h"
+#include "common/thread.h"
+
+#define PKG_STAGING_DIR "PublicStaging"
+#define UPLOAD_CHUNK_SIZE (1024 * 1024)
+#define UPLOAD_WRITE_WINDOW 16
+#define PROGRESS_INTERVAL_MS 500
+
+enum install_phase {
+	PHASE_WAITING = 0,
+	PHASE_UPLOADING,
+	PHASE_INSTALLING,
+	PHASE_DONE,
+	PHASE_FAILED
+};
+
+static const char *phase_names[] = {
+	"Waiting",
+	"Uploading",
+	"Installing",
+	"Done",
+	"Failed"
+};
+
+struct install_package {
+	struct mapped_buffer map;
+	char *staging_path;
+};
+
+struct install_target {
+	char *udid;
+	enum idevice_options lookup;
+	const struct install_package *pkg;
+	THREAD_T thread;
+	/* protected by status_mutex */
+	enum install_phase phase;
+	int percent;
+	char *error;
+	/* last state printed by the main thread */
+	enum install_phase reported_phase;
+	int reported_percent;
+};
+
+static mutex_t status_mutex;
+static cond_t status_cond;
+static int active_workers = 0;
+
+static void print_usage(void)
+{
+	printf("Usage: ideviceinstall [OPTIONS] PACKAGE\n");
+	printf("\n");
+	printf("Install the application package PACKAGE on one or more devices in parallel.\n");
+	printf("Without -u the package is installed on all connected devices.\n");
+	printf("\n");
+	printf("OPTIONS:\n");
+	printf("  -u, --udid UDID\ttarget specific device by UDID, can be given multiple times\n");
+	printf("  -n, --network\t\tinclude network devices\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -h, --help\t\tprint usage information\n");
+	printf("  -v, --version\t\tprint version information\n");
+	printf("\n");
+	printf("Homepage:    <" PACKAGE_URL ">\n");
+	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
+}
+
+static void target_set_state(struct install_target *target, enum install_phase phase, int percent, const char *error)
+{
+	mutex_lock(&status_mutex);
+	target->phase = phase;
+	target->percent = percent;
+	if (error && !target->error) {
+		target->error = strdup(error);
+	}
+	mutex_unlock(&status_mutex);
+}
+
+static int package_open(struct install_package *pkg, const char *path)
+{
+	memset(pkg, '\0', sizeof(struct install_package));
+	if (buffer_map_from_filename(path, &pkg->map, 1) < 0) {
+		return -1;
+	}
+
+	const char *name = strrchr(path, '/');
+#ifdef WIN32
+	const char *bslash = strrchr(path, '\\');
+	if (bslash && (!name || bslash > name)) {
+		name = bslash;
+	}
+#endif
+	name = (name) ? name + 1 : path;
+	pkg->staging_path = string_build_path(PKG_STAGING_DIR, name, NULL);
+
+	return 0;
+}
+
+static void package_close(struct install_package *pkg)
+{
+	if (!pkg->map.data) {
+		return;
+	}
+	buffer_unmap(&pkg->map);
+	free(pkg->staging_path);
+	memset(pkg, '\0', sizeof(struct install_package));
+}
+
+static int package_upload(struct install_target *target, idevice_t device)
+{
+	const struct install_package *pkg = target->pkg;
+	afc_client_t afc = NULL;
+	uint64_t handle = 0;
+	uint64_t offset = 0;
+	afc_error_t err;
+
+	err = afc_client_start_service(device, &afc, TOOL_NAME);
+	if (err != AFC_E_SUCCESS) {
+		target_set_state(target, PHASE_FAILED, 0, "Could not start AFC service");
+		return -1;
+	}
+
+	afc_make_directory(afc, PKG_STAGING_DIR);
+
+	err = afc_file_open(afc, pkg->staging_path, AFC_FOPEN_WRONLY, &handle);
+	if (err != AFC_E_SUCCESS) {
+		afc_client_free(afc);
+		target_set_state(target, PHASE_FAILED, 0, "Could not create package file in staging directory");
+		return -1;
+	}
+
+	/* do not wait for the status of each chunk, errors are reported by a later write or by close */
+	afc_set_write_window(afc, UPLOAD_WRITE_WINDOW);
+
+	while (offset < pkg->map.length) {
+		uint32_t length = (pkg->map.length - offset > UPLOAD_CHUNK_SIZE) ? UPLOAD_CHUNK_SIZE : (uint32_t)(pkg->map.length - offset);
+		uint32_t written = 0;
+		err = afc_file_write(afc, handle, pkg->map.data + offset, length, &written);
+		if (err != AFC_E_SUCCESS || written == 0) {
+			break;
+		}
+		offset += written;
+		target_set_state(target, PHASE_UPLOADING, (int)((offset * 100) / pkg->map.length), NULL);
+	}
+
+	afc_error_t close_err = afc_file_close(afc, handle);
+	if (err == AFC_E_SUCCESS) {
+		err = close_err;
+	}
+	afc_client_free(afc);
+
+	if (err != AFC_E_SUCCESS || offset < pkg->map.length) {
+		char errmsg[64];
+		snprintf(errmsg, sizeof(errmsg), "Upload failed with AFC error %d", err);
+		target_set_state(target, PHASE_FAILED, (int)((offset * 100) / pkg->map.length), errmsg);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void install_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct install_target *target = (struct install_target*)user_data;
+	char *error_name = NULL;
+	char *error_description = NULL;
+	char *status_name = NULL;
+	uint64_t error_code = 0;
+	int percent = -1;
+
+	if (instproxy_status_get_error(status, &error_name, &error_description, &error_code) != INSTPROXY_E_SUCCESS) {
+		char errmsg[256];
+		snprintf(errmsg, sizeof(errmsg), "%s (0x%08llx): %s", (error_name) ? error_name : "Error", (unsigned long long)error_code, (error_description) ? error_description : "N/A");
+		mutex_lock(&status_mutex);
+		percent = target->percent;
+		mutex_unlock(&status_mutex);
+		target_set_state(target, PHASE_FAILED, percent, errmsg);
+	} else {
+		instproxy_status_get_name(status, &status_name);
+		instproxy_status_get_percent_complete(status, &percent);
+		if (status_name && !strcmp(status_name, "Complete")) {
+			target_set_state(target, PHASE_DONE, 100, NULL);
+		} else if (percent >= 0) {
+			target_set_state(target, PHASE_INSTALLING, percent, NULL);
+		}
+	}
+
+	free(error_name);
+	free(error_description);
+	free(status_name);
+}
+
+static void* install_worker(void *arg)
+{
+	struct install_target *target = (struct install_target*)arg;
+	idevice_t device = NULL;
+	lockdownd_client_t lockdown = NULL;
+	lockdownd_service_descriptor_t service = NULL;
+	instproxy_client_t ipc = NULL;
+
+	if (idevice_new_with_options(&device, target->udid, target->lookup) != IDEVICE_E_SUCCESS) {
+		target_set_state(target, PHASE_FAILED, 0, "Device not found");
+		goto leave;
+	}
+
+	target_set_state(target, PHASE_UPLOADING, 0, NULL);
+	if (package_upload(target, device) < 0) {
+		goto leave;
+	}
+
+	/* start the installation right after the upload, other devices may still be uploading */
+	target_set_state(target, PHASE_INSTALLING, 0, NULL);
+	if (lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME) != LOCKDOWN_E_SUCCESS) {
+		target_set_state(target, PHASE_FAILED, 0, "Could not connect to lockdownd");
+		goto leave;
+	}
+	if (lockdownd_start_service(lockdown, INSTPROXY_SERVICE_NAME, &service) != LOCKDOWN_E_SUCCESS || !service) {
+		target_set_state(target, PHASE_FAILED, 0, "Could not start installation proxy service");
+		goto leave;
+	}
+	lockdownd_client_free(lockdown);
+	lockdown = NULL;
+
+	if (instproxy_client_new(device, service, &ipc) != INSTPROXY_E_SUCCESS) {
+		target_set_state(target, PHASE_FAILED, 0, "Could not connect to installation proxy");
+		goto leave;
+	}
+
+	instproxy_error_t ierr = instproxy_install(ipc, target->pkg->staging_path, NULL, install_status_cb, target);
+	if (ierr != INSTPROXY_E_SUCCESS) {
+		char errmsg[64];
+		snprintf(errmsg, sizeof(errmsg), "Could not start installation, error %d", ierr);
+		target_set_state(target, PHASE_FAILED, 0, errmsg);
+		goto leave;
+	}
+
+	/* freeing the client waits for the queued install command to complete */
+	instproxy_client_free(ipc);
+	ipc = NULL;
+
+	mutex_lock(&status_mutex);
+	if (target->phase != PHASE_DONE && target->phase != PHASE_FAILED) {
+		target->phase = PHASE_FAILED;
+		if (!target->error) {
+			target->error = strdup("Connection lost during installation");
+		}
+	}
+	mutex_unlock(&status_mutex);
+
+leave:
+	if (ipc) {
+		instproxy_client_free(ipc);
+	}
+	if (service) {
+		lockdownd_service_descriptor_free(service);
+	}
+	if (lockdown) {
+		lockdownd_client_free(lockdown);
+	}
+	if (device) {
+		idevice_free(device);
+	}
+
+	mutex_lock(&status_mutex);
+	active_workers--;
+	cond_signal(&status_cond);
+	mutex_unlock(&status_mutex);
+
+	return NULL;
+}
+
+/* prints the state of all devices that changed since the last call, status_mutex must be held */
+static void print_progress(struct install_target *targets, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		struct install_target *target = &targets[i];
+		if (target->phase == target->reported_phase && target->percent == target->reported_percent) {
+			continue;
+		}
+		if (target->phase == PHASE_FAILED) {
+			printf("%s: %s: %s\n", target->udid, phase_names[target->phase], (target->error) ? target->error : "Unknown error");
+		} else if (target->phase == PHASE_DONE) {
+			printf("%s: %s\n", target->udid, phase_names[target->phase]);
+		} else {
+			printf("%s: %s %d%%\n", target->udid, phase_names[target->phase], target->percent);
+		}
+		target->reported_phase = target->phase;
+		target->reported_percent = target->percent;
+	}
+	fflush(stdout);
+}
+
+static int target_list_add(struct install_target **targets, int *count, const char *udid, enum idevice_options lookup)
+{
+	int i;
+	for (i = 0; i < *count; i++) {
+		if (!strcmp((*targets)[i].udid, udid)) {
+			return 0;
+		}
+	}
+	struct install_target *list = (struct install_target*)realloc(*targets, sizeof(struct install_target) * (*count + 1));
+	if (!list) {
+		return -1;
+	}
+	memset(&list[*count], '\0', sizeof(struct install_target));
+	list[*count].udid = strdup(udid);
+	list[*count].lookup = lookup;
+	list[*count].reported_percent = -1;
+	*targets = list;
+	(*count)++;
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	int c = 0;
+	const struct option longopts[] = {
+		{ "udid",    required_argument, NULL, 'u' },
+		{ "network", no_argument,       NULL, 'n' },
+		{ "debug",   no_argument,       NULL, 'd' },
+		{ "help",    no_argument,       NULL, 'h' },
+		{ "version", no_argument,       NULL, 'v' },
+		{ NULL, 0, NULL, 0}
+	};
+	int res = 0;
+	int use_network = 0;
+	char **udids = NULL;
+	int udid_count = 0;
+	struct install_target *targets = NULL;
+	int target_count = 0;
+	struct install_package pkg;
+	int i;
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	while ((c = getopt_long(argc, argv, "du:hnv", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'u':
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: UDID must not be empty!\n");
+				print_usage();
+				return 2;
+			}
+			udids = (char**)realloc(udids, sizeof(char*) * (udid_count + 1));
+			udids[udid_count++] = optarg;
+			break;
+		case 'n':
+			use_network = 1;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'v':
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		default:
+			print_usage();
+			return 2;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		print_usage();
+		free(udids);
+		return 2;
+	}
+
+	enum idevice_options lookup = (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX;
+	if (udid_count > 0) {
+		for (i = 0; i < udid_count; i++) {
+			target_list_add(&targets, &target_count, udids[i], lookup);
+		}
+	} else {
+		idevice_info_t *devices = NULL;
+		int count = 0;
+		if (idevice_get_device_list_extended(&devices, &count) == IDEVICE_E_SUCCESS) {
+			for (i = 0; i < count; i++) {
+				if (devices[i]->conn_type == CONNECTION_NETWORK && !use_network) {
+					continue;
+				}
+				/* devices reachable via USB and network show up twice */
+				target_list_add(&targets, &target_count, devices[i]->udid, (devices[i]->conn_type == CONNECTION_NETWORK) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
+			}
+			idevice_device_list_extended_free(devices);
+		}
+	}
+	free(udids);
+
+	if (target_count == 0) {
+		fprintf(stderr, "ERROR: No device found.\n");
+		return 1;
+	}
+
+	/* the package is read once and shared by all upload threads */
+	if (package_open(&pkg, argv[0]) < 0) {
+		fprintf(stderr, "ERROR: Could not read package file '%s'\n", argv[0]);
+		for (i = 0; i < target_count; i++) {
+			free(targets[i].udid);
+		}
+		free(targets);
+		return 1;
+	}
+
+	printf("Installing %s (%llu bytes) on %d device%s\n", argv[0], (unsigned long long)pkg.map.length, target_count, (target_count == 1) ? "" : "s");
+
+	mutex_init(&status_mutex);
+	cond_init(&status_cond);
+
+	for (i = 0; i < target_count; i++) {
+		targets[i].pkg = &pkg;
+		mutex_lock(&status_mutex);
+		active_workers++;
+		mutex_unlock(&status_mutex);
+		if (thread_new(&targets[i].thread, install_worker, &targets[i]) != 0) {
+			mutex_lock(&status_mutex);
+			active_workers--;
+			targets[i].phase = PHASE_FAILED;
+			targets[i].error = strdup("Could not create worker thread");
+			mutex_unlock(&status_mutex);
+			targets[i].thread = (THREAD_T)0;
+		}
+	}
+
+	mutex_lock(&status_mutex);
+	while (active_workers > 0) {
+		print_progress(targets, target_count);
+		cond_wait_timeout(&status_cond, &status_mutex, PROGRESS_INTERVAL_MS);
+	}
+	print_progress(targets, target_count);
+	mutex_unlock(&status_mutex);
+
+	int failed = 0;
+	for (i = 0; i < target_count; i++) {
+		if (targets[i].thread) {
+			thread_join(targets[i].thread);
+			thread_free(targets[i].thread);
+		}
+		if (targets[i].phase != PHASE_DONE) {
+			failed++;
+		}
+	}
+
+	printf("Installed on %d of %d device%s\n", target_count - failed, target_count, (target_count == 1) ? "" : "s");
+	if (failed > 0) {
+		printf("Failed devices:\n");
+		for (i = 0; i < target_count; i++) {
+			if (targets[i].phase != PHASE_DONE) {
+				printf("  %s: %s\n", targets[i].udid, (targets[i].error) ? targets[i].error : "Unknown error");
+			}
+		}
+		res = 1;
+	}
+
+	for (i = 0; i < target_count; i++) {
+		free(targets[i].udid);
+		free(targets[i].error);
+	}
+	free(targets);
+
+	cond_destroy(&status_cond);
+	mutex_destroy(&status_mutex);
+	package_close(&pkg);
+
+	return res;
+}
@@ -0,0 +1,228 @@
+/*
+ * idevicemetrics.c
+ * Probe devices and export the library metrics in OpenMetrics format
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "idevicemetrics"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <signal.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+static volatile int quit_flag = 0;
+
+static void handle_signal(int sig)
+{
+	quit_flag = 1;
+}
+
+static void print_usage(int argc, char **argv, int is_error)
+{
+	char *name = strrchr(argv[0], '/');
+	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS]\n", (name ? name + 1: argv[0]));
+	fprintf(is_error ? stderr : stdout,
+		"\n"
+		"Connect to each device, perform a lockdown handshake and export the\n"
+		"connection, handshake and service counters in OpenMetrics format.\n"
+		"\n"
+		"Without --port the devices are probed once and the metrics are printed\n"
+		"to stdout. With --port they are probed every INTERVAL seconds and served\n"
+		"at http://127.0.0.1:PORT/metrics until interrupted.\n"
+		"\n"
+		"OPTIONS:\n"
+		"  -u, --udid UDID       only probe the device with the given UDID\n"
+		"  -n, --network         also probe network devices\n"
+		"  -p, --port PORT       serve the metrics over HTTP on PORT\n"
+		"  -i, --interval SECS   time between probes when serving (default 60)\n"
+		"  -d, --debug           enable communication debugging\n"
+		"  -h, --help            prints usage information\n"
+		"  -v, --version         prints version information\n"
+		"\n"
+		"Homepage:    <" PACKAGE_URL ">\n"
+		"Bug Reports: <" PACKAGE_BUGREPORT ">\n"
+	);
+}
+
+static void probe_device(const char *udid, enum idevice_options options)
+{
+	idevice_t device = NULL;
+	lockdownd_client_t lockdown = NULL;
+	plist_t value = NULL;
+
+	if (idevice_new_with_options(&device, udid, options) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "WARNING: Could not connect to device %s\n", udid);
+		return;
+	}
+	/* the handshake starts an SSL session, which is what gets measured */
+	if (lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME) == LOCKDOWN_E_SUCCESS) {
+		if (lockdownd_get_value(lockdown, NULL, "ProductVersion", &value) == LOCKDOWN_E_SUCCESS) {
+			plist_free(value);
+		}
+		lockdownd_client_free(lockdown);
+	} else {
+		fprintf(stderr, "WARNING: Could not connect to lockdownd on device %s\n", udid);
+	}
+	idevice_free(device);
+}
+
+static void probe_devices(const char *udid, int use_network)
+{
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	int i;
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "WARNING: Unable to retrieve device list\n");
+		return;
+	}
+	for (i = 0; i < count && !quit_flag; i++) {
+		enum idevice_options options = IDEVICE_LOOKUP_USBMUX;
+		if (udid && strcmp(devices[i]->udid, udid) != 0) {
+			continue;
+		}
+		if (devices[i]->conn_type == CONNECTION_NETWORK) {
+			if (!use_network) {
+				continue;
+			}
+			options = IDEVICE_LOOKUP_NETWORK;
+		}
+		probe_device(devices[i]->udid, options);
+	}
+	idevice_device_list_extended_free(devices);
+}
+
+static void wait_seconds(unsigned int seconds)
+{
+	while (seconds-- > 0 && !quit_flag) {
+#ifdef WIN32
+		Sleep(1000);
+#else
+		sleep(1);
+#endif
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int c = 0;
+	const char *udid = NULL;
+	int use_network = 0;
+	unsigned long port = 0;
+	unsigned int interval = 60;
+	const struct option longopts[] = {
+		{ "udid", required_argument, NULL, 'u' },
+		{ "network", no_argument, NULL, 'n' },
+		{ "port", required_argument, NULL, 'p' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "debug", no_argument, NULL, 'd' },
+		{ "help", no_argument, NULL, 'h' },
+		{ "version", no_argument, NULL, 'v' },
+		{ NULL, 0, NULL, 0}
+	};
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	while ((c = getopt_long(argc, argv, "u:np:i:dhv", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'u':
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: UDID must not be empty!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			udid = optarg;
+			break;
+		case 'n':
+			use_network = 1;
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 10);
+			if (port == 0 || port > 65535) {
+				fprintf(stderr, "ERROR: Invalid port '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'i':
+			interval = (unsigned int)strtoul(optarg, NULL, 10);
+			if (interval == 0) {
+				fprintf(stderr, "ERROR: Invalid interval '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'h':
+			print_usage(argc, argv, 0);
+			return 0;
+		case 'v':
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		default:
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+
+	if (port == 0) {
+		char *text = NULL;
+		uint32_t length = 0;
+		probe_devices(udid, use_network);
+		if (idevice_metrics_format_openmetrics(&text, &length) != IDEVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not format metrics\n");
+			return 1;
+		}
+		fwrite(text, 1, length, stdout);
+		free(text);
+		return 0;
+	}
+
+	if (idevice_metrics_serve((uint16_t)port) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not listen on port %lu\n", port);
+		return 1;
+	}
+	printf("Serving metrics at http://127.0.0.1:%lu/metrics\n", port);
+	fflush(stdout);
+
+	while (!quit_flag) {
+		probe_devices(udid, use_network);
+		wait_seconds(interval);
+	}
+
+	idevice_metrics_serve(0);
+
+	return 0;
+}
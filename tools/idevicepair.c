@@ -30,10 +30,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
-#ifndef WIN32
+#ifdef WIN32
+#include <windows.h>
+#else
 #include <signal.h>
+#include <time.h>
+#include <sys/time.h>
 #endif
 #include "common/userpref.h"
+#include "common/thread.h"
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -62,6 +67,188 @@ static void print_error_message(lockdownd_error_t err)
 	}
 }
 
+/* default and maximum number of devices handled at once with --all */
+#define BULK_DEFAULT_JOBS 8
+#define BULK_MAX_JOBS 64
+
+static const char *status_string(lockdownd_error_t err)
+{
+	switch (err) {
+		case LOCKDOWN_E_SUCCESS:
+			return "OK";
+		case LOCKDOWN_E_PASSWORD_PROTECTED:
+			return "passcode set, unlock device and retry";
+		case LOCKDOWN_E_INVALID_CONF:
+		case LOCKDOWN_E_INVALID_HOST_ID:
+			return "not paired with this host";
+		case LOCKDOWN_E_PAIRING_DIALOG_RESPONSE_PENDING:
+			return "trust dialog pending";
+		case LOCKDOWN_E_USER_DENIED_PAIRING:
+			return "user denied pairing";
+		default:
+			break;
+	}
+	return NULL;
+}
+
+static uint64_t time_ms(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+struct bulk_job {
+	char *udid;
+	int connected;
+	lockdownd_error_t result;
+	uint64_t duration;
+};
+
+struct bulk_list {
+	struct bulk_job *jobs;
+	int count;
+	int next;
+	int pair;
+	mutex_t mutex;
+};
+
+static void bulk_run_job(struct bulk_job *job, int pair)
+{
+	idevice_t device = NULL;
+	lockdownd_client_t client = NULL;
+	uint64_t start = time_ms();
+
+	if (idevice_new_with_options(&device, job->udid, IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		job->result = LOCKDOWN_E_MUX_ERROR;
+		job->duration = time_ms() - start;
+		return;
+	}
+	job->connected = 1;
+	if (pair) {
+		job->result = lockdownd_client_new(device, &client, TOOL_NAME);
+		if (job->result == LOCKDOWN_E_SUCCESS) {
+			job->result = lockdownd_pair(client, NULL);
+		}
+	} else {
+		/* the handshake only succeeds with a valid pair record */
+		job->result = lockdownd_client_new_with_handshake(device, &client, TOOL_NAME);
+	}
+	lockdownd_client_free(client);
+	idevice_free(device);
+	job->duration = time_ms() - start;
+}
+
+static void* bulk_worker(void *arg)
+{
+	struct bulk_list *list = (struct bulk_list*)arg;
+	while (1) {
+		mutex_lock(&list->mutex);
+		int idx = list->next++;
+		mutex_unlock(&list->mutex);
+		if (idx >= list->count) {
+			break;
+		}
+		bulk_run_job(&list->jobs[idx], list->pair);
+	}
+	return NULL;
+}
+
+/* pairs or validates all devices attached via USB with up to jobs devices
+ * at once and prints a status table */
+static int bulk_operation(int pair, int jobs)
+{
+	idevice_info_t *devices = NULL;
+	int num_devices = 0;
+	struct bulk_list list;
+	THREAD_T workers[BULK_MAX_JOBS];
+	int started = 0;
+	int failed = 0;
+	int i, j;
+
+	if (idevice_get_device_list_extended(&devices, &num_devices) != IDEVICE_E_SUCCESS) {
+		printf("ERROR: Unable to retrieve device list!\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(&list, '\0', sizeof(list));
+	list.jobs = (struct bulk_job*)calloc(num_devices + 1, sizeof(struct bulk_job));
+	list.pair = pair;
+	for (i = 0; i < num_devices; i++) {
+		if (devices[i]->conn_type != CONNECTION_USBMUXD) {
+			continue;
+		}
+		for (j = 0; j < list.count && strcmp(list.jobs[j].udid, devices[i]->udid) != 0; j++);
+		if (j < list.count) {
+			continue;
+		}
+		list.jobs[list.count++].udid = strdup(devices[i]->udid);
+	}
+	idevice_device_list_extended_free(devices);
+
+	if (list.count == 0) {
+		printf("No device found.\n");
+		free(list.jobs);
+		return EXIT_FAILURE;
+	}
+
+	if (pair) {
+		/* generate the host keys of all pair records in the background
+		 * while the first devices are being connected */
+		unsigned int key_workers = (jobs < 16) ? jobs : 16;
+		lockdownd_set_pair_key_pool((list.count < 256) ? list.count : 256, key_workers);
+	}
+
+	mutex_init(&list.mutex);
+	int num_workers = (list.count < jobs) ? list.count : jobs;
+	for (i = 1; i < num_workers; i++) {
+		if (thread_new(&workers[started], bulk_worker, &list) != 0) {
+			break;
+		}
+		started++;
+	}
+	bulk_worker(&list);
+	for (i = 0; i < started; i++) {
+		thread_join(workers[i]);
+		thread_free(workers[i]);
+	}
+	mutex_destroy(&list.mutex);
+
+	if (pair) {
+		lockdownd_set_pair_key_pool(0, 0);
+	}
+
+	printf("%-40s  %8s  %s\n", "UDID", "TIME", "STATUS");
+	for (i = 0; i < list.count; i++) {
+		struct bulk_job *job = &list.jobs[i];
+		const char *status = status_string(job->result);
+		char buf[64];
+		if (!job->connected) {
+			status = "could not connect";
+		} else if (!status) {
+			snprintf(buf, sizeof(buf), "error %d", job->result);
+			status = buf;
+		}
+		if (job->result != LOCKDOWN_E_SUCCESS) {
+			failed++;
+		}
+		printf("%-40s  %6.1fs  %s\n", job->udid, (double)job->duration / 1000.0, status);
+		free(job->udid);
+	}
+	printf("%s %d of %d devices\n", (pair) ? "Paired" : "Validated", list.count - failed, list.count);
+	free(list.jobs);
+
+	return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 static void print_usage(int argc, char **argv)
 {
 	char *name = NULL;
@@ -81,6 +268,8 @@ static void print_usage(int argc, char **argv)
 	printf("\n");
 	printf("The following OPTIONS are accepted:\n");
 	printf("  -u, --udid UDID  target specific device by UDID\n");
+	printf("  -a, --all        pair or validate all devices attached via USB\n");
+	printf("  -j, --jobs N     number of devices handled at once with --all (default %d)\n", BULK_DEFAULT_JOBS);
 	printf("  -d, --debug      enable communication debugging\n");
 	printf("  -h, --help       prints usage information\n");
 	printf("  -v, --version    prints version information\n");
@@ -95,6 +284,8 @@ int main(int argc, char **argv)
 	static struct option longopts[] = {
 		{ "help",    no_argument,       NULL, 'h' },
 		{ "udid",    required_argument, NULL, 'u' },
+		{ "all",     no_argument,       NULL, 'a' },
+		{ "jobs",    required_argument, NULL, 'j' },
 		{ "debug",   no_argument,       NULL, 'd' },
 		{ "version", no_argument,       NULL, 'v' },
 		{ NULL, 0, NULL, 0}
@@ -104,6 +295,8 @@ int main(int argc, char **argv)
 	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
 	lockdownd_error_t lerr;
 	int result;
+	int all = 0;
+	int jobs = BULK_DEFAULT_JOBS;
 
 	char *type = NULL;
 	char *cmd;
@@ -112,7 +305,7 @@ int main(int argc, char **argv)
 	} op_t;
 	op_t op = OP_NONE;
 
-	while ((c = getopt_long(argc, argv, "hu:dv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hu:aj:dv", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			print_usage(argc, argv);
@@ -127,6 +320,17 @@ int main(int argc, char **argv)
 			free(udid);
 			udid = strdup(optarg);
 			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1 || jobs > BULK_MAX_JOBS) {
+				fprintf(stderr, "ERROR: Number of jobs must be between 1 and %d\n", BULK_MAX_JOBS);
+				result = EXIT_FAILURE;
+				goto leave;
+			}
+			break;
 		case 'd':
 			idevice_set_debug_level(1);
 			break;
@@ -172,6 +376,16 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (all) {
+		if ((op != OP_PAIR && op != OP_VALIDATE) || udid) {
+			printf("ERROR: --all can only be used with the pair and validate commands and without --udid\n");
+			result = EXIT_FAILURE;
+			goto leave;
+		}
+		result = bulk_operation(op == OP_PAIR, jobs);
+		goto leave;
+	}
+
 	if (op == OP_SYSTEMBUID) {
 		char *systembuid = NULL;
 		userpref_read_system_buid(&systembuid);
@@ -56,8 +56,8 @@ static void print_usage(int argc, char **argv)
 	printf("Manage provisioning profiles on a device.\n");
 	printf("\n");
 	printf("Where COMMAND is one of:\n");
-	printf("  install FILE\tInstalls the provisioning profile specified by FILE.\n");
-	printf("              \tA valid .mobileprovision file is expected.\n");
+	printf("  install FILE [FILE...]  Installs the provisioning profiles specified by\n");
+	printf("              \tFILE. A valid .mobileprovision file is expected.\n");
 	printf("  list\t\tGet a list of all provisioning profiles on the device.\n");
 	printf("  copy PATH\tRetrieves all provisioning profiles from the device and\n");
 	printf("           \tstores them into the existing directory specified by PATH.\n");
@@ -65,7 +65,7 @@ static void print_usage(int argc, char **argv)
 	printf("  copy UUID PATH  Retrieves the provisioning profile identified by UUID\n");
 	printf("           \tfrom the device and stores it into the existing directory\n");
 	printf("           \tspecified by PATH. The file will be stored as UUID.mobileprovision.\n");
-	printf("  remove UUID\tRemoves the provisioning profile identified by UUID.\n");
+	printf("  remove UUID [UUID...]  Removes the provisioning profiles identified by UUID.\n");
 	printf("  remove-all\tRemoves all installed provisioning profiles.\n");
 	printf("  dump FILE\tPrints detailed information about the provisioning profile\n");
 	printf("           \tspecified by FILE.\n");
@@ -287,6 +287,75 @@ static int profile_read_from_file(const char* path, unsigned char **profile_data
 	return 0;
 }
 
+struct profile_list_ctx {
+	int copy;
+	const char* uuid;
+	const char* path;
+	int index;
+	int found_match;
+};
+
+static int profile_list_cb(const char* data, uint64_t size, const misagent_profile_info_t* info, void* user_data)
+{
+	struct profile_list_ctx* ctx = (struct profile_list_ctx*)user_data;
+	int index = ctx->index++;
+
+	if (ctx->uuid) {
+		if (strcmp(info->uuid, ctx->uuid) != 0) {
+			return 0;
+		}
+		ctx->found_match = 1;
+	}
+	printf("%s - %s\n", (info->uuid[0]) ? info->uuid : "(unknown id)", (info->name[0]) ? info->name : "(no name)");
+	if (ctx->copy) {
+		char pfname[512];
+		if (info->uuid[0]) {
+			snprintf(pfname, sizeof(pfname), "%s/%s.mobileprovision", ctx->path, info->uuid);
+		} else {
+			snprintf(pfname, sizeof(pfname), "%s/profile%d.mobileprovision", ctx->path, index);
+		}
+		FILE* f = fopen(pfname, "wb");
+		if (f) {
+			fwrite(data, 1, size, f);
+			fclose(f);
+			printf(" => %s\n", pfname);
+		} else {
+			fprintf(stderr, "Could not open '%s' for writing: %s\n", pfname, strerror(errno));
+		}
+	}
+
+	return ctx->found_match;
+}
+
+struct profile_remove_ctx {
+	const char** uuids;
+	char** owned_uuids;
+	char** names;
+	int count;
+	int capacity;
+};
+
+static int profile_collect_cb(const char* data, uint64_t size, const misagent_profile_info_t* info, void* user_data)
+{
+	struct profile_remove_ctx* ctx = (struct profile_remove_ctx*)user_data;
+	(void)data;
+	(void)size;
+
+	if (!info->uuid[0]) {
+		return 0;
+	}
+	if (ctx->count == ctx->capacity) {
+		ctx->capacity = (ctx->capacity) ? ctx->capacity * 2 : 16;
+		ctx->owned_uuids = (char**)realloc(ctx->owned_uuids, sizeof(char*) * ctx->capacity);
+		ctx->names = (char**)realloc(ctx->names, sizeof(char*) * ctx->capacity);
+	}
+	ctx->owned_uuids[ctx->count] = strdup(info->uuid);
+	ctx->names[ctx->count] = strdup(info->name);
+	ctx->count++;
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	lockdownd_client_t client = NULL;
@@ -301,6 +370,8 @@ int main(int argc, char *argv[])
 	const char* udid = NULL;
 	const char* param = NULL;
 	const char* param2 = NULL;
+	const char** params = NULL;
+	int num_params = 0;
 	int use_network = 0;
 
 #ifndef WIN32
@@ -332,6 +403,11 @@ int main(int argc, char *argv[])
 				return 0;
 			}
 			param = argv[i];
+			params = (const char**)&argv[i];
+			while (argv[i+1] && argv[i+1][0] != '-') {
+				i++;
+			}
+			num_params = &argv[i] - (char**)params + 1;
 			op = OP_INSTALL;
 			continue;
 		}
@@ -359,6 +435,11 @@ int main(int argc, char *argv[])
 				return 0;
 			}
 			param = argv[i];
+			params = (const char**)&argv[i];
+			while (argv[i+1] && argv[i+1][0] != '-') {
+				i++;
+			}
+			num_params = &argv[i] - (char**)params + 1;
 			op = OP_REMOVE;
 			continue;
 		}
@@ -506,90 +587,58 @@ int main(int argc, char *argv[])
 	switch (op) {
 		case OP_INSTALL:
 		{
-			unsigned char* profile_data = NULL;
-			unsigned int profile_size = 0;
-			if (profile_read_from_file(param, &profile_data, &profile_size) != 0) {
-				break;
+			plist_t profiles = plist_new_array();
+			const char** names = (const char**)malloc(sizeof(char*) * num_params);
+			int num_names = 0;
+			for (i = 0; i < num_params; i++) {
+				unsigned char* profile_data = NULL;
+				unsigned int profile_size = 0;
+				if (profile_read_from_file(params[i], &profile_data, &profile_size) != 0) {
+					res = -1;
+					continue;
+				}
+				uint64_t psize = profile_size;
+				plist_array_append_item(profiles, plist_new_data((const char*)profile_data, psize));
+				free(profile_data);
+				names[num_names++] = params[i];
 			}
 
-			uint64_t psize = profile_size;
-			plist_t pdata = plist_new_data((const char*)profile_data, psize);
-			free(profile_data);
-
-			if (misagent_install(mis, pdata) == MISAGENT_E_SUCCESS) {
-				printf("Profile '%s' installed successfully.\n", param);
-			} else {
-				int sc = misagent_get_status_code(mis);
-				fprintf(stderr, "Could not install profile '%s', status code: 0x%x\n", param, sc);
+			if (num_names > 0) {
+				int* status_codes = (int*)malloc(sizeof(int) * num_names);
+				misagent_error_t merr = misagent_install_multiple(mis, profiles, status_codes);
+				if (merr == MISAGENT_E_SUCCESS || merr == MISAGENT_E_REQUEST_FAILED) {
+					for (i = 0; i < num_names; i++) {
+						if (status_codes[i] == 0) {
+							printf("Profile '%s' installed successfully.\n", names[i]);
+						} else {
+							fprintf(stderr, "Could not install profile '%s', status code: 0x%x\n", names[i], status_codes[i]);
+							res = -1;
+						}
+					}
+				} else {
+					fprintf(stderr, "Could not install profiles, error %d\n", merr);
+					res = -1;
+				}
+				free(status_codes);
 			}
+			free(names);
+			plist_free(profiles);
 		}
 			break;
 		case OP_LIST:
 		case OP_COPY:
 		{
-			plist_t profiles = NULL;
-			misagent_error_t merr;
-			if (product_version < 0x090300) {
-				merr = misagent_copy(mis, &profiles);
-			} else {
-				merr = misagent_copy_all(mis, &profiles);
-			}
+			struct profile_list_ctx ctx;
+			memset(&ctx, '\0', sizeof(ctx));
+			ctx.copy = (op == OP_COPY);
+			ctx.uuid = (param2) ? param : NULL;
+			ctx.path = (param2) ? param2 : param;
+			misagent_error_t merr = misagent_profiles_foreach(mis, (product_version >= 0x090300), profile_list_cb, &ctx);
 			if (merr == MISAGENT_E_SUCCESS) {
-				int found_match = 0;
-				uint32_t num_profiles = plist_array_get_size(profiles);
 				if (op == OP_LIST || !param2) {
-					printf("Device has %d provisioning %s installed:\n", num_profiles, (num_profiles == 1) ? "profile" : "profiles");
-				}
-				uint32_t j;
-				for (j = 0; !found_match && j < num_profiles; j++) {
-					char* p_name = NULL;
-					char* p_uuid = NULL;
-					plist_t profile = plist_array_get_item(profiles, j);
-					plist_t pl = profile_get_embedded_plist(profile);
-					if (pl && (plist_get_node_type(pl) == PLIST_DICT)) {
-						plist_t node;
-						node = plist_dict_get_item(pl, "Name");
-						if (node && (plist_get_node_type(node) == PLIST_STRING)) {
-							plist_get_string_val(node, &p_name);
-						}
-						node = plist_dict_get_item(pl, "UUID");
-						if (node && (plist_get_node_type(node) == PLIST_STRING)) {
-							plist_get_string_val(node, &p_uuid);
-						}
-					}
-					if (param2) {
-						if (p_uuid && !strcmp(p_uuid, param)) {
-							found_match = 1;
-						} else {
-							free(p_uuid);
-							free(p_name);
-							continue;
-						}
-					}
-					printf("%s - %s\n", (p_uuid) ? p_uuid : "(unknown id)", (p_name) ? p_name : "(no name)");
-					if (op == OP_COPY) {
-						char pfname[512];
-						if (p_uuid) {
-							sprintf(pfname, "%s/%s.mobileprovision", (param2) ? param2 : param, p_uuid);
-						} else {
-							sprintf(pfname, "%s/profile%d.mobileprovision", (param2) ? param2 : param, j);
-						}
-						FILE* f = fopen(pfname, "wb");
-						if (f) {
-							char* dt = NULL;
-							uint64_t ds = 0;
-							plist_get_data_val(profile, &dt, &ds);
-							fwrite(dt, 1, ds, f);
-							fclose(f);
-							printf(" => %s\n", pfname);
-						} else {
-							fprintf(stderr, "Could not open '%s' for writing: %s\n", pfname, strerror(errno));
-						}
-					}
-					free(p_uuid);
-					free(p_name);
+					printf("Device has %d provisioning %s installed.\n", ctx.index, (ctx.index == 1) ? "profile" : "profiles");
 				}
-				if (param2 && !found_match) {
+				if (param2 && !ctx.found_match) {
 					fprintf(stderr, "Profile '%s' was not found on the device.\n", param);
 					res = -1;
 				}
@@ -598,66 +647,68 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "Could not get installed profiles from device, status code: 0x%x\n", sc);
 				res = -1;
 			}
-			plist_free(profiles);
 		}
 			break;
 		case OP_REMOVE:
+		{
+			struct profile_remove_ctx ctx;
+			memset(&ctx, '\0', sizeof(ctx));
 			if (param) {
-				/* remove specified provisioning profile */
-				if (misagent_remove(mis, param) == MISAGENT_E_SUCCESS) {
-					printf("Profile '%s' removed.\n", param);
-				} else {
-					int sc = misagent_get_status_code(mis);
-					fprintf(stderr, "Could not remove profile '%s', status code 0x%x\n", param, sc);
-				}
+				/* remove specified provisioning profiles */
+				ctx.uuids = params;
+				ctx.count = num_params;
 			} else {
 				/* remove all provisioning profiles */
-				plist_t profiles = NULL;
-				misagent_error_t merr;
-				if (product_version < 0x090300) {
-					merr = misagent_copy(mis, &profiles);
-				} else {
-					merr = misagent_copy_all(mis, &profiles);
+				misagent_error_t merr = misagent_profiles_foreach(mis, (product_version >= 0x090300), profile_collect_cb, &ctx);
+				if (merr != MISAGENT_E_SUCCESS) {
+					int sc = misagent_get_status_code(mis);
+					fprintf(stderr, "Could not get installed profiles from device, status code: 0x%x\n", sc);
+					res = -1;
+					break;
 				}
-				if (merr == MISAGENT_E_SUCCESS) {
-					uint32_t j;
-					uint32_t num_removed = 0;
-					for (j = 0; j < plist_array_get_size(profiles); j++) {
-						char* p_name = NULL;
-						char* p_uuid = NULL;
-						plist_t profile = plist_array_get_item(profiles, j);
-						plist_t pl = profile_get_embedded_plist(profile);
-						if (pl && (plist_get_node_type(pl) == PLIST_DICT)) {
-							plist_t node;
-							node = plist_dict_get_item(pl, "Name");
-							if (node && (plist_get_node_type(node) == PLIST_STRING)) {
-								plist_get_string_val(node, &p_name);
-							}
-							node = plist_dict_get_item(pl, "UUID");
-							if (node && (plist_get_node_type(node) == PLIST_STRING)) {
-								plist_get_string_val(node, &p_uuid);
+				ctx.uuids = (const char**)ctx.owned_uuids;
+			}
+			if (ctx.count > 0) {
+				int* status_codes = (int*)malloc(sizeof(int) * ctx.count);
+				misagent_error_t merr = misagent_remove_multiple(mis, ctx.uuids, ctx.count, status_codes);
+				if (merr == MISAGENT_E_SUCCESS || merr == MISAGENT_E_REQUEST_FAILED) {
+					int num_removed = 0;
+					for (i = 0; i < ctx.count; i++) {
+						const char* p_name = (ctx.names && ctx.names[i][0]) ? ctx.names[i] : NULL;
+						if (status_codes[i] == 0) {
+							if (param) {
+								printf("Profile '%s' removed.\n", ctx.uuids[i]);
+							} else {
+								printf("OK profile removed: %s - %s\n", ctx.uuids[i], (p_name) ? p_name : "(no name)");
 							}
-						}
-						if (p_uuid) {
-							if (misagent_remove(mis, p_uuid) == MISAGENT_E_SUCCESS) {
-								printf("OK profile removed: %s - %s\n", p_uuid, (p_name) ? p_name : "(no name)");
-								num_removed++;
+							num_removed++;
+						} else {
+							if (param) {
+								fprintf(stderr, "Could not remove profile '%s', status code 0x%x\n", ctx.uuids[i], status_codes[i]);
 							} else {
-								int sc = misagent_get_status_code(mis);
-								printf("FAIL profile not removed: %s - %s (status code 0x%x)\n", p_uuid, (p_name) ? p_name : "(no name)", sc);
+								printf("FAIL profile not removed: %s - %s (status code 0x%x)\n", ctx.uuids[i], (p_name) ? p_name : "(no name)", status_codes[i]);
 							}
+							res = -1;
 						}
-						free(p_name);
-						free(p_uuid);
 					}
-					printf("%d profiles removed.\n", num_removed);
+					if (!param) {
+						printf("%d profiles removed.\n", num_removed);
+					}
 				} else {
-					int sc = misagent_get_status_code(mis);
-					fprintf(stderr, "Could not get installed profiles from device, status code: 0x%x\n", sc);
+					fprintf(stderr, "Could not remove profiles, error %d\n", merr);
 					res = -1;
 				}
-				plist_free(profiles);
+				free(status_codes);
+			} else if (!param) {
+				printf("0 profiles removed.\n");
 			}
+			for (i = 0; i < ctx.count && ctx.owned_uuids; i++) {
+				free(ctx.owned_uuids[i]);
+				free(ctx.names[i]);
+			}
+			free(ctx.owned_uuids);
+			free(ctx.names);
+		}
 			break;
 		default:
 			break;
@@ -31,9 +31,8 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
-#ifndef WIN32
 #include <signal.h>
-#endif
+#include <sys/time.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -42,6 +41,99 @@
 void get_image_filename(char *imgdata, char **filename);
 void print_usage(int argc, char **argv);
 
+static int quit_flag = 0;
+
+static void clean_exit(int sig)
+{
+	quit_flag++;
+}
+
+static uint64_t time_now_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* builds "PREFIX-NNNNN.EXT" for frame seq, keeping an extension given in prefix */
+static char* get_frame_filename(const char *imgdata, const char *prefix, uint64_t seq)
+{
+	const char *fileext = NULL;
+	size_t prefix_len = strlen(prefix);
+	const char *last_dot = strrchr(prefix, '.');
+	if (last_dot && !strchr(last_dot, '/')) {
+		fileext = last_dot;
+		prefix_len = last_dot - prefix;
+	} else if (memcmp(imgdata, "\x89PNG", 4) == 0) {
+		fileext = ".png";
+	} else if (memcmp(imgdata, "MM\x00*", 4) == 0) {
+		fileext = ".tiff";
+	} else {
+		fileext = ".dat";
+	}
+	char *filename = (char*)malloc(prefix_len + strlen(fileext) + 24);
+	sprintf(filename, "%.*s-%05llu%s", (int)prefix_len, prefix, (unsigned long long)seq, fileext);
+	return filename;
+}
+
+/* captures frames at the given interval until count frames were saved or the tool is interrupted */
+static int capture_frames(screenshotr_client_t shotr, const char *prefix, unsigned int interval, unsigned int count)
+{
+	screenshotr_frame_t frame;
+	uint64_t start = time_now_ms();
+	uint64_t latency_sum = 0;
+	uint64_t saved = 0;
+	int result = 0;
+
+	signal(SIGINT, clean_exit);
+	signal(SIGTERM, clean_exit);
+
+	while (!quit_flag && (count == 0 || saved < count)) {
+		/* without an interval keep one request ahead of the frame being received */
+		int prefetch = (interval == 0) && (count == 0 || saved + 1 < count);
+		if (screenshotr_stream_next_frame(shotr, &frame, prefetch) != SCREENSHOTR_E_SUCCESS) {
+			printf("Could not get screenshot!\n");
+			result = -1;
+			break;
+		}
+		char *filename = get_frame_filename(frame.data, prefix, frame.sequence + 1);
+		FILE *f = fopen(filename, "wb");
+		if (!f || fwrite(frame.data, 1, (size_t)frame.size, f) != (size_t)frame.size) {
+			printf("Could not save screenshot to file %s!\n", filename);
+			if (f)
+				fclose(f);
+			free(filename);
+			result = -1;
+			break;
+		}
+		fclose(f);
+		saved++;
+		latency_sum += frame.latency_us;
+		printf("Frame %llu saved to %s (%llu bytes, latency %llu ms)\n", (unsigned long long)saved, filename, (unsigned long long)frame.size, (unsigned long long)(frame.latency_us / 1000));
+		free(filename);
+
+		if (interval > 0) {
+			/* pace against the start time so that delays do not add up */
+			uint64_t next = start + saved * interval;
+			uint64_t now = time_now_ms();
+			while (!quit_flag && now < next) {
+				uint64_t wait = next - now;
+				usleep((useconds_t)((wait > 100) ? 100 : wait) * 1000);
+				now = time_now_ms();
+			}
+		}
+	}
+	screenshotr_stream_stop(shotr);
+
+	uint64_t elapsed = time_now_ms() - start;
+	if (saved > 0) {
+		printf("Captured %llu frames in %llu ms (%.2f fps, average latency %llu ms)\n", (unsigned long long)saved, (unsigned long long)elapsed,
+			(elapsed > 0) ? (double)saved * 1000.0 / (double)elapsed : 0.0, (unsigned long long)(latency_sum / saved / 1000));
+	}
+
+	return result;
+}
+
 int main(int argc, char **argv)
 {
 	idevice_t device = NULL;
@@ -54,6 +146,9 @@ int main(int argc, char **argv)
 	const char *udid = NULL;
 	int use_network = 0;
 	char *filename = NULL;
+	int continuous = 0;
+	unsigned int interval = 0;
+	unsigned int count = 0;
 
 #ifndef WIN32
 	signal(SIGPIPE, SIG_IGN);
@@ -77,6 +172,26 @@ int main(int argc, char **argv)
 			use_network = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--interval")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			interval = (unsigned int)strtoul(argv[i], NULL, 10);
+			continuous = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--count")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			count = (unsigned int)strtoul(argv[i], NULL, 10);
+			continuous = 1;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -115,6 +230,17 @@ int main(int argc, char **argv)
 	if (service && service->port > 0) {
 		if (screenshotr_client_new(device, service, &shotr) != SCREENSHOTR_E_SUCCESS) {
 			printf("Could not connect to screenshotr!\n");
+		} else if (continuous) {
+			char *prefix = filename;
+			if (!prefix) {
+				time_t now = time(NULL);
+				prefix = (char*)malloc(32);
+				strftime(prefix, 31, "screenshot-%Y-%m-%d-%H-%M-%S", gmtime(&now));
+			}
+			result = capture_frames(shotr, prefix, interval, count);
+			if (prefix != filename)
+				free(prefix);
+			screenshotr_client_free(shotr);
 		} else {
 			char *imgdata = NULL;
 			uint64_t imgsize = 0;
@@ -225,8 +351,14 @@ void print_usage(int argc, char **argv)
 	printf("NOTE: A mounted developer disk image is required on the device, otherwise\n");
 	printf("the screenshotr service is not available.\n");
 	printf("\n");
+	printf("With --interval or --count, frames are captured continuously over one\n");
+	printf("connection and saved as \"FILE-NNNNN\" with the frame number appended.\n");
+	printf("\n");
 	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
 	printf("  -n, --network\t\tconnect to network device\n");
+	printf("  -i, --interval MS\tcapture a frame every MS milliseconds, 0 for as fast as\n");
+	printf("                   \tpossible\n");
+	printf("  -c, --count N\t\tstop after N frames, by default continue until interrupted\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -30,20 +30,51 @@
 #include <string.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
+#include <math.h>
+#include <ctype.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/time.h>
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
-#include <libimobiledevice/lockdown.h>
-#include <libimobiledevice/service.h>
+#include <libimobiledevice/location_simulation.h>
 
-#include <endianness.h>
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
-#define DT_SIMULATELOCATION_SERVICE "com.apple.dt.simulatelocation"
+#define EARTH_RADIUS 6371000.0
 
 enum {
 	SET_LOCATION = 0,
-	RESET_LOCATION = 1
+	RESET_LOCATION = 1,
+	PLAY_ROUTE = 2
+};
+
+struct route_point {
+	double lat;
+	double lon;
+	double time; /* seconds since the first point */
+	int has_time;
+};
+
+struct route {
+	struct route_point *points;
+	unsigned int count;
+	unsigned int capacity;
 };
 
+static volatile int quit_flag = 0;
+
+static void handle_signal(int sig)
+{
+	quit_flag = 1;
+}
+
 static void print_usage(int argc, char **argv, int is_error)
 {
 	char *bname = strrchr(argv[0], '/');
@@ -51,35 +82,405 @@ static void print_usage(int argc, char **argv, int is_error)
 
 	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS] -- <LAT> <LONG>\n", bname);
 	fprintf(is_error ? stderr : stdout, "       %s [OPTIONS] reset\n", bname);
+	fprintf(is_error ? stderr : stdout, "       %s [OPTIONS] --route FILE\n", bname);
 	fprintf(is_error ? stderr : stdout, "\n" \
 		"OPTIONS:\n" \
-		"  -u, --udid UDID    target specific device by UDID\n" \
-		"  -n, --network      connect to network device\n" \
-		"  -d, --debug        enable communication debugging\n" \
-		"  -h, --help         prints usage information\n" \
-		"  -v, --version      prints version information\n" \
+		"  -u, --udid UDID       target specific device by UDID\n" \
+		"  -n, --network         connect to network device\n" \
+		"  -r, --route FILE      play back a GPX or CSV track over one connection\n" \
+		"  -i, --interval MS     time between location updates (default 1000)\n" \
+		"  -s, --speed M/S       speed for tracks without timestamps (default 10)\n" \
+		"  -l, --loop            restart the track when it ends\n" \
+		"  -d, --debug           enable communication debugging\n" \
+		"  -h, --help            prints usage information\n" \
+		"  -v, --version         prints version information\n" \
+		"\n" \
+		"CSV tracks have one point per line as LAT,LONG or LAT,LONG,TIME where\n" \
+		"TIME is in seconds or an ISO 8601 timestamp. Positions between the\n" \
+		"points of the track are interpolated.\n" \
 		"\n" \
 		"Homepage:    <" PACKAGE_URL ">\n" \
 		"Bug Reports: <" PACKAGE_BUGREPORT ">\n"
 	);
 }
 
+static uint64_t time_ms(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+static void sleep_ms(unsigned int ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static int route_add(struct route *route, double lat, double lon, double time, int has_time)
+{
+	if (lat < -90.0 || lat > 90.0 || lon < -180.0 || lon > 180.0) {
+		return -1;
+	}
+	if (route->count == route->capacity) {
+		unsigned int capacity = (route->capacity) ? route->capacity * 2 : 256;
+		struct route_point *points = (struct route_point*)realloc(route->points, sizeof(struct route_point) * capacity);
+		if (!points) {
+			return -1;
+		}
+		route->points = points;
+		route->capacity = capacity;
+	}
+	route->points[route->count].lat = lat;
+	route->points[route->count].lon = lon;
+	route->points[route->count].time = time;
+	route->points[route->count].has_time = has_time;
+	route->count++;
+	return 0;
+}
+
+/* days since 1970-01-01 of a date in the proleptic Gregorian calendar */
+static long days_from_civil(long y, unsigned int m, unsigned int d)
+{
+	y -= (m <= 2);
+	long era = (y >= 0 ? y : y - 399) / 400;
+	unsigned long yoe = (unsigned long)(y - era * 400);
+	unsigned long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	unsigned long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (long)doe - 719468;
+}
+
+/* parses an ISO 8601 timestamp like 2020-05-01T12:30:00.5Z into seconds
+ * since the epoch */
+static int parse_timestamp(const char *str, double *seconds)
+{
+	int year, month, day, hour, minute, n = 0;
+	double second;
+
+	if (sscanf(str, "%d-%d-%dT%d:%d:%lf%n", &year, &month, &day, &hour, &minute, &second, &n) != 6) {
+		return -1;
+	}
+	if (month < 1 || month > 12 || day < 1 || day > 31) {
+		return -1;
+	}
+	*seconds = (double)days_from_civil(year, month, day) * 86400.0 + hour * 3600 + minute * 60 + second;
+
+	str += n;
+	if (*str == '+' || *str == '-') {
+		int oh = 0, om = 0;
+		if (sscanf(str + 1, "%d:%d", &oh, &om) >= 1) {
+			int offset = oh * 3600 + om * 60;
+			*seconds -= (*str == '+') ? offset : -offset;
+		}
+	}
+	return 0;
+}
+
+static int parse_time(const char *str, double *seconds)
+{
+	char *end = NULL;
+
+	while (isspace((unsigned char)*str)) {
+		str++;
+	}
+	if (strchr(str, 'T')) {
+		return parse_timestamp(str, seconds);
+	}
+	*seconds = strtod(str, &end);
+	return (end == str) ? -1 : 0;
+}
+
+static int route_load_csv(struct route *route, FILE *f)
+{
+	char line[1024];
+	unsigned int lineno = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line;
+		char *end = NULL;
+		double lat, lon, time = 0;
+		int has_time = 0;
+
+		lineno++;
+		while (isspace((unsigned char)*p)) {
+			p++;
+		}
+		/* skip empty lines, comments and a header line */
+		if (*p == '\0' || *p == '#' || !(isdigit((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.')) {
+			continue;
+		}
+		lat = strtod(p, &end);
+		p = end;
+		while (*p == ',' || *p == ';' || *p == ' ' || *p == '\t') {
+			p++;
+		}
+		lon = strtod(p, &end);
+		if (end == p) {
+			fprintf(stderr, "ERROR: Invalid point on line %u\n", lineno);
+			return -1;
+		}
+		p = end;
+		while (*p == ',' || *p == ';' || *p == ' ' || *p == '\t') {
+			p++;
+		}
+		if (*p != '\0' && *p != '\r' && *p != '\n') {
+			if (parse_time(p, &time) < 0) {
+				fprintf(stderr, "ERROR: Invalid time on line %u\n", lineno);
+				return -1;
+			}
+			has_time = 1;
+		}
+		if (route_add(route, lat, lon, time, has_time) < 0) {
+			fprintf(stderr, "ERROR: Invalid coordinates on line %u\n", lineno);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int gpx_get_attribute(const char *tag, const char *tag_end, const char *name, double *value)
+{
+	size_t len = strlen(name);
+	const char *p = tag;
+
+	while ((p = strstr(p, name)) && p < tag_end) {
+		const char *q = p + len;
+		if (isspace((unsigned char)p[-1]) && *q == '=' && (q[1] == '"' || q[1] == '\'')) {
+			*value = strtod(q + 2, NULL);
+			return 0;
+		}
+		p = q;
+	}
+	return -1;
+}
+
+static int route_load_gpx(struct route *route, const char *data)
+{
+	static const char *elements[] = { "<trkpt", "<rtept", "<wpt", NULL };
+	int i;
+
+	/* use track points, or route points or waypoints if there are none */
+	for (i = 0; elements[i] && route->count == 0; i++) {
+		const char *p = data;
+		while ((p = strstr(p, elements[i]))) {
+			const char *tag_end = strchr(p, '>');
+			double lat = 0, lon = 0, time = 0;
+			int has_time = 0;
+			if (!tag_end) {
+				break;
+			}
+			if (gpx_get_attribute(p, tag_end, "lat", &lat) < 0 || gpx_get_attribute(p, tag_end, "lon", &lon) < 0) {
+				fprintf(stderr, "ERROR: GPX point without coordinates\n");
+				return -1;
+			}
+			if (tag_end[-1] != '/') {
+				/* look for the timestamp up to the closing tag */
+				char close_tag[16];
+				snprintf(close_tag, sizeof(close_tag), "</%s", elements[i] + 1);
+				const char *close = strstr(tag_end, close_tag);
+				const char *t = strstr(tag_end, "<time>");
+				if (t && (!close || t < close) && parse_timestamp(t + 6, &time) == 0) {
+					has_time = 1;
+				}
+			}
+			if (route_add(route, lat, lon, time, has_time) < 0) {
+				fprintf(stderr, "ERROR: Invalid GPX coordinates\n");
+				return -1;
+			}
+			p = tag_end;
+		}
+	}
+	return 0;
+}
+
+static double distance(const struct route_point *a, const struct route_point *b)
+{
+	double lat1 = a->lat * M_PI / 180.0;
+	double lat2 = b->lat * M_PI / 180.0;
+	double dlat = lat2 - lat1;
+	double dlon = (b->lon - a->lon) * M_PI / 180.0;
+	double h = sin(dlat / 2) * sin(dlat / 2) + cos(lat1) * cos(lat2) * sin(dlon / 2) * sin(dlon / 2);
+	return 2 * EARTH_RADIUS * atan2(sqrt(h), sqrt(1 - h));
+}
+
+static int route_load(struct route *route, const char *filename, double speed)
+{
+	FILE *f = fopen(filename, "rb");
+	char *data = NULL;
+	size_t size = 0;
+	int res = 0;
+	unsigned int i;
+
+	if (!f) {
+		fprintf(stderr, "ERROR: Could not open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = (size_t)ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = (char*)malloc(size + 1);
+	if (!data || fread(data, 1, size, f) != size) {
+		fprintf(stderr, "ERROR: Could not read %s\n", filename);
+		free(data);
+		fclose(f);
+		return -1;
+	}
+	data[size] = '\0';
+
+	if (strstr(data, "<gpx")) {
+		res = route_load_gpx(route, data);
+	} else {
+		fseek(f, 0, SEEK_SET);
+		res = route_load_csv(route, f);
+	}
+	free(data);
+	fclose(f);
+	if (res < 0) {
+		return -1;
+	}
+	if (route->count == 0) {
+		fprintf(stderr, "ERROR: %s does not contain any points\n", filename);
+		return -1;
+	}
+
+	/* use the timestamps of the track if all points have one, otherwise
+	 * move along it at a constant speed */
+	for (i = 0; i < route->count && route->points[i].has_time; i++);
+	if (i == route->count) {
+		double start = route->points[0].time;
+		for (i = 0; i < route->count; i++) {
+			route->points[i].time -= start;
+			if (i > 0 && route->points[i].time < route->points[i-1].time) {
+				fprintf(stderr, "ERROR: Timestamps of %s are not in order\n", filename);
+				return -1;
+			}
+		}
+	} else {
+		route->points[0].time = 0;
+		for (i = 1; i < route->count; i++) {
+			route->points[i].time = route->points[i-1].time + distance(&route->points[i-1], &route->points[i]) / speed;
+		}
+	}
+
+	return 0;
+}
+
+/* position on the route at the given time, interpolated linearly between
+ * the surrounding points; *segment caches the search position */
+static void route_position(const struct route *route, double time, unsigned int *segment, double *lat, double *lon)
+{
+	unsigned int i = *segment;
+
+	while (i + 1 < route->count && route->points[i+1].time <= time) {
+		i++;
+	}
+	*segment = i;
+
+	const struct route_point *a = &route->points[i];
+	if (i + 1 >= route->count || route->points[i+1].time <= a->time) {
+		*lat = a->lat;
+		*lon = a->lon;
+		return;
+	}
+	const struct route_point *b = &route->points[i+1];
+	double f = (time - a->time) / (b->time - a->time);
+	double dlon = b->lon - a->lon;
+	/* take the short way across the antimeridian */
+	if (dlon > 180.0) {
+		dlon -= 360.0;
+	} else if (dlon < -180.0) {
+		dlon += 360.0;
+	}
+	*lat = a->lat + (b->lat - a->lat) * f;
+	*lon = a->lon + dlon * f;
+	if (*lon > 180.0) {
+		*lon -= 360.0;
+	} else if (*lon < -180.0) {
+		*lon += 360.0;
+	}
+}
+
+static int route_play(location_simulation_client_t client, const struct route *route, unsigned int interval, int loop)
+{
+	double duration = route->points[route->count-1].time;
+
+	printf("Playing %u points over %.1f seconds\n", route->count, duration);
+
+	do {
+		uint64_t start = time_ms();
+		unsigned int segment = 0;
+		uint64_t step;
+
+		for (step = 0; !quit_flag; step++) {
+			double t = (double)(step * interval) / 1000.0;
+			double lat, lon;
+			if (t > duration) {
+				t = duration;
+			}
+			route_position(route, t, &segment, &lat, &lon);
+			location_simulation_error_t err = location_simulation_set(client, lat, lon);
+			if (err != LOCATION_SIMULATION_E_SUCCESS) {
+				fprintf(stderr, "ERROR: Could not set location (%d)\n", err);
+				return -1;
+			}
+			if (t >= duration) {
+				break;
+			}
+			uint64_t next = start + (step + 1) * interval;
+			uint64_t now = time_ms();
+			if (next > now) {
+				sleep_ms((unsigned int)(next - now));
+			}
+		}
+	} while (loop && !quit_flag);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int c = 0;
 	const struct option longopts[] = {
-		{ "help",    no_argument,       NULL, 'h' },
-		{ "udid",    required_argument, NULL, 'u' },
-		{ "debug",   no_argument,       NULL, 'd' },
-		{ "network", no_argument,       NULL, 'n' },
-		{ "version", no_argument,       NULL, 'v' },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ "udid",     required_argument, NULL, 'u' },
+		{ "debug",    no_argument,       NULL, 'd' },
+		{ "network",  no_argument,       NULL, 'n' },
+		{ "route",    required_argument, NULL, 'r' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "speed",    required_argument, NULL, 's' },
+		{ "loop",     no_argument,       NULL, 'l' },
+		{ "version",  no_argument,       NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
 	uint32_t mode = 0;
 	const char *udid = NULL;
 	int use_network = 0;
+	const char *route_file = NULL;
+	unsigned int interval = 1000;
+	double speed = 10.0;
+	int loop = 0;
+	double lat = 0, lon = 0;
+	struct route route;
+	char *end = NULL;
+	int res = 0;
+
+	memset(&route, '\0', sizeof(route));
 
-	while ((c = getopt_long(argc, argv, "dhu:nv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:nr:i:s:lv", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -95,6 +496,26 @@ int main(int argc, char **argv)
 		case 'n':
 			use_network = 1;
 			break;
+		case 'r':
+			route_file = optarg;
+			break;
+		case 'i':
+			interval = (unsigned int)strtoul(optarg, NULL, 10);
+			if (interval == 0) {
+				fprintf(stderr, "ERROR: Invalid interval '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 's':
+			speed = strtod(optarg, &end);
+			if (end == optarg || speed <= 0) {
+				fprintf(stderr, "ERROR: Invalid speed '%s'\n", optarg);
+				return 2;
+			}
+			break;
+		case 'l':
+			loop = 1;
+			break;
 		case 'h':
 			print_usage(argc, argv, 0);
 			return 0;
@@ -110,13 +531,27 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if ((argc > 2) || (argc < 1)) {
+	if (route_file) {
+		if (argc != 0) {
+			print_usage(argc+optind, argv-optind, 1);
+			return -1;
+		}
+		mode = PLAY_ROUTE;
+	} else if ((argc > 2) || (argc < 1)) {
 		print_usage(argc+optind, argv-optind, 1);
 		return -1;
-	}
-
-	if (argc == 2) {
+	} else if (argc == 2) {
 		mode = SET_LOCATION;
+		lat = strtod(argv[0], &end);
+		if (end == argv[0] || *end != '\0') {
+			fprintf(stderr, "ERROR: Invalid latitude '%s'\n", argv[0]);
+			return -1;
+		}
+		lon = strtod(argv[1], &end);
+		if (end == argv[1] || *end != '\0') {
+			fprintf(stderr, "ERROR: Invalid longitude '%s'\n", argv[1]);
+			return -1;
+		}
 	} else if (argc == 1) {
 		if (strcmp(argv[0], "reset") == 0) {
 			mode = RESET_LOCATION;
@@ -126,6 +561,11 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (mode == PLAY_ROUTE && route_load(&route, route_file, speed) < 0) {
+		free(route.points);
+		return -1;
+	}
+
 	idevice_t device = NULL;
 
 	if (idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
@@ -134,57 +574,46 @@ int main(int argc, char **argv)
 		} else {
 			printf("ERROR: No device found!\n");
 		}
+		free(route.points);
 		return -1;
 	}
 
-	lockdownd_client_t lockdown;
-	lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME);
-
-	lockdownd_service_descriptor_t svc = NULL;
-	if (lockdownd_start_service(lockdown, DT_SIMULATELOCATION_SERVICE, &svc) != LOCKDOWN_E_SUCCESS) {
-		lockdownd_client_free(lockdown);
-		idevice_free(device);
-		printf("ERROR: Could not start the simulatelocation service. Make sure a developer disk image is mounted!\n");
-		return -1;
-	}
-	lockdownd_client_free(lockdown);
-
-	service_client_t service = NULL;
-
-	service_error_t serr = service_client_new(device, svc, &service);
-
-	lockdownd_service_descriptor_free(svc);
-
-	if (serr != SERVICE_E_SUCCESS) {
-		lockdownd_client_free(lockdown);
+	location_simulation_client_t client = NULL;
+	location_simulation_error_t err = location_simulation_client_start_service(device, &client, TOOL_NAME);
+	if (err != LOCATION_SIMULATION_E_SUCCESS) {
 		idevice_free(device);
-		printf("ERROR: Could not connect to simulatelocation service (%d)\n", serr);
+		free(route.points);
+		printf("ERROR: Could not start the simulatelocation service (%d). Make sure a developer disk image is mounted!\n", err);
 		return -1;
 	}
 
-	uint32_t l;
-	uint32_t s = 0;
-
-	l = htobe32(mode);
-	service_send(service, (const char*)&l, 4, &s);
-	if (mode == SET_LOCATION) {
-		int len = 4 + strlen(argv[0]) + 4 + strlen(argv[1]);
-		char *buf = malloc(len);
-		uint32_t latlen;
-		latlen = strlen(argv[0]);
-		l = htobe32(latlen);
-		memcpy(buf, &l, 4);
-		memcpy(buf+4, argv[0], latlen);
-		uint32_t longlen = strlen(argv[1]);
-		l = htobe32(longlen);
-		memcpy(buf+4+latlen, &l, 4);
-		memcpy(buf+4+latlen+4, argv[1], longlen);
-
-		s = 0;
-		service_send(service, buf, len, &s);
+	switch (mode) {
+	case SET_LOCATION:
+		err = location_simulation_set(client, lat, lon);
+		if (err != LOCATION_SIMULATION_E_SUCCESS) {
+			printf("ERROR: Could not set location (%d)\n", err);
+			res = -1;
+		}
+		break;
+	case RESET_LOCATION:
+		err = location_simulation_stop(client);
+		if (err != LOCATION_SIMULATION_E_SUCCESS) {
+			printf("ERROR: Could not reset location (%d)\n", err);
+			res = -1;
+		}
+		break;
+	case PLAY_ROUTE:
+		signal(SIGINT, handle_signal);
+		signal(SIGTERM, handle_signal);
+		res = route_play(client, &route, interval, loop);
+		break;
+	default:
+		break;
 	}
 
+	location_simulation_client_free(client);
 	idevice_free(device);
+	free(route.points);
 
-	return 0;
+	return res;
 }
@@ -38,14 +38,26 @@
 #include <windows.h>
 #define sleep(x) Sleep(x*1000)
 #endif
+#ifdef HAVE_REGEX_H
+#include <regex.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <time.h>
+#include <stdint.h>
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/syslog_relay.h>
+#include "common/thread.h"
+#include "common/utils.h"
 
 static int quit_flag = 0;
 static int exit_on_disconnect = 0;
 static int use_colors = 0;
 static int show_device_name = 0;
+static int all_devices = 0;
+static char* output_dir = NULL;
 
 static char* udid = NULL;
 static char** proc_filters = NULL;
@@ -63,18 +75,74 @@ static int num_trigger_filters = 0;
 static char** untrigger_filters = NULL;
 static int num_untrigger_filters = 0;
 static int triggered = 0;
+static int use_regex = 0;
 
-static idevice_t device = NULL;
-static syslog_relay_client_t syslog = NULL;
+/**
+ * Matches a set of patterns against a string in a single pass. Plain
+ * substring patterns are compiled into an Aho-Corasick automaton, regular
+ * expressions are compiled once up front.
+ */
+struct filter_matcher {
+	int num_patterns;
+	unsigned char char_class[256];
+	int num_classes;
+	int num_states;
+	int *delta;
+	unsigned char *accept;
+#ifdef HAVE_REGEX_H
+	regex_t *regexes;
+#endif
+};
+
+static struct filter_matcher msg_matcher;
+static struct filter_matcher trigger_matcher;
+static struct filter_matcher untrigger_matcher;
+
+/**
+ * Writes the syslog to rotating segment files. Data is collected in blocks
+ * that are written as independent gzip members, so decompression can start
+ * at any block. Each segment has a sidecar index with one line per block:
+ * "<unix time> <compressed offset> <uncompressed offset>".
+ */
+struct syslog_archive {
+	char* prefix;
+	FILE* data;
+	FILE* index;
+	uint64_t segment_size;
+	uint64_t uncompressed_offset;
+	time_t segment_start;
+	char* block;
+	uint32_t block_len;
+	time_t block_time;
+};
+
+#define ARCHIVE_BLOCK_SIZE 65536
+#define ARCHIVE_BLOCK_INTERVAL 10
+
+static char* archive_dir = NULL;
+static uint64_t archive_max_size = 64*1024*1024;
+static unsigned int archive_max_age = 0;
+
+struct syslog_device {
+	char* udid;
+	idevice_t device;
+	syslog_relay_client_t syslog;
+	FILE* file;
+	struct syslog_archive* archive;
+	int triggered;
+	struct syslog_device* next;
+};
+
+static struct syslog_device* syslog_devices = NULL;
+
+/* serializes output of the capture threads of all devices */
+static mutex_t output_mutex;
+static FILE* cur_out = NULL;
 
 static const char QUIET_FILTER[] = "CircleJoinRequested|CommCenter|HeuristicInterpreter|MobileMail|PowerUIAgent|ProtectedCloudKeySyncing|SpringBoard|UserEventAgent|WirelessRadioManagerd|accessoryd|accountsd|aggregated|analyticsd|appstored|apsd|assetsd|assistant_service|backboardd|biometrickitd|bluetoothd|calaccessd|callservicesd|cloudd|com.apple.Safari.SafeBrowsing.Service|contextstored|corecaptured|coreduetd|corespeechd|cdpd|dasd|dataaccessd|distnoted|dprivacyd|duetexpertd|findmydeviced|fmfd|fmflocatord|gpsd|healthd|homed|identityservicesd|imagent|itunescloudd|itunesstored|kernel|locationd|maild|mDNSResponder|mediaremoted|mediaserverd|mobileassetd|nanoregistryd|nanotimekitcompaniond|navd|nsurlsessiond|passd|pasted|photoanalysisd|powerd|powerlogHelperd|ptpd|rapportd|remindd|routined|runningboardd|searchd|sharingd|suggestd|symptomsd|timed|thermalmonitord|useractivityd|vmd|wifid|wirelessproxd";
 
 static int use_network = 0;
 
-static char *line = NULL;
-static int line_buffer_size = 0;
-static int lp = 0;
-
 #ifdef WIN32
 static WORD COLOR_RESET = 0;
 static HANDLE h_stdout = INVALID_HANDLE_VALUE;
@@ -99,7 +167,7 @@ static HANDLE h_stdout = INVALID_HANDLE_VALUE;
 
 static void TEXT_COLOR(WORD attr)
 {
-	if (use_colors) {
+	if (use_colors && cur_out == stdout) {
 		SetConsoleTextAttribute(h_stdout, attr);
 	}
 }
@@ -124,7 +192,7 @@ static void TEXT_COLOR(WORD attr)
 #define COLOR_WHITE         "\e[1;37m"
 #define COLOR_DARK_WHITE    "\e[0;37m"
 
-#define TEXT_COLOR(x) if (use_colors) { fwrite(x, 1, sizeof(x)-1, stdout); }
+#define TEXT_COLOR(x) if (use_colors && cur_out == stdout) { fwrite(x, 1, sizeof(x)-1, stdout); }
 #endif
 
 static void add_filter(const char* filterstr)
@@ -171,241 +239,573 @@ static void add_filter(const char* filterstr)
 	}
 }
 
-static int find_char(char c, char** p, char* end)
+static void filter_matcher_free(struct filter_matcher *matcher)
 {
-	while ((**p != c) && (*p < end)) {
-		(*p)++;
+	free(matcher->delta);
+	free(matcher->accept);
+#ifdef HAVE_REGEX_H
+	if (matcher->regexes) {
+		int i;
+		for (i = 0; i < matcher->num_patterns; i++) {
+			regfree(&matcher->regexes[i]);
+		}
+		free(matcher->regexes);
 	}
-	return (**p == c);
+#endif
+	memset(matcher, '\0', sizeof(struct filter_matcher));
 }
 
-static void stop_logging(void);
+static int filter_matcher_add_state(struct filter_matcher *matcher)
+{
+	int *new_delta = realloc(matcher->delta, sizeof(int) * matcher->num_classes * (matcher->num_states+1));
+	unsigned char *new_accept = realloc(matcher->accept, matcher->num_states+1);
+	if (!new_delta || !new_accept) {
+		fprintf(stderr, "ERROR: realloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	matcher->delta = new_delta;
+	matcher->accept = new_accept;
+	int i;
+	for (i = 0; i < matcher->num_classes; i++) {
+		matcher->delta[matcher->num_states * matcher->num_classes + i] = -1;
+	}
+	matcher->accept[matcher->num_states] = 0;
+	return matcher->num_states++;
+}
 
-static void syslog_callback(char c, void *user_data)
+static int filter_matcher_compile(struct filter_matcher *matcher, char **patterns, int num_patterns)
 {
-	if (lp >= line_buffer_size-1) {
-		line_buffer_size+=1024;
-		char* _line = realloc(line, line_buffer_size);
-		if (!_line) {
-			fprintf(stderr, "ERROR: realloc failed\n");
+	int i;
+
+	memset(matcher, '\0', sizeof(struct filter_matcher));
+	matcher->num_patterns = num_patterns;
+	if (num_patterns == 0) {
+		return 0;
+	}
+
+	if (use_regex) {
+#ifdef HAVE_REGEX_H
+		matcher->regexes = calloc(num_patterns, sizeof(regex_t));
+		if (!matcher->regexes) {
+			fprintf(stderr, "ERROR: calloc() failed\n");
 			exit(EXIT_FAILURE);
 		}
-		line = _line;
+		for (i = 0; i < num_patterns; i++) {
+			int err = regcomp(&matcher->regexes[i], patterns[i], REG_EXTENDED | REG_NOSUB);
+			if (err != 0) {
+				char errbuf[256];
+				regerror(err, &matcher->regexes[i], errbuf, sizeof(errbuf));
+				fprintf(stderr, "ERROR: Invalid regular expression '%s': %s\n", patterns[i], errbuf);
+				matcher->num_patterns = i;
+				filter_matcher_free(matcher);
+				return -1;
+			}
+		}
+		return 0;
+#else
+		fprintf(stderr, "ERROR: Regular expressions are not supported on this platform\n");
+		return -1;
+#endif
+	}
+
+	/* map all bytes that occur in a pattern to their own class, all others to class 0 */
+	matcher->num_classes = 1;
+	for (i = 0; i < num_patterns; i++) {
+		const unsigned char *p = (const unsigned char*)patterns[i];
+		while (*p) {
+			if (matcher->char_class[*p] == 0) {
+				matcher->char_class[*p] = matcher->num_classes++;
+			}
+			p++;
+		}
+	}
+
+	/* build the trie */
+	filter_matcher_add_state(matcher);
+	for (i = 0; i < num_patterns; i++) {
+		const unsigned char *p = (const unsigned char*)patterns[i];
+		int state = 0;
+		while (*p) {
+			int idx = state * matcher->num_classes + matcher->char_class[*p];
+			if (matcher->delta[idx] < 0) {
+				int next = filter_matcher_add_state(matcher);
+				matcher->delta[idx] = next;
+			}
+			state = matcher->delta[idx];
+			p++;
+		}
+		matcher->accept[state] = 1;
+	}
+
+	/* turn the trie into a DFA by resolving failure links breadth first */
+	int *fail = malloc(sizeof(int) * matcher->num_states);
+	int *queue = malloc(sizeof(int) * matcher->num_states);
+	if (!fail || !queue) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	int head = 0;
+	int tail = 0;
+	for (i = 0; i < matcher->num_classes; i++) {
+		int next = matcher->delta[i];
+		if (next < 0) {
+			matcher->delta[i] = 0;
+		} else {
+			fail[next] = 0;
+			queue[tail++] = next;
+		}
+	}
+	while (head < tail) {
+		int state = queue[head++];
+		matcher->accept[state] |= matcher->accept[fail[state]];
+		for (i = 0; i < matcher->num_classes; i++) {
+			int idx = state * matcher->num_classes + i;
+			int fallback = matcher->delta[fail[state] * matcher->num_classes + i];
+			int next = matcher->delta[idx];
+			if (next < 0) {
+				matcher->delta[idx] = fallback;
+			} else {
+				fail[next] = fallback;
+				queue[tail++] = next;
+			}
+		}
+	}
+	free(fail);
+	free(queue);
+
+	return 0;
+}
+
+static int filter_matcher_match(const struct filter_matcher *matcher, const char *str)
+{
+#ifdef HAVE_REGEX_H
+	if (matcher->regexes) {
+		int i;
+		for (i = 0; i < matcher->num_patterns; i++) {
+			if (regexec(&matcher->regexes[i], str, 0, NULL, 0) == 0) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+#endif
+	if (!matcher->delta) {
+		return 0;
+	}
+	const unsigned char *p = (const unsigned char*)str;
+	int state = 0;
+	while (*p) {
+		state = matcher->delta[state * matcher->num_classes + matcher->char_class[*p]];
+		if (matcher->accept[state]) {
+			return 1;
+		}
+		p++;
+	}
+	return 0;
+}
+
+static int proc_filter_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Checks if any process filter starts with the given process name, using
+ * a binary search on the sorted process filter list.
+ */
+static int proc_filters_match(const char *name, size_t len)
+{
+	int lo = 0;
+	int hi = num_proc_filters;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		int cmp = strncmp(proc_filters[mid], name, len);
+		if (cmp == 0) {
+			return 1;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-	line[lp++] = c;
-	if (c == '\0') {
-		int shall_print = 0;
-		int trigger_off = 0;
-		lp--;
-		char* linep = &line[0];
-		do {
-			if (lp < 16) {
+	return 0;
+}
+
+enum {
+	LINE_SKIP = 0,
+	LINE_PLAIN,
+	LINE_FORMATTED
+};
+
+/**
+ * Applies all filters to a line.
+ *
+ * @return LINE_SKIP if the line shall not be printed, LINE_FORMATTED if it
+ *     shall be printed with a formatted header, LINE_PLAIN otherwise.
+ */
+static int syslog_filter_line(struct syslog_device* dev, const syslog_relay_line_t *entry, int *trigger_off)
+{
+	int shall_print = 0;
+	int formatted = 0;
+	do {
+		if (!entry->timestamp) {
+			shall_print = 1;
+			break;
+		} else if (!entry->host) {
+			break;
+		}
+
+		/* everything after the device name */
+		const char* rest = entry->host + entry->host_length + 1;
+
+		/* check if we have any triggers/untriggers */
+		if (num_untrigger_filters > 0 && dev->triggered) {
+			int found = filter_matcher_match(&untrigger_matcher, rest);
+			if (!found) {
+				shall_print = 1;
+			} else {
 				shall_print = 1;
-				TEXT_COLOR(COLOR_WHITE);
+				*trigger_off = 1;
+			}
+		} else if (num_trigger_filters > 0 && !dev->triggered) {
+			int found = filter_matcher_match(&trigger_matcher, rest);
+			if (!found) {
+				shall_print = 0;
 				break;
-			} else if (line[3] == ' ' && line[6] == ' ' && line[15] == ' ') {
-				char* end = &line[lp];
-				char* p = &line[16];
-
-				/* device name */
-				char* device_name_start = p;
-				char* device_name_end = p;
-				if (!find_char(' ', &p, end)) break;
-				device_name_end = p;
-				p++;
-
-				/* check if we have any triggers/untriggers */
-				if (num_untrigger_filters > 0 && triggered) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_untrigger_filters; i++) {
-						if (strstr(device_name_end+1, untrigger_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 1;
-					} else {
-						shall_print = 1;
-						trigger_off = 1;
-					}
-				} else if (num_trigger_filters > 0 && !triggered) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_trigger_filters; i++) {
-						if (strstr(device_name_end+1, trigger_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 0;
-						break;
-					} else {
-						triggered = 1;
-						shall_print = 1;
-					}
-				} else if (num_trigger_filters == 0 && num_untrigger_filters > 0 && !triggered) {
-					shall_print = 0;
-					quit_flag++;
+			} else {
+				dev->triggered = 1;
+				shall_print = 1;
+			}
+		} else if (num_trigger_filters == 0 && num_untrigger_filters > 0 && !dev->triggered) {
+			shall_print = 0;
+			quit_flag++;
+			break;
+		}
+
+		/* check message filters */
+		if (num_msg_filters > 0) {
+			int found = filter_matcher_match(&msg_matcher, rest);
+			if (!found) {
+				shall_print = 0;
+				break;
+			} else {
+				shall_print = 1;
+			}
+		}
+
+		if (!entry->process) break;
+
+		int proc_matched = 0;
+		if (num_pid_filters > 0 && entry->pid >= 0) {
+			int found = proc_filter_excluding;
+			int i = 0;
+			for (i = 0; i < num_pid_filters; i++) {
+				if (entry->pid == pid_filters[i]) {
+					found = !proc_filter_excluding;
 					break;
 				}
+			}
+			if (found) {
+				proc_matched = 1;
+			}
+		}
+		if (num_proc_filters > 0 && !proc_matched) {
+			int found = proc_filters_match(entry->process, entry->process_length) ? !proc_filter_excluding : proc_filter_excluding;
+			if (found) {
+				proc_matched = 1;
+			}
+		}
+		if (!proc_matched && (num_pid_filters > 0 || num_proc_filters > 0)) {
+			shall_print = 0;
+			break;
+		}
 
-				/* check message filters */
-				if (num_msg_filters > 0) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_msg_filters; i++) {
-						if (strstr(device_name_end+1, msg_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 0;
-						break;
-					} else {
-						shall_print = 1;
-					}
-				}
+		/* the line passed all filters */
+		shall_print = 1;
+		formatted = 1;
+	} while (0);
 
-				/* process name */
-				char* proc_name_start = p;
-				char* proc_name_end = p;
-				if (!find_char('[', &p, end)) break;
-				char* process_name_start = proc_name_start;
-				char* process_name_end = p;
-				char* pid_start = p+1;
-				char* pp = process_name_start;
-				if (find_char('(', &pp, p)) {
-					process_name_end = pp;
-				}
-				if (!find_char(']', &p, end)) break;
-				p++;
-				if (*p != ' ') break;
-				proc_name_end = p;
-				p++;
-
-				int proc_matched = 0;
-				if (num_pid_filters > 0) {
-					char* endp = NULL;
-					int pid_value = (int)strtol(pid_start, &endp, 10);
-					if (endp && (*endp == ']')) {
-						int found = proc_filter_excluding;
-						int i = 0;
-						for (i = 0; i < num_pid_filters; i++) {
-							if (pid_value == pid_filters[i]) {
-								found = !proc_filter_excluding;
-								break;
-							}
-						}
-						if (found) {
-							proc_matched = 1;
-						}
-					}
-				}
-				if (num_proc_filters > 0 && !proc_matched) {
-					int found = proc_filter_excluding;
-					int i = 0;
-					for (i = 0; i < num_proc_filters; i++) {
-						if (!proc_filters[i]) continue;
-						if (strncmp(proc_filters[i], process_name_start, process_name_end-process_name_start) == 0) {
-							found = !proc_filter_excluding;
-							break;
-						}
-					}
-					if (found) {
-						proc_matched = 1;
-					}
-				}
-				if (proc_matched) {
-					shall_print = 1;
-				} else {
-					if (num_pid_filters > 0 || num_proc_filters > 0) {
-						shall_print = 0;
-						break;
-					}
-				}
+	if ((num_msg_filters == 0 && num_proc_filters == 0 && num_pid_filters == 0 && num_trigger_filters == 0 && num_untrigger_filters == 0) || shall_print) {
+		return (formatted) ? LINE_FORMATTED : LINE_PLAIN;
+	}
+	return LINE_SKIP;
+}
+
+/**
+ * Writes a line to the given stream. Must be called with output_mutex held.
+ */
+static void syslog_print_line(FILE* out, const char* prefix, const syslog_relay_line_t *entry, int formatted)
+{
+	cur_out = out;
+
+	if (prefix) {
+		TEXT_COLOR(COLOR_DARK_YELLOW);
+		fprintf(out, "[%s] ", prefix);
+	}
+
+	if (!formatted) {
+		TEXT_COLOR(COLOR_WHITE);
+		fwrite(entry->line, 1, entry->line_length, out);
+		TEXT_COLOR(COLOR_RESET);
+		fflush(out);
+		return;
+	}
 
-				/* log level */
-				char* level_start = p;
-				char* level_end = p;
+	/* log level */
 #ifdef WIN32
-				WORD level_color = COLOR_NORMAL;
+	WORD level_color = COLOR_NORMAL;
 #else
-				const char* level_color = NULL;
+	const char* level_color = NULL;
 #endif
-				if (!strncmp(p, "<Notice>:", 9)) {
-					level_end += 9;
-					level_color = COLOR_GREEN;
-				} else if (!strncmp(p, "<Error>:", 8)) {
-					level_end += 8;
-					level_color = COLOR_RED;
-				} else if (!strncmp(p, "<Warning>:", 10)) {
-					level_end += 10;
-					level_color = COLOR_YELLOW;
-				} else if (!strncmp(p, "<Debug>:", 8)) {
-					level_end += 8;
-					level_color = COLOR_MAGENTA;
-				} else {
-					level_color = COLOR_WHITE;
-				}
+	switch (entry->level) {
+	case SYSLOG_RELAY_LEVEL_NOTICE:
+		level_color = COLOR_GREEN;
+		break;
+	case SYSLOG_RELAY_LEVEL_ERROR:
+		level_color = COLOR_RED;
+		break;
+	case SYSLOG_RELAY_LEVEL_WARNING:
+		level_color = COLOR_YELLOW;
+		break;
+	case SYSLOG_RELAY_LEVEL_DEBUG:
+		level_color = COLOR_MAGENTA;
+		break;
+	default:
+		level_color = COLOR_WHITE;
+		break;
+	}
 
-				/* write date and time */
-				TEXT_COLOR(COLOR_DARK_WHITE);
-				fwrite(line, 1, 16, stdout);
+	/* write date and time */
+	TEXT_COLOR(COLOR_DARK_WHITE);
+	fwrite(entry->timestamp, 1, entry->timestamp_length+1, out);
 
-				if (show_device_name) {
-					/* write device name */
-					TEXT_COLOR(COLOR_DARK_YELLOW);
-					fwrite(device_name_start, 1, device_name_end-device_name_start+1, stdout);
-					TEXT_COLOR(COLOR_RESET);
-				}
+	if (show_device_name) {
+		/* write device name */
+		TEXT_COLOR(COLOR_DARK_YELLOW);
+		fwrite(entry->host, 1, entry->host_length+1, out);
+		TEXT_COLOR(COLOR_RESET);
+	}
 
-				/* write process name */
-				TEXT_COLOR(COLOR_BRIGHT_CYAN);
-				fwrite(process_name_start, 1, process_name_end-process_name_start, stdout);
-				TEXT_COLOR(COLOR_CYAN);
-				fwrite(process_name_end, 1, proc_name_end-process_name_end+1, stdout);
-
-				/* write log level */
-				TEXT_COLOR(level_color);
-				if (level_end > level_start) {
-					fwrite(level_start, 1, level_end-level_start, stdout);
-					p = level_end;
-				}
+	/* write process name */
+	const char* process_name_end = entry->process + entry->process_length;
+	const char* header_end = (entry->level_tag) ? entry->level_tag : entry->message;
+	TEXT_COLOR(COLOR_BRIGHT_CYAN);
+	fwrite(entry->process, 1, entry->process_length, out);
+	TEXT_COLOR(COLOR_CYAN);
+	fwrite(process_name_end, 1, header_end-process_name_end, out);
+
+	/* write log level */
+	TEXT_COLOR(level_color);
+	if (entry->level_tag) {
+		fwrite(entry->level_tag, 1, entry->level_tag_length, out);
+	}
 
-				lp -= p - linep;
-				linep = p;
+	/* write message */
+	TEXT_COLOR(COLOR_WHITE);
+	fwrite(entry->message, 1, entry->message_length, out);
+	TEXT_COLOR(COLOR_RESET);
+	fflush(out);
+}
 
-				TEXT_COLOR(COLOR_WHITE);
+static struct syslog_archive* archive_new(const char* device_udid)
+{
+	struct syslog_archive* archive = (struct syslog_archive*)calloc(1, sizeof(struct syslog_archive));
+	if (!archive) {
+		return NULL;
+	}
+	archive->prefix = string_build_path(archive_dir, device_udid, NULL);
+	archive->block = (char*)malloc(ARCHIVE_BLOCK_SIZE);
+	if (!archive->prefix || !archive->block) {
+		free(archive->prefix);
+		free(archive->block);
+		free(archive);
+		return NULL;
+	}
+	return archive;
+}
+
+static int archive_open_segment(struct syslog_archive* archive)
+{
+	char stamp[32];
+	time_t now = time(NULL);
+	struct tm* tm = localtime(&now);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", tm);
+#ifdef HAVE_ZLIB
+	char* path = string_concat(archive->prefix, "-", stamp, ".log.gz", NULL);
+#else
+	char* path = string_concat(archive->prefix, "-", stamp, ".log", NULL);
+#endif
+	char* index_path = string_concat(path, ".idx", NULL);
+
+	archive->data = fopen(path, "wb");
+	archive->index = fopen(index_path, "w");
+	if (!archive->data || !archive->index) {
+		fprintf(stderr, "ERROR: Could not create archive segment %s: %s\n", path, strerror(errno));
+		if (archive->data) {
+			fclose(archive->data);
+			archive->data = NULL;
+		}
+		if (archive->index) {
+			fclose(archive->index);
+			archive->index = NULL;
+		}
+		free(index_path);
+		free(path);
+		return -1;
+	}
+	free(index_path);
+	free(path);
+
+	archive->segment_size = 0;
+	archive->uncompressed_offset = 0;
+	archive->segment_start = now;
+	return 0;
+}
+
+static void archive_close_segment(struct syslog_archive* archive)
+{
+	if (archive->data) {
+		fclose(archive->data);
+		archive->data = NULL;
+	}
+	if (archive->index) {
+		fclose(archive->index);
+		archive->index = NULL;
+	}
+}
+
+static void archive_flush_block(struct syslog_archive* archive)
+{
+	if (archive->block_len == 0) {
+		return;
+	}
+	if (!archive->data && archive_open_segment(archive) < 0) {
+		archive->block_len = 0;
+		return;
+	}
 
+	const char* out = archive->block;
+	uint32_t out_len = archive->block_len;
+#ifdef HAVE_ZLIB
+	char* compressed = NULL;
+	z_stream zs;
+	memset(&zs, '\0', sizeof(zs));
+	/* window bits 15 + 16 to write a gzip header */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+		uLong bound = deflateBound(&zs, archive->block_len);
+		compressed = (char*)malloc(bound);
+		if (compressed) {
+			zs.next_in = (Bytef*)archive->block;
+			zs.avail_in = archive->block_len;
+			zs.next_out = (Bytef*)compressed;
+			zs.avail_out = bound;
+			if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+				out = compressed;
+				out_len = zs.total_out;
 			} else {
-				shall_print = 1;
-				TEXT_COLOR(COLOR_WHITE);
+				free(compressed);
+				compressed = NULL;
 			}
-		} while (0);
+		}
+		deflateEnd(&zs);
+	}
+	if (!compressed) {
+		fprintf(stderr, "ERROR: Failed to compress archive block\n");
+		archive->block_len = 0;
+		return;
+	}
+#endif
 
-		if ((num_msg_filters == 0 && num_proc_filters == 0 && num_pid_filters == 0 && num_trigger_filters == 0 && num_untrigger_filters == 0) || shall_print) {
-			fwrite(linep, 1, lp, stdout);
-			TEXT_COLOR(COLOR_RESET);
-			fflush(stdout);
-			if (trigger_off) {
-				triggered = 0;
+	fprintf(archive->index, "%lld %llu %llu\n", (long long)archive->block_time, (unsigned long long)archive->segment_size, (unsigned long long)archive->uncompressed_offset);
+	fwrite(out, 1, out_len, archive->data);
+	fflush(archive->data);
+	fflush(archive->index);
+	archive->segment_size += out_len;
+	archive->uncompressed_offset += archive->block_len;
+	archive->block_len = 0;
+#ifdef HAVE_ZLIB
+	free(compressed);
+#endif
+}
+
+static void archive_write(struct syslog_archive* archive, const char* data, uint32_t length)
+{
+	time_t now = time(NULL);
+
+	while (length > 0) {
+		if (archive->block_len > 0 && (archive->block_len == ARCHIVE_BLOCK_SIZE || now - archive->block_time >= ARCHIVE_BLOCK_INTERVAL)) {
+			archive_flush_block(archive);
+		}
+		if (archive->block_len == 0) {
+			/* rotate segment if needed */
+			if (archive->data && (archive->segment_size >= archive_max_size || (archive_max_age > 0 && now - archive->segment_start >= archive_max_age))) {
+				archive_close_segment(archive);
 			}
+			archive->block_time = now;
+		}
+		uint32_t n = ARCHIVE_BLOCK_SIZE - archive->block_len;
+		if (n > length) {
+			n = length;
 		}
-		line[0] = '\0';
-		lp = 0;
+		memcpy(archive->block + archive->block_len, data, n);
+		archive->block_len += n;
+		data += n;
+		length -= n;
+	}
+}
+
+static void archive_free(struct syslog_archive* archive)
+{
+	if (!archive) {
 		return;
 	}
+	archive_flush_block(archive);
+	archive_close_segment(archive);
+	free(archive->block);
+	free(archive->prefix);
+	free(archive);
+}
+
+static void syslog_callback(const syslog_relay_line_t *entry, void *user_data)
+{
+	struct syslog_device* dev = (struct syslog_device*)user_data;
+	int trigger_off = 0;
+
+	mutex_lock(&output_mutex);
+	int res = syslog_filter_line(dev, entry, &trigger_off);
+	if (res != LINE_SKIP) {
+		syslog_print_line(stdout, (all_devices) ? dev->udid : NULL, entry, res == LINE_FORMATTED);
+		if (dev->file) {
+			syslog_print_line(dev->file, NULL, entry, res == LINE_FORMATTED);
+		}
+		if (dev->archive) {
+			archive_write(dev->archive, entry->line, entry->line_length);
+		}
+		if (trigger_off) {
+			dev->triggered = 0;
+		}
+	}
+	mutex_unlock(&output_mutex);
+}
+
+static struct syslog_device* find_syslog_device(const char* device_udid)
+{
+	struct syslog_device* dev = syslog_devices;
+	while (dev) {
+		if (strcmp(dev->udid, device_udid) == 0) {
+			return dev;
+		}
+		dev = dev->next;
+	}
+	return NULL;
 }
 
-static int start_logging(void)
+static int start_logging(const char* device_udid)
 {
-	idevice_error_t ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
+	idevice_t device = NULL;
+	idevice_error_t ret = idevice_new_with_options(&device, device_udid, (use_network) ? IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
-		fprintf(stderr, "Device with udid %s not found!?\n", udid);
+		fprintf(stderr, "Device with udid %s not found!?\n", device_udid);
 		return -1;
 	}
 
@@ -414,7 +814,6 @@ static int start_logging(void)
 	if (lerr != LOCKDOWN_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Could not connect to lockdownd: %d\n", lerr);
 		idevice_free(device);
-		device = NULL;
 		return -1;
 	}
 
@@ -422,7 +821,7 @@ static int start_logging(void)
 	lockdownd_service_descriptor_t svc = NULL;
 	lerr = lockdownd_start_service(lockdown, SYSLOG_RELAY_SERVICE_NAME, &svc);
 	if (lerr == LOCKDOWN_E_PASSWORD_PROTECTED) {
-		fprintf(stderr, "*** Device is passcode protected, enter passcode on the device to continue ***\n");
+		fprintf(stderr, "*** Device %s is passcode protected, enter passcode on the device to continue ***\n", device_udid);
 		while (!quit_flag) {
 			lerr = lockdownd_start_service(lockdown, SYSLOG_RELAY_SERVICE_NAME, &svc);
 			if (lerr != LOCKDOWN_E_PASSWORD_PROTECTED) {
@@ -433,53 +832,105 @@ static int start_logging(void)
 	}
 	if (lerr != LOCKDOWN_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Could not connect to lockdownd: %d\n", lerr);
+		lockdownd_client_free(lockdown);
 		idevice_free(device);
-		device = NULL;
 		return -1;
 	}
 	lockdownd_client_free(lockdown);
 
+	struct syslog_device* dev = (struct syslog_device*)calloc(1, sizeof(struct syslog_device));
+	if (!dev) {
+		fprintf(stderr, "ERROR: calloc() failed\n");
+		lockdownd_service_descriptor_free(svc);
+		idevice_free(device);
+		return -1;
+	}
+	dev->udid = strdup(device_udid);
+	dev->device = device;
+	dev->triggered = triggered;
+
+	if (output_dir) {
+		char* filename = string_concat(dev->udid, ".log", NULL);
+		char* path = string_build_path(output_dir, filename, NULL);
+		dev->file = fopen(path, "a");
+		if (!dev->file) {
+			fprintf(stderr, "ERROR: Could not open %s for writing: %s\n", path, strerror(errno));
+		}
+		free(path);
+		free(filename);
+	}
+
+	if (archive_dir) {
+		dev->archive = archive_new(dev->udid);
+		if (!dev->archive) {
+			fprintf(stderr, "ERROR: Could not set up syslog archive for %s\n", dev->udid);
+		}
+	}
+
 	/* connect to syslog_relay service */
 	syslog_relay_error_t serr = SYSLOG_RELAY_E_UNKNOWN_ERROR;
-	serr = syslog_relay_client_new(device, svc, &syslog);
+	serr = syslog_relay_client_new(device, svc, &dev->syslog);
 	lockdownd_service_descriptor_free(svc);
 	if (serr != SYSLOG_RELAY_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Could not start service com.apple.syslog_relay.\n");
-		idevice_free(device);
-		device = NULL;
-		return -1;
+		goto error;
 	}
 
 	/* start capturing syslog */
-	serr = syslog_relay_start_capture_raw(syslog, syslog_callback, NULL);
+	serr = syslog_relay_start_capture_lines(dev->syslog, syslog_callback, dev);
 	if (serr != SYSLOG_RELAY_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Unable tot start capturing syslog.\n");
-		syslog_relay_client_free(syslog);
-		syslog = NULL;
-		idevice_free(device);
-		device = NULL;
-		return -1;
+		goto error;
 	}
 
-	fprintf(stdout, "[connected:%s]\n", udid);
+	dev->next = syslog_devices;
+	syslog_devices = dev;
+
+	mutex_lock(&output_mutex);
+	fprintf(stdout, "[connected:%s]\n", dev->udid);
 	fflush(stdout);
+	mutex_unlock(&output_mutex);
 
 	return 0;
+
+error:
+	if (dev->syslog) {
+		syslog_relay_client_free(dev->syslog);
+	}
+	if (dev->file) {
+		fclose(dev->file);
+	}
+	archive_free(dev->archive);
+	idevice_free(dev->device);
+	free(dev->udid);
+	free(dev);
+	return -1;
 }
 
-static void stop_logging(void)
+static void stop_logging(struct syslog_device* dev)
 {
-	fflush(stdout);
-
-	if (syslog) {
-		syslog_relay_client_free(syslog);
-		syslog = NULL;
+	struct syslog_device** pdev = &syslog_devices;
+	while (*pdev && *pdev != dev) {
+		pdev = &(*pdev)->next;
+	}
+	if (*pdev) {
+		*pdev = dev->next;
 	}
 
-	if (device) {
-		idevice_free(device);
-		device = NULL;
+	/* this waits for the capture thread, so output_mutex must not be held */
+	syslog_relay_client_free(dev->syslog);
+	idevice_free(dev->device);
+
+	mutex_lock(&output_mutex);
+	fflush(stdout);
+	if (dev->file) {
+		fclose(dev->file);
 	}
+	archive_free(dev->archive);
+	mutex_unlock(&output_mutex);
+
+	free(dev->udid);
+	free(dev);
 }
 
 static void device_event_cb(const idevice_event_t* event, void* userdata)
@@ -490,21 +941,28 @@ static void device_event_cb(const idevice_event_t* event, void* userdata)
 		return;
 	}
 	if (event->event == IDEVICE_DEVICE_ADD) {
-		if (!syslog) {
+		if (!all_devices) {
 			if (!udid) {
 				udid = strdup(event->udid);
 			}
-			if (strcmp(udid, event->udid) == 0) {
-				if (start_logging() != 0) {
-					fprintf(stderr, "Could not start logger for udid %s\n", udid);
-				}
+			if (strcmp(udid, event->udid) != 0) {
+				return;
+			}
+		}
+		if (!find_syslog_device(event->udid)) {
+			if (start_logging(event->udid) != 0) {
+				fprintf(stderr, "Could not start logger for udid %s\n", event->udid);
 			}
 		}
 	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
-		if (syslog && (strcmp(udid, event->udid) == 0)) {
-			stop_logging();
-			fprintf(stdout, "[disconnected:%s]\n", udid);
-			if (exit_on_disconnect) {
+		struct syslog_device* dev = find_syslog_device(event->udid);
+		if (dev) {
+			stop_logging(dev);
+			mutex_lock(&output_mutex);
+			fprintf(stdout, "[disconnected:%s]\n", event->udid);
+			fflush(stdout);
+			mutex_unlock(&output_mutex);
+			if (exit_on_disconnect && !syslog_devices) {
 				quit_flag++;
 			}
 		}
@@ -532,6 +990,14 @@ static void print_usage(int argc, char **argv, int is_error)
 		"OPTIONS:\n" \
 		"  -u, --udid UDID  target specific device by UDID\n" \
 		"  -n, --network    connect to network device\n" \
+		"  -a, --all        relay syslog of all connected devices, prefixing each\n" \
+		"                   line with the UDID of the device\n" \
+		"  -o, --output-dir DIR  additionally write the syslog of each device to\n" \
+		"                   DIR/UDID.log\n" \
+		"  --archive DIR    write the syslog to rotating, compressed segment files\n" \
+		"                   with a time index in DIR\n" \
+		"  --archive-size SIZE  rotate archive segments after SIZE MB (default 64)\n" \
+		"  --archive-age SECONDS  rotate archive segments after SECONDS\n" \
 		"  -x, --exit       exit when device disconnects\n" \
 		"  -h, --help       prints usage information\n" \
 		"  -d, --debug      enable communication debugging\n" \
@@ -542,6 +1008,8 @@ static void print_usage(int argc, char **argv, int is_error)
 		"  -m, --match STRING      only print messages that contain STRING\n" \
 		"  -t, --trigger STRING    start logging when matching STRING\n" \
 		"  -T, --untrigger STRING  stop logging when matching STRING\n" \
+		"  --regex                 treat STRING of -m, -t and -T as extended regular\n" \
+		"                          expression\n" \
 		"  -p, --process PROCESS   only print messages from matching process(es)\n" \
 		"  -e, --exclude PROCESS   print all messages except matching process(es)\n" \
 		"                          PROCESS is a process name or multiple process names\n" \
@@ -578,6 +1046,8 @@ int main(int argc, char *argv[])
 		{ "help", no_argument, NULL, 'h' },
 		{ "udid", required_argument, NULL, 'u' },
 		{ "network", no_argument, NULL, 'n' },
+		{ "all", no_argument, NULL, 'a' },
+		{ "output-dir", required_argument, NULL, 'o' },
 		{ "exit", no_argument, NULL, 'x' },
 		{ "trigger", required_argument, NULL, 't' },
 		{ "untrigger", required_argument, NULL, 'T' },
@@ -589,6 +1059,10 @@ int main(int argc, char *argv[])
 		{ "no-kernel", no_argument, NULL, 'K' },
 		{ "quiet-list", no_argument, NULL, 1 },
 		{ "no-colors", no_argument, NULL, 2 },
+		{ "regex", no_argument, NULL, 3 },
+		{ "archive", required_argument, NULL, 4 },
+		{ "archive-size", required_argument, NULL, 5 },
+		{ "archive-age", required_argument, NULL, 6 },
 		{ "version", no_argument, NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
@@ -600,7 +1074,7 @@ int main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	while ((c = getopt_long(argc, argv, "dhu:nxt:T:m:e:p:qkKv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:nao:xt:T:m:e:p:qkKv", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -617,6 +1091,18 @@ int main(int argc, char *argv[])
 		case 'n':
 			use_network = 1;
 			break;
+		case 'a':
+			all_devices = 1;
+			break;
+		case 'o':
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: output directory must not be empty!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			free(output_dir);
+			output_dir = strdup(optarg);
+			break;
 		case 'q':
 			exclude_filter++;
 			add_filter(QUIET_FILTER);
@@ -702,6 +1188,40 @@ int main(int argc, char *argv[])
 		case 2:
 			no_colors = 1;
 			break;
+		case 3:
+			use_regex = 1;
+			break;
+		case 4:
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: archive directory must not be empty!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			free(archive_dir);
+			archive_dir = strdup(optarg);
+			break;
+		case 5: {
+			char* endp = NULL;
+			unsigned long size = strtoul(optarg, &endp, 10);
+			if (!endp || *endp != '\0' || size == 0) {
+				fprintf(stderr, "ERROR: invalid archive size '%s'\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			archive_max_size = (uint64_t)size * 1024 * 1024;
+			break;
+		}
+		case 6: {
+			char* endp = NULL;
+			unsigned long age = strtoul(optarg, &endp, 10);
+			if (!endp || *endp != '\0') {
+				fprintf(stderr, "ERROR: invalid archive age '%s'\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			archive_max_age = (unsigned int)age;
+			break;
+		}
 		case 'v':
 			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
 			return 0;
@@ -711,6 +1231,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (all_devices && udid) {
+		fprintf(stderr, "ERROR: -a and -u cannot be used together.\n");
+		print_usage(argc, argv, 1);
+		return 2;
+	}
+
 	if (include_kernel > 0 && exclude_kernel > 0) {
 		fprintf(stderr, "ERROR: -k and -K cannot be used together.\n");
 		print_usage(argc, argv, 1);
@@ -753,6 +1279,31 @@ int main(int argc, char *argv[])
 		triggered = 1;
 	}
 
+	/* drop removed process filters and sort the rest for lookup */
+	if (num_proc_filters > 0) {
+		int num_valid = 0;
+		int i;
+		for (i = 0; i < num_proc_filters; i++) {
+			if (proc_filters[i]) {
+				proc_filters[num_valid++] = proc_filters[i];
+			}
+		}
+		if (num_valid == 0) {
+			free(proc_filters);
+			proc_filters = NULL;
+		}
+		num_proc_filters = num_valid;
+		if (num_proc_filters > 0) {
+			qsort(proc_filters, num_proc_filters, sizeof(char*), proc_filter_cmp);
+		}
+	}
+
+	if (filter_matcher_compile(&msg_matcher, msg_filters, num_msg_filters) < 0
+	    || filter_matcher_compile(&trigger_matcher, trigger_filters, num_trigger_filters) < 0
+	    || filter_matcher_compile(&untrigger_matcher, untrigger_filters, num_untrigger_filters) < 0) {
+		return 2;
+	}
+
 	argc -= optind;
 	argv += optind;
 
@@ -765,7 +1316,9 @@ int main(int argc, char *argv[])
 	idevice_get_device_list_extended(&devices, &num);
 	idevice_device_list_extended_free(devices);
 	if (num == 0) {
-		if (!udid) {
+		if (all_devices) {
+			fprintf(stderr, "Waiting for devices to become available...\n");
+		} else if (!udid) {
 			fprintf(stderr, "No device found. Plug in a device or pass UDID with -u to wait for device to be available.\n");
 			return -1;
 		} else {
@@ -773,8 +1326,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	line_buffer_size = 1024;
-	line = malloc(line_buffer_size);
+	mutex_init(&output_mutex);
 
 	idevice_event_subscribe(device_event_cb, NULL);
 
@@ -782,7 +1334,10 @@ int main(int argc, char *argv[])
 		sleep(1);
 	}
 	idevice_event_unsubscribe();
-	stop_logging();
+	while (syslog_devices) {
+		stop_logging(syslog_devices);
+	}
+	mutex_destroy(&output_mutex);
 
 	if (num_proc_filters > 0) {
 		int i;
@@ -815,10 +1370,13 @@ int main(int argc, char *argv[])
 		}
 		free(untrigger_filters);
 	}
-
-	free(line);
+	filter_matcher_free(&msg_matcher);
+	filter_matcher_free(&trigger_matcher);
+	filter_matcher_free(&untrigger_matcher);
 
 	free(udid);
+	free(output_dir);
+	free(archive_dir);
 
 	return 0;
 }